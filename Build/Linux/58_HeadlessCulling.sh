@@ -0,0 +1,31 @@
+#!/bin/sh
+# Builds and runs 58_HeadlessCulling with the headless application (no window, no GPU).
+# usage: Build/Linux/58_HeadlessCulling.sh [script]
+#
+# CXX selects the compiler (default: g++), HEADLESS_TIMINGS names the JSON file
+# with the frame timings (default: Bin/Linux/58_HeadlessCulling.json). With
+# CXXFLAGS=-DENABLE_PROFILER and PROFILER_TRACE=file a Chrome trace is written too.
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/../.." && pwd)
+SRC="$ROOT/ShaderTutors"
+OUT="$ROOT/Bin/Linux"
+
+mkdir -p "$OUT"
+
+${CXX:-g++} -O2 -std=c++17 -pthread $CXXFLAGS -I"$SRC/Common" \
+	"$SRC/58_HeadlessCulling/main.cpp" \
+	"$SRC/Common/3Dmath.cpp" \
+	"$SRC/Common/application.cpp" \
+	"$SRC/Common/basiccamera.cpp" \
+	"$SRC/Common/frustumculler.cpp" \
+	"$SRC/Common/headlessapplication.cpp" \
+	"$SRC/Common/pathtessellator.cpp" \
+	"$SRC/Common/profiler.cpp" \
+	"$SRC/Common/threadpool.cpp" \
+	-o "$OUT/58_HeadlessCulling"
+
+HEADLESS_SCRIPT="${1:-$ROOT/Build/Linux/58_HeadlessCulling.script}" \
+HEADLESS_TIMINGS="${HEADLESS_TIMINGS:-$OUT/58_HeadlessCulling.json}" \
+	"$OUT/58_HeadlessCulling"
@@ -0,0 +1,50 @@
+#!/bin/sh
+# Builds and runs the CPU checks of the Common modules (no window, no GPU).
+# usage: Build/Linux/59_HeadlessTests.sh [check [arguments]] [-threads N]
+#
+# Without a check every one runs with its defaults and the script fails if any
+# of them does. CXX selects the compiler (default: g++), CXXFLAGS is passed on.
+# OPENGL is defined as for the GL samples (-1..1 clip depth, see Common_GL.props).
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/../.." && pwd)
+SRC="$ROOT/ShaderTutors"
+OUT="$ROOT/Bin/Linux"
+
+mkdir -p "$OUT"
+
+${CXX:-g++} -O2 -std=c++17 -pthread -DOPENGL $CXXFLAGS -I"$SRC/Common" \
+	"$SRC/59_HeadlessTests/main.cpp" \
+	"$SRC/59_HeadlessTests/batchingtests.cpp" \
+	"$SRC/59_HeadlessTests/cullingtests.cpp" \
+	"$SRC/59_HeadlessTests/jobtests.cpp" \
+	"$SRC/59_HeadlessTests/occlusiontests.cpp" \
+	"$SRC/59_HeadlessTests/particletests.cpp" \
+	"$SRC/59_HeadlessTests/pathtests.cpp" \
+	"$SRC/59_HeadlessTests/physicstests.cpp" \
+	"$SRC/59_HeadlessTests/shadowtests.cpp" \
+	"$SRC/59_HeadlessTests/terraintests.cpp" \
+	"$SRC/Common/3Dmath.cpp" \
+	"$SRC/Common/batchcache.cpp" \
+	"$SRC/Common/broadphase.cpp" \
+	"$SRC/Common/depthrasterizer.cpp" \
+	"$SRC/Common/frustumculler.cpp" \
+	"$SRC/Common/geometryutils.cpp" \
+	"$SRC/Common/jobsystem.cpp" \
+	"$SRC/Common/lightculler.cpp" \
+	"$SRC/Common/lightning.cpp" \
+	"$SRC/Common/meshoptimizer.cpp" \
+	"$SRC/Common/particlesystem.cpp" \
+	"$SRC/Common/pathtessellator.cpp" \
+	"$SRC/Common/physicsworld.cpp" \
+	"$SRC/Common/profiler.cpp" \
+	"$SRC/Common/shadowcascades.cpp" \
+	"$SRC/Common/terrainquadtree.cpp" \
+	"$SRC/Common/threadpool.cpp" \
+	"$SRC/Common/visibilityservice.cpp" \
+	-o "$OUT/59_HeadlessTests"
+
+# NOTE: media paths are relative to the binary (../../Media)
+cd "$OUT"
+./59_HeadlessTests "$@"
@@ -7,6 +7,10 @@
 #include "..\Common\application.h"
 #include "..\Common\dx9ext.h"
 #include "..\Common\basiccamera.h"
+#include "..\Common\threadpool.h"
+#include "..\Common\cpuhdreffects.h"
+
+#include <cstdio>
 
 // helper macros
 #define TITLE				"Shader sample 39: HDR effects"
@@ -59,6 +63,9 @@ LPD3DXEFFECT			hdreffects				= nullptr;
 LPD3DXEFFECT			screenquad				= nullptr;
 LPD3DXEFFECT			effect					= nullptr;
 
+ThreadPool*				threadpool				= nullptr;		// for the CPU reference
+CPUHDREffects*			cpueffects				= nullptr;
+
 BasicCamera				camera;
 BasicCamera				objectrotator;
 D3DVIEWPORT9			oldviewport;
@@ -67,11 +74,13 @@ D3DXVECTOR4				pixelsize(0, 0, 0, 1);
 D3DXVECTOR4				texelsize(0, 0, 0, 1);
 float					averageluminance	= 0.1f;	// don't set this to zero!!!
 float					adaptedluminance	= 0.1f;	// don't set this to zero!!!
+float					prevadaptedlum		= 0.1f;
 float					exposure			= 0;
 uint8_t					mousebuttons		= 0;
 int						currentafterimage	= 0;
 bool					drawafterimage		= false;
 bool					drawtext			= true;
+bool					comparewithcpu		= false;
 
 // forward declarations
 void RenderScene(float alpha);
@@ -83,6 +92,7 @@ void Stars();
 void Bloom();
 void LensFlare();
 void ToneMap();
+void CompareWithCPU(float elapsedtime);
 
 bool InitScene()
 {
@@ -159,7 +169,7 @@ bool InitScene()
 
 	if (FAILED(DXRenderTextEx(
 		device,
-		"Mouse left - Orbit camera\nMouse middle - Pan/zoom camera\nMouse right - Rotate object\n\n1 - Change object\n2 - Change material\n3 - Toggle afterimage\n\nH - Toggle help text",
+		"Mouse left - Orbit camera\nMouse middle - Pan/zoom camera\nMouse right - Rotate object\n\n1 - Change object\n2 - Change material\n3 - Toggle afterimage\n4 - Compare with CPU reference\n\nH - Toggle help text",
 		512, 512, L"Arial", 1, Gdiplus::FontStyleBold, 25, &helptext)))
 		return false;
 
@@ -298,6 +308,9 @@ void UninitScene()
 	SAFE_RELEASE(measureeffect);
 	SAFE_RELEASE(hdreffects);
 	SAFE_RELEASE(screenquad);
+
+	delete cpueffects;
+	delete threadpool;
 }
 
 void KeyUp(KeyCode key)
@@ -325,6 +338,10 @@ void KeyUp(KeyCode key)
 		drawafterimage = !drawafterimage;
 		break;
 
+	case KeyCode4:
+		comparewithcpu = true;
+		break;
+
 	case KeyCodeH:
 		drawtext = !drawtext;
 		break;
@@ -887,6 +904,202 @@ void ToneMap()
 	hdreffects->End();
 }
 
+bool ReadBackTarget(HDRImage& out, LPDIRECT3DSURFACE9 surface)
+{
+	LPDIRECT3DSURFACE9	sysmemsurface = nullptr;
+	D3DSURFACE_DESC		desc;
+	D3DLOCKED_RECT		rect;
+
+	surface->GetDesc(&desc);
+
+	if (desc.Format != D3DFMT_A16B16G16R16F)
+		return false;
+
+	if (FAILED(device->CreateOffscreenPlainSurface(desc.Width, desc.Height, desc.Format, D3DPOOL_SYSTEMMEM, &sysmemsurface, NULL)))
+		return false;
+
+	if (FAILED(device->GetRenderTargetData(surface, sysmemsurface)) || FAILED(sysmemsurface->LockRect(&rect, NULL, D3DLOCK_READONLY))) {
+		sysmemsurface->Release();
+		return false;
+	}
+
+	out.Resize(desc.Width, desc.Height);
+
+	for (UINT y = 0; y < desc.Height; ++y) {
+		const Math::Float16* srcrow = (const Math::Float16*)((const uint8_t*)rect.pBits + y * rect.Pitch);
+		float* dstrow = out.GetRow(y);
+
+		for (UINT x = 0; x < desc.Width * 4; ++x)
+			dstrow[x] = (float)srcrow[x];
+	}
+
+	sysmemsurface->UnlockRect();
+	sysmemsurface->Release();
+
+	return true;
+}
+
+void PrintDifference(const char* name, const HDRImage& gpuimage, const HDRImage& cpuimage)
+{
+	float maxvalue = 0;
+	float maxerror = 0;
+	double sumerror = 0;
+
+	if (gpuimage.width != cpuimage.width || gpuimage.height != cpuimage.height) {
+		printf("  %-12s size mismatch\n", name);
+		return;
+	}
+
+	for (size_t i = 0; i < gpuimage.texels.size(); ++i) {
+		if (i % 4 == 3)
+			continue;
+
+		float error = fabsf(gpuimage.texels[i] - cpuimage.texels[i]);
+
+		maxvalue = Math::Max(maxvalue, fabsf(gpuimage.texels[i]));
+		maxerror = Math::Max(maxerror, error);
+		sumerror += error;
+	}
+
+	printf("  %-12s max error: %.4f (%.3f%% of %.2f), mean error: %.6f\n", name, maxerror, 100.0f * maxerror / Math::Max(maxvalue, 1e-6f), maxvalue,
+		sumerror / (double)(gpuimage.width * gpuimage.height * 3));
+}
+
+void CompareBackBuffer(const HDRImage& cpuresult)
+{
+	LPDIRECT3DSURFACE9	backbuffer = nullptr;
+	LPDIRECT3DSURFACE9	sysmemsurface = nullptr;
+	D3DSURFACE_DESC		desc;
+	D3DLOCKED_RECT		rect;
+
+	auto linearToSRGB8 = [](float value) -> int {
+		value = Math::Clamp(value, 0.0f, 1.0f);
+		value = (value <= 0.0031308f ? value * 12.92f : 1.055f * powf(value, 1.0f / 2.4f) - 0.055f);
+
+		return (int)(value * 255.0f + 0.5f);
+	};
+
+	device->GetBackBuffer(0, 0, D3DBACKBUFFER_TYPE_MONO, &backbuffer);
+	backbuffer->GetDesc(&desc);
+
+	if (desc.Format == D3DFMT_X8R8G8B8 && desc.Width == cpuresult.width && desc.Height == cpuresult.height &&
+		SUCCEEDED(device->CreateOffscreenPlainSurface(desc.Width, desc.Height, desc.Format, D3DPOOL_SYSTEMMEM, &sysmemsurface, NULL)))
+	{
+		if (SUCCEEDED(device->GetRenderTargetData(backbuffer, sysmemsurface)) && SUCCEEDED(sysmemsurface->LockRect(&rect, NULL, D3DLOCK_READONLY))) {
+			int maxdifference = 0;
+			uint32_t numdiffering = 0;
+
+			for (UINT y = 0; y < desc.Height; ++y) {
+				const uint8_t* srcrow = (const uint8_t*)rect.pBits + y * rect.Pitch;
+				const float* cpurow = cpuresult.GetRow(y);
+
+				for (UINT x = 0; x < desc.Width; ++x) {
+					int difference = 0;
+
+					// NOTE: X8R8G8B8 is BGRX in memory
+					for (int i = 0; i < 3; ++i)
+						difference = Math::Max(difference, abs((int)srcrow[x * 4 + 2 - i] - linearToSRGB8(cpurow[x * 4 + i])));
+
+					maxdifference = Math::Max(maxdifference, difference);
+					numdiffering += (difference > 1 ? 1 : 0);
+				}
+			}
+
+			printf("  %-12s max difference: %d / 255, %.3f%% of the pixels differ by more than 1\n", "final image", maxdifference,
+				100.0f * numdiffering / (float)(desc.Width * desc.Height));
+
+			sysmemsurface->UnlockRect();
+		}
+
+		sysmemsurface->Release();
+	}
+
+	backbuffer->Release();
+}
+
+void CompareWithCPU(float elapsedtime)
+{
+	HDRImage scene;
+	HDRImage gpuimage;
+
+	if (cpueffects == nullptr) {
+		threadpool = new ThreadPool();
+		cpueffects = new CPUHDREffects();
+
+		cpueffects->SetThreadPool(threadpool);
+	}
+
+	if (!ReadBackTarget(scene, scenesurface)) {
+		MYERROR("Could not read back scene");
+		return;
+	}
+
+	// NOTE: the afterimage has no history on the CPU
+	cpueffects->SetAdaptedLuminance(prevadaptedlum);
+	cpueffects->SetAfterImage(false);
+	cpueffects->Process(scene, elapsedtime);
+
+	printf("\nCPU reference (%u threads):\n", threadpool->GetNumThreads());
+	printf("  average luminance: GPU %.4f, CPU %.4f\n", averageluminance, cpueffects->GetAverageLuminance());
+	printf("  exposure: GPU %.4f, CPU %.4f\n", exposure, cpueffects->GetExposure());
+
+	if (ReadBackTarget(gpuimage, bloomsurface))
+		PrintDifference("bloom", gpuimage, cpueffects->GetBloom());
+
+	if (ReadBackTarget(gpuimage, starsurface))
+		PrintDifference("stars", gpuimage, cpueffects->GetStars());
+
+	if (ReadBackTarget(gpuimage, lensflaresurfaces[1]))
+		PrintDifference("lens flare", gpuimage, cpueffects->GetLensFlare());
+
+	if (drawtext || drawafterimage)
+		printf("  %-12s skipped (turn off the help text and the afterimage)\n", "final image");
+	else
+		CompareBackBuffer(cpueffects->GetResult());
+
+	// time the chain on the current frame scaled to 1080p and 4K
+	const UINT sizes[2][2] = { { 1920, 1080 }, { 3840, 2160 } };
+
+	for (int i = 0; i < 2; ++i) {
+		CPUHDREffects		benchmark;
+		HDRImage			resized;
+		HDREffectsTimings	sum = {};
+		const int			numruns = 10;
+
+		resized.Resize(sizes[i][0], sizes[i][1]);
+
+		for (UINT y = 0; y < resized.height; ++y) {
+			const float* srcrow = scene.GetRow(y * scene.height / resized.height);
+			float* dstrow = resized.GetRow(y);
+
+			for (UINT x = 0; x < resized.width; ++x)
+				memcpy(dstrow + x * 4, srcrow + (x * scene.width / resized.width) * 4, 4 * sizeof(float));
+		}
+
+		benchmark.SetThreadPool(threadpool);
+		benchmark.Process(resized, elapsedtime);	// warm up
+
+		for (int j = 0; j < numruns; ++j) {
+			benchmark.Process(resized, elapsedtime);
+
+			const HDREffectsTimings& timings = benchmark.GetTimings();
+
+			sum.luminance	+= timings.luminance;
+			sum.brightpass	+= timings.brightpass;
+			sum.downsample	+= timings.downsample;
+			sum.stars		+= timings.stars;
+			sum.bloom		+= timings.bloom;
+			sum.lensflare	+= timings.lensflare;
+			sum.tonemap		+= timings.tonemap;
+			sum.total		+= timings.total;
+		}
+
+		printf("  %ux%u: %.2f ms (luminance %.2f, bright pass %.2f, downsample %.2f, stars %.2f, bloom %.2f, lens flare %.2f, tonemap %.2f)\n",
+			sizes[i][0], sizes[i][1], sum.total / numruns, sum.luminance / numruns, sum.brightpass / numruns, sum.downsample / numruns,
+			sum.stars / numruns, sum.bloom / numruns, sum.lensflare / numruns, sum.tonemap / numruns);
+	}
+}
+
 void Render(float alpha, float elapsedtime)
 {
 	static float time = 0;
@@ -906,6 +1119,8 @@ void Render(float alpha, float elapsedtime)
 		device->SetRenderState(D3DRS_ZENABLE, FALSE);
 
 		// STEP 2: measure average luminance
+		prevadaptedlum = adaptedluminance;
+
 		MeasureLuminance();
 		AdaptLuminance(elapsedtime);
 
@@ -961,6 +1176,11 @@ void Render(float alpha, float elapsedtime)
 		device->SetViewport(&oldviewport);
 
 		device->EndScene();
+
+		if (comparewithcpu) {
+			CompareWithCPU(elapsedtime);
+			comparewithcpu = false;
+		}
 	}
 
 	time += elapsedtime;
@@ -5,12 +5,15 @@
 #pragma comment(lib, "gdiplus.lib")
 
 #include <iostream>
+#include <cstring>
+#include <vector>
 
 #include "..\Common\application.h"
 #include "..\Common\gl4ext.h"
 #include "..\Common\basiccamera.h"
 #include "..\Common\spectatorcamera.h"
 #include "..\Common\geometryutils.h"
+#include "..\Common\shadowcascades.h"
 #include "..\Common\ldgtaorenderer.h"
 #include "..\Common\averageluminance.h"
 
@@ -56,6 +59,7 @@ AverageLuminance*	avgluminance	= nullptr;
 SpectatorCamera		camera;
 BasicCamera			light;
 BasicCamera			debugcamera;
+ShadowCascades		shadowsetup(1);
 GLuint				asphalt			= 0;
 GLuint				environment		= 0;
 GLuint				diffirradiance	= 0;
@@ -538,100 +542,20 @@ void Render(float alpha, float elapsedtime)
 	
 	Math::MatrixMultiply(viewproj, view, proj);
 
-	// focus the shadow map
-	std::vector<Math::Vector3> isectpoints;
-	
-	GeometryUtils::FrustumIntersectAABox(isectpoints, viewproj, scenebox);
-	GeometryUtils::LightVolumeIntersectAABox(isectpoints, -lightdir, scenebox);
-
-	// calculate light space perspective frustum
-	Math::AABox lsbody;
-	Math::Matrix lslightview(1, 1, 1, 1);
-	Math::Matrix lispsmproj(1, 1, 1, 1);
-	Math::Matrix lslightviewproj;
-	Math::Vector3 lsleft, lsup;
-
-	Math::Vec3Cross(lsleft, lightdir, viewdir);
-	Math::Vec3Normalize(lsleft, lsleft);
-
-	Math::Vec3Cross(lsup, lsleft, lightdir);
-	Math::Vec3Normalize(lsup, lsup);
-
-	lslightview._11 = lsleft.x;	lslightview._12 = lsup.x;	lslightview._13 = lightdir.x;
-	lslightview._21 = lsleft.y;	lslightview._22 = lsup.y;	lslightview._23 = lightdir.y;
-	lslightview._31 = lsleft.z;	lslightview._32 = lsup.z;	lslightview._33 = lightdir.z;
-
-	lslightview._41 = -Math::Vec3Dot(lsleft, (Math::Vector3&)eyepos);
-	lslightview._42 = -Math::Vec3Dot(lsup, (Math::Vector3&)eyepos);
-	lslightview._43 = -Math::Vec3Dot(lightdir, (Math::Vector3&)eyepos);
-
-	//GeometryUtils::CalculateAABoxFromPoints(lsbody, isectpoints, lslightview);
-	float viewnear = 1.0f; //-lsbody.Max.z;
-
-	// transform body B to light space, calculate bounding box
-	GeometryUtils::CalculateAABoxFromPoints(lsbody, isectpoints, lslightview);
-
-	// calculate LSPSM matrix
-	float cosgamma	= Math::Vec3Dot(viewdir, lightdir);
-	float singamma	= sqrtf(1.0f - cosgamma * cosgamma);
-	float znear		= viewnear / singamma;
-	float d			= fabs(lsbody.Max.y - lsbody.Min.y);
-	float zfar		= znear + d * singamma;
-	float n			= (znear + sqrtf(zfar * znear)) / singamma;
-	float f			= n + d;
-
-	lispsmproj._22 = (f + n) / (f - n);
-	lispsmproj._42 = -2 * f * n / (f - n);
-	lispsmproj._24 = 1;
-	lispsmproj._44 = 0;
-	
-	// project everything into unit cube
-	Math::Matrix fittounitcube;
-	Math::Vector3 corrected;
-
-	corrected = (Math::Vector3&)eyepos - lsup * (n - viewnear);
-
-	lslightview._41 = -Math::Vec3Dot(lsleft, corrected);
-	lslightview._42 = -Math::Vec3Dot(lsup, corrected);
-	lslightview._43 = -Math::Vec3Dot(lightdir, corrected);
-
-	Math::MatrixMultiply(lslightviewproj, lslightview, lispsmproj);
-	GeometryUtils::CalculateAABoxFromPoints(lsbody, isectpoints, lslightviewproj);
-
-	MatrixOrthoOffCenterRH(
-		fittounitcube,
-		lsbody.Min.x, lsbody.Max.x,
-		lsbody.Min.y, lsbody.Max.y,
-		-lsbody.Min.z, -lsbody.Max.z);
+	// focus the shadow map (single cascade)
+	ShadowCascade lispsm;
 
-	Math::MatrixMultiply(lslightviewproj, lslightviewproj, fittounitcube);
+	shadowsetup.Update(view, proj, scenebox);
+	shadowsetup.FitLiSPSM(&lispsm, lightdir);
 
 #if 0
 	// uniform shadow mapping
-	Math::Vector2 clipplanes;
+	ShadowCascade uniform;
 
-	//Math::AABox vsbody;
-	//GeometryUtils::CalculateAABoxFromPoints(vsbody, isectpoints, Math::Matrix(1, 1, 1, 1));
-	//Math::FitToBoxOrtho(lightproj, clipplanes, lightview, vsbody);
-
-	Math::FitToBoxOrtho(lightproj, clipplanes, lightview, scenebox);
-	Math::MatrixMultiply(lightviewproj, lightview, lightproj);
-
-	/*
-	Math::AABox vsbody;
-
-	GeometryUtils::CalculateAABoxFromPoints(vsbody, isectpoints, lightview);
-
-	MatrixOrthoOffCenterRH(
-		lightproj,
-		vsbody.Min.x, vsbody.Max.x,
-		vsbody.Min.y, vsbody.Max.y,
-		vsbody.Min.z, vsbody.Max.z);
-
-	Math::MatrixMultiply(lightviewproj, lightview, lightproj);
-	*/
+	shadowsetup.FitOrtho(&uniform, lightdir);
+	lightviewproj = uniform.lightviewproj;
 #else
-	lightviewproj = lslightviewproj;
+	lightviewproj = lispsm.lightviewproj;
 #endif
 
 	glEnable(GL_DEPTH_TEST);
@@ -671,7 +595,10 @@ void Render(float alpha, float elapsedtime)
 		glViewport(0, 0, screenwidth, screenheight);
 		glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
 		
-		DebugRender(viewproj, lightviewproj, corrected, scenebox, lsbody, isectpoints);
+		Math::Vector3 bodypoints[MAX_BODY_POINTS];
+		uint32_t numpoints = shadowsetup.GetBodyPoints(bodypoints, 0);
+
+		DebugRender(viewproj, lightviewproj, lispsm.projcenter, scenebox, lispsm.lightbody, std::vector<Math::Vector3>(bodypoints, bodypoints + numpoints));
 	} else {
 		Math::Color black = { 0, 0, 0, 1 };
 		Math::Color white = { 1, 1, 1, 1 };
@@ -8,12 +8,15 @@
 #pragma comment(lib, "mfreadwrite.lib")
 #pragma comment(lib, "mfuuid.lib")
 
+#include <vector>
+
 #include "..\Common\application.h"
 #include "..\Common\dx9ext.h"
 #include "..\Common\xa2ext.h"
 #include "..\Common\basiccamera.h"
 #include "..\Common\particlesystem.h"
 #include "..\Common\lightning.h"
+#include "..\Common\threadpool.h"
 
 #define LIGHTNING_THICKNESS	3e-2f	// lightning is around 2-3 cm in diameter
 
@@ -53,6 +56,7 @@ XA2Sound*				burning				= nullptr;
 XA2Sound*				thunder				= nullptr;
 
 Lightning*				lightning;
+ThreadPool*				workers				= nullptr;
 BasicCamera				camera;
 bool					drawtext			= false;
 
@@ -238,9 +242,13 @@ bool InitScene()
 	firesystem->Force = Math::Vector3(0, 3e-2f, 0);
 
 	// setup lightning
+	workers = new ThreadPool();
+
 	lightning = new Lightning(CoilLightning);
 	lightningstorage = new DXParticleStorage(device);
 
+	lightning->SetThreadPool(workers);
+
 	// setup sound
 	audiostreamer = new XA2AudioStreamer();
 
@@ -265,6 +273,7 @@ void UninitScene()
 	delete audiostreamer;
 	delete firesystem;
 	delete lightning;
+	delete workers;
 
 	for (int i = 0; i < 6; ++i)
 		delete dwarfs[i];
@@ -8,6 +8,10 @@
 #pragma comment(lib, "GdiPlus.lib")
 
 #include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <vector>
 
 #define _CRTDBG_MAP_ALLOC
 #include <stdlib.h>
@@ -92,8 +96,233 @@ void THREAD3_Run()
 	window3 = 0;
 }
 
+class MockRenderingContext : public IRenderingContext
+{
+public:
+	OpenGLFramebuffer*	CreateFramebuffer(GLuint width, GLuint height) override									{ return nullptr; }
+	OpenGLScreenQuad*	CreateScreenQuad() override																{ return nullptr; }
+	OpenGLEffect*		CreateEffect(const char* vsfile, const char* gsfile, const char* fsfile) override		{ return nullptr; }
+	OpenGLMesh*			CreateMesh(const char* file) override													{ return nullptr; }
+	OpenGLMesh*			CreateMesh(GLuint numvertices, GLuint numindices, GLuint flags, OpenGLVertexElement* decl) override	{ return nullptr; }
+
+	void SetBlendMode(GLenum src, GLenum dst) override							{}
+	void SetCullMode(GLenum mode) override										{}
+	void SetDepthTest(GLboolean enable) override								{}
+	void SetDepthFunc(GLenum func) override										{}
+
+	void Blit(OpenGLFramebuffer* from, OpenGLFramebuffer* to, GLbitfield flags) override	{}
+	void Clear(GLbitfield target, const Math::Color& color, float depth) override			{}
+	void Present(int id) override															{}
+
+	void CheckError() override													{}
+};
+
+struct QueueBenchState
+{
+	// NOTE: only touched by the rendering thread
+	IRenderingContext*		context;
+	std::vector<int64_t>	lastsequence;
+	uint64_t				numexecuted;
+	uint64_t				numerrors;
+};
+
+class MockRenderingTask : public IRenderingTask
+{
+private:
+	QueueBenchState*	state;
+	uint32_t			producer;
+	int64_t				sequence;
+
+public:
+	bool executed;
+
+	MockRenderingTask(QueueBenchState* benchstate, uint32_t producerid, int64_t sequenceid)
+		: IRenderingTask(0)
+	{
+		state		= benchstate;
+		producer	= producerid;
+		sequence	= sequenceid;
+		executed	= false;
+	}
+
+	void Dispose() override
+	{
+	}
+
+	void Execute(IRenderingContext* context) override
+	{
+		// tasks of the same producer must arrive in order
+		if (context != state->context || sequence != state->lastsequence[producer] + 1)
+			++state->numerrors;
+
+		context->CheckError();
+
+		state->lastsequence[producer] = sequence;
+		++state->numexecuted;
+
+		executed = true;
+	}
+};
+
+static int BenchmarkQueue(int first, int argc, char* argv[])
+{
+	// NOTE: drives RenderingCore's task queue with mock tasks (no OpenGL), e.g. -queuebench 262144 -threads 4
+	typedef std::chrono::high_resolution_clock Clock;
+	typedef std::vector<IRenderingTask*> TaskArray;
+
+	uint32_t	numtasks		= 1 << 18;
+	uint32_t	numproducers	= 4;
+	const int	numruns			= 5;
+	const int	numlatency		= 20000;
+	const int	batchsize		= 16;
+
+	if (first < argc && argv[first][0] != '-')
+		numtasks = (uint32_t)atoi(argv[first]);
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+			numproducers = Math::Max<uint32_t>(1, (uint32_t)atoi(argv[++i]));
+	}
+
+	MockRenderingContext	mockcontext;
+	QueueBenchState			state;
+	RenderingCore*			core = RenderingCore::CreateHeadless(&mockcontext);
+	std::vector<TaskArray>	tasks(numproducers);
+	double					elapsed;
+	bool					success = true;
+
+	state.context = &mockcontext;
+	state.lastsequence.resize(numproducers + 1);
+
+	for (uint32_t i = 0; i < numproducers; ++i) {
+		for (uint32_t j = 0; j < numtasks; ++j)
+			tasks[i].push_back(new MockRenderingTask(&state, i, j));
+	}
+
+	auto ResetState = [&]() {
+		for (size_t i = 0; i < state.lastsequence.size(); ++i)
+			state.lastsequence[i] = -1;
+
+		state.numexecuted = 0;
+		state.numerrors = 0;
+
+		for (uint32_t i = 0; i < numproducers; ++i) {
+			for (IRenderingTask* task : tasks[i])
+				((MockRenderingTask*)task)->executed = false;
+		}
+	};
+
+	printf("%u producers, %u tasks each, queue capacity %u\n", numproducers, numtasks, MAX_QUEUED_TASKS);
+
+	// latency: one task + wait for its ticket (what CreateUniverse does)
+	MockRenderingTask* lonely = new MockRenderingTask(&state, numproducers, 0);
+
+	ResetState();
+	elapsed = 0;
+
+	for (int i = 0; i < numlatency; ++i) {
+		state.lastsequence[numproducers] = -1;
+		lonely->executed = false;
+
+		auto start = Clock::now();
+		{
+			core->Wait(core->AddTask(lonely));
+		}
+		elapsed += std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+
+		if (!lonely->executed)
+			success = false;
+	}
+
+	printf("AddTask + Wait: %.3f us\n", elapsed / numlatency);
+
+	// throughput: every producer pushes its tasks (one by one or in batches) and checks some tickets
+	for (int batched = 0; batched < 2; ++batched) {
+		uint64_t numlost = 0;
+		uint64_t numerrors = 0;
+		uint64_t numbadtickets = 0;
+		std::atomic<uint64_t> badtickets;
+
+		elapsed = 0;
+
+		for (int run = -1; run < numruns; ++run) {
+			std::vector<std::thread> producers;
+
+			ResetState();
+			badtickets = 0;
+
+			auto start = Clock::now();
+
+			for (uint32_t i = 0; i < numproducers; ++i) {
+				producers.push_back(std::thread([&, i]() {
+					TaskArray& mytasks = tasks[i];
+					uint64_t ticket;
+
+					for (uint32_t j = 0; j < numtasks; j += (batched ? batchsize : 1)) {
+						uint32_t count = (batched ? Math::Min<uint32_t>(batchsize, numtasks - j) : 1);
+
+						if (count == 1)
+							ticket = core->AddTask(mytasks[j]);
+						else
+							ticket = core->AddTasks(mytasks.data() + j, count);
+
+						if ((j % 4096) == 0) {
+							// everything up to the ticket must be done
+							core->Wait(ticket);
+
+							if (!core->IsCompleted(ticket) || !((MockRenderingTask*)mytasks[j + count - 1])->executed)
+								++badtickets;
+						}
+					}
+				}));
+			}
+
+			for (std::thread& producer : producers)
+				producer.join();
+
+			core->Barrier();
+
+			if (run >= 0)
+				elapsed += std::chrono::duration<double>(Clock::now() - start).count();
+
+			numlost += (uint64_t)numproducers * numtasks - state.numexecuted;
+			numerrors += state.numerrors;
+			numbadtickets += badtickets;
+		}
+
+		printf("%s: %.2f M tasks/s (lost: %llu, out of order: %llu, bad tickets: %llu)\n",
+			(batched ? "AddTasks (16)" : "AddTask"),
+			((double)numproducers * numtasks * numruns) / elapsed * 1e-6,
+			(unsigned long long)numlost, (unsigned long long)numerrors, (unsigned long long)numbadtickets);
+
+		if (numlost > 0 || numerrors > 0 || numbadtickets > 0)
+			success = false;
+	}
+
+	core->Shutdown();
+
+	for (uint32_t i = 0; i < numproducers; ++i) {
+		for (IRenderingTask* task : tasks[i])
+			delete task;
+	}
+
+	delete lonely;
+
+	if (!success) {
+		printf("* Error: RenderingCore queue test failed!\n");
+		return 1;
+	}
+
+	return 0;
+}
+
 int main(int argc, char* argv[])
 {
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-queuebench") == 0)
+			return BenchmarkQueue(i + 1, argc, argv);
+	}
+
 	SystemParametersInfo(SPI_GETWORKAREA, 0, &workarea, 0);
 
 	wawidth = workarea.right - workarea.left;
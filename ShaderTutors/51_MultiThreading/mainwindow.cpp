@@ -200,8 +200,7 @@ void OpenGLAddonTask::Setup()
 	// NOTE: runs on any other thread
 	action = AddonActionSetup;
 
-	GetRenderingCore()->AddTask(this);
-	GetRenderingCore()->Barrier();
+	GetRenderingCore()->Wait(GetRenderingCore()->AddTask(this));
 }
 
 void OpenGLAddonTask::Render(float time)
@@ -233,8 +232,7 @@ void MainWindow_Closing(Win32Window*)
 	if (addonrenderer != nullptr) {
 		addonrenderer->MarkForDispose();
 		
-		GetRenderingCore()->AddTask(addonrenderer);
-		GetRenderingCore()->Barrier();
+		GetRenderingCore()->Wait(GetRenderingCore()->AddTask(addonrenderer));
 
 		addonrenderer = nullptr;
 	}
@@ -288,8 +286,7 @@ void Window3_Closing(Win32Window*)
 	if (window3renderer != nullptr) {
 		window3renderer->MarkForDispose();
 		
-		GetRenderingCore()->AddTask(window3renderer);
-		GetRenderingCore()->Barrier();
+		GetRenderingCore()->Wait(GetRenderingCore()->AddTask(window3renderer));
 
 		window3renderer = nullptr;
 	}
@@ -316,8 +313,7 @@ void Window3_Render(Win32Window* window, float alpha, float elapsedtime)
 
 		blitter->MarkForDispose();
 
-		GetRenderingCore()->AddTask(blitter);
-		GetRenderingCore()->Barrier();
+		GetRenderingCore()->Wait(GetRenderingCore()->AddTask(blitter));
 
 		window3renderer->SetRenderTarget(feedbacklayer);
 		window3renderer->SetClearOptions(Math::Color(0, 0, 0, 0), false);
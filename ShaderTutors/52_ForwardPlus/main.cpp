@@ -5,10 +5,14 @@
 #pragma comment(lib, "gdiplus.lib")
 
 #include <iostream>
+#include <vector>
 
 #include "..\Common\application.h"
 #include "..\Common\gl4ext.h"
 #include "..\Common\basiccamera.h"
+#include "..\Common\visibilityservice.h"
+#include "..\Common\lightculler.h"
+#include "..\Common\threadpool.h"
 
 #define NUM_LIGHTS			400		// must be square number
 #define LIGHT_RADIUS		1.5f	// must be at least 1
@@ -65,9 +69,16 @@ GLuint				helptext		= 0;
 
 BasicCamera			camera;
 Math::AABox			scenebox;
+VisibilityService	visibility;
+LightCuller			lightculler(16, 1);		// no depth slices, same as the shader
+ThreadPool*			workers			= nullptr;
 GLuint				workgroupsx		= 0;
 GLuint				workgroupsy		= 0;
 int					timeout			= 0;
+bool				cpuculling		= false;
+
+Math::Vector4		previouslights[NUM_LIGHTS];	// copy of light buffer for CPU culling (position + radius)
+Math::Vector4		currentlights[NUM_LIGHTS];
 
 ObjectInstance instances[] =
 {
@@ -88,7 +99,7 @@ ObjectInstance instances[] =
 };
 
 void UpdateParticles(float dt, bool generate);
-void RenderScene(OpenGLEffect* effect);
+void RenderScene(OpenGLEffect* effect, const VisibilityService::IndexList& visible);
 
 bool InitScene()
 {
@@ -156,6 +167,8 @@ bool InitScene()
 
 		scenebox.Add(tmpbox.Min);
 		scenebox.Add(tmpbox.Max);
+
+		visibility.Register(tmpbox, i);
 	}
 
 	// create render targets
@@ -241,7 +254,9 @@ bool InitScene()
 	}
 
 	screenquad = new OpenGLScreenQuad();
+	workers = new ThreadPool();
 
+	lightculler.SetThreadPool(workers);
 	lightcull->SetInt("depthSampler", 0);
 	lightcull->SetInt("numLights", NUM_LIGHTS);
 	lightaccum->SetInt("sampler0", 0);
@@ -269,7 +284,7 @@ bool InitScene()
 	GLCreateTexture(512, 512, 1, GLFMT_A8B8G8R8, &helptext);
 
 	GLRenderText(
-		"Mouse left - Orbit camera\nMouse middle - Pan/zoom camera",
+		"Mouse left - Orbit camera\nMouse middle - Pan/zoom camera\n\n1 - Toggle CPU light culling",
 		helptext, 512, 512);
 
 	return true;
@@ -289,6 +304,7 @@ void UninitScene()
 	delete shadowmap;
 	delete blurredshadow;
 	delete screenquad;
+	delete workers;
 
 	GL_SAFE_DELETE_TEXTURE(wood);
 	GL_SAFE_DELETE_TEXTURE(marble);
@@ -307,6 +323,7 @@ void KeyUp(KeyCode key)
 {
 	switch (key) {
 	case KeyCode1:
+		cpuculling = !cpuculling;
 		break;
 
 	default:
@@ -481,6 +498,13 @@ void UpdateParticles(float dt, bool generate)
 		}
 	}
 
+	for (int i = 0; i < NUM_LIGHTS; ++i) {
+		const LightParticle& p = particles[i];
+
+		previouslights[i] = Math::Vector4(p.previous[0], p.previous[1], p.previous[2], p.radius);
+		currentlights[i] = Math::Vector4(p.current[0], p.current[1], p.current[2], p.radius);
+	}
+
 	glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
 	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 }
@@ -495,12 +519,12 @@ void Update(float delta)
 		++timeout;
 }
 
-void RenderScene(OpenGLEffect* effect)
+void RenderScene(OpenGLEffect* effect, const VisibilityService::IndexList& visible)
 {
 	Math::Matrix worldinv;
 
-	for (int i = 0; i < ARRAY_SIZE(instances); ++i) {
-		const ObjectInstance& obj = instances[i];
+	for (size_t i = 0; i < visible.size(); ++i) {
+		const ObjectInstance& obj = instances[visible[i]];
 
 		Math::MatrixInverse(worldinv, obj.transform);
 
@@ -526,6 +550,50 @@ void RenderScene(OpenGLEffect* effect)
 	glBindTexture(GL_TEXTURE_2D, 0);
 }
 
+void AssignLightsOnCPU(float alpha, const Math::Matrix& view, const Math::Matrix& proj, const Math::Vector2& clipplanes)
+{
+	// NOTE: no depth readback, so tiles are tested against the clip planes (more lights per tile than the shader)
+	Math::Vector4 lights[NUM_LIGHTS];
+
+	for (int i = 0; i < NUM_LIGHTS; ++i)
+		Math::Vec4Lerp(lights[i], previouslights[i], currentlights[i], alpha);
+
+	// tile grid must be the same as in lightaccum.frag
+	lightculler.Cull(lights, NUM_LIGHTS, view, proj, clipplanes, workgroupsx * 16, workgroupsy * 16);
+
+	const std::vector<uint32_t>& offsets = lightculler.GetOffsets();
+	const std::vector<uint32_t>& indices = lightculler.GetIndices();
+
+	GLuint numtiles = workgroupsx * workgroupsy;
+	GLuint numnodes = (GLuint)indices.size();
+
+	// write the same lists as lightcull.comp (start, count) and (light index, next)
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, headbuffer);
+	GLuint* heads = (GLuint*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, numtiles * 16, GL_MAP_WRITE_BIT|GL_MAP_INVALIDATE_BUFFER_BIT);
+
+	for (GLuint i = 0; i < numtiles; ++i) {
+		heads[i * 4 + 0] = offsets[i];
+		heads[i * 4 + 1] = offsets[i + 1] - offsets[i];
+	}
+
+	glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+
+	if (numnodes > 0) {
+		// at most NUM_LIGHTS per tile, fits into the 1024 per tile allocated
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, nodebuffer);
+		GLuint* nodes = (GLuint*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, numnodes * 16, GL_MAP_WRITE_BIT|GL_MAP_INVALIDATE_RANGE_BIT);
+
+		for (GLuint i = 0; i < numnodes; ++i) {
+			nodes[i * 4 + 0] = indices[i];
+			nodes[i * 4 + 1] = i + 1;
+		}
+
+		glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+	}
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
 void Render(float alpha, float elapsedtime)
 {
 	Math::Matrix world, view, proj;
@@ -567,6 +635,15 @@ void Render(float alpha, float elapsedtime)
 	Math::FitToBoxOrtho(lightproj, lightclip, lightview, scenebox);
 	Math::MatrixMultiply(lightviewproj, lightview, lightproj);
 
+	// cull objects for the shadow map (query 0) and the camera (query 1) in one pass
+	visibility.BeginQueries();
+	visibility.AddFrustumQuery(lightviewproj);
+	visibility.AddFrustumQuery(viewproj);
+	visibility.Cull();
+
+	const VisibilityService::IndexList& shadowcasters = visibility.GetVisible(0);
+	const VisibilityService::IndexList& visibleobjects = visibility.GetVisible(1);
+
 	// render shadow map
 	glClearColor(1, 1, 1, 1);
 
@@ -579,7 +656,7 @@ void Render(float alpha, float elapsedtime)
 
 		varianceshadow->Begin();
 		{
-			RenderScene(varianceshadow);
+			RenderScene(varianceshadow, shadowcasters);
 		}
 		varianceshadow->End();
 	}
@@ -646,14 +723,20 @@ void Render(float alpha, float elapsedtime)
 		// then fill z-buffer
 		ambient->Begin();
 		{
-			RenderScene(ambient);
+			RenderScene(ambient, visibleobjects);
 		}
 		ambient->End();
 	}
 	framebuffer->Unset();
 
 	// STEP 2: cull lights
-	if (timeout > DELAY) {
+	if (timeout > DELAY && cpuculling) {
+		AssignLightsOnCPU(alpha, view, proj, clipplanes);
+
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, headbuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, nodebuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, lightbuffer);
+	} else if (timeout > DELAY) {
 		lightcull->SetFloat("alpha", alpha);
 		lightcull->SetVector("clipPlanes", clipplanes);
 		lightcull->SetVector("screenSize", screensize);
@@ -705,7 +788,7 @@ void Render(float alpha, float elapsedtime)
 
 		blinnphong->Begin();
 		{
-			RenderScene(blinnphong);
+			RenderScene(blinnphong, visibleobjects);
 		}
 		blinnphong->End();
 
@@ -718,7 +801,7 @@ void Render(float alpha, float elapsedtime)
 
 			lightaccum->Begin();
 			{
-				RenderScene(lightaccum);
+				RenderScene(lightaccum, visibleobjects);
 			}
 			lightaccum->End();
 		
@@ -5,6 +5,7 @@
 #pragma comment(lib, "gdiplus.lib")
 
 #include <iostream>
+#include <chrono>
 
 #include "..\Common\application.h"
 #include "..\Common\gl4ext.h"
@@ -13,6 +14,12 @@
 #include "..\Common\physicsworld.h"
 #include "..\Common\gtaorenderer.h"
 #include "..\Common\averageluminance.h"
+#include "..\Common\iblbaker.h"
+#include "..\Common\meshoptimizer.h"
+#include "..\Common\meshsimplifier.h"
+#include "..\Common\tangentgenerator.h"
+#include "..\Common\threadpool.h"
+#include "..\Common\visibilityservice.h"
 
 #ifdef _WIN32
 // NOTE: include after gl4ext.h
@@ -44,6 +51,7 @@
 
 #define NUM_OBJECTS			16
 #define NUM_LIGHTS			5
+#define CAMERA_LAYER		(1 << NUM_LIGHTS)	// lower bits are the lights
 #define SHADOWMAP_SIZE		1024
 #define USE_MSAA			0 //1
 
@@ -70,6 +78,7 @@ private:
 	RigidBody*		body;
 	OpenGLMesh*		mesh;
 	GLuint			numsubsets;
+	GLuint			lod;
 	float			scaling;
 	bool			isclone;
 	bool			isvisible;	// for view frustum culling
@@ -81,6 +90,7 @@ public:
 	~SceneObject();
 
 	void RecalculateBoundingBox();
+	void SelectLOD(const Math::Vector3& eye, float pixelsperunit);
 	void Draw(OpenGLEffect* effect, bool transparent);
 	void DrawFast(OpenGLEffect* effect);
 
@@ -126,6 +136,7 @@ PBRLight*			lights[NUM_LIGHTS]		= { nullptr };
 GTAORenderer*		gtaorenderer			= nullptr;
 AverageLuminance*	averageluminance		= nullptr;
 PhysicsWorld*		physicsworld			= nullptr;
+VisibilityService*	visibility				= nullptr;
 RigidBody*			selectedbody			= nullptr;
 FPSCamera*			camera					= nullptr;
 bool				debugphysics			= false;
@@ -295,6 +306,7 @@ SceneObject::SceneObject(const SceneObject& other)
 	scaling		= other.scaling;
 	isclone		= true;
 	isvisible	= true;
+	lod			= 0;
 
 	materials.resize(numsubsets);
 	RecalculateBoundingBox();
@@ -330,6 +342,7 @@ SceneObject::SceneObject(const char* file, RigidBodyType type, float scale)
 	}
 
 	isvisible = true;
+	lod = 0;
 }
 
 SceneObject::SceneObject(OpenGLMesh* external, RigidBodyType type, float scale)
@@ -360,6 +373,7 @@ SceneObject::SceneObject(OpenGLMesh* external, RigidBodyType type, float scale)
 	}
 
 	isvisible = true;
+	lod = 0;
 }
 
 SceneObject::~SceneObject()
@@ -387,11 +401,29 @@ void SceneObject::RecalculateBoundingBox()
 	}
 }
 
+void SceneObject::SelectLOD(const Math::Vector3& eye, float pixelsperunit)
+{
+	Math::Vector3 center;
+
+	if (mesh == nullptr || mesh->GetNumLODs() == 1) {
+		lod = 0;
+		return;
+	}
+
+	// NOTE: distance to the bounding sphere, the errors are in object space
+	boundingbox.GetCenter(center);
+
+	float distance = Math::Max(Math::Vec3Distance(eye, center) - boundingbox.Radius(), 1e-3f);
+	lod = mesh->SelectLOD(distance, pixelsperunit * scaling);
+}
+
 void SceneObject::Draw(OpenGLEffect* effect, bool transparent)
 {
 	if (mesh == nullptr || !isvisible)
 		return;
 
+	mesh->SetLOD(lod);
+
 	Math::Matrix world, worldinv;
 
 	Math::MatrixScaling(world, scaling, scaling, scaling);
@@ -430,6 +462,8 @@ void SceneObject::DrawFast(OpenGLEffect* effect)
 	if (mesh == nullptr || !isvisible )
 		return;
 
+	mesh->SetLOD(lod);
+
 	Math::Matrix world;
 	Math::MatrixScaling(world, scaling, scaling, scaling);
 
@@ -863,6 +897,8 @@ bool InitScene()
 	lights[LIGHT_ID_LOCAL1]->SetProbeTextures("../../Media/Textures/uffizi_diff_irrad.dds", "../../Media/Textures/local1_spec_irrad.dds");
 
 	// calculate scene bounding box
+	visibility = new VisibilityService();
+
 	for (int i = 0; i < NUM_OBJECTS; ++i) {
 		if (objects[i] == nullptr)	//
 			continue;	//
@@ -875,6 +911,16 @@ bool InitScene()
 
 		scenebox.Add(tmpbox.Min);
 		scenebox.Add(tmpbox.Max);
+
+		// NOTE: objects are static, handles are not needed
+		uint32_t layers = CAMERA_LAYER;
+
+		for (int j = 0; j < NUM_LIGHTS; ++j) {
+			if (IsAffectedByLight(i, j))
+				layers |= (1 << j);
+		}
+
+		visibility->Register(tmpbox, i, layers);
 	}
 
 	// render shadow map
@@ -948,6 +994,7 @@ void UninitScene()
 
 	delete camera;
 	delete physicsworld;
+	delete visibility;
 
 	GL_SAFE_DELETE_TEXTURE(environment);
 	GL_SAFE_DELETE_TEXTURE(integratedbrdf);
@@ -1089,55 +1136,33 @@ void Update(float delta)
 
 void CullScene(const Math::Matrix& viewproj)
 {
-	Math::Vector4 planes[6] = {
-		{ 1, 0, 0, 1 },
-		{ -1, 0, 0, 1 },
-		{ 0, 1, 0, 1 },
-		{ 0, -1, 0, 1 },
-		{ 0, 0, 1, 0 },
-		{ 0, 0, -1, 1 },
-	};
-
-	for (int i = 0; i < 6; ++i) {
-		Math::PlaneTransformTranspose(planes[i], viewproj, planes[i]);
-		Math::PlaneNormalize(planes[i], planes[i]);
-	}
-
-	Math::Vector3	center;
-	Math::Vector3	halfsize;
-	float			dist, maxdist;
-	int				numculled = 0;
-	bool			visible;
-
-	// NOTE: this is fast, but might give false negative for concave objects
-	for (int i = 0; i < NUM_OBJECTS; ++i) {
-		if (objects[i] == nullptr)
-			continue;
-
-		const Math::AABox& box = objects[i]->GetBoundingBox();
-
-		box.GetCenter(center);
-		box.GetHalfSize(halfsize);
-
-		visible = true;
+	Math::Matrix lightviewproj;
 
-		for (int j = 0; j < 6; ++j) {
-			const Math::Vector4& plane = planes[j];
+	// query 0 is the camera, query i + 1 is light i (the spot light can use its own frustum)
+	visibility->BeginQueries();
+	visibility->AddFrustumQuery(viewproj, CAMERA_LAYER);
 
-			dist = Math::PlaneDotCoord(plane, center);
-			maxdist = (fabs(plane.x * halfsize.x) + fabs(plane.y * halfsize.y) + fabs(plane.z * halfsize.z));
+	for (int i = 0; i < NUM_LIGHTS; ++i) {
+		if (lights[i]->GetType() == PBRLightTypeSpot) {
+			lights[i]->GetViewProj(lightviewproj);
+			visibility->AddFrustumQuery(lightviewproj, (1 << i));
+		} else {
+			visibility->AddFrustumQuery(viewproj, (1 << i));
+		}
+	}
 
-			if (dist < -maxdist) {
-				// outside
-				visible = false;
-				++numculled;
+	visibility->Cull();
 
-				break;
-			}
-		}
+	// NOTE: bounding boxes vs. planes, so the list is conservative (boxes near the frustum edges may be false positives)
+	const VisibilityService::IndexList& visible = visibility->GetVisible(0);
 
-		objects[i]->SetVisible(visible);
+	for (int i = 0; i < NUM_OBJECTS; ++i) {
+		if (objects[i] != nullptr)
+			objects[i]->SetVisible(false);
 	}
+
+	for (size_t i = 0; i < visible.size(); ++i)
+		objects[visible[i]]->SetVisible(true);
 }
 
 void RenderScene(const Math::Matrix& viewproj, const Math::Vector3& eye, bool transparent, LightMode mode)
@@ -1209,17 +1234,17 @@ void RenderScene(const Math::Matrix& viewproj, const Math::Vector3& eye, bool tr
 			continue;
 		}
 
-		// render objects that the current light affects
+		// render objects that the current light affects (see CullScene)
 		if (effect != nullptr) {
+			const VisibilityService::IndexList& affected = visibility->GetVisible(i + 1);
+
 			effect->SetVector("eyePos", eye);
 			effect->SetMatrix("matViewProj", viewproj);
 
 			effect->Begin();
 			{
-				for (int j = 0; j < NUM_OBJECTS; ++j) {
-					if (objects[j] != nullptr && IsAffectedByLight(j, i))
-						objects[j]->Draw(effect, transparent);
-				}
+				for (size_t j = 0; j < affected.size(); ++j)
+					objects[affected[j]]->Draw(effect, transparent);
 			}
 			effect->End();
 		}
@@ -1318,13 +1343,20 @@ void Render(float alpha, float elapsedtime)
 	Math::MatrixInverse(viewinv, view);
 	Math::MatrixMultiply(viewproj, view, proj);
 
+	float pixelsperunit = app->GetClientHeight() / (2.0f * tanf(camera->GetFov() * 0.5f));
+
 	clipinfo.x = camera->GetNearPlane();
 	clipinfo.y = camera->GetFarPlane();
-	clipinfo.z = 0.5f * (app->GetClientHeight() / (2.0f * tanf(camera->GetFov() * 0.5f)));
+	clipinfo.z = 0.5f * pixelsperunit;
 
-	// view frustum culling
+	// view frustum culling + LOD selection
 	CullScene(viewproj);
 
+	for (int i = 0; i < NUM_OBJECTS; ++i) {
+		if (objects[i] != nullptr)
+			objects[i]->SelectLOD(eye, pixelsperunit);
+	}
+
 	Math::Color clearcolor	= { 0, 0.0103f, 0.0707f, 1 };
 	Math::Color black		= { 0, 0, 0, 1 };
 	Math::Color white		= { 1, 1, 1, 1 };
@@ -1539,8 +1571,172 @@ void DEBUG_DrawBody(RigidBodyType type, const Math::Matrix& xform)
 	debugbox->DrawSubset(0);
 }
 
+static int BakeProbes(int first, int argc, char* argv[])
+{
+	// NOTE: offline version of 53_PrefilterEnvmap, e.g. -bake grace uffizi -specsamples 512 -threads 8 (only the BRDF LUT if no probe is given)
+	std::vector<std::string>	probes;
+	IBLBaker					baker;
+	ThreadPool*					threadpool		= nullptr;
+	uint32_t					numspecsamples	= 256;
+	uint32_t					numbrdfsamples	= 2048;
+	uint32_t					numthreads		= 0;
+	bool						success			= true;
+
+	for (int i = first; i < argc && argv[i][0] != '-'; ++i)
+		probes.push_back(argv[i]);
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-specsamples") == 0 && i + 1 < argc)
+			numspecsamples = (uint32_t)atoi(argv[++i]);
+		else if (strcmp(argv[i], "-brdfsamples") == 0 && i + 1 < argc)
+			numbrdfsamples = (uint32_t)atoi(argv[++i]);
+		else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+			numthreads = (uint32_t)atoi(argv[++i]);
+	}
+
+	threadpool = new ThreadPool(numthreads);
+
+	baker.SetThreadPool(threadpool);
+	baker.SetSampleCounts(numspecsamples, numbrdfsamples);
+
+	for (const std::string& probe : probes) {
+		std::string path = "../../Media/Textures/" + probe;
+		auto start = std::chrono::high_resolution_clock::now();
+
+		if (!baker.LoadEnvironment((path + ".dds").c_str())) {
+			MYERROR("Could not load " << path << ".dds");
+
+			success = false;
+			continue;
+		}
+
+		success = baker.BakeDiffuse((path + "_diff_irrad.dds").c_str()) && success;
+		success = baker.BakeSpecular((path + "_spec_irrad.dds").c_str()) && success;
+
+		auto end = std::chrono::high_resolution_clock::now();
+
+		std::cout << "Baked " << probe << " (" << baker.GetEnvironmentSize() << "x" << baker.GetEnvironmentSize() << ") in "
+			<< std::chrono::duration<double, std::milli>(end - start).count() << " ms\n";
+	}
+
+	auto start = std::chrono::high_resolution_clock::now();
+	success = baker.BakeBRDF("../../Media/Textures/brdf.dds") && success;
+	auto end = std::chrono::high_resolution_clock::now();
+
+	std::cout << "Integrated BRDF in " << std::chrono::duration<double, std::milli>(end - start).count() << " ms ("
+		<< threadpool->GetNumThreads() << " threads)\n";
+
+	delete threadpool;
+	return (success ? 0 : 1);
+}
+
+static int OptimizeMeshes(int first, int argc, char* argv[])
+{
+	// NOTE: rewrites the given .qm files in place, e.g. -optimize ../../Media/MeshesQM/sofa2.qm ../../Media/MeshesQM/dragon.qm
+	MeshOptimizer::QMStatistics stats;
+	bool success = true;
+
+	for (int i = first; i < argc && argv[i][0] != '-'; ++i) {
+		if (!MeshOptimizer::OptimizeQM(argv[i], &stats)) {
+			MYERROR("Could not optimize " << argv[i]);
+
+			success = false;
+			continue;
+		}
+
+		printf("%s: %u triangles, %u subsets, %u clusters, ACMR %.3f -> %.3f, ATVR %.3f -> %.3f%s\n", argv[i],
+			stats.numtriangles, stats.numsubsets, stats.numclusters, stats.before.acmr, stats.after.acmr,
+			stats.before.atvr, stats.after.atvr, (stats.fetchreordered ? "" : " (vertex order kept)"));
+	}
+
+	// NOTE: the BVH caches and scene packages of sample 57 depend on the triangle order
+	std::cout << "Delete Media/Cache/*.bvh and repack the scenes of sample 57 if their meshes changed\n";
+
+	return (success ? 0 : 1);
+}
+
+static int SimplifyMeshes(int first, int argc, char* argv[])
+{
+	// NOTE: appends an LOD chain to the given .qm files, e.g. -simplify ../../Media/MeshesQM/dragon.qm -lods 5 (run -optimize before)
+	LODChainStatistics	stats;
+	uint32_t			numlods		= 4;
+	float				ratio		= 0.5f;
+	float				maxerror	= 0.02f;
+	bool				success		= true;
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-lods") == 0 && i + 1 < argc)
+			numlods = (uint32_t)atoi(argv[++i]);
+		else if (strcmp(argv[i], "-ratio") == 0 && i + 1 < argc)
+			ratio = (float)atof(argv[++i]);
+		else if (strcmp(argv[i], "-maxerror") == 0 && i + 1 < argc)
+			maxerror = (float)atof(argv[++i]);
+	}
+
+	for (int i = first; i < argc && argv[i][0] != '-'; ++i) {
+		if (!MeshSimplifier::GenerateQMLODs(argv[i], numlods, ratio, maxerror, &stats)) {
+			MYERROR("Could not simplify " << argv[i]);
+
+			success = false;
+			continue;
+		}
+
+		printf("%s: %u LODs in %.1f ms (%.0f triangles/ms)\n", argv[i], stats.numlods, stats.buildtime,
+			stats.numtriangles[0] / Math::Max(stats.buildtime, 1e-3f));
+
+		for (uint32_t j = 0; j < stats.numlods; ++j)
+			printf("    LOD %u: %u triangles, error %.5f\n", j, stats.numtriangles[j], stats.errors[j]);
+	}
+
+	return (success ? 0 : 1);
+}
+
+static int GenerateTangents(int first, int argc, char* argv[])
+{
+	// NOTE: regenerates the tangent frames of .qm files that have TANGENT/BINORMAL elements (the vertex stride is not changed), e.g. -tangents ../../Media/MeshesQM/mesh.qm -threads 8
+	TangentGenerator	generator;
+	TangentStatistics	stats;
+	ThreadPool*			threadpool	= nullptr;
+	uint32_t			numthreads	= 0;
+	bool				success		= true;
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+			numthreads = (uint32_t)atoi(argv[++i]);
+	}
+
+	threadpool = new ThreadPool(numthreads);
+	generator.SetThreadPool(threadpool);
+
+	for (int i = first; i < argc && argv[i][0] != '-'; ++i) {
+		if (!generator.GenerateQMTangents(argv[i], &stats)) {
+			MYERROR("Could not generate tangent frames for " << argv[i] << " (no TANGENT/BINORMAL elements?)");
+
+			success = false;
+			continue;
+		}
+
+		printf("%s: %u triangles, %u vertices in %.2f ms (%.0f triangles/ms, %u threads)\n", argv[i], stats.numtriangles, stats.numvertices,
+			stats.buildtime, stats.numtriangles / Math::Max(stats.buildtime, 1e-3f), threadpool->GetNumThreads());
+	}
+
+	delete threadpool;
+	return (success ? 0 : 1);
+}
+
 int main(int argc, char* argv[])
 {
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-bake") == 0)
+			return BakeProbes(i + 1, argc, argv);
+		else if (strcmp(argv[i], "-optimize") == 0)
+			return OptimizeMeshes(i + 1, argc, argv);
+		else if (strcmp(argv[i], "-simplify") == 0)
+			return SimplifyMeshes(i + 1, argc, argv);
+		else if (strcmp(argv[i], "-tangents") == 0)
+			return GenerateTangents(i + 1, argc, argv);
+	}
+
 	app = Application::Create(1360, 768);
 	app->SetTitle(TITLE);
 
@@ -5,13 +5,18 @@
 #pragma comment(lib, "gdiplus.lib")
 
 #include <iostream>
+#include <cstring>
+#include <vector>
 
 #include "..\Common\application.h"
+#include "..\Common\depthrasterizer.h"
 #include "..\Common\gtaorenderer.h"
 #include "..\Common\ldgtaorenderer.h"
 #include "..\Common\spectatorcamera.h"
+#include "..\Common\threadpool.h"
 
 #define METERS_PER_UNIT		0.01f	// for Sponza
+#define OCCLUSION_WIDTH		320		// software depth buffer for occlusion culling
 
 // helper macros
 #define TITLE				"Shader sample 54: Ground Truth-based Ambient Occlusion"
@@ -35,9 +40,18 @@ SpectatorCamera		camera;
 GTAORenderer*		gtaorenderer		= nullptr;
 LDGTAORenderer*		ldgtaorenderer		= nullptr;
 
+DepthRasterizer*	occlusionbuffer		= nullptr;
+ThreadPool*			workers				= nullptr;
+
+std::vector<Math::Vector3>	occluderpositions;
+std::vector<uint32_t>		occluderindices;
+std::vector<Math::AABox>	subsetboxes;		// object space
+std::vector<uint8_t>		subsetvisibility;
+
 int					rendermode			= 3;
 bool				drawtext			= true;
 bool				useldrenderer		= false;
+bool				useocclusionculling	= true;
 
 bool InitScene()
 {
@@ -70,6 +84,67 @@ bool InitScene()
 	GLCreateTextureFromFile("../../Media/Textures/vk_logo.jpg", true, &supplytex);
 	GLCreateTexture(1, 1, 1, GLFMT_A8B8G8R8, &supplynormalmap, &normal);
 
+	// copy occluder geometry (enabled subsets only) for the software rasterizer
+	OpenGLAttributeRange* subsets = model->GetAttributeTable();
+	void* vdata = nullptr;
+	void* idata = nullptr;
+	uint32_t stride = (uint32_t)model->GetNumBytesPerVertex();
+	bool index32 = (model->GetIndexType() == GL_UNSIGNED_INT);
+
+	occluderpositions.resize(model->GetNumVertices());
+	subsetboxes.resize(model->GetNumSubsets());
+	subsetvisibility.resize(model->GetNumSubsets(), 1);
+
+	model->LockVertexBuffer(0, 0, GLLOCK_READONLY, &vdata);
+	{
+		for (GLuint i = 0; i < model->GetNumVertices(); ++i)
+			memcpy(&occluderpositions[i], (uint8_t*)vdata + i * stride, sizeof(Math::Vector3));
+	}
+	model->UnlockVertexBuffer();
+
+	// NOTE: alpha-tested foliage would occlude what is behind its holes
+	const char* alphatested[] = {
+		"chain_texture.png",
+		"sponza_thorn_diff.png",
+		"vase_plant.png"
+	};
+
+	GLuint alphatextures[ARRAY_SIZE(alphatested)];
+
+	for (int i = 0; i < ARRAY_SIZE(alphatested); ++i)
+		alphatextures[i] = OpenGLContentManager().IDTexture(std::string("../../Media/MeshesQM/sponza/textures/") + alphatested[i]);
+
+	model->LockIndexBuffer(0, 0, GLLOCK_READONLY, &idata);
+	{
+		for (GLuint i = 0; i < model->GetNumSubsets(); ++i) {
+			if (!subsets[i].Enabled)
+				continue;
+
+			bool isoccluder = true;
+
+			for (int j = 0; j < ARRAY_SIZE(alphatextures); ++j) {
+				if (alphatextures[j] != 0 && materials[i].Texture == alphatextures[j])
+					isoccluder = false;
+			}
+
+			for (GLuint j = subsets[i].IndexStart; j < subsets[i].IndexStart + subsets[i].IndexCount; ++j) {
+				uint32_t index = (index32 ? ((uint32_t*)idata)[j] : ((uint16_t*)idata)[j]);
+
+				if (isoccluder)
+					occluderindices.push_back(index);
+
+				subsetboxes[i].Add(occluderpositions[index]);
+			}
+		}
+	}
+	model->UnlockIndexBuffer();
+
+	// NOTE: lower resolution than the screen, so thin gaps between occluders might get lost
+	workers = new ThreadPool();
+	occlusionbuffer = new DepthRasterizer(OCCLUSION_WIDTH, (OCCLUSION_WIDTH * screenheight) / screenwidth);
+
+	occlusionbuffer->SetThreadPool(workers);
+
 	for (GLuint i = 0; i < model->GetNumSubsets(); ++i) {
 		if (materials[i].Texture == 0)
 			materials[i].Texture = supplytex;
@@ -143,7 +218,7 @@ bool InitScene()
 	GLCreateTexture(512, 512, 1, GLFMT_A8B8G8R8, &helptext);
 
 	GLRenderText(
-		"Use WASD and mouse to move around\n\n1 - Scene only\n2 - Scene with GTAO (multi-bounce)\n3 - GTAO only\n4- Toggle low-disprecancy sequence\n\nB - Toggle temporal denoiser\nH - Toggle help text",
+		"Use WASD and mouse to move around\n\n1 - Scene only\n2 - Scene with GTAO (multi-bounce)\n3 - GTAO only\n4- Toggle low-disprecancy sequence\n\nB - Toggle temporal denoiser\nO - Toggle occlusion culling\nH - Toggle help text",
 		helptext, 512, 512);
 
 	return true;
@@ -153,6 +228,8 @@ void UninitScene()
 {
 	gbuffer->Detach(GL_COLOR_ATTACHMENT2);
 
+	delete occlusionbuffer;
+	delete workers;
 	delete ldgtaorenderer;
 	delete gtaorenderer;
 	delete gbuffereffect;
@@ -185,6 +262,10 @@ void KeyUp(KeyCode key)
 		drawtext = !drawtext;
 		break;
 
+	case KeyCodeO:
+		useocclusionculling = !useocclusionculling;
+		break;
+
 	case KeyCode1:
 		rendermode = 1;
 		break;
@@ -257,8 +338,10 @@ void RenderModel(const Math::Matrix& view, const Math::Matrix& proj, const Math:
 
 		gbuffereffect->Begin();
 		{
-			for (GLuint i = 0; i < model->GetNumSubsets(); ++i)
-				model->DrawSubset(i, true);
+			for (GLuint i = 0; i < model->GetNumSubsets(); ++i) {
+				if (!useocclusionculling || subsetvisibility[i])
+					model->DrawSubset(i, true);
+			}
 		}
 		gbuffereffect->End();
 	}
@@ -333,6 +416,17 @@ void Render(float alpha, float elapsedtime)
 	Math::MatrixMultiply(currWVP, world, view);
 	Math::MatrixMultiply(currWVP, currWVP, proj);
 
+	// occlusion culling
+	if (useocclusionculling) {
+		occlusionbuffer->Clear();
+		occlusionbuffer->AddMesh(
+			occluderpositions.data(), (uint32_t)occluderpositions.size(), sizeof(Math::Vector3),
+			occluderindices.data(), (uint32_t)occluderindices.size(), true, currWVP);
+
+		occlusionbuffer->Flush();
+		occlusionbuffer->TestBoxes(subsetvisibility.data(), subsetboxes.data(), (uint32_t)subsetboxes.size(), currWVP);
+	}
+
 	gbuffereffect->SetMatrix("matWorld", world);
 	gbuffereffect->SetMatrix("matWorldInv", worldinv);
 	gbuffereffect->SetMatrix("matView", view);
@@ -6,15 +6,19 @@
 
 #include <iostream>
 #include <random>
+#include <cstdio>
+#include <cstring>
 
 #include "..\Common\application.h"
 #include "..\Common\gl4ext.h"
 #include "..\Common\spectatorcamera.h"
 #include "..\Common\terrainquadtree.h"
+#include "..\Common\gridlodpatterns.h"
+#include "..\Common\threadpool.h"
 
 // tweakables
 #define DISP_MAP_SIZE		512					// 1024 max
-#define MESH_SIZE			256					// [64, 256] (or calculate index count for other levels)
+#define MESH_SIZE			256					// [64, 256] (index patterns are cached in Media/Cache)
 #define GRAV_ACCELERATION	9.81f				// m/s^2
 #define PATCH_SIZE			20.0f				// m
 #define FURTHEST_COVER		8					// full ocean size = PATCH_SIZE * (1 << FURTHEST_COVER)
@@ -27,18 +31,6 @@
 #define TITLE				"Shader sample 56: Ocean rendering"
 #define MYERROR(x)			{ std::cout << "* Error: " << x << "!\n"; }
 
-static const int IndexCounts[] = {
-	0,
-	0,
-	0,
-	0,
-	0,
-	0,
-	961920,		// 64x64
-	3705084,	// 128x128
-	14500728	// 256x256
-};
-
 Math::Color OceanColors[] = {
 	{ 0.0056f, 0.0194f, 0.0331f, 1 },	// deep blue
 	{ 0.1812f, 0.4678f, 0.5520f, 1 },	// carribbean
@@ -93,8 +85,6 @@ bool				drawtext		= true;
 extern void FFT_Test();
 
 void FourierTransform(GLuint spectrum);
-void GenerateLODLevels(OpenGLAttributeRange** subsettable, GLuint* numsubsets, uint32_t* idata);
-GLuint GenerateBoundaryMesh(int deg_left, int deg_top, int deg_right, int deg_bottom, int levelsize, uint32_t* idata);
 
 // static functions
 static float Phillips(const Math::Vector2& k, const Math::Vector2& w, float V, float A)
@@ -133,12 +123,6 @@ static float Fresnel(float alpha, float n1, float n2)
 	return 0.5f * (Rs + Rp);
 }
 
-static GLuint CalcSubsetIndex(int level, int dL, int dR, int dB, int dT)
-{
-	// returns the subset index of the given LOD levels
-	return 2 * (level * 3 * 3 * 3 * 3 + dL * 3 * 3 * 3 + dR * 3 * 3 + dB * 3 + dT);
-}
-
 // --- Sample impl ------------------------------------------------------------
 
 bool InitScene()
@@ -267,13 +251,27 @@ bool InitScene()
 
 	numlods = Math::Log2OfPow2(MESH_SIZE);
 
-	if (!GLCreateMesh((MESH_SIZE + 1) * (MESH_SIZE + 1), IndexCounts[numlods], GLMESH_32BIT, decl, &oceanmesh))
+	GridLODPatterns patterns;
+	char cachefile[64];
+
+	sprintf_s(cachefile, "../../Media/Cache/gridlod_%d_%u.bin", MESH_SIZE, numlods);
+
+	if (!patterns.Load(cachefile, MESH_SIZE, numlods)) {
+		ThreadPool workers;
+
+		patterns.SetThreadPool(&workers);
+		patterns.Generate(MESH_SIZE, numlods);
+
+		if (!patterns.Save(cachefile))
+			MYERROR("Could not write " << cachefile);
+	}
+
+	if (!GLCreateMesh((MESH_SIZE + 1) * (MESH_SIZE + 1), patterns.GetNumIndices(), GLMESH_32BIT, decl, &oceanmesh))
 		return false;
 
-	OpenGLAttributeRange* subsettable = nullptr;
+	OpenGLAttributeRange* subsettable = new OpenGLAttributeRange[patterns.GetNumSubsets()];
 	Math::Vector3* vdata = nullptr;
 	uint32_t* idata = nullptr;
-	GLuint numsubsets = 0;
 
 	oceanmesh->LockVertexBuffer(0, 0, GLLOCK_DISCARD, (void**)&vdata);
 	oceanmesh->LockIndexBuffer(0, 0, GLLOCK_DISCARD, (void**)&idata);
@@ -292,12 +290,13 @@ bool InitScene()
 		}
 
 		// index data
-		GenerateLODLevels(&subsettable, &numsubsets, idata);
+		memcpy(idata, patterns.GetIndices(), patterns.GetNumIndices() * sizeof(uint32_t));
+		patterns.GetAttributeTable(subsettable);
 	}
 	oceanmesh->UnlockIndexBuffer();
 	oceanmesh->UnlockVertexBuffer();
 
-	oceanmesh->SetAttributeTable(subsettable, numsubsets);
+	oceanmesh->SetAttributeTable(subsettable, patterns.GetNumSubsets());
 	delete[] subsettable;
 
 	// load shaders
@@ -433,241 +432,6 @@ bool InitScene()
 	return true;
 }
 
-void GenerateLODLevels(OpenGLAttributeRange** subsettable, GLuint* numsubsets, uint32_t* idata)
-{
-#define CALC_INNER_INDEX(x, z) \
-	((top + (z)) * (MESH_SIZE + 1) + left + (x))
-// END
-
-	assert(subsettable);
-	assert(numsubsets);
-
-	*numsubsets = (numlods - 2) * 3 * 3 * 3 * 3 * 2;
-	*subsettable = new OpenGLAttributeRange[*numsubsets];
-
-	int currsubset = 0;
-	GLuint indexoffset = 0;
-	GLuint numwritten = 0;
-	OpenGLAttributeRange* subset = 0;
-
-	//int numrestarts = 0;
-
-	for (uint32_t level = 0; level < numlods - 2; ++level) {
-		int levelsize = MESH_SIZE >> level;
-		int mindegree = levelsize >> 3;
-
-		for (int left_degree = levelsize; left_degree > mindegree; left_degree >>= 1) {
-			for (int right_degree = levelsize; right_degree > mindegree; right_degree >>= 1) {
-				for (int bottom_degree = levelsize; bottom_degree > mindegree; bottom_degree >>= 1) {
-					for (int top_degree = levelsize; top_degree > mindegree; top_degree >>= 1) {
-						int right	= ((right_degree == levelsize) ? levelsize : levelsize - 1);
-						int left	= ((left_degree == levelsize) ? 0 : 1);
-						int bottom	= ((bottom_degree == levelsize) ? levelsize : levelsize - 1);
-						int top		= ((top_degree == levelsize) ? 0 : 1);
-
-						// generate inner mesh (triangle strip)
-						int width = right - left;
-						int height = bottom - top;
-
-						numwritten = 0;
-
-						for (int z = 0; z < height; ++z) {
-							if ((z & 1) == 1) {
-								idata[numwritten++] = CALC_INNER_INDEX(0, z);
-								idata[numwritten++] = CALC_INNER_INDEX(0, z + 1);
-
-								for (int x = 0; x < width; ++x) {
-									idata[numwritten++] = CALC_INNER_INDEX(x + 1, z);
-									idata[numwritten++] = CALC_INNER_INDEX(x + 1, z + 1);
-								}
-
-								idata[numwritten++] = UINT32_MAX;
-								//++numrestarts;
-							} else {
-								idata[numwritten++] = CALC_INNER_INDEX(width, z + 1);
-								idata[numwritten++] = CALC_INNER_INDEX(width, z);
-
-								for (int x = width - 1; x >= 0; --x) {
-									idata[numwritten++] = CALC_INNER_INDEX(x, z + 1);
-									idata[numwritten++] = CALC_INNER_INDEX(x, z);
-								}
-
-								idata[numwritten++] = UINT32_MAX;
-								//++numrestarts;
-							}
-						}
-
-						// add inner subset
-						subset = ((*subsettable) + currsubset);
-
-						subset->AttribId		= currsubset;
-						subset->Enabled			= (numwritten > 0);
-						subset->IndexCount		= numwritten;
-						subset->IndexStart		= indexoffset;
-						subset->PrimitiveType	= GL_TRIANGLE_STRIP;
-						subset->VertexCount		= 0;
-						subset->VertexStart		= 0;
-
-						indexoffset += numwritten;
-						idata += numwritten;
-
-						++currsubset;
-
-						// generate boundary mesh (triangle list)
-						numwritten = GenerateBoundaryMesh(left_degree, top_degree, right_degree, bottom_degree, levelsize, idata);
-
-						// add boundary subset
-						subset = ((*subsettable) + currsubset);
-
-						subset->AttribId		= currsubset;
-						subset->Enabled			= (numwritten > 0);
-						subset->IndexCount		= numwritten;
-						subset->IndexStart		= indexoffset;
-						subset->PrimitiveType	= GL_TRIANGLES;
-						subset->VertexCount		= 0;
-						subset->VertexStart		= 0;
-
-						indexoffset += numwritten;
-						idata += numwritten;
-
-						++currsubset;
-					}
-				}
-			}
-		}
-	}
-
-	//OpenGLAttributeRange& lastsubset = (*subsettable)[currsubset - 1];
-	//printf("Total indices: %lu (%lu restarts)\n", lastsubset.IndexStart + lastsubset.IndexCount, numrestarts);
-}
-
-GLuint GenerateBoundaryMesh(int deg_left, int deg_top, int deg_right, int deg_bottom, int levelsize, uint32_t* idata)
-{
-#define CALC_BOUNDARY_INDEX(x, z) \
-	((z) * (MESH_SIZE + 1) + (x))
-// END
-
-	GLuint numwritten = 0;
-
-	// top edge
-	if (deg_top < levelsize) {
-		int t_step = levelsize / deg_top;
-
-		for (int i = 0; i < levelsize; i += t_step) {
-			idata[numwritten++] = CALC_BOUNDARY_INDEX(i, 0);
-			idata[numwritten++] = CALC_BOUNDARY_INDEX(i + t_step / 2, 1);
-			idata[numwritten++] = CALC_BOUNDARY_INDEX(i + t_step, 0);
-
-			for (int j = 0; j < t_step / 2; ++j) {
-				if (i == 0 && j == 0 && deg_left < levelsize)
-					continue;
-
-				idata[numwritten++] = CALC_BOUNDARY_INDEX(i, 0);
-				idata[numwritten++] = CALC_BOUNDARY_INDEX(i + j, 1);
-				idata[numwritten++] = CALC_BOUNDARY_INDEX(i + j + 1, 1);
-			}
-
-			for (int j = t_step / 2; j < t_step; ++j) {
-				if (i == levelsize - t_step && j == t_step - 1 && deg_right < levelsize)
-					continue;
-
-				idata[numwritten++] = CALC_BOUNDARY_INDEX(i + t_step, 0);
-				idata[numwritten++] = CALC_BOUNDARY_INDEX(i + j, 1);
-				idata[numwritten++] = CALC_BOUNDARY_INDEX(i + j + 1, 1);
-			}
-		}
-	}
-
-	// left edge
-	if (deg_left < levelsize) {
-		int l_step = levelsize / deg_left;
-
-		for (int i = 0; i < levelsize; i += l_step) {
-			idata[numwritten++] = CALC_BOUNDARY_INDEX(0, i);
-			idata[numwritten++] = CALC_BOUNDARY_INDEX(0, i + l_step);
-			idata[numwritten++] = CALC_BOUNDARY_INDEX(1, i + l_step / 2);
-
-			for (int j = 0; j < l_step / 2; ++j) {
-				if (i == 0 && j == 0 && deg_top < levelsize)
-					continue;
-
-				idata[numwritten++] = CALC_BOUNDARY_INDEX(0, i);
-				idata[numwritten++] = CALC_BOUNDARY_INDEX(1, i + j + 1);
-				idata[numwritten++] = CALC_BOUNDARY_INDEX(1, i + j);
-			}
-
-			for (int j = l_step / 2; j < l_step; ++j) {
-				if (i == levelsize - l_step && j == l_step - 1 && deg_bottom < levelsize)
-					continue;
-
-				idata[numwritten++] = CALC_BOUNDARY_INDEX(0, i + l_step);
-				idata[numwritten++] = CALC_BOUNDARY_INDEX(1, i + j + 1);
-				idata[numwritten++] = CALC_BOUNDARY_INDEX(1, i + j);
-			}
-		}
-	}
-
-	// right edge
-	if (deg_right < levelsize) {
-		int r_step = levelsize / deg_right;
-
-		for (int i = 0; i < levelsize; i += r_step) {
-			idata[numwritten++] = CALC_BOUNDARY_INDEX(levelsize, i);
-			idata[numwritten++] = CALC_BOUNDARY_INDEX(levelsize - 1, i + r_step / 2);
-			idata[numwritten++] = CALC_BOUNDARY_INDEX(levelsize, i + r_step);
-
-			for (int j = 0; j < r_step / 2; ++j) {
-				if (i == 0 && j == 0 && deg_top < levelsize)
-					continue;
-
-				idata[numwritten++] = CALC_BOUNDARY_INDEX(levelsize, i);
-				idata[numwritten++] = CALC_BOUNDARY_INDEX(levelsize - 1, i + j);
-				idata[numwritten++] = CALC_BOUNDARY_INDEX(levelsize - 1, i + j + 1);
-			}
-
-			for (int j = r_step / 2; j < r_step; ++j) {
-				if (i == levelsize - r_step && j == r_step - 1 && deg_bottom < levelsize)
-					continue;
-
-				idata[numwritten++] = CALC_BOUNDARY_INDEX(levelsize, i + r_step);
-				idata[numwritten++] = CALC_BOUNDARY_INDEX(levelsize - 1, i + j);
-				idata[numwritten++] = CALC_BOUNDARY_INDEX(levelsize - 1, i + j + 1);
-			}
-		}
-	}
-
-	// bottom edge
-	if (deg_bottom < levelsize) {
-		int b_step = levelsize / deg_bottom;
-
-		for (int i = 0; i < levelsize; i += b_step) {
-			idata[numwritten++] = CALC_BOUNDARY_INDEX(i, levelsize);
-			idata[numwritten++] = CALC_BOUNDARY_INDEX(i + b_step, levelsize);
-			idata[numwritten++] = CALC_BOUNDARY_INDEX(i + b_step / 2, levelsize - 1);
-
-			for (int j = 0; j < b_step / 2; ++j) {
-				if (i == 0 && j == 0 && deg_left < levelsize)
-					continue;
-
-				idata[numwritten++] = CALC_BOUNDARY_INDEX(i, levelsize);
-				idata[numwritten++] = CALC_BOUNDARY_INDEX(i + j + 1, levelsize - 1);
-				idata[numwritten++] = CALC_BOUNDARY_INDEX(i + j, levelsize - 1);
-			}
-
-			for (int j = b_step / 2; j < b_step; ++j) {
-				if (i == levelsize - b_step && j == b_step - 1 && deg_right < levelsize)
-					continue;
-
-				idata[numwritten++] = CALC_BOUNDARY_INDEX(i + b_step, levelsize);
-				idata[numwritten++] = CALC_BOUNDARY_INDEX(i + j + 1, levelsize - 1);
-				idata[numwritten++] = CALC_BOUNDARY_INDEX(i + j, levelsize - 1);
-			}
-		}
-	}
-
-	return numwritten;
-}
-
 void UninitScene()
 {
 	delete oceanmesh;
@@ -911,8 +675,8 @@ void Render(float alpha, float elapsedtime)
 		skyeffect->End();
 	}
 
-	// build quadtree
-	tree.Rebuild(viewproj, proj, eye);
+	// build quadtree (reuses last frame's tree)
+	tree.RebuildIncremental(viewproj, proj, eye);
 
 	// render ocean
 	Math::Matrix	flipYZ			= { 1, 0, 0, 0, 0, 0, 1, 0, 0, 1, 0, 0, 0, 0, 0, 1 };
@@ -920,7 +684,6 @@ void Render(float alpha, float elapsedtime)
 	Math::Vector4	uvparams		= { 0, 0, 0, 0 };
 	Math::Vector4	perlinoffset	= { 0, 0, 0, 0 };
 	Math::Vector2	w				= WIND_DIRECTION;
-	int				pattern[4];
 	OpenGLEffect*	effect			= (use_debug ? wireeffect : oceaneffect);
 	GLuint			subset			= 0;
 
@@ -956,31 +719,31 @@ void Render(float alpha, float elapsedtime)
 		glActiveTexture(GL_TEXTURE3);
 		glBindTexture(GL_TEXTURE_2D, gradients);
 
-		tree.Traverse([&](const TerrainQuadTree::Node& node) {
-			float levelsize = (float)(MESH_SIZE >> node.lod);
-			float scale = node.length / levelsize;
+		// NOTE: patches are sorted by subset
+		for (const TerrainQuadTree::Patch& patch : tree.GetPatches()) {
+			float levelsize = (float)(MESH_SIZE >> patch.lod);
+			float scale = patch.length / levelsize;
 
 			Math::MatrixScaling(localtraf, scale, scale, 0);
 
-			Math::MatrixTranslation(world, node.start[0], 0, node.start[1]);
+			Math::MatrixTranslation(world, patch.start[0], 0, patch.start[1]);
 			Math::MatrixMultiply(world, flipYZ, world);
 
-			uvparams.z = node.start[0] / PATCH_SIZE;
-			uvparams.w = node.start[1] / PATCH_SIZE;
+			uvparams.z = patch.start[0] / PATCH_SIZE;
+			uvparams.w = patch.start[1] / PATCH_SIZE;
 
 			effect->SetMatrix("matLocal", localtraf);
 			effect->SetMatrix("matWorld", world);
 			effect->SetVector("uvParams", uvparams);
 			effect->CommitChanges();
 
-			tree.FindSubsetPattern(pattern, node);
-			subset = CalcSubsetIndex(node.lod, pattern[0], pattern[1], pattern[2], pattern[3]);
+			subset = 2 * patch.subset;
 
 			if (subset < oceanmesh->GetNumSubsets() - 1) {
 				oceanmesh->DrawSubset(subset);
 				oceanmesh->DrawSubset(subset + 1);
 			}
-		});
+		}
 
 		glActiveTexture(GL_TEXTURE0);
 	}
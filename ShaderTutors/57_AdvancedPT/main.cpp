@@ -6,11 +6,22 @@
 
 #include <iostream>
 #include <sstream>
+#include <chrono>
+#include <cmath>
+#include <vector>
 
 #include "..\Common\application.h"
 #include "..\Common\gl4ext.h"
 #include "..\Common\gl4bvh.h"
 #include "..\Common\spectatorcamera.h"
+#include "..\Common\cpupathtracer.h"
+#include "..\Common\scenepackage.h"
+#include "..\Common\threadpool.h"
+
+#ifdef _WIN32
+// NOTE: include after gl4ext.h
+#	include <gdiplus.h>
+#endif
 
 // render control
 const bool BIDIRECTIONAL			= false;
@@ -30,44 +41,6 @@ const char* SCENE_FILE			= "veach-bidir/veach-bidir";
 #define TITLE				"Shader sample 57: Advanced Monte Carlo methods"
 #define MYERROR(x)			{ std::cout << "* Error: " << x << "!\n"; }
 
-// sample enums
-enum BSDFType
-{
-	BSDFTypeDiffuse = 0,
-	BSDFTypeSpecular = 1,		// Dirac delta (when roughness < 0.1)
-	BSDFTypeInsulator = 2,
-	BSDFTypeConductor = 4,		// metals
-	BSDFTypeDielectric = 8,		// glass, diamond, etc.
-	BSDFTypeTransparent = 16	// alpha-blended diffuse
-};
-
-enum ShapeType
-{
-	ShapeTypePlate = 2,
-	ShapeTypeSphere = 4
-};
-
-// sample structures
-struct BSDFInfo
-{
-	Math::Color	color;
-	uint32_t	textureID;
-	uint32_t	bsdftype;
-	uint32_t	roughness;
-	uint32_t	eta;
-};
-
-struct AreaLight
-{
-	Math::Matrix	tounit;
-	Math::Matrix	toworld;
-	Math::Vector3	luminance;
-	uint32_t		shapetype;
-};
-
-static_assert(sizeof(BSDFInfo) == 32, "sizeof(BSDFInfo) must be 32 B");
-static_assert(sizeof(AreaLight) == 144, "sizeof(AreaLight) must be 144 B");
-
 // sample variables
 Application*		app				= nullptr;
 
@@ -98,7 +71,51 @@ uint32_t			screenwidth;
 uint32_t			screenheight;
 bool				drawtext		= true;
 
-static bool LoadScene(const std::string& filepath)
+// regression mode (GPU vs. CPU reference)
+std::string			regressionfile;
+std::string			regressionoutput;
+uint32_t			regressionspp	= 0;
+uint32_t			numpasses		= 0;
+float				regressiontolerance	= 0.05f;
+int					exitcode		= 0;
+
+static void CreateSceneBuffers(AreaLight* lights, BSDFInfo* materials, uint32_t nummaterials)
+{
+	if (WHITE_FURNACE_TEST) {
+		for (uint32_t i = 0; i < nummaterials; ++i) {
+			BSDFInfo& mat = materials[i];
+			
+			mat.bsdftype = BSDFTypeDiffuse;
+			mat.color = Math::Color(1, 1, 1, 1);
+			mat.textureID = -1;
+		}
+
+		for (uint32_t i = 0; i < numlights; ++i) {
+			AreaLight& light = lights[i];
+
+			light.luminance = Math::Vector3(1, 1, 1);
+		}
+	}
+
+	if (numlights > 0) {
+		// fill light buffer
+		glGenBuffers(1, &lightbuffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightbuffer);
+
+		glBufferStorage(GL_SHADER_STORAGE_BUFFER, (numlights + 1) * sizeof(AreaLight), lights, 0);
+	}
+
+	if (nummaterials > 0) {
+		// fill material buffer
+		glGenBuffers(1, &materialbuffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, materialbuffer);
+
+		glBufferStorage(GL_SHADER_STORAGE_BUFFER, nummaterials * sizeof(BSDFInfo), materials, 0);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	}
+}
+
+static bool LoadSceneFromFiles(const std::string& filepath)
 {
 	std::string path = "../../Media/MeshesQM/" + filepath + ".qm";
 	std::string name;
@@ -179,22 +196,6 @@ static bool LoadScene(const std::string& filepath)
 
 	fclose(infile);
 
-	if (WHITE_FURNACE_TEST) {
-		for (uint32_t i = 0; i < nummaterials; ++i) {
-			BSDFInfo& mat = materials[i];
-			
-			mat.bsdftype = BSDFTypeDiffuse;
-			mat.color = Math::Color(1, 1, 1, 1);
-			mat.textureID = -1;
-		}
-
-		for (uint32_t i = 0; i < numlights; ++i) {
-			AreaLight& light = lights[i];
-
-			light.luminance = Math::Vector3(1, 1, 1);
-		}
-	}
-
 	if (numtextures > 0) {
 		// load textures
 		if (!GLCreateTextureArrayFromFiles(texturenames, numtextures, true, &textures)) {
@@ -202,22 +203,7 @@ static bool LoadScene(const std::string& filepath)
 		}
 	}
 
-	if (numlights > 0) {
-		// fill light buffer
-		glGenBuffers(1, &lightbuffer);
-		glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightbuffer);
-
-		glBufferStorage(GL_SHADER_STORAGE_BUFFER, (numlights + 1) * sizeof(AreaLight), lights, 0);
-	}
-
-	if (nummaterials > 0) {
-		// fill material buffer
-		glGenBuffers(1, &materialbuffer);
-		glBindBuffer(GL_SHADER_STORAGE_BUFFER, materialbuffer);
-
-		glBufferStorage(GL_SHADER_STORAGE_BUFFER, nummaterials * sizeof(BSDFInfo), materials, 0);
-		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
-	}
+	CreateSceneBuffers(lights, materials, nummaterials);
 
 	camera.SetFov(fov);
 	camera.SetEyePosition(eye.x, eye.y, eye.z);
@@ -238,6 +224,165 @@ static bool LoadScene(const std::string& filepath)
 	return true;
 }
 
+static bool LoadSceneFromPackage(const std::string& file)
+{
+	ScenePackage package;
+
+	if (!package.Open(file.c_str()))
+		return false;
+
+	uint32_t numvertices = 0, numindices = 0, numsubsets = 0, numoverrides = 0, nummaterials = 0, numpackagelights = 0;
+	uint32_t numcameras = 0, numinfos = 0, numlayers = 0, numnodes = 0, numtriangleIDs = 0;
+
+	// NOTE: the sections are used in place, only the lights and materials are copied (dummy light, furnace test)
+	const GeometryUtils::CommonVertex* vertices = package.GetSection<GeometryUtils::CommonVertex>(ScenePackageSectionVertices, &numvertices);
+	const uint32_t* indices = package.GetSection<uint32_t>(ScenePackageSectionIndices, &numindices);
+	const ScenePackageSubset* subsets = package.GetSection<ScenePackageSubset>(ScenePackageSectionSubsets, &numsubsets);
+	const uint32_t* overridetable = package.GetSection<uint32_t>(ScenePackageSectionMaterialOverrides, &numoverrides);
+	const AreaLight* packagelights = package.GetSection<AreaLight>(ScenePackageSectionLights, &numpackagelights);
+	const BSDFInfo* packagematerials = package.GetSection<BSDFInfo>(ScenePackageSectionMaterials, &nummaterials);
+	const ScenePackageCamera* packagecamera = package.GetSection<ScenePackageCamera>(ScenePackageSectionCamera, &numcameras);
+	const ScenePackageTextureArray* texinfo = package.GetSection<ScenePackageTextureArray>(ScenePackageSectionTextureInfo, &numinfos);
+	const uint8_t* texels = nullptr;
+	const ScenePackageBVHNode* bvhnodes = package.GetSection<ScenePackageBVHNode>(ScenePackageSectionBVHNodes, &numnodes);
+	const uint32_t* bvhtriangles = (const uint32_t*)package.GetSection(ScenePackageSectionBVHTriangles, &numtriangleIDs, 8);
+
+	// NOTE: validate every section before creating any GL object (a bad package falls back to LoadSceneFromFiles)
+	if (vertices == nullptr || indices == nullptr || subsets == nullptr || numcameras == 0)
+		return false;
+
+	if (overridetable == nullptr || numoverrides < numsubsets || numindices % 3 != 0)
+		return false;
+
+	for (uint32_t i = 0; i < numsubsets; ++i) {
+		const ScenePackageSubset& subset = subsets[i];
+
+		if (subset.IndexCount % 3 != 0 || subset.IndexStart > numindices || subset.IndexCount > numindices - subset.IndexStart)
+			return false;
+
+		if (subset.VertexStart > numvertices || subset.VertexCount > numvertices - subset.VertexStart)
+			return false;
+
+		if (nummaterials > 0 && overridetable[i] >= nummaterials)
+			return false;
+	}
+
+	for (uint32_t i = 0; i < numindices; ++i) {
+		if (indices[i] >= numvertices)
+			return false;
+	}
+
+	if (numinfos > 0 && texinfo->numlayers > 0) {
+		texels = (const uint8_t*)package.GetSection(ScenePackageSectionTexels, &numlayers, texinfo->width * texinfo->height * 4);
+
+		if (texels == nullptr || numlayers != texinfo->numlayers)
+			return false;
+	}
+
+	// create mesh
+	OpenGLVertexElement decl[] = {
+		{ 0, 0, GLDECLTYPE_FLOAT3, GLDECLUSAGE_POSITION, 0 },
+		{ 0, 12, GLDECLTYPE_FLOAT3, GLDECLUSAGE_NORMAL, 0 },
+		{ 0, 24, GLDECLTYPE_FLOAT2, GLDECLUSAGE_TEXCOORD, 0 },
+		{ 0xff, 0, 0, 0, 0 }
+	};
+
+	std::vector<OpenGLAttributeRange> table(numsubsets);
+	void* data = nullptr;
+
+	if (!GLCreateMesh(numvertices, numindices, GLMESH_32BIT, decl, &model))
+		return false;
+
+	if (texels != nullptr && !GLCreateTextureArrayFromMemory(texels, texinfo->width, texinfo->height, numlayers, (texinfo->srgb != 0), &textures)) {
+		delete model;
+		model = nullptr;
+
+		return false;
+	}
+
+	model->LockVertexBuffer(0, 0, GLLOCK_DISCARD, &data);
+	memcpy(data, vertices, numvertices * sizeof(GeometryUtils::CommonVertex));
+	model->UnlockVertexBuffer();
+
+	model->LockIndexBuffer(0, 0, GLLOCK_DISCARD, &data);
+	memcpy(data, indices, numindices * sizeof(uint32_t));
+	model->UnlockIndexBuffer();
+
+	for (uint32_t i = 0; i < numsubsets; ++i) {
+		OpenGLAttributeRange& subset = table[i];
+
+		subset.AttribId			= i;
+		subset.PrimitiveType	= GLPT_TRIANGLELIST;
+		subset.Enabled			= GL_TRUE;
+		subset.IndexStart		= subsets[i].IndexStart;
+		subset.IndexCount		= subsets[i].IndexCount;
+		subset.VertexStart		= subsets[i].VertexStart;
+		subset.VertexCount		= subsets[i].VertexCount;
+	}
+
+	model->SetAttributeTable(table.data(), numsubsets);
+
+	// load scene info (nothing can fail from here on)
+	std::vector<AreaLight> lights(packagelights, packagelights + numpackagelights);
+	std::vector<BSDFInfo> materials(packagematerials, packagematerials + nummaterials);
+
+	numlights = numpackagelights;
+
+	if (numlights > 0) {
+		lights.resize(numlights + 1);
+
+		// dummy light
+		lights[numlights].luminance = Math::Vector3(0, 0, 0);
+		lights[numlights].shapetype = ShapeTypeSphere;
+
+		Math::MatrixIdentity(lights[numlights].tounit);
+		Math::MatrixIdentity(lights[numlights].toworld);
+	}
+
+	CreateSceneBuffers(lights.data(), materials.data(), nummaterials);
+
+	camera.SetFov(packagecamera->fov);
+	camera.SetEyePosition(packagecamera->eye.x, packagecamera->eye.y, packagecamera->eye.z);
+	camera.SetOrientation(packagecamera->orient.x, packagecamera->orient.y, packagecamera->orient.z);
+
+	// upload BVH
+	static_assert(sizeof(ScenePackageBVHNode) == sizeof(OpenGLBVHNode), "BVH node layouts must match");
+
+	accelstructure = new OpenGLBVH();
+
+	if (bvhnodes != nullptr && bvhtriangles != nullptr) {
+		accelstructure->Load((const OpenGLBVHNode*)bvhnodes, numnodes, bvhtriangles, numtriangleIDs);
+	} else {
+		std::string name, path;
+
+		Math::GetFile(name, file);
+		path = "../../Media/Cache/" + name.substr(0, name.find_last_of('.')) + ".bvh";
+
+		model->CalculateBoundingBox();
+		accelstructure->Build(model, (uint32_t*)overridetable, path.c_str());
+	}
+
+	return true;
+}
+
+static bool LoadScene(const std::string& filepath)
+{
+	// NOTE: prefer the scene package (see -pack)
+	std::string path = "../../Media/MeshesQM/" + filepath + ".scene";
+	auto start = std::chrono::high_resolution_clock::now();
+	bool packaged = LoadSceneFromPackage(path);
+
+	if (!packaged && !LoadSceneFromFiles(filepath))
+		return false;
+
+	auto end = std::chrono::high_resolution_clock::now();
+
+	std::cout << "Scene loaded from " << (packaged ? "package" : "files") << " in "
+		<< std::chrono::duration<double, std::milli>(end - start).count() << " ms\n";
+
+	return true;
+}
+
 static void UpdateText()
 {
 	std::stringstream ss;
@@ -251,6 +396,146 @@ static void UpdateText()
 		helptext, 512, 512);
 }
 
+static bool ReadPFM(std::vector<float>& out, uint32_t& width, uint32_t& height, const char* file)
+{
+	// NOTE: RGB, the first row of 'out' is the top of the image
+	FILE* infile = nullptr;
+	float scale = 0;
+	char magic[3] = { 0, 0, 0 };
+
+	fopen_s(&infile, file, "rb");
+
+	if (!infile)
+		return false;
+
+	bool valid = (fread(magic, 1, 2, infile) == 2 && strcmp(magic, "PF") == 0);
+
+	// a single whitespace separates the header from the data
+	valid = valid && (fscanf_s(infile, "%u %u %f", &width, &height, &scale) == 3);
+	valid = valid && (width > 0 && height > 0 && scale < 0 && fgetc(infile) != EOF);
+
+	if (valid) {
+		out.resize(width * height * 3);
+
+		for (uint32_t y = height; y-- > 0;) {
+			if (fread(&out[y * width * 3], sizeof(float), width * 3, infile) != width * 3) {
+				valid = false;
+				break;
+			}
+		}
+	}
+
+	fclose(infile);
+	return valid;
+}
+
+static bool WritePFM(const char* file, const std::vector<float>& rgb, uint32_t width, uint32_t height)
+{
+	FILE* outfile = nullptr;
+
+	fopen_s(&outfile, file, "wb");
+
+	if (!outfile)
+		return false;
+
+	fprintf(outfile, "PF\n%u %u\n-1.0\n", width, height);
+
+	for (uint32_t y = height; y-- > 0;)
+		fwrite(&rgb[y * width * 3], sizeof(float), width * 3, outfile);
+
+	fclose(outfile);
+	return true;
+}
+
+static double CompareImages(const std::vector<float>& image, const std::vector<float>& reference, uint32_t width, uint32_t height, uint32_t& numinvalid)
+{
+	// NOTE: compares 16x16 block means, so that the noise of a few hundred spp mostly averages out
+	const uint32_t blocksize = 16;
+	double sumdiff = 0;
+	double sumref = 0;
+
+	numinvalid = 0;
+
+	for (uint32_t by = 0; by < height; by += blocksize) {
+		for (uint32_t bx = 0; bx < width; bx += blocksize) {
+			double imagesum[3] = { 0, 0, 0 };
+			double refsum[3] = { 0, 0, 0 };
+
+			for (uint32_t y = by; y < Math::Min(by + blocksize, height); ++y) {
+				for (uint32_t x = bx; x < Math::Min(bx + blocksize, width); ++x) {
+					const float* rgb = &image[(y * width + x) * 3];
+					const float* refrgb = &reference[(y * width + x) * 3];
+
+					if (!std::isfinite(rgb[0]) || !std::isfinite(rgb[1]) || !std::isfinite(rgb[2])) {
+						++numinvalid;
+						continue;
+					}
+
+					for (int i = 0; i < 3; ++i) {
+						imagesum[i] += rgb[i];
+						refsum[i] += refrgb[i];
+					}
+				}
+			}
+
+			for (int i = 0; i < 3; ++i) {
+				sumdiff += fabs(imagesum[i] - refsum[i]);
+				sumref += refsum[i];
+			}
+		}
+	}
+
+	return sumdiff / Math::Max(sumref, 1e-6);
+}
+
+static int CompareWithReference()
+{
+	std::vector<float>	reference;
+	std::vector<float>	pixels(screenwidth * screenheight * 4);
+	std::vector<float>	image(screenwidth * screenheight * 3);
+	uint32_t			refwidth	= 0;
+	uint32_t			refheight	= 0;
+	uint32_t			numinvalid	= 0;
+
+	if (!ReadPFM(reference, refwidth, refheight, regressionfile.c_str())) {
+		MYERROR("Could not read " << regressionfile << " (render it with -reference " << regressionfile << ")");
+		return 1;
+	}
+
+	if (refwidth != screenwidth || refheight != screenheight) {
+		MYERROR("The reference is " << refwidth << "x" << refheight << " but the window is " << screenwidth << "x" << screenheight);
+		return 1;
+	}
+
+	// the first row of the render target is the bottom of the image
+	glBindTexture(GL_TEXTURE_2D, rendertarget);
+	glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, pixels.data());
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	for (uint32_t y = 0; y < screenheight; ++y) {
+		for (uint32_t x = 0; x < screenwidth; ++x) {
+			const float* rgba = &pixels[((screenheight - 1 - y) * screenwidth + x) * 4];
+			float* rgb = &image[(y * screenwidth + x) * 3];
+
+			rgb[0] = rgba[0];
+			rgb[1] = rgba[1];
+			rgb[2] = rgba[2];
+		}
+	}
+
+	if (!regressionoutput.empty() && !WritePFM(regressionoutput.c_str(), image, screenwidth, screenheight))
+		MYERROR("Could not write " << regressionoutput);
+
+	double error = CompareImages(image, reference, screenwidth, screenheight, numinvalid);
+	bool passed = (error <= regressiontolerance && numinvalid == 0);
+
+	std::cout << (BIDIRECTIONAL ? "bdpt.comp" : "udpt.comp") << " (" << regressionspp << " spp) vs " << regressionfile << ": "
+		<< error * 100.0 << "% block error (tolerance " << regressiontolerance * 100.0f << "%), "
+		<< numinvalid << " invalid pixels -> " << (passed ? "PASSED" : "FAILED") << "\n";
+
+	return (passed ? 0 : 1);
+}
+
 bool InitScene()
 {
 	std::stringstream defines;
@@ -479,6 +764,8 @@ void Render(float alpha, float elapsedtime)
 
 		glClearTexImage(accumtarget, 0, GL_RGBA, GL_FLOAT, zeroes);
 		glClearTexImage(countertarget, 0, GL_RG, GL_FLOAT, zeroes);
+
+		numpasses = 0;
 	}
 
 	float cameraarea = Math::ImagePlaneArea(proj);
@@ -526,6 +813,15 @@ void Render(float alpha, float elapsedtime)
 	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
 	glActiveTexture(GL_TEXTURE0);
 
+	if (!regressionfile.empty() && ++numpasses == regressionspp) {
+		glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+		exitcode = CompareWithReference();
+
+#ifdef _WIN32
+		SendMessage((HWND)app->GetHandle(), WM_CLOSE, 0, 0);
+#endif
+	}
+
 	// present
 	Math::MatrixIdentity(world);
 	screenquad->SetTextureMatrix(world);
@@ -591,8 +887,272 @@ void Render(float alpha, float elapsedtime)
 	app->Present();
 }
 
+static void LoadReferenceTextures(CPUPathTracer& reference)
+{
+#ifdef _WIN32
+	Gdiplus::GdiplusStartupInput	gdiplustartup;
+	ULONG_PTR						gdiplustoken;
+
+	// NOTE: the Win32 application isn't created in reference mode
+	Gdiplus::GdiplusStartup(&gdiplustoken, &gdiplustartup, NULL);
+
+	for (uint32_t i = 0; i < reference.GetNumTextures(); ++i) {
+		const std::string& file = reference.GetTextureName(i);
+		std::wstring wstr;
+		int size = MultiByteToWideChar(CP_UTF8, 0, file.c_str(), (int)file.size(), 0, 0);
+
+		wstr.resize(size);
+		MultiByteToWideChar(CP_UTF8, 0, file.c_str(), (int)file.size(), &wstr[0], size);
+
+		Gdiplus::Bitmap* bitmap = Gdiplus::Bitmap::FromFile(wstr.c_str(), FALSE);
+
+		if (bitmap->GetLastStatus() != Gdiplus::Ok) {
+			MYERROR("Could not load " << file);
+
+			delete bitmap;
+			continue;
+		}
+
+		Gdiplus::BitmapData data;
+		std::vector<uint8_t> imgdata;
+
+		bitmap->LockBits(0, Gdiplus::ImageLockModeRead, PixelFormat32bppARGB, &data);
+		{
+			imgdata.resize(data.Width * data.Height * 4);
+
+			for (UINT j = 0; j < data.Height; ++j) {
+				const uint8_t* row = (const uint8_t*)data.Scan0 + j * data.Stride;
+
+				// swap red and blue
+				for (UINT k = 0; k < data.Width; ++k) {
+					UINT index = (j * data.Width + k) * 4;
+
+					imgdata[index + 0] = row[k * 4 + 2];
+					imgdata[index + 1] = row[k * 4 + 1];
+					imgdata[index + 2] = row[k * 4 + 0];
+					imgdata[index + 3] = row[k * 4 + 3];
+				}
+			}
+		}
+		bitmap->UnlockBits(&data);
+
+		reference.SetTexture(i, data.Width, data.Height, imgdata.data());
+		delete bitmap;
+	}
+
+	Gdiplus::GdiplusShutdown(gdiplustoken);
+#endif
+}
+
+static int RenderReference(const char* outfile, int argc, char* argv[])
+{
+	// NOTE: ground truth for the shaders, e.g. -reference veach.hdr -spp 4096 -threads 16 -bdpt
+	CPUPathTracer	reference;
+	SpectatorCamera	refcamera;
+	ThreadPool*		threadpool		= nullptr;
+	Math::Matrix	view, proj;
+	uint32_t		numsamples		= 256;
+	uint32_t		numthreads		= 0;
+	uint32_t		maxdepth		= 15;
+	uint32_t		flags			= 0;
+	bool			bidirectional	= BIDIRECTIONAL;
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-spp") == 0 && i + 1 < argc)
+			numsamples = (uint32_t)atoi(argv[++i]);
+		else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+			numthreads = (uint32_t)atoi(argv[++i]);
+		else if (strcmp(argv[i], "-maxdepth") == 0 && i + 1 < argc)
+			maxdepth = (uint32_t)atoi(argv[++i]);
+		else if (strcmp(argv[i], "-bdpt") == 0)
+			bidirectional = true;
+		else if (strcmp(argv[i], "-udpt") == 0)
+			bidirectional = false;
+	}
+
+	if (bidirectional)
+		flags |= CPUPathTracerFlagBidirectional;
+
+	if (ENABLE_TWOSIDED)
+		flags |= CPUPathTracerFlagTwoSided;
+
+	if (NEXT_EVENT_ESTIMATION)
+		flags |= CPUPathTracerFlagNextEvent;
+
+	std::string qmfile = "../../Media/MeshesQM/" + std::string(SCENE_FILE) + ".qm";
+	std::string infofile = "../../Media/MeshesQM/" + std::string(SCENE_FILE) + ".info";
+	std::string packagefile = "../../Media/MeshesQM/" + std::string(SCENE_FILE) + ".scene";
+	ScenePackage package;
+	bool packaged = package.Open(packagefile.c_str());
+
+	if (packaged ? !reference.LoadScene(package) : !reference.LoadScene(qmfile.c_str(), infofile.c_str())) {
+		MYERROR("Could not load scene");
+		return 1;
+	}
+
+	package.Close();
+
+	if (WHITE_FURNACE_TEST)
+		reference.ConvertToWhiteFurnace();
+	else if (!packaged)
+		LoadReferenceTextures(reference);
+
+	// same camera as the window
+	const Math::Vector3& eye = reference.GetCameraEye();
+	const Math::Vector3& orient = reference.GetCameraOrientation();
+
+	refcamera.SetFov(reference.GetCameraFov());
+	refcamera.SetEyePosition(eye.x, eye.y, eye.z);
+	refcamera.SetOrientation(orient.x, orient.y, orient.z);
+	refcamera.SetAspect(1360.0f / 768.0f);
+	refcamera.SetClipPlanes(0.1f, 50.0f);
+	refcamera.SetIntertia(false);
+
+	refcamera.Animate(1.0f);
+	refcamera.GetViewMatrix(view);
+	refcamera.GetProjectionMatrix(proj);
+
+	threadpool = new ThreadPool(numthreads);
+
+	reference.SetThreadPool(threadpool);
+	reference.SetResolution(1360, 768);
+	reference.SetCamera(view, proj);
+	reference.SetFlags(flags);
+	reference.SetMaxDepth(maxdepth);
+
+	std::cout << "Rendering " << reference.GetNumTriangles() << " triangles with " << threadpool->GetNumThreads() << " threads ("
+		<< (bidirectional ? "bidirectional" : "unidirectional") << ")\n";
+
+	while (reference.GetNumSamples() < numsamples) {
+		reference.RenderPass(Math::Min<uint32_t>(16, numsamples - reference.GetNumSamples()));
+
+		if (!reference.WriteHDR(outfile)) {
+			MYERROR("Could not write " << outfile);
+			break;
+		}
+
+		std::cout << reference.GetNumSamples() << "/" << numsamples << " spp, "
+			<< (reference.GetSamplesPerSecond() / 1000000.0) << " Msamples/s, "
+			<< reference.GetNumSteals() << " steals\n";
+	}
+
+	if (reference.GetNumInvalidSamples() > 0)
+		std::cout << reference.GetNumInvalidSamples() << " invalid samples were dropped\n";
+
+	delete threadpool;
+	return 0;
+}
+
+static bool PackScene(const std::string& filepath)
+{
+	SceneDescription			scene;
+	ScenePackageWriter			writer;
+	ScenePackageTextureArray	texinfo;
+	std::vector<std::string>	texturenames;
+	std::vector<uint8_t>		texels;
+	std::string					name;
+	std::string					path = "../../Media/MeshesQM/" + filepath;
+
+	Math::GetFile(name, filepath);
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	if (!scene.LoadQM((path + ".qm").c_str()) || !scene.LoadInfo((path + ".info").c_str())) {
+		MYERROR("Could not load " << filepath);
+		return false;
+	}
+
+	if (!scene.LoadBVHCache(("../../Media/Cache/" + name + ".bvh").c_str()))
+		std::cout << "No BVH cache for " << filepath << ", it will be built when the package is loaded\n";
+
+	writer.AddScene(scene);
+
+	if (!scene.texturenames.empty()) {
+		for (const std::string& texname : scene.texturenames)
+			texturenames.push_back("../../Media/MeshesQM/" + name + "/" + texname);
+
+		// NOTE: the same texture array as GLCreateTextureArrayFromFiles (mip 0), mipmaps are generated on upload
+		if (!GLDecodeTextureArray(texturenames.data(), (uint32_t)texturenames.size(), texels, texinfo.width, texinfo.height)) {
+			MYERROR("Could not load the textures of " << filepath);
+			return false;
+		}
+
+		texinfo.numlayers = (uint32_t)texturenames.size();
+		texinfo.srgb = 1;
+
+		writer.AddSection(ScenePackageSectionTextureInfo, &texinfo, 1, sizeof(ScenePackageTextureArray));
+		writer.AddSection(ScenePackageSectionTexels, texels.data(), texinfo.numlayers, texinfo.width * texinfo.height * 4);
+	}
+
+	auto middle = std::chrono::high_resolution_clock::now();
+
+	if (!writer.Write((path + ".scene").c_str())) {
+		MYERROR("Could not write " << path << ".scene");
+		return false;
+	}
+
+	auto end = std::chrono::high_resolution_clock::now();
+
+	std::cout << "Packed " << filepath << ".scene (" << scene.indices.size() / 3 << " triangles, " << texturenames.size() << " textures): "
+		<< std::chrono::duration<double, std::milli>(middle - start).count() << " ms to load, "
+		<< std::chrono::duration<double, std::milli>(end - middle).count() << " ms to write\n";
+
+	return true;
+}
+
+static int PackScenes(int first, int argc, char* argv[])
+{
+	// NOTE: e.g. -pack kitchen/kitchen bathroom/bathroom (the current scene if none is given)
+	std::vector<std::string> scenes;
+	bool success = true;
+
+	for (int i = first; i < argc && argv[i][0] != '-'; ++i)
+		scenes.push_back(argv[i]);
+
+	if (scenes.empty())
+		scenes.push_back(SCENE_FILE);
+
+#ifdef _WIN32
+	Gdiplus::GdiplusStartupInput	gdiplustartup;
+	ULONG_PTR						gdiplustoken;
+
+	// NOTE: the Win32 application isn't created in pack mode
+	Gdiplus::GdiplusStartup(&gdiplustoken, &gdiplustartup, NULL);
+#endif
+
+	for (const std::string& scene : scenes)
+		success = PackScene(scene) && success;
+
+#ifdef _WIN32
+	Gdiplus::GdiplusShutdown(gdiplustoken);
+#endif
+
+	return (success ? 0 : 1);
+}
+
 int main(int argc, char* argv[])
 {
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-reference") == 0 && i + 1 < argc)
+			return RenderReference(argv[i + 1], argc, argv);
+		else if (strcmp(argv[i], "-pack") == 0)
+			return PackScenes(i + 1, argc, argv);
+		else if (strcmp(argv[i], "-regression") == 0 && i + 1 < argc)
+			regressionfile = argv[i + 1];
+		else if (strcmp(argv[i], "-spp") == 0 && i + 1 < argc)
+			regressionspp = (uint32_t)atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-tolerance") == 0 && i + 1 < argc)
+			regressiontolerance = (float)atof(argv[i + 1]);
+		else if (strcmp(argv[i], "-output") == 0 && i + 1 < argc)
+			regressionoutput = argv[i + 1];
+	}
+
+	// NOTE: e.g. -regression veach.pfm -spp 256 -tolerance 0.05 -output gpu.pfm (the shaders stop accumulating at MAX_SAMPLES)
+	const uint32_t maxsamples = (BIDIRECTIONAL ? 64 : 256);
+
+	if (regressionspp == 0 || regressionspp > maxsamples)
+		regressionspp = maxsamples;
+
 	app = Application::Create(1360, 768);
 	//app = Application::Create(768, 432);
 	app->SetTitle(TITLE);
@@ -606,14 +1166,20 @@ int main(int argc, char* argv[])
 	app->UninitSceneCallback = UninitScene;
 	app->UpdateCallback = Update;
 	app->RenderCallback = Render;
-	app->KeyDownCallback = KeyDown;
-	app->KeyUpCallback = KeyUp;
-	app->MouseMoveCallback = MouseMove;
-	app->MouseDownCallback = MouseDown;
-	app->MouseUpCallback = MouseUp;
+
+	if (regressionfile.empty()) {
+		app->KeyDownCallback = KeyDown;
+		app->KeyUpCallback = KeyUp;
+		app->MouseMoveCallback = MouseMove;
+		app->MouseDownCallback = MouseDown;
+		app->MouseUpCallback = MouseUp;
+	} else {
+		// keep the camera of the scene file
+		drawtext = false;
+	}
 
 	app->Run();
 	delete app;
 
-	return 0;
+	return exitcode;
 }
@@ -0,0 +1,186 @@
+#include <iostream>
+#include <cstdio>
+#include <vector>
+
+#include "../Common/application.h"
+#include "../Common/basiccamera.h"
+#include "../Common/frustumculler.h"
+#include "../Common/pathtessellator.h"
+#include "../Common/profiler.h"
+#include "../Common/threadpool.h"
+
+// NOTE: no device at all, runs with the headless application (see Build/Linux/58_HeadlessCulling.sh)
+
+#define GRID_SIZE			256		// boxes per side
+#define MINIMAP_SIZE		256.0f	// in pixels
+
+// helper macros
+#define TITLE				"Sample 58: Headless frustum culling"
+#define MYERROR(x)			{ std::cout << "* Error: " << x << "!\n"; }
+
+// sample variables
+Application*				app				= nullptr;
+ThreadPool*					workers			= nullptr;
+
+BasicCamera					camera;
+FrustumCuller				culler;
+FrustumCuller::CullResults	cullresults;
+PathTessellator				tessellator;
+PathArena					minimap;
+std::vector<Math::AABox>	boxes;
+
+uint64_t					numvisible		= 0;	// summed over frames
+uint64_t					numchanges		= 0;
+uint64_t					nummapvertices	= 0;
+uint32_t					numframes		= 0;
+
+bool InitScene()
+{
+	uint32_t screenwidth = app->GetClientWidth();
+	uint32_t screenheight = app->GetClientHeight();
+
+	for (int i = 0; i < GRID_SIZE; ++i) {
+		for (int j = 0; j < GRID_SIZE; ++j) {
+			Math::AABox box;
+
+			box.Min = Math::Vector3((float)(j - GRID_SIZE / 2), 0, (float)(i - GRID_SIZE / 2));
+			box.Max = box.Min + Math::Vector3(0.8f, 1.0f + (i * 7 + j) % 5, 0.8f);
+
+			boxes.push_back(box);
+		}
+	}
+
+	workers = new ThreadPool();
+
+	culler.SetThreadPool(workers);
+	culler.Build(boxes.data(), (uint32_t)boxes.size());
+
+	camera.SetAspect((float)screenwidth / screenheight);
+	camera.SetFov(Math::DegreesToRadians(60));
+	camera.SetClipPlanes(0.1f, 80.0f);
+	camera.SetDistance(20);
+	camera.SetOrientation(Math::DegreesToRadians(-135), Math::DegreesToRadians(25), 0);
+
+	std::cout << boxes.size() << " boxes, " << workers->GetNumThreads() << " threads\n";
+	return true;
+}
+
+void UninitScene()
+{
+	if (numframes > 0) {
+		printf("%u frames, %.1f visible boxes/frame, %.1f visibility changes/frame, %.1f minimap vertices/frame\n",
+			numframes, numvisible / (double)numframes, numchanges / (double)numframes, nummapvertices / (double)numframes);
+	}
+
+	delete workers;
+	workers = nullptr;
+}
+
+void KeyUp(KeyCode key)
+{
+	switch (key) {
+	case KeyCodeW:
+		camera.Zoom(-2);
+		break;
+
+	case KeyCodeS:
+		camera.Zoom(2);
+		break;
+
+	case KeyCodeA:
+		camera.PanRight(-4);
+		break;
+
+	case KeyCodeD:
+		camera.PanRight(4);
+		break;
+
+	default:
+		break;
+	}
+}
+
+void MouseMove(int32_t x, int32_t y, int16_t dx, int16_t dy)
+{
+	uint8_t state = app->GetMouseButtonState();
+
+	if (state & MouseButtonLeft) {
+		camera.OrbitRight(Math::DegreesToRadians(dx));
+		camera.OrbitUp(Math::DegreesToRadians(dy));
+	}
+}
+
+void Update(float delta)
+{
+	camera.Update(delta);
+}
+
+void Render(float alpha, float elapsedtime)
+{
+	Math::Matrix	view, proj, viewproj;
+	Math::Vector4	frustum[6];
+
+	camera.Animate(alpha);
+	camera.GetViewMatrix(view);
+	camera.GetProjectionMatrix(proj);
+
+	Math::MatrixMultiply(viewproj, view, proj);
+	Math::FrustumPlanes(frustum, viewproj);
+
+	{
+		PROFILE_SCOPE("Cull");
+		culler.Cull(cullresults, frustum);
+	}
+
+	// instead of drawing: a top-down map of the visible boxes
+	const float scale = MINIMAP_SIZE / GRID_SIZE;
+	const float offset = MINIMAP_SIZE * 0.5f;
+
+	PROFILE_SCOPE("Minimap");
+	minimap.Reset();
+
+	for (uint32_t index : cullresults.visible) {
+		const Math::AABox& box = boxes[index];
+
+		tessellator.BeginPath();
+		tessellator.MoveTo(box.Min.x * scale + offset, box.Min.z * scale + offset);
+		tessellator.LineTo(box.Max.x * scale + offset, box.Min.z * scale + offset);
+		tessellator.LineTo(box.Max.x * scale + offset, box.Max.z * scale + offset);
+		tessellator.LineTo(box.Min.x * scale + offset, box.Max.z * scale + offset);
+		tessellator.ClosePath();
+		tessellator.Fill(minimap);
+	}
+
+	numvisible += cullresults.visible.size();
+	numchanges += cullresults.newlyvisible.size() + cullresults.newlyhidden.size();
+	nummapvertices += minimap.GetNumVertices();
+
+	++numframes;
+
+	app->Present();
+}
+
+int main(int argc, char* argv[])
+{
+	app = Application::Create(1360, 768);
+	app->SetTitle(TITLE);
+
+	if (!app->InitializeDriverInterface(GraphicsAPINone)) {
+		MYERROR("This sample only runs with the headless application");
+
+		delete app;
+		return 1;
+	}
+
+	app->InitSceneCallback = InitScene;
+	app->UninitSceneCallback = UninitScene;
+	app->UpdateCallback = Update;
+	app->RenderCallback = Render;
+	app->KeyUpCallback = KeyUp;
+	app->MouseMoveCallback = MouseMove;
+
+	app->Run();
+	delete app;
+
+	return 0;
+}
@@ -0,0 +1,156 @@
+
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+
+#include "../Common/batchcache.h"
+#include "../Common/frustumculler.h"
+
+#define OBJECT_GRID_SIZE		64					// same as 71_DrawBatching
+#define TILE_GRID_SIZE			32
+#define SPACING					0.4f
+#define CAMERA_SPEED			0.05f
+#define RECORDED_OBJECT_SIZE	256					// estimated command buffer memory per object
+#define BATCH_CACHE_BUDGET		(1024 * 1024)		// keep hidden tiles recorded up to this
+
+int TestBatchCache(int first, int argc, char* argv[])
+{
+	// NOTE: replays the camera path of 71_DrawBatching without Vulkan and counts re-recordings per frame, e.g. -batchtest 20000
+	std::vector<Math::AABox>	objectboxes;
+	std::vector<Math::AABox>	tileboxes(TILE_GRID_SIZE * TILE_GRID_SIZE);
+	std::vector<uint8_t>		tilevisible;
+	Math::Matrix				view, proj, viewproj;
+	Math::Vector4				planes[6];
+	Math::Vector3				eye, look, tangent;
+	uint32_t					numframes	= 20000;
+	uint32_t					numerrors	= 0;
+
+	if (first < argc && argv[first][0] != '-')
+		numframes = (uint32_t)atoi(argv[first]);
+
+	// same layout as InitScene in 71_DrawBatching (objects are approximated by their unrotated footprint)
+	float width = OBJECT_GRID_SIZE * 3.2168f + (OBJECT_GRID_SIZE - 1) * SPACING;
+	float depth = OBJECT_GRID_SIZE * 2.0f + (OBJECT_GRID_SIZE - 1) * SPACING;
+	float height = 5;
+	float tilewidth = width / TILE_GRID_SIZE;
+	float tiledepth = depth / TILE_GRID_SIZE;
+
+	for (int i = 0; i < OBJECT_GRID_SIZE; ++i) {
+		for (int j = 0; j < OBJECT_GRID_SIZE; ++j) {
+			Math::AABox box;
+
+			box.Min = Math::Vector3(i * (3.2168f + SPACING) - width * 0.5f, 0, j * (2.0f + SPACING) - depth * 0.5f);
+			box.Max = box.Min + Math::Vector3(3.2168f, 1.6f, 2.0f);
+
+			objectboxes.push_back(box);
+		}
+	}
+
+	Math::MatrixPerspectiveFovRH(proj, Math::DegreesToRadians(60), 1360.0f / 768.0f, 1.5f, 50.0f);
+
+	printf("%u frames, %u objects, %u tiles\n", numframes, (uint32_t)objectboxes.size(), (uint32_t)tileboxes.size());
+
+	for (size_t budget : { (size_t)BATCH_CACHE_BUDGET / 4, (size_t)BATCH_CACHE_BUDGET, SIZE_MAX }) {
+		BatchCache					cache((uint32_t)tileboxes.size(), (uint32_t)objectboxes.size(), 2, budget);
+		FrustumCuller				culler;
+		FrustumCuller::CullResults	results;
+		FrustumCuller::CullResults	imageresults[2];
+		uint32_t					oldrecords	= 0;
+		uint32_t					maxrecords	= 0;
+		uint32_t					prevrecords	= 0;
+		size_t						peakmemory	= 0;
+
+		for (int i = 0; i < TILE_GRID_SIZE; ++i) {
+			for (int j = 0; j < TILE_GRID_SIZE; ++j) {
+				Math::AABox tilebox;
+				uint32_t index = i * TILE_GRID_SIZE + j;
+
+				tilebox.Min = Math::Vector3(width * -0.5f + j * tilewidth, 0, depth * -0.5f + i * tiledepth);
+				tilebox.Max = Math::Vector3(width * -0.5f + (j + 1) * tilewidth, height, depth * -0.5f + (i + 1) * tiledepth);
+
+				// like DrawBatch, the bounds contain every object of the tile
+				tileboxes[index] = Math::AABox();
+
+				for (uint32_t k = 0; k < (uint32_t)objectboxes.size(); ++k) {
+					if (tilebox.Intersects(objectboxes[k])) {
+						cache.AddObject(index, k, RECORDED_OBJECT_SIZE);
+
+						tileboxes[index].Add(objectboxes[k].Min);
+						tileboxes[index].Add(objectboxes[k].Max);
+					}
+				}
+			}
+		}
+
+		culler.Build(tileboxes.data(), (uint32_t)tileboxes.size());
+
+		for (uint32_t frame = 0; frame < numframes; ++frame) {
+			// same path as its Render at 60 fps
+			float t = (frame / 60.0f) * (CAMERA_SPEED * 32.0f) / OBJECT_GRID_SIZE;
+			float halfw = width * 0.45f;
+			float halfd = depth * 0.45f;
+			uint32_t image = (frame & 1);
+
+			eye = { halfw * sinf(t * 2), height + 8.0f, -halfd * cosf(t * 3) };
+
+			tangent.x = halfw * cosf(t * 2) * 2;
+			tangent.z = halfd * sinf(t * 3) * 3;
+			tangent.y = sqrtf(tangent.x * tangent.x + tangent.z * tangent.z) * -tanf(Math::DegreesToRadians(60));
+
+			Math::Vec3Normalize(tangent, tangent);
+			Math::Vec3Add(look, eye, tangent);
+
+			Math::MatrixLookAtRH(view, eye, look, Math::Vector3(0, 1, 0));
+			Math::MatrixMultiply(viewproj, view, proj);
+			Math::FrustumPlanes(planes, viewproj);
+
+			culler.Cull(results, planes);
+
+			// the previous scheme re-recorded every tile that became visible for an image
+			culler.Cull(imageresults[image], planes);
+			oldrecords += (uint32_t)imageresults[image].newlyvisible.size();
+
+			// simulated material edit
+			if (frame % 300 == 150)
+				cache.InvalidateObject((frame * 37) % (uint32_t)objectboxes.size());
+
+			cache.Update(image, results.visible);
+
+			uint32_t numrecords = cache.GetNumRecorded() - prevrecords;
+
+			prevrecords = cache.GetNumRecorded();
+			maxrecords = Math::Max(maxrecords, numrecords);
+			peakmemory = Math::Max(peakmemory, cache.GetUsedMemory());
+
+			// every visible tile must be recorded, and every visible object must have a visible owner
+			tilevisible.assign(tileboxes.size(), 0);
+
+			for (uint32_t index : results.visible) {
+				tilevisible[index] = 1;
+
+				if (!cache.IsRecorded(index, image))
+					++numerrors;
+			}
+
+			for (uint32_t k = 0; k < (uint32_t)objectboxes.size(); ++k) {
+				if (Math::FrustumIntersect(planes, objectboxes[k]) > 0 && !tilevisible[cache.GetOwner(k)])
+					++numerrors;
+			}
+
+			cache.FrameFinished();
+		}
+
+		if (budget == SIZE_MAX)
+			printf("unlimited budget: ");
+		else
+			printf("budget %5u KB: ", (uint32_t)(budget / 1024));
+
+		printf("%.2f re-recordings/frame (max %u, previous scheme %.2f), peak memory %u KB\n",
+			cache.GetNumRecorded() / (double)numframes, maxrecords, oldrecords / (double)numframes, (uint32_t)(peakmemory / 1024));
+	}
+
+	if (numerrors > 0)
+		printf("* Error: %u visible tiles or objects were not recorded!\n", numerrors);
+
+	return (numerrors > 0 ? 1 : 0);
+}
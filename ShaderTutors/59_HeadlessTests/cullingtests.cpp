@@ -0,0 +1,378 @@
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "../Common/frustumculler.h"
+#include "../Common/lightculler.h"
+#include "../Common/threadpool.h"
+#include "../Common/visibilityservice.h"
+
+#define NUM_LIGHTS			400		// same as 52_ForwardPlus
+#define LIGHT_RADIUS		1.5f
+#define OBJECT_GRID_SIZE	64		// same as 71_DrawBatching
+#define TILE_GRID_SIZE		32
+#define SPACING				0.4f
+#define CAMERA_SPEED		0.05f
+
+int BenchmarkVisibility(int first, int argc, char* argv[])
+{
+	// NOTE: culls random boxes against a camera, 4 shadow cascades and 8 light volumes, e.g. -visibilitybench 1000000 -threads 8
+	typedef std::chrono::high_resolution_clock Clock;
+
+	VisibilityService	service;
+	Math::Matrix		view, proj, viewproj;
+	Math::Matrix		cascades[4];
+	Math::AABox			lightboxes[8];
+	Math::Vector3		center, size;
+	ThreadPool*			threadpool	= nullptr;
+	uint32_t			numobjects	= 1000000;
+	uint32_t			numthreads	= 0;
+	uint32_t			numvisible	= 0;
+	double				batched		= 0;
+	double				separate	= 0;
+	const int			numruns		= 20;
+
+	if (first < argc && argv[first][0] != '-')
+		numobjects = (uint32_t)atoi(argv[first]);
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+			numthreads = (uint32_t)atoi(argv[++i]);
+	}
+
+	threadpool = new ThreadPool(numthreads);
+	service.SetThreadPool(threadpool);
+
+	srand(1234);
+
+	for (uint32_t i = 0; i < numobjects; ++i) {
+		Math::AABox box;
+
+		center = { Math::RandomFloat() * 1000 - 500, Math::RandomFloat() * 100 - 50, Math::RandomFloat() * 1000 - 500 };
+		size = { Math::RandomFloat() * 3 + 0.1f, Math::RandomFloat() * 3 + 0.1f, Math::RandomFloat() * 3 + 0.1f };
+
+		box.Add(center - size);
+		box.Add(center + size);
+
+		service.Register(box, i);
+	}
+
+	Math::MatrixLookAtRH(view, Math::Vector3(0, 20, -300), Math::Vector3(0, 0, 0), Math::Vector3(0, 1, 0));
+	Math::MatrixPerspectiveFovRH(proj, Math::DegreesToRadians(60), 16.0f / 9.0f, 0.1f, 1000.0f);
+	Math::MatrixMultiply(viewproj, view, proj);
+
+	for (int i = 0; i < 4; ++i) {
+		float extent = 50.0f * (1 << i);
+
+		Math::MatrixLookAtRH(view, Math::Vector3(100, 300, -100), Math::Vector3(0, 0, extent), Math::Vector3(0, 1, 0));
+		Math::MatrixOrthoOffCenterRH(proj, -extent, extent, -extent, extent, 1, 1000);
+		Math::MatrixMultiply(cascades[i], view, proj);
+	}
+
+	for (int i = 0; i < 8; ++i) {
+		center = { i * 40.0f - 160, 0, i * 20.0f };
+
+		lightboxes[i].Add(center - Math::Vector3(20, 20, 20));
+		lightboxes[i].Add(center + Math::Vector3(20, 20, 20));
+	}
+
+	auto addquery = [&](int index) {
+		if (index == 0)
+			service.AddFrustumQuery(viewproj);
+		else if (index < 5)
+			service.AddFrustumQuery(cascades[index - 1]);
+		else
+			service.AddBoxQuery(lightboxes[index - 5]);
+	};
+
+	for (int run = -1; run < numruns; ++run) {
+		// all queries in one pass (first run is warmup)
+		auto start = Clock::now();
+
+		service.BeginQueries();
+
+		for (int i = 0; i < 13; ++i)
+			addquery(i);
+
+		service.Cull();
+
+		auto middle = Clock::now();
+
+		numvisible = 0;
+
+		for (uint32_t i = 0; i < service.GetNumQueries(); ++i)
+			numvisible += (uint32_t)service.GetVisible(i).size();
+
+		// one pass per query
+		auto restart = Clock::now();
+
+		for (int i = 0; i < 13; ++i) {
+			service.BeginQueries();
+			addquery(i);
+			service.Cull();
+		}
+
+		auto end = Clock::now();
+
+		if (run >= 0) {
+			batched += std::chrono::duration<double, std::milli>(middle - start).count();
+			separate += std::chrono::duration<double, std::milli>(end - restart).count();
+		}
+	}
+
+	printf("%u objects, 13 queries (%u visible in total), %u threads\n", numobjects, numvisible, threadpool->GetNumThreads());
+	printf("batched: %.2f ms, one pass per query: %.2f ms\n", batched / numruns, separate / numruns);
+
+	delete threadpool;
+	return 0;
+}
+
+int BenchmarkFrustumCuller(int first, int argc, char* argv[])
+{
+	// NOTE: culls a grid of tiles along a camera path and compares with Math::FrustumIntersect, e.g. -cullbench 100000 -threads 8
+	typedef std::chrono::high_resolution_clock Clock;
+
+	FrustumCuller				culler;
+	FrustumCuller::CullResults	results;
+	std::vector<Math::AABox>	boxes;
+	std::vector<uint32_t>		reference;
+	Math::Matrix				view, proj, viewproj;
+	Math::Vector4				planes[6];
+	ThreadPool*					threadpool		= nullptr;
+	uint32_t					numboxes		= 100000;
+	uint32_t					numthreads		= 1;
+	uint32_t					nummismatches	= 0;
+	const int					numframes		= 200;
+
+	if (first < argc && argv[first][0] != '-')
+		numboxes = (uint32_t)atoi(argv[first]);
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+			numthreads = (uint32_t)atoi(argv[++i]);
+	}
+
+	if (numthreads != 1)
+		threadpool = new ThreadPool(numthreads);
+
+	int gridsize = (int)sqrtf((float)numboxes);
+
+	for (int i = 0; i < gridsize; ++i) {
+		for (int j = 0; j < gridsize; ++j) {
+			Math::AABox box;
+
+			box.Min = Math::Vector3((float)(j - gridsize / 2), 0, (float)(i - gridsize / 2));
+			box.Max = box.Min + Math::Vector3(1, 2.0f + (i * 7 + j) % 5, 1);
+
+			boxes.push_back(box);
+		}
+	}
+
+	culler.Build(boxes.data(), (uint32_t)boxes.size());
+	culler.SetThreadPool(threadpool);
+
+	Math::MatrixPerspectiveFovRH(proj, Math::DegreesToRadians(60), 16.0f / 9.0f, 0.1f, 150.0f);
+
+	const char* names[] = { "FrustumIntersect loop", "FrustumCuller", "FrustumCuller (AVX)" };
+	double elapsed[3] = { 0, 0, 0 };
+
+	for (int i = 0; i < numframes; ++i) {
+		Math::Vector3 eye(i * 0.5f - 50, 20, i * 0.3f - 20);
+		Math::Vector3 look(i * 0.5f - 30, 0, i * 0.3f);
+
+		Math::MatrixLookAtRH(view, eye, look, Math::Vector3(0, 1, 0));
+		Math::MatrixMultiply(viewproj, view, proj);
+		Math::FrustumPlanes(planes, viewproj);
+
+		auto start = Clock::now();
+
+		reference.clear();
+
+		for (uint32_t j = 0; j < (uint32_t)boxes.size(); ++j) {
+			if (Math::FrustumIntersect(planes, boxes[j]) > 0)
+				reference.push_back(j);
+		}
+
+		elapsed[0] += std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+		for (int avx = 0; avx < 2; ++avx) {
+			culler.SetUseAVX(avx == 1);
+
+			if (avx == 1 && !culler.IsUsingAVX())
+				break;
+
+			start = Clock::now();
+			culler.Cull(results, planes);
+
+			elapsed[avx + 1] += std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+			if (results.visible != reference)
+				++nummismatches;
+		}
+	}
+
+	printf("%u boxes, %d frames, %u threads\n", (uint32_t)boxes.size(), numframes, numthreads);
+
+	for (int i = 0; i < 3; ++i) {
+		if (elapsed[i] > 0)
+			printf("%s: %.3f ms/frame\n", names[i], elapsed[i] / numframes);
+	}
+
+	if (nummismatches > 0)
+		printf("* Error: %u culls differ from FrustumIntersect!\n", nummismatches);
+
+	delete threadpool;
+	return (nummismatches > 0 ? 1 : 0);
+}
+
+static void CullLightsReference(
+	std::vector<std::vector<uint32_t> >& out, const std::vector<Math::Vector4>& lights,
+	const Math::Matrix& view, const Math::Matrix& proj, const Math::Vector2& clipplanes,
+	uint32_t numtilesx, uint32_t numtilesy)
+{
+	// scalar port of lightcull.comp in 52_ForwardPlus (every tile tests every light in world space)
+	Math::Matrix	viewproj;
+	Math::Vector4	planes[6];
+	float			dist;
+
+	Math::MatrixMultiply(viewproj, view, proj);
+	out.assign(numtilesx * numtilesy, std::vector<uint32_t>());
+
+	for (uint32_t y = 0; y < numtilesy; ++y) {
+		for (uint32_t x = 0; x < numtilesx; ++x) {
+			float step1x = (2.0f * x) / numtilesx;
+			float step2x = (2.0f * (x + 1)) / numtilesx;
+			float step1y = (2.0f * y) / numtilesy;
+			float step2y = (2.0f * (y + 1)) / numtilesy;
+
+			Math::Vector4 clipspace[6] = {
+				{ 1, 0, 0, 1 - step1x },
+				{ -1, 0, 0, -1 + step2x },
+				{ 0, 1, 0, 1 - step1y },
+				{ 0, -1, 0, -1 + step2y },
+				{ 0, 0, -1, -clipplanes.x },
+				{ 0, 0, 1, clipplanes.y }
+			};
+
+			for (int i = 0; i < 6; ++i) {
+				Math::Vec4TransformTranspose(planes[i], (i < 4 ? viewproj : view), clipspace[i]);
+				Math::PlaneNormalize(planes[i], planes[i]);
+			}
+
+			for (uint32_t i = 0; i < (uint32_t)lights.size(); ++i) {
+				const Math::Vector4& l = lights[i];
+
+				for (int j = 0; j < 6; ++j) {
+					dist = Math::PlaneDotCoord(planes[j], (const Math::Vector3&)l) + l.w;
+
+					if (dist <= 0)
+						break;
+				}
+
+				if (dist > 0)
+					out[y * numtilesx + x].push_back(i);
+			}
+		}
+	}
+}
+
+int BenchmarkLightCulling(int first, int argc, char* argv[])
+{
+	// NOTE: culls random lights as 52_ForwardPlus does (1360x768, 16x16 tiles, no depth bounds) and compares with lightcull.comp, e.g. -lightcullbench 10000 -threads 8
+	typedef std::chrono::high_resolution_clock Clock;
+
+	LightCuller							culler(16, 1);
+	std::vector<Math::Vector4>			lights;
+	std::vector<std::vector<uint32_t> >	reference;
+	std::vector<uint32_t>				tilelights;
+	Math::Matrix						view, proj;
+	Math::Vector2						clipplanes(0.1f, 30.0f);
+	ThreadPool*							threadpool		= nullptr;
+	uint32_t							numlights		= NUM_LIGHTS;
+	uint32_t							numthreads		= 1;
+	uint32_t							numtilesx		= (1360 + 15) / 16;
+	uint32_t							numtilesy		= (768 + 15) / 16;
+	uint32_t							numpairs		= 0;
+	uint32_t							numextra		= 0;
+	uint32_t							nummissing		= 0;
+	const int							numruns			= 20;
+
+	if (first < argc && argv[first][0] != '-')
+		numlights = (uint32_t)atoi(argv[first]);
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+			numthreads = (uint32_t)atoi(argv[++i]);
+	}
+
+	if (numthreads != 1)
+		threadpool = new ThreadPool(numthreads);
+
+	culler.SetThreadPool(threadpool);
+	srand(1);
+
+	// same camera as 52_ForwardPlus, lights fill the scene box
+	Math::MatrixLookAtRH(view, Math::Vector3(-4.5f, 5.5f, 5.5f), Math::Vector3(0, 0.3f, 0), Math::Vector3(0, 1, 0));
+	Math::MatrixPerspectiveFovRH(proj, Math::DegreesToRadians(60), 1360.0f / 768.0f, clipplanes.x, clipplanes.y);
+
+	lights.resize(numlights);
+
+	for (uint32_t i = 0; i < numlights; ++i) {
+		lights[i].x = (rand() % 1000) * 0.015f - 7.5f;
+		lights[i].y = (rand() % 1000) * 0.003f - 0.5f;
+		lights[i].z = (rand() % 1000) * 0.015f - 7.5f;
+		lights[i].w = LIGHT_RADIUS;
+	}
+
+	auto start = Clock::now();
+
+	for (int i = 0; i < numruns; ++i)
+		culler.Cull(lights.data(), numlights, view, proj, clipplanes, numtilesx * 16, numtilesy * 16);
+
+	double cullertime = std::chrono::duration<double, std::milli>(Clock::now() - start).count() / numruns;
+
+	start = Clock::now();
+	CullLightsReference(reference, lights, view, proj, clipplanes, numtilesx, numtilesy);
+
+	double referencetime = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+	const std::vector<uint32_t>& offsets = culler.GetOffsets();
+	const std::vector<uint32_t>& indices = culler.GetIndices();
+
+	for (uint32_t i = 0; i < numtilesx * numtilesy; ++i) {
+		std::vector<uint32_t>& expected = reference[i];
+
+		tilelights.assign(indices.begin() + offsets[i], indices.begin() + offsets[i + 1]);
+
+		std::sort(tilelights.begin(), tilelights.end());
+		numpairs += (uint32_t)expected.size();
+
+		for (size_t j = 0; j < tilelights.size(); ++j) {
+			if (!std::binary_search(expected.begin(), expected.end(), tilelights[j]))
+				++numextra;
+		}
+
+		for (size_t j = 0; j < expected.size(); ++j) {
+			if (!std::binary_search(tilelights.begin(), tilelights.end(), expected[j]))
+				++nummissing;
+		}
+	}
+
+	printf("%u lights, %ux%u tiles, %u threads\n", numlights, numtilesx, numtilesy, numthreads);
+	printf("LightCuller: %.3f ms (%u light/tile pairs)\n", cullertime, (uint32_t)indices.size());
+	printf("lightcull.comp on CPU: %.3f ms (%u light/tile pairs)\n", referencetime, numpairs);
+
+	// NOTE: the coarse tests of LightCuller may reject a few false positives of the shader's plane test
+	if (nummissing > 0)
+		printf("%u pairs rejected by the coarse tests\n", nummissing);
+
+	if (numextra > 0)
+		printf("* Error: %u pairs are not in the shader's result!\n", numextra);
+
+	delete threadpool;
+	return (numextra > 0 ? 1 : 0);
+}
@@ -0,0 +1,224 @@
+
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "../Common/jobsystem.h"
+#include "../Common/threadpool.h"
+
+struct SpawnData
+{
+	JobSystem*	system;
+	uint32_t	depth;
+};
+
+static void SpawnTree(Job* job, const void* data)
+{
+	// children are detached, the root finishes when every descendant did
+	SpawnData current = *(const SpawnData*)data;
+
+	if (current.depth > 0) {
+		SpawnData child = { current.system, current.depth - 1 };
+
+		current.system->Run(current.system->CreateJob(&SpawnTree, &child, sizeof(SpawnData), job));
+		current.system->Run(current.system->CreateJob(&SpawnTree, &child, sizeof(SpawnData), job));
+	}
+}
+
+static void ForkJoin(Job* job, const void* data)
+{
+	// waits for its children explicitly (the thread helps meanwhile)
+	SpawnData current = *(const SpawnData*)data;
+
+	if (current.depth > 0) {
+		SpawnData child = { current.system, current.depth - 1 };
+		Job* first = current.system->CreateJob(&ForkJoin, &child, sizeof(SpawnData));
+		Job* second = current.system->CreateJob(&ForkJoin, &child, sizeof(SpawnData));
+
+		current.system->Run(first);
+		current.system->Run(second);
+
+		current.system->Wait(first);
+		current.system->Wait(second);
+	}
+}
+
+int BenchmarkJobs(int first, int argc, char* argv[])
+{
+	// NOTE: measures the job system against ThreadPool, e.g. -jobbench -threads 8
+	typedef std::chrono::high_resolution_clock Clock;
+
+	uint32_t	numthreads	= 0;
+	const int	numruns		= 10;
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+			numthreads = (uint32_t)atoi(argv[++i]);
+	}
+
+	JobSystem	jobsystem(numthreads);
+	ThreadPool	threadpool(jobsystem.GetNumThreads());
+	Job*		root;
+	double		elapsed;
+
+	printf("%u threads\n", jobsystem.GetNumThreads());
+
+	// thread identity: after another system lived on this thread, and from a thread of no system
+	std::atomic<uint32_t> numcovered(0);
+	std::atomic<uint32_t> numbadindices(0);
+
+	auto countrange = [&](uint32_t begin, uint32_t end, uint32_t index) {
+		if (index != UINT32_MAX && index >= jobsystem.GetNumThreads())
+			++numbadindices;
+
+		numcovered += end - begin;
+	};
+
+	{
+		JobSystem other(2);
+		other.ParallelFor(1000, 10, [](uint32_t, uint32_t, uint32_t) {});
+	}
+
+	jobsystem.ParallelFor(1000, 10, countrange);
+
+	std::thread foreign([&]() {
+		jobsystem.ParallelFor(1000, 10, countrange);
+	});
+
+	foreign.join();
+
+	if (numcovered != 2000 || numbadindices > 0) {
+		printf("* Error: ParallelFor covered %u of 2000 elements (%u bad thread indices)!\n", numcovered.load(), numbadindices.load());
+		return 1;
+	}
+
+	// throughput: empty jobs from one thread
+	const uint32_t numjobs = 1 << 20;
+	elapsed = 0;
+
+	for (int run = -1; run < numruns; ++run) {
+		auto start = Clock::now();
+
+		root = jobsystem.CreateJob([]() {});
+
+		for (uint32_t i = 0; i < numjobs; ++i)
+			jobsystem.Run(jobsystem.CreateJob([]() {}, root));
+
+		jobsystem.Run(root);
+		jobsystem.Wait(root);
+
+		if (run >= 0)
+			elapsed += std::chrono::duration<double>(Clock::now() - start).count();
+	}
+
+	printf("empty jobs (one producer): %.2f M jobs/s\n", (numjobs * (double)numruns) / elapsed * 1e-6);
+
+	// throughput: empty jobs spawned recursively (every thread produces)
+	SpawnData spawn = { &jobsystem, 19 };
+	elapsed = 0;
+
+	for (int run = -1; run < numruns; ++run) {
+		auto start = Clock::now();
+
+		root = jobsystem.CreateJob(&SpawnTree, &spawn, sizeof(SpawnData));
+
+		jobsystem.Run(root);
+		jobsystem.Wait(root);
+
+		if (run >= 0)
+			elapsed += std::chrono::duration<double>(Clock::now() - start).count();
+	}
+
+	printf("empty jobs (binary tree): %.2f M jobs/s\n", (((2u << spawn.depth) - 1) * (double)numruns) / elapsed * 1e-6);
+
+	// latency: fork-join trees with explicit waits
+	for (uint32_t depth : { 1, 4, 8, 12, 16 }) {
+		SpawnData forkjoin = { &jobsystem, depth };
+		elapsed = 0;
+
+		for (int run = -1; run < numruns; ++run) {
+			auto start = Clock::now();
+
+			root = jobsystem.CreateJob(&ForkJoin, &forkjoin, sizeof(SpawnData));
+
+			jobsystem.Run(root);
+			jobsystem.Wait(root);
+
+			if (run >= 0)
+				elapsed += std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+		}
+
+		printf("fork-join depth %2u: %10.2f us (%.3f us/job)\n", depth, elapsed / numruns, elapsed / numruns / ((2u << depth) - 1));
+	}
+
+	// data parallel loop with small grains
+	const uint32_t numelements = 1 << 22;
+	std::vector<float> values(numelements, 1.0f);
+	std::vector<double> sums(jobsystem.GetNumThreads());
+
+	auto sumrange = [&](uint32_t begin, uint32_t end, uint32_t index) {
+		float sum = 0;
+
+		for (uint32_t i = begin; i < end; ++i)
+			sum += values[i];
+
+		sums[index] += sum;
+	};
+
+	for (uint32_t grain : { 256, 1024, 4096, 65536 }) {
+		double jobtime = 0;
+		double pooltime = 0;
+
+		for (int run = -1; run < numruns; ++run) {
+			auto start = Clock::now();
+
+			jobsystem.ParallelFor(numelements, grain, sumrange);
+
+			auto middle = Clock::now();
+
+			threadpool.ParallelFor(numelements, grain, sumrange);
+
+			auto end = Clock::now();
+
+			if (run >= 0) {
+				jobtime += std::chrono::duration<double, std::milli>(middle - start).count();
+				pooltime += std::chrono::duration<double, std::milli>(end - middle).count();
+			}
+		}
+
+		printf("ParallelFor grain %5u: JobSystem %.3f ms, ThreadPool %.3f ms\n", grain, jobtime / numruns, pooltime / numruns);
+	}
+
+	// task graph: 16 layers of 64 tasks, each depends on two tasks of the previous layer
+	const uint32_t numlayers = 16;
+	const uint32_t layersize = 64;
+	JobGraph graph;
+
+	for (uint32_t i = 0; i < numlayers * layersize; ++i)
+		graph.AddTask([]() {});
+
+	for (uint32_t i = 1; i < numlayers; ++i) {
+		for (uint32_t j = 0; j < layersize; ++j) {
+			graph.AddDependency(i * layersize + j, (i - 1) * layersize + j);
+			graph.AddDependency(i * layersize + j, (i - 1) * layersize + (j + 1) % layersize);
+		}
+	}
+
+	elapsed = 0;
+
+	for (int run = -1; run < numruns; ++run) {
+		auto start = Clock::now();
+
+		graph.Execute(jobsystem);
+
+		if (run >= 0)
+			elapsed += std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+	}
+
+	printf("task graph (%u tasks): %.2f us (%.3f us/task)\n", graph.GetNumTasks(), elapsed / numruns, elapsed / numruns / graph.GetNumTasks());
+
+	return 0;
+}
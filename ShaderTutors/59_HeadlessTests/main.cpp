@@ -0,0 +1,86 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+// NOTE: CPU-only checks of the Common modules, runs without a window or device (see Build/Linux/59_HeadlessTests.sh)
+
+extern int BenchmarkBroadPhase(int first, int argc, char* argv[]);
+extern int BenchmarkSolver(int first, int argc, char* argv[]);
+extern int TestTunneling(int first, int argc, char* argv[]);
+
+extern int BenchmarkVisibility(int first, int argc, char* argv[]);
+extern int BenchmarkFrustumCuller(int first, int argc, char* argv[]);
+extern int BenchmarkLightCulling(int first, int argc, char* argv[]);
+extern int TestBatchCache(int first, int argc, char* argv[]);
+
+extern int BenchmarkRasterizer(int first, int argc, char* argv[]);
+extern int BenchmarkCascades(int first, int argc, char* argv[]);
+extern int BenchmarkQuadTree(int first, int argc, char* argv[]);
+
+extern int BenchmarkJobs(int first, int argc, char* argv[]);
+extern int BenchmarkPaths(int first, int argc, char* argv[]);
+extern int BenchmarkParticles(int first, int argc, char* argv[]);
+extern int BenchmarkLightning(int first, int argc, char* argv[]);
+
+struct HeadlessTest
+{
+	const char*	name;
+	int			(*run)(int, int, char*[]);
+	const char*	origin;		// the sample that uses the module
+};
+
+static const HeadlessTest tests[] = {
+	{ "-broadphasebench",	&BenchmarkBroadPhase,		"53_PhysicallyBased" },
+	{ "-solverbench",		&BenchmarkSolver,			"53_PhysicallyBased" },
+	{ "-tunneltest",		&TestTunneling,				"53_PhysicallyBased" },
+	{ "-visibilitybench",	&BenchmarkVisibility,		"53_PhysicallyBased" },
+	{ "-cullbench",			&BenchmarkFrustumCuller,	"71_DrawBatching" },
+	{ "-batchtest",			&TestBatchCache,			"71_DrawBatching" },
+	{ "-lightcullbench",	&BenchmarkLightCulling,		"52_ForwardPlus" },
+	{ "-rasterbench",		&BenchmarkRasterizer,		"54_GTAO" },
+	{ "-cascadebench",		&BenchmarkCascades,			"43_LightSpacePerspectiveSM" },
+	{ "-terrainbench",		&BenchmarkQuadTree,			"56_Ocean" },
+	{ "-jobbench",			&BenchmarkJobs,				"51_MultiThreading" },
+	{ "-pathbench",			&BenchmarkPaths,			"51_MultiThreading" },
+	{ "-particlebench",		&BenchmarkParticles,		"45_AudioStreaming" },
+	{ "-lightningbench",	&BenchmarkLightning,		"45_AudioStreaming" },
+};
+
+static const size_t numtests = sizeof(tests) / sizeof(tests[0]);
+
+int main(int argc, char* argv[])
+{
+	// NOTE: runs one check with its own arguments, e.g. -solverbench 64 -threads 8
+	for (int i = 1; i < argc; ++i) {
+		for (size_t j = 0; j < numtests; ++j) {
+			if (strcmp(argv[i], tests[j].name) == 0)
+				return tests[j].run(i + 1, argc, argv);
+		}
+	}
+
+	// other arguments are only options for every check (i.e. -threads N)
+	if (argc > 1 && strcmp(argv[1], "-threads") != 0) {
+		printf("usage: %s [check [arguments]] [-threads N]\n\n", argv[0]);
+
+		for (size_t j = 0; j < numtests; ++j)
+			printf("  %-18s(%s)\n", tests[j].name, tests[j].origin);
+
+		return 1;
+	}
+
+	// run everything with the defaults
+	size_t numfailed = 0;
+
+	for (size_t j = 0; j < numtests; ++j) {
+		printf("\n%s (%s):\n", tests[j].name + 1, tests[j].origin);
+		fflush(stdout);
+
+		if (tests[j].run(1, argc, argv) != 0) {
+			printf("* Error: %s failed!\n", tests[j].name + 1);
+			++numfailed;
+		}
+	}
+
+	printf("\n%u of %u checks failed\n", (uint32_t)numfailed, (uint32_t)numtests);
+	return (numfailed > 0 ? 1 : 0);
+}
@@ -0,0 +1,268 @@
+
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <utility>
+#include <vector>
+
+#include "../Common/depthrasterizer.h"
+#include "../Common/meshoptimizer.h"
+#include "../Common/threadpool.h"
+
+#define OCCLUSION_WIDTH		320		// same as 54_GTAO
+
+static void RasterizeReference(
+	std::vector<float>& out, uint32_t width, uint32_t height,
+	const float* positions, uint32_t stride, const std::vector<uint32_t>& indices, const Math::Matrix& viewproj)
+{
+	// NOTE: scalar version of DepthRasterizer (same snapping and fill rules, no clipping, no culling)
+	Math::Vector4	clip[3];
+	int64_t			x[3], y[3];
+	float			z[3];
+
+	out.assign(width * height, 1.0f);
+
+	for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+		for (int j = 0; j < 3; ++j) {
+			const float* p = (const float*)((const uint8_t*)positions + indices[i + j] * stride);
+
+			Math::Vec4Transform(clip[j], Math::Vector4(p[0], p[1], p[2], 1), viewproj);
+
+			x[j] = (int64_t)floorf((clip[j].x / clip[j].w * 0.5f + 0.5f) * width * 16 + 0.5f);
+			y[j] = (int64_t)floorf((clip[j].y / clip[j].w * 0.5f + 0.5f) * height * 16 + 0.5f);
+			z[j] = clip[j].z / clip[j].w * 0.5f + 0.5f;
+		}
+
+		int64_t area = (x[1] - x[0]) * (y[2] - y[0]) - (y[1] - y[0]) * (x[2] - x[0]);
+
+		if (area == 0)
+			continue;
+
+		if (area < 0) {
+			std::swap(x[1], x[2]);
+			std::swap(y[1], y[2]);
+			std::swap(z[1], z[2]);
+
+			area = -area;
+		}
+
+		int64_t minx = Math::Max<int64_t>(0, (Math::Min(x[0], Math::Min(x[1], x[2])) - 8) / 16);
+		int64_t miny = Math::Max<int64_t>(0, (Math::Min(y[0], Math::Min(y[1], y[2])) - 8) / 16);
+		int64_t maxx = Math::Min<int64_t>(width - 1, (Math::Max(x[0], Math::Max(x[1], x[2])) + 8) / 16);
+		int64_t maxy = Math::Min<int64_t>(height - 1, (Math::Max(y[0], Math::Max(y[1], y[2])) + 8) / 16);
+
+		for (int64_t py = miny; py <= maxy; ++py) {
+			for (int64_t px = minx; px <= maxx; ++px) {
+				int64_t sx = px * 16 + 8;
+				int64_t sy = py * 16 + 8;
+				bool inside = true;
+
+				for (int j = 0; j < 3; ++j) {
+					int k = (j + 1) % 3;
+					int64_t a = y[j] - y[k];
+					int64_t b = x[k] - x[j];
+					int64_t edge = a * sx + b * sy + x[j] * y[k] - x[k] * y[j];
+					bool topleft = (b < 0 || (b == 0 && a > 0));
+
+					if (edge < 0 || (edge == 0 && !topleft))
+						inside = false;
+				}
+
+				if (!inside)
+					continue;
+
+				double b1 = -((double)(x[2] - x[0]) * (sy - y[0]) - (double)(y[2] - y[0]) * (sx - x[0])) / area;
+				double b2 = ((double)(x[1] - x[0]) * (sy - y[0]) - (double)(y[1] - y[0]) * (sx - x[0])) / area;
+				float depth = (float)(z[0] + (z[1] - z[0]) * b1 + (z[2] - z[0]) * b2);
+
+				float& dest = out[py * width + px];
+				dest = Math::Min(dest, depth);
+			}
+		}
+	}
+}
+
+int BenchmarkRasterizer(int first, int argc, char* argv[])
+{
+	// NOTE: compares a shadow map with a scalar reference, then measures occlusion culling around the model, e.g. -rasterbench ../../Media/MeshesQM/modern_house/modern_house.qm -threads 8
+	typedef std::chrono::high_resolution_clock Clock;
+
+	MeshOptimizer::QMLayout		layout;
+	std::vector<uint8_t>		data;
+	std::vector<uint32_t>		indices;
+	std::vector<Math::AABox>	boxes;			// 64 triangle clusters
+	std::vector<uint32_t>		clusterstarts;
+	std::vector<uint32_t>		clustercounts;
+	std::vector<uint8_t>		visibility;
+	std::vector<float>			reference;
+	Math::AABox					meshbox;
+	Math::Matrix				view, proj, viewproj;
+	Math::Vector2				clipplanes;
+	Math::Vector3				center, size;
+	ThreadPool*					threadpool		= nullptr;
+	const char*					file			= "../../Media/MeshesQM/modern_house/modern_house.qm";
+	uint32_t					numthreads		= 1;
+	uint32_t					numerrors		= 0;
+	const uint32_t				shadowsize		= 256;
+	const int					numviews		= 8;
+	const int					numruns			= 20;
+
+	if (first < argc && argv[first][0] != '-')
+		file = argv[first];
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+			numthreads = (uint32_t)atoi(argv[++i]);
+	}
+
+	if (!MeshOptimizer::ReadQM(data, layout, file)) {
+		printf("* Error: Could not load '%s'!\n", file);
+		return 1;
+	}
+
+	if (numthreads != 1)
+		threadpool = new ThreadPool(numthreads);
+
+	const float* positions = (const float*)(data.data() + layout.vertexoffset + layout.posoffset);
+	uint32_t numvertices = layout.header[4];
+	uint32_t numtriangles = layout.header[1] / 3;
+
+	MeshOptimizer::ReadIndices(indices, data, layout);
+
+	for (size_t i = 0; i < layout.subsets.size(); ++i) {
+		const MeshOptimizer::QMSubset& subset = layout.subsets[i];
+
+		for (uint32_t j = 0; j < subset.IndexCount; j += 64 * 3) {
+			uint32_t count = Math::Min<uint32_t>(64 * 3, subset.IndexCount - j);
+			Math::AABox box;
+
+			for (uint32_t k = subset.IndexStart + j; k < subset.IndexStart + j + count; ++k) {
+				const float* p = (const float*)((const uint8_t*)positions + indices[k] * layout.vstride);
+				box.Add(Math::Vector3(p[0], p[1], p[2]));
+			}
+
+			boxes.push_back(box);
+			clusterstarts.push_back(subset.IndexStart + j);
+			clustercounts.push_back(count);
+
+			meshbox.Add(box.Min);
+			meshbox.Add(box.Max);
+		}
+	}
+
+	visibility.resize(boxes.size());
+
+	meshbox.GetCenter(center);
+	meshbox.GetSize(size);
+
+	printf("%s: %u triangles, %u subsets, %u threads\n", file, numtriangles, (uint32_t)layout.subsets.size(), numthreads);
+
+	// reference shadow map (orthographic, so nothing is clipped)
+	DepthRasterizer shadowmap(shadowsize, shadowsize);
+	uint32_t numcoveragediffs = 0;
+	uint32_t numdepthdiffs = 0;
+
+	Math::MatrixViewVector(view, Math::Vector3(-0.25f, 0.65f, -1));
+	Math::FitToBoxOrtho(proj, clipplanes, view, meshbox);
+	Math::MatrixMultiply(viewproj, view, proj);
+
+	shadowmap.SetThreadPool(threadpool);
+	shadowmap.SetCullMode(DepthCullModeNone);
+	shadowmap.AddMesh(positions, numvertices, layout.vstride, indices.data(), (uint32_t)indices.size(), true, viewproj);
+	shadowmap.Flush();
+
+	RasterizeReference(reference, shadowsize, shadowsize, positions, layout.vstride, indices, viewproj);
+
+	for (uint32_t i = 0; i < shadowsize; ++i) {
+		for (uint32_t j = 0; j < shadowsize; ++j) {
+			float depth = shadowmap.GetDepth(j, i);
+			float expected = reference[i * shadowsize + j];
+
+			if ((depth < 1) != (expected < 1))
+				++numcoveragediffs;
+			else if (fabs(depth - expected) > 1e-4f)
+				++numdepthdiffs;
+		}
+	}
+
+	printf("shadow map %ux%u: %u coverage and %u depth differences\n", shadowsize, shadowsize, numcoveragediffs, numdepthdiffs);
+	numerrors += numcoveragediffs + numdepthdiffs;
+
+	// occlusion culling from inside and outside the model
+	DepthRasterizer occlusionbuffer(OCCLUSION_WIDTH, (OCCLUSION_WIDTH * 9) / 16);
+	DepthRasterizer single(OCCLUSION_WIDTH, (OCCLUSION_WIDTH * 9) / 16);
+	Math::Vector4 planes[6];
+	double totaltime = 0;
+	uint32_t numinfrustum = 0;
+	uint32_t numculled = 0;
+	uint32_t numwrong = 0;
+
+	occlusionbuffer.SetThreadPool(threadpool);
+
+	for (int i = 0; i < numviews; ++i) {
+		float angle = (i * Math::TWO_PI) / numviews;
+		float radius = ((i % 2) ? 1.2f : 0.2f);
+		float height = ((i % 2) ? 0.8f : 0.3f);
+
+		Math::Vector3 eye(center.x + cosf(angle) * size.x * radius, meshbox.Min.y + size.y * height, center.z + sinf(angle) * size.z * radius);
+		Math::Vector3 look(center.x, meshbox.Min.y + size.y * 0.3f, center.z);
+
+		Math::MatrixLookAtRH(view, eye, look, Math::Vector3(0, 1, 0));
+		Math::MatrixPerspectiveFovRH(proj, Math::DegreesToRadians(60), 16.0f / 9.0f, size.x * 1e-3f, size.x * 4);
+		Math::MatrixMultiply(viewproj, view, proj);
+		Math::FrustumPlanes(planes, viewproj);
+
+		auto start = Clock::now();
+
+		for (int j = 0; j < numruns; ++j) {
+			occlusionbuffer.Clear();
+			occlusionbuffer.AddMesh(positions, numvertices, layout.vstride, indices.data(), (uint32_t)indices.size(), true, viewproj);
+			occlusionbuffer.Flush();
+			occlusionbuffer.TestBoxes(visibility.data(), boxes.data(), (uint32_t)boxes.size(), viewproj);
+		}
+
+		totaltime += std::chrono::duration<double, std::milli>(Clock::now() - start).count() / numruns;
+
+		// a culled cluster must not have any visible pixel
+		for (size_t j = 0; j < boxes.size(); ++j) {
+			if (Math::FrustumIntersect(planes, boxes[j]) == 0)
+				continue;
+
+			++numinfrustum;
+
+			if (visibility[j])
+				continue;
+
+			++numculled;
+
+			single.Clear();
+			single.AddMesh(positions, numvertices, layout.vstride, indices.data() + clusterstarts[j], clustercounts[j], true, viewproj);
+			single.Flush();
+
+			for (uint32_t k = 0; k < single.GetWidth() * single.GetHeight(); ++k) {
+				uint32_t x = k % single.GetWidth();
+				uint32_t y = k / single.GetWidth();
+				float depth = single.GetDepth(x, y);
+
+				if (depth < 1 && depth <= occlusionbuffer.GetDepth(x, y)) {
+					++numwrong;
+					break;
+				}
+			}
+		}
+	}
+
+	printf("occlusion %ux%u: %.3f ms/frame (%.1f Mtri/s)\n",
+		occlusionbuffer.GetWidth(), occlusionbuffer.GetHeight(), totaltime / numviews, (numtriangles * numviews) / (totaltime * 1000.0));
+
+	printf("64 triangle clusters in frustum: %u, occluded: %u (%.1f%%)\n",
+		numinfrustum, numculled, (100.0f * numculled) / Math::Max<uint32_t>(numinfrustum, 1));
+
+	if (numwrong > 0)
+		printf("* Error: %u clusters were culled but have visible pixels!\n", numwrong);
+
+	numerrors += numwrong;
+
+	delete threadpool;
+	return (numerrors > 0 ? 1 : 0);
+}
@@ -0,0 +1,215 @@
+
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <vector>
+
+#include "../Common/geometryutils.h"
+#include "../Common/lightning.h"
+#include "../Common/particlesystem.h"
+#include "../Common/threadpool.h"
+
+#define LIGHTNING_THICKNESS	3e-2f	// same as 45_AudioStreaming
+
+class MemoryParticleStorage : public IParticleStorage
+{
+	// for benchmarks
+private:
+	std::vector<uint8_t>	vertices;
+	size_t					vertexstride;
+	size_t					vertexcount;
+
+public:
+	MemoryParticleStorage() {
+		vertexstride = 0;
+		vertexcount = 0;
+	}
+
+	bool Initialize(size_t count, size_t stride) override {
+		// NOTE: same size as DXParticleStorage in 45_AudioStreaming
+		vertices.resize(count * stride * 6);
+
+		vertexstride = stride;
+		vertexcount = count;
+
+		return true;
+	}
+
+	void* LockVertexBuffer(uint32_t, uint32_t) override	{ return vertices.data(); }
+	void UnlockVertexBuffer() override						{}
+
+	inline size_t GetVertexStride() const override			{ return vertexstride; }
+	inline size_t GetNumVertices() const override			{ return vertexcount; }
+};
+
+int BenchmarkParticles(int first, int argc, char* argv[])
+{
+	// NOTE: updates and draws the fire without a device and checks the sort order, e.g. -particlebench 100000
+	typedef std::chrono::high_resolution_clock Clock;
+
+	ParticleSystem			particles;
+	MemoryParticleStorage*	storage		= new MemoryParticleStorage();
+	Math::Matrix			world, view;
+	Math::Vector3			eye(3, 2, 4);
+	size_t					numdrawn	= 0;
+	uint32_t				numunsorted	= 0;
+	uint32_t				numparticles	= 100000;
+	const int				numframes	= 10;
+
+	if (first < argc && argv[first][0] != '-')
+		numparticles = (uint32_t)atoi(argv[first]);
+
+	if (!particles.Initialize(storage, numparticles))
+		return 1;
+
+	particles.Force = Math::Vector3(0, 3e-2f, 0);
+
+	Math::MatrixTranslation(world, 0, 0.55f, 0);
+	Math::MatrixLookAtRH(view, eye, Math::Vector3(0, 0, 0), Math::Vector3(0, 1, 0));
+
+	particles.Update(1.0f / 60.0f);
+
+	auto start = Clock::now();
+
+	for (int i = 0; i < numframes; ++i) {
+		particles.Update(1.0f / 60.0f);
+		particles.Draw(world, view, [&](size_t count) {
+			numdrawn += count;
+		});
+	}
+
+	double elapsed = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+	// billboards must be sorted by descending view space depth
+	const GeometryUtils::BillboardVertex* vertices = (const GeometryUtils::BillboardVertex*)storage->LockVertexBuffer(0, 0);
+	Math::Vector3 prev, curr;
+
+	for (size_t i = 0; i < particles.GetNumParticles(); ++i) {
+		const GeometryUtils::BillboardVertex& v = vertices[i * 6];
+
+		Math::Vec3TransformCoord(curr, Math::Vector3(v.x, v.y, v.z), view);
+
+		if (i > 0 && prev.z < curr.z - 1e-4f)
+			++numunsorted;
+
+		prev = curr;
+	}
+
+	printf("%u particles: %.3f ms/frame (%.0f particles/ms), %zu drawn\n", numparticles, elapsed / numframes, numdrawn / elapsed, numdrawn);
+
+	if (numunsorted > 0)
+		printf("* Error: %u billboards are out of order!\n", numunsorted);
+
+	return (numunsorted > 0 ? 1 : 0);
+}
+
+int BenchmarkLightning(int first, int argc, char* argv[])
+{
+	// NOTE: subdivides and generates bolts without a device, serial and on a ThreadPool, e.g. -lightningbench 10 -threads 8
+	typedef std::chrono::high_resolution_clock Clock;
+
+	Lightning					bolt(CoilLightning);
+	MemoryParticleStorage*		storage			= new MemoryParticleStorage();	// bolt deletes it
+	ThreadPool*					threadpool		= nullptr;
+	std::vector<Math::Vector3>	seeds;
+	std::vector<uint8_t>		reference;
+	Math::Matrix				view;
+	double						elapsed[2][2]	= { { 0, 0 }, { 0, 0 } };	// [serial, pooled][subdivide, generate]
+	size_t						numsegments		= 0;
+	uint32_t					numthreads		= 0;
+	uint32_t					nummismatches	= 0;
+	int							levels			= 10;
+	const int					numbolts		= 64;
+	const int					mask			= 0x88;
+
+	if (first < argc && argv[first][0] != '-')
+		levels = Math::Min<int>(Math::Max<int>(atoi(argv[first]), 1), 12);
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+			numthreads = (uint32_t)atoi(argv[++i]);
+	}
+
+	if (numthreads != 1)
+		threadpool = new ThreadPool(numthreads);
+
+	auto RandomXZ = [](float diameter) -> float {
+		return -0.5f * diameter + Math::RandomFloat() * diameter;
+	};
+
+	Math::MatrixLookAtRH(view, Math::Vector3(3, 2, 4), Math::Vector3(0, 2, 0), Math::Vector3(0, 1, 0));
+	srand(1);
+
+	for (int i = 0; i < numbolts; ++i) {
+		// same layout as LightningStrike() in 45_AudioStreaming
+		Math::Vector3 groundpoint(RandomXZ(4.75f), 0, RandomXZ(4.75f));
+		Math::Vector3 skypoint(groundpoint.x + RandomXZ(2.5f), 4, groundpoint.z + RandomXZ(2.5f));
+
+		seeds.clear();
+
+		for (int j = 0; j < 4; ++j) {
+			seeds.push_back(skypoint + (groundpoint - skypoint) * (j / 4.0f));
+			seeds.push_back(skypoint + (groundpoint - skypoint) * ((j + 1) / 4.0f));
+		}
+
+		bolt.Reset();
+
+		if (!bolt.Initialize(storage, seeds, levels, mask)) {
+			printf("* Error: Could not initialize lightning!\n");
+			delete threadpool;
+
+			return 1;
+		}
+
+		size_t numbytes = storage->GetNumVertices() * storage->GetVertexStride();
+		float time = i * 0.1f;
+
+		// the pooled bolt must be the same as the serial one
+		for (int pass = 0; pass < (threadpool ? 2 : 1); ++pass) {
+			bolt.SetThreadPool(pass == 0 ? nullptr : threadpool);
+
+			auto start = Clock::now();
+			{
+				bolt.Subdivide(time);
+			}
+			auto middle = Clock::now();
+			{
+				bolt.Generate(LIGHTNING_THICKNESS, view);
+			}
+			auto end = Clock::now();
+
+			elapsed[pass][0] += std::chrono::duration<double, std::milli>(middle - start).count();
+			elapsed[pass][1] += std::chrono::duration<double, std::milli>(end - middle).count();
+
+			const uint8_t* vertices = (const uint8_t*)storage->LockVertexBuffer(0, 0);
+
+			if (pass == 0)
+				reference.assign(vertices, vertices + numbytes);
+			else if (memcmp(reference.data(), vertices, numbytes) != 0)
+				++nummismatches;
+
+			storage->UnlockVertexBuffer();
+		}
+
+		numsegments += bolt.GetNumSegments();
+	}
+
+	printf("%d bolts, %d levels, %zu segments/bolt, %.1f MB vertices/bolt\n",
+		numbolts, levels, numsegments / numbolts, storage->GetNumVertices() * storage->GetVertexStride() / (1024.0 * 1024.0));
+
+	printf("serial: subdivide %.3f ms, generate %.3f ms\n", elapsed[0][0] / numbolts, elapsed[0][1] / numbolts);
+
+	if (threadpool != nullptr) {
+		printf("%u threads: subdivide %.3f ms, generate %.3f ms, %u of %d bolts differ\n",
+			threadpool->GetNumThreads(), elapsed[1][0] / numbolts, elapsed[1][1] / numbolts, nummismatches, numbolts);
+	}
+
+	delete threadpool;
+
+	if (nummismatches > 0) {
+		printf("* Error: pooled lightning differs from serial!\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,245 @@
+
+#include <cstdio>
+#include <chrono>
+#include <vector>
+
+#include "../Common/pathtessellator.h"
+
+static bool IsCovered(const PathArena& arena, float x, float y)
+{
+	const Math::Vector4* vertices = arena.GetVertices();
+	const uint32_t* indices = arena.GetIndices();
+
+	for (uint32_t i = 0; i < arena.GetNumIndices(); i += 3) {
+		const Math::Vector4& a = vertices[indices[i + 0]];
+		const Math::Vector4& b = vertices[indices[i + 1]];
+		const Math::Vector4& c = vertices[indices[i + 2]];
+
+		float d1 = (b.x - a.x) * (y - a.y) - (b.y - a.y) * (x - a.x);
+		float d2 = (c.x - b.x) * (y - b.y) - (c.y - b.y) * (x - b.x);
+		float d3 = (a.x - c.x) * (y - c.y) - (a.y - c.y) * (x - c.x);
+
+		bool hasneg = (d1 < 0 || d2 < 0 || d3 < 0);
+		bool haspos = (d1 > 0 || d2 > 0 || d3 > 0);
+
+		if (!(hasneg && haspos))
+			return true;
+	}
+
+	return false;
+}
+
+static float SegmentDistance(float x, float y, const Math::Vector2& a, const Math::Vector2& b)
+{
+	float dx = b.x - a.x;
+	float dy = b.y - a.y;
+	float t = Math::Clamp(((x - a.x) * dx + (y - a.y) * dy) / (dx * dx + dy * dy), 0.0f, 1.0f);
+
+	float ex = a.x + t * dx - x;
+	float ey = a.y + t * dy - y;
+
+	return sqrtf(ex * ex + ey * ey);
+}
+
+int BenchmarkPaths(int first, int argc, char* argv[])
+{
+	// NOTE: tests PathTessellator against point-sampled references and measures it on dense line art, e.g. -pathbench 2000
+	typedef std::chrono::high_resolution_clock Clock;
+
+	PathTessellator	tessellator;
+	PathArena		arena;
+	PathStrokeStyle	style;
+	uint32_t		numlines	= 2000;
+	const uint32_t	linelength	= 64;
+	const int		numruns		= 5;
+	int				numerrors;
+	int				numsamples;
+	bool			success		= true;
+
+	if (first < argc && argv[first][0] != '-')
+		numlines = Math::Max<uint32_t>(1, (uint32_t)atoi(argv[first]));
+
+	// round joins and caps must cover exactly the points closer than width/2 to the polyline
+	Math::Vector2 polyline[] = {
+		{ 10, 10 }, { 50, 12 }, { 30, 40 }, { 60, 60 }, { 62, 20 }
+	};
+
+	style.width = 6;
+	style.join = LineJoinTypeRound;
+	style.cap = LineCapTypeRound;
+
+	tessellator.BeginPath();
+	tessellator.MoveTo(polyline[0].x, polyline[0].y);
+
+	for (size_t i = 1; i < ARRAY_SIZE(polyline); ++i)
+		tessellator.LineTo(polyline[i].x, polyline[i].y);
+
+	tessellator.Stroke(arena, style);
+
+	numerrors = numsamples = 0;
+
+	for (float y = 0; y < 70; y += 0.37f) {
+		for (float x = 0; x < 70; x += 0.37f) {
+			float dist = FLT_MAX;
+
+			for (size_t i = 0; i + 1 < ARRAY_SIZE(polyline); ++i)
+				dist = Math::Min(dist, SegmentDistance(x, y, polyline[i], polyline[i + 1]));
+
+			// skip samples near the edge (the round parts are polygons)
+			if (fabsf(dist - 3) < 0.3f)
+				continue;
+
+			++numsamples;
+
+			if ((dist < 3) != IsCovered(arena, x, y))
+				++numerrors;
+		}
+	}
+
+	printf("round stroke: %d of %d samples differ\n", numerrors, numsamples);
+	success = success && (numerrors == 0);
+
+	// mitered closed square covers [-3, 103]^2 minus (3, 97)^2
+	arena.Reset();
+
+	style.join = LineJoinTypeMiter;
+	style.cap = LineCapTypeButt;
+
+	tessellator.BeginPath();
+	tessellator.MoveTo(0, 0);
+	tessellator.LineTo(100, 0);
+	tessellator.LineTo(100, 100);
+	tessellator.LineTo(0, 100);
+	tessellator.ClosePath();
+	tessellator.Stroke(arena, style);
+
+	numerrors = numsamples = 0;
+
+	for (float y = -10; y < 110; y += 0.71f) {
+		for (float x = -10; x < 110; x += 0.71f) {
+			bool inside = (x > -3 && x < 103 && y > -3 && y < 103) && !(x > 3 && x < 97 && y > 3 && y < 97);
+
+			++numsamples;
+
+			if (inside != IsCovered(arena, x, y))
+				++numerrors;
+		}
+	}
+
+	printf("miter square: %d of %d samples differ\n", numerrors, numsamples);
+	success = success && (numerrors == 0);
+
+	// concave fill must cover the polygon exactly once, with counter-clockwise triangles
+	Math::Vector2 star[10];
+	double polyarea = 0;
+	double triarea = 0;
+	bool counterclockwise = true;
+
+	for (int i = 0; i < 10; ++i) {
+		float radius = ((i & 1) ? 20.0f : 50.0f);
+		float angle = i * Math::TWO_PI / 10;
+
+		star[i] = Math::Vector2(radius * cosf(angle), radius * sinf(angle));
+	}
+
+	for (int i = 0; i < 10; ++i) {
+		const Math::Vector2& a = star[i];
+		const Math::Vector2& b = star[(i + 1) % 10];
+
+		polyarea += 0.5 * (a.x * b.y - b.x * a.y);
+	}
+
+	arena.Reset();
+
+	tessellator.BeginPath();
+	tessellator.MoveTo(star[0].x, star[0].y);
+
+	for (int i = 1; i < 10; ++i)
+		tessellator.LineTo(star[i].x, star[i].y);
+
+	tessellator.ClosePath();
+	tessellator.Fill(arena);
+
+	for (uint32_t i = 0; i < arena.GetNumIndices(); i += 3) {
+		const Math::Vector4& a = arena.GetVertices()[arena.GetIndices()[i + 0]];
+		const Math::Vector4& b = arena.GetVertices()[arena.GetIndices()[i + 1]];
+		const Math::Vector4& c = arena.GetVertices()[arena.GetIndices()[i + 2]];
+
+		double area = 0.5 * ((b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x));
+
+		triarea += area;
+		counterclockwise = counterclockwise && (area > 0);
+	}
+
+	printf("star fill: triangle area %.3f, polygon area %.3f\n", triarea, polyarea);
+	success = success && counterclockwise && (fabs(triarea - polyarea) < 1e-3 * polyarea);
+
+	// dense line art: random polylines of 'linelength' points in a 1000x1000 box
+	std::vector<Math::Vector2> points(numlines * linelength);
+	uint32_t seed = 1;
+
+	auto Random = [&]() -> float {
+		seed = seed * 1664525u + 1013904223u;
+		return (seed >> 8) / 16777216.0f;
+	};
+
+	for (size_t i = 0; i < points.size(); ++i) {
+		points[i].x = Random() * 1000.0f;
+		points[i].y = Random() * 1000.0f;
+	}
+
+	const char* joinnames[] = { "miter", "bevel", "round" };
+
+	style.width = 3;
+	style.cap = LineCapTypeButt;
+
+	printf("%u polylines, %u segments\n", numlines, numlines * (linelength - 1));
+
+	for (int curves = 0; curves < 2; ++curves) {
+		for (int join = 0; join < 3; ++join) {
+			double elapsed = 0;
+
+			if (curves && join != LineJoinTypeMiter)
+				continue;
+
+			style.join = (LineJoinType)join;
+
+			for (int run = -1; run < numruns; ++run) {
+				arena.Reset();
+
+				auto start = Clock::now();
+
+				for (uint32_t i = 0; i < numlines; ++i) {
+					const Math::Vector2* line = &points[i * linelength];
+
+					tessellator.BeginPath();
+					tessellator.MoveTo(line[0].x, line[0].y);
+
+					if (curves) {
+						for (uint32_t j = 1; j + 2 < linelength; j += 3)
+							tessellator.CubicTo(line[j].x, line[j].y, line[j + 1].x, line[j + 1].y, line[j + 2].x, line[j + 2].y);
+					} else {
+						for (uint32_t j = 1; j < linelength; ++j)
+							tessellator.LineTo(line[j].x, line[j].y);
+					}
+
+					tessellator.Stroke(arena, style);
+				}
+
+				if (run >= 0)
+					elapsed += std::chrono::duration<double>(Clock::now() - start).count();
+			}
+
+			printf("%s (%s): %u vertices, %u triangles, %.2f ms, %.1f M vertices/s\n",
+				(curves ? "cubics" : "lines"), joinnames[join], arena.GetNumVertices(), arena.GetNumIndices() / 3,
+				elapsed * 1000 / numruns, (arena.GetNumVertices() * (double)numruns) / elapsed * 1e-6);
+		}
+	}
+
+	if (!success) {
+		printf("* Error: PathTessellator does not match the reference!\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,265 @@
+
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "../Common/physicsworld.h"
+#include "../Common/threadpool.h"
+
+int BenchmarkBroadPhase(int first, int argc, char* argv[])
+{
+	// NOTE: steps overlapping lattices of 100 up to N spheres with every broad phase and compares the results, e.g. -broadphasebench 100000
+	typedef std::chrono::high_resolution_clock Clock;
+
+	const char* names[] = { "brute force", "sweep and prune", "uniform grid" };
+	uint32_t maxbodies = 100000;
+	const int numsteps = 10;
+	const int numrays = 100;
+	bool mismatch = false;
+
+	if (first < argc && argv[first][0] != '-')
+		maxbodies = (uint32_t)atoi(argv[first]);
+
+	for (uint32_t numbodies = 100; numbodies <= maxbodies; numbodies *= 10) {
+		// radius 0.2 at 0.37 spacing, so every sphere starts out penetrating its neighbours
+		uint32_t side = (uint32_t)ceilf(powf((float)numbodies, 1.0f / 3.0f));
+		float extent = side * 0.37f;
+
+		std::vector<float> refhits;
+		size_t refcontacts = 0;
+		int reftype = -1;
+
+		printf("%u bodies:\n", numbodies);
+
+		for (int type = BroadPhaseTypeNone; type <= BroadPhaseTypeUniformGrid; ++type) {
+			if (type == BroadPhaseTypeNone && numbodies > 10000) {
+				printf("  %s: skipped (too many bodies)\n", names[type]);
+				continue;
+			}
+
+			PhysicsWorld world;
+			std::vector<RigidBody*> spheres;
+			std::vector<float> hits;
+			CollisionData collisions;
+			Math::Vector4 params;
+			Math::Vector3 raystart, raydir;
+			size_t numcontacts = 0;
+			int numhits = 0;
+			double collisiontime = 0;
+			double raytime = 0;
+
+			world.SetBroadPhase((BroadPhaseType)type, 0.5f);
+			world.AddStaticBox(1000, 0.1f, 1000)->SetPosition(0, -0.05f, 0);
+
+			for (uint32_t i = 0; i < numbodies; ++i) {
+				RigidBody* sphere = world.AddDynamicSphere(0.2f, 1);
+
+				sphere->SetPosition((i % side) * 0.37f, (i / side / side) * 0.37f + 0.3f, ((i / side) % side) * 0.37f);
+				spheres.push_back(sphere);
+			}
+
+			for (int i = 0; i < numsteps; ++i) {
+				auto start = Clock::now();
+
+				for (RigidBody* sphere : spheres)
+					sphere->Integrate(1.0f / 60.0f);
+
+				collisions.contacts.clear();
+				world.DetectCollisions(collisions);
+
+				// NOTE: brute force also reports separated (speculative) contacts
+				for (const Contact& contact : collisions.contacts) {
+					if (contact.depth > 0)
+						++numcontacts;
+				}
+
+				auto middle = Clock::now();
+
+				for (int j = 0; j < numrays; ++j) {
+					float u = (j + 0.5f) / numrays;
+
+					if (j % 2 == 0) {
+						// steep, tilted down onto the top of the lattice
+						raydir = Math::Vector3(0.3f, -1, 0.2f);
+						raystart = Math::Vector3(u * extent - 1.5f, extent + 5, (1 - u) * extent - 1);
+					} else {
+						// shallow, from inside the lattice along +x or -x
+						raystart = Math::Vector3(0.5f * extent, u * extent, u * extent);
+						raydir = Math::Vector3((j % 4 == 1 ? 1.0f : -1.0f), -0.1f, 0.35f);
+					}
+
+					if (world.RayIntersect(params, raystart, raydir) != nullptr) {
+						hits.push_back(params[3]);
+						++numhits;
+					} else {
+						hits.push_back(FLT_MAX);
+					}
+				}
+
+				auto end = Clock::now();
+
+				collisiontime += std::chrono::duration<double, std::milli>(middle - start).count();
+				raytime += std::chrono::duration<double, std::milli>(end - middle).count();
+			}
+
+			printf("  %s: %.3f ms/step collisions, %.3f ms/step rays (%zu penetrating contacts, %d ray hits)\n",
+				names[type], collisiontime / numsteps, raytime / numsteps, numcontacts, numhits);
+
+			if (reftype == -1) {
+				refcontacts = numcontacts;
+				refhits = hits;
+				reftype = type;
+			} else if (numcontacts != refcontacts || hits != refhits) {
+				printf("* Error: %s disagrees with %s!\n", names[type], names[reftype]);
+				mismatch = true;
+			}
+		}
+	}
+
+	return (mismatch ? 1 : 0);
+}
+
+int BenchmarkSolver(int first, int argc, char* argv[])
+{
+	// NOTE: steps sphere piles (one island each) with 1 and N threads and checks that the results match bitwise, e.g. -solverbench 64 -threads 8
+	typedef std::chrono::high_resolution_clock Clock;
+
+	uint32_t numpiles = 64;
+	uint32_t numthreads = 0;
+	const uint32_t pilesize = 160;
+	const int numsteps = 240;
+
+	std::vector<Math::Vector3> reference;
+	bool mismatch = false;
+
+	if (first < argc && argv[first][0] != '-')
+		numpiles = (uint32_t)atoi(argv[first]);
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+			numthreads = (uint32_t)atoi(argv[++i]);
+	}
+
+	if (numthreads == 0)
+		numthreads = Math::Max<uint32_t>(std::thread::hardware_concurrency(), 1);
+
+	for (uint32_t threads : { 1u, numthreads }) {
+		PhysicsWorld world;
+		std::vector<RigidBody*> spheres;
+
+		world.SetBroadPhase(BroadPhaseTypeUniformGrid, 0.5f);
+		world.SetNumThreads(threads);
+
+		for (uint32_t i = 0; i < numpiles; ++i) {
+			float x = (i % 8) * 4.0f;
+			float z = (i / 8) * 4.0f;
+
+			world.AddStaticBox(2, 0.5f, 2)->SetPosition(x, -0.25f, z);
+
+			for (uint32_t j = 0; j < pilesize; ++j) {
+				RigidBody* sphere = world.AddDynamicSphere(0.1f, 1);
+
+				sphere->SetPosition(x + (j % 4) * 0.22f - 0.33f, 0.2f + (j / 16) * 0.22f, z + ((j / 4) % 4) * 0.22f - 0.33f);
+				spheres.push_back(sphere);
+			}
+		}
+
+		auto start = Clock::now();
+
+		for (int i = 0; i < numsteps; ++i)
+			world.Step(1.0f / 60.0f);
+
+		double elapsed = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+		printf("%u threads: %.3f ms/step (%zu bodies)\n", threads, elapsed / numsteps, spheres.size());
+
+		if (reference.empty()) {
+			for (RigidBody* sphere : spheres)
+				reference.push_back(sphere->GetPosition());
+		} else {
+			for (size_t j = 0; j < spheres.size(); ++j)
+				mismatch |= (memcmp(&reference[j], &spheres[j]->GetPosition(), sizeof(Math::Vector3)) != 0);
+		}
+	}
+
+	printf(mismatch ? "* Error: results depend on the number of threads!\n" : "Results are identical\n");
+	return (mismatch ? 1 : 0);
+}
+
+static int CountTunneledBodies(bool boxes, float dt)
+{
+	// fast bodies against a 5 cm wall, and fast pairs heading into each other
+	PhysicsWorld world;
+	std::vector<RigidBody*> bodies;
+	Math::Quaternion orientation;
+	int numtunneled = 0;
+
+	world.SetGravity(Math::Vector3(0, 0, 0));
+	world.SetNumThreads(1);
+	world.AddStaticBox(0.05f, 4, 4)->SetPosition(0, 0, 0);
+
+	auto addbody = [&]() -> RigidBody* {
+		RigidBody* body = (boxes ? world.AddDynamicBox(0.1f, 0.1f, 0.1f, 1) : world.AddDynamicSphere(0.05f, 1));
+
+		bodies.push_back(body);
+		return body;
+	};
+
+	for (int i = 0; i < 16; ++i) {
+		RigidBody* body = addbody();
+
+		if (boxes) {
+			Math::QuaternionRotationAxis(orientation, i * 0.3f, 0.3f, 1, 0.2f);
+			body->SetOrientation(orientation);
+		}
+
+		body->SetPosition(-3, (i % 4) * 0.8f - 1.2f, (i / 4) * 0.8f - 1.2f);
+		body->SetVelocity(200.0f + i * 10, 0, 0);
+	}
+
+	for (int i = 0; i < 8; ++i) {
+		RigidBody* left = addbody();
+		RigidBody* right = addbody();
+
+		left->SetPosition(-2.5f, 3 + i * 0.5f, 0);
+		right->SetPosition(-1.5f, 3 + i * 0.5f, 0);
+
+		left->SetVelocity(150, 0, 0);
+		right->SetVelocity(-150, 0, 0);
+	}
+
+	int numsteps = (int)(0.2f / dt);
+
+	for (int i = 0; i < numsteps; ++i)
+		world.Step(dt);
+
+	for (int i = 0; i < 16; ++i) {
+		if (bodies[i]->GetPosition().x > 0)
+			++numtunneled;
+	}
+
+	for (int i = 0; i < 8; ++i) {
+		if (bodies[16 + 2 * i]->GetPosition().x > bodies[17 + 2 * i]->GetPosition().x)
+			++numtunneled;
+	}
+
+	return numtunneled;
+}
+
+int TestTunneling(int, int, char*[])
+{
+	// NOTE: 16 bodies at 200-350 m/s against a thin wall and 8 head-on pairs at 150 m/s, e.g. -tunneltest
+	int numfailed = 0;
+
+	for (float dt : { 1.0f / 240.0f, 1.0f / 60.0f, 1.0f / 30.0f }) {
+		int spheres = CountTunneledBodies(false, dt);
+		int boxes = CountTunneledBodies(true, dt);
+
+		printf("dt = %.4f: %d of 24 spheres tunneled, %d of 24 boxes tunneled\n", dt, spheres, boxes);
+		numfailed += spheres + boxes;
+	}
+
+	return (numfailed > 0 ? 1 : 0);
+}
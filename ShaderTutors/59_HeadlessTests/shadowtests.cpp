@@ -0,0 +1,229 @@
+
+#include <cstdio>
+#include <chrono>
+#include <vector>
+
+#include "../Common/geometryutils.h"
+#include "../Common/shadowcascades.h"
+
+static bool FitLiSPSMReference(
+	Math::Matrix& out, const std::vector<Math::Vector3>& frustumbody, const Math::AABox& scenebox,
+	const Math::Vector3& eyepos, const Math::Vector3& viewdir, const Math::Vector3& lightdir, float viewnear)
+{
+	// NOTE: the previous GeometryUtils path of 43_LightSpacePerspectiveSM (with the same n_opt and projection center as ShadowCascades)
+	std::vector<Math::Vector3> isectpoints = frustumbody;
+
+	if (isectpoints.empty())
+		return false;
+
+	GeometryUtils::LightVolumeIntersectAABox(isectpoints, -lightdir, scenebox);
+
+	Math::AABox lsbody;
+	Math::Matrix lslightview(1, 1, 1, 1);
+	Math::Matrix lispsmproj(1, 1, 1, 1);
+	Math::Matrix lslightviewproj;
+	Math::Matrix fittounitcube;
+	Math::Vector3 lsleft, lsup;
+	Math::Vector3 corrected;
+
+	Math::Vec3Cross(lsleft, lightdir, viewdir);
+	Math::Vec3Normalize(lsleft, lsleft);
+
+	Math::Vec3Cross(lsup, lsleft, lightdir);
+	Math::Vec3Normalize(lsup, lsup);
+
+	lslightview._11 = lsleft.x;	lslightview._12 = lsup.x;	lslightview._13 = lightdir.x;
+	lslightview._21 = lsleft.y;	lslightview._22 = lsup.y;	lslightview._23 = lightdir.y;
+	lslightview._31 = lsleft.z;	lslightview._32 = lsup.z;	lslightview._33 = lightdir.z;
+
+	lslightview._41 = -Math::Vec3Dot(lsleft, eyepos);
+	lslightview._42 = -Math::Vec3Dot(lsup, eyepos);
+	lslightview._43 = -Math::Vec3Dot(lightdir, eyepos);
+
+	GeometryUtils::CalculateAABoxFromPoints(lsbody, isectpoints, lslightview);
+
+	float cosgamma	= Math::Vec3Dot(viewdir, lightdir);
+	float singamma	= sqrtf(1.0f - cosgamma * cosgamma);
+	float znear		= viewnear / singamma;
+	float d			= fabs(lsbody.Max.y - lsbody.Min.y);
+	float zfar		= znear + d * singamma;
+	float n			= (znear + sqrtf(zfar * znear)) / singamma;
+	float f			= n + d;
+
+	lispsmproj._22 = (f + n) / (f - n);
+	lispsmproj._42 = -2 * f * n / (f - n);
+	lispsmproj._24 = 1;
+	lispsmproj._44 = 0;
+
+	corrected = eyepos + lsup * (lsbody.Min.y - n);
+
+	lslightview._41 = -Math::Vec3Dot(lsleft, corrected);
+	lslightview._42 = -Math::Vec3Dot(lsup, corrected);
+	lslightview._43 = -Math::Vec3Dot(lightdir, corrected);
+
+	Math::MatrixMultiply(lslightviewproj, lslightview, lispsmproj);
+	GeometryUtils::CalculateAABoxFromPoints(lsbody, isectpoints, lslightviewproj);
+
+	Math::MatrixOrthoOffCenterRH(
+		fittounitcube,
+		lsbody.Min.x, lsbody.Max.x,
+		lsbody.Min.y, lsbody.Max.y,
+		-lsbody.Min.z, -lsbody.Max.z);
+
+	Math::MatrixMultiply(out, lslightviewproj, fittounitcube);
+	return true;
+}
+
+int BenchmarkCascades(int first, int argc, char* argv[])
+{
+	// NOTE: fits 4 and 8 cascades for random sun directions and compares with the GeometryUtils path, e.g. -cascadebench 1000
+	typedef std::chrono::high_resolution_clock Clock;
+
+	ShadowCascade				cascades[MAX_SHADOW_CASCADES];
+	std::vector<Math::Vector3>	lightdirs;
+	std::vector<Math::Vector3>	frustumbodies[MAX_SHADOW_CASCADES];
+	Math::Vector3				bodypoints[MAX_BODY_POINTS];
+	Math::AABox					scenebox(-50, 0, -50, 50, 20, 50);
+	Math::Matrix				view, proj;
+	Math::Matrix				splitproj, viewproj;
+	Math::Matrix				reference;
+	Math::Vector3				eye(-30, 5, 10);
+	Math::Vector3				viewdir;
+	uint32_t					numlights		= 1000;
+	uint32_t					numerrors		= 0;
+	const uint32_t				numchecked		= 50;
+	const int					numruns			= 20;
+
+	if (first < argc && argv[first][0] != '-')
+		numlights = Math::Max<uint32_t>(numchecked, (uint32_t)atoi(argv[first]));
+
+	srand(3);
+
+	for (uint32_t i = 0; i < numlights; ++i) {
+		Math::Vector3 dir;
+
+		dir.x = (rand() % 2001) / 1000.0f - 1;
+		dir.y = -(rand() % 1001) / 1000.0f - 0.2f;
+		dir.z = (rand() % 2001) / 1000.0f - 1;
+
+		Math::Vec3Normalize(dir, dir);
+		lightdirs.push_back(dir);
+	}
+
+	Math::MatrixLookAtRH(view, eye, Math::Vector3(20, 2, -10), Math::Vector3(0, 1, 0));
+	Math::MatrixPerspectiveFovRH(proj, Math::DegreesToRadians(60), 16.0f / 9.0f, 0.1f, 200.0f);
+
+	viewdir = Math::Vector3(-view._13, -view._23, -view._33);
+
+	for (uint32_t numcascades = 4; numcascades <= 8; numcascades += 4) {
+		ShadowCascades setup(numcascades, 0.75f);
+		float maxbodyerror = 0;
+		float maxmatrixerror = 0;
+
+		setup.Update(view, proj, scenebox);
+
+		// bodies
+		for (uint32_t i = 0; i < numcascades; ++i) {
+			const Math::Vector2& split = setup.GetSplit(i);
+			Math::AABox body, expected;
+
+			Math::MatrixPerspectiveFovRH(splitproj, Math::DegreesToRadians(60), 16.0f / 9.0f, split.x, split.y);
+			Math::MatrixMultiply(viewproj, view, splitproj);
+
+			frustumbodies[i].clear();
+			GeometryUtils::FrustumIntersectAABox(frustumbodies[i], viewproj, scenebox);
+			uint32_t numpoints = setup.GetBodyPoints(bodypoints, i);
+
+			for (uint32_t j = 0; j < numpoints; ++j)
+				body.Add(bodypoints[j]);
+
+			for (size_t j = 0; j < frustumbodies[i].size(); ++j)
+				expected.Add(frustumbodies[i][j]);
+
+			if ((numpoints == 0) != frustumbodies[i].empty()) {
+				++numerrors;
+				continue;
+			}
+
+			for (int j = 0; j < 3 && numpoints > 0; ++j) {
+				maxbodyerror = Math::Max(maxbodyerror, fabsf(body.Min[j] - expected.Min[j]));
+				maxbodyerror = Math::Max(maxbodyerror, fabsf(body.Max[j] - expected.Max[j]));
+			}
+		}
+
+		// matrices (relative difference)
+		for (uint32_t i = 0; i < numchecked; ++i) {
+			setup.FitLiSPSM(cascades, lightdirs[i]);
+
+			for (uint32_t j = 0; j < numcascades; ++j) {
+				if (!FitLiSPSMReference(reference, frustumbodies[j], scenebox, eye, viewdir, lightdirs[i], cascades[j].splits.x))
+					continue;
+
+				for (int k = 0; k < 16; ++k) {
+					float a = reference[k / 4][k % 4];
+					float b = cascades[j].lightviewproj[k / 4][k % 4];
+
+					maxmatrixerror = Math::Max(maxmatrixerror, fabsf(a - b) / (fabsf(a) + 1e-3f));
+				}
+			}
+		}
+
+		// timing
+		float checksum = 0;
+		auto start = Clock::now();
+
+		for (int i = 0; i < numruns; ++i) {
+			setup.Update(view, proj, scenebox);
+
+			for (uint32_t j = 0; j < numlights; ++j) {
+				setup.FitLiSPSM(cascades, lightdirs[j]);
+				checksum += cascades[0].lightviewproj._11;
+			}
+		}
+
+		double lispsmtime = std::chrono::duration<double, std::milli>(Clock::now() - start).count() / numruns;
+		start = Clock::now();
+
+		for (int i = 0; i < numruns; ++i) {
+			setup.Update(view, proj, scenebox);
+
+			for (uint32_t j = 0; j < numlights; ++j) {
+				setup.FitOrtho(cascades, lightdirs[j]);
+				checksum += cascades[0].lightviewproj._11;
+			}
+		}
+
+		double orthotime = std::chrono::duration<double, std::milli>(Clock::now() - start).count() / numruns;
+		start = Clock::now();
+
+		for (uint32_t j = 0; j < numlights; ++j) {
+			for (uint32_t k = 0; k < numcascades; ++k) {
+				const Math::Vector2& split = setup.GetSplit(k);
+
+				Math::MatrixPerspectiveFovRH(splitproj, Math::DegreesToRadians(60), 16.0f / 9.0f, split.x, split.y);
+				Math::MatrixMultiply(viewproj, view, splitproj);
+
+				frustumbodies[k].clear();
+				GeometryUtils::FrustumIntersectAABox(frustumbodies[k], viewproj, scenebox);
+
+				if (FitLiSPSMReference(reference, frustumbodies[k], scenebox, eye, viewdir, lightdirs[j], split.x))
+					checksum += reference._11;
+			}
+		}
+
+		double referencetime = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+		printf("%u lights x %u cascades: LiSPSM %.3f ms, ortho %.3f ms, GeometryUtils path %.3f ms (checksum %g)\n",
+			numlights, numcascades, lispsmtime, orthotime, referencetime, checksum);
+
+		printf("max body difference: %g, max relative matrix difference: %g\n", maxbodyerror, maxmatrixerror);
+
+		if (maxbodyerror > 1e-2f || maxmatrixerror > 5e-2f)
+			++numerrors;
+	}
+
+	if (numerrors > 0)
+		printf("* Error: ShadowCascades differs from the GeometryUtils path!\n");
+
+	return (numerrors > 0 ? 1 : 0);
+}
@@ -0,0 +1,149 @@
+
+#include <cstdio>
+#include <chrono>
+
+#include "../Common/terrainquadtree.h"
+
+#define MESH_SIZE			256					// same as 56_Ocean
+#define PATCH_SIZE			20.0f				// m
+#define FURTHEST_COVER		8					// full ocean size = PATCH_SIZE * (1 << FURTHEST_COVER)
+#define MAX_COVERAGE		64.0f				// pixel limit for a distant patch to be rendered
+
+static bool ComparePatches(const TerrainQuadTree::PatchList& patches1, const TerrainQuadTree::PatchList& patches2)
+{
+	if (patches1.size() != patches2.size())
+		return false;
+
+	for (size_t i = 0; i < patches1.size(); ++i) {
+		const TerrainQuadTree::Patch& patch1 = patches1[i];
+		const TerrainQuadTree::Patch& patch2 = patches2[i];
+
+		if (patch1.start.x != patch2.start.x || patch1.start.y != patch2.start.y || patch1.length != patch2.length ||
+			patch1.lod != patch2.lod || patch1.subset != patch2.subset)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int BenchmarkQuadTree(int first, int argc, char* argv[])
+{
+	// NOTE: flies over the ocean and rebuilds the quadtree both ways, e.g. -terrainbench 2000
+	typedef std::chrono::high_resolution_clock Clock;
+
+	struct TreeConfig
+	{
+		int		meshsize;
+		int		furthestcover;
+		float	patchsize;
+		float	maxcoverage;
+	};
+
+	// the setup of 56_Ocean, then denser grids with deep trees (lodcount = log2(meshsize), coverage is in pixels per grid cell)
+	const TreeConfig configs[] = {
+		{ MESH_SIZE, FURTHEST_COVER, PATCH_SIZE, MAX_COVERAGE },
+		{ 1024, 12, 2.0f, 0.02f },
+		{ 4096, 14, 0.5f, 0.0002f }
+	};
+
+	Math::Matrix	view, proj, viewproj;
+	Math::Vector3	eye, look;
+	uint32_t		numframes		= 1000;
+	uint32_t		nummismatches	= 0;
+
+	if (first < argc && argv[first][0] != '-')
+		numframes = (uint32_t)atoi(argv[first]);
+
+	Math::MatrixPerspectiveFovRH(proj, Math::DegreesToRadians(60), 1360.0f / 768.0f, 1.0f, 2000.0f);
+
+	for (const TreeConfig& config : configs) {
+		TerrainQuadTree	fulltree;
+		TerrainQuadTree	incrtree;
+		uint32_t		fullevaluated	= 0;
+		uint32_t		increvaluated	= 0;
+		uint32_t		fullpatches		= 0;
+		uint32_t		incrpatches		= 0;
+		double			fulltime		= 0;
+		double			incrtime		= 0;
+
+		float ocean_extent = config.patchsize * (1 << config.furthestcover);
+		float ocean_start[2] = { -0.5f * ocean_extent, -0.5f * ocean_extent };
+		int lodcount = (int)Math::Log2OfPow2(config.meshsize);
+
+		auto initialize = [&](TerrainQuadTree& tree) {
+			tree.Initialize(ocean_start, ocean_extent, lodcount, config.meshsize, config.patchsize, config.maxcoverage, 1360.0f * 768.0f);
+		};
+
+		// a new tree has no previous decisions, so its first frame must match Rebuild
+		auto checkfresh = [&](const char* what) {
+			TerrainQuadTree freshtree;
+
+			initialize(freshtree);
+			freshtree.RebuildIncremental(viewproj, proj, eye);
+
+			if (!ComparePatches(freshtree.GetPatches(), fulltree.GetPatches())) {
+				printf("* Error: new incremental tree differs from Rebuild (%s, eye = (%.1f, %.1f, %.1f))!\n", what, eye.x, eye.y, eye.z);
+				++nummismatches;
+			}
+		};
+
+		initialize(fulltree);
+		initialize(incrtree);
+
+		// static view
+		eye = { 300, 30, -200 };
+		look = { 350, 0, -100 };
+
+		Math::MatrixLookAtRH(view, eye, look, Math::Vector3(0, 1, 0));
+		Math::MatrixMultiply(viewproj, view, proj);
+
+		fulltree.Rebuild(viewproj, proj, eye);
+		checkfresh("static view");
+
+		for (uint32_t i = 0; i < numframes; ++i) {
+			// circle at 15 m/s (60 fps), bobbing between 5 and 45 m, looking slightly down
+			float time = i / 60.0f;
+			float angle = time * 15.0f / 1000.0f;
+
+			eye = { cosf(angle) * 1000.0f, 25.0f + 20.0f * sinf(time * 0.5f), sinf(angle) * 1000.0f };
+			look = { eye.x - sinf(angle) * 100.0f, 0.0f, eye.z + cosf(angle) * 100.0f };
+
+			Math::MatrixLookAtRH(view, eye, look, Math::Vector3(0, 1, 0));
+			Math::MatrixMultiply(viewproj, view, proj);
+
+			auto start = Clock::now();
+
+			fulltree.Rebuild(viewproj, proj, eye);
+
+			auto middle = Clock::now();
+
+			incrtree.RebuildIncremental(viewproj, proj, eye);
+
+			auto end = Clock::now();
+
+			fulltime += std::chrono::duration<double, std::milli>(middle - start).count();
+			incrtime += std::chrono::duration<double, std::milli>(end - middle).count();
+
+			fullevaluated += fulltree.GetNumEvaluatedNodes();
+			increvaluated += incrtree.GetNumEvaluatedNodes();
+			fullpatches += (uint32_t)fulltree.GetPatches().size();
+			incrpatches += (uint32_t)incrtree.GetPatches().size();
+
+			if (i == 0 && !ComparePatches(incrtree.GetPatches(), fulltree.GetPatches())) {
+				printf("* Error: first incremental frame differs from Rebuild!\n");
+				++nummismatches;
+			}
+
+			if (i % 100 == 0)
+				checkfresh("fly-through");
+		}
+
+		printf("mesh %d, %d LODs, ocean %.0f m, %u frames\n", config.meshsize, lodcount, ocean_extent, numframes);
+		printf("Rebuild: %.3f ms/frame, %.1f nodes evaluated, %.1f patches\n", fulltime / numframes, fullevaluated / (double)numframes, fullpatches / (double)numframes);
+		printf("RebuildIncremental: %.3f ms/frame, %.1f nodes evaluated, %.1f patches\n", incrtime / numframes, increvaluated / (double)numframes, incrpatches / (double)numframes);
+	}
+
+	return (nummismatches > 0 ? 1 : 0);
+}
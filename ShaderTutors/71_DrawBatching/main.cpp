@@ -23,15 +23,24 @@
 #pragma comment(lib, "gdiplus.lib")
 
 #include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <vector>
 
 #include "..\Common\application.h"
 #include "..\Common\vk1ext.h"
 #include "..\Common\basiccamera.h"
+#include "..\Common\frustumculler.h"
+#include "..\Common\threadpool.h"
+#include "..\Common\batchcache.h"
 
 #define OBJECT_GRID_SIZE	64		// nxn objects
 #define TILE_GRID_SIZE		32		// kxk tiles
 #define SPACING				0.4f
 #define CAMERA_SPEED		0.05f
+#define RECORDED_OBJECT_SIZE	256					// estimated command buffer memory per object
+#define BATCH_CACHE_BUDGET		(1024 * 1024)		// keep hidden tiles recorded up to this
 
 // helper macros
 #define TITLE				"Shader sample 71: Draw call batching"
@@ -85,59 +94,47 @@ class SceneObject
 private:
 	Math::Matrix	world;
 	uint32_t		materialoffset;
-	bool			encoded;
+	uint32_t		index;
 
 	SceneObjectPrototype* proto;
 
 public:
-	SceneObject(SceneObjectPrototype* prototype);
+	SceneObject(SceneObjectPrototype* prototype, uint32_t index);
 
 	void Draw(VkCommandBuffer commandbuffer, VulkanGraphicsPipeline* pipeline);
 	void GetBoundingBox(Math::AABox& outbox) const;
 
-	inline bool IsEncoded() const						{ return encoded; }
 	inline Math::Matrix& GetTransform()					{ return world; }
 	inline const SceneObjectPrototype* GetProto() const	{ return proto; }
+	inline uint32_t GetIndex() const					{ return index; }
 
 	inline void SetMaterialOffset(uint32_t offset)		{ materialoffset = offset; }
-	inline void SetEncoded(bool value)					{ encoded = value; }
 };
 
 class DrawBatch
 {
 public:
-	struct TileObject {
-		SceneObject*	object;
-		bool			encoded[2];
-	};
-
-	typedef std::vector<TileObject> TileObjectArray;
+	typedef std::vector<SceneObject*> TileObjectArray;
 
 private:
 	TileObjectArray	tileobjects;
 	Math::AABox		boundingbox;
 	VkCommandBuffer	commandbuffers[2];
-	bool			markedfordiscard[2];
-	bool			discarded[2];
-	uint32_t		lastenqueuedframe;
+	uint32_t		index;
 
 public:
-	DrawBatch();
+	DrawBatch(uint32_t index);
 	~DrawBatch();
 
 	void AddObject(SceneObject* obj);
 	void DebugDraw(VkCommandBuffer commandbuffer, VulkanGraphicsPipeline* pipeline);
-	void Discard(uint32_t finishedframe);
-	void Regenerate(uint32_t currentimage, VkRenderPass renderpass, VkFramebuffer framebuffer, VulkanGraphicsPipeline* pipeline);
-
-	VkCommandBuffer SetForRender(uint32_t frameid, uint32_t currentimage);
+	void Release(uint32_t image);
+	void Regenerate(uint32_t currentimage, VkRenderPass renderpass, VkFramebuffer framebuffer, VulkanGraphicsPipeline* pipeline, const BatchCache* cache);
 
-	inline void MarkForDiscard(uint32_t currentimage)		{ markedfordiscard[currentimage] = true; }
-
-	inline const Math::AABox& GetBoundingBox() const		{ return boundingbox; }
-	inline const TileObjectArray& GetObjects() const		{ return tileobjects; }
-	inline bool IsDiscarded(uint32_t currentimage) const	{ return discarded[currentimage]; }
-	inline bool IsMarkedForDiscard() const					{ return (markedfordiscard[0] || markedfordiscard[1]); }
+	inline VkCommandBuffer GetCommandBuffer(uint32_t currentimage) const	{ return commandbuffers[currentimage]; }
+	inline const Math::AABox& GetBoundingBox() const						{ return boundingbox; }
+	inline const TileObjectArray& GetObjects() const						{ return tileobjects; }
+	inline uint32_t GetIndex() const										{ return index; }
 };
 
 typedef std::vector<SceneObject*> ObjectArray;
@@ -163,6 +160,10 @@ SceneObjectPrototype*		prototypes[3]		= { nullptr };
 ObjectArray					sceneobjects;
 BatchArray					tiles;
 BatchArray					visibletiles;
+FrustumCuller				tileculler;
+FrustumCuller::CullResults	cullresults;
+ThreadPool*					workers				= nullptr;
+BatchCache*					batchcache			= nullptr;
 BasicCamera					debugcamera;
 uint32_t					totalpolys			= 0;
 float						totalwidth;
@@ -195,26 +196,24 @@ void SceneObjectPrototype::Draw(VkCommandBuffer commandbuffer)
 
 // --- SceneObject impl -------------------------------------------------------
 
-SceneObject::SceneObject(SceneObjectPrototype* prototype)
+SceneObject::SceneObject(SceneObjectPrototype* prototype, uint32_t index)
 {
 	VK_ASSERT(prototype);
 
 	proto = prototype;
 	materialoffset = 0;
-	encoded = false;
+
+	this->index = index;
 
 	Math::MatrixIdentity(world);
 }
 
 void SceneObject::Draw(VkCommandBuffer commandbuffer, VulkanGraphicsPipeline* pipeline)
 {
-	if (!encoded) {
-		vkCmdPushConstants(commandbuffer, pipeline->GetPipelineLayout(), VK_SHADER_STAGE_VERTEX_BIT, 0, 64, world);
-		vkCmdBindDescriptorSets(commandbuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->GetPipelineLayout(), 0, 1, pipeline->GetDescriptorSets(0), 1, &materialoffset);
+	vkCmdPushConstants(commandbuffer, pipeline->GetPipelineLayout(), VK_SHADER_STAGE_VERTEX_BIT, 0, 64, world);
+	vkCmdBindDescriptorSets(commandbuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->GetPipelineLayout(), 0, 1, pipeline->GetDescriptorSets(0), 1, &materialoffset);
 
-		proto->Draw(commandbuffer);
-		encoded = true;
-	}
+	proto->Draw(commandbuffer);
 }
 
 void SceneObject::GetBoundingBox(Math::AABox& outbox) const
@@ -225,7 +224,7 @@ void SceneObject::GetBoundingBox(Math::AABox& outbox) const
 
 // --- DrawBatch impl ---------------------------------------------------------
 
-DrawBatch::DrawBatch()
+DrawBatch::DrawBatch(uint32_t index)
 {
 	VkCommandBufferAllocateInfo cmdbuffinfo = {};
 	VkResult res;
@@ -239,11 +238,7 @@ DrawBatch::DrawBatch()
 	res = vkAllocateCommandBuffers(driverInfo.device, &cmdbuffinfo, commandbuffers);
 	VK_ASSERT(res == VK_SUCCESS);
 
-	markedfordiscard[0] = false;
-	markedfordiscard[1] = false;
-
-	discarded[0] = true;
-	discarded[1] = true;
+	this->index = index;
 }
 
 DrawBatch::~DrawBatch()
@@ -254,17 +249,12 @@ DrawBatch::~DrawBatch()
 
 void DrawBatch::AddObject(SceneObject* obj)
 {
-	Math::AABox	objbox;
-	TileObject	tileobj;
+	Math::AABox objbox;
 
 	if (tileobjects.size() >= tileobjects.capacity())
 		tileobjects.reserve(tileobjects.capacity() + 16);
 
-	tileobj.object = obj;
-	tileobj.encoded[0] = false;
-	tileobj.encoded[1] = false;
-
-	tileobjects.push_back(tileobj);
+	tileobjects.push_back(obj);
 	obj->GetBoundingBox(objbox);
 
 	boundingbox.Add(objbox.Min);
@@ -274,39 +264,17 @@ void DrawBatch::AddObject(SceneObject* obj)
 void DrawBatch::DebugDraw(VkCommandBuffer commandbuffer, VulkanGraphicsPipeline* pipeline)
 {
 	for (size_t j = 0; j < tileobjects.size(); ++j)
-		tileobjects[j].object->Draw(commandbuffer, pipeline);
+		tileobjects[j]->Draw(commandbuffer, pipeline);
 }
 
-void DrawBatch::Discard(uint32_t finishedframe)
+void DrawBatch::Release(uint32_t image)
 {
-	if (finishedframe == lastenqueuedframe) {
-		for (int j = 0; j < 2; ++j) {
-			if (markedfordiscard[j] && !discarded[j]) {
-				for (size_t i = 0; i < tileobjects.size(); ++i)
-					tileobjects[i].encoded[j] = false;
-
-				vkResetCommandBuffer(commandbuffers[j], VK_COMMAND_BUFFER_RESET_RELEASE_RESOURCES_BIT);
-				
-				discarded[j] = true;
-				markedfordiscard[j] = false;
-			}
-		}
-	}
+	// NOTE: the cache guarantees that it's not in flight
+	vkResetCommandBuffer(commandbuffers[image], VK_COMMAND_BUFFER_RESET_RELEASE_RESOURCES_BIT);
 }
 
-void DrawBatch::Regenerate(uint32_t currentimage, VkRenderPass renderpass, VkFramebuffer framebuffer, VulkanGraphicsPipeline* pipeline)
+void DrawBatch::Regenerate(uint32_t currentimage, VkRenderPass renderpass, VkFramebuffer framebuffer, VulkanGraphicsPipeline* pipeline, const BatchCache* cache)
 {
-	if (!discarded[currentimage]) {
-		// not deleted yet, mark them encoded
-		for (size_t i = 0; i < tileobjects.size(); ++i) {
-			if( tileobjects[i].encoded[currentimage] )
-				tileobjects[i].object->SetEncoded(true);
-		}
-
-		markedfordiscard[currentimage] = false;
-		return;
-	}
-
 	VkCommandBufferInheritanceInfo	inheritanceinfo	= {};
 	VkCommandBufferBeginInfo		begininfo		= {};
 	VkResult res;
@@ -333,24 +301,12 @@ void DrawBatch::Regenerate(uint32_t currentimage, VkRenderPass renderpass, VkFra
 		vkCmdSetScissor(commandbuffers[currentimage], 0, 1, pipeline->GetScissor());
 
 		for (size_t j = 0; j < tileobjects.size(); ++j) {
-			bool alreadyencoded = tileobjects[j].object->IsEncoded();
-			tileobjects[j].encoded[currentimage] = !alreadyencoded;
-
-			if (!alreadyencoded) {
-				// don't encode more than once
-				tileobjects[j].object->Draw(commandbuffers[currentimage], pipeline);
-			}
+			// objects spanning more tiles are only drawn by their owner
+			if (cache->GetOwner(tileobjects[j]->GetIndex()) == index)
+				tileobjects[j]->Draw(commandbuffers[currentimage], pipeline);
 		}
 	}
 	vkEndCommandBuffer(commandbuffers[currentimage]);
-
-	discarded[currentimage] = false;
-}
-
-VkCommandBuffer DrawBatch::SetForRender(uint32_t frameid, uint32_t currentimage)
-{
-	lastenqueuedframe = frameid;
-	return commandbuffers[currentimage];
 }
 
 // --- Sample impl ------------------------------------------------------------
@@ -415,7 +371,7 @@ bool InitScene()
 
 			SceneObjectPrototype* proto = prototypes[index];
 
-			sceneobjects.push_back(new SceneObject(proto));
+			sceneobjects.push_back(new SceneObject(proto, (uint32_t)sceneobjects.size()));
 			totalpolys += proto->GetMesh()->GetNumPolygons();
 
 			Math::MatrixRotationAxis(rotation, angle, 0, 1, 0);
@@ -556,6 +512,7 @@ bool InitScene()
 	float		tiledepth = totaldepth / TILE_GRID_SIZE;
 
 	tiles.resize(TILE_GRID_SIZE * TILE_GRID_SIZE, 0);
+	batchcache = new BatchCache((uint32_t)tiles.size(), (uint32_t)sceneobjects.size(), 2, BATCH_CACHE_BUDGET);
 
 	printf("Generatig tiles...\n");
 
@@ -564,20 +521,34 @@ bool InitScene()
 			tilebox.Min = Math::Vector3(totalwidth * -0.5f + j * tilewidth, 0, totaldepth * -0.5f + i * tiledepth);
 			tilebox.Max = Math::Vector3(totalwidth * -0.5f + (j + 1) * tilewidth, totalheight, totaldepth * -0.5f + (i + 1) * tiledepth);
 
-			DrawBatch* batch = (tiles[i * TILE_GRID_SIZE + j] = new DrawBatch());
+			uint32_t index = (uint32_t)(i * TILE_GRID_SIZE + j);
+			DrawBatch* batch = (tiles[index] = new DrawBatch(index));
 
 			// this is REALLY slow...
 			for (size_t k = 0; k < sceneobjects.size(); ++k) {
 				sceneobjects[k]->GetBoundingBox(objbox);
 
-				if (tilebox.Intersects(objbox))
+				if (tilebox.Intersects(objbox)) {
 					batch->AddObject(sceneobjects[k]);
+					batchcache->AddObject(index, (uint32_t)k, RECORDED_OBJECT_SIZE);
+				}
 			}
 		}
 	}
 
 	visibletiles.reserve(tiles.size());
 
+	// setup culling
+	std::vector<Math::AABox> tileboxes(tiles.size());
+
+	for (size_t i = 0; i < tiles.size(); ++i)
+		tileboxes[i] = tiles[i]->GetBoundingBox();
+
+	workers = new ThreadPool();
+
+	tileculler.Build(tileboxes.data(), (uint32_t)tileboxes.size());
+	tileculler.SetThreadPool(workers);
+
 	// help text
 	helptext = VulkanImage::Create2D(VK_FORMAT_B8G8R8A8_UNORM, 512, 512, 1, VK_IMAGE_USAGE_TRANSFER_DST_BIT|VK_IMAGE_USAGE_SAMPLED_BIT);
 
@@ -679,6 +650,12 @@ void UninitScene()
 	tiles.clear();
 	tiles.swap(BatchArray());
 
+	delete workers;
+	delete batchcache;
+
+	workers = nullptr;
+	batchcache = nullptr;
+
 	sceneobjects.clear();
 	sceneobjects.swap(ObjectArray());
 
@@ -739,35 +716,27 @@ void MouseScroll(int32_t x, int32_t y, int16_t dz)
 
 void UpdateTiles(const Math::Matrix& viewproj, uint32_t currentimage)
 {
-	// TODO: make this multithreaded
 	Math::Vector4 planes[6];
 
 	Math::FrustumPlanes(planes, viewproj);
+	tileculler.Cull(cullresults, planes);
+
 	visibletiles.clear();
 
-	// mark all objects non-encoded
-	for (size_t i = 0; i < sceneobjects.size(); ++i)
-		sceneobjects[i]->SetEncoded(false);
+	for (size_t i = 0; i < cullresults.visible.size(); ++i)
+		visibletiles.push_back(tiles[cullresults.visible[i]]);
 
-	for (size_t i = 0; i < tiles.size(); ++i) {
-		const Math::AABox& tilebox = tiles[i]->GetBoundingBox();
+	// NOTE: recordings of hidden tiles are kept until the budget runs out
+	batchcache->Update(currentimage, cullresults.visible);
 
-		if (Math::FrustumIntersect(planes, tilebox) > 0) {
-			visibletiles.push_back(tiles[i]);
+	const BatchCache::ReleaseList& releases = batchcache->GetReleaseList();
+	const BatchCache::IndexList& outdated = batchcache->GetRecordList();
 
-			// mark tile-encoded objects encoded (to avoid double encoding)
-			if (!tiles[i]->IsDiscarded(currentimage))
-				tiles[i]->Regenerate(currentimage, mainrenderpass->GetRenderPass(), mainframebuffers[currentimage], drawbatching);
-		} else {
-			tiles[i]->MarkForDiscard(currentimage);
-		}
-	}
+	for (size_t i = 0; i < releases.size(); ++i)
+		tiles[releases[i].batch]->Release(releases[i].image);
 
-	// regenerate new tiles
-	for (size_t i = 0; i < visibletiles.size(); ++i) { 
-		if (visibletiles[i]->IsDiscarded(currentimage))
-			visibletiles[i]->Regenerate(currentimage, mainrenderpass->GetRenderPass(), mainframebuffers[currentimage], drawbatching);
-	}
+	for (size_t i = 0; i < outdated.size(); ++i)
+		tiles[outdated[i]]->Regenerate(currentimage, mainrenderpass->GetRenderPass(), mainframebuffers[currentimage], drawbatching, batchcache);
 }
 
 void Update(float delta)
@@ -904,7 +873,7 @@ void Render(float alpha, float elapsedtime)
 		std::vector<VkCommandBuffer> secondaries(visibletiles.size(), 0);
 
 		for (size_t i = 0; i < visibletiles.size(); ++i)
-			secondaries[i] = visibletiles[i]->SetForRender(presenter->GetCurrentFrame(), currentdrawable);
+			secondaries[i] = visibletiles[i]->GetCommandBuffer(currentdrawable);
 
 		// only valid command here
 		vkCmdExecuteCommands(primarycmdbuff, (uint32_t)secondaries.size(), secondaries.data());
@@ -937,16 +906,16 @@ void Render(float alpha, float elapsedtime)
 			debugmesh->Draw(primarycmdbuff, false);
 
 			// draw grid
-			for (size_t i = 0, j = 0; i < tiles.size() && j < visibletiles.size(); ++i) {
-				bool visible = (visibletiles[j] == tiles[i]);
-				bool marked = (tiles[i]->IsMarkedForDiscard() && !tiles[i]->IsDiscarded(currentdrawable));
+			for (size_t i = 0, j = 0; i < tiles.size(); ++i) {
+				bool visible = (j < visibletiles.size() && visibletiles[j] == tiles[i]);
+				bool cached = (!visible && batchcache->IsRecorded((uint32_t)i, currentdrawable));
 
-				if (marked)
+				if (cached)
 					debugcolor = Math::Color(1, 0, 0, 1);
 				else
 					debugcolor = Math::Color(1, 1, 1, 1);
 
-				if (visible || marked) {
+				if (visible || cached) {
 					size_t y = i / TILE_GRID_SIZE;
 					size_t x = i % TILE_GRID_SIZE;
 
@@ -986,9 +955,7 @@ void Render(float alpha, float elapsedtime)
 
 void FrameFinished(uint32_t frameid)
 {
-	for (size_t i = 0; i < tiles.size(); ++i) {
-		tiles[i]->Discard(frameid);
-	}
+	batchcache->FrameFinished();
 }
 
 int main(int argc, char* argv[])
@@ -1,5 +1,6 @@
 
 #include <cassert>
+#include <cstring>
 #include "3Dmath.h"
 
 namespace Math {
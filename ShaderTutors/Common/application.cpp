@@ -3,8 +3,15 @@
 
 #ifdef _WIN32
 #	include "win32application.h"
-#elif defined(__APPLE__)
-#	include "macOSapplication.h"
+#else
+#	ifdef __APPLE__
+#		include "macOSapplication.h"
+#	else
+#		include "headlessapplication.h"
+
+typedef int errno_t;
+#	endif
+
 #	include <errno.h>
 #	include <stdarg.h>
 
@@ -19,7 +26,7 @@ int fscanf_s(FILE* stream, const char* format, ...)
 	va_list argptr;
 	va_start(argptr, format);
 	
-	int ret = fscanf(stream, format, argptr);
+	int ret = vfscanf(stream, format, argptr);
 	va_end(argptr);
 	
 	return ret;
@@ -33,7 +40,7 @@ static void ReadResolutionFile(uint32_t& width, uint32_t& height)
 	fopen_s(&infile, "res.conf", "rb");
 
 	if (infile != nullptr) {
-		fscanf_s(infile, "%lu %lu\n", &width, &height);
+		fscanf_s(infile, "%u %u\n", &width, &height);
 		fclose(infile);
 
 		if (width < 640)
@@ -45,7 +52,7 @@ static void ReadResolutionFile(uint32_t& width, uint32_t& height)
 		fopen_s(&infile, "res.conf", "wb");
 
 		if (infile != nullptr) {
-			fprintf(infile, "%ud %ud\n", width, height);
+			fprintf(infile, "%u %u\n", width, height);
 			fclose(infile);
 		}
 	}
@@ -70,6 +77,6 @@ Application* Application::Create(uint32_t width, uint32_t height)
 #elif defined(__APPLE__)
 	return new macOSApplication(width, height);
 #else
-	return nullptr;
+	return new HeadlessApplication(width, height);
 #endif
 }
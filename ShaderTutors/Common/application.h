@@ -12,6 +12,7 @@
 #elif defined (__APPLE__)
 #	define PLATFORM_KEYCODE(win, mac)	mac
 #else
+#	define PLATFORM_KEYCODE(win, mac)	win
 #endif
 
 enum GraphicsAPI
@@ -23,7 +24,8 @@ enum GraphicsAPI
 	GraphicsAPIDirect3D11,
 	GraphicsAPIDirect2D,
 	GraphicsAPIVulkan,
-	GraphicsAPIMetal
+	GraphicsAPIMetal,
+	GraphicsAPINone					// no device, CPU only (headless)
 };
 
 enum MouseButton
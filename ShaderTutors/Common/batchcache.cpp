@@ -0,0 +1,162 @@
+
+#include "batchcache.h"
+
+#define INVALID_INDEX	UINT32_MAX
+
+const uint32_t BatchCache::NoOwner = UINT32_MAX;
+
+BatchCache::BatchCache(uint32_t numbatches, uint32_t numobjects, uint32_t numimages, size_t budget)
+{
+	this->budget		= budget;
+	this->numimages		= numimages;
+
+	usedmemory			= 0;
+	currentframe		= 0;
+	finishedframes		= 0;
+	lruhead				= INVALID_INDEX;
+	lrutail				= INVALID_INDEX;
+	numrecorded			= 0;
+
+	batches.resize(numbatches);
+	owners.resize(numobjects, NoOwner);
+	recordings.resize(numbatches * numimages);
+
+	for (size_t i = 0; i < batches.size(); ++i) {
+		batches[i].size = 0;
+		batches[i].generation = 1;
+	}
+
+	for (size_t i = 0; i < recordings.size(); ++i) {
+		recordings[i].lastframe = 0;
+		recordings[i].size = 0;
+		recordings[i].generation = 0;
+		recordings[i].prev = INVALID_INDEX;
+		recordings[i].next = INVALID_INDEX;
+	}
+}
+
+void BatchCache::AddObject(uint32_t batch, uint32_t object, uint32_t size)
+{
+	if (owners[object] != NoOwner)
+		return;
+
+	owners[object] = batch;
+
+	batches[batch].size += size;
+	++batches[batch].generation;
+}
+
+void BatchCache::InvalidateObject(uint32_t object)
+{
+	// only the owner has it recorded
+	if (owners[object] != NoOwner)
+		++batches[owners[object]].generation;
+}
+
+void BatchCache::InvalidateBatch(uint32_t batch)
+{
+	++batches[batch].generation;
+}
+
+void BatchCache::Unlink(uint32_t recording)
+{
+	Recording& rec = recordings[recording];
+
+	if (rec.prev != INVALID_INDEX)
+		recordings[rec.prev].next = rec.next;
+	else if (lruhead == recording)
+		lruhead = rec.next;
+
+	if (rec.next != INVALID_INDEX)
+		recordings[rec.next].prev = rec.prev;
+	else if (lrutail == recording)
+		lrutail = rec.prev;
+
+	rec.prev = INVALID_INDEX;
+	rec.next = INVALID_INDEX;
+}
+
+void BatchCache::Touch(uint32_t recording)
+{
+	Recording& rec = recordings[recording];
+
+	if (lruhead == recording)
+		return;
+
+	Unlink(recording);
+
+	rec.next = lruhead;
+
+	if (lruhead != INVALID_INDEX)
+		recordings[lruhead].prev = recording;
+
+	lruhead = recording;
+
+	if (lrutail == INVALID_INDEX)
+		lrutail = recording;
+}
+
+void BatchCache::Update(uint32_t image, const IndexList& visible)
+{
+	++currentframe;
+
+	recordlist.clear();
+	releaselist.clear();
+
+	// find outdated recordings
+	for (size_t i = 0; i < visible.size(); ++i) {
+		const Batch& batch = batches[visible[i]];
+		uint32_t index = visible[i] * numimages + image;
+		Recording& rec = recordings[index];
+
+		if (rec.generation != batch.generation) {
+			usedmemory -= rec.size;
+			usedmemory += batch.size;
+
+			rec.generation = batch.generation;
+			rec.size = batch.size;
+
+			recordlist.push_back(visible[i]);
+			++numrecorded;
+		}
+
+		rec.lastframe = currentframe;
+		Touch(index);
+	}
+
+	// free least recently used ones (if not in flight)
+	uint32_t index = lrutail;
+
+	while (usedmemory > budget && index != INVALID_INDEX) {
+		Recording& rec = recordings[index];
+		uint32_t prev = rec.prev;
+
+		if (rec.lastframe <= finishedframes) {
+			Release release;
+
+			release.batch = index / numimages;
+			release.image = index % numimages;
+
+			releaselist.push_back(release);
+			usedmemory -= rec.size;
+
+			rec.generation = 0;
+			rec.size = 0;
+
+			Unlink(index);
+		}
+
+		index = prev;
+	}
+}
+
+void BatchCache::FrameFinished()
+{
+	// NOTE: frames finish in submission order
+	++finishedframes;
+}
+
+bool BatchCache::IsRecorded(uint32_t batch, uint32_t image) const
+{
+	return (recordings[batch * numimages + image].generation != 0);
+}
@@ -0,0 +1,86 @@
+
+#ifndef _BATCHCACHE_H_
+#define _BATCHCACHE_H_
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * \brief Decides which draw batches have to be (re)recorded and which recordings can be freed
+ *
+ * Objects might belong to more than one batch, but only their owner (the first one they
+ * were added to) records them. NOTE: batch bounds must contain their objects, so that the
+ * owner is visible whenever the object is.
+ *
+ * Edits bump the generation of the owner; a recording is up to date if it was made with
+ * the current generation. Recordings are kept (even for hidden batches) until the memory
+ * budget is exceeded, then freed in LRU order.
+ */
+class BatchCache
+{
+public:
+	static const uint32_t NoOwner;
+
+	struct Release
+	{
+		uint32_t batch;
+		uint32_t image;
+	};
+
+	typedef std::vector<uint32_t> IndexList;
+	typedef std::vector<Release> ReleaseList;
+
+private:
+	struct Batch
+	{
+		size_t		size;		// estimated size of a recording
+		uint32_t	generation;
+	};
+
+	struct Recording
+	{
+		uint64_t	lastframe;	// last frame that used it
+		size_t		size;
+		uint32_t	generation;	// 0 means not recorded
+		uint32_t	prev;		// LRU links
+		uint32_t	next;
+	};
+
+	std::vector<Batch>		batches;
+	IndexList				owners;
+	std::vector<Recording>	recordings;		// batch * numimages + image
+	IndexList				recordlist;
+	ReleaseList				releaselist;
+	size_t					budget;
+	size_t					usedmemory;
+	uint64_t				currentframe;
+	uint64_t				finishedframes;
+	uint32_t				numimages;
+	uint32_t				lruhead;		// most recently used
+	uint32_t				lrutail;
+	uint32_t				numrecorded;	// statistics
+
+	void Touch(uint32_t recording);
+	void Unlink(uint32_t recording);
+
+public:
+	BatchCache(uint32_t numbatches, uint32_t numobjects, uint32_t numimages, size_t budget);
+
+	void AddObject(uint32_t batch, uint32_t object, uint32_t size);
+	void InvalidateObject(uint32_t object);
+	void InvalidateBatch(uint32_t batch);
+
+	void Update(uint32_t image, const IndexList& visible);
+	void FrameFinished();
+
+	bool IsRecorded(uint32_t batch, uint32_t image) const;
+
+	inline const IndexList& GetRecordList() const	{ return recordlist; }
+	inline const ReleaseList& GetReleaseList() const	{ return releaselist; }
+	inline uint32_t GetOwner(uint32_t object) const	{ return owners[object]; }
+	inline size_t GetUsedMemory() const				{ return usedmemory; }
+	inline uint32_t GetNumRecorded() const			{ return numrecorded; }
+};
+
+#endif
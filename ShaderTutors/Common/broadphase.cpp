@@ -0,0 +1,680 @@
+
+#include <algorithm>
+#include "broadphase.h"
+
+#define MAX_CELLS_PER_AXIS	4	// proxies covering more cells are tested separately
+
+// --- BroadPhase impl --------------------------------------------------------
+
+BroadPhase::~BroadPhase()
+{
+}
+
+BroadPhase* BroadPhase::Create(BroadPhaseType type, float cellsize)
+{
+	switch (type) {
+	case BroadPhaseTypeSweepAndPrune:
+		return new SweepAndPrune(cellsize * MAX_CELLS_PER_AXIS);
+
+	case BroadPhaseTypeUniformGrid:
+		return new UniformGrid(cellsize);
+
+	default:
+		break;
+	}
+
+	return nullptr;
+}
+
+float BroadPhase::RayIntersect(const Math::AABox& box, const Math::Vector3& start, const Math::Vector3& invdir)
+{
+	// NOTE: same as AABox::RayIntersect, but with precomputed reciprocal (must be conservative)
+	float t[6];
+
+	for (int i = 0; i < 3; ++i) {
+		float m1 = box.Min[i] - start[i];
+		float m2 = box.Max[i] - start[i];
+
+		if (invdir[i] == FLT_MAX) {
+			t[i * 2 + 0] = (m1 >= 0 ? FLT_MAX : -FLT_MAX);
+			t[i * 2 + 1] = (m2 >= 0 ? FLT_MAX : -FLT_MAX);
+		} else {
+			t[i * 2 + 0] = m1 * invdir[i];
+			t[i * 2 + 1] = m2 * invdir[i];
+		}
+	}
+
+	float tmin = Math::Max(Math::Max(Math::Min(t[0], t[1]), Math::Min(t[2], t[3])), Math::Min(t[4], t[5]));
+	float tmax = Math::Min(Math::Min(Math::Max(t[0], t[1]), Math::Max(t[2], t[3])), Math::Max(t[4], t[5]));
+
+	if (tmax < 0 || tmin > tmax)
+		return FLT_MAX;
+
+	return tmin;
+}
+
+static void CalculateInverseDirection(Math::Vector3& out, const Math::Vector3& dir)
+{
+	// FLT_MAX marks axis parallel rays
+	out[0] = (dir[0] == 0 ? FLT_MAX : 1.0f / dir[0]);
+	out[1] = (dir[1] == 0 ? FLT_MAX : 1.0f / dir[1]);
+	out[2] = (dir[2] == 0 ? FLT_MAX : 1.0f / dir[2]);
+}
+
+// --- SweepAndPrune impl -----------------------------------------------------
+
+SweepAndPrune::SweepAndPrune(float size)
+{
+	// NOTE: same limit as the grid; a single floor box would otherwise make every query scan the whole axis
+	maxsize = size;
+	maxextent = 0;
+	needsort = false;
+}
+
+void SweepAndPrune::SortAll()
+{
+	if (!needsort)
+		return;
+
+	std::sort(order.begin(), order.end(), [&](int a, int b) -> bool {
+		return (bounds[a].Min[0] < bounds[b].Min[0]);
+	});
+
+	for (size_t i = 0; i < order.size(); ++i)
+		ranks[order[i]] = (int)i;
+
+	needsort = false;
+}
+
+void SweepAndPrune::SortProxy(int proxy)
+{
+	// NOTE: insertion step; coherent motion moves a proxy only a few slots
+	int rank = ranks[proxy];
+	float key = bounds[proxy].Min[0];
+
+	while (rank > 0 && bounds[order[rank - 1]].Min[0] > key) {
+		order[rank] = order[rank - 1];
+		ranks[order[rank]] = rank;
+
+		--rank;
+	}
+
+	while (rank < (int)order.size() - 1 && bounds[order[rank + 1]].Min[0] < key) {
+		order[rank] = order[rank + 1];
+		ranks[order[rank]] = rank;
+
+		++rank;
+	}
+
+	order[rank] = proxy;
+	ranks[proxy] = rank;
+}
+
+void SweepAndPrune::AddToOrder(int proxy)
+{
+	const Math::AABox& box = bounds[proxy];
+
+	if (IsOversized(box)) {
+		oversized.push_back(proxy);
+		ranks[proxy] = -1;
+
+		return;
+	}
+
+	maxextent = Math::Max(maxextent, box.Max[0] - box.Min[0]);
+
+	ranks[proxy] = (int)order.size();
+	order.push_back(proxy);
+
+	// NOTE: new proxies are in random order, insertion sort would be quadratic
+	needsort = true;
+}
+
+void SweepAndPrune::RemoveFromOrder(int proxy)
+{
+	if (ranks[proxy] == -1) {
+		oversized.erase(std::find(oversized.begin(), oversized.end(), proxy));
+		return;
+	}
+
+	// NOTE: keeps the order sorted
+	order.erase(order.begin() + ranks[proxy]);
+
+	for (size_t i = ranks[proxy]; i < order.size(); ++i)
+		ranks[order[i]] = (int)i;
+}
+
+void SweepAndPrune::Insert(int proxy, const Math::AABox& box)
+{
+	if (proxy >= (int)bounds.size()) {
+		bounds.resize(proxy + 1);
+		ranks.resize(proxy + 1, -1);
+	}
+
+	bounds[proxy] = box;
+	AddToOrder(proxy);
+}
+
+void SweepAndPrune::Update(int proxy, const Math::AABox& box)
+{
+	if (IsOversized(box) != (ranks[proxy] == -1)) {
+		RemoveFromOrder(proxy);
+
+		bounds[proxy] = box;
+		AddToOrder(proxy);
+
+		return;
+	}
+
+	bounds[proxy] = box;
+
+	if (ranks[proxy] == -1)
+		return;
+
+	maxextent = Math::Max(maxextent, box.Max[0] - box.Min[0]);
+
+	if (!needsort)
+		SortProxy(proxy);
+}
+
+void SweepAndPrune::Query(ProxyList& out, const Math::AABox& box)
+{
+	SortAll();
+
+	for (size_t i = 0; i < oversized.size(); ++i) {
+		if (bounds[oversized[i]].Intersects(box))
+			out.push_back(oversized[i]);
+	}
+
+	// find first proxy that starts after the box
+	int last = (int)(std::upper_bound(order.begin(), order.end(), box.Max[0], [&](float value, int proxy) -> bool {
+		return (value < bounds[proxy].Min[0]);
+	}) - order.begin());
+
+	float limit = box.Min[0] - maxextent;
+
+	for (int i = last - 1; i >= 0; --i) {
+		const Math::AABox& other = bounds[order[i]];
+
+		if (other.Min[0] < limit)
+			break;
+
+		if (other.Intersects(box))
+			out.push_back(order[i]);
+	}
+}
+
+void SweepAndPrune::QueryPairs(PairList& out)
+{
+	Pair pair;
+	int count = (int)order.size();
+
+	// oversized vs. everything
+	for (size_t i = 0; i < oversized.size(); ++i) {
+		const Math::AABox& box1 = bounds[oversized[i]];
+
+		pair.proxy1 = oversized[i];
+
+		for (int j = 0; j < count; ++j) {
+			pair.proxy2 = order[j];
+
+			if (box1.Intersects(bounds[pair.proxy2]))
+				out.push_back(pair);
+		}
+
+		for (size_t j = i + 1; j < oversized.size(); ++j) {
+			pair.proxy2 = oversized[j];
+
+			if (box1.Intersects(bounds[pair.proxy2]))
+				out.push_back(pair);
+		}
+	}
+
+	SortAll();
+
+	for (int i = 0; i < count; ++i) {
+		const Math::AABox& box1 = bounds[order[i]];
+
+		for (int j = i + 1; j < count; ++j) {
+			const Math::AABox& box2 = bounds[order[j]];
+
+			if (box2.Min[0] > box1.Max[0])
+				break;
+
+			if (box1.Min[1] > box2.Max[1] || box1.Max[1] < box2.Min[1] ||
+				box1.Min[2] > box2.Max[2] || box1.Max[2] < box2.Min[2])
+			{
+				continue;
+			}
+
+			pair.proxy1 = order[i];
+			pair.proxy2 = order[j];
+
+			out.push_back(pair);
+		}
+	}
+}
+
+void SweepAndPrune::RayCast(const Math::Vector3& start, const Math::Vector3& dir, RayCastCallback callback, void* context)
+{
+	Math::Vector3 invdir;
+	RayCandidate candidate;
+
+	int count = (int)order.size();
+	float maxt = FLT_MAX;
+
+	SortAll();
+	CalculateInverseDirection(invdir, dir);
+	candidates.clear();
+
+	for (size_t i = 0; i < oversized.size(); ++i) {
+		candidate.proxy = oversized[i];
+		candidate.t = RayIntersect(bounds[candidate.proxy], start, invdir);
+
+		if (candidate.t != FLT_MAX)
+			candidates.push_back(candidate);
+	}
+
+	if (dir[0] == 0) {
+		// ray stays in the x = start.x plane (typical for ground queries)
+		int last = (int)(std::upper_bound(order.begin(), order.end(), start[0], [&](float value, int proxy) -> bool {
+			return (value < bounds[proxy].Min[0]);
+		}) - order.begin());
+
+		int first = (int)(std::lower_bound(order.begin(), order.begin() + last, start[0] - maxextent, [&](int proxy, float value) -> bool {
+			return (bounds[proxy].Min[0] < value);
+		}) - order.begin());
+
+		for (int i = first; i < last; ++i) {
+			candidate.proxy = order[i];
+			candidate.t = RayIntersect(bounds[candidate.proxy], start, invdir);
+
+			if (candidate.t != FLT_MAX)
+				candidates.push_back(candidate);
+		}
+
+		std::sort(candidates.begin(), candidates.end(), [](const RayCandidate& a, const RayCandidate& b) -> bool {
+			return (a.t < b.t);
+		});
+
+		for (size_t i = 0; i < candidates.size(); ++i) {
+			if (candidates[i].t >= maxt)
+				break;
+
+			maxt = callback(context, candidates[i].proxy, maxt);
+		}
+
+		return;
+	}
+
+	// NOTE: walk the half-line in sweep order; a proxy can't be entered before the ray reaches its nearest x bound
+	auto farther = [](const RayCandidate& a, const RayCandidate& b) -> bool {
+		return (a.t > b.t);
+	};
+
+	int step = (dir[0] > 0 ? 1 : -1);
+	int i = 0;
+
+	std::make_heap(candidates.begin(), candidates.end(), farther);
+
+	if (dir[0] > 0) {
+		// skip proxies with Max.x < start.x
+		i = (int)(std::lower_bound(order.begin(), order.end(), start[0] - maxextent, [&](int proxy, float value) -> bool {
+			return (bounds[proxy].Min[0] < value);
+		}) - order.begin());
+	} else {
+		// skip proxies with Min.x > start.x
+		i = (int)(std::upper_bound(order.begin(), order.end(), start[0], [&](float value, int proxy) -> bool {
+			return (value < bounds[proxy].Min[0]);
+		}) - order.begin()) - 1;
+	}
+
+	for (;; i += step) {
+		// earliest possible entry of this and every further proxy
+		float bound = FLT_MAX;
+
+		if (i >= 0 && i < count) {
+			const Math::AABox& box = bounds[order[i]];
+			bound = ((dir[0] > 0 ? box.Min[0] : box.Min[0] + maxextent) - start[0]) * invdir[0];
+		}
+
+		// candidates that no further proxy can precede go to the narrow phase (closest first)
+		while (!candidates.empty() && candidates.front().t <= bound) {
+			std::pop_heap(candidates.begin(), candidates.end(), farther);
+			candidate = candidates.back();
+			candidates.pop_back();
+
+			if (candidate.t >= maxt)
+				return;
+
+			maxt = callback(context, candidate.proxy, maxt);
+		}
+
+		if (bound >= maxt || i < 0 || i >= count)
+			break;
+
+		candidate.proxy = order[i];
+		candidate.t = RayIntersect(bounds[candidate.proxy], start, invdir);
+
+		if (candidate.t < maxt) {
+			candidates.push_back(candidate);
+			std::push_heap(candidates.begin(), candidates.end(), farther);
+		}
+	}
+}
+
+// --- UniformGrid impl -------------------------------------------------------
+
+bool UniformGrid::CellRange::Contains(int32_t x, int32_t y, int32_t z) const
+{
+	return (
+		x >= start[0] && x <= end[0] &&
+		y >= start[1] && y <= end[1] &&
+		z >= start[2] && z <= end[2]);
+}
+
+bool UniformGrid::CellRange::operator ==(const CellRange& other) const
+{
+	return (
+		start[0] == other.start[0] && start[1] == other.start[1] && start[2] == other.start[2] &&
+		end[0] == other.end[0] && end[1] == other.end[1] && end[2] == other.end[2]);
+}
+
+UniformGrid::UniformGrid(float size, uint32_t numbuckets)
+{
+	numbuckets	= Math::NextPow2(numbuckets);
+
+	cellsize	= size;
+	invcellsize	= 1.0f / size;
+	bucketmask	= numbuckets - 1;
+	querystamp	= 0;
+
+	buckets.resize(numbuckets);
+}
+
+void UniformGrid::CalculateRange(CellRange& out, const Math::AABox& box) const
+{
+	for (int i = 0; i < 3; ++i) {
+		out.start[i] = (int32_t)floorf(box.Min[i] * invcellsize);
+		out.end[i] = (int32_t)floorf(box.Max[i] * invcellsize);
+	}
+}
+
+bool UniformGrid::IsOversized(const CellRange& range) const
+{
+	return (
+		range.end[0] - range.start[0] >= MAX_CELLS_PER_AXIS ||
+		range.end[1] - range.start[1] >= MAX_CELLS_PER_AXIS ||
+		range.end[2] - range.start[2] >= MAX_CELLS_PER_AXIS);
+}
+
+void UniformGrid::AddToCells(int proxy, const CellRange& range, const CellRange* skip)
+{
+	if (IsOversized(range)) {
+		oversized.push_back(proxy);
+		return;
+	}
+
+	for (int32_t z = range.start[2]; z <= range.end[2]; ++z) {
+		for (int32_t y = range.start[1]; y <= range.end[1]; ++y) {
+			for (int32_t x = range.start[0]; x <= range.end[0]; ++x) {
+				// NOTE: one entry per cell (different cells can map to the same bucket)
+				if (skip == nullptr || !skip->Contains(x, y, z))
+					buckets[Hash(x, y, z)].push_back(proxy);
+			}
+		}
+	}
+
+	extents.Add(bounds[proxy].Min);
+	extents.Add(bounds[proxy].Max);
+}
+
+void UniformGrid::RemoveFromCells(int proxy, const CellRange& range, const CellRange* skip)
+{
+	if (IsOversized(range)) {
+		oversized.erase(std::find(oversized.begin(), oversized.end(), proxy));
+		return;
+	}
+
+	for (int32_t z = range.start[2]; z <= range.end[2]; ++z) {
+		for (int32_t y = range.start[1]; y <= range.end[1]; ++y) {
+			for (int32_t x = range.start[0]; x <= range.end[0]; ++x) {
+				if (skip != nullptr && skip->Contains(x, y, z))
+					continue;
+
+				ProxyList& bucket = buckets[Hash(x, y, z)];
+				ProxyList::iterator it = std::find(bucket.begin(), bucket.end(), proxy);
+
+				if (it != bucket.end()) {
+					*it = bucket.back();
+					bucket.pop_back();
+				}
+			}
+		}
+	}
+}
+
+uint32_t UniformGrid::NextQueryStamp()
+{
+	++querystamp;
+
+	if (querystamp == 0) {
+		// wrapped around
+		std::fill(stamps.begin(), stamps.end(), 0);
+		querystamp = 1;
+	}
+
+	return querystamp;
+}
+
+void UniformGrid::Insert(int proxy, const Math::AABox& box)
+{
+	if (proxy >= (int)bounds.size()) {
+		bounds.resize(proxy + 1);
+		ranges.resize(proxy + 1);
+		stamps.resize(proxy + 1, 0);
+	}
+
+	bounds[proxy] = box;
+
+	CalculateRange(ranges[proxy], box);
+	AddToCells(proxy, ranges[proxy], nullptr);
+}
+
+void UniformGrid::Update(int proxy, const Math::AABox& box)
+{
+	CellRange range;
+
+	bounds[proxy] = box;
+	CalculateRange(range, box);
+
+	if (range == ranges[proxy]) {
+		if (!IsOversized(range)) {
+			extents.Add(box.Min);
+			extents.Add(box.Max);
+		}
+
+		return;
+	}
+
+	if (IsOversized(range) != IsOversized(ranges[proxy])) {
+		RemoveFromCells(proxy, ranges[proxy], nullptr);
+		AddToCells(proxy, range, nullptr);
+	} else if (!IsOversized(range)) {
+		// only touch cells that the proxy enters or leaves
+		RemoveFromCells(proxy, ranges[proxy], &range);
+		AddToCells(proxy, range, &ranges[proxy]);
+	}
+
+	ranges[proxy] = range;
+}
+
+void UniformGrid::Query(ProxyList& out, const Math::AABox& box)
+{
+	CellRange range;
+	uint32_t stamp = NextQueryStamp();
+
+	for (size_t i = 0; i < oversized.size(); ++i) {
+		if (bounds[oversized[i]].Intersects(box))
+			out.push_back(oversized[i]);
+	}
+
+	CalculateRange(range, box);
+
+	for (int32_t z = range.start[2]; z <= range.end[2]; ++z) {
+		for (int32_t y = range.start[1]; y <= range.end[1]; ++y) {
+			for (int32_t x = range.start[0]; x <= range.end[0]; ++x) {
+				const ProxyList& bucket = buckets[Hash(x, y, z)];
+
+				for (size_t i = 0; i < bucket.size(); ++i) {
+					int proxy = bucket[i];
+
+					if (stamps[proxy] == stamp)
+						continue;
+
+					stamps[proxy] = stamp;
+
+					if (bounds[proxy].Intersects(box))
+						out.push_back(proxy);
+				}
+			}
+		}
+	}
+}
+
+void UniformGrid::QueryPairs(PairList& out)
+{
+	ProxyList found;
+	Pair pair;
+
+	// oversized vs. everything
+	for (size_t i = 0; i < oversized.size(); ++i) {
+		for (int j = 0; j < (int)bounds.size(); ++j) {
+			if (j == oversized[i] || !bounds[oversized[i]].Intersects(bounds[j]))
+				continue;
+
+			// report oversized pairs only once
+			if (IsOversized(ranges[j]) && j < oversized[i])
+				continue;
+
+			pair.proxy1 = oversized[i];
+			pair.proxy2 = j;
+
+			out.push_back(pair);
+		}
+	}
+
+	// gridded vs. gridded
+	for (int i = 0; i < (int)bounds.size(); ++i) {
+		const CellRange& range = ranges[i];
+		uint32_t stamp = NextQueryStamp();
+
+		if (IsOversized(range))
+			continue;
+
+		for (int32_t z = range.start[2]; z <= range.end[2]; ++z) {
+			for (int32_t y = range.start[1]; y <= range.end[1]; ++y) {
+				for (int32_t x = range.start[0]; x <= range.end[0]; ++x) {
+					const ProxyList& bucket = buckets[Hash(x, y, z)];
+
+					for (size_t k = 0; k < bucket.size(); ++k) {
+						int proxy = bucket[k];
+
+						if (proxy <= i || stamps[proxy] == stamp)
+							continue;
+
+						stamps[proxy] = stamp;
+
+						if (bounds[i].Intersects(bounds[proxy])) {
+							pair.proxy1 = i;
+							pair.proxy2 = proxy;
+
+							out.push_back(pair);
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+void UniformGrid::RayCast(const Math::Vector3& start, const Math::Vector3& dir, RayCastCallback callback, void* context)
+{
+	Math::Vector3 invdir;
+	float maxt = FLT_MAX;
+	float t;
+
+	CalculateInverseDirection(invdir, dir);
+
+	for (size_t i = 0; i < oversized.size(); ++i) {
+		t = RayIntersect(bounds[oversized[i]], start, invdir);
+
+		if (t < maxt)
+			maxt = callback(context, oversized[i], maxt);
+	}
+
+	// clip ray to the gridded area
+	float tenter = RayIntersect(extents, start, invdir);
+
+	if (tenter == FLT_MAX)
+		return;
+
+	// 3D DDA (Amanatides & Woo)
+	Math::Vector3 p;
+	int32_t cell[3], step[3];
+	float tnext[3], tdelta[3];
+
+	tenter = Math::Max(tenter, 0.0f);
+	Math::Vec3Mad(p, start, dir, tenter);
+
+	CellRange gridrange;
+	CalculateRange(gridrange, extents);
+
+	for (int i = 0; i < 3; ++i) {
+		cell[i] = Math::Min(Math::Max((int32_t)floorf(p[i] * invcellsize), gridrange.start[i]), gridrange.end[i]);
+
+		if (dir[i] > 0) {
+			step[i] = 1;
+			tdelta[i] = cellsize * invdir[i];
+			tnext[i] = ((cell[i] + 1) * cellsize - start[i]) * invdir[i];
+		} else if (dir[i] < 0) {
+			step[i] = -1;
+			tdelta[i] = -cellsize * invdir[i];
+			tnext[i] = (cell[i] * cellsize - start[i]) * invdir[i];
+		} else {
+			step[i] = 0;
+			tdelta[i] = FLT_MAX;
+			tnext[i] = FLT_MAX;
+		}
+	}
+
+	float tcell = tenter;
+	uint32_t stamp = NextQueryStamp();
+
+	while (tcell < maxt) {
+		const ProxyList& bucket = buckets[Hash(cell[0], cell[1], cell[2])];
+
+		for (size_t i = 0; i < bucket.size(); ++i) {
+			int proxy = bucket[i];
+
+			if (stamps[proxy] == stamp)
+				continue;
+
+			stamps[proxy] = stamp;
+			t = RayIntersect(bounds[proxy], start, invdir);
+
+			if (t < maxt)
+				maxt = callback(context, proxy, maxt);
+		}
+
+		// step to next cell
+		int axis = (tnext[0] < tnext[1] ? (tnext[0] < tnext[2] ? 0 : 2) : (tnext[1] < tnext[2] ? 1 : 2));
+
+		tcell = tnext[axis];
+		cell[axis] += step[axis];
+		tnext[axis] += tdelta[axis];
+
+		if (cell[axis] < gridrange.start[axis] || cell[axis] > gridrange.end[axis])
+			break;
+	}
+}
@@ -0,0 +1,135 @@
+
+#ifndef _BROADPHASE_H_
+#define _BROADPHASE_H_
+
+#include <vector>
+#include "3Dmath.h"
+
+enum BroadPhaseType
+{
+	BroadPhaseTypeNone = 0,		// test everything against everything
+	BroadPhaseTypeSweepAndPrune,
+	BroadPhaseTypeUniformGrid
+};
+
+class BroadPhase
+{
+public:
+	struct Pair
+	{
+		int proxy1;
+		int proxy2;
+	};
+
+	typedef std::vector<int> ProxyList;
+	typedef std::vector<Pair> PairList;
+
+	// returns the new maximum ray parameter
+	typedef float (*RayCastCallback)(void* context, int proxy, float maxt);
+
+protected:
+	typedef std::vector<Math::AABox> BoundsList;
+
+	BoundsList bounds;
+
+public:
+	virtual ~BroadPhase();
+
+	virtual void Insert(int proxy, const Math::AABox& box) = 0;
+	virtual void Update(int proxy, const Math::AABox& box) = 0;
+	virtual void Query(ProxyList& out, const Math::AABox& box) = 0;
+	virtual void QueryPairs(PairList& out) = 0;
+	virtual void RayCast(const Math::Vector3& start, const Math::Vector3& dir, RayCastCallback callback, void* context) = 0;
+
+	static BroadPhase* Create(BroadPhaseType type, float cellsize);
+	static float RayIntersect(const Math::AABox& box, const Math::Vector3& start, const Math::Vector3& invdir);
+
+	inline const Math::AABox& GetBounds(int proxy) const	{ return bounds[proxy]; }
+	inline int GetNumProxies() const						{ return (int)bounds.size(); }
+};
+
+class SweepAndPrune : public BroadPhase
+{
+	struct RayCandidate
+	{
+		float	t;
+		int		proxy;
+	};
+
+	typedef std::vector<RayCandidate> CandidateList;
+
+private:
+	ProxyList		order;		// proxies sorted by Min.x
+	ProxyList		ranks;		// position of each proxy in order (-1 if oversized)
+	ProxyList		oversized;	// proxies wider than maxsize (not in order)
+	CandidateList	candidates;
+	float			maxsize;
+	float			maxextent;	// largest x size in order (conservative)
+	bool			needsort;
+
+	void SortAll();
+	void SortProxy(int proxy);
+	void AddToOrder(int proxy);
+	void RemoveFromOrder(int proxy);
+
+	inline bool IsOversized(const Math::AABox& box) const {
+		return (box.Max[0] - box.Min[0] > maxsize);
+	}
+
+public:
+	SweepAndPrune(float size);
+
+	void Insert(int proxy, const Math::AABox& box) override;
+	void Update(int proxy, const Math::AABox& box) override;
+	void Query(ProxyList& out, const Math::AABox& box) override;
+	void QueryPairs(PairList& out) override;
+	void RayCast(const Math::Vector3& start, const Math::Vector3& dir, RayCastCallback callback, void* context) override;
+};
+
+class UniformGrid : public BroadPhase
+{
+	struct CellRange
+	{
+		int32_t start[3];
+		int32_t end[3];		// inclusive
+
+		bool Contains(int32_t x, int32_t y, int32_t z) const;
+		bool operator ==(const CellRange& other) const;
+	};
+
+	typedef std::vector<ProxyList> BucketList;
+	typedef std::vector<CellRange> RangeList;
+	typedef std::vector<uint32_t> StampList;
+
+private:
+	BucketList		buckets;	// spatial hash of cells
+	RangeList		ranges;
+	StampList		stamps;		// for deduplication during queries
+	ProxyList		oversized;	// proxies that would cover too many cells
+	Math::AABox		extents;	// union of all gridded proxies
+	float			cellsize;
+	float			invcellsize;
+	uint32_t		bucketmask;
+	uint32_t		querystamp;
+
+	void CalculateRange(CellRange& out, const Math::AABox& box) const;
+	void AddToCells(int proxy, const CellRange& range, const CellRange* skip);
+	void RemoveFromCells(int proxy, const CellRange& range, const CellRange* skip);
+	bool IsOversized(const CellRange& range) const;
+	uint32_t NextQueryStamp();
+
+	inline uint32_t Hash(int32_t x, int32_t y, int32_t z) const {
+		return (((uint32_t)x * 73856093u) ^ ((uint32_t)y * 19349663u) ^ ((uint32_t)z * 83492791u)) & bucketmask;
+	}
+
+public:
+	UniformGrid(float size, uint32_t numbuckets = 65536);
+
+	void Insert(int proxy, const Math::AABox& box) override;
+	void Update(int proxy, const Math::AABox& box) override;
+	void Query(ProxyList& out, const Math::AABox& box) override;
+	void QueryPairs(PairList& out) override;
+	void RayCast(const Math::Vector3& start, const Math::Vector3& dir, RayCastCallback callback, void* context) override;
+};
+
+#endif
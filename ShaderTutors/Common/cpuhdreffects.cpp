@@ -0,0 +1,937 @@
+
+#include "cpuhdreffects.h"
+#include "3Dmath.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#	include <emmintrin.h>
+#	define CPUHDREFFECTS_SSE2
+#endif
+
+#define ROWS_PER_JOB		8
+#define BLUR_TILE_WIDTH		64		// in pixels
+#define BLUR_TILE_HEIGHT	32
+#define LUMINANCE_SIZE		64		// first level of the luminance reduction
+#define MAX_FILTER_TAPS		8		// 4 bilinear samples per axis
+
+// filter slots (see Resize)
+#define FILTER_BRIGHTPASS	0
+#define FILTER_DOWNSAMPLE	1		// 4 levels
+#define FILTER_BLOOM		5		// 5 levels
+#define FILTER_LENSFLARE	10		// 7 samples
+#define FILTER_EXPAND		17		// 5 samples
+#define FILTER_TONEMAP		22		// bloom, star, ghost, afterimage
+#define FILTER_LUMINANCE	26		// 3 point, then 3 bilinear offsets
+#define NUM_FILTERS			32
+
+struct FlareSample
+{
+	uint32_t	source;
+	float		scale;		// around the center of the screen
+	float		color[4];
+};
+
+// NOTE: constants of hdreffects.fx and measureluminance.fx
+static const float BlurWeights[9] = {
+	0.013437f, 0.047370f, 0.116512f, 0.199935f, 0.239365f, 0.199935f, 0.116512f, 0.047370f, 0.013437f
+};
+
+static const float BloomWeights[5] = {
+	5.0f, 7.0f, 6.5f, 3.5f, 1.75f
+};
+
+static const int32_t StarOffsets[4][2] = {
+	{ -1, -1 }, { 1, -1 }, { -1, 1 }, { 1, 1 }
+};
+
+static const FlareSample LensFlareSamples[7] = {
+	{ 0, -1.724f, { 0.250f, 0.175f, 0.125f, 1 } },
+	{ 1, -2.845f, { 0.131f, 0.187f, 0.131f, 1 } },
+	{ 0, -1.0f, { 0.103f, 0.103f, 0.103f, 1 } },
+	{ 1, -1.957f, { 0.2f, 0.2f, 0.250f, 1 } },
+	{ 0, -2.147f, { 0.101f, 0.050f, 0.050f, 1 } },
+	{ 1, -4.0f, { 0.102f, 0.102f, 0.102f, 1 } },
+	{ 2, -1.794f, { 0.248f, 0.248f, 0.248f, 1 } }
+};
+
+static const FlareSample ExpandSamples[5] = {
+	{ 0, 1.0f, { 0.413f, 0.413f, 2.063f, 1 } },
+	{ 0, 5.0f, { 1.611f, 0.644f, 0.644f, 1 } },
+	{ 0, -4.0f, { 1.000f, 2.000f, 0.800f, 1 } },
+	{ 0, -1.33f, { 0.254f, 0.254f, 0.845f, 1 } },
+	{ 0, 0.5f, { 0.315f, 0.701f, 0.315f, 1 } }
+};
+
+static const float LuminanceVector[3] = { 0.2125f, 0.7154f, 0.0721f };
+static const float LuminanceOffsets[3] = { -0.5f, 0.5f, 1.5f };
+static const float DownSampleOffsets[4] = { -1.5f, -0.5f, 0.5f, 1.5f };
+
+static const float FilmicA = 0.22f;
+static const float FilmicB = 0.30f;
+static const float FilmicC = 0.10f;
+static const float FilmicD = 0.20f;
+static const float FilmicE = 0.01f;
+static const float FilmicF = 0.30f;
+static const float FilmicW = 11.2f;
+
+// --- Texel helpers ----------------------------------------------------------
+
+#ifdef CPUHDREFFECTS_SSE2
+typedef __m128 Texel4;
+
+static inline Texel4 Load4(const float* p)						{ return _mm_loadu_ps(p); }
+static inline Texel4 Splat4(float f)							{ return _mm_set1_ps(f); }
+static inline Texel4 Add4(Texel4 a, Texel4 b)					{ return _mm_add_ps(a, b); }
+static inline Texel4 Sub4(Texel4 a, Texel4 b)					{ return _mm_sub_ps(a, b); }
+static inline Texel4 Mul4(Texel4 a, Texel4 b)					{ return _mm_mul_ps(a, b); }
+static inline Texel4 Div4(Texel4 a, Texel4 b)					{ return _mm_div_ps(a, b); }
+static inline Texel4 Mad4(Texel4 a, Texel4 b, Texel4 c)			{ return _mm_add_ps(_mm_mul_ps(a, b), c); }
+static inline Texel4 Min4(Texel4 a, Texel4 b)					{ return _mm_min_ps(a, b); }
+static inline Texel4 Max4(Texel4 a, Texel4 b)					{ return _mm_max_ps(a, b); }
+static inline void Store4(float* p, Texel4 a)					{ _mm_storeu_ps(p, a); }
+#else
+struct Texel4
+{
+	float v[4];
+};
+
+static inline Texel4 Load4(const float* p)						{ return { p[0], p[1], p[2], p[3] }; }
+static inline Texel4 Splat4(float f)							{ return { f, f, f, f }; }
+static inline Texel4 Add4(Texel4 a, Texel4 b)					{ return { a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2], a.v[3] + b.v[3] }; }
+static inline Texel4 Sub4(Texel4 a, Texel4 b)					{ return { a.v[0] - b.v[0], a.v[1] - b.v[1], a.v[2] - b.v[2], a.v[3] - b.v[3] }; }
+static inline Texel4 Mul4(Texel4 a, Texel4 b)					{ return { a.v[0] * b.v[0], a.v[1] * b.v[1], a.v[2] * b.v[2], a.v[3] * b.v[3] }; }
+static inline Texel4 Div4(Texel4 a, Texel4 b)					{ return { a.v[0] / b.v[0], a.v[1] / b.v[1], a.v[2] / b.v[2], a.v[3] / b.v[3] }; }
+static inline Texel4 Mad4(Texel4 a, Texel4 b, Texel4 c)			{ return { a.v[0] * b.v[0] + c.v[0], a.v[1] * b.v[1] + c.v[1], a.v[2] * b.v[2] + c.v[2], a.v[3] * b.v[3] + c.v[3] }; }
+static inline Texel4 Min4(Texel4 a, Texel4 b)					{ return { Math::Min(a.v[0], b.v[0]), Math::Min(a.v[1], b.v[1]), Math::Min(a.v[2], b.v[2]), Math::Min(a.v[3], b.v[3]) }; }
+static inline Texel4 Max4(Texel4 a, Texel4 b)					{ return { Math::Max(a.v[0], b.v[0]), Math::Max(a.v[1], b.v[1]), Math::Max(a.v[2], b.v[2]), Math::Max(a.v[3], b.v[3]) }; }
+static inline void Store4(float* p, Texel4 a)					{ p[0] = a.v[0]; p[1] = a.v[1]; p[2] = a.v[2]; p[3] = a.v[3]; }
+#endif
+
+struct CPUHDREffects::AxisFilter
+{
+	std::vector<int32_t>	indices;	// numtaps per destination texel
+	std::vector<float>		weights;
+	uint32_t				numtaps;
+
+	void Build(uint32_t dstsize, uint32_t srcsize, float scale, const float* offsets, uint32_t numoffsets, bool point, bool border);
+
+	inline Texel4 Sample(const float* row, uint32_t x) const {
+		const int32_t* xindices = &indices[x * numtaps];
+		const float* xweights = &weights[x * numtaps];
+
+		Texel4 sum = Mul4(Load4(row + xindices[0] * 4), Splat4(xweights[0]));
+
+		if (numtaps == 2)
+			return Mad4(Load4(row + xindices[1] * 4), Splat4(xweights[1]), sum);
+
+		for (uint32_t t = 1; t < numtaps; ++t)
+			sum = Mad4(Load4(row + xindices[t] * 4), Splat4(xweights[t]), sum);
+
+		return sum;
+	}
+};
+
+static void ParallelRange(ThreadPool* pool, uint32_t count, uint32_t grain, const ThreadPool::RangeCallback& callback)
+{
+	if (pool != nullptr)
+		pool->ParallelFor(count, grain, callback);
+	else if (count > 0)
+		callback(0, count, 0);
+}
+
+static inline void SetAlpha(float* row, uint32_t width)
+{
+	// NOTE: every pass writes 1 into alpha
+	for (uint32_t x = 0; x < width; ++x)
+		row[x * 4 + 3] = 1.0f;
+}
+
+static inline float FilmicTonemap(float x)
+{
+	return ((x * (FilmicA * x + FilmicC * FilmicB) + FilmicD * FilmicE) / (x * (FilmicA * x + FilmicB) + FilmicD * FilmicF)) - FilmicE / FilmicF;
+}
+
+// --- HDRImage impl ----------------------------------------------------------
+
+HDRImage::HDRImage()
+{
+	width	= 0;
+	height	= 0;
+}
+
+void HDRImage::Resize(uint32_t newwidth, uint32_t newheight)
+{
+	width	= newwidth;
+	height	= newheight;
+
+	texels.assign((size_t)width * height * 4, 0.0f);
+}
+
+// --- AxisFilter impl --------------------------------------------------------
+
+void CPUHDREffects::AxisFilter::Build(uint32_t dstsize, uint32_t srcsize, float scale, const float* offsets, uint32_t numoffsets, bool point, bool border)
+{
+	// NOTE: the sample positions of the shaders are separable, (tex - 0.5) * scale + 0.5 + offset * texelSize
+	uint32_t maxtaps = (point ? 1 : 2) * numoffsets;
+	float sampleweight = 1.0f / (float)numoffsets;
+
+	std::vector<int32_t> tmpindices(dstsize * maxtaps);
+	std::vector<float> tmpweights(dstsize * maxtaps);
+	std::vector<uint32_t> counts(dstsize, 0);
+
+	auto addtap = [&](uint32_t dst, int32_t index, float weight) {
+		if (weight == 0.0f)
+			return;
+
+		if (index < 0 || index >= (int32_t)srcsize) {
+			// border color is zero
+			if (border)
+				return;
+
+			index = Math::Min<int32_t>(Math::Max<int32_t>(index, 0), (int32_t)srcsize - 1);
+		}
+
+		int32_t* dstindices = &tmpindices[dst * maxtaps];
+		float* dstweights = &tmpweights[dst * maxtaps];
+
+		for (uint32_t k = 0; k < counts[dst]; ++k) {
+			if (dstindices[k] == index) {
+				dstweights[k] += weight;
+				return;
+			}
+		}
+
+		dstindices[counts[dst]] = index;
+		dstweights[counts[dst]] = weight;
+
+		++counts[dst];
+	};
+
+	numtaps = 1;
+
+	for (uint32_t i = 0; i < dstsize; ++i) {
+		float center = ((i + 0.5f) / (float)dstsize) * scale + 0.5f * (1.0f - scale);
+
+		for (uint32_t j = 0; j < numoffsets; ++j) {
+			// NOTE: snapped to 8 bits of subtexel precision like the texture units, otherwise
+			// rounding errors could move a point sample that lies exactly on a texel edge
+			float texel = center * (float)srcsize + offsets[j];
+			texel = floorf(texel * 256.0f + 0.5f) / 256.0f;
+
+			if (point) {
+				addtap(i, (int32_t)floorf(texel), sampleweight);
+			} else {
+				float base = floorf(texel - 0.5f);
+				float frac = (texel - 0.5f) - base;
+
+				addtap(i, (int32_t)base, (1.0f - frac) * sampleweight);
+				addtap(i, (int32_t)base + 1, frac * sampleweight);
+			}
+		}
+
+		numtaps = Math::Max(numtaps, counts[i]);
+	}
+
+	indices.assign(dstsize * numtaps, 0);
+	weights.assign(dstsize * numtaps, 0.0f);
+
+	for (uint32_t i = 0; i < dstsize; ++i) {
+		for (uint32_t k = 0; k < counts[i]; ++k) {
+			indices[i * numtaps + k] = tmpindices[i * maxtaps + k];
+			weights[i * numtaps + k] = tmpweights[i * maxtaps + k];
+		}
+
+		// NOTE: unused taps read the first texel again, so that they don't widen the range of FilterRows
+		for (uint32_t k = counts[i]; k < numtaps; ++k)
+			indices[i * numtaps + k] = indices[i * numtaps];
+	}
+}
+
+// --- CPUHDREffects impl -----------------------------------------------------
+
+CPUHDREffects::CPUHDREffects()
+{
+	workers				= nullptr;
+	luminancemode		= LuminanceModePoint;
+	width				= 0;
+	height				= 0;
+	currentafterimage	= 0;
+	averageluminance	= 0.1f;
+	adaptedluminance	= 0.1f;	// don't set this to zero!!!
+	exposure			= 0;
+	drawafterimage		= false;
+	afterimagevalid		= false;
+
+	memset(&timings, 0, sizeof(HDREffectsTimings));
+}
+
+CPUHDREffects::~CPUHDREffects()
+{
+}
+
+void CPUHDREffects::Resize(uint32_t newwidth, uint32_t newheight)
+{
+	if (newwidth == width && newheight == height)
+		return;
+
+	width	= newwidth;
+	height	= newheight;
+
+	// same sizes as the render targets of 39_HDREffects
+	uint32_t halfwidth = width / 2;
+	uint32_t halfheight = height / 2;
+
+	for (int i = 0; i < 5; ++i) {
+		dsampletargets[i].Resize(width / (2 << i), height / (2 << i));
+		blurtargets[i].Resize(width / (2 << i), height / (2 << i));
+	}
+
+	for (int i = 0; i < 4; ++i) {
+		startargets[i][0].Resize(width / 4, height / 4);
+		startargets[i][1].Resize(width / 4, height / 4);
+	}
+
+	for (int i = 0; i < 2; ++i) {
+		lensflaretargets[i].Resize(halfwidth, halfheight);
+		afterimagetargets[i].Resize(halfwidth, halfheight);
+	}
+
+	bloomresult.Resize(halfwidth, halfheight);
+	starresult.Resize(width / 4, height / 4);
+	tonemapped.Resize(width, height);
+
+	afterimagevalid = false;
+
+	// build filters
+	const float center = 0.0f;
+
+	auto build = [&](uint32_t slot, const HDRImage& target, const HDRImage& source, float scale, const float* offsets, uint32_t numoffsets, bool point, bool border) {
+		xfilters[slot].Build(target.width, source.width, scale, offsets, numoffsets, point, border);
+		yfilters[slot].Build(target.height, source.height, scale, offsets, numoffsets, point, border);
+	};
+
+	xfilters.resize(NUM_FILTERS);
+	yfilters.resize(NUM_FILTERS);
+
+	build(FILTER_BRIGHTPASS, dsampletargets[0], tonemapped, 1.0f, &center, 1, true, false);
+
+	for (int i = 1; i < 5; ++i)
+		build(FILTER_DOWNSAMPLE + i - 1, dsampletargets[i], dsampletargets[i - 1], 1.0f, DownSampleOffsets, 4, false, false);
+
+	for (int i = 0; i < 5; ++i)
+		build(FILTER_BLOOM + i, bloomresult, dsampletargets[i], 1.0f, &center, 1, false, false);
+
+	for (int i = 0; i < 7; ++i)
+		build(FILTER_LENSFLARE + i, lensflaretargets[0], dsampletargets[LensFlareSamples[i].source], LensFlareSamples[i].scale, &center, 1, false, true);
+
+	for (int i = 0; i < 5; ++i)
+		build(FILTER_EXPAND + i, lensflaretargets[1], lensflaretargets[0], ExpandSamples[i].scale, &center, 1, false, true);
+
+	// NOTE: samplers 1 and 2 are left in border mode by LensFlare, 3 and 4 in clamp mode by Bloom
+	build(FILTER_TONEMAP + 0, tonemapped, bloomresult, 1.0f, &center, 1, false, true);
+	build(FILTER_TONEMAP + 1, tonemapped, starresult, 1.0f, &center, 1, false, true);
+	build(FILTER_TONEMAP + 2, tonemapped, lensflaretargets[1], 1.0f, &center, 1, false, false);
+	build(FILTER_TONEMAP + 3, tonemapped, afterimagetargets[0], 1.0f, &center, 1, false, false);
+
+	for (int i = 0; i < 3; ++i) {
+		xfilters[FILTER_LUMINANCE + i].Build(LUMINANCE_SIZE, width, 1.0f, &LuminanceOffsets[i], 1, true, false);
+		yfilters[FILTER_LUMINANCE + i].Build(LUMINANCE_SIZE, height, 1.0f, &LuminanceOffsets[i], 1, true, false);
+
+		xfilters[FILTER_LUMINANCE + 3 + i].Build(LUMINANCE_SIZE, width, 1.0f, &LuminanceOffsets[i], 1, false, false);
+		yfilters[FILTER_LUMINANCE + 3 + i].Build(LUMINANCE_SIZE, height, 1.0f, &LuminanceOffsets[i], 1, false, false);
+	}
+}
+
+const float* CPUHDREffects::FilterRows(const HDRImage& source, uint32_t filter, uint32_t y, uint32_t xbegin, uint32_t xend, float* scratch) const
+{
+	const AxisFilter& xfilter = xfilters[filter];
+	const AxisFilter& yfilter = yfilters[filter];
+
+	const int32_t* yindices = &yfilter.indices[y * yfilter.numtaps];
+	const float* yweights = &yfilter.weights[y * yfilter.numtaps];
+
+	if (yfilter.numtaps == 1 && yweights[0] == 1.0f)
+		return source.GetRow(yindices[0]);
+
+	// only blend the texels that the horizontal taps of [xbegin, xend) read
+	int32_t first = INT32_MAX;
+	int32_t last = -1;
+
+	for (uint32_t i = xbegin * xfilter.numtaps; i < xend * xfilter.numtaps; ++i) {
+		first = Math::Min(first, xfilter.indices[i]);
+		last = Math::Max(last, xfilter.indices[i]);
+	}
+
+	const float* rows[MAX_FILTER_TAPS];
+	Texel4 weights[MAX_FILTER_TAPS];
+
+	for (uint32_t t = 0; t < yfilter.numtaps; ++t) {
+		rows[t] = source.GetRow(yindices[t]);
+		weights[t] = Splat4(yweights[t]);
+	}
+
+	for (int32_t i = first * 4; i <= last * 4; i += 4) {
+		Texel4 sum = Mul4(Load4(rows[0] + i), weights[0]);
+
+		for (uint32_t t = 1; t < yfilter.numtaps; ++t)
+			sum = Mad4(Load4(rows[t] + i), weights[t], sum);
+
+		Store4(scratch + i, sum);
+	}
+
+	return scratch;
+}
+
+float CPUHDREffects::MeasureLuminance(const HDRImage& scene)
+{
+	if (luminancemode == LuminanceModeFull) {
+		// NOTE: partial sums are added in block order, so the result doesn't depend on the number of threads
+		uint32_t numblocks = (scene.height + ROWS_PER_JOB - 1) / ROWS_PER_JOB;
+		std::vector<double> partialsums(numblocks);
+
+		ParallelRange(workers, numblocks, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+			for (uint32_t i = begin; i < end; ++i) {
+				uint32_t last = Math::Min((i + 1) * ROWS_PER_JOB, scene.height);
+				double blocksum = 0;
+
+				for (uint32_t y = i * ROWS_PER_JOB; y < last; ++y) {
+					const float* row = scene.GetRow(y);
+					float rowsum = 0;
+
+					for (uint32_t x = 0; x < scene.width; ++x) {
+						const float* texel = row + x * 4;
+						rowsum += logf(0.0001f + texel[0] * LuminanceVector[0] + texel[1] * LuminanceVector[1] + texel[2] * LuminanceVector[2]);
+					}
+
+					blocksum += rowsum;
+				}
+
+				partialsums[i] = blocksum;
+			}
+		});
+
+		double logsum = 0;
+
+		for (uint32_t i = 0; i < numblocks; ++i)
+			logsum += partialsums[i];
+
+		averageluminance = (float)exp(logsum / ((double)scene.width * scene.height));
+		return averageluminance;
+	}
+
+	// 64x64 (ps_avgluminital)
+	uint32_t first = FILTER_LUMINANCE + (luminancemode == LuminanceModeBilinear ? 3 : 0);
+	float levels[LUMINANCE_SIZE * LUMINANCE_SIZE];
+
+	ParallelRange(workers, LUMINANCE_SIZE, 4, [&](uint32_t begin, uint32_t end, uint32_t) {
+		for (uint32_t j = begin; j < end; ++j) {
+			for (uint32_t i = 0; i < LUMINANCE_SIZE; ++i) {
+				float logsum = 0;
+
+				for (uint32_t a = 0; a < 3; ++a) {
+					const AxisFilter& xfilter = xfilters[first + a];
+
+					for (uint32_t b = 0; b < 3; ++b) {
+						const AxisFilter& yfilter = yfilters[first + b];
+						float luminance = 0;
+
+						for (uint32_t ty = 0; ty < yfilter.numtaps; ++ty) {
+							const float* row = scene.GetRow(yfilter.indices[j * yfilter.numtaps + ty]);
+							float wy = yfilter.weights[j * yfilter.numtaps + ty];
+
+							for (uint32_t tx = 0; tx < xfilter.numtaps; ++tx) {
+								const float* texel = row + xfilter.indices[i * xfilter.numtaps + tx] * 4;
+								float weight = wy * xfilter.weights[i * xfilter.numtaps + tx];
+
+								luminance += weight * (texel[0] * LuminanceVector[0] + texel[1] * LuminanceVector[1] + texel[2] * LuminanceVector[2]);
+							}
+						}
+
+						logsum += logf(0.0001f + luminance);
+					}
+				}
+
+				levels[j * LUMINANCE_SIZE + i] = logsum / 9.0f;
+			}
+		}
+	});
+
+	// 16x16, 4x4, 1x1 (ps_avglumiterative, in place)
+	for (uint32_t size = LUMINANCE_SIZE / 4; size > 0; size /= 4) {
+		uint32_t prevsize = size * 4;
+
+		for (uint32_t j = 0; j < size; ++j) {
+			for (uint32_t i = 0; i < size; ++i) {
+				float sum = 0;
+
+				for (uint32_t k = 0; k < 16; ++k)
+					sum += levels[(j * 4 + k / 4) * prevsize + i * 4 + k % 4];
+
+				levels[j * size + i] = sum * 0.0625f;
+			}
+		}
+	}
+
+	averageluminance = expf(levels[0]);
+	return averageluminance;
+}
+
+void CPUHDREffects::AdaptLuminance(float elapsedtime)
+{
+	adaptedluminance = adaptedluminance + (averageluminance - adaptedluminance) * (1.0f - powf(0.98f, 50.0f * elapsedtime));
+
+	// DICE's suggestion
+	float two_ad_EV = adaptedluminance * (100.0f / 12.5f);
+	exposure = 1.0f / (1.2f * two_ad_EV);
+}
+
+void CPUHDREffects::BrightPass(const HDRImage& scene)
+{
+	HDRImage& target = dsampletargets[0];
+
+	const AxisFilter& xfilter = xfilters[FILTER_BRIGHTPASS];
+	const AxisFilter& yfilter = yfilters[FILTER_BRIGHTPASS];
+
+	Texel4 scale = Splat4(exposure * 0.002f);
+	Texel4 bias = Splat4(0.002f);
+	Texel4 zero = Splat4(0.0f);
+	Texel4 maxvalue = Splat4(16384.0f);
+
+	ParallelRange(workers, target.height, ROWS_PER_JOB, [&](uint32_t begin, uint32_t end, uint32_t) {
+		for (uint32_t y = begin; y < end; ++y) {
+			const float* srcrow = scene.GetRow(yfilter.indices[y]);
+			float* dstrow = target.GetRow(y);
+
+			for (uint32_t x = 0; x < target.width; ++x) {
+				Texel4 color = Load4(srcrow + xfilter.indices[x] * 4);
+
+				color = Sub4(Mul4(color, scale), bias);
+				color = Min4(Max4(color, zero), maxvalue);
+
+				Store4(dstrow + x * 4, color);
+			}
+
+			SetAlpha(dstrow, target.width);
+		}
+	});
+
+	// afterimage (the GPU clears it when disabled)
+	if (drawafterimage) {
+		HDRImage& previous = afterimagetargets[1 - currentafterimage];
+		HDRImage& current = afterimagetargets[currentafterimage];
+
+		if (!afterimagevalid)
+			std::fill(previous.texels.begin(), previous.texels.end(), 0.0f);
+
+		ParallelRange(workers, current.height, ROWS_PER_JOB, [&](uint32_t begin, uint32_t end, uint32_t) {
+			Texel4 factor = Splat4(0.1f);
+
+			for (uint32_t y = begin; y < end; ++y) {
+				const float* prevrow = previous.GetRow(y);
+				const float* currrow = target.GetRow(y);
+				float* dstrow = current.GetRow(y);
+
+				for (uint32_t x = 0; x < current.width * 4; x += 4) {
+					Texel4 prev = Load4(prevrow + x);
+					Texel4 color = Mad4(Sub4(Load4(currrow + x), prev), factor, prev);
+
+					Store4(dstrow + x, Max4(color, zero));
+				}
+
+				SetAlpha(dstrow, current.width);
+			}
+		});
+	}
+
+	afterimagevalid = drawafterimage;
+	currentafterimage = 1 - currentafterimage;
+}
+
+void CPUHDREffects::DownSample()
+{
+	for (int i = 1; i < 5; ++i) {
+		HDRImage& target = dsampletargets[i];
+		const HDRImage& source = dsampletargets[i - 1];
+
+		ParallelRange(workers, target.height, ROWS_PER_JOB, [&](uint32_t begin, uint32_t end, uint32_t) {
+			std::vector<float> scratch(source.width * 4);
+
+			for (uint32_t y = begin; y < end; ++y) {
+				const AxisFilter& xfilter = xfilters[FILTER_DOWNSAMPLE + i - 1];
+				const float* srcrow = FilterRows(source, FILTER_DOWNSAMPLE + i - 1, y, 0, target.width, scratch.data());
+				float* dstrow = target.GetRow(y);
+
+				for (uint32_t x = 0; x < target.width; ++x)
+					Store4(dstrow + x * 4, xfilter.Sample(srcrow, x));
+
+				SetAlpha(dstrow, target.width);
+			}
+		});
+	}
+}
+
+void CPUHDREffects::StarRow(float* out, const HDRImage& source, uint32_t direction, uint32_t step, uint32_t y) const
+{
+	int32_t sourcewidth = (int32_t)source.width;
+	int32_t sourceheight = (int32_t)source.height;
+
+	memset(out, 0, source.width * 4 * sizeof(float));
+
+	for (int32_t i = 0; i < 4; ++i) {
+		// NOTE: offsets are whole texels, so the bilinear fetch is exact (border color is zero)
+		int32_t distance = (int32_t)step * i;
+		int32_t dx = distance * StarOffsets[direction][0];
+		int32_t sy = (int32_t)y + distance * StarOffsets[direction][1];
+
+		if (sy < 0 || sy >= sourceheight)
+			continue;
+
+		int32_t first = Math::Max(0, -dx);
+		int32_t last = Math::Min(sourcewidth, sourcewidth - dx);
+
+		const float* srcrow = source.GetRow(sy);
+		Texel4 weight = Splat4(powf(0.9f, (float)distance));
+
+		for (int32_t x = first; x < last; ++x)
+			Store4(out + x * 4, Mad4(Load4(srcrow + (x + dx) * 4), weight, Load4(out + x * 4)));
+	}
+
+	SetAlpha(out, source.width);
+}
+
+void CPUHDREffects::Stars()
+{
+	uint32_t starheight = starresult.height;
+
+	for (uint32_t pass = 0; pass < 3; ++pass) {
+		// step is pow(4, starPass)
+		uint32_t step = 1 << (2 * pass);
+
+		// NOTE: the 4 directions are independent
+		ParallelRange(workers, 4 * starheight, ROWS_PER_JOB, [&](uint32_t begin, uint32_t end, uint32_t) {
+			for (uint32_t i = begin; i < end; ++i) {
+				uint32_t direction = i / starheight;
+				uint32_t y = i % starheight;
+
+				const HDRImage& source = (pass == 0 ? dsampletargets[1] : startargets[direction][1 - pass % 2]);
+				HDRImage& target = startargets[direction][pass % 2];
+
+				StarRow(target.GetRow(y), source, direction, step, y);
+			}
+		});
+	}
+
+	// combine
+	ParallelRange(workers, starheight, ROWS_PER_JOB, [&](uint32_t begin, uint32_t end, uint32_t) {
+		for (uint32_t y = begin; y < end; ++y) {
+			const float* row0 = startargets[0][0].GetRow(y);
+			const float* row1 = startargets[1][0].GetRow(y);
+			const float* row2 = startargets[2][0].GetRow(y);
+			const float* row3 = startargets[3][0].GetRow(y);
+			float* dstrow = starresult.GetRow(y);
+
+			for (uint32_t x = 0; x < starresult.width * 4; x += 4) {
+				Texel4 sum = Add4(Add4(Load4(row0 + x), Load4(row1 + x)), Add4(Load4(row2 + x), Load4(row3 + x)));
+				Store4(dstrow + x, sum);
+			}
+
+			SetAlpha(dstrow, starresult.width);
+		}
+	});
+}
+
+void CPUHDREffects::HorizontalBlur(HDRImage& target, const HDRImage& source) const
+{
+	ParallelRange(workers, target.height, ROWS_PER_JOB, [&](uint32_t begin, uint32_t end, uint32_t) {
+		// NOTE: padded with 4 zero texels on both sides (border color)
+		std::vector<float> padded((source.width + 8) * 4, 0.0f);
+		Texel4 weights[9];
+
+		for (int k = 0; k < 9; ++k)
+			weights[k] = Splat4(BlurWeights[k]);
+
+		for (uint32_t y = begin; y < end; ++y) {
+			const float* srcrow = padded.data();
+			float* dstrow = target.GetRow(y);
+
+			memcpy(padded.data() + 16, source.GetRow(y), source.width * 4 * sizeof(float));
+
+			for (uint32_t x = 0; x < target.width; ++x) {
+				const float* texels = srcrow + x * 4;
+				Texel4 sum = Mul4(Load4(texels), weights[0]);
+
+				sum = Mad4(Load4(texels + 4), weights[1], sum);
+				sum = Mad4(Load4(texels + 8), weights[2], sum);
+				sum = Mad4(Load4(texels + 12), weights[3], sum);
+				sum = Mad4(Load4(texels + 16), weights[4], sum);
+				sum = Mad4(Load4(texels + 20), weights[5], sum);
+				sum = Mad4(Load4(texels + 24), weights[6], sum);
+				sum = Mad4(Load4(texels + 28), weights[7], sum);
+				sum = Mad4(Load4(texels + 32), weights[8], sum);
+
+				Store4(dstrow + x * 4, sum);
+			}
+
+			SetAlpha(dstrow, target.width);
+		}
+	});
+}
+
+void CPUHDREffects::VerticalBlur(HDRImage& target, const HDRImage& source) const
+{
+	uint32_t numtilesx = (target.width + BLUR_TILE_WIDTH - 1) / BLUR_TILE_WIDTH;
+	uint32_t numtilesy = (target.height + BLUR_TILE_HEIGHT - 1) / BLUR_TILE_HEIGHT;
+
+	// NOTE: a tile reads 9 short rows per output row, which stay in cache for the next rows
+	ParallelRange(workers, numtilesx * numtilesy, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+		const float* rows[9];
+		Texel4 weights[9];
+
+		for (uint32_t i = begin; i < end; ++i) {
+			uint32_t firstx = (i % numtilesx) * BLUR_TILE_WIDTH;
+			uint32_t firsty = (i / numtilesx) * BLUR_TILE_HEIGHT;
+			uint32_t lastx = Math::Min(firstx + BLUR_TILE_WIDTH, target.width);
+			uint32_t lasty = Math::Min(firsty + BLUR_TILE_HEIGHT, target.height);
+
+			for (uint32_t y = firsty; y < lasty; ++y) {
+				float* dstrow = target.GetRow(y);
+				uint32_t numtaps = 0;
+
+				// rows outside are the border color
+				for (int32_t k = 0; k < 9; ++k) {
+					int32_t sy = (int32_t)y + k - 4;
+
+					if (sy >= 0 && sy < (int32_t)source.height) {
+						rows[numtaps] = source.GetRow(sy);
+						weights[numtaps] = Splat4(BlurWeights[k]);
+
+						++numtaps;
+					}
+				}
+
+				for (uint32_t x = firstx * 4; x < lastx * 4; x += 4) {
+					Texel4 sum = Mul4(Load4(rows[0] + x), weights[0]);
+
+					for (uint32_t t = 1; t < numtaps; ++t)
+						sum = Mad4(Load4(rows[t] + x), weights[t], sum);
+
+					Store4(dstrow + x, sum);
+					dstrow[x + 3] = 1.0f;
+				}
+			}
+		}
+	});
+}
+
+void CPUHDREffects::Bloom()
+{
+	for (int i = 0; i < 5; ++i) {
+		HorizontalBlur(blurtargets[i], dsampletargets[i]);
+		VerticalBlur(dsampletargets[i], blurtargets[i]);
+	}
+
+	// combine
+	ParallelRange(workers, bloomresult.height, ROWS_PER_JOB, [&](uint32_t begin, uint32_t end, uint32_t) {
+		std::vector<float> scratch(dsampletargets[0].width * 4 * 5);
+		const float* rows[5];
+		Texel4 weights[5];
+
+		for (int i = 0; i < 5; ++i)
+			weights[i] = Splat4(BloomWeights[i]);
+
+		for (uint32_t y = begin; y < end; ++y) {
+			float* dstrow = bloomresult.GetRow(y);
+
+			for (int i = 0; i < 5; ++i)
+				rows[i] = FilterRows(dsampletargets[i], FILTER_BLOOM + i, y, 0, bloomresult.width, &scratch[dsampletargets[0].width * 4 * i]);
+
+			for (uint32_t x = 0; x < bloomresult.width; ++x) {
+				Texel4 sum = Mul4(xfilters[FILTER_BLOOM].Sample(rows[0], x), weights[0]);
+
+				for (int i = 1; i < 5; ++i)
+					sum = Mad4(xfilters[FILTER_BLOOM + i].Sample(rows[i], x), weights[i], sum);
+
+				Store4(dstrow + x * 4, sum);
+			}
+
+			SetAlpha(dstrow, bloomresult.width);
+		}
+	});
+}
+
+void CPUHDREffects::CombineFlares(HDRImage& target, const HDRImage* const* sources, uint32_t firstfilter, bool expand) const
+{
+	const FlareSample* samples = (expand ? ExpandSamples : LensFlareSamples);
+	uint32_t numsamples = (expand ? 5 : 7);
+
+	std::vector<float> xsquared(target.width);
+
+	for (uint32_t x = 0; x < target.width; ++x) {
+		float u = (x + 0.5f) / (float)target.width - 0.5f;
+		xsquared[x] = u * u;
+	}
+
+	ParallelRange(workers, target.height, ROWS_PER_JOB, [&](uint32_t begin, uint32_t end, uint32_t) {
+		std::vector<float> scratch(dsampletargets[0].width * 4);
+
+		for (uint32_t y = begin; y < end; ++y) {
+			float* dstrow = target.GetRow(y);
+			float v = (y + 0.5f) / (float)target.height - 0.5f;
+
+			memset(dstrow, 0, target.width * 4 * sizeof(float));
+
+			for (uint32_t i = 0; i < numsamples; ++i) {
+				const FlareSample& sample = samples[i];
+				const AxisFilter& xfilter = xfilters[firstfilter + i];
+
+				// weight is saturate(1 - dot(a, a) * 3), skip the texels where it is zero
+				float scalesq = sample.scale * sample.scale;
+				float radiussq = 1.0f / (3.0f * scalesq) - v * v;
+
+				if (radiussq <= 0.0f)
+					continue;
+
+				float radius = sqrtf(radiussq);
+				uint32_t xbegin = (uint32_t)Math::Max(0.0f, floorf(target.width * (0.5f - radius) - 0.5f));
+				uint32_t xend = (uint32_t)Math::Min((float)target.width, ceilf(target.width * (0.5f + radius) + 0.5f));
+
+				const float* srcrow = FilterRows(*sources[sample.source], firstfilter + i, y, xbegin, xend, scratch.data());
+				Texel4 color = Load4(sample.color);
+
+				for (uint32_t x = xbegin; x < xend; ++x) {
+					float weight = Math::Clamp(1.0f - (xsquared[x] + v * v) * scalesq * 3.0f, 0.0f, 1.0f);
+					Texel4 value = Mul4(xfilter.Sample(srcrow, x), Mul4(color, Splat4(weight)));
+
+					Store4(dstrow + x * 4, Add4(Load4(dstrow + x * 4), value));
+				}
+			}
+
+			SetAlpha(dstrow, target.width);
+		}
+	});
+}
+
+void CPUHDREffects::LensFlare()
+{
+	const HDRImage* flaresources[] = { &dsampletargets[0], &dsampletargets[1], &dsampletargets[2] };
+	const HDRImage* expandsources[] = { &lensflaretargets[0] };
+
+	CombineFlares(lensflaretargets[0], flaresources, FILTER_LENSFLARE, false);
+
+	// expand lens flares
+	CombineFlares(lensflaretargets[1], expandsources, FILTER_EXPAND, true);
+}
+
+void CPUHDREffects::ToneMap(const HDRImage& scene)
+{
+	const HDRImage* layers[] = { &bloomresult, &starresult, &lensflaretargets[1], &afterimagetargets[1 - currentafterimage] };
+	uint32_t numlayers = (drawafterimage ? 4 : 3);	// afterimage is black otherwise
+
+	float invlinwhite = 1.0f / FilmicTonemap(FilmicW);
+	std::vector<float> xsquared(tonemapped.width);
+
+	for (uint32_t x = 0; x < tonemapped.width; ++x) {
+		float u = (x + 0.5f) / (float)tonemapped.width - 0.5f;
+		xsquared[x] = u * u;
+	}
+
+	ParallelRange(workers, tonemapped.height, ROWS_PER_JOB, [&](uint32_t begin, uint32_t end, uint32_t) {
+		std::vector<float> scratch(bloomresult.width * 4 * 4);
+		const float* rows[4];
+
+		Texel4 scale = Splat4(exposure);
+		Texel4 a = Splat4(FilmicA);
+		Texel4 b = Splat4(FilmicB);
+		Texel4 cb = Splat4(FilmicC * FilmicB);
+		Texel4 de = Splat4(FilmicD * FilmicE);
+		Texel4 df = Splat4(FilmicD * FilmicF);
+		Texel4 ef = Splat4(FilmicE / FilmicF);
+		Texel4 white = Splat4(invlinwhite);
+
+		for (uint32_t y = begin; y < end; ++y) {
+			const float* srcrow = scene.GetRow(y);
+			float* dstrow = tonemapped.GetRow(y);
+			float v = (y + 0.5f) / (float)tonemapped.height - 0.5f;
+
+			for (uint32_t i = 0; i < numlayers; ++i)
+				rows[i] = FilterRows(*layers[i], FILTER_TONEMAP + i, y, 0, tonemapped.width, &scratch[bloomresult.width * 4 * i]);
+
+			for (uint32_t x = 0; x < tonemapped.width; ++x) {
+				Texel4 effects = xfilters[FILTER_TONEMAP].Sample(rows[0], x);
+
+				for (uint32_t i = 1; i < numlayers; ++i)
+					effects = Add4(effects, xfilters[FILTER_TONEMAP + i].Sample(rows[i], x));
+
+				Texel4 color = Mul4(Load4(srcrow + x * 4), scale);
+
+				Texel4 numerator = Mad4(color, Mad4(a, color, cb), de);
+				Texel4 denominator = Mad4(color, Mad4(a, color, b), df);
+
+				color = Sub4(Div4(numerator, denominator), ef);
+				color = Mad4(color, white, effects);
+
+				float vignette = 1.0f - (xsquared[x] + v * v);
+
+				Store4(dstrow + x * 4, Mul4(color, Splat4(vignette * vignette * vignette)));
+			}
+
+			SetAlpha(dstrow, tonemapped.width);
+		}
+	});
+}
+
+void CPUHDREffects::Process(const HDRImage& scene, float elapsedtime)
+{
+	typedef std::chrono::high_resolution_clock Clock;
+
+	auto elapsed = [](const Clock::time_point& start, const Clock::time_point& end) -> float {
+		return std::chrono::duration<float, std::milli>(end - start).count();
+	};
+
+	Resize(scene.width, scene.height);
+
+	auto start = Clock::now();
+	{
+		MeasureLuminance(scene);
+		AdaptLuminance(elapsedtime);
+	}
+	auto measured = Clock::now();
+	{
+		BrightPass(scene);
+	}
+	auto brightpassed = Clock::now();
+	{
+		DownSample();
+	}
+	auto downsampled = Clock::now();
+	{
+		Stars();
+	}
+	auto starred = Clock::now();
+	{
+		Bloom();
+	}
+	auto bloomed = Clock::now();
+	{
+		LensFlare();
+	}
+	auto flared = Clock::now();
+	{
+		ToneMap(scene);
+	}
+	auto end = Clock::now();
+
+	timings.luminance	= elapsed(start, measured);
+	timings.brightpass	= elapsed(measured, brightpassed);
+	timings.downsample	= elapsed(brightpassed, downsampled);
+	timings.stars		= elapsed(downsampled, starred);
+	timings.bloom		= elapsed(starred, bloomed);
+	timings.lensflare	= elapsed(bloomed, flared);
+	timings.tonemap		= elapsed(flared, end);
+	timings.total		= elapsed(start, end);
+}
@@ -0,0 +1,122 @@
+
+#ifndef _CPUHDREFFECTS_H_
+#define _CPUHDREFFECTS_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class ThreadPool;
+
+enum LuminanceMode
+{
+	LuminanceModePoint = 0,		// 64x64 x 9 point samples (39_HDREffects)
+	LuminanceModeBilinear,		// 64x64 x 9 bilinear samples (AverageLuminance with a linear source)
+	LuminanceModeFull			// every pixel of the scene
+};
+
+struct HDRImage
+{
+	std::vector<float>	texels;		// RGBA, row by row
+	uint32_t			width;
+	uint32_t			height;
+
+	HDRImage();
+
+	void Resize(uint32_t newwidth, uint32_t newheight);
+
+	inline float* GetRow(uint32_t y)				{ return texels.data() + (size_t)y * width * 4; }
+	inline const float* GetRow(uint32_t y) const	{ return texels.data() + (size_t)y * width * 4; }
+};
+
+struct HDREffectsTimings
+{
+	float	luminance;		// ms (measure + adapt)
+	float	brightpass;
+	float	downsample;
+	float	stars;
+	float	bloom;
+	float	lensflare;
+	float	tonemap;
+	float	total;
+};
+
+/**
+ * \brief CPU implementation of the HDR post-processing chain of 39_HDREffects
+ *
+ * Every pass reproduces the texture fetches of its shader in hdreffects.fx and measureluminance.fx
+ * (sample positions, point or bilinear filtering, clamp or border addressing), so the results
+ * match the render targets up to half float precision. Images are RGBA32F with rows in the order
+ * of the readback (row 0 is the top in D3D and the bottom in GL).
+ *
+ * The resampling weights only depend on the image sizes, so Resize builds them once as per-axis
+ * tap tables. Passes run in parallel by rows, the vertical blur by tiles.
+ */
+class CPUHDREffects
+{
+	struct AxisFilter;
+
+private:
+	HDRImage				dsampletargets[5];		// 1/2 to 1/32 resolution
+	HDRImage				blurtargets[5];
+	HDRImage				startargets[4][2];		// per direction, ping-pong
+	HDRImage				lensflaretargets[2];
+	HDRImage				afterimagetargets[2];
+	HDRImage				bloomresult;
+	HDRImage				starresult;
+	HDRImage				tonemapped;
+
+	std::vector<AxisFilter>	xfilters;
+	std::vector<AxisFilter>	yfilters;
+	ThreadPool*				workers;
+	HDREffectsTimings		timings;
+	LuminanceMode			luminancemode;
+	uint32_t				width;
+	uint32_t				height;
+	uint32_t				currentafterimage;
+	float					averageluminance;
+	float					adaptedluminance;
+	float					exposure;
+	bool					drawafterimage;
+	bool					afterimagevalid;
+
+	const float* FilterRows(const HDRImage& source, uint32_t filter, uint32_t y, uint32_t xbegin, uint32_t xend, float* scratch) const;
+	void StarRow(float* out, const HDRImage& source, uint32_t direction, uint32_t step, uint32_t y) const;
+	void HorizontalBlur(HDRImage& target, const HDRImage& source) const;
+	void VerticalBlur(HDRImage& target, const HDRImage& source) const;
+	void CombineFlares(HDRImage& target, const HDRImage* const* sources, uint32_t firstfilter, bool expand) const;
+
+public:
+	CPUHDREffects();
+	~CPUHDREffects();
+
+	void Resize(uint32_t newwidth, uint32_t newheight);		// size of the scene, at least 32x32
+	void Process(const HDRImage& scene, float elapsedtime);	// the whole chain, in the order of 39_HDREffects
+
+	// NOTE: the passes can be called one by one as well (the scene must be the size given to Resize)
+	float MeasureLuminance(const HDRImage& scene);
+	void AdaptLuminance(float elapsedtime);
+	void BrightPass(const HDRImage& scene);
+	void DownSample();
+	void Stars();
+	void Bloom();
+	void LensFlare();
+	void ToneMap(const HDRImage& scene);
+
+	inline void SetThreadPool(ThreadPool* pool)				{ workers = pool; }
+	inline void SetLuminanceMode(LuminanceMode mode)		{ luminancemode = mode; }
+	inline void SetAdaptedLuminance(float value)			{ adaptedluminance = value; }
+	inline void SetAfterImage(bool enable)					{ drawafterimage = enable; }
+
+	inline const HDRImage& GetBloom() const					{ return bloomresult; }
+	inline const HDRImage& GetStars() const					{ return starresult; }
+	inline const HDRImage& GetLensFlare() const				{ return lensflaretargets[1]; }
+	inline const HDRImage& GetResult() const				{ return tonemapped; }		// linear, before sRGB conversion
+	inline const HDREffectsTimings& GetTimings() const		{ return timings; }
+
+	inline float GetAverageLuminance() const				{ return averageluminance; }
+	inline float GetAdaptedLuminance() const				{ return adaptedluminance; }
+	inline float GetExposure() const						{ return exposure; }
+};
+
+#endif
@@ -0,0 +1,2265 @@
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "cpupathtracer.h"
+#include "threadpool.h"
+#include "profiler.h"
+
+#define TILE_SIZE			16		// same as the compute shaders
+#define BVH_NUM_BINS		16
+#define BVH_MAX_LEAF_SIZE	4
+#define BVH_MAX_DEPTH		60
+#define BVH_STACK_SIZE		64
+#define MAX_PASSTHROUGHS	256		// alpha tested surfaces per ray
+#define RR_START_DEPTH		3		// same as the unidirectional shader
+#define INSULATOR_F0		0.04f
+#define MIN_ROUGHNESS		0.01f
+
+#define ONE_OVER_PI			0.3183098861837906f
+#define ONE_OVER_TWO_PI		0.1591549430918953f
+
+enum TransportMode
+{
+	TransportModeRadiance = 0,		// camera subpaths
+	TransportModeImportance			// light subpaths
+};
+
+enum PathVertexType
+{
+	PathVertexTypeCamera = 0,
+	PathVertexTypeLight,
+	PathVertexTypeSurface
+};
+
+struct CPUPathTracer::Triangle
+{
+	Math::Vector3	v0;
+	Math::Vector3	e1;
+	Math::Vector3	e2;
+	uint32_t		index;		// in the index buffer (/ 3)
+};
+
+struct CPUPathTracer::BVHNode
+{
+	// NOTE: same layout as the GPU nodes (accelstructure.head)
+	Math::Vector3	Min;
+	uint32_t		LeftOrCount;	// high bit set for leaves
+	Math::Vector3	Max;
+	uint32_t		RightOrStart;	// split axis in bits 30-31 for inner nodes
+};
+
+struct CPUPathTracer::Texture
+{
+	std::vector<Math::Vector3>	texels;		// linear
+	uint32_t					width;
+	uint32_t					height;
+};
+
+struct CPUPathTracer::Hit
+{
+	Math::Vector3	position;
+	Math::Vector3	geomnormal;
+	Math::Vector3	normal;			// interpolated
+	float			distance;
+	float			u, v;			// barycentrics, then texcoord after GetSurface
+	uint32_t		triangle;		// in BVH order
+	int32_t			light;			// -1 for surfaces
+	uint32_t		materialID;
+};
+
+struct CPUPathTracer::PathVertex
+{
+	Math::Vector3	position;
+	Math::Vector3	geomnormal;		// light normal for light vertices
+	Math::Vector3	normal;
+	Math::Vector3	outdir;			// towards the previous vertex
+	Math::Vector3	beta;			// throughput of the subpath
+	Math::Vector3	albedo;
+	float			forwardPDF;		// area density
+	float			reversePDF;
+	uint32_t		type;
+	uint32_t		index;			// material or light
+	bool			isdelta;
+};
+
+struct CPUPathTracer::Random
+{
+	// NOTE: PCG32 (O'Neill), one sequence per pixel sample
+	uint64_t state;
+	uint64_t increment;
+
+	static uint64_t SplitMix64(uint64_t x)
+	{
+		x += 0x9e3779b97f4a7c15ULL;
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+
+		return x ^ (x >> 31);
+	}
+
+	Random(uint64_t sequence, uint64_t index)
+	{
+		state = 0;
+		increment = (SplitMix64(sequence) << 1) | 1;
+
+		NextUInt();
+		state += SplitMix64(index ^ (sequence * 0x9e3779b97f4a7c15ULL));
+		NextUInt();
+	}
+
+	inline uint32_t NextUInt()
+	{
+		uint64_t oldstate = state;
+		state = oldstate * 6364136223846793005ULL + increment;
+
+		uint32_t xorshifted = (uint32_t)(((oldstate >> 18) ^ oldstate) >> 27);
+		uint32_t rot = (uint32_t)(oldstate >> 59);
+
+		return (xorshifted >> rot) | (xorshifted << ((~rot + 1) & 31));
+	}
+
+	inline float Next()
+	{
+		return (NextUInt() >> 8) * (1.0f / 16777216.0f);
+	}
+};
+
+struct CPUPathTracer::WorkerData
+{
+	std::atomic<uint64_t>		tiles;		// [begin, end) packed as end << 32 | begin
+	std::vector<PathVertex>		camerapath;
+	std::vector<PathVertex>		lightpath;
+};
+
+// --- Helpers impl -----------------------------------------------------------
+
+struct BSDFSample
+{
+	Math::Vector3	value;
+	Math::Vector3	wi;
+	float			pdf;
+	bool			isdelta;
+};
+
+struct ShadingFrame
+{
+	Math::Vector3 t, b, n;
+
+	ShadingFrame(const Math::Vector3& normal)
+	{
+		// NOTE: Duff et al. 2017, "Building an Orthonormal Basis, Revisited"
+		float sign = (normal.z >= 0.0f ? 1.0f : -1.0f);
+		float a = -1.0f / (sign + normal.z);
+		float c = normal.x * normal.y * a;
+
+		t = Math::Vector3(1.0f + sign * normal.x * normal.x * a, sign * c, -sign * normal.x);
+		b = Math::Vector3(c, sign + normal.y * normal.y * a, -normal.y);
+		n = normal;
+	}
+
+	inline Math::Vector3 ToLocal(const Math::Vector3& v) const {
+		return Math::Vector3(Math::Vec3Dot(v, t), Math::Vec3Dot(v, b), Math::Vec3Dot(v, n));
+	}
+
+	inline Math::Vector3 ToWorld(const Math::Vector3& v) const {
+		return t * v.x + b * v.y + n * v.z;
+	}
+};
+
+static inline Math::Vector3 Cross(const Math::Vector3& a, const Math::Vector3& b)
+{
+	return Math::Vector3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+}
+
+static inline Math::Vector3 Normalize(const Math::Vector3& v)
+{
+	float length = sqrtf(Math::Vec3Dot(v, v));
+	return ((length > 0.0f) ? v * (1.0f / length) : v);
+}
+
+static inline bool IsBlack(const Math::Vector3& v)
+{
+	return (v.x == 0.0f && v.y == 0.0f && v.z == 0.0f);
+}
+
+static inline bool IsFinite(const Math::Vector3& v)
+{
+	return (std::isfinite(v.x) && std::isfinite(v.y) && std::isfinite(v.z));
+}
+
+static inline float MaxComponent(const Math::Vector3& v)
+{
+	return Math::Max(v.x, Math::Max(v.y, v.z));
+}
+
+static inline float SurfaceArea(const Math::AABox& box)
+{
+	Math::Vector3 size = box.Max - box.Min;
+	return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+static inline float PowerHeuristic(float pdf1, float pdf2)
+{
+	float f = pdf1 * pdf1;
+	float g = pdf2 * pdf2;
+
+	return ((f + g > 0.0f) ? f / (f + g) : 0.0f);
+}
+
+static inline float Pow5(float x)
+{
+	float x2 = x * x;
+	return x2 * x2 * x;
+}
+
+static inline bool RayIntersectBox(const Math::Vector3& bmin, const Math::Vector3& bmax, const Math::Vector3& start, const Math::Vector3& invdir, float maxdist)
+{
+	float t1 = (bmin.x - start.x) * invdir.x;
+	float t2 = (bmax.x - start.x) * invdir.x;
+	float tmin = Math::Min(t1, t2);
+	float tmax = Math::Max(t1, t2);
+
+	t1 = (bmin.y - start.y) * invdir.y;
+	t2 = (bmax.y - start.y) * invdir.y;
+	tmin = Math::Max(tmin, Math::Min(t1, t2));
+	tmax = Math::Min(tmax, Math::Max(t1, t2));
+
+	t1 = (bmin.z - start.z) * invdir.z;
+	t2 = (bmax.z - start.z) * invdir.z;
+	tmin = Math::Max(tmin, Math::Min(t1, t2));
+	tmax = Math::Min(tmax, Math::Max(t1, t2));
+
+	return (tmax >= Math::Max(tmin, 0.0f) && tmin < maxdist);
+}
+
+static inline float RayIntersectTriangle(float& b1, float& b2, const Math::Vector3& v0, const Math::Vector3& e1, const Math::Vector3& e2, const Math::Vector3& start, const Math::Vector3& dir)
+{
+	// NOTE: Moller-Trumbore, returns FLT_MAX if there is no intersection
+	Math::Vector3 pvec = Cross(dir, e2);
+	float det = Math::Vec3Dot(e1, pvec);
+
+	if (fabsf(det) < 1e-12f)
+		return FLT_MAX;
+
+	float invdet = 1.0f / det;
+	Math::Vector3 tvec = start - v0;
+
+	b1 = Math::Vec3Dot(tvec, pvec) * invdet;
+
+	if (b1 < 0.0f || b1 > 1.0f)
+		return FLT_MAX;
+
+	Math::Vector3 qvec = Cross(tvec, e1);
+	b2 = Math::Vec3Dot(dir, qvec) * invdet;
+
+	if (b2 < 0.0f || b1 + b2 > 1.0f)
+		return FLT_MAX;
+
+	float t = Math::Vec3Dot(e2, qvec) * invdet;
+	return ((t > 0.0f) ? t : FLT_MAX);
+}
+
+// --- BSDF impl --------------------------------------------------------------
+
+// NOTE: the models follow bsdf_common.head, in a local frame where the (shading) normal is +Z:
+//   diffuse, transparent:	Lambert (front side only)
+//   insulator:				Ashikhmin-Shirley with F0 = 0.04, delta: its diffuse part + a Schlick mirror
+//   conductor:				Cook-Torrance (GGX, height-correlated Smith) with Schlick(color), delta: mirror
+//   dielectric:			rough/smooth glass (Walter et al. 2007), Schlick Fresnel, transmission tinted by color
+//
+// (the roughness is used as the GGX alpha, the eta of the .info files is the relative IOR)
+
+static inline float D_GGX(float ndoth, float alpha)
+{
+	if (ndoth <= 0.0f)
+		return 0.0f;
+
+	float a2 = alpha * alpha;
+	float d = (ndoth * ndoth) * (a2 - 1.0f) + 1.0f;
+
+	return a2 / (Math::PI * d * d);
+}
+
+static inline float G1_Smith_GGX(float ndotv, float alpha)
+{
+	float a2 = alpha * alpha;
+	return (2.0f * ndotv) / (ndotv + sqrtf(a2 + (1.0f - a2) * ndotv * ndotv));
+}
+
+static inline float G2_Smith_GGX(float ndotl, float ndotv, float alpha)
+{
+	float a2 = alpha * alpha;
+	float lambdav = sqrtf(a2 + (1.0f - a2) * ndotv * ndotv);
+	float lambdal = sqrtf(a2 + (1.0f - a2) * ndotl * ndotl);
+
+	return (2.0f * ndotl * ndotv) / (ndotv * lambdal + ndotl * lambdav);
+}
+
+static inline float F_Schlick(float f0, float u)
+{
+	return f0 + (1.0f - f0) * Pow5(1.0f - u);
+}
+
+static inline Math::Vector3 F_Schlick(const Math::Vector3& f0, float u)
+{
+	float f = Pow5(1.0f - u);
+	return f0 + (Math::Vector3(1, 1, 1) - f0) * f;
+}
+
+static float FresnelDielectric(float cosi, float eta)
+{
+	// NOTE: Schlick with the angle of the less dense side, 1 for total internal reflection
+	if (cosi < 0.0f) {
+		eta = 1.0f / eta;
+		cosi = -cosi;
+	}
+
+	float sin2t = (1.0f - cosi * cosi) / (eta * eta);
+
+	if (sin2t >= 1.0f)
+		return 1.0f;
+
+	float cost = sqrtf(1.0f - sin2t);
+	return F_Schlick(Math::F0FromEta(eta), (eta < 1.0f) ? cost : cosi);
+}
+
+static bool Refract(Math::Vector3& out, float& etap, const Math::Vector3& wo, Math::Vector3 n, float eta)
+{
+	float cosi = Math::Vec3Dot(n, wo);
+
+	if (cosi < 0.0f) {
+		eta = 1.0f / eta;
+		cosi = -cosi;
+		n = -n;
+	}
+
+	float sin2i = Math::Max(0.0f, 1.0f - cosi * cosi);
+	float sin2t = sin2i / (eta * eta);
+
+	if (sin2t >= 1.0f)
+		return false;
+
+	float cost = sqrtf(1.0f - sin2t);
+
+	out = (-wo) / eta + n * (cosi / eta - cost);
+	etap = eta;
+
+	return true;
+}
+
+static inline Math::Vector3 Reflect(const Math::Vector3& wo, const Math::Vector3& n)
+{
+	return n * (2.0f * Math::Vec3Dot(wo, n)) - wo;
+}
+
+static inline float PDF_GGXVisible(const Math::Vector3& wo, const Math::Vector3& wm, float alpha)
+{
+	// NOTE: density of visible normals (Heitz 2018), wo and wm can be on either side
+	float cosv = fabsf(wo.z);
+
+	if (cosv == 0.0f)
+		return 0.0f;
+
+	return G1_Smith_GGX(cosv, alpha) / cosv * D_GGX(fabsf(wm.z), alpha) * fabsf(Math::Vec3Dot(wo, wm));
+}
+
+static Math::Vector3 SampleGGXVisible(const Math::Vector3& wo, float alpha, float u1, float u2)
+{
+	// NOTE: Heitz 2018, "Sampling the GGX Distribution of Visible Normals" (upper hemisphere)
+	Math::Vector3 v = Normalize(Math::Vector3(alpha * wo.x, alpha * wo.y, fabsf(wo.z)));
+	float lensq = v.x * v.x + v.y * v.y;
+
+	Math::Vector3 t1 = ((lensq > 0.0f) ? Math::Vector3(-v.y, v.x, 0.0f) * (1.0f / sqrtf(lensq)) : Math::Vector3(1, 0, 0));
+	Math::Vector3 t2 = Cross(v, t1);
+
+	float r = sqrtf(u1);
+	float phi = Math::TWO_PI * u2;
+	float p1 = r * cosf(phi);
+	float p2 = r * sinf(phi);
+	float s = 0.5f * (1.0f + v.z);
+
+	p2 = (1.0f - s) * sqrtf(Math::Max(0.0f, 1.0f - p1 * p1)) + s * p2;
+
+	Math::Vector3 h = t1 * p1 + t2 * p2 + v * sqrtf(Math::Max(0.0f, 1.0f - p1 * p1 - p2 * p2));
+	return Normalize(Math::Vector3(alpha * h.x, alpha * h.y, Math::Max(0.0f, h.z)));
+}
+
+static inline Math::Vector3 SampleCosineHemisphere(float u1, float u2)
+{
+	float r = sqrtf(u1);
+	float phi = Math::TWO_PI * u2;
+
+	return Math::Vector3(r * cosf(phi), r * sinf(phi), sqrtf(Math::Max(0.0f, 1.0f - u1)));
+}
+
+static inline uint32_t GetBaseType(const BSDFInfo& info)
+{
+	return (info.bsdftype & (~BSDFTypeSpecular));
+}
+
+static inline bool IsDiracDelta(const BSDFInfo& info)
+{
+	return ((info.bsdftype & BSDFTypeSpecular) == BSDFTypeSpecular);
+}
+
+static inline bool IsDeltaOnly(const BSDFInfo& info)
+{
+	// NOTE: these have no diffuse part to connect to
+	uint32_t basetype = GetBaseType(info);
+	return (IsDiracDelta(info) && (basetype == BSDFTypeConductor || basetype == BSDFTypeDielectric));
+}
+
+static inline bool IsReflectionOnly(const BSDFInfo& info, bool twosided)
+{
+	uint32_t basetype = GetBaseType(info);
+	return (twosided && (basetype == BSDFTypeDiffuse || basetype == BSDFTypeInsulator || basetype == BSDFTypeConductor));
+}
+
+static inline void GetRoughnessAndEta(float& alpha, float& eta, const BSDFInfo& info)
+{
+	memcpy(&alpha, &info.roughness, sizeof(float));
+	memcpy(&eta, &info.eta, sizeof(float));
+
+	alpha = Math::Max(alpha, MIN_ROUGHNESS);
+
+	if (eta < 1e-3f)
+		eta = 1.5f;
+}
+
+static Math::Vector3 EvaluateRoughDielectric(const BSDFInfo& info, const Math::Vector3& wo, const Math::Vector3& wi, float alpha, float eta, uint32_t mode)
+{
+	float coso = wo.z;
+	float cosi = wi.z;
+
+	if (coso == 0.0f || cosi == 0.0f)
+		return Math::Vector3(0, 0, 0);
+
+	bool reflect = (coso * cosi > 0.0f);
+	float etap = 1.0f;
+
+	if (!reflect)
+		etap = ((coso > 0.0f) ? eta : (1.0f / eta));
+
+	Math::Vector3 wm = wi * etap + wo;
+
+	if (Math::Vec3Dot(wm, wm) == 0.0f)
+		return Math::Vector3(0, 0, 0);
+
+	wm = Normalize(wm);
+
+	if (wm.z < 0.0f)
+		wm = -wm;
+
+	float wodotm = Math::Vec3Dot(wo, wm);
+	float widotm = Math::Vec3Dot(wi, wm);
+
+	if (widotm * cosi < 0.0f || wodotm * coso < 0.0f)
+		return Math::Vector3(0, 0, 0);
+
+	float F = FresnelDielectric(wodotm, eta);
+	float D = D_GGX(wm.z, alpha);
+	float G = G2_Smith_GGX(fabsf(cosi), fabsf(coso), alpha);
+
+	if (reflect) {
+		float value = D * G * F / fabsf(4.0f * cosi * coso);
+		return Math::Vector3(value, value, value);
+	}
+
+	float denom = widotm + wodotm / etap;
+	float value = D * (1.0f - F) * G * fabsf(widotm * wodotm / (cosi * coso * denom * denom));
+
+	if (mode == TransportModeRadiance)
+		value /= (etap * etap);
+
+	return Math::Vector3(info.color.r, info.color.g, info.color.b) * value;
+}
+
+static float PDFRoughDielectric(const Math::Vector3& wo, const Math::Vector3& wi, float alpha, float eta)
+{
+	float coso = wo.z;
+	float cosi = wi.z;
+
+	if (coso == 0.0f || cosi == 0.0f)
+		return 0.0f;
+
+	bool reflect = (coso * cosi > 0.0f);
+	float etap = 1.0f;
+
+	if (!reflect)
+		etap = ((coso > 0.0f) ? eta : (1.0f / eta));
+
+	Math::Vector3 wm = wi * etap + wo;
+
+	if (Math::Vec3Dot(wm, wm) == 0.0f)
+		return 0.0f;
+
+	wm = Normalize(wm);
+
+	if (wm.z < 0.0f)
+		wm = -wm;
+
+	float wodotm = Math::Vec3Dot(wo, wm);
+	float widotm = Math::Vec3Dot(wi, wm);
+
+	if (widotm * cosi < 0.0f || wodotm * coso < 0.0f)
+		return 0.0f;
+
+	float R = FresnelDielectric(wodotm, eta);
+	float T = 1.0f - R;
+
+	if (reflect)
+		return PDF_GGXVisible(wo, wm, alpha) / (4.0f * fabsf(wodotm)) * R;
+
+	float denom = widotm + wodotm / etap;
+	return PDF_GGXVisible(wo, wm, alpha) * fabsf(widotm) / (denom * denom) * T;
+}
+
+static Math::Vector3 EvaluateBSDF(const BSDFInfo& info, const Math::Vector3& albedo, Math::Vector3 wo, Math::Vector3 wi, bool twosided, uint32_t mode)
+{
+	uint32_t basetype = GetBaseType(info);
+	bool diracdelta = IsDiracDelta(info);
+	float alpha, eta;
+
+	if (IsReflectionOnly(info, twosided) && wo.z < 0.0f) {
+		wo.z = -wo.z;
+		wi.z = -wi.z;
+	}
+
+	GetRoughnessAndEta(alpha, eta, info);
+
+	if (basetype == BSDFTypeDielectric)
+		return (diracdelta ? Math::Vector3(0, 0, 0) : EvaluateRoughDielectric(info, wo, wi, alpha, eta, mode));
+
+	if (wo.z <= 0.0f || wi.z <= 0.0f)
+		return Math::Vector3(0, 0, 0);
+
+	if (basetype == BSDFTypeInsulator) {
+		// Ashikhmin-Shirley
+		float ndotl = wi.z;
+		float ndotv = wo.z;
+		float diffscale = (28.0f / 23.0f) * ONE_OVER_PI * (1.0f - INSULATOR_F0) * (1.0f - Pow5(1.0f - 0.5f * ndotl)) * (1.0f - Pow5(1.0f - 0.5f * ndotv));
+		Math::Vector3 value = albedo * diffscale;
+
+		if (!diracdelta) {
+			Math::Vector3 h = Normalize(wo + wi);
+			float ldoth = Math::Vec3Dot(wi, h);
+			float spec = D_GGX(h.z, alpha) * F_Schlick(INSULATOR_F0, ldoth) / (4.0f * ldoth * Math::Max(ndotl, ndotv));
+
+			value += Math::Vector3(spec, spec, spec);
+		}
+
+		return value;
+	} else if (basetype == BSDFTypeConductor) {
+		if (diracdelta)
+			return Math::Vector3(0, 0, 0);
+
+		// Cook-Torrance
+		Math::Vector3 h = Normalize(wo + wi);
+		Math::Vector3 F = F_Schlick(Math::Vector3(info.color.r, info.color.g, info.color.b), Math::Vec3Dot(wi, h));
+		float value = G2_Smith_GGX(wi.z, wo.z, alpha) * D_GGX(h.z, alpha) / (4.0f * wi.z * wo.z);
+
+		return F * value;
+	}
+
+	// diffuse, transparent
+	return albedo * ONE_OVER_PI;
+}
+
+static float PDFBSDF(const BSDFInfo& info, Math::Vector3 wo, Math::Vector3 wi, bool twosided)
+{
+	uint32_t basetype = GetBaseType(info);
+	bool diracdelta = IsDiracDelta(info);
+	float alpha, eta;
+
+	if (IsReflectionOnly(info, twosided) && wo.z < 0.0f) {
+		wo.z = -wo.z;
+		wi.z = -wi.z;
+	}
+
+	GetRoughnessAndEta(alpha, eta, info);
+
+	if (basetype == BSDFTypeDielectric)
+		return (diracdelta ? 0.0f : PDFRoughDielectric(wo, wi, alpha, eta));
+
+	if (wo.z <= 0.0f || wi.z <= 0.0f)
+		return 0.0f;
+
+	if (basetype == BSDFTypeInsulator) {
+		float pdf = 0.5f * wi.z * ONE_OVER_PI;
+
+		if (!diracdelta) {
+			Math::Vector3 h = Normalize(wo + wi);
+			pdf += 0.5f * PDF_GGXVisible(wo, h, alpha) / (4.0f * Math::Vec3Dot(wo, h));
+		}
+
+		return pdf;
+	} else if (basetype == BSDFTypeConductor) {
+		if (diracdelta)
+			return 0.0f;
+
+		Math::Vector3 h = Normalize(wo + wi);
+		return PDF_GGXVisible(wo, h, alpha) / (4.0f * Math::Vec3Dot(wo, h));
+	}
+
+	return wi.z * ONE_OVER_PI;
+}
+
+static bool SampleBSDF(BSDFSample& out, const BSDFInfo& info, const Math::Vector3& albedo, Math::Vector3 wo, float u1, float u2, float u3, bool twosided, uint32_t mode)
+{
+	uint32_t basetype = GetBaseType(info);
+	bool diracdelta = IsDiracDelta(info);
+	bool flipped = (IsReflectionOnly(info, twosided) && wo.z < 0.0f);
+	float alpha, eta;
+
+	GetRoughnessAndEta(alpha, eta, info);
+
+	if (flipped)
+		wo.z = -wo.z;
+
+	out.isdelta = false;
+
+	if (basetype == BSDFTypeDielectric) {
+		if (wo.z == 0.0f)
+			return false;
+
+		if (diracdelta) {
+			float R = FresnelDielectric(wo.z, eta);
+			float T = 1.0f - R;
+
+			out.isdelta = true;
+
+			if (u3 < R) {
+				out.wi = Math::Vector3(-wo.x, -wo.y, wo.z);
+				out.value = Math::Vector3(R, R, R) / fabsf(out.wi.z);
+				out.pdf = R;
+			} else {
+				float etap;
+
+				if (!Refract(out.wi, etap, wo, Math::Vector3(0, 0, 1), eta) || out.wi.z == 0.0f)
+					return false;
+
+				out.value = Math::Vector3(info.color.r, info.color.g, info.color.b) * (T / fabsf(out.wi.z));
+				out.pdf = T;
+
+				if (mode == TransportModeRadiance)
+					out.value = out.value / (etap * etap);
+			}
+		} else {
+			// NOTE: wm is always in the upper hemisphere (visible from -wo when coming from inside)
+			Math::Vector3 wm = SampleGGXVisible((wo.z < 0.0f ? -wo : wo), alpha, u1, u2);
+			float R = FresnelDielectric(Math::Vec3Dot(wo, wm), eta);
+
+			if (u3 < R) {
+				out.wi = Reflect(wo, wm);
+
+				if (out.wi.z * wo.z <= 0.0f)
+					return false;
+			} else {
+				float etap;
+
+				if (!Refract(out.wi, etap, wo, wm, eta) || out.wi.z * wo.z >= 0.0f)
+					return false;
+			}
+
+			// NOTE: evaluating is cheaper than duplicating the transmission terms here
+			out.value = EvaluateRoughDielectric(info, wo, out.wi, alpha, eta, mode);
+			out.pdf = PDFRoughDielectric(wo, out.wi, alpha, eta);
+		}
+	} else {
+		if (wo.z <= 0.0f)
+			return false;
+
+		if (basetype == BSDFTypeConductor) {
+			if (diracdelta) {
+				out.wi = Math::Vector3(-wo.x, -wo.y, wo.z);
+				out.value = F_Schlick(Math::Vector3(info.color.r, info.color.g, info.color.b), wo.z) / wo.z;
+				out.pdf = 1.0f;
+				out.isdelta = true;
+			} else {
+				out.wi = Reflect(wo, SampleGGXVisible(wo, alpha, u1, u2));
+
+				if (out.wi.z <= 0.0f)
+					return false;
+
+				out.value = EvaluateBSDF(info, albedo, wo, out.wi, false, mode);
+				out.pdf = PDFBSDF(info, wo, out.wi, false);
+			}
+		} else if (basetype == BSDFTypeInsulator) {
+			if (u3 < 0.5f) {
+				out.wi = SampleCosineHemisphere(u1, u2);
+			} else if (diracdelta) {
+				out.wi = Math::Vector3(-wo.x, -wo.y, wo.z);
+				out.value = Math::Vector3(1, 1, 1) * (F_Schlick(INSULATOR_F0, wo.z) / wo.z);
+				out.pdf = 0.5f;
+				out.isdelta = true;
+			} else {
+				out.wi = Reflect(wo, SampleGGXVisible(wo, alpha, u1, u2));
+			}
+
+			if (!out.isdelta) {
+				if (out.wi.z <= 0.0f)
+					return false;
+
+				out.value = EvaluateBSDF(info, albedo, wo, out.wi, false, mode);
+				out.pdf = PDFBSDF(info, wo, out.wi, false);
+			}
+		} else {
+			out.wi = SampleCosineHemisphere(u1, u2);
+			out.value = albedo * ONE_OVER_PI;
+			out.pdf = out.wi.z * ONE_OVER_PI;
+		}
+	}
+
+	if (flipped)
+		out.wi.z = -out.wi.z;
+
+	return (out.pdf > 0.0f && !IsBlack(out.value));
+}
+
+// --- Light impl -------------------------------------------------------------
+
+// NOTE: plates are the [0, 1] x [0, 1] xz square of toworld emitting towards cross(b, t),
+// spheres are centered at the translation of toworld with radius toworld._11 (see the shaders)
+
+static inline void GetPlateFrame(const AreaLight& light, Math::Vector3& o, Math::Vector3& t, Math::Vector3& b)
+{
+	t = Math::Vector3(light.toworld._11, light.toworld._12, light.toworld._13);
+	b = Math::Vector3(light.toworld._31, light.toworld._32, light.toworld._33);
+	o = Math::Vector3(light.toworld._41, light.toworld._42, light.toworld._43);
+}
+
+static float GetLightArea(const AreaLight& light)
+{
+	if (light.shapetype == ShapeTypeSphere)
+		return 4.0f * Math::PI * light.toworld._11 * light.toworld._11;
+
+	Math::Vector3 o, t, b;
+	GetPlateFrame(light, o, t, b);
+
+	return sqrtf(Math::Vec3Dot(Cross(b, t), Cross(b, t)));
+}
+
+static inline Math::Vector3 GetEmitted(const AreaLight& light, const Math::Vector3& n, const Math::Vector3& w)
+{
+	// NOTE: w points away from the light
+	return ((Math::Vec3Dot(n, w) > 0.0f) ? light.luminance : Math::Vector3(0, 0, 0));
+}
+
+static void SampleLightArea(Math::Vector3& p, Math::Vector3& n, const AreaLight& light, float u1, float u2)
+{
+	if (light.shapetype == ShapeTypeSphere) {
+		Math::Vector3 center(light.toworld._41, light.toworld._42, light.toworld._43);
+		float z = 1.0f - 2.0f * u1;
+		float r = sqrtf(Math::Max(0.0f, 1.0f - z * z));
+		float phi = Math::TWO_PI * u2;
+
+		n = Math::Vector3(r * cosf(phi), r * sinf(phi), z);
+		p = center + n * light.toworld._11;
+	} else {
+		Math::Vector3 o, t, b;
+		GetPlateFrame(light, o, t, b);
+
+		p = o + t * u1 + b * u2;
+		n = Normalize(Cross(b, t));
+	}
+}
+
+static bool SampleLightDirect(Math::Vector3& p, Math::Vector3& n, float& pdf, const AreaLight& light, const Math::Vector3& ref, float u1, float u2)
+{
+	// NOTE: pdf is a solid angle density from ref
+	if (light.shapetype == ShapeTypeSphere) {
+		Math::Vector3 center(light.toworld._41, light.toworld._42, light.toworld._43);
+		Math::Vector3 wc = center - ref;
+		float radius = light.toworld._11;
+		float dc2 = Math::Vec3Dot(wc, wc);
+
+		if (dc2 > radius * radius) {
+			// sample the visible cone (pbrt-v3)
+			float dc = sqrtf(dc2);
+			float sin2max = (radius * radius) / dc2;
+			float cosmax = sqrtf(Math::Max(0.0f, 1.0f - sin2max));
+			float costheta = (1.0f - u1) + u1 * cosmax;
+			float sintheta = sqrtf(Math::Max(0.0f, 1.0f - costheta * costheta));
+			float phi = Math::TWO_PI * u2;
+
+			float ds = dc * costheta - sqrtf(Math::Max(0.0f, radius * radius - dc2 * sintheta * sintheta));
+			float cosalpha = (dc2 + radius * radius - ds * ds) / (2.0f * dc * radius);
+			float sinalpha = sqrtf(Math::Max(0.0f, 1.0f - cosalpha * cosalpha));
+
+			ShadingFrame frame(wc * (1.0f / dc));
+
+			n = -frame.ToWorld(Math::Vector3(sinalpha * cosf(phi), sinalpha * sinf(phi), cosalpha));
+			p = center + n * radius;
+			pdf = 1.0f / (Math::TWO_PI * (1.0f - cosmax));
+
+			return (pdf > 0.0f && std::isfinite(pdf));
+		}
+	}
+
+	SampleLightArea(p, n, light, u1, u2);
+
+	Math::Vector3 w = p - ref;
+	float d2 = Math::Vec3Dot(w, w);
+	float cosl = -Math::Vec3Dot(n, w) / sqrtf(d2);
+
+	if (d2 == 0.0f || cosl <= 0.0f)
+		return false;
+
+	pdf = d2 / (cosl * GetLightArea(light));
+	return true;
+}
+
+static float PDFLightDirect(const AreaLight& light, const Math::Vector3& ref, const Math::Vector3& p, const Math::Vector3& n)
+{
+	if (light.shapetype == ShapeTypeSphere) {
+		Math::Vector3 center(light.toworld._41, light.toworld._42, light.toworld._43);
+		Math::Vector3 wc = center - ref;
+		float radius = light.toworld._11;
+		float dc2 = Math::Vec3Dot(wc, wc);
+
+		if (dc2 > radius * radius) {
+			float cosmax = sqrtf(Math::Max(0.0f, 1.0f - (radius * radius) / dc2));
+			return 1.0f / (Math::TWO_PI * (1.0f - cosmax));
+		}
+	}
+
+	Math::Vector3 w = p - ref;
+	float d2 = Math::Vec3Dot(w, w);
+	float cosl = -Math::Vec3Dot(n, w) / sqrtf(d2);
+
+	if (d2 == 0.0f || cosl <= 0.0f)
+		return 0.0f;
+
+	return d2 / (cosl * GetLightArea(light));
+}
+
+// --- CPUPathTracer impl -----------------------------------------------------
+
+CPUPathTracer::CPUPathTracer()
+{
+	workers			= nullptr;
+	threadpool		= nullptr;
+	camerafov		= Math::HALF_PI;
+	rayepsilon		= 1e-4f;
+
+	width			= 0;
+	height			= 0;
+	tilesx			= 0;
+	tilesy			= 0;
+	numworkers		= 0;
+	flags			= CPUPathTracerFlagNextEvent|CPUPathTracerFlagTwoSided;
+	maxdepth		= 15;
+	seed			= 0;
+	numsamples		= 0;
+	passsamples		= 0;
+	samplespersec	= 0;
+
+	numsteals		= 0;
+	numinvalid		= 0;
+
+	Math::MatrixIdentity(viewprojinv);
+}
+
+CPUPathTracer::~CPUPathTracer()
+{
+	delete[] workers;
+}
+
+bool CPUPathTracer::LoadScene(const char* qmfile, const char* infofile)
+{
+	PROFILE_SCOPE("CPUPathTracer::LoadScene");
+
+	SceneDescription scene;
+
+	if (!scene.LoadQM(qmfile) || !scene.LoadInfo(infofile))
+		return false;
+
+	std::string infodir(infofile);
+	size_t pos = infodir.find_last_of("/\\");
+
+	infodir = ((pos == std::string::npos) ? std::string() : infodir.substr(0, pos + 1));
+
+	vertices.swap(scene.vertices);
+	indices.swap(scene.indices);
+	lights.swap(scene.lights);
+	materials.swap(scene.materials);
+	texturenames.clear();
+
+	for (const std::string& name : scene.texturenames)
+		texturenames.push_back(infodir + name);
+
+	camerafov = scene.camera.fov;
+	cameraeye = scene.camera.eye;
+	cameraorient = scene.camera.orient;
+
+	InitScene(scene.subsets.data(), (uint32_t)scene.subsets.size(), scene.overrides.data(), (uint32_t)scene.overrides.size(), (uint32_t)texturenames.size());
+	return true;
+}
+
+bool CPUPathTracer::LoadScene(const ScenePackage& package)
+{
+	PROFILE_SCOPE("CPUPathTracer::LoadScene");
+
+	uint32_t numvertices = 0, numindices = 0, numsubsets = 0, numoverrides = 0;
+	uint32_t numlights = 0, nummaterials = 0, numcameras = 0, numinfos = 0, numlayers = 0;
+
+	const GeometryUtils::CommonVertex* vdata = package.GetSection<GeometryUtils::CommonVertex>(ScenePackageSectionVertices, &numvertices);
+	const uint32_t* idata = package.GetSection<uint32_t>(ScenePackageSectionIndices, &numindices);
+	const ScenePackageSubset* subsets = package.GetSection<ScenePackageSubset>(ScenePackageSectionSubsets, &numsubsets);
+	const uint32_t* overrides = package.GetSection<uint32_t>(ScenePackageSectionMaterialOverrides, &numoverrides);
+	const AreaLight* ldata = package.GetSection<AreaLight>(ScenePackageSectionLights, &numlights);
+	const BSDFInfo* mdata = package.GetSection<BSDFInfo>(ScenePackageSectionMaterials, &nummaterials);
+	const ScenePackageCamera* cam = package.GetSection<ScenePackageCamera>(ScenePackageSectionCamera, &numcameras);
+	const ScenePackageTextureArray* texinfo = package.GetSection<ScenePackageTextureArray>(ScenePackageSectionTextureInfo, &numinfos);
+	const uint8_t* texels = nullptr;
+
+	if (vdata == nullptr || idata == nullptr || subsets == nullptr || numvertices == 0 || numindices < 3)
+		return false;
+
+	for (uint32_t i = 0; i < numindices; ++i) {
+		if (idata[i] >= numvertices)
+			return false;
+	}
+
+	for (uint32_t i = 0; i < numsubsets; ++i) {
+		if (subsets[i].IndexStart + subsets[i].IndexCount > numindices)
+			return false;
+	}
+
+	vertices.assign(vdata, vdata + numvertices);
+	indices.assign(idata, idata + numindices);
+	lights.assign(ldata, ldata + numlights);
+	materials.assign(mdata, mdata + nummaterials);
+	texturenames.clear();
+
+	if (numcameras > 0) {
+		camerafov = cam->fov;
+		cameraeye = cam->eye;
+		cameraorient = cam->orient;
+	}
+
+	if (numinfos > 0)
+		texels = (const uint8_t*)package.GetSection(ScenePackageSectionTexels, &numlayers, texinfo->width * texinfo->height * 4);
+
+	if (texels == nullptr || numinfos == 0 || numlayers != texinfo->numlayers)
+		numlayers = 0;
+
+	// NOTE: textures of the package are already resized to the same size
+	texturenames.resize(numlayers);
+	InitScene(subsets, numsubsets, overrides, numoverrides, numlayers);
+
+	for (uint32_t i = 0; i < numlayers; ++i)
+		SetTexture(i, texinfo->width, texinfo->height, texels + (size_t)i * texinfo->width * texinfo->height * 4);
+
+	return true;
+}
+
+void CPUPathTracer::InitScene(const ScenePackageSubset* subsets, uint32_t numsubsets, const uint32_t* overrides, uint32_t numoverrides, uint32_t numtextures)
+{
+	uint32_t numtris = (uint32_t)(indices.size() / 3);
+
+	if (materials.empty()) {
+		BSDFInfo defaultmaterial;
+
+		defaultmaterial.color = Math::Color(1, 1, 1, 1);
+		defaultmaterial.textureID = 0xffffffff;
+		defaultmaterial.bsdftype = BSDFTypeDiffuse;
+		defaultmaterial.roughness = 0;
+		defaultmaterial.eta = 0;
+
+		materials.push_back(defaultmaterial);
+	}
+
+	trianglematerials.assign(numtris, 0);
+
+	for (uint32_t i = 0; i < numsubsets; ++i) {
+		uint32_t first = subsets[i].IndexStart / 3;
+		uint32_t last = Math::Min<uint32_t>((subsets[i].IndexStart + subsets[i].IndexCount) / 3, numtris);
+		uint32_t material = ((i < numoverrides) ? overrides[i] : 0);
+
+		if (material >= materials.size())
+			material = 0;
+
+		for (uint32_t j = first; j < last; ++j)
+			trianglematerials[j] = material;
+	}
+
+	textures.clear();
+	textures.resize(numtextures);
+
+	BuildBVH();
+	Reset();
+}
+
+void CPUPathTracer::BuildBVH()
+{
+	PROFILE_SCOPE("CPUPathTracer::BuildBVH");
+
+	uint32_t numtris = (uint32_t)(indices.size() / 3);
+
+	std::vector<uint32_t> order(numtris);
+	std::vector<Math::AABox> boxes(numtris);
+	std::vector<Math::Vector3> centers(numtris);
+	Math::AABox scenebox;
+
+	for (uint32_t i = 0; i < numtris; ++i) {
+		for (int j = 0; j < 3; ++j) {
+			const GeometryUtils::CommonVertex& vert = vertices[indices[i * 3 + j]];
+			boxes[i].Add(vert.x, vert.y, vert.z);
+		}
+
+		boxes[i].GetCenter(centers[i]);
+		scenebox.Add(boxes[i].Min);
+		scenebox.Add(boxes[i].Max);
+
+		order[i] = i;
+	}
+
+	nodes.clear();
+	triangles.resize(numtris);
+
+	if (numtris == 0)
+		return;
+
+	nodes.reserve(2 * numtris);
+	BuildNode(order, boxes, centers, 0, numtris, 0);
+
+	for (uint32_t i = 0; i < numtris; ++i) {
+		Triangle& tri = triangles[i];
+		const GeometryUtils::CommonVertex& v0 = vertices[indices[order[i] * 3 + 0]];
+		const GeometryUtils::CommonVertex& v1 = vertices[indices[order[i] * 3 + 1]];
+		const GeometryUtils::CommonVertex& v2 = vertices[indices[order[i] * 3 + 2]];
+
+		tri.v0 = Math::Vector3(v0.x, v0.y, v0.z);
+		tri.e1 = Math::Vector3(v1.x - v0.x, v1.y - v0.y, v1.z - v0.z);
+		tri.e2 = Math::Vector3(v2.x - v0.x, v2.y - v0.y, v2.z - v0.z);
+		tri.index = order[i];
+	}
+
+	// NOTE: relative to the scene extent (like MODEL_EPSILON for the Media scenes)
+	float extent = Math::Max(MaxComponent(Math::Vector3::Max(-scenebox.Min, scenebox.Max)), 0.0f);
+	rayepsilon = 1e-4f * (1.0f + extent);
+}
+
+uint32_t CPUPathTracer::BuildNode(std::vector<uint32_t>& order, std::vector<Math::AABox>& boxes, std::vector<Math::Vector3>& centers, uint32_t first, uint32_t last, uint32_t depth)
+{
+	Math::AABox bounds, centerbounds;
+	uint32_t nodeID = (uint32_t)nodes.size();
+	uint32_t count = last - first;
+
+	nodes.push_back(BVHNode());
+
+	for (uint32_t i = first; i < last; ++i) {
+		bounds.Add(boxes[order[i]].Min);
+		bounds.Add(boxes[order[i]].Max);
+		centerbounds.Add(centers[order[i]]);
+	}
+
+	nodes[nodeID].Min = bounds.Min;
+	nodes[nodeID].Max = bounds.Max;
+
+	// find the best binned SAH split along the longest axis of the centers
+	Math::Vector3 size = centerbounds.Max - centerbounds.Min;
+	uint32_t axis = ((size.x > size.y && size.x > size.z) ? 0 : (size.y > size.z ? 1 : 2));
+	uint32_t mid = first;
+
+	if (count > BVH_MAX_LEAF_SIZE && depth < BVH_MAX_DEPTH && size[axis] > 0.0f) {
+		Math::AABox binboxes[BVH_NUM_BINS];
+		uint32_t bincounts[BVH_NUM_BINS] = { 0 };
+		float leftareas[BVH_NUM_BINS];
+		float binscale = BVH_NUM_BINS / size[axis];
+		float bestcost = FLT_MAX;
+		uint32_t bestsplit = 0;
+
+		for (uint32_t i = first; i < last; ++i) {
+			uint32_t bin = Math::Min<uint32_t>((uint32_t)((centers[order[i]][axis] - centerbounds.Min[axis]) * binscale), BVH_NUM_BINS - 1);
+
+			binboxes[bin].Add(boxes[order[i]].Min);
+			binboxes[bin].Add(boxes[order[i]].Max);
+
+			++bincounts[bin];
+		}
+
+		Math::AABox sweep;
+
+		// NOTE: empty bins have inverted bounds
+		for (uint32_t i = 0; i < BVH_NUM_BINS - 1; ++i) {
+			if (bincounts[i] > 0) {
+				sweep.Add(binboxes[i].Min);
+				sweep.Add(binboxes[i].Max);
+			}
+
+			leftareas[i] = ((sweep.Min.x <= sweep.Max.x) ? SurfaceArea(sweep) : 0.0f);
+		}
+
+		sweep = Math::AABox();
+		uint32_t rightcount = 0;
+		uint32_t leftcount = count;
+
+		for (uint32_t i = BVH_NUM_BINS - 1; i > 0; --i) {
+			if (bincounts[i] > 0) {
+				sweep.Add(binboxes[i].Min);
+				sweep.Add(binboxes[i].Max);
+			}
+
+			rightcount += bincounts[i];
+			leftcount -= bincounts[i];
+
+			if (leftcount == 0 || rightcount == 0)
+				continue;
+
+			float cost = leftcount * leftareas[i - 1] + rightcount * SurfaceArea(sweep);
+
+			if (cost < bestcost) {
+				bestcost = cost;
+				bestsplit = i;
+			}
+		}
+
+		// NOTE: intersecting a triangle costs about as much as a box test
+		float leafcost = (float)count;
+		float splitcost = 1.0f + bestcost / SurfaceArea(bounds);
+
+		if (bestsplit > 0 && (count > 16 * BVH_MAX_LEAF_SIZE || splitcost < leafcost)) {
+			mid = (uint32_t)(std::partition(order.begin() + first, order.begin() + last, [&](uint32_t tri) {
+				uint32_t bin = Math::Min<uint32_t>((uint32_t)((centers[tri][axis] - centerbounds.Min[axis]) * binscale), BVH_NUM_BINS - 1);
+				return (bin < bestsplit);
+			}) - order.begin());
+		}
+	}
+
+	if (mid == first || mid == last) {
+		nodes[nodeID].LeftOrCount = count | 0x80000000;
+		nodes[nodeID].RightOrStart = first;
+
+		return nodeID;
+	}
+
+	BuildNode(order, boxes, centers, first, mid, depth + 1);
+	uint32_t right = BuildNode(order, boxes, centers, mid, last, depth + 1);
+
+	nodes[nodeID].LeftOrCount = nodeID + 1;
+	nodes[nodeID].RightOrStart = right | (axis << 30);
+
+	return nodeID;
+}
+
+float CPUPathTracer::IntersectLight(const AreaLight& light, const Math::Vector3& start, const Math::Vector3& dir) const
+{
+	if (light.shapetype == ShapeTypeSphere) {
+		Math::Vector3 center(light.toworld._41, light.toworld._42, light.toworld._43);
+		Math::Vector3 oc = start - center;
+		float radius = light.toworld._11;
+		float b = Math::Vec3Dot(oc, dir);
+		float c = Math::Vec3Dot(oc, oc) - radius * radius;
+		float disc = b * b - c;
+
+		if (disc < 0.0f)
+			return FLT_MAX;
+
+		disc = sqrtf(disc);
+
+		float t = -b - disc;
+
+		if (t <= 0.0f)
+			t = -b + disc;
+
+		return ((t > 0.0f) ? t : FLT_MAX);
+	}
+
+	Math::Vector3 ustart, udir;
+
+	Math::Vec3TransformCoord(ustart, start, light.tounit);
+	Math::Vec3TransformNormal(udir, dir, light.tounit);
+
+	if (udir.y == 0.0f)
+		return FLT_MAX;
+
+	float t = -ustart.y / udir.y;
+	float x = ustart.x + t * udir.x;
+	float z = ustart.z + t * udir.z;
+
+	if (t <= 0.0f || x < 0.0f || x > 1.0f || z < 0.0f || z > 1.0f)
+		return FLT_MAX;
+
+	return t;
+}
+
+bool CPUPathTracer::Intersect(Hit& hit, const Math::Vector3& start, const Math::Vector3& dir, float maxdist) const
+{
+	hit.distance = maxdist;
+	hit.light = -1;
+	hit.triangle = UINT32_MAX;
+
+	for (size_t i = 0; i < lights.size(); ++i) {
+		float t = IntersectLight(lights[i], start, dir);
+
+		if (t < hit.distance) {
+			hit.distance = t;
+			hit.light = (int32_t)i;
+		}
+	}
+
+	if (nodes.empty())
+		return (hit.light >= 0);
+
+	Math::Vector3 invdir(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+	uint32_t stack[BVH_STACK_SIZE];
+	uint32_t nodeID = 0;
+	uint32_t top = 0;
+	bool dirisneg[3] = { (invdir.x < 0.0f), (invdir.y < 0.0f), (invdir.z < 0.0f) };
+
+	for (;;) {
+		const BVHNode& node = nodes[nodeID];
+
+		if (RayIntersectBox(node.Min, node.Max, start, invdir, hit.distance)) {
+			if (node.LeftOrCount & 0x80000000) {
+				uint32_t count = (node.LeftOrCount & 0x7fffffff);
+
+				for (uint32_t i = node.RightOrStart; i < node.RightOrStart + count; ++i) {
+					const Triangle& tri = triangles[i];
+					float b1 = 0, b2 = 0;
+					float t = RayIntersectTriangle(b1, b2, tri.v0, tri.e1, tri.e2, start, dir);
+
+					if (t < hit.distance) {
+						hit.distance = t;
+						hit.triangle = i;
+						hit.light = -1;
+						hit.u = b1;
+						hit.v = b2;
+					}
+				}
+			} else {
+				uint32_t left = node.LeftOrCount;
+				uint32_t right = (node.RightOrStart & 0x3fffffff);
+
+				// visit the near child first
+				if (dirisneg[node.RightOrStart >> 30]) {
+					stack[top++] = left;
+					nodeID = right;
+				} else {
+					stack[top++] = right;
+					nodeID = left;
+				}
+
+				continue;
+			}
+		}
+
+		if (top == 0)
+			break;
+
+		nodeID = stack[--top];
+	}
+
+	return (hit.light >= 0 || hit.triangle != UINT32_MAX);
+}
+
+bool CPUPathTracer::TraceClosest(Hit& hit, Math::Vector3 start, const Math::Vector3& dir, Random& rng) const
+{
+	// NOTE: transparent surfaces are hit with probability alpha (the shaders do the same)
+	for (uint32_t i = 0; i < MAX_PASSTHROUGHS; ++i) {
+		if (!Intersect(hit, start, dir, FLT_MAX))
+			return false;
+
+		if (hit.light >= 0) {
+			const AreaLight& light = lights[hit.light];
+
+			hit.position = start + dir * hit.distance;
+
+			if (light.shapetype == ShapeTypeSphere) {
+				Math::Vector3 center(light.toworld._41, light.toworld._42, light.toworld._43);
+				hit.geomnormal = Normalize(hit.position - center);
+			} else {
+				Math::Vector3 o, t, b;
+				GetPlateFrame(light, o, t, b);
+
+				hit.geomnormal = Normalize(Cross(b, t));
+			}
+
+			hit.normal = hit.geomnormal;
+			return true;
+		}
+
+		GetSurface(hit, hit.triangle, hit.u, hit.v);
+
+		const BSDFInfo& info = materials[hit.materialID];
+
+		if (GetBaseType(info) != BSDFTypeTransparent || rng.Next() < info.color.a)
+			return true;
+
+		start = OffsetRayOrigin(hit.position, hit.geomnormal, dir);
+	}
+
+	return false;
+}
+
+float CPUPathTracer::Transmittance(const Math::Vector3& from, const Math::Vector3& to, int32_t targetlight) const
+{
+	Math::Vector3 dir = to - from;
+	float maxdist = sqrtf(Math::Vec3Dot(dir, dir));
+
+	if (maxdist == 0.0f)
+		return 1.0f;
+
+	dir = dir * (1.0f / maxdist);
+
+	for (size_t i = 0; i < lights.size(); ++i) {
+		if ((int32_t)i != targetlight && IntersectLight(lights[i], from, dir) < maxdist)
+			return 0.0f;
+	}
+
+	if (nodes.empty())
+		return 1.0f;
+
+	Math::Vector3 invdir(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+	uint32_t stack[BVH_STACK_SIZE];
+	uint32_t nodeID = 0;
+	uint32_t top = 0;
+	float transmittance = 1.0f;
+
+	for (;;) {
+		const BVHNode& node = nodes[nodeID];
+
+		if (RayIntersectBox(node.Min, node.Max, from, invdir, maxdist)) {
+			if (node.LeftOrCount & 0x80000000) {
+				uint32_t count = (node.LeftOrCount & 0x7fffffff);
+
+				for (uint32_t i = node.RightOrStart; i < node.RightOrStart + count; ++i) {
+					const Triangle& tri = triangles[i];
+					float b1, b2;
+
+					if (RayIntersectTriangle(b1, b2, tri.v0, tri.e1, tri.e2, from, dir) >= maxdist)
+						continue;
+
+					const BSDFInfo& info = materials[trianglematerials[tri.index]];
+
+					if (GetBaseType(info) != BSDFTypeTransparent)
+						return 0.0f;
+
+					transmittance *= (1.0f - info.color.a);
+
+					if (transmittance == 0.0f)
+						return 0.0f;
+				}
+			} else {
+				stack[top++] = (node.RightOrStart & 0x3fffffff);
+				nodeID = node.LeftOrCount;
+
+				continue;
+			}
+		}
+
+		if (top == 0)
+			break;
+
+		nodeID = stack[--top];
+	}
+
+	return transmittance;
+}
+
+void CPUPathTracer::GetSurface(Hit& hit, uint32_t triangle, float b1, float b2) const
+{
+	const Triangle& tri = triangles[triangle];
+	const GeometryUtils::CommonVertex& v0 = vertices[indices[tri.index * 3 + 0]];
+	const GeometryUtils::CommonVertex& v1 = vertices[indices[tri.index * 3 + 1]];
+	const GeometryUtils::CommonVertex& v2 = vertices[indices[tri.index * 3 + 2]];
+	float b0 = 1.0f - b1 - b2;
+
+	hit.position = tri.v0 + tri.e1 * b1 + tri.e2 * b2;
+	hit.geomnormal = Normalize(Cross(tri.e1, tri.e2));
+
+	hit.normal = Math::Vector3(
+		b0 * v0.nx + b1 * v1.nx + b2 * v2.nx,
+		b0 * v0.ny + b1 * v1.ny + b2 * v2.ny,
+		b0 * v0.nz + b1 * v1.nz + b2 * v2.nz);
+
+	if (Math::Vec3Dot(hit.normal, hit.normal) < 1e-12f)
+		hit.normal = hit.geomnormal;
+	else
+		hit.normal = Normalize(hit.normal);
+
+	hit.u = b0 * v0.u + b1 * v1.u + b2 * v2.u;
+	hit.v = b0 * v0.v + b1 * v1.v + b2 * v2.v;
+	hit.materialID = trianglematerials[tri.index];
+}
+
+void CPUPathTracer::GetAlbedo(Math::Vector3& out, const BSDFInfo& info, float u, float v) const
+{
+	if (info.textureID >= textures.size() || textures[info.textureID].texels.empty()) {
+		out = Math::Vector3(info.color.r, info.color.g, info.color.b);
+		return;
+	}
+
+	// NOTE: bilinear with wrapping (no mipmaps)
+	const Texture& tex = textures[info.textureID];
+
+	float x = u * tex.width - 0.5f;
+	float y = v * tex.height - 0.5f;
+	float fx = floorf(x);
+	float fy = floorf(y);
+	float sx = x - fx;
+	float sy = y - fy;
+
+	int32_t x0 = (int32_t)fx % (int32_t)tex.width;
+	int32_t y0 = (int32_t)fy % (int32_t)tex.height;
+
+	x0 = (x0 < 0 ? x0 + tex.width : x0);
+	y0 = (y0 < 0 ? y0 + tex.height : y0);
+
+	int32_t x1 = (x0 + 1) % tex.width;
+	int32_t y1 = (y0 + 1) % tex.height;
+
+	const Math::Vector3& c00 = tex.texels[y0 * tex.width + x0];
+	const Math::Vector3& c10 = tex.texels[y0 * tex.width + x1];
+	const Math::Vector3& c01 = tex.texels[y1 * tex.width + x0];
+	const Math::Vector3& c11 = tex.texels[y1 * tex.width + x1];
+
+	out = (c00 * (1.0f - sx) + c10 * sx) * (1.0f - sy) + (c01 * (1.0f - sx) + c11 * sx) * sy;
+}
+
+Math::Vector3 CPUPathTracer::OffsetRayOrigin(const Math::Vector3& p, const Math::Vector3& n, const Math::Vector3& dir) const
+{
+	return ((Math::Vec3Dot(dir, n) > 0.0f) ? p + n * rayepsilon : p - n * rayepsilon);
+}
+
+Math::Vector3 CPUPathTracer::SampleLightsExplicit(const Hit& hit, const BSDFInfo& info, const Math::Vector3& albedo, const Math::Vector3& wo, Random& rng) const
+{
+	ShadingFrame frame(hit.normal);
+	Math::Vector3 localwo = frame.ToLocal(wo);
+	Math::Vector3 radiance(0, 0, 0);
+	bool twosided = ((flags & CPUPathTracerFlagTwoSided) == CPUPathTracerFlagTwoSided);
+
+	for (size_t i = 0; i < lights.size(); ++i) {
+		const AreaLight& light = lights[i];
+		Math::Vector3 lp, ln;
+		float lightpdf;
+		float u1 = rng.Next();
+		float u2 = rng.Next();
+
+		if (!SampleLightDirect(lp, ln, lightpdf, light, hit.position, u1, u2))
+			continue;
+
+		Math::Vector3 wi = Normalize(lp - hit.position);
+		Math::Vector3 le = GetEmitted(light, ln, -wi);
+
+		if (IsBlack(le))
+			continue;
+
+		Math::Vector3 localwi = frame.ToLocal(wi);
+		Math::Vector3 f = EvaluateBSDF(info, albedo, localwo, localwi, twosided, TransportModeRadiance);
+
+		if (IsBlack(f))
+			continue;
+
+		float visibility = Transmittance(OffsetRayOrigin(hit.position, hit.geomnormal, wi), OffsetRayOrigin(lp, ln, -wi), (int32_t)i);
+
+		if (visibility == 0.0f)
+			continue;
+
+		float bsdfpdf = PDFBSDF(info, localwo, localwi, twosided);
+		float weight = PowerHeuristic(lightpdf, bsdfpdf);
+
+		radiance += f * le * (fabsf(localwi.z) * visibility * weight / lightpdf);
+	}
+
+	return radiance;
+}
+
+Math::Vector3 CPUPathTracer::TraceUnidirectional(const Math::Vector3& primary, Random& rng) const
+{
+	Hit hit;
+	Math::Vector3 radiance(0, 0, 0);
+	Math::Vector3 throughput(1, 1, 1);
+	Math::Vector3 start = eye;
+	Math::Vector3 dir = primary;
+	Math::Vector3 prevpos = eye;
+	float prevpdf = 0.0f;
+	bool prevdelta = true;	// the pinhole camera
+	bool nextevent = ((flags & CPUPathTracerFlagNextEvent) == CPUPathTracerFlagNextEvent);
+	bool twosided = ((flags & CPUPathTracerFlagTwoSided) == CPUPathTracerFlagTwoSided);
+
+	for (uint32_t depth = 0;; ++depth) {
+		if (!TraceClosest(hit, start, dir, rng))
+			break;
+
+		if (hit.light >= 0) {
+			const AreaLight& light = lights[hit.light];
+			Math::Vector3 le = GetEmitted(light, hit.geomnormal, -dir);
+
+			if (nextevent && !prevdelta)
+				le = le * PowerHeuristic(prevpdf, PDFLightDirect(light, prevpos, hit.position, hit.geomnormal));
+
+			radiance += throughput * le;
+			break;
+		}
+
+		if (depth == maxdepth)
+			break;
+
+		const BSDFInfo& info = materials[hit.materialID];
+		ShadingFrame frame(hit.normal);
+		Math::Vector3 albedo;
+		BSDFSample sample;
+
+		GetAlbedo(albedo, info, hit.u, hit.v);
+
+		if (nextevent && !IsDeltaOnly(info))
+			radiance += throughput * SampleLightsExplicit(hit, info, albedo, -dir, rng);
+
+		float u1 = rng.Next();
+		float u2 = rng.Next();
+		float u3 = rng.Next();
+
+		if (!SampleBSDF(sample, info, albedo, frame.ToLocal(-dir), u1, u2, u3, twosided, TransportModeRadiance))
+			break;
+
+		dir = Normalize(frame.ToWorld(sample.wi));
+		throughput = throughput * sample.value * (fabsf(sample.wi.z) / sample.pdf);
+
+		prevpos = hit.position;
+		prevpdf = sample.pdf;
+		prevdelta = sample.isdelta;
+
+		start = OffsetRayOrigin(hit.position, hit.geomnormal, dir);
+
+		if (depth + 1 >= RR_START_DEPTH) {
+			float q = Math::Min(1.0f, MaxComponent(throughput));
+
+			if (rng.Next() >= q)
+				break;
+
+			throughput = throughput / q;
+		}
+	}
+
+	return radiance;
+}
+
+// --- Bidirectional impl -----------------------------------------------------
+
+// NOTE: Veach's BDPT as in pbrt-v3: the vertices store area densities in both directions
+// and the MIS weight (power heuristic) is computed from their ratios. Only strategies with
+// at least two camera vertices are evaluated (there is no splatting), the weights account
+// for that, so the estimate is unbiased.
+
+static inline float ConvertDensity(float pdf, const Math::Vector3& from, const Math::Vector3& to, const Math::Vector3& tonormal, bool tocamera)
+{
+	Math::Vector3 w = to - from;
+	float dist2 = Math::Vec3Dot(w, w);
+
+	if (dist2 == 0.0f)
+		return 0.0f;
+
+	float invdist2 = 1.0f / dist2;
+
+	if (!tocamera)
+		pdf *= fabsf(Math::Vec3Dot(tonormal, w)) * sqrtf(invdist2);
+
+	return pdf * invdist2;
+}
+
+static inline float CorrectShadingNormal(const Math::Vector3& ns, const Math::Vector3& ng, const Math::Vector3& wo, const Math::Vector3& wi, uint32_t mode)
+{
+	// NOTE: adjoint BSDF with shading normals (Veach 1997, 5.3)
+	if (mode == TransportModeRadiance)
+		return 1.0f;
+
+	float num = fabsf(Math::Vec3Dot(wo, ns) * Math::Vec3Dot(wi, ng));
+	float denom = fabsf(Math::Vec3Dot(wo, ng) * Math::Vec3Dot(wi, ns));
+
+	return ((denom == 0.0f) ? 0.0f : num / denom);
+}
+
+static inline float RemapZero(float f)
+{
+	return ((f != 0.0f) ? f : 1.0f);
+}
+
+uint32_t CPUPathTracer::RandomWalk(PathVertex* path, Math::Vector3 dir, Math::Vector3 beta, float pdf, uint32_t maxvertices, uint32_t mode, Random& rng) const
+{
+	// NOTE: path[-1] is the start vertex
+	if (maxvertices == 0)
+		return 0;
+
+	Hit hit;
+	Math::Vector3 start;
+	uint32_t numvertices = 0;
+	float forwardPDF = pdf;
+	float reversePDF = 0.0f;
+	bool twosided = ((flags & CPUPathTracerFlagTwoSided) == CPUPathTracerFlagTwoSided);
+
+	if (path[-1].type == PathVertexTypeCamera)
+		start = path[-1].position;
+	else
+		start = OffsetRayOrigin(path[-1].position, path[-1].geomnormal, dir);
+
+	for (;;) {
+		if (!TraceClosest(hit, start, dir, rng))
+			break;
+
+		PathVertex& vertex = path[numvertices];
+		PathVertex& prev = path[(int32_t)numvertices - 1];
+
+		if (hit.light >= 0 && mode == TransportModeImportance)
+			break;
+
+		vertex.position		= hit.position;
+		vertex.geomnormal	= hit.geomnormal;
+		vertex.normal		= hit.normal;
+		vertex.outdir		= -dir;
+		vertex.beta			= beta;
+		vertex.forwardPDF	= ConvertDensity(forwardPDF, prev.position, vertex.position, vertex.geomnormal, false);
+		vertex.reversePDF	= 0.0f;
+		vertex.isdelta		= false;
+
+		++numvertices;
+
+		if (hit.light >= 0) {
+			vertex.type = PathVertexTypeLight;
+			vertex.index = (uint32_t)hit.light;
+
+			break;
+		}
+
+		const BSDFInfo& info = materials[hit.materialID];
+		ShadingFrame frame(vertex.normal);
+		BSDFSample sample;
+
+		vertex.type = PathVertexTypeSurface;
+		vertex.index = hit.materialID;
+
+		GetAlbedo(vertex.albedo, info, hit.u, hit.v);
+
+		if (numvertices >= maxvertices)
+			break;
+
+		Math::Vector3 localwo = frame.ToLocal(vertex.outdir);
+		float u1 = rng.Next();
+		float u2 = rng.Next();
+		float u3 = rng.Next();
+
+		if (!SampleBSDF(sample, info, vertex.albedo, localwo, u1, u2, u3, twosided, mode))
+			break;
+
+		dir = Normalize(frame.ToWorld(sample.wi));
+		beta = beta * sample.value * (fabsf(sample.wi.z) / sample.pdf) * CorrectShadingNormal(vertex.normal, vertex.geomnormal, vertex.outdir, dir, mode);
+
+		if (sample.isdelta) {
+			vertex.isdelta = true;
+			forwardPDF = reversePDF = 0.0f;
+		} else {
+			forwardPDF = sample.pdf;
+			reversePDF = PDFBSDF(info, sample.wi, localwo, twosided);
+		}
+
+		prev.reversePDF = ConvertDensity(reversePDF, vertex.position, prev.position, prev.geomnormal, (prev.type == PathVertexTypeCamera));
+		start = OffsetRayOrigin(vertex.position, vertex.geomnormal, dir);
+	}
+
+	return numvertices;
+}
+
+Math::Vector3 CPUPathTracer::EvaluateVertex(const PathVertex& curr, const PathVertex& next, uint32_t mode) const
+{
+	Math::Vector3 wi = Normalize(next.position - curr.position);
+	ShadingFrame frame(curr.normal);
+	bool twosided = ((flags & CPUPathTracerFlagTwoSided) == CPUPathTracerFlagTwoSided);
+
+	Math::Vector3 f = EvaluateBSDF(materials[curr.index], curr.albedo, frame.ToLocal(curr.outdir), frame.ToLocal(wi), twosided, mode);
+	return f * CorrectShadingNormal(curr.normal, curr.geomnormal, curr.outdir, wi, mode);
+}
+
+float CPUPathTracer::PDFLight(const PathVertex& light, const PathVertex& next) const
+{
+	// NOTE: lights emit with a cosine distribution
+	Math::Vector3 w = next.position - light.position;
+	float dist2 = Math::Vec3Dot(w, w);
+
+	if (dist2 == 0.0f)
+		return 0.0f;
+
+	w = w * (1.0f / sqrtf(dist2));
+
+	float pdf = Math::Max(0.0f, Math::Vec3Dot(light.geomnormal, w)) * ONE_OVER_PI / dist2;
+
+	if (next.type != PathVertexTypeCamera)
+		pdf *= fabsf(Math::Vec3Dot(next.geomnormal, w));
+
+	return pdf;
+}
+
+float CPUPathTracer::PDFLightOrigin(const PathVertex& light) const
+{
+	return 1.0f / ((float)lights.size() * GetLightArea(lights[light.index]));
+}
+
+float CPUPathTracer::PDFVertex(const PathVertex& curr, const PathVertex* prev, const PathVertex& next) const
+{
+	if (curr.type == PathVertexTypeLight)
+		return PDFLight(curr, next);
+
+	if (curr.type != PathVertexTypeSurface || prev == nullptr)
+		return 0.0f;
+
+	ShadingFrame frame(curr.normal);
+	Math::Vector3 wp = Normalize(prev->position - curr.position);
+	Math::Vector3 wn = Normalize(next.position - curr.position);
+	bool twosided = ((flags & CPUPathTracerFlagTwoSided) == CPUPathTracerFlagTwoSided);
+
+	float pdf = PDFBSDF(materials[curr.index], frame.ToLocal(wp), frame.ToLocal(wn), twosided);
+	return ConvertDensity(pdf, curr.position, next.position, next.geomnormal, (next.type == PathVertexTypeCamera));
+}
+
+float CPUPathTracer::MISWeight(PathVertex* lightpath, PathVertex* camerapath, PathVertex& sampled, uint32_t s, uint32_t t) const
+{
+	PathVertex* qs		= (s > 0 ? &lightpath[s - 1] : nullptr);
+	PathVertex* pt		= &camerapath[t - 1];
+	PathVertex* qsminus	= (s > 1 ? &lightpath[s - 2] : nullptr);
+	PathVertex* ptminus	= &camerapath[t - 2];
+	PathVertex savedqs;
+
+	// temporarily change the subpaths as if they were sampled with this strategy
+	if (s == 1) {
+		savedqs = *qs;
+		*qs = sampled;
+	}
+
+	bool ptdelta = pt->isdelta;
+	bool qsdelta = (qs ? qs->isdelta : false);
+	float ptrev = pt->reversePDF;
+	float ptminusrev = ptminus->reversePDF;
+	float qsrev = (qs ? qs->reversePDF : 0.0f);
+	float qsminusrev = (qsminus ? qsminus->reversePDF : 0.0f);
+
+	pt->isdelta = false;
+
+	if (qs)
+		qs->isdelta = false;
+
+	pt->reversePDF = (s > 0 ? PDFVertex(*qs, qsminus, *pt) : PDFLightOrigin(*pt));
+	ptminus->reversePDF = (s > 0 ? PDFVertex(*pt, qs, *ptminus) : PDFLight(*pt, *ptminus));
+
+	if (qs)
+		qs->reversePDF = PDFVertex(*pt, ptminus, *qs);
+
+	if (qsminus)
+		qsminus->reversePDF = PDFVertex(*qs, pt, *qsminus);
+
+	float sum = 0.0f;
+	float ri = 1.0f;
+
+	for (uint32_t i = t - 1; i > 1; --i) {
+		float r = RemapZero(camerapath[i].reversePDF) / RemapZero(camerapath[i].forwardPDF);
+		ri *= r * r;
+
+		if (!camerapath[i].isdelta && !camerapath[i - 1].isdelta)
+			sum += ri;
+	}
+
+	ri = 1.0f;
+
+	for (int32_t i = (int32_t)s - 1; i >= 0; --i) {
+		float r = RemapZero(lightpath[i].reversePDF) / RemapZero(lightpath[i].forwardPDF);
+		ri *= r * r;
+
+		bool prevdelta = (i > 0 ? lightpath[i - 1].isdelta : false);
+
+		if (!lightpath[i].isdelta && !prevdelta)
+			sum += ri;
+	}
+
+	pt->isdelta = ptdelta;
+	pt->reversePDF = ptrev;
+	ptminus->reversePDF = ptminusrev;
+
+	if (qs) {
+		qs->isdelta = qsdelta;
+		qs->reversePDF = qsrev;
+	}
+
+	if (qsminus)
+		qsminus->reversePDF = qsminusrev;
+
+	if (s == 1)
+		*qs = savedqs;
+
+	return 1.0f / (1.0f + sum);
+}
+
+Math::Vector3 CPUPathTracer::ConnectBDPT(PathVertex* lightpath, PathVertex* camerapath, uint32_t s, uint32_t t, Random& rng) const
+{
+	PathVertex& pt = camerapath[t - 1];
+	PathVertex sampled;
+	Math::Vector3 radiance(0, 0, 0);
+
+	if (s > 0 && pt.type == PathVertexTypeLight)
+		return radiance;
+
+	if (s == 0) {
+		// the camera subpath hit a light
+		if (pt.type == PathVertexTypeLight)
+			radiance = pt.beta * GetEmitted(lights[pt.index], pt.geomnormal, pt.outdir);
+	} else if (s == 1) {
+		// sample a new point on a light
+		if (IsDeltaOnly(materials[pt.index]))
+			return radiance;
+
+		uint32_t numlights = (uint32_t)lights.size();
+		uint32_t index = Math::Min<uint32_t>((uint32_t)(rng.Next() * numlights), numlights - 1);
+		const AreaLight& light = lights[index];
+		Math::Vector3 lp, ln;
+		float lightpdf;
+		float u1 = rng.Next();
+		float u2 = rng.Next();
+
+		if (!SampleLightDirect(lp, ln, lightpdf, light, pt.position, u1, u2))
+			return radiance;
+
+		Math::Vector3 wi = Normalize(lp - pt.position);
+
+		sampled.position	= lp;
+		sampled.geomnormal	= ln;
+		sampled.normal		= ln;
+		sampled.outdir		= Math::Vector3(0, 0, 0);
+		sampled.beta		= GetEmitted(light, ln, -wi) * ((float)numlights / lightpdf);
+		sampled.albedo		= Math::Vector3(0, 0, 0);
+		sampled.reversePDF	= 0.0f;
+		sampled.type		= PathVertexTypeLight;
+		sampled.index		= index;
+		sampled.isdelta		= false;
+		sampled.forwardPDF	= PDFLightOrigin(sampled);
+
+		radiance = pt.beta * EvaluateVertex(pt, sampled, TransportModeRadiance) * sampled.beta * fabsf(Math::Vec3Dot(wi, pt.normal));
+
+		if (!IsBlack(radiance))
+			radiance = radiance * Transmittance(OffsetRayOrigin(pt.position, pt.geomnormal, wi), OffsetRayOrigin(lp, ln, -wi), (int32_t)index);
+	} else {
+		// connect two surface vertices
+		const PathVertex& qs = lightpath[s - 1];
+
+		if (qs.type != PathVertexTypeSurface || IsDeltaOnly(materials[qs.index]) || IsDeltaOnly(materials[pt.index]))
+			return radiance;
+
+		radiance = qs.beta * EvaluateVertex(qs, pt, TransportModeImportance) * EvaluateVertex(pt, qs, TransportModeRadiance) * pt.beta;
+
+		if (!IsBlack(radiance)) {
+			Math::Vector3 w = pt.position - qs.position;
+			float dist2 = Math::Vec3Dot(w, w);
+
+			w = w * (1.0f / sqrtf(dist2));
+
+			float G = fabsf(Math::Vec3Dot(qs.normal, w)) * fabsf(Math::Vec3Dot(pt.normal, w)) / dist2;
+			radiance = radiance * (G * Transmittance(OffsetRayOrigin(qs.position, qs.geomnormal, w), OffsetRayOrigin(pt.position, pt.geomnormal, -w), -1));
+		}
+	}
+
+	if (IsBlack(radiance))
+		return radiance;
+
+	float weight = ((s + t == 2) ? 1.0f : MISWeight(lightpath, camerapath, sampled, s, t));
+	return radiance * weight;
+}
+
+Math::Vector3 CPUPathTracer::TraceBidirectional(const Math::Vector3& primary, Random& rng, WorkerData& data) const
+{
+	PathVertex* camerapath = data.camerapath.data();
+	PathVertex* lightpath = data.lightpath.data();
+	Math::Vector3 radiance(0, 0, 0);
+	uint32_t numlights = (uint32_t)lights.size();
+
+	// camera subpath (NOTE: the density of the pinhole is never used, as t = 1 is not a strategy)
+	PathVertex& camera = camerapath[0];
+
+	camera.position		= eye;
+	camera.geomnormal	= primary;
+	camera.normal		= primary;
+	camera.beta			= Math::Vector3(1, 1, 1);
+	camera.forwardPDF	= 1.0f;
+	camera.reversePDF	= 0.0f;
+	camera.type			= PathVertexTypeCamera;
+	camera.isdelta		= false;
+
+	uint32_t numcameravertices = RandomWalk(camerapath + 1, primary, Math::Vector3(1, 1, 1), 1.0f, maxdepth + 1, TransportModeRadiance, rng) + 1;
+	uint32_t numlightvertices = 0;
+
+	// light subpath
+	if (numlights > 0) {
+		uint32_t index = Math::Min<uint32_t>((uint32_t)(rng.Next() * numlights), numlights - 1);
+		const AreaLight& light = lights[index];
+		PathVertex& origin = lightpath[0];
+		Math::Vector3 lp, ln;
+		float u1 = rng.Next();
+		float u2 = rng.Next();
+		float u3 = rng.Next();
+		float u4 = rng.Next();
+
+		SampleLightArea(lp, ln, light, u1, u2);
+
+		origin.position		= lp;
+		origin.geomnormal	= ln;
+		origin.normal		= ln;
+		origin.type			= PathVertexTypeLight;
+		origin.index		= index;
+		origin.isdelta		= false;
+		origin.reversePDF	= 0.0f;
+		origin.forwardPDF	= PDFLightOrigin(origin);
+		origin.beta			= light.luminance * (1.0f / origin.forwardPDF);
+
+		Math::Vector3 localdir = SampleCosineHemisphere(u3, u4);
+		float dirpdf = localdir.z * ONE_OVER_PI;
+
+		numlightvertices = 1;
+
+		if (dirpdf > 0.0f) {
+			Math::Vector3 dir = ShadingFrame(ln).ToWorld(localdir);
+			Math::Vector3 beta = origin.beta * (localdir.z / dirpdf);
+
+			numlightvertices += RandomWalk(lightpath + 1, dir, beta, dirpdf, maxdepth, TransportModeImportance, rng);
+		}
+	}
+
+	for (uint32_t t = 2; t <= numcameravertices; ++t) {
+		for (uint32_t s = 0; s <= numlightvertices; ++s) {
+			if (s + t - 2 > maxdepth || (s == 1 && numlights == 0))
+				continue;
+
+			radiance += ConnectBDPT(lightpath, camerapath, s, t, rng);
+		}
+	}
+
+	return radiance;
+}
+
+// --- Scheduling impl --------------------------------------------------------
+
+bool CPUPathTracer::PopTile(uint32_t worker, uint32_t& tile)
+{
+	std::atomic<uint64_t>& range = workers[worker].tiles;
+	uint64_t current = range.load(std::memory_order_relaxed);
+
+	for (;;) {
+		uint32_t begin = (uint32_t)(current & 0xffffffff);
+		uint32_t end = (uint32_t)(current >> 32);
+
+		if (begin >= end)
+			return false;
+
+		uint64_t desired = ((uint64_t)end << 32) | (begin + 1);
+
+		if (range.compare_exchange_weak(current, desired, std::memory_order_acq_rel)) {
+			tile = begin;
+			return true;
+		}
+	}
+}
+
+bool CPUPathTracer::StealTile(uint32_t worker, uint32_t& tile)
+{
+	// NOTE: take the back half of the largest range, keep the first tile and publish the rest as our own
+	for (;;) {
+		uint32_t victim = UINT32_MAX;
+		uint32_t largest = 0;
+
+		for (uint32_t i = 0; i < numworkers; ++i) {
+			uint64_t current = workers[i].tiles.load(std::memory_order_relaxed);
+			uint32_t count = (uint32_t)(current >> 32) - Math::Min((uint32_t)(current >> 32), (uint32_t)(current & 0xffffffff));
+
+			if (i != worker && count > largest) {
+				largest = count;
+				victim = i;
+			}
+		}
+
+		if (victim == UINT32_MAX)
+			return false;
+
+		std::atomic<uint64_t>& range = workers[victim].tiles;
+		uint64_t current = range.load(std::memory_order_relaxed);
+		uint32_t begin = (uint32_t)(current & 0xffffffff);
+		uint32_t end = (uint32_t)(current >> 32);
+
+		if (begin >= end)
+			continue;
+
+		uint32_t middle = end - (end - begin + 1) / 2;
+		uint64_t desired = ((uint64_t)middle << 32) | begin;
+
+		if (!range.compare_exchange_strong(current, desired, std::memory_order_acq_rel))
+			continue;
+
+		tile = middle;
+		workers[worker].tiles.store(((uint64_t)end << 32) | (middle + 1), std::memory_order_release);
+
+		numsteals.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+}
+
+void CPUPathTracer::RunWorker(uint32_t worker)
+{
+	uint32_t tile;
+
+	while (PopTile(worker, tile) || StealTile(worker, tile))
+		RenderTile(tile, workers[worker]);
+}
+
+void CPUPathTracer::RenderTile(uint32_t tile, WorkerData& data)
+{
+	PROFILE_SCOPE("CPUPathTracer::RenderTile");
+
+	uint32_t startx = (tile % tilesx) * TILE_SIZE;
+	uint32_t starty = (tile / tilesx) * TILE_SIZE;
+	uint32_t endx = Math::Min(startx + TILE_SIZE, width);
+	uint32_t endy = Math::Min(starty + TILE_SIZE, height);
+	uint64_t invalid = 0;
+	bool bidirectional = ((flags & CPUPathTracerFlagBidirectional) == CPUPathTracerFlagBidirectional);
+	bool jitter = ((flags & CPUPathTracerFlagJitter) == CPUPathTracerFlagJitter);
+
+	for (uint32_t y = starty; y < endy; ++y) {
+		for (uint32_t x = startx; x < endx; ++x) {
+			uint32_t pixel = y * width + x;
+			double sum[3] = { 0, 0, 0 };
+
+			for (uint32_t i = 0; i < passsamples; ++i) {
+				// NOTE: the sequence only depends on the pixel and the sample index
+				Random rng(pixel, ((uint64_t)seed << 32) | (numsamples + i));
+				Math::Vector4 wpos;
+				float jx = (jitter ? rng.Next() : 0.0f);
+				float jy = (jitter ? rng.Next() : 0.0f);
+
+				// row 0 is the top of the image, but the bottom in NDC (like the shaders)
+				Math::Vector4 ndc(
+					((x + jx) / width) * 2.0f - 1.0f,
+					((height - 1 - y + jy) / height) * 2.0f - 1.0f,
+					0.1f, 1.0f);
+
+				Math::Vec4Transform(wpos, ndc, viewprojinv);
+
+				Math::Vector3 dir = Normalize(Math::Vector3(wpos.x / wpos.w, wpos.y / wpos.w, wpos.z / wpos.w) - eye);
+				Math::Vector3 radiance = (bidirectional ? TraceBidirectional(dir, rng, data) : TraceUnidirectional(dir, rng));
+
+				if (!IsFinite(radiance)) {
+					++invalid;
+					continue;
+				}
+
+				sum[0] += radiance.x;
+				sum[1] += radiance.y;
+				sum[2] += radiance.z;
+			}
+
+			accumulator[pixel * 3 + 0] += sum[0];
+			accumulator[pixel * 3 + 1] += sum[1];
+			accumulator[pixel * 3 + 2] += sum[2];
+		}
+	}
+
+	if (invalid > 0)
+		numinvalid.fetch_add(invalid, std::memory_order_relaxed);
+}
+
+void CPUPathTracer::RenderPass(uint32_t samplesperpixel)
+{
+	PROFILE_SCOPE("CPUPathTracer::RenderPass");
+
+	if (width == 0 || height == 0 || samplesperpixel == 0)
+		return;
+
+	uint32_t numthreads = (threadpool ? threadpool->GetNumThreads() : 1);
+	uint32_t numtiles = tilesx * tilesy;
+
+	if (numthreads != numworkers) {
+		delete[] workers;
+
+		workers = new WorkerData[numthreads];
+		numworkers = numthreads;
+	}
+
+	// NOTE: scratch is allocated here, not while rendering
+	for (uint32_t i = 0; i < numworkers; ++i) {
+		uint32_t first = (uint32_t)(((uint64_t)numtiles * i) / numworkers);
+		uint32_t last = (uint32_t)(((uint64_t)numtiles * (i + 1)) / numworkers);
+
+		workers[i].camerapath.resize(maxdepth + 3);
+		workers[i].lightpath.resize(maxdepth + 2);
+		workers[i].tiles.store(((uint64_t)last << 32) | first, std::memory_order_relaxed);
+	}
+
+	passsamples = samplesperpixel;
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	if (threadpool) {
+		threadpool->ParallelFor(numworkers, 1, [this](uint32_t begin, uint32_t end, uint32_t) {
+			for (uint32_t i = begin; i < end; ++i)
+				RunWorker(i);
+		});
+	} else {
+		RunWorker(0);
+	}
+
+	auto end = std::chrono::high_resolution_clock::now();
+	double elapsed = std::chrono::duration<double>(end - start).count();
+
+	numsamples += samplesperpixel;
+	samplespersec = ((elapsed > 0.0) ? ((double)width * height * samplesperpixel) / elapsed : 0.0);
+}
+
+void CPUPathTracer::Reset()
+{
+	accumulator.assign((size_t)width * height * 3, 0.0);
+	numsamples = 0;
+}
+
+bool CPUPathTracer::SetTexture(uint32_t index, uint32_t texwidth, uint32_t texheight, const uint8_t* rgba)
+{
+	if (index >= textures.size() || texwidth == 0 || texheight == 0 || !rgba)
+		return false;
+
+	Texture& tex = textures[index];
+	float tolinear[256];
+
+	for (int i = 0; i < 256; ++i)
+		tolinear[i] = Math::Color::sRGBToLinear((uint8_t)i, (uint8_t)i, (uint8_t)i).r;
+
+	tex.width = texwidth;
+	tex.height = texheight;
+	tex.texels.resize((size_t)texwidth * texheight);
+
+	for (size_t i = 0; i < tex.texels.size(); ++i)
+		tex.texels[i] = Math::Vector3(tolinear[rgba[i * 4 + 0]], tolinear[rgba[i * 4 + 1]], tolinear[rgba[i * 4 + 2]]);
+
+	Reset();
+	return true;
+}
+
+bool CPUPathTracer::WriteHDR(const char* file) const
+{
+	if (width == 0 || height == 0)
+		return false;
+
+	FILE* outfile = nullptr;
+	std::string ext;
+	float scale = ((numsamples > 0) ? 1.0f / numsamples : 0.0f);
+
+	Math::GetExtension(ext, file);
+
+#ifdef _MSC_VER
+	fopen_s(&outfile, file, "wb");
+#else
+	outfile = fopen(file, "wb");
+#endif
+
+	if (!outfile)
+		return false;
+
+	if (ext == "pfm") {
+		// NOTE: little endian, the first row is the bottom of the image
+		std::vector<float> row(width * 3);
+
+		fprintf(outfile, "PF\n%u %u\n-1.0\n", width, height);
+
+		for (uint32_t y = height; y-- > 0;) {
+			for (uint32_t i = 0; i < width * 3; ++i)
+				row[i] = (float)(accumulator[y * width * 3 + i] * scale);
+
+			fwrite(row.data(), sizeof(float), row.size(), outfile);
+		}
+	} else {
+		// Radiance RGBE (flat, without run length encoding)
+		std::vector<uint8_t> row(width * 4);
+
+		fprintf(outfile, "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y %u +X %u\n", height, width);
+
+		for (uint32_t y = 0; y < height; ++y) {
+			for (uint32_t x = 0; x < width; ++x) {
+				const double* rgb = &accumulator[(y * width + x) * 3];
+				float r = (float)(rgb[0] * scale);
+				float g = (float)(rgb[1] * scale);
+				float b = (float)(rgb[2] * scale);
+				float maxvalue = Math::Max(r, Math::Max(g, b));
+				uint8_t* rgbe = &row[x * 4];
+
+				if (maxvalue < 1e-32f) {
+					rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+				} else {
+					int exponent;
+					float mantissa = frexpf(maxvalue, &exponent) * 256.0f / maxvalue;
+
+					rgbe[0] = (uint8_t)(r * mantissa);
+					rgbe[1] = (uint8_t)(g * mantissa);
+					rgbe[2] = (uint8_t)(b * mantissa);
+					rgbe[3] = (uint8_t)(exponent + 128);
+				}
+			}
+
+			fwrite(row.data(), 1, row.size(), outfile);
+		}
+	}
+
+	fclose(outfile);
+	return true;
+}
+
+void CPUPathTracer::ConvertToWhiteFurnace()
+{
+	for (BSDFInfo& info : materials) {
+		info.color = Math::Color(1, 1, 1, 1);
+		info.textureID = 0xffffffff;
+		info.bsdftype = BSDFTypeDiffuse;
+	}
+
+	for (AreaLight& light : lights)
+		light.luminance = Math::Vector3(1, 1, 1);
+
+	Reset();
+}
+
+void CPUPathTracer::SetCamera(const Math::Matrix& view, const Math::Matrix& proj)
+{
+	Math::Matrix viewinv, viewproj;
+
+	Math::MatrixInverse(viewinv, view);
+	Math::MatrixMultiply(viewproj, view, proj);
+	Math::MatrixInverse(viewprojinv, viewproj);
+
+	eye = Math::Vector3(viewinv._41, viewinv._42, viewinv._43);
+	Reset();
+}
+
+void CPUPathTracer::SetResolution(uint32_t newwidth, uint32_t newheight)
+{
+	width = newwidth;
+	height = newheight;
+	tilesx = (width + TILE_SIZE - 1) / TILE_SIZE;
+	tilesy = (height + TILE_SIZE - 1) / TILE_SIZE;
+
+	Reset();
+}
+
+void CPUPathTracer::SetFlags(uint32_t newflags)
+{
+	flags = newflags;
+	Reset();
+}
+
+void CPUPathTracer::SetMaxDepth(uint32_t depth)
+{
+	maxdepth = Math::Max<uint32_t>(depth, 1);
+	Reset();
+}
+
+void CPUPathTracer::SetSeed(uint32_t value)
+{
+	seed = value;
+	Reset();
+}
+
+void CPUPathTracer::SetThreadPool(ThreadPool* pool)
+{
+	threadpool = pool;
+}
@@ -0,0 +1,147 @@
+
+#ifndef _CPUPATHTRACER_H_
+#define _CPUPATHTRACER_H_
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "3Dmath.h"
+#include "geometryutils.h"
+#include "scenepackage.h"
+
+class ThreadPool;
+
+enum CPUPathTracerFlag
+{
+	CPUPathTracerFlagNone = 0,
+	CPUPathTracerFlagBidirectional = 1,
+	CPUPathTracerFlagTwoSided = 2,		// diffuse, insulator and conductor surfaces reflect on both sides
+	CPUPathTracerFlagNextEvent = 4,		// explicit light sampling (unidirectional mode)
+	CPUPathTracerFlagJitter = 8			// random position in the pixel (otherwise the corner, like the shaders)
+};
+
+/**
+ * \brief Tiled, progressive CPU path tracer for the scenes of sample 57
+ *
+ * Ground truth for the GLSL path tracers: reads the same .qm + .info files (or
+ * scene package) and implements the same BSDF models (see the .cpp for the exact definitions). The
+ * unidirectional mode does next event estimation with MIS, the bidirectional mode
+ * combines every camera/light subpath connection except light tracing (t = 1) with
+ * the power heuristic. Each pass distributes the tiles between the threads of the
+ * pool, idle threads steal half of the remaining tiles of the busiest one. Every
+ * pixel sample has its own random sequence, so the image doesn't depend on the
+ * number of threads.
+ */
+class CPUPathTracer
+{
+	struct Triangle;
+	struct BVHNode;
+	struct Texture;
+	struct Hit;
+	struct PathVertex;
+	struct Random;
+	struct WorkerData;
+
+private:
+	std::vector<GeometryUtils::CommonVertex>	vertices;
+	std::vector<uint32_t>						indices;
+	std::vector<uint32_t>						trianglematerials;
+	std::vector<Triangle>						triangles;		// in BVH order
+	std::vector<BVHNode>						nodes;
+	std::vector<AreaLight>						lights;
+	std::vector<BSDFInfo>						materials;
+	std::vector<Texture>						textures;
+	std::vector<std::string>					texturenames;
+	std::vector<double>							accumulator;	// RGB sums
+
+	WorkerData*			workers;
+	ThreadPool*			threadpool;
+
+	Math::Matrix		viewprojinv;
+	Math::Vector3		eye;
+	Math::Vector3		cameraeye;		// from the .info file
+	Math::Vector3		cameraorient;	// yaw, pitch, roll
+	float				camerafov;
+	float				rayepsilon;
+
+	uint32_t			width;
+	uint32_t			height;
+	uint32_t			tilesx;
+	uint32_t			tilesy;
+	uint32_t			numworkers;
+	uint32_t			flags;
+	uint32_t			maxdepth;		// scattering events per path
+	uint32_t			seed;
+	uint32_t			numsamples;		// per pixel so far
+	uint32_t			passsamples;
+
+	std::atomic<uint64_t>	numsteals;
+	std::atomic<uint64_t>	numinvalid;	// NaN/inf samples (dropped)
+	double					samplespersec;
+
+	void InitScene(const ScenePackageSubset* subsets, uint32_t numsubsets, const uint32_t* overrides, uint32_t numoverrides, uint32_t numtextures);
+	void BuildBVH();
+	uint32_t BuildNode(std::vector<uint32_t>& order, std::vector<Math::AABox>& boxes, std::vector<Math::Vector3>& centers, uint32_t first, uint32_t last, uint32_t depth);
+
+	bool Intersect(Hit& hit, const Math::Vector3& start, const Math::Vector3& dir, float maxdist) const;
+	bool TraceClosest(Hit& hit, Math::Vector3 start, const Math::Vector3& dir, Random& rng) const;
+	float Transmittance(const Math::Vector3& from, const Math::Vector3& to, int32_t targetlight) const;
+	float IntersectLight(const AreaLight& light, const Math::Vector3& start, const Math::Vector3& dir) const;
+
+	void GetSurface(Hit& hit, uint32_t triangle, float b1, float b2) const;
+	void GetAlbedo(Math::Vector3& out, const BSDFInfo& info, float u, float v) const;
+	Math::Vector3 OffsetRayOrigin(const Math::Vector3& p, const Math::Vector3& n, const Math::Vector3& dir) const;
+
+	Math::Vector3 TraceUnidirectional(const Math::Vector3& dir, Random& rng) const;
+	Math::Vector3 SampleLightsExplicit(const Hit& hit, const BSDFInfo& info, const Math::Vector3& albedo, const Math::Vector3& wo, Random& rng) const;
+
+	Math::Vector3 TraceBidirectional(const Math::Vector3& dir, Random& rng, WorkerData& data) const;
+	uint32_t RandomWalk(PathVertex* path, Math::Vector3 dir, Math::Vector3 beta, float pdf, uint32_t maxvertices, uint32_t mode, Random& rng) const;
+	Math::Vector3 ConnectBDPT(PathVertex* lightpath, PathVertex* camerapath, uint32_t s, uint32_t t, Random& rng) const;
+	Math::Vector3 EvaluateVertex(const PathVertex& curr, const PathVertex& next, uint32_t mode) const;
+	float PDFVertex(const PathVertex& curr, const PathVertex* prev, const PathVertex& next) const;
+	float PDFLight(const PathVertex& light, const PathVertex& next) const;
+	float PDFLightOrigin(const PathVertex& light) const;
+	float MISWeight(PathVertex* lightpath, PathVertex* camerapath, PathVertex& sampled, uint32_t s, uint32_t t) const;
+
+	bool PopTile(uint32_t worker, uint32_t& tile);
+	bool StealTile(uint32_t worker, uint32_t& tile);
+	void RunWorker(uint32_t worker);
+	void RenderTile(uint32_t tile, WorkerData& data);
+
+public:
+	CPUPathTracer();
+	~CPUPathTracer();
+
+	bool LoadScene(const char* qmfile, const char* infofile);
+	bool LoadScene(const ScenePackage& package);	// including the textures
+	bool SetTexture(uint32_t index, uint32_t texwidth, uint32_t texheight, const uint8_t* rgba);	// sRGB, rows start at v = 0
+	bool WriteHDR(const char* file) const;		// Radiance .hdr or .pfm (by extension)
+
+	void ConvertToWhiteFurnace();
+	void RenderPass(uint32_t samplesperpixel = 1);
+	void Reset();
+
+	void SetCamera(const Math::Matrix& view, const Math::Matrix& proj);
+	void SetResolution(uint32_t newwidth, uint32_t newheight);
+	void SetFlags(uint32_t newflags);
+	void SetMaxDepth(uint32_t depth);
+	void SetSeed(uint32_t value);
+	void SetThreadPool(ThreadPool* pool);
+
+	inline const std::string& GetTextureName(uint32_t index) const	{ return texturenames[index]; }
+	inline const Math::Vector3& GetCameraEye() const					{ return cameraeye; }
+	inline const Math::Vector3& GetCameraOrientation() const			{ return cameraorient; }
+
+	inline float GetCameraFov() const					{ return camerafov; }
+	inline double GetSamplesPerSecond() const			{ return samplespersec; }	// last pass
+	inline uint32_t GetNumSamples() const				{ return numsamples; }
+	inline uint32_t GetNumTextures() const				{ return (uint32_t)texturenames.size(); }
+	inline uint32_t GetNumTriangles() const				{ return (uint32_t)(indices.size() / 3); }
+	inline uint32_t GetNumLights() const				{ return (uint32_t)lights.size(); }
+	inline uint64_t GetNumSteals() const				{ return numsteals.load(std::memory_order_relaxed); }
+	inline uint64_t GetNumInvalidSamples() const		{ return numinvalid.load(std::memory_order_relaxed); }
+};
+
+#endif
@@ -1,6 +1,7 @@
 
 #include "dds.h"
 #include "3Dmath.h"
+#include "profiler.h"
 
 #if defined(VULKAN)
 #	include "vk1ext.h"
@@ -531,6 +532,8 @@ uint32_t GetCompressedLevelSize(uint32_t width, uint32_t height, uint32_t depth,
 
 bool LoadFromDDS(const char* file, DDS_Image_Info* outinfo)
 {
+	PROFILE_SCOPE("LoadFromDDS");
+
 	DDS_HEADER	header;
 	FILE*		infile = 0;
 	DWORD		magic;
@@ -691,8 +694,24 @@ bool SaveToDDS(const char* file, const DDS_Image_Info* info)
 	DDS_HEADER	header;
 	FILE*		outfile		= 0;
 	DWORD		magic		= DDS_MAGIC;
+	DWORD		fourcc		= 0;
+	DWORD		bytes		= 0;
+
+	if (!info || !info->Data)
+		return false;
 
-	if (!info)
+	// NOTE: half float formats only (RGBA16F cubemap/2D or RG16F 2D)
+	if (info->Format == FORMAT_A16B16G16R16F) {
+		fourcc = 0x71;
+		bytes = 8;
+	} else if (info->Format == FORMAT_G16R16F) {
+		fourcc = 0x70;
+		bytes = 4;
+	} else {
+		return false;
+	}
+
+	if (info->Type == DDSImageTypeVolume)
 		return false;
 
 #ifdef _MSC_VER
@@ -706,29 +725,38 @@ bool SaveToDDS(const char* file, const DDS_Image_Info* info)
 
 	memset(&header, 0, sizeof(DDS_HEADER));
 
-	// NOTE: RGBA16F cubemap only
 	header.dwSize				= sizeof(DDS_HEADER);
-	header.dwHeaderFlags		= 0x2|0x4;
+	header.dwHeaderFlags		= DDSD_CAPS|DDSD_HEIGHT|DDSD_WIDTH|DDSD_PITCH|DDSD_PIXELFORMAT;
 	header.dwHeight				= info->Height;
 	header.dwWidth				= info->Width;
-	header.dwPitchOrLinearSize	= header.dwWidth * 8;
+	header.dwPitchOrLinearSize	= header.dwWidth * bytes;
 	header.dwDepth				= 0;
 	header.dwMipMapCount		= info->MipLevels;
 
 	header.ddspf.dwSize			= sizeof(DDS_PIXELFORMAT);
-	header.ddspf.dwFlags		= 0x4;
-	header.ddspf.dwFourCC		= 0x71;
-	header.ddspf.dwRGBBitCount	= 64;
+	header.ddspf.dwFlags		= DDPF_FOURCC;
+	header.ddspf.dwFourCC		= fourcc;
+	header.ddspf.dwRGBBitCount	= bytes * 8;
 	header.ddspf.dwRBitMask		= 0;
 	header.ddspf.dwGBitMask		= 0;
 	header.ddspf.dwBBitMask		= 0;
 	header.ddspf.dwABitMask		= 0;
 
-	header.dwCaps				= 0x00401008;
-	header.dwCaps2				= 0xfe00;
+	header.dwCaps				= DDSCAPS_TEXTURE;
+	header.dwCaps2				= 0;
 	header.dwCaps3				= 0;
 	header.dwReserved2			= 0;
 
+	if (info->MipLevels > 1) {
+		header.dwHeaderFlags |= DDSD_MIPMAPCOUNT;
+		header.dwCaps |= (DDSCAPS_COMPLEX|DDSCAPS_MIPMAP);
+	}
+
+	if (info->Type == DDSImageTypeCube) {
+		header.dwCaps |= DDSCAPS_COMPLEX;
+		header.dwCaps2 = 0xfe00;	// all faces
+	}
+
 	fwrite(&magic, sizeof(DWORD), 1, outfile);
 	fwrite(&header, sizeof(DDS_HEADER), 1, outfile);
 	fwrite((char*)info->Data, 1, info->DataSize, outfile);
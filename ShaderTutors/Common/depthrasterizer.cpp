@@ -0,0 +1,544 @@
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <emmintrin.h>
+
+#include "depthrasterizer.h"
+#include "threadpool.h"
+
+#define TILE_SIZE			32		// in pixels (multiple of 4)
+#define SUBPIXEL_SCALE		16.0f	// 28.4 fixed point
+#define GUARD_BAND			2.0f	// in NDC units
+#define VERTICES_PER_JOB	4096
+#define TRIANGLES_PER_JOB	2048
+#define BOXES_PER_JOB		256
+#define MAX_CLIP_VERTICES	8
+#define BOX_DEPTH_BIAS		1e-5f	// rasterized depth may round below the box's nearest corner
+
+static void RunJobs(ThreadPool* workers, uint32_t count, const ThreadPool::RangeCallback& callback)
+{
+	if (workers != nullptr)
+		workers->ParallelFor(count, 1, callback);
+	else
+		callback(0, count, 0);
+}
+
+static float ClipDistance(const Math::Vector4& v, int plane)
+{
+	switch (plane) {
+	case 0:		return v.z + v.w;					// near
+	case 1:		return GUARD_BAND * v.w - v.x;		// guard band
+	case 2:		return GUARD_BAND * v.w + v.x;
+	case 3:		return GUARD_BAND * v.w - v.y;
+	default:	return GUARD_BAND * v.w + v.y;
+	}
+}
+
+DepthRasterizer::DepthRasterizer(uint32_t width, uint32_t height)
+{
+	this->width		= width;
+	this->height	= height;
+
+	workers			= nullptr;
+	cullmode		= DepthCullModeBack;
+	numtilesx		= (width + TILE_SIZE - 1) / TILE_SIZE;
+	numtilesy		= (height + TILE_SIZE - 1) / TILE_SIZE;
+	numthreads		= 1;
+
+	// NOTE: padded to tiles, so that 4 pixel groups never leave the buffer
+	pitch = numtilesx * TILE_SIZE;
+	depthbuffer.resize(pitch * numtilesy * TILE_SIZE, 1.0f);
+
+	// hierarchical-Z (max depth)
+	uint32_t levelwidth = width;
+	uint32_t levelheight = height;
+
+	do {
+		levelwidth = std::max<uint32_t>(1, (levelwidth + 1) / 2);
+		levelheight = std::max<uint32_t>(1, (levelheight + 1) / 2);
+
+		hizlevels.push_back(HiZLevel());
+
+		hizlevels.back().width = levelwidth;
+		hizlevels.back().height = levelheight;
+		hizlevels.back().data.resize(levelwidth * levelheight, 1.0f);
+	} while (levelwidth > 1 || levelheight > 1);
+}
+
+void DepthRasterizer::Clear()
+{
+	draws.clear();
+	std::fill(depthbuffer.begin(), depthbuffer.end(), 1.0f);
+}
+
+void DepthRasterizer::AddMesh(const void* vertices, uint32_t numvertices, uint32_t stride, const void* indices, uint32_t numindices, bool index32, const Math::Matrix& worldviewproj)
+{
+	Draw draw;
+
+	draw.worldviewproj	= worldviewproj;
+	draw.vertices		= vertices;
+	draw.indices		= indices;
+	draw.numvertices	= numvertices;
+	draw.numindices		= numindices;
+	draw.stride			= stride;
+	draw.firstvertex	= (draws.empty() ? 0 : draws.back().firstvertex + draws.back().numvertices);
+	draw.index32		= index32;
+
+	draws.push_back(draw);
+}
+
+void DepthRasterizer::TransformVertices(uint32_t draw, uint32_t begin, uint32_t end)
+{
+	const Draw& data = draws[draw];
+	const Math::Matrix& m = data.worldviewproj;
+
+	for (uint32_t i = begin; i < end; ++i) {
+		const float* pos = (const float*)((const uint8_t*)data.vertices + i * data.stride);
+		Math::Vector4& out = clipvertices[data.firstvertex + i];
+
+		out.x = pos[0] * m._11 + pos[1] * m._21 + pos[2] * m._31 + m._41;
+		out.y = pos[0] * m._12 + pos[1] * m._22 + pos[2] * m._32 + m._42;
+		out.z = pos[0] * m._13 + pos[1] * m._23 + pos[2] * m._33 + m._43;
+		out.w = pos[0] * m._14 + pos[1] * m._24 + pos[2] * m._34 + m._44;
+	}
+}
+
+void DepthRasterizer::SetupTriangles(const Job& job, uint32_t thread)
+{
+	const Draw& data = draws[job.draw];
+	const Math::Vector4* vertices = &clipvertices[data.firstvertex];
+
+	for (uint32_t i = job.first; i < job.first + job.count; ++i) {
+		uint32_t i0, i1, i2;
+
+		if (data.index32) {
+			const uint32_t* indices = (const uint32_t*)data.indices + i * 3;
+
+			i0 = indices[0];
+			i1 = indices[1];
+			i2 = indices[2];
+		} else {
+			const uint16_t* indices = (const uint16_t*)data.indices + i * 3;
+
+			i0 = indices[0];
+			i1 = indices[1];
+			i2 = indices[2];
+		}
+
+		const Math::Vector4& v0 = vertices[i0];
+		const Math::Vector4& v1 = vertices[i1];
+		const Math::Vector4& v2 = vertices[i2];
+
+		// outside of frustum
+		if ((v0.x > v0.w && v1.x > v1.w && v2.x > v2.w) || (v0.x < -v0.w && v1.x < -v1.w && v2.x < -v2.w))
+			continue;
+
+		if ((v0.y > v0.w && v1.y > v1.w && v2.y > v2.w) || (v0.y < -v0.w && v1.y < -v1.w && v2.y < -v2.w))
+			continue;
+
+		if ((v0.z > v0.w && v1.z > v1.w && v2.z > v2.w) || (v0.z < -v0.w && v1.z < -v1.w && v2.z < -v2.w))
+			continue;
+
+		bool needsclip = false;
+
+		for (int j = 0; j < 5; ++j) {
+			if (ClipDistance(v0, j) < 0 || ClipDistance(v1, j) < 0 || ClipDistance(v2, j) < 0) {
+				needsclip = true;
+				break;
+			}
+		}
+
+		if (needsclip)
+			ClipTriangle(v0, v1, v2, thread);
+		else
+			SetupTriangle(v0, v1, v2, thread);
+	}
+}
+
+void DepthRasterizer::ClipTriangle(const Math::Vector4& v0, const Math::Vector4& v1, const Math::Vector4& v2, uint32_t thread)
+{
+	// Sutherland-Hodgman against the near plane and the guard band
+	Math::Vector4 buffers[2][MAX_CLIP_VERTICES + 2];
+	Math::Vector4* input = buffers[0];
+	Math::Vector4* output = buffers[1];
+	int count = 3;
+
+	input[0] = v0;
+	input[1] = v1;
+	input[2] = v2;
+
+	for (int plane = 0; plane < 5; ++plane) {
+		int outcount = 0;
+
+		for (int i = 0; i < count; ++i) {
+			const Math::Vector4& a = input[i];
+			const Math::Vector4& b = input[(i + 1) % count];
+
+			float da = ClipDistance(a, plane);
+			float db = ClipDistance(b, plane);
+
+			if (da >= 0)
+				output[outcount++] = a;
+
+			if ((da >= 0) != (db >= 0)) {
+				float t = da / (da - db);
+				Math::Vec4Lerp(output[outcount++], a, b, t);
+			}
+		}
+
+		std::swap(input, output);
+		count = outcount;
+
+		if (count < 3)
+			return;
+	}
+
+	for (int i = 1; i < count - 1; ++i)
+		SetupTriangle(input[0], input[i], input[i + 1], thread);
+}
+
+void DepthRasterizer::SetupTriangle(const Math::Vector4& v0, const Math::Vector4& v1, const Math::Vector4& v2, uint32_t thread)
+{
+	const Math::Vector4* vertices[3] = { &v0, &v1, &v2 };
+	Triangle tri;
+	float z[3];
+
+	for (int i = 0; i < 3; ++i) {
+		const Math::Vector4& v = *vertices[i];
+		float invw = 1.0f / v.w;
+
+		tri.x[i] = (int32_t)floorf((v.x * invw * 0.5f + 0.5f) * width * SUBPIXEL_SCALE + 0.5f);
+		tri.y[i] = (int32_t)floorf((v.y * invw * 0.5f + 0.5f) * height * SUBPIXEL_SCALE + 0.5f);
+
+		z[i] = v.z * invw * 0.5f + 0.5f;
+	}
+
+	int64_t area = (int64_t)(tri.x[1] - tri.x[0]) * (tri.y[2] - tri.y[0]) - (int64_t)(tri.y[1] - tri.y[0]) * (tri.x[2] - tri.x[0]);
+
+	if (area == 0)
+		return;
+
+	if ((cullmode == DepthCullModeBack && area < 0) || (cullmode == DepthCullModeFront && area > 0))
+		return;
+
+	if (area < 0) {
+		// make it counter-clockwise
+		std::swap(tri.x[1], tri.x[2]);
+		std::swap(tri.y[1], tri.y[2]);
+		std::swap(z[1], z[2]);
+
+		area = -area;
+	}
+
+	// pixel (x, y) is sampled at (16x + 8, 16y + 8)
+	int32_t minx = std::min(std::min(tri.x[0], tri.x[1]), tri.x[2]);
+	int32_t miny = std::min(std::min(tri.y[0], tri.y[1]), tri.y[2]);
+	int32_t maxx = std::max(std::max(tri.x[0], tri.x[1]), tri.x[2]);
+	int32_t maxy = std::max(std::max(tri.y[0], tri.y[1]), tri.y[2]);
+
+	tri.minx = std::max<int32_t>((minx - 8 + 15) >> 4, 0);
+	tri.miny = std::max<int32_t>((miny - 8 + 15) >> 4, 0);
+	tri.maxx = std::min<int32_t>((maxx - 8) >> 4, width - 1);
+	tri.maxy = std::min<int32_t>((maxy - 8) >> 4, height - 1);
+
+	if (tri.minx > tri.maxx || tri.miny > tri.maxy)
+		return;
+
+	// depth plane (in pixels)
+	float x10 = (tri.x[1] - tri.x[0]) / SUBPIXEL_SCALE;
+	float y10 = (tri.y[1] - tri.y[0]) / SUBPIXEL_SCALE;
+	float x20 = (tri.x[2] - tri.x[0]) / SUBPIXEL_SCALE;
+	float y20 = (tri.y[2] - tri.y[0]) / SUBPIXEL_SCALE;
+	float invarea = (SUBPIXEL_SCALE * SUBPIXEL_SCALE) / (float)area;
+
+	tri.dzdx = ((z[1] - z[0]) * y20 - (z[2] - z[0]) * y10) * invarea;
+	tri.dzdy = ((z[2] - z[0]) * x10 - (z[1] - z[0]) * x20) * invarea;
+	tri.z0 = z[0] + tri.dzdx * (0.5f - tri.x[0] / SUBPIXEL_SCALE) + tri.dzdy * (0.5f - tri.y[0] / SUBPIXEL_SCALE);
+
+	// bin it
+	TriangleList& list = triangles[thread];
+	uint32_t index = (uint32_t)list.size();
+	uint32_t numtiles = numtilesx * numtilesy;
+
+	list.push_back(tri);
+
+	for (int32_t i = tri.miny / TILE_SIZE; i <= tri.maxy / TILE_SIZE; ++i) {
+		for (int32_t j = tri.minx / TILE_SIZE; j <= tri.maxx / TILE_SIZE; ++j)
+			bins[thread * numtiles + i * numtilesx + j].push_back(index);
+	}
+}
+
+void DepthRasterizer::RasterizeTriangle(const Triangle& tri, int32_t tilex, int32_t tiley)
+{
+	// 4 pixel groups are aligned to 4 and stay within the tile
+	int32_t x0 = std::max(tri.minx, tilex) & ~3;
+	int32_t x1 = (std::min(tri.maxx, tilex + TILE_SIZE - 1) & ~3) + 3;
+	int32_t y0 = std::max(tri.miny, tiley);
+	int32_t y1 = std::min(tri.maxy, tiley + TILE_SIZE - 1);
+
+	__m128i rowvalues[3];
+	__m128i xsteps[3];
+	__m128i ysteps[3];
+
+	for (int i = 0; i < 3; ++i) {
+		int j = (i + 1) % 3;
+
+		int64_t a = tri.y[i] - tri.y[j];
+		int64_t b = tri.x[j] - tri.x[i];
+		int64_t c = (int64_t)tri.x[i] * tri.y[j] - (int64_t)tri.x[j] * tri.y[i];
+
+		// top-left rule: include top and left edges only
+		if (!(b < 0 ? true : (b == 0 && a > 0)))
+			c -= 1;
+
+		int64_t value = a * (x0 * 16 + 8) + b * (y0 * 16 + 8) + c;
+		int64_t dx = a * (x1 - x0) * 16;
+		int64_t dy = b * (y1 - y0) * 16;
+
+		int64_t minvalue = value + std::min<int64_t>(dx, 0) + std::min<int64_t>(dy, 0);
+		int64_t maxvalue = value + std::max<int64_t>(dx, 0) + std::max<int64_t>(dy, 0);
+
+		if (maxvalue < 0)
+			return;
+
+		if (minvalue >= 0) {
+			// whole rectangle is inside of this edge (and values might not fit into 32 bits)
+			rowvalues[i] = _mm_setzero_si128();
+			xsteps[i] = _mm_setzero_si128();
+			ysteps[i] = _mm_setzero_si128();
+		} else {
+			int32_t a16 = (int32_t)(a * 16);
+
+			rowvalues[i] = _mm_add_epi32(_mm_set1_epi32((int32_t)value), _mm_setr_epi32(0, a16, a16 * 2, a16 * 3));
+			xsteps[i] = _mm_set1_epi32(a16 * 4);
+			ysteps[i] = _mm_set1_epi32((int32_t)(b * 16));
+		}
+	}
+
+	__m128 dzdx = _mm_set1_ps(tri.dzdx);
+	__m128 offsets = _mm_setr_ps(0, 1, 2, 3);
+
+	for (int32_t y = y0; y <= y1; ++y) {
+		float* row = &depthbuffer[y * pitch];
+
+		__m128i w0 = rowvalues[0];
+		__m128i w1 = rowvalues[1];
+		__m128i w2 = rowvalues[2];
+		__m128 zrow = _mm_set1_ps(tri.z0 + tri.dzdy * y);
+
+		for (int32_t x = x0; x <= x1; x += 4) {
+			// inside if none of them is negative
+			__m128i signs = _mm_or_si128(_mm_or_si128(w0, w1), w2);
+			__m128 inside = _mm_castsi128_ps(_mm_cmpgt_epi32(signs, _mm_set1_epi32(-1)));
+
+			if (_mm_movemask_ps(inside) != 0) {
+				__m128 z = _mm_add_ps(zrow, _mm_mul_ps(dzdx, _mm_add_ps(_mm_set1_ps((float)x), offsets)));
+				__m128 depth = _mm_loadu_ps(row + x);
+				__m128 closer = _mm_and_ps(inside, _mm_cmplt_ps(z, depth));
+
+				_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(closer, z), _mm_andnot_ps(closer, depth)));
+			}
+
+			w0 = _mm_add_epi32(w0, xsteps[0]);
+			w1 = _mm_add_epi32(w1, xsteps[1]);
+			w2 = _mm_add_epi32(w2, xsteps[2]);
+		}
+
+		rowvalues[0] = _mm_add_epi32(rowvalues[0], ysteps[0]);
+		rowvalues[1] = _mm_add_epi32(rowvalues[1], ysteps[1]);
+		rowvalues[2] = _mm_add_epi32(rowvalues[2], ysteps[2]);
+	}
+}
+
+void DepthRasterizer::RasterizeTile(uint32_t tile)
+{
+	uint32_t numtiles = numtilesx * numtilesy;
+	int32_t tilex = (tile % numtilesx) * TILE_SIZE;
+	int32_t tiley = (tile / numtilesx) * TILE_SIZE;
+
+	// NOTE: submission order is kept (doesn't matter for depth anyway)
+	for (uint32_t i = 0; i < numthreads; ++i) {
+		const IndexList& bin = bins[i * numtiles + tile];
+		const TriangleList& list = triangles[i];
+
+		for (size_t j = 0; j < bin.size(); ++j)
+			RasterizeTriangle(list[bin[j]], tilex, tiley);
+	}
+}
+
+void DepthRasterizer::BuildHiZ()
+{
+	auto downsample = [&](const float* src, uint32_t srcpitch, uint32_t srcwidth, uint32_t srcheight, HiZLevel& dst, uint32_t begin, uint32_t end) {
+		for (uint32_t i = begin; i < end; ++i) {
+			const float* row0 = src + (i * 2) * srcpitch;
+			const float* row1 = src + std::min(i * 2 + 1, srcheight - 1) * srcpitch;
+			float* out = &dst.data[i * dst.width];
+
+			for (uint32_t j = 0; j < dst.width; ++j) {
+				uint32_t x0 = j * 2;
+				uint32_t x1 = std::min(j * 2 + 1, srcwidth - 1);
+
+				out[j] = std::max(std::max(row0[x0], row0[x1]), std::max(row1[x0], row1[x1]));
+			}
+		}
+	};
+
+	// first level is the most expensive
+	RunJobs(workers, hizlevels[0].height, [&](uint32_t begin, uint32_t end, uint32_t) {
+		downsample(depthbuffer.data(), pitch, width, height, hizlevels[0], begin, end);
+	});
+
+	for (size_t i = 1; i < hizlevels.size(); ++i) {
+		const HiZLevel& src = hizlevels[i - 1];
+		downsample(src.data.data(), src.width, src.width, src.height, hizlevels[i], 0, hizlevels[i].height);
+	}
+}
+
+void DepthRasterizer::Flush()
+{
+	uint32_t numtiles = numtilesx * numtilesy;
+	uint32_t numvertices = 0;
+
+	numthreads = (workers != nullptr ? workers->GetNumThreads() : 1);
+
+	for (size_t i = 0; i < draws.size(); ++i)
+		numvertices += draws[i].numvertices;
+
+	clipvertices.resize(numvertices);
+	triangles.resize(numthreads);
+	bins.resize(numthreads * numtiles);
+
+	for (size_t i = 0; i < triangles.size(); ++i)
+		triangles[i].clear();
+
+	for (size_t i = 0; i < bins.size(); ++i)
+		bins[i].clear();
+
+	// STEP 1: transform vertices
+	jobs.clear();
+
+	for (uint32_t i = 0; i < (uint32_t)draws.size(); ++i) {
+		for (uint32_t j = 0; j < draws[i].numvertices; j += VERTICES_PER_JOB)
+			jobs.push_back({ i, j, std::min<uint32_t>(VERTICES_PER_JOB, draws[i].numvertices - j) });
+	}
+
+	RunJobs(workers, (uint32_t)jobs.size(), [&](uint32_t begin, uint32_t end, uint32_t) {
+		for (uint32_t i = begin; i < end; ++i)
+			TransformVertices(jobs[i].draw, jobs[i].first, jobs[i].first + jobs[i].count);
+	});
+
+	// STEP 2: setup and bin triangles
+	jobs.clear();
+
+	for (uint32_t i = 0; i < (uint32_t)draws.size(); ++i) {
+		uint32_t numtriangles = draws[i].numindices / 3;
+
+		for (uint32_t j = 0; j < numtriangles; j += TRIANGLES_PER_JOB)
+			jobs.push_back({ i, j, std::min<uint32_t>(TRIANGLES_PER_JOB, numtriangles - j) });
+	}
+
+	RunJobs(workers, (uint32_t)jobs.size(), [&](uint32_t begin, uint32_t end, uint32_t thread) {
+		for (uint32_t i = begin; i < end; ++i)
+			SetupTriangles(jobs[i], thread);
+	});
+
+	// STEP 3: rasterize tiles (each tile is owned by one thread)
+	RunJobs(workers, numtiles, [&](uint32_t begin, uint32_t end, uint32_t) {
+		for (uint32_t i = begin; i < end; ++i)
+			RasterizeTile(i);
+	});
+
+	// STEP 4: build hierarchical-Z
+	BuildHiZ();
+}
+
+bool DepthRasterizer::TestBox(const Math::AABox& box, const Math::Matrix& viewproj) const
+{
+	Math::Vector4 clippos;
+	Math::Vector3 ndcmin(FLT_MAX, FLT_MAX, FLT_MAX);
+	Math::Vector3 ndcmax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+	for (int i = 0; i < 8; ++i) {
+		Math::Vector4 corner(
+			(i & 1) ? box.Max.x : box.Min.x,
+			(i & 2) ? box.Max.y : box.Min.y,
+			(i & 4) ? box.Max.z : box.Min.z, 1);
+
+		Math::Vec4Transform(clippos, corner, viewproj);
+
+		// crosses the near plane
+		if (clippos.z < -clippos.w || clippos.w <= 0)
+			return true;
+
+		for (int j = 0; j < 3; ++j) {
+			float value = clippos[j] / clippos.w;
+
+			ndcmin[j] = std::min(ndcmin[j], value);
+			ndcmax[j] = std::max(ndcmax[j], value);
+		}
+	}
+
+	if (ndcmax.x < -1 || ndcmin.x > 1 || ndcmax.y < -1 || ndcmin.y > 1 || ndcmin.z > 1)
+		return false;
+
+	// pixels whose centers might be covered
+	int32_t x0 = std::max<int32_t>((int32_t)floorf((ndcmin.x * 0.5f + 0.5f) * width), 0);
+	int32_t y0 = std::max<int32_t>((int32_t)floorf((ndcmin.y * 0.5f + 0.5f) * height), 0);
+	int32_t x1 = std::min<int32_t>((int32_t)floorf((ndcmax.x * 0.5f + 0.5f) * width), width - 1);
+	int32_t y1 = std::min<int32_t>((int32_t)floorf((ndcmax.y * 0.5f + 0.5f) * height), height - 1);
+	float mindepth = ndcmin.z * 0.5f + 0.5f - BOX_DEPTH_BIAS;
+
+	// find a level where the box covers at most 4x4 texels
+	uint32_t level = 0;
+
+	x0 >>= 1;
+	y0 >>= 1;
+	x1 >>= 1;
+	y1 >>= 1;
+
+	while ((x1 - x0 > 3 || y1 - y0 > 3) && level + 1 < hizlevels.size()) {
+		x0 >>= 1;
+		y0 >>= 1;
+		x1 >>= 1;
+		y1 >>= 1;
+
+		++level;
+	}
+
+	const HiZLevel& hiz = hizlevels[level];
+
+	for (int32_t y = y0; y <= y1; ++y) {
+		for (int32_t x = x0; x <= x1; ++x) {
+			if (mindepth <= hiz.data[y * hiz.width + x])
+				return true;
+		}
+	}
+
+	return false;
+}
+
+void DepthRasterizer::TestBoxes(uint8_t* visibility, const Math::AABox* boxes, uint32_t count, const Math::Matrix& viewproj) const
+{
+	uint32_t numjobs = (count + BOXES_PER_JOB - 1) / BOXES_PER_JOB;
+
+	RunJobs(workers, numjobs, [&](uint32_t begin, uint32_t end, uint32_t) {
+		for (uint32_t i = begin * BOXES_PER_JOB; i < std::min(end * BOXES_PER_JOB, count); ++i)
+			visibility[i] = (TestBox(boxes[i], viewproj) ? 1 : 0);
+	});
+}
+
+float DepthRasterizer::GetDepth(uint32_t x, uint32_t y) const
+{
+	return depthbuffer[y * pitch + x];
+}
+
+uint32_t DepthRasterizer::GetNumTriangles() const
+{
+	uint32_t count = 0;
+
+	for (size_t i = 0; i < triangles.size(); ++i)
+		count += (uint32_t)triangles[i].size();
+
+	return count;
+}
@@ -0,0 +1,116 @@
+
+#ifndef _DEPTHRASTERIZER_H_
+#define _DEPTHRASTERIZER_H_
+
+#include <vector>
+#include "3Dmath.h"
+
+class ThreadPool;
+
+enum DepthCullMode
+{
+	DepthCullModeNone = 0,
+	DepthCullModeBack,		// counter-clockwise is front (as in GL)
+	DepthCullModeFront
+};
+
+/**
+ * \brief Depth-only software rasterizer for occlusion culling and reference shadow maps
+ *
+ * Meshes are queued with AddMesh, then Flush transforms and bins the triangles into
+ * screen tiles and rasterizes the tiles in parallel (4 pixels at once, 28.4 fixed point
+ * edge functions with top-left rule). Depth is stored like a GL depth buffer: values
+ * in [0, 1], row 0 is the bottom of the screen, cleared to 1.
+ *
+ * After Flush a max-depth pyramid (hierarchical-Z) is built, which TestBoxes uses to
+ * reject boxes that are hidden behind the rasterized occluders.
+ */
+class DepthRasterizer
+{
+private:
+	struct Draw
+	{
+		Math::Matrix	worldviewproj;
+		const void*		vertices;
+		const void*		indices;
+		uint32_t		numvertices;
+		uint32_t		numindices;
+		uint32_t		stride;			// position is the first 3 floats
+		uint32_t		firstvertex;	// in transformed vertices
+		bool			index32;
+	};
+
+	struct Job
+	{
+		uint32_t draw;
+		uint32_t first;
+		uint32_t count;
+	};
+
+	struct Triangle
+	{
+		int32_t		x[3], y[3];		// 28.4 fixed point, counter-clockwise
+		float		z0, dzdx, dzdy;	// depth at pixel centers
+		int32_t		minx, miny;		// pixel bounds (inclusive)
+		int32_t		maxx, maxy;
+	};
+
+	struct HiZLevel
+	{
+		std::vector<float>	data;
+		uint32_t			width;
+		uint32_t			height;
+	};
+
+	typedef std::vector<Triangle> TriangleList;
+	typedef std::vector<uint32_t> IndexList;
+
+	std::vector<Draw>			draws;
+	std::vector<Job>			jobs;
+	std::vector<Math::Vector4>	clipvertices;
+	std::vector<TriangleList>	triangles;		// per thread
+	std::vector<IndexList>		bins;			// per thread and tile
+	std::vector<HiZLevel>		hizlevels;		// level 0 is half resolution
+	std::vector<float>			depthbuffer;
+	ThreadPool*					workers;
+	DepthCullMode				cullmode;
+	uint32_t					width;
+	uint32_t					height;
+	uint32_t					pitch;
+	uint32_t					numtilesx;
+	uint32_t					numtilesy;
+	uint32_t					numthreads;
+
+	void TransformVertices(uint32_t draw, uint32_t begin, uint32_t end);
+	void SetupTriangles(const Job& job, uint32_t thread);
+	void SetupTriangle(const Math::Vector4& v0, const Math::Vector4& v1, const Math::Vector4& v2, uint32_t thread);
+	void ClipTriangle(const Math::Vector4& v0, const Math::Vector4& v1, const Math::Vector4& v2, uint32_t thread);
+	void RasterizeTile(uint32_t tile);
+	void RasterizeTriangle(const Triangle& tri, int32_t tilex, int32_t tiley);
+	void BuildHiZ();
+
+	bool TestBox(const Math::AABox& box, const Math::Matrix& viewproj) const;
+
+public:
+	DepthRasterizer(uint32_t width, uint32_t height);
+
+	void Clear();
+	void AddMesh(const void* vertices, uint32_t numvertices, uint32_t stride, const void* indices, uint32_t numindices, bool index32, const Math::Matrix& worldviewproj);
+	void Flush();
+
+	// visibility[i] is 1 if boxes[i] is (potentially) visible
+	void TestBoxes(uint8_t* visibility, const Math::AABox* boxes, uint32_t count, const Math::Matrix& viewproj) const;
+
+	float GetDepth(uint32_t x, uint32_t y) const;
+	uint32_t GetNumTriangles() const;	// after clipping and culling
+
+	inline void SetCullMode(DepthCullMode mode)		{ cullmode = mode; }
+	inline void SetThreadPool(ThreadPool* pool)		{ workers = pool; }
+
+	inline const float* GetDepthBuffer() const		{ return depthbuffer.data(); }
+	inline uint32_t GetWidth() const				{ return width; }
+	inline uint32_t GetHeight() const				{ return height; }
+	inline uint32_t GetPitch() const				{ return pitch; }
+};
+
+#endif
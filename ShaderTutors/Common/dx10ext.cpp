@@ -1,6 +1,7 @@
 
 #include "dx10ext.h"
 #include "3Dmath.h"
+#include "profiler.h"
 
 static void ReadString(FILE* f, char* buff)
 {
@@ -42,6 +43,8 @@ HRESULT DXCreateEffect(ID3D10Device* device, LPCTSTR file, ID3D10Effect** out)
 
 HRESULT DXLoadMeshFromQM(ID3D10Device* device, LPCTSTR file, DWORD options, ID3DX10Mesh** mesh)
 {
+	PROFILE_SCOPE("DXLoadMeshFromQM");
+
 	static const char* usages[] = {
 		"POSITION",
 		"POSITIONT",
@@ -1,6 +1,7 @@
 
 #include "dx11ext.h"
 #include "3Dmath.h"
+#include "profiler.h"
 
 static void ReadString(FILE* f, char* buff)
 {
@@ -83,6 +84,8 @@ void D3D11Mesh::DrawSubset(ID3D11DeviceContext* context, UINT subset)
 
 HRESULT DXLoadMeshFromQM(ID3D11Device* device, LPCTSTR file, DWORD options, D3D11Mesh** mesh)
 {
+	PROFILE_SCOPE("DXLoadMeshFromQM");
+
 	static const char* usages[] = {
 		"POSITION",
 		"POSITIONT",
@@ -2,6 +2,7 @@
 #include "dx9ext.h"
 #include "3Dmath.h"
 #include "geometryutils.h"
+#include "profiler.h"
 
 #define MAX_BONE_MATRICES	26
 
@@ -75,6 +76,8 @@ HRESULT DXCreateEffect(LPDIRECT3DDEVICE9 device, LPCTSTR file, LPD3DXEFFECT* out
 
 HRESULT DXLoadMeshFromQM(LPCTSTR file, DWORD options, LPDIRECT3DDEVICE9 d3ddevice, D3DXMATERIAL** materials, DWORD* nummaterials, LPD3DXMESH* mesh)
 {
+	PROFILE_SCOPE("DXLoadMeshFromQM");
+
 	static const uint8_t usages[] = {
 		D3DDECLUSAGE_POSITION,
 		D3DDECLUSAGE_POSITIONT,
@@ -0,0 +1,369 @@
+
+#include <algorithm>
+#include <cstring>
+
+#include "frustumculler.h"
+#include "threadpool.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#	define FRUSTUMCULLER_SSE2
+#	ifdef _MSC_VER
+#		include <intrin.h>
+#		define AVX_FUNCTION
+#	else
+#		include <x86intrin.h>
+#		define AVX_FUNCTION	__attribute__((target("avx")))
+#	endif
+#endif
+
+#define BLOCK_SIZE		8
+#define BLOCK_SHIFT		3
+#define MORTON_BITS		10
+
+static uint32_t SpreadBits(uint32_t x)
+{
+	// 10 bits -> every third bit of 30
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x030000ff;
+	x = (x | (x << 8)) & 0x0300f00f;
+	x = (x | (x << 4)) & 0x030c30c3;
+	x = (x | (x << 2)) & 0x09249249;
+
+	return x;
+}
+
+static bool IsAVXSupported()
+{
+#if !defined(FRUSTUMCULLER_SSE2)
+	return false;
+#elif defined(_MSC_VER)
+	int info[4];
+
+	__cpuid(info, 1);
+
+	// AVX and OSXSAVE, then check that the OS saves YMM registers
+	if ((info[2] & (1 << 28)) == 0 || (info[2] & (1 << 27)) == 0)
+		return false;
+
+	return ((_xgetbv(0) & 6) == 6);
+#else
+	return __builtin_cpu_supports("avx");
+#endif
+}
+
+void FrustumCuller::CullResults::Reset()
+{
+	visible.clear();
+	newlyvisible.clear();
+	newlyhidden.clear();
+	visibility.clear();
+}
+
+// --- FrustumCuller impl -----------------------------------------------------
+
+FrustumCuller::FrustumCuller()
+{
+	workers		= nullptr;
+	numboxes	= 0;
+	joblevel	= 0;
+	useavx		= IsAVXSupported();
+}
+
+void FrustumCuller::SetUseAVX(bool enable)
+{
+	useavx = (enable && IsAVXSupported());
+}
+
+void FrustumCuller::Build(const Math::AABox* boxes, uint32_t count)
+{
+	typedef std::pair<uint32_t, uint32_t> CodeIndexPair;
+
+	std::vector<CodeIndexPair> codes(count);
+	Math::AABox bounds;
+	Math::Vector3 center, halfsize, scale;
+
+	numboxes = count;
+
+	levels.clear();
+	permutation.resize(count);
+	visibility.resize(count);
+
+	if (count == 0)
+		return;
+
+	// sort in Morton order, so that nearby boxes end up in the same subtree
+	for (uint32_t i = 0; i < count; ++i) {
+		boxes[i].GetCenter(center);
+		bounds.Add(center);
+	}
+
+	bounds.GetSize(scale);
+
+	for (int i = 0; i < 3; ++i)
+		scale[i] = (scale[i] > 0 ? ((1 << MORTON_BITS) - 1) / scale[i] : 0);
+
+	for (uint32_t i = 0; i < count; ++i) {
+		boxes[i].GetCenter(center);
+
+		uint32_t x = (uint32_t)((center.x - bounds.Min.x) * scale.x);
+		uint32_t y = (uint32_t)((center.y - bounds.Min.y) * scale.y);
+		uint32_t z = (uint32_t)((center.z - bounds.Min.z) * scale.z);
+
+		codes[i].first = SpreadBits(x) | (SpreadBits(y) << 1) | (SpreadBits(z) << 2);
+		codes[i].second = i;
+	}
+
+	std::sort(codes.begin(), codes.end());
+
+	for (uint32_t i = 0; i < count; ++i)
+		permutation[i] = codes[i].second;
+
+	// build levels bottom-up (a lane of level n covers 8^n boxes)
+	std::vector<Math::AABox> current(count), parents;
+
+	for (uint32_t i = 0; i < count; ++i)
+		current[i] = boxes[permutation[i]];
+
+	do {
+		uint32_t numblocks = ((uint32_t)current.size() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+		levels.push_back(BlockList(numblocks));
+		parents.assign(numblocks, Math::AABox());
+
+		BlockList& blocks = levels.back();
+
+		for (uint32_t i = 0; i < numblocks; ++i) {
+			BoxBlock& block = blocks[i];
+
+			memset(&block, 0, sizeof(BoxBlock));
+
+			for (uint32_t j = 0; j < BLOCK_SIZE; ++j) {
+				uint32_t index = i * BLOCK_SIZE + j;
+
+				if (index >= current.size())
+					break;
+
+				const Math::AABox& box = current[index];
+
+				// empty boxes are never visible
+				if (box.Min.x > box.Max.x)
+					continue;
+
+				box.GetCenter(center);
+				box.GetHalfSize(halfsize);
+
+				for (int k = 0; k < 3; ++k) {
+					block.centers[k][j] = center[k];
+					block.halfsizes[k][j] = halfsize[k];
+				}
+
+				block.validmask |= (1 << j);
+
+				parents[i].Add(box.Min);
+				parents[i].Add(box.Max);
+			}
+		}
+
+		current.swap(parents);
+	} while (current.size() > 1);
+
+	// pick a level with enough blocks to keep every thread busy
+	joblevel = (uint32_t)levels.size() - 1;
+
+	while (joblevel > 0 && levels[joblevel].size() < 64)
+		--joblevel;
+
+	jobblocks.resize(levels[joblevel].size());
+
+	for (uint32_t i = 0; i < jobblocks.size(); ++i)
+		jobblocks[i] = i;
+}
+
+uint32_t FrustumCuller::TestBlock(const BoxBlock& block, const CullPlanes& planes, uint32_t& insidemask)
+{
+	// same test as Math::FrustumIntersect
+	uint32_t visiblemask = 0;
+
+	insidemask = 0;
+
+#ifdef FRUSTUMCULLER_SSE2
+	// two halves of 4
+	for (int half = 0; half < 2; ++half) {
+		int offset = half * 4;
+
+		__m128 cx = _mm_loadu_ps(block.centers[0] + offset);
+		__m128 cy = _mm_loadu_ps(block.centers[1] + offset);
+		__m128 cz = _mm_loadu_ps(block.centers[2] + offset);
+		__m128 hx = _mm_loadu_ps(block.halfsizes[0] + offset);
+		__m128 hy = _mm_loadu_ps(block.halfsizes[1] + offset);
+		__m128 hz = _mm_loadu_ps(block.halfsizes[2] + offset);
+
+		__m128 outside = _mm_setzero_ps();
+		__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+
+		for (int i = 0; i < 6; ++i) {
+			const float* p = planes.planes[i];
+			const float* n = planes.absnormals[i];
+
+			__m128 dist = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(cx, _mm_set1_ps(p[0])), _mm_mul_ps(cy, _mm_set1_ps(p[1]))),
+				_mm_add_ps(_mm_mul_ps(cz, _mm_set1_ps(p[2])), _mm_set1_ps(p[3])));
+
+			__m128 maxdist = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(hx, _mm_set1_ps(n[0])), _mm_mul_ps(hy, _mm_set1_ps(n[1]))),
+				_mm_mul_ps(hz, _mm_set1_ps(n[2])));
+
+			outside = _mm_or_ps(outside, _mm_cmplt_ps(dist, _mm_sub_ps(_mm_setzero_ps(), maxdist)));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(dist, maxdist));
+		}
+
+		visiblemask |= ((~_mm_movemask_ps(outside) & 0xf) << offset);
+		insidemask |= (_mm_movemask_ps(inside) << offset);
+	}
+#else
+	for (int lane = 0; lane < BLOCK_SIZE; ++lane) {
+		bool outside = false;
+		bool inside = true;
+
+		for (int i = 0; i < 6; ++i) {
+			const float* p = planes.planes[i];
+			const float* n = planes.absnormals[i];
+
+			float dist = block.centers[0][lane] * p[0] + block.centers[1][lane] * p[1] + block.centers[2][lane] * p[2] + p[3];
+			float maxdist = block.halfsizes[0][lane] * n[0] + block.halfsizes[1][lane] * n[1] + block.halfsizes[2][lane] * n[2];
+
+			outside = (outside || dist < -maxdist);
+			inside = (inside && dist >= maxdist);
+		}
+
+		visiblemask |= ((outside ? 0 : 1) << lane);
+		insidemask |= ((inside ? 1 : 0) << lane);
+	}
+#endif
+
+	visiblemask &= block.validmask;
+	insidemask &= visiblemask;
+
+	return visiblemask;
+}
+
+#ifdef FRUSTUMCULLER_SSE2
+AVX_FUNCTION uint32_t FrustumCuller::TestBlockAVX(const BoxBlock& block, const CullPlanes& planes, uint32_t& insidemask)
+{
+	__m256 cx = _mm256_loadu_ps(block.centers[0]);
+	__m256 cy = _mm256_loadu_ps(block.centers[1]);
+	__m256 cz = _mm256_loadu_ps(block.centers[2]);
+	__m256 hx = _mm256_loadu_ps(block.halfsizes[0]);
+	__m256 hy = _mm256_loadu_ps(block.halfsizes[1]);
+	__m256 hz = _mm256_loadu_ps(block.halfsizes[2]);
+
+	__m256 outside = _mm256_setzero_ps();
+	__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+
+	for (int i = 0; i < 6; ++i) {
+		const float* p = planes.planes[i];
+		const float* n = planes.absnormals[i];
+
+		__m256 dist = _mm256_add_ps(
+			_mm256_add_ps(_mm256_mul_ps(cx, _mm256_set1_ps(p[0])), _mm256_mul_ps(cy, _mm256_set1_ps(p[1]))),
+			_mm256_add_ps(_mm256_mul_ps(cz, _mm256_set1_ps(p[2])), _mm256_set1_ps(p[3])));
+
+		__m256 maxdist = _mm256_add_ps(
+			_mm256_add_ps(_mm256_mul_ps(hx, _mm256_set1_ps(n[0])), _mm256_mul_ps(hy, _mm256_set1_ps(n[1]))),
+			_mm256_mul_ps(hz, _mm256_set1_ps(n[2])));
+
+		outside = _mm256_or_ps(outside, _mm256_cmp_ps(dist, _mm256_sub_ps(_mm256_setzero_ps(), maxdist), _CMP_LT_OQ));
+		inside = _mm256_and_ps(inside, _mm256_cmp_ps(dist, maxdist, _CMP_GE_OQ));
+	}
+
+	uint32_t visiblemask = (~_mm256_movemask_ps(outside) & 0xff) & block.validmask;
+	insidemask = _mm256_movemask_ps(inside) & visiblemask;
+
+	return visiblemask;
+}
+#endif
+
+void FrustumCuller::MarkVisible(uint32_t level, uint32_t block, uint32_t lane)
+{
+	uint32_t start = (block * BLOCK_SIZE + lane) << (level * BLOCK_SHIFT);
+	uint32_t end = std::min<uint32_t>(start + (1 << (level * BLOCK_SHIFT)), numboxes);
+
+	for (uint32_t i = start; i < end; ++i)
+		visibility[permutation[i]] = 1;
+}
+
+void FrustumCuller::CullBlock(const CullPlanes& planes, uint32_t level, uint32_t block)
+{
+	uint32_t insidemask;
+	uint32_t visiblemask;
+
+#ifdef FRUSTUMCULLER_SSE2
+	if (useavx)
+		visiblemask = TestBlockAVX(levels[level][block], planes, insidemask);
+	else
+#endif
+		visiblemask = TestBlock(levels[level][block], planes, insidemask);
+
+	for (uint32_t lane = 0; lane < BLOCK_SIZE; ++lane) {
+		uint32_t bit = (1 << lane);
+
+		if (!(visiblemask & bit))
+			continue;
+
+		if (level == 0 || (insidemask & bit)) {
+			// whole subtree is visible
+			MarkVisible(level, block, lane);
+		} else {
+			CullBlock(planes, level - 1, block * BLOCK_SIZE + lane);
+		}
+	}
+}
+
+void FrustumCuller::Cull(CullResults& results, const Math::Vector4 frustum[6])
+{
+	CullPlanes planes;
+
+	results.visible.clear();
+	results.newlyvisible.clear();
+	results.newlyhidden.clear();
+	results.visibility.resize(numboxes, 0);
+
+	if (numboxes == 0)
+		return;
+
+	for (int i = 0; i < 6; ++i) {
+		for (int j = 0; j < 4; ++j)
+			planes.planes[i][j] = frustum[i][j];
+
+		for (int j = 0; j < 3; ++j)
+			planes.absnormals[i][j] = fabs(frustum[i][j]);
+	}
+
+	memset(visibility.data(), 0, visibility.size());
+
+	// NOTE: blocks above the job level are not tested (there are only a few of them)
+	if (workers != nullptr) {
+		workers->ParallelFor((uint32_t)jobblocks.size(), 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+			for (uint32_t i = begin; i < end; ++i)
+				CullBlock(planes, joblevel, jobblocks[i]);
+		});
+	} else {
+		CullBlock(planes, (uint32_t)levels.size() - 1, 0);
+	}
+
+	// compare with previous state
+	for (uint32_t i = 0; i < numboxes; ++i) {
+		uint8_t current = visibility[i];
+
+		if (current) {
+			results.visible.push_back(i);
+
+			if (!results.visibility[i])
+				results.newlyvisible.push_back(i);
+		} else if (results.visibility[i]) {
+			results.newlyhidden.push_back(i);
+		}
+
+		results.visibility[i] = current;
+	}
+}
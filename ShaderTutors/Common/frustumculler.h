@@ -0,0 +1,75 @@
+
+#ifndef _FRUSTUMCULLER_H_
+#define _FRUSTUMCULLER_H_
+
+#include <vector>
+#include "3Dmath.h"
+
+class ThreadPool;
+
+/**
+ * \brief Culls a static set of boxes against a view frustum
+ *
+ * Boxes are stored in an 8-wide BVH (built in Morton order), each node holding
+ * its children as SoA arrays so that all 8 are tested at once. Results are
+ * diffed against the previous call with the same CullResults object.
+ */
+class FrustumCuller
+{
+public:
+	struct CullResults
+	{
+		std::vector<uint32_t>	visible;		// in increasing order
+		std::vector<uint32_t>	newlyvisible;	// since last call with this object
+		std::vector<uint32_t>	newlyhidden;
+		std::vector<uint8_t>	visibility;		// state of last call
+
+		void Reset();
+	};
+
+private:
+	struct BoxBlock
+	{
+		float		centers[3][8];
+		float		halfsizes[3][8];
+		uint32_t	validmask;
+	};
+
+	struct CullPlanes
+	{
+		float		planes[6][4];
+		float		absnormals[6][3];
+	};
+
+	typedef std::vector<BoxBlock> BlockList;
+	typedef std::vector<BlockList> LevelList;
+
+private:
+	LevelList				levels;			// levels[0] are the leaves
+	std::vector<uint32_t>	permutation;	// sorted position -> box index
+	std::vector<uint8_t>	visibility;		// current call, per box
+	std::vector<uint32_t>	jobblocks;
+	ThreadPool*				workers;
+	uint32_t				numboxes;
+	uint32_t				joblevel;
+	bool					useavx;
+
+	void CullBlock(const CullPlanes& planes, uint32_t level, uint32_t block);
+	void MarkVisible(uint32_t level, uint32_t block, uint32_t lane);
+
+	static uint32_t TestBlock(const BoxBlock& block, const CullPlanes& planes, uint32_t& insidemask);
+	static uint32_t TestBlockAVX(const BoxBlock& block, const CullPlanes& planes, uint32_t& insidemask);
+
+public:
+	FrustumCuller();
+
+	void Build(const Math::AABox* boxes, uint32_t count);
+	void Cull(CullResults& results, const Math::Vector4 frustum[6]);
+	void SetUseAVX(bool enable);	// only if the CPU supports it (default)
+
+	inline void SetThreadPool(ThreadPool* pool)	{ workers = pool; }
+	inline uint32_t GetNumBoxes() const			{ return numboxes; }
+	inline bool IsUsingAVX() const				{ return useavx; }
+};
+
+#endif
@@ -1,6 +1,7 @@
 
 #include <cassert>
 #include <cmath>
+#include <cstring>
 #include <algorithm>
 
 #include "geometryutils.h"
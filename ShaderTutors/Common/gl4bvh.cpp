@@ -1,6 +1,7 @@
 
 #include <iostream>
 #include "gl4bvh.h"
+#include "profiler.h"
 
 struct OpenGLBVH::AABoxEx : private Math::AABox
 {
@@ -39,6 +40,8 @@ OpenGLBVH::~OpenGLBVH()
 
 void OpenGLBVH::Build(OpenGLMesh* mesh, uint32_t* materialoverrides, const char* cachefile)
 {
+	PROFILE_SCOPE("OpenGLBVH::Build");
+
 	FILE* infile = nullptr;
 
 	fopen_s(&infile, cachefile, "rb");
@@ -189,7 +192,19 @@ void OpenGLBVH::Build(OpenGLMesh* mesh, uint32_t* materialoverrides, const char*
 	subsets = nullptr;
 }
 
-void OpenGLBVH::UploadToGPU(OpenGLBVHNode* heap, Triangle* triangleIDs, uint32_t numtriangleIDs)
+void OpenGLBVH::Load(const OpenGLBVHNode* heap, uint32_t numnodes, const uint32_t* triangledata, uint32_t numtriangleIDs)
+{
+	static_assert(sizeof(Triangle) == 2 * sizeof(uint32_t), "sizeof(Triangle) must be 8 bytes");
+
+	// NOTE: (first index, material) pairs, e.g. straight from a mapped scene package
+	GL_SAFE_DELETE_BUFFER(hierarchy);
+	GL_SAFE_DELETE_BUFFER(triangles);
+
+	totalnodes = numnodes;
+	UploadToGPU(heap, (const Triangle*)triangledata, numtriangleIDs);
+}
+
+void OpenGLBVH::UploadToGPU(const OpenGLBVHNode* heap, const Triangle* triangleIDs, uint32_t numtriangleIDs)
 {
 	glGenBuffers(1, &hierarchy);
 	glGenBuffers(1, &triangles);
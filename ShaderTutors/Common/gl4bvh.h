@@ -80,13 +80,14 @@ private:
 	BVHNode* Recurse(std::vector<AABoxEx>& items, const Math::AABox& itemsbox, int depth = 0, float percent = 0.0f);
 	void PopulateHeap(BVHNode* node, OpenGLBVHNode* heap, Triangle* triangles, uint32_t& nodeindex, uint32_t& triindex);
 	void InternalTraverse(BVHNode* node, std::function<void (const Math::AABox&, bool)> callback);
-	void UploadToGPU(OpenGLBVHNode* heap, Triangle* triangleIDs, uint32_t numtriangleIDs);
+	void UploadToGPU(const OpenGLBVHNode* heap, const Triangle* triangleIDs, uint32_t numtriangleIDs);
 
 public:
 	OpenGLBVH();
 	~OpenGLBVH();
 
 	void Build(OpenGLMesh* mesh, uint32_t* materialoverrides, const char* cachefile);
+	void Load(const OpenGLBVHNode* heap, uint32_t numnodes, const uint32_t* triangledata, uint32_t numtriangleIDs);	// same layout as the cache file
 	void DEBUG_Traverse(std::function<void (const Math::AABox&, bool)> callback);
 
 	inline GLuint GetHierarchy() const		{ return hierarchy; }
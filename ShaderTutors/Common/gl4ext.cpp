@@ -2,6 +2,7 @@
 #include "gl4ext.h"
 #include "geometryutils.h"
 #include "dds.h"
+#include "profiler.h"
 
 #include <iostream>
 #include <algorithm>
@@ -259,7 +260,11 @@ OpenGLMesh::OpenGLMesh()
 	numsubsets		= 0;
 	numvertices		= 0;
 	numindices		= 0;
+	numlods			= 1;
+	currentlod		= 0;
 	subsettable		= nullptr;
+	lodtable		= nullptr;
+	loderrors		= nullptr;
 	materials		= nullptr;
 	vertexbuffer	= 0;
 	indexbuffer		= 0;
@@ -291,11 +296,17 @@ void OpenGLMesh::Destroy()
 	}
 
 	delete[] subsettable;
+	delete[] lodtable;
+	delete[] loderrors;
 	delete[] materials;
 
 	subsettable = nullptr;
+	lodtable = nullptr;
+	loderrors = nullptr;
 	materials = nullptr;
 	numsubsets = 0;
+	numlods = 1;
+	currentlod = 0;
 }
 
 void OpenGLMesh::RecreateVertexLayout()
@@ -445,10 +456,10 @@ void OpenGLMesh::DrawSubset(GLuint subset, bool bindtextures)
 		return;
 
 	if (subsettable != nullptr && subset < numsubsets) {
-		const OpenGLAttributeRange& attr = subsettable[subset];
+		const OpenGLAttributeRange& attr = (currentlod > 0 ? lodtable[(currentlod - 1) * numsubsets + subsettable[subset].AttribId] : subsettable[subset]);
 		const OpenGLMaterial& mat = materials[subset];
 
-		if (!attr.Enabled)
+		if (!subsettable[subset].Enabled)
 			return;
 
 		GLenum itype = (meshoptions & GLMESH_32BIT) ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT;
@@ -486,10 +497,10 @@ void OpenGLMesh::DrawSubset(GLuint subset, std::function<void (const OpenGLMater
 		return;
 
 	if (subsettable != nullptr && subset < numsubsets) {
-		const OpenGLAttributeRange& attr = subsettable[subset];
+		const OpenGLAttributeRange& attr = (currentlod > 0 ? lodtable[(currentlod - 1) * numsubsets + subsettable[subset].AttribId] : subsettable[subset]);
 		const OpenGLMaterial& mat = materials[subset];
 
-		if (!attr.Enabled)
+		if (!subsettable[subset].Enabled)
 			return;
 
 		GLenum itype = (meshoptions & GLMESH_32BIT) ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT;
@@ -530,10 +541,10 @@ void OpenGLMesh::DrawSubsetInstanced(GLuint subset, GLuint numinstances, bool bi
 		return;
 
 	if (subsettable != nullptr && subset < numsubsets) {
-		const OpenGLAttributeRange& attr = subsettable[subset];
+		const OpenGLAttributeRange& attr = (currentlod > 0 ? lodtable[(currentlod - 1) * numsubsets + subsettable[subset].AttribId] : subsettable[subset]);
 		const OpenGLMaterial& mat = materials[subset];
 
-		if (!attr.Enabled)
+		if (!subsettable[subset].Enabled)
 			return;
 
 		GLenum itype = (meshoptions & GLMESH_32BIT) ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT;
@@ -603,6 +614,12 @@ void OpenGLMesh::CalculateBoundingBox()
 
 void OpenGLMesh::GenerateTangentFrame()
 {
+	for (int i = 0; i < 16 && vertexdecl.Elements[i].Stream != 0xff; ++i) {
+		// NOTE: already in the file (see TangentGenerator::GenerateQMTangents)
+		if (vertexdecl.Elements[i].Usage == GLDECLUSAGE_TANGENT)
+			return;
+	}
+
 	GL_ASSERT(vertexdecl.Stride == sizeof(GeometryUtils::CommonVertex));
 	GL_ASSERT(vertexbuffer != 0);
 
@@ -757,11 +774,39 @@ void OpenGLMesh::UnlockIndexBuffer()
 void OpenGLMesh::SetAttributeTable(const OpenGLAttributeRange* table, GLuint size)
 {
 	delete[] subsettable;
+	delete[] lodtable;
+	delete[] loderrors;
 
 	subsettable = new OpenGLAttributeRange[size];
 	memcpy(subsettable, table, size * sizeof(OpenGLAttributeRange));
 
 	numsubsets = size;
+
+	// LODs belong to the old table
+	lodtable = nullptr;
+	loderrors = nullptr;
+	numlods = 1;
+	currentlod = 0;
+}
+
+void OpenGLMesh::SetLOD(GLuint lod)
+{
+	currentlod = Math::Min<GLuint>(lod, numlods - 1);
+}
+
+GLuint OpenGLMesh::SelectLOD(float distance, float pixelsperunit, float maxpixelerror) const
+{
+	// NOTE: the coarsest level whose error projects to at most 'maxpixelerror' pixels
+	GLuint lod = 0;
+
+	for (GLuint i = 1; i < numlods; ++i) {
+		if (loderrors[i] * pixelsperunit > maxpixelerror * distance)
+			break;
+
+		lod = i;
+	}
+
+	return lod;
 }
 
 // --- OpenGLEffect impl ------------------------------------------------------
@@ -1834,6 +1879,8 @@ void OpenGLScreenQuad::SetTextureMatrix(const Math::Matrix& m)
 
 bool GLCreateCubeTextureFromDDS(const char* file, bool srgb, GLuint* out)
 {
+	PROFILE_SCOPE("GLCreateCubeTextureFromDDS");
+
 	DDS_Image_Info info;
 	GLuint texid = OpenGLContentManager().IDTexture(file);
 
@@ -2082,6 +2129,8 @@ bool GLCreateMesh(GLuint numvertices, GLuint numindices, GLuint options, OpenGLV
 
 bool GLCreateMeshFromQM(const char* file, OpenGLMesh** mesh, uint32_t options)
 {
+	PROFILE_SCOPE("GLCreateMeshFromQM");
+
 	static const uint8_t usages[] = {
 		GLDECLUSAGE_POSITION,
 		GLDECLUSAGE_POSITIONT,
@@ -2122,6 +2171,11 @@ bool GLCreateMeshFromQM(const char* file, OpenGLMesh** mesh, uint32_t options)
 	uint32_t				istride;
 	uint32_t				numsubsets;
 	uint32_t				numelems;
+	uint32_t				numlodentries = 0;
+	uint32_t				numlodlevels = 0;
+	uint32_t				numlodindices = 0;
+	uint32_t*				lodentries = nullptr;
+	uint16_t*				tmpdata = nullptr;
 	uint16_t				tmp16;
 	uint8_t					tmp8;
 	void*					data = nullptr;
@@ -2182,8 +2236,28 @@ bool GLCreateMeshFromQM(const char* file, OpenGLMesh** mesh, uint32_t options)
 	decl[numelems].Usage = 0;
 	decl[numelems].UsageIndex = 0;
 
+	if (version >= 1) {
+		// NOTE: the LOD indices are stored in the LOD block, but they share the index buffer (see MeshSimplifier::GenerateQMLODs)
+		long declend = ftell(infile);
+		uint32_t lodheader[2] = { 0, 0 };
+
+		fseek(infile, vstride * numvertices + istride * numindices, SEEK_CUR);
+		fread(&numlodentries, 4, 1, infile);
+
+		if (numlodentries > 0 && fread(lodheader, 4, 2, infile) == 2) {
+			uint64_t numexpected = 1 + (uint64_t)lodheader[0] * (numsubsets + 1) + ((uint64_t)lodheader[1] * istride + 7) / 8;
+
+			if (lodheader[0] > 0 && numexpected == numlodentries) {
+				numlodlevels = lodheader[0];
+				numlodindices = lodheader[1];
+			}
+		}
+
+		fseek(infile, declend, SEEK_SET);
+	}
+
 	// create mesh
-	success = GLCreateMesh(numvertices, numindices, options | (istride == 4 ? GLMESH_32BIT : 0), decl, mesh);
+	success = GLCreateMesh(numvertices, numindices + numlodindices, options | (istride == 4 ? GLMESH_32BIT : 0), decl, mesh);
 
 	if (!success)
 		goto _fail;
@@ -2193,30 +2267,44 @@ bool GLCreateMeshFromQM(const char* file, OpenGLMesh** mesh, uint32_t options)
 	(*mesh)->UnlockVertexBuffer();
 
 	if ((options & GLMESH_32BIT) && istride == 2) {
-		uint16_t* tmpdata = new uint16_t[numindices];
-		fread(tmpdata, istride, numindices, infile);
+		tmpdata = new uint16_t[numindices + numlodindices];
+		data = tmpdata;
+	} else {
+		(*mesh)->LockIndexBuffer(0, 0, GLLOCK_DISCARD, &data);
+	}
+
+	fread(data, istride, numindices, infile);
+
+	if (version >= 1) {
+		fread(&numlodentries, 4, 1, infile);
+
+		if (numlodlevels > 0) {
+			// LOD chain (see MeshSimplifier::GenerateQMLODs)
+			uint32_t numlevelentries = 1 + numlodlevels * (numsubsets + 1);
+
+			lodentries = new uint32_t[numlevelentries * 2];
+			fread(lodentries, 8, numlevelentries, infile);
 
+			fread((uint8_t*)data + numindices * istride, istride, numlodindices, infile);
+			fseek(infile, 8 * (numlodentries - numlevelentries) - numlodindices * istride, SEEK_CUR);
+		} else if (numlodentries > 0) {
+			fseek(infile, 8 * numlodentries, SEEK_CUR);
+		}
+	}
+
+	if (tmpdata != nullptr) {
 		(*mesh)->LockIndexBuffer(0, 0, GLLOCK_DISCARD, &data);
 		{
-			for (uint16_t i = 0; i < numindices; ++i)
+			for (uint32_t i = 0; i < numindices + numlodindices; ++i)
 				*((uint32_t*)data + i) = tmpdata[i];
 		}
 		(*mesh)->UnlockIndexBuffer();
 
 		delete[] tmpdata;
 	} else {
-		(*mesh)->LockIndexBuffer(0, 0, GLLOCK_DISCARD, &data);
-		fread(data, istride, numindices, infile);
 		(*mesh)->UnlockIndexBuffer();
 	}
 
-	if (version >= 1) {
-		fread(&unused, 4, 1, infile);
-
-		if (unused > 0)
-			fseek(infile, 8 * unused, SEEK_CUR);
-	}
-
 	// attribute table
 	(*mesh)->materials = new OpenGLMaterial[numsubsets];
 
@@ -2321,6 +2409,31 @@ bool GLCreateMeshFromQM(const char* file, OpenGLMesh** mesh, uint32_t options)
 	// attribute buffer
 	(*mesh)->SetAttributeTable(table, numsubsets);
 
+	if (lodentries != nullptr) {
+		OpenGLMesh* glmesh = (*mesh);
+
+		glmesh->numindices	= numindices;	// LOD0
+		glmesh->numlods		= 1 + numlodlevels;
+		glmesh->lodtable	= new OpenGLAttributeRange[(glmesh->numlods - 1) * numsubsets];
+		glmesh->loderrors	= new float[glmesh->numlods];
+
+		glmesh->loderrors[0] = 0;
+
+		// for each level: error, number of indices, then the ranges of the subsets
+		for (GLuint i = 1; i < glmesh->numlods; ++i) {
+			const uint32_t* level = lodentries + 2 + 2 * (i - 1) * (numsubsets + 1);
+			memcpy(&glmesh->loderrors[i], level, 4);
+
+			for (uint32_t j = 0; j < numsubsets; ++j) {
+				OpenGLAttributeRange& range = glmesh->lodtable[(i - 1) * numsubsets + j];
+
+				range = table[j];
+				range.IndexStart = numindices + level[2 + j * 2];
+				range.IndexCount = level[3 + j * 2];
+			}
+		}
+	}
+
 	// printf some info
 	Math::GetFile(str, file);
 	box.GetSize(bbmin);
@@ -2330,6 +2443,7 @@ bool GLCreateMeshFromQM(const char* file, OpenGLMesh** mesh, uint32_t options)
 _fail:
 	delete[] decl;
 	delete[] table;
+	delete[] lodentries;
 
 	fclose(infile);
 	return success;
@@ -2522,6 +2636,8 @@ bool GLCreateTexture(GLsizei width, GLsizei height, GLint miplevels, OpenGLForma
 
 bool GLCreateTextureFromDDS(const char* file, bool srgb, GLuint* out)
 {
+	PROFILE_SCOPE("GLCreateTextureFromDDS");
+
 	DDS_Image_Info info;
 	GLuint texid = OpenGLContentManager().IDTexture(file);
 
@@ -2743,24 +2859,13 @@ bool GLCreateTextureFromFile(const char* file, bool srgb, GLuint* out, GLuint fl
 	return (texid != 0);
 }
 
-bool GLCreateTextureArrayFromFiles(const std::string* files, uint32_t numfiles, bool srgb, GLuint* out)
+bool GLDecodeTextureArray(const std::string* files, uint32_t numfiles, std::vector<uint8_t>& pixels, uint32_t& width, uint32_t& height)
 {
-	if (out == nullptr)
-		return false;
+	width = height = 0;
+	pixels.clear();
 
-	uint8_t*	imgdata	= nullptr;
-	GLuint		texid	= 0;
-	GLsizei		width	= 0;
-	GLsizei		height	= 0;
-
-	glGenTextures(1, &texid);
-	glBindTexture(GL_TEXTURE_2D_ARRAY, texid);
-
-	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	if (numfiles == 0)
+		return false;
 
 #ifdef _WIN32
 	std::vector<Gdiplus::Bitmap*> bitmaps;
@@ -2780,8 +2885,8 @@ bool GLCreateTextureArrayFromFiles(const std::string* files, uint32_t numfiles,
 			break;
 		}
 
-		width = Math::Max<GLsizei>(width, bitmaps[i]->GetWidth());
-		height = Math::Max<GLsizei>(height, bitmaps[i]->GetHeight());
+		width = Math::Max<uint32_t>(width, bitmaps[i]->GetWidth());
+		height = Math::Max<uint32_t>(height, bitmaps[i]->GetHeight());
 	}
 
 	if (width == 0 || height == 0) {
@@ -2791,12 +2896,12 @@ bool GLCreateTextureArrayFromFiles(const std::string* files, uint32_t numfiles,
 		return false;
 	}
 
-	// resize & upload
+	// resize to the largest
 	Gdiplus::Bitmap* scaled = new Gdiplus::Bitmap(width, height, PixelFormat32bppARGB);
 	Gdiplus::Graphics graphics(scaled);
 	Gdiplus::Rect target(0, 0, width, height);
 	Gdiplus::BitmapData data;
-	GLsizei miplevels = Math::Max<uint32_t>(1, (uint32_t)floor(log(Math::Max<double>(width, height)) / 0.69314718055994530941723212));
+	size_t layersize = (size_t)width * height * 4;
 
 	graphics.SetInterpolationMode(Gdiplus::InterpolationModeNearestNeighbor);
 
@@ -2804,15 +2909,11 @@ bool GLCreateTextureArrayFromFiles(const std::string* files, uint32_t numfiles,
 	Gdiplus::ImageAttributes wrapmode;
 	wrapmode.SetWrapMode(Gdiplus::WrapModeTileFlipXY);
 
-	if (srgb)
-		glTexStorage3D(GL_TEXTURE_2D_ARRAY, miplevels, GL_SRGB8_ALPHA8, width, height, numfiles);
-	else
-		glTexStorage3D(GL_TEXTURE_2D_ARRAY, miplevels, GL_RGBA8, width, height, numfiles);
-
-	imgdata = new uint8_t[width * height * 4];
+	pixels.resize(layersize * numfiles);
 
 	for (size_t i = 0; i < bitmaps.size(); ++i) {
 		Gdiplus::Bitmap* bitmap = bitmaps[i];
+		uint8_t* imgdata = pixels.data() + i * layersize;
 
 		graphics.DrawImage(bitmap, target, 0, 0, bitmap->GetWidth(), bitmap->GetHeight(), Gdiplus::UnitPixel, &wrapmode);
 
@@ -2832,18 +2933,45 @@ bool GLCreateTextureArrayFromFiles(const std::string* files, uint32_t numfiles,
 			}
 		}
 		scaled->UnlockBits(&data);
-
-		glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, (GLint)i, width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE, imgdata);
 	}
-	
-	delete[] imgdata;
+
 	delete scaled;
 
 	for (Gdiplus::Bitmap* bitmap : bitmaps)
 		delete bitmap;
+
+	return true;
 #else
 	// TODO:
+	return false;
 #endif
+}
+
+bool GLCreateTextureArrayFromMemory(const void* pixels, GLsizei width, GLsizei height, uint32_t numlayers, bool srgb, GLuint* out)
+{
+	if (out == nullptr || pixels == nullptr || width == 0 || height == 0 || numlayers == 0)
+		return false;
+
+	GLuint		texid		= 0;
+	GLsizei		miplevels	= Math::Max<uint32_t>(1, (uint32_t)floor(log(Math::Max<double>(width, height)) / 0.69314718055994530941723212));
+	size_t		layersize	= (size_t)width * height * 4;
+
+	glGenTextures(1, &texid);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, texid);
+
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+	if (srgb)
+		glTexStorage3D(GL_TEXTURE_2D_ARRAY, miplevels, GL_SRGB8_ALPHA8, width, height, numlayers);
+	else
+		glTexStorage3D(GL_TEXTURE_2D_ARRAY, miplevels, GL_RGBA8, width, height, numlayers);
+
+	for (uint32_t i = 0; i < numlayers; ++i)
+		glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, (GLint)i, width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE, (const uint8_t*)pixels + i * layersize);
 
 	glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
 
@@ -2863,6 +2991,21 @@ bool GLCreateTextureArrayFromFiles(const std::string* files, uint32_t numfiles,
 	return (texid != 0);
 }
 
+bool GLCreateTextureArrayFromFiles(const std::string* files, uint32_t numfiles, bool srgb, GLuint* out)
+{
+	if (out == nullptr)
+		return false;
+
+	std::vector<uint8_t>	pixels;
+	uint32_t				width	= 0;
+	uint32_t				height	= 0;
+
+	if (!GLDecodeTextureArray(files, numfiles, pixels, width, height))
+		return false;
+
+	return GLCreateTextureArrayFromMemory(pixels.data(), width, height, numfiles, srgb, out);
+}
+
 bool GLCreateVolumeTextureFromFile(const char* file, bool srgb, GLuint* out)
 {
 	DDS_Image_Info info;
@@ -225,13 +225,17 @@ class OpenGLMesh
 private:
 	Math::AABox					boundingbox;
 	OpenGLAttributeRange*		subsettable;
+	OpenGLAttributeRange*		lodtable;		// (numlods - 1) * numsubsets, indexed by AttribId
 	OpenGLMaterial*				materials;
 	OpenGLVertexDeclaration		vertexdecl;
+	float*						loderrors;		// object space
 	
 	GLuint						meshoptions;
 	GLuint						numsubsets;
+	GLuint						numlods;
+	GLuint						currentlod;
 	GLuint						numvertices;
-	GLuint						numindices;
+	GLuint						numindices;		// of LOD0, the LOD indices come after them
 	GLuint						vertexbuffer;
 	GLuint						indexbuffer;
 	GLuint						vertexlayout;
@@ -262,6 +266,9 @@ public:
 	void UnlockVertexBuffer();
 	void UnlockIndexBuffer();
 	void SetAttributeTable(const OpenGLAttributeRange* table, GLuint size);
+	void SetLOD(GLuint lod);
+
+	GLuint SelectLOD(float distance, float pixelsperunit, float maxpixelerror = 1.0f) const;
 
 	inline void SetBoundingBox(const Math::AABox& box)	{ boundingbox = box; }
 	inline OpenGLAttributeRange* GetAttributeTable()	{ return subsettable; }
@@ -269,6 +276,8 @@ public:
 	inline const Math::AABox& GetBoundingBox() const	{ return boundingbox; }
 	inline size_t GetNumBytesPerVertex() const			{ return vertexdecl.Stride; }
 	inline GLuint GetNumSubsets() const					{ return numsubsets; }
+	inline GLuint GetNumLODs() const					{ return numlods; }
+	inline float GetLODError(GLuint lod) const			{ return (lod > 0 ? loderrors[lod] : 0.0f); }
 	inline GLuint GetNumVertices() const				{ return numvertices; }
 	inline GLuint GetNumIndices() const					{ return numindices; }
 	inline GLuint GetVertexLayout() const				{ return vertexlayout; }
@@ -467,7 +476,9 @@ bool GLCreateTexture(GLsizei width, GLsizei height, GLint miplevels, OpenGLForma
 bool GLCreateTextureFromDDS(const char* file, bool srgb, GLuint* out);
 bool GLCreateTextureFromFile(const char* file, bool srgb, GLuint* out, GLuint flags = 0);
 bool GLCreateTextureArrayFromFiles(const std::string* files, uint32_t numfiles, bool srgb, GLuint* out);
+bool GLCreateTextureArrayFromMemory(const void* pixels, GLsizei width, GLsizei height, uint32_t numlayers, bool srgb, GLuint* out);	// RGBA8 layers
 bool GLCreateVolumeTextureFromFile(const char* file, bool srgb, GLuint* out);
+bool GLDecodeTextureArray(const std::string* files, uint32_t numfiles, std::vector<uint8_t>& pixels, uint32_t& width, uint32_t& height);	// resized to the largest
 
 OpenGLMesh* GLCreateDebugBox();
 
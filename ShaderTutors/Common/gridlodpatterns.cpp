@@ -0,0 +1,447 @@
+
+#include <cstring>
+#include <unordered_map>
+
+#include "gridlodpatterns.h"
+#include "gl4ext.h"
+#include "threadpool.h"
+#include "profiler.h"
+
+#define STITCH_LEFT		1
+#define STITCH_RIGHT	2
+#define STITCH_BOTTOM	4
+#define STITCH_TOP		8
+
+static uint64_t HashRun(const std::vector<uint32_t>& run)
+{
+	// NOTE: FNV-1a
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (uint32_t index : run) {
+		hash ^= index;
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+static void ParallelRange(ThreadPool* pool, uint32_t count, uint32_t grain, const ThreadPool::RangeCallback& callback)
+{
+	if (pool != nullptr)
+		pool->ParallelFor(count, grain, callback);
+	else if (count > 0)
+		callback(0, count, 0);
+}
+
+// --- GridLODPatterns impl ---------------------------------------------------
+
+GridLODPatterns::GridLODPatterns()
+{
+	workers		= nullptr;
+	meshsize	= 0;
+	numlods		= 0;
+}
+
+GridLODPatterns::~GridLODPatterns()
+{
+}
+
+uint32_t GridLODPatterns::GenerateInnerStrip(uint32_t* idata, int levelsize, uint32_t stitchmask) const
+{
+#define CALC_INNER_INDEX(x, z) \
+	((top + (z)) * (meshsize + 1) + left + (x))
+// END
+
+	int right	= ((stitchmask & STITCH_RIGHT) ? levelsize - 1 : levelsize);
+	int left	= ((stitchmask & STITCH_LEFT) ? 1 : 0);
+	int bottom	= ((stitchmask & STITCH_BOTTOM) ? levelsize - 1 : levelsize);
+	int top		= ((stitchmask & STITCH_TOP) ? 1 : 0);
+
+	int width = right - left;
+	int height = bottom - top;
+	uint32_t numwritten = 0;
+
+	// rows alternate direction, so that the strips can be joined with restarts
+	for (int z = 0; z < height; ++z) {
+		if ((z & 1) == 1) {
+			idata[numwritten++] = CALC_INNER_INDEX(0, z);
+			idata[numwritten++] = CALC_INNER_INDEX(0, z + 1);
+
+			for (int x = 0; x < width; ++x) {
+				idata[numwritten++] = CALC_INNER_INDEX(x + 1, z);
+				idata[numwritten++] = CALC_INNER_INDEX(x + 1, z + 1);
+			}
+		} else {
+			idata[numwritten++] = CALC_INNER_INDEX(width, z + 1);
+			idata[numwritten++] = CALC_INNER_INDEX(width, z);
+
+			for (int x = width - 1; x >= 0; --x) {
+				idata[numwritten++] = CALC_INNER_INDEX(x, z + 1);
+				idata[numwritten++] = CALC_INNER_INDEX(x, z);
+			}
+		}
+
+		idata[numwritten++] = GRIDLODPATTERNS_RESTART;
+	}
+
+#undef CALC_INNER_INDEX
+	return numwritten;
+}
+
+uint32_t GridLODPatterns::GenerateBoundary(uint32_t* idata, int levelsize, const int degrees[4]) const
+{
+#define CALC_BOUNDARY_INDEX(x, z) \
+	((z) * (meshsize + 1) + (x))
+// END
+
+	int deg_left	= degrees[0];
+	int deg_right	= degrees[1];
+	int deg_bottom	= degrees[2];
+	int deg_top		= degrees[3];
+
+	uint32_t numwritten = 0;
+
+	// top edge
+	if (deg_top < levelsize) {
+		int t_step = levelsize / deg_top;
+
+		for (int i = 0; i < levelsize; i += t_step) {
+			idata[numwritten++] = CALC_BOUNDARY_INDEX(i, 0);
+			idata[numwritten++] = CALC_BOUNDARY_INDEX(i + t_step / 2, 1);
+			idata[numwritten++] = CALC_BOUNDARY_INDEX(i + t_step, 0);
+
+			for (int j = 0; j < t_step / 2; ++j) {
+				if (i == 0 && j == 0 && deg_left < levelsize)
+					continue;
+
+				idata[numwritten++] = CALC_BOUNDARY_INDEX(i, 0);
+				idata[numwritten++] = CALC_BOUNDARY_INDEX(i + j, 1);
+				idata[numwritten++] = CALC_BOUNDARY_INDEX(i + j + 1, 1);
+			}
+
+			for (int j = t_step / 2; j < t_step; ++j) {
+				if (i == levelsize - t_step && j == t_step - 1 && deg_right < levelsize)
+					continue;
+
+				idata[numwritten++] = CALC_BOUNDARY_INDEX(i + t_step, 0);
+				idata[numwritten++] = CALC_BOUNDARY_INDEX(i + j, 1);
+				idata[numwritten++] = CALC_BOUNDARY_INDEX(i + j + 1, 1);
+			}
+		}
+	}
+
+	// left edge
+	if (deg_left < levelsize) {
+		int l_step = levelsize / deg_left;
+
+		for (int i = 0; i < levelsize; i += l_step) {
+			idata[numwritten++] = CALC_BOUNDARY_INDEX(0, i);
+			idata[numwritten++] = CALC_BOUNDARY_INDEX(0, i + l_step);
+			idata[numwritten++] = CALC_BOUNDARY_INDEX(1, i + l_step / 2);
+
+			for (int j = 0; j < l_step / 2; ++j) {
+				if (i == 0 && j == 0 && deg_top < levelsize)
+					continue;
+
+				idata[numwritten++] = CALC_BOUNDARY_INDEX(0, i);
+				idata[numwritten++] = CALC_BOUNDARY_INDEX(1, i + j + 1);
+				idata[numwritten++] = CALC_BOUNDARY_INDEX(1, i + j);
+			}
+
+			for (int j = l_step / 2; j < l_step; ++j) {
+				if (i == levelsize - l_step && j == l_step - 1 && deg_bottom < levelsize)
+					continue;
+
+				idata[numwritten++] = CALC_BOUNDARY_INDEX(0, i + l_step);
+				idata[numwritten++] = CALC_BOUNDARY_INDEX(1, i + j + 1);
+				idata[numwritten++] = CALC_BOUNDARY_INDEX(1, i + j);
+			}
+		}
+	}
+
+	// right edge
+	if (deg_right < levelsize) {
+		int r_step = levelsize / deg_right;
+
+		for (int i = 0; i < levelsize; i += r_step) {
+			idata[numwritten++] = CALC_BOUNDARY_INDEX(levelsize, i);
+			idata[numwritten++] = CALC_BOUNDARY_INDEX(levelsize - 1, i + r_step / 2);
+			idata[numwritten++] = CALC_BOUNDARY_INDEX(levelsize, i + r_step);
+
+			for (int j = 0; j < r_step / 2; ++j) {
+				if (i == 0 && j == 0 && deg_top < levelsize)
+					continue;
+
+				idata[numwritten++] = CALC_BOUNDARY_INDEX(levelsize, i);
+				idata[numwritten++] = CALC_BOUNDARY_INDEX(levelsize - 1, i + j);
+				idata[numwritten++] = CALC_BOUNDARY_INDEX(levelsize - 1, i + j + 1);
+			}
+
+			for (int j = r_step / 2; j < r_step; ++j) {
+				if (i == levelsize - r_step && j == r_step - 1 && deg_bottom < levelsize)
+					continue;
+
+				idata[numwritten++] = CALC_BOUNDARY_INDEX(levelsize, i + r_step);
+				idata[numwritten++] = CALC_BOUNDARY_INDEX(levelsize - 1, i + j);
+				idata[numwritten++] = CALC_BOUNDARY_INDEX(levelsize - 1, i + j + 1);
+			}
+		}
+	}
+
+	// bottom edge
+	if (deg_bottom < levelsize) {
+		int b_step = levelsize / deg_bottom;
+
+		for (int i = 0; i < levelsize; i += b_step) {
+			idata[numwritten++] = CALC_BOUNDARY_INDEX(i, levelsize);
+			idata[numwritten++] = CALC_BOUNDARY_INDEX(i + b_step, levelsize);
+			idata[numwritten++] = CALC_BOUNDARY_INDEX(i + b_step / 2, levelsize - 1);
+
+			for (int j = 0; j < b_step / 2; ++j) {
+				if (i == 0 && j == 0 && deg_left < levelsize)
+					continue;
+
+				idata[numwritten++] = CALC_BOUNDARY_INDEX(i, levelsize);
+				idata[numwritten++] = CALC_BOUNDARY_INDEX(i + j + 1, levelsize - 1);
+				idata[numwritten++] = CALC_BOUNDARY_INDEX(i + j, levelsize - 1);
+			}
+
+			for (int j = b_step / 2; j < b_step; ++j) {
+				if (i == levelsize - b_step && j == b_step - 1 && deg_right < levelsize)
+					continue;
+
+				idata[numwritten++] = CALC_BOUNDARY_INDEX(i + b_step, levelsize);
+				idata[numwritten++] = CALC_BOUNDARY_INDEX(i + j + 1, levelsize - 1);
+				idata[numwritten++] = CALC_BOUNDARY_INDEX(i + j, levelsize - 1);
+			}
+		}
+	}
+
+#undef CALC_BOUNDARY_INDEX
+	return numwritten;
+}
+
+void GridLODPatterns::Generate(uint32_t size, uint32_t lodcount)
+{
+	PROFILE_SCOPE("GridLODPatterns::Generate");
+
+	typedef std::unordered_map<uint64_t, std::vector<uint32_t>> RunMap;	// hash -> jobs
+
+	struct JobResult
+	{
+		std::vector<uint32_t>	indices;
+		uint64_t				hash;
+		bool					unique;
+	};
+
+	uint32_t numlevels = (lodcount > 2 ? lodcount - 2 : 0);
+	uint32_t numinnerjobs = numlevels * 16;
+	uint32_t numboundaryjobs = numlevels * 3 * 3 * 3 * 3;
+	uint32_t numindices = 0;
+
+	std::vector<JobResult>	results(numinnerjobs + numboundaryjobs);
+	std::vector<IndexRun>	jobruns(results.size());
+	RunMap					uniqueruns;
+
+	meshsize = size;
+	numlods = lodcount;
+
+	// generate every run into its own list (inner strips first, they are the largest)
+	ParallelRange(workers, (uint32_t)results.size(), 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+		for (uint32_t i = begin; i < end; ++i) {
+			std::vector<uint32_t>& list = results[i].indices;
+			uint32_t numwritten;
+
+			if (i < numinnerjobs) {
+				int levelsize = (int)(size >> (i / 16));
+
+				list.resize(levelsize * (2 * levelsize + 3));
+				numwritten = GenerateInnerStrip(list.data(), levelsize, i % 16);
+			} else {
+				uint32_t level = (i - numinnerjobs) / 81;
+				uint32_t pattern = (i - numinnerjobs) % 81;
+				int levelsize = (int)(size >> level);
+
+				int degrees[4] = {
+					levelsize >> (pattern / 27),
+					levelsize >> ((pattern / 9) % 3),
+					levelsize >> ((pattern / 3) % 3),
+					levelsize >> (pattern % 3)
+				};
+
+				// NOTE: at most 6 * levelsize indices per edge
+				list.resize(24 * levelsize);
+				numwritten = GenerateBoundary(list.data(), levelsize, degrees);
+			}
+
+			list.resize(numwritten);
+			results[i].hash = HashRun(list);
+		}
+	});
+
+	// find identical runs (in job order, so that the layout doesn't depend on the threads)
+	for (size_t i = 0; i < results.size(); ++i) {
+		JobResult& result = results[i];
+		IndexRun& run = jobruns[i];
+
+		run.start = 0;
+		run.count = (uint32_t)result.indices.size();
+		result.unique = false;
+
+		if (run.count == 0)
+			continue;
+
+		std::vector<uint32_t>& candidates = uniqueruns[result.hash];
+		bool found = false;
+
+		for (uint32_t other : candidates) {
+			if (results[other].indices == result.indices) {
+				run.start = jobruns[other].start;
+				found = true;
+
+				break;
+			}
+		}
+
+		if (!found) {
+			run.start = numindices;
+			result.unique = true;
+
+			numindices += run.count;
+			candidates.push_back((uint32_t)i);
+		}
+	}
+
+	indices.resize(numindices);
+
+	ParallelRange(workers, (uint32_t)results.size(), 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+		for (uint32_t i = begin; i < end; ++i) {
+			if (results[i].unique)
+				memcpy(indices.data() + jobruns[i].start, results[i].indices.data(), jobruns[i].count * 4);
+
+			std::vector<uint32_t>().swap(results[i].indices);
+		}
+	});
+
+	// subset 2 * pattern is the inner strip, the next one is the boundary
+	runs.resize(numboundaryjobs * 2);
+
+	for (uint32_t level = 0; level < numlevels; ++level) {
+		for (uint32_t pattern = 0; pattern < 81; ++pattern) {
+			uint32_t stitchmask = 0;
+			uint32_t subset = (level * 81 + pattern) * 2;
+
+			stitchmask |= ((pattern / 27) > 0 ? STITCH_LEFT : 0);
+			stitchmask |= (((pattern / 9) % 3) > 0 ? STITCH_RIGHT : 0);
+			stitchmask |= (((pattern / 3) % 3) > 0 ? STITCH_BOTTOM : 0);
+			stitchmask |= ((pattern % 3) > 0 ? STITCH_TOP : 0);
+
+			runs[subset + 0] = jobruns[level * 16 + stitchmask];
+			runs[subset + 1] = jobruns[numinnerjobs + level * 81 + pattern];
+		}
+	}
+}
+
+bool GridLODPatterns::Load(const char* file, uint32_t size, uint32_t lodcount)
+{
+	PROFILE_SCOPE("GridLODPatterns::Load");
+
+	FileHeader	header;
+	FILE*		infile = nullptr;
+	uint32_t	numlevels = (lodcount > 2 ? lodcount - 2 : 0);
+	bool		success = false;
+
+#ifdef _MSC_VER
+	fopen_s(&infile, file, "rb");
+#else
+	infile = fopen(file, "rb");
+#endif
+
+	if (!infile)
+		return false;
+
+	if (fread(&header, sizeof(FileHeader), 1, infile) != 1)
+		goto _fail;
+
+	if (header.magic != GRIDLODPATTERNS_MAGIC || header.version != GRIDLODPATTERNS_VERSION)
+		goto _fail;
+
+	if (header.meshsize != size || header.numlods != lodcount || header.numsubsets != numlevels * 3 * 3 * 3 * 3 * 2)
+		goto _fail;
+
+	runs.resize(header.numsubsets);
+	indices.resize(header.numindices);
+
+	if (fread(runs.data(), sizeof(IndexRun), runs.size(), infile) != runs.size())
+		goto _fail;
+
+	if (fread(indices.data(), 4, indices.size(), infile) != indices.size())
+		goto _fail;
+
+	for (const IndexRun& run : runs) {
+		if ((uint64_t)run.start + run.count > header.numindices)
+			goto _fail;
+	}
+
+	meshsize = size;
+	numlods = lodcount;
+	success = true;
+
+_fail:
+	if (!success) {
+		runs.clear();
+		indices.clear();
+	}
+
+	fclose(infile);
+	return success;
+}
+
+bool GridLODPatterns::Save(const char* file) const
+{
+	FileHeader	header;
+	FILE*		outfile = nullptr;
+	bool		success;
+
+	header.magic		= GRIDLODPATTERNS_MAGIC;
+	header.version		= GRIDLODPATTERNS_VERSION;
+	header.meshsize		= meshsize;
+	header.numlods		= numlods;
+	header.numsubsets	= (uint32_t)runs.size();
+	header.numindices	= (uint32_t)indices.size();
+
+#ifdef _MSC_VER
+	fopen_s(&outfile, file, "wb");
+#else
+	outfile = fopen(file, "wb");
+#endif
+
+	if (!outfile)
+		return false;
+
+	success = (fwrite(&header, sizeof(FileHeader), 1, outfile) == 1);
+	success = success && (fwrite(runs.data(), sizeof(IndexRun), runs.size(), outfile) == runs.size());
+	success = success && (fwrite(indices.data(), 4, indices.size(), outfile) == indices.size());
+
+	fclose(outfile);
+
+	if (!success)
+		remove(file);
+
+	return success;
+}
+
+void GridLODPatterns::GetAttributeTable(OpenGLAttributeRange* outtable) const
+{
+	for (size_t i = 0; i < runs.size(); ++i) {
+		OpenGLAttributeRange& subset = outtable[i];
+
+		subset.AttribId			= (GLuint)i;
+		subset.Enabled			= (runs[i].count > 0);
+		subset.IndexCount		= runs[i].count;
+		subset.IndexStart		= runs[i].start;
+		subset.PrimitiveType	= ((i % 2) == 0 ? GL_TRIANGLE_STRIP : GL_TRIANGLES);
+		subset.VertexCount		= 0;
+		subset.VertexStart		= 0;
+	}
+}
@@ -0,0 +1,77 @@
+
+#ifndef _GRIDLODPATTERNS_H_
+#define _GRIDLODPATTERNS_H_
+
+#include <cstdint>
+#include <vector>
+
+#define GRIDLODPATTERNS_MAGIC		0x50444c47	// "GLDP"
+#define GRIDLODPATTERNS_VERSION		1
+#define GRIDLODPATTERNS_RESTART		UINT32_MAX	// primitive restart index of the strips
+
+struct OpenGLAttributeRange;
+class ThreadPool;
+
+/**
+ * \brief Index patterns of a regular grid patch for every LOD and stitching combination
+ *
+ * Each LOD (except the last two) has 3^4 patterns, one for every combination of the left, right,
+ * bottom and top neighbour degrees (same, half or quarter resolution, see TerrainQuadTree::FindSubsetPattern).
+ * Each pattern has two subsets: an inner triangle strip with primitive restarts, then a boundary
+ * triangle list. Vertices are indexed as z * (meshsize + 1) + x. Coarser levels use the top-left
+ * corner of the grid.
+ *
+ * The inner strip only depends on which edges are stitched, so runs with identical indices are
+ * stored once.
+ */
+class GridLODPatterns
+{
+	struct IndexRun
+	{
+		uint32_t	start;
+		uint32_t	count;
+	};
+
+	struct FileHeader
+	{
+		uint32_t	magic;
+		uint32_t	version;
+		uint32_t	meshsize;
+		uint32_t	numlods;
+		uint32_t	numsubsets;
+		uint32_t	numindices;
+	};
+
+private:
+	std::vector<uint32_t>	indices;
+	std::vector<IndexRun>	runs;		// per subset (can overlap)
+	ThreadPool*				workers;
+	uint32_t				meshsize;
+	uint32_t				numlods;
+
+	uint32_t GenerateInnerStrip(uint32_t* idata, int levelsize, uint32_t stitchmask) const;
+	uint32_t GenerateBoundary(uint32_t* idata, int levelsize, const int degrees[4]) const;
+
+public:
+	GridLODPatterns();
+	~GridLODPatterns();
+
+	void Generate(uint32_t size, uint32_t lodcount);
+	bool Load(const char* file, uint32_t size, uint32_t lodcount);	// fails if the file was made for another size
+	bool Save(const char* file) const;
+
+	void GetAttributeTable(OpenGLAttributeRange* outtable) const;	// GetNumSubsets() entries
+
+	inline void SetThreadPool(ThreadPool* pool)		{ workers = pool; }
+
+	inline const uint32_t* GetIndices() const		{ return indices.data(); }
+	inline uint32_t GetNumIndices() const			{ return (uint32_t)indices.size(); }
+	inline uint32_t GetNumSubsets() const			{ return (uint32_t)runs.size(); }
+
+	// NOTE: pattern is left, right, bottom, top (0: same, 1: half, 2: quarter resolution neighbour)
+	static inline uint32_t GetPatternIndex(int lod, const int pattern[4]) {
+		return (uint32_t)(lod * 3 * 3 * 3 * 3 + pattern[0] * 3 * 3 * 3 + pattern[1] * 3 * 3 + pattern[2] * 3 + pattern[3]);
+	}
+};
+
+#endif
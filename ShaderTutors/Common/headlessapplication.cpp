@@ -0,0 +1,446 @@
+
+#include <algorithm>
+#include <chrono>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+#include "headlessapplication.h"
+#include "profiler.h"
+
+#define DEFAULT_TIMESTEP	0.0333	// same as the Win32 loop
+#define DEFAULT_NUM_FRAMES	300
+#define MAX_LINE_LENGTH		256
+
+typedef std::chrono::steady_clock HeadlessClock;
+
+static float ElapsedMicroseconds(const HeadlessClock::time_point& start)
+{
+	return std::chrono::duration<float, std::micro>(HeadlessClock::now() - start).count();
+}
+
+static bool ParseKeyCode(const char* str, int32_t& out)
+{
+	// single letter or digit, otherwise a number (decimal or 0x...)
+	if (isalnum(str[0]) && str[1] == 0) {
+		out = toupper(str[0]);
+		return true;
+	}
+
+	char* end = nullptr;
+	out = (int32_t)strtol(str, &end, 0);
+
+	return (end != str);
+}
+
+static bool ParseMouseButton(const char* str, int32_t& out)
+{
+	if (strcmp(str, "left") == 0)
+		out = MouseButtonLeft;
+	else if (strcmp(str, "right") == 0)
+		out = MouseButtonRight;
+	else if (strcmp(str, "middle") == 0)
+		out = MouseButtonMiddle;
+	else
+		out = atoi(str);
+
+	return (out == MouseButtonLeft || out == MouseButtonRight || out == MouseButtonMiddle);
+}
+
+// --- HeadlessApplication::TimingHistogram impl ------------------------------
+
+HeadlessApplication::TimingHistogram::TimingHistogram()
+{
+	Clear();
+}
+
+void HeadlessApplication::TimingHistogram::Add(float microsecs)
+{
+	uint32_t index = 0;
+	float limit = 1.0f;
+
+	while (microsecs >= limit && index < NUM_TIMING_BUCKETS - 1) {
+		limit *= 2.0f;
+		++index;
+	}
+
+	samples.push_back(microsecs);
+
+	++buckets[index];
+	total += microsecs;
+}
+
+void HeadlessApplication::TimingHistogram::Clear()
+{
+	samples.clear();
+	memset(buckets, 0, sizeof(buckets));
+
+	total = 0;
+}
+
+void HeadlessApplication::TimingHistogram::WriteJSON(FILE* outfile, const char* name) const
+{
+	std::vector<float> sorted(samples);
+	float percentiles[3] = { 0, 0, 0 };
+	float minvalue = 0, maxvalue = 0;
+	size_t count = sorted.size();
+
+	if (count > 0) {
+		std::sort(sorted.begin(), sorted.end());
+
+		minvalue = sorted.front();
+		maxvalue = sorted.back();
+
+		// nearest rank
+		percentiles[0] = sorted[(count * 50 + 99) / 100 - 1];
+		percentiles[1] = sorted[(count * 90 + 99) / 100 - 1];
+		percentiles[2] = sorted[(count * 99 + 99) / 100 - 1];
+	}
+
+	fprintf(outfile, "\t\t\"%s\": {\n", name);
+	fprintf(outfile, "\t\t\t\"count\": %zu,\n", count);
+	fprintf(outfile, "\t\t\t\"total_ms\": %.3f,\n", total * 1e-3);
+	fprintf(outfile, "\t\t\t\"mean_us\": %.3f,\n", (count > 0 ? total / count : 0.0));
+	fprintf(outfile, "\t\t\t\"min_us\": %.3f,\n", minvalue);
+	fprintf(outfile, "\t\t\t\"max_us\": %.3f,\n", maxvalue);
+	fprintf(outfile, "\t\t\t\"p50_us\": %.3f,\n", percentiles[0]);
+	fprintf(outfile, "\t\t\t\"p90_us\": %.3f,\n", percentiles[1]);
+	fprintf(outfile, "\t\t\t\"p99_us\": %.3f,\n", percentiles[2]);
+
+	// bucket i counts samples in [2^(i-1), 2^i) us
+	fprintf(outfile, "\t\t\t\"histogram_us\": [");
+
+	for (uint32_t i = 0; i < NUM_TIMING_BUCKETS; ++i) {
+		if (i > 0)
+			fprintf(outfile, ", ");
+
+		fprintf(outfile, "[%u, %u]", (1u << i), buckets[i]);
+	}
+
+	fprintf(outfile, "]\n\t\t}");
+}
+
+// --- HeadlessApplication impl -----------------------------------------------
+
+HeadlessApplication::HeadlessApplication(uint32_t width, uint32_t height)
+{
+	const char* scriptfile = getenv("HEADLESS_SCRIPT");
+
+	clientwidth		= width;
+	clientheight	= height;
+	timestep		= DEFAULT_TIMESTEP;
+	simulatedtime	= 0;
+	numframes		= 0;
+	numupdates		= 0;
+
+	memset(&inputstate, 0, sizeof(InputState));
+	SetTimingsFile(getenv("HEADLESS_TIMINGS"));
+
+	if (scriptfile == nullptr || !LoadScript(scriptfile))
+		AddFrames(DEFAULT_NUM_FRAMES, 1.0 / 60.0);
+}
+
+HeadlessApplication::~HeadlessApplication()
+{
+}
+
+bool HeadlessApplication::LoadScript(const char* file)
+{
+	FILE* infile = fopen(file, "rb");
+	char line[MAX_LINE_LENGTH];
+	char command[32], arg1[32], arg2[32];
+	uint32_t linenumber = 0;
+	bool success = true;
+
+	if (infile == nullptr) {
+		printf("HeadlessApplication::LoadScript(): Could not open '%s'\n", file);
+		return false;
+	}
+
+	ClearScript();
+
+	while (fgets(line, MAX_LINE_LENGTH, infile) != nullptr) {
+		HeadlessEvent ev;
+		char* comment = strchr(line, '#');
+
+		++linenumber;
+
+		if (comment != nullptr)
+			*comment = 0;
+
+		int numargs = sscanf(line, "%31s %31s %31s", command, arg1, arg2) - 1;
+
+		if (numargs < 0)
+			continue;
+
+		ev.value = 0;
+		ev.args[0] = ev.args[1] = 0;
+
+		bool valid = true;
+
+		if (strcmp(command, "frame") == 0) {
+			ev.type = HeadlessEventTypeFrame;
+			ev.value = (numargs > 0 ? atof(arg1) : 0);
+			ev.args[0] = (numargs > 1 ? atoi(arg2) : 1);
+
+			valid = (ev.value > 0 && ev.args[0] > 0);
+		} else if (strcmp(command, "timestep") == 0) {
+			ev.type = HeadlessEventTypeTimestep;
+			ev.value = (numargs > 0 ? atof(arg1) : 0);
+
+			valid = (ev.value > 0);
+		} else if (strcmp(command, "keydown") == 0 || strcmp(command, "keyup") == 0) {
+			ev.type = (command[3] == 'd' ? HeadlessEventTypeKeyDown : HeadlessEventTypeKeyUp);
+			valid = (numargs > 0 && ParseKeyCode(arg1, ev.args[0]));
+		} else if (strcmp(command, "mousemove") == 0) {
+			ev.type = HeadlessEventTypeMouseMove;
+			ev.args[0] = (numargs > 0 ? atoi(arg1) : 0);
+			ev.args[1] = (numargs > 1 ? atoi(arg2) : 0);
+
+			valid = (numargs > 1);
+		} else if (strcmp(command, "mousescroll") == 0) {
+			ev.type = HeadlessEventTypeMouseScroll;
+			ev.args[0] = (numargs > 0 ? atoi(arg1) : 0);
+
+			valid = (numargs > 0);
+		} else if (strcmp(command, "mousedown") == 0 || strcmp(command, "mouseup") == 0) {
+			ev.type = (command[5] == 'd' ? HeadlessEventTypeMouseDown : HeadlessEventTypeMouseUp);
+			valid = (numargs > 0 && ParseMouseButton(arg1, ev.args[0]));
+		} else if (strcmp(command, "quit") == 0) {
+			ev.type = HeadlessEventTypeQuit;
+		} else {
+			valid = false;
+		}
+
+		if (!valid) {
+			printf("HeadlessApplication::LoadScript(): Invalid command in '%s' line %u\n", file, linenumber);
+			success = false;
+
+			break;
+		}
+
+		script.push_back(ev);
+	}
+
+	fclose(infile);
+
+	if (!success)
+		ClearScript();
+
+	return success;
+}
+
+bool HeadlessApplication::WriteTimings(const char* file) const
+{
+	const char* names[HeadlessPhaseCount] = { "update", "render", "callbacks", "frame" };
+	FILE* outfile = fopen(file, "wb");
+
+	if (outfile == nullptr)
+		return false;
+
+	fprintf(outfile, "{\n");
+	fprintf(outfile, "\t\"frames\": %u,\n", numframes);
+	fprintf(outfile, "\t\"updates\": %u,\n", numupdates);
+	fprintf(outfile, "\t\"timestep\": %.6f,\n", timestep);
+	fprintf(outfile, "\t\"simulated_time\": %.6f,\n", simulatedtime);
+	fprintf(outfile, "\t\"phases\": {\n");
+
+	for (int i = 0; i < HeadlessPhaseCount; ++i) {
+		timings[i].WriteJSON(outfile, names[i]);
+		fprintf(outfile, (i < HeadlessPhaseCount - 1) ? ",\n" : "\n");
+	}
+
+	fprintf(outfile, "\t}\n}\n");
+	fclose(outfile);
+
+	return true;
+}
+
+void HeadlessApplication::AddFrames(uint32_t count, double delta)
+{
+	HeadlessEvent ev;
+
+	ev.type		= HeadlessEventTypeFrame;
+	ev.value	= delta;
+	ev.args[0]	= (int32_t)count;
+	ev.args[1]	= 0;
+
+	script.push_back(ev);
+}
+
+void HeadlessApplication::AddEvent(const HeadlessEvent& ev)
+{
+	script.push_back(ev);
+}
+
+void HeadlessApplication::ClearScript()
+{
+	script.clear();
+}
+
+bool HeadlessApplication::DispatchEvent(const HeadlessEvent& ev)
+{
+	switch (ev.type) {
+	case HeadlessEventTypeKeyDown:
+		if (KeyDownCallback != nullptr)
+			KeyDownCallback((KeyCode)ev.args[0]);
+
+		break;
+
+	case HeadlessEventTypeKeyUp:
+		if (KeyUpCallback != nullptr)
+			KeyUpCallback((KeyCode)ev.args[0]);
+
+		// NOTE: Escape closes the window in the Win32 loop
+		if (ev.args[0] == KeyCodeEscape)
+			return false;
+
+		break;
+
+	case HeadlessEventTypeMouseMove: {
+		int16_t dx = (int16_t)(ev.args[0] - inputstate.X);
+		int16_t dy = (int16_t)(ev.args[1] - inputstate.Y);
+
+		inputstate.X = ev.args[0];
+		inputstate.Y = ev.args[1];
+
+		if (MouseMoveCallback != nullptr)
+			MouseMoveCallback(inputstate.X, inputstate.Y, dx, dy);
+		} break;
+
+	case HeadlessEventTypeMouseScroll:
+		if (MouseScrollCallback != nullptr)
+			MouseScrollCallback(inputstate.X, inputstate.Y, (int16_t)ev.args[0]);
+
+		break;
+
+	case HeadlessEventTypeMouseDown:
+		inputstate.Button |= ev.args[0];
+
+		if (MouseDownCallback != nullptr)
+			MouseDownCallback((MouseButton)ev.args[0], inputstate.X, inputstate.Y);
+
+		break;
+
+	case HeadlessEventTypeMouseUp:
+		inputstate.Button &= (~ev.args[0]);
+
+		if (MouseUpCallback != nullptr)
+			MouseUpCallback((MouseButton)ev.args[0], inputstate.X, inputstate.Y);
+
+		break;
+
+	case HeadlessEventTypeQuit:
+		return false;
+
+	default:
+		break;
+	}
+
+	return true;
+}
+
+bool HeadlessApplication::InitializeDriverInterface(GraphicsAPI api)
+{
+	// NOTE: there is no device, samples should only use CPU-side code
+	return (api == GraphicsAPINone);
+}
+
+bool HeadlessApplication::Present()
+{
+	return true;
+}
+
+void HeadlessApplication::Run()
+{
+	if (InitSceneCallback != nullptr) {
+		if (!InitSceneCallback())
+			return;
+	}
+
+	double accum = 0;
+	bool running = true;
+
+	PROFILE_THREAD_NAME("Main");
+
+	for (size_t i = 0; i < script.size() && running; ++i) {
+		const HeadlessEvent& ev = script[i];
+
+		if (ev.type == HeadlessEventTypeTimestep) {
+			timestep = ev.value;
+			continue;
+		} else if (ev.type != HeadlessEventTypeFrame) {
+			pending.push_back(ev);
+			continue;
+		}
+
+		for (int32_t j = 0; j < ev.args[0] && running; ++j) {
+			PROFILE_SCOPE("HeadlessApplication::Frame");
+
+			HeadlessClock::time_point framestart = HeadlessClock::now();
+			double delta = ev.value;
+
+			accum += delta;
+			simulatedtime += delta;
+
+			while (accum > timestep) {
+				accum -= timestep;
+
+				if (!pending.empty()) {
+					HeadlessClock::time_point start = HeadlessClock::now();
+
+					for (size_t k = 0; k < pending.size() && running; ++k)
+						running = DispatchEvent(pending[k]);
+
+					pending.clear();
+					timings[HeadlessPhaseCallbacks].Add(ElapsedMicroseconds(start));
+				}
+
+				if (!running)
+					break;
+
+				if (UpdateCallback != nullptr) {
+					HeadlessClock::time_point start = HeadlessClock::now();
+
+					UpdateCallback((float)timestep);
+					timings[HeadlessPhaseUpdate].Add(ElapsedMicroseconds(start));
+				}
+
+				++numupdates;
+			}
+
+			if (running && RenderCallback != nullptr) {
+				HeadlessClock::time_point start = HeadlessClock::now();
+
+				RenderCallback((float)(accum / timestep), (float)delta);
+				timings[HeadlessPhaseRender].Add(ElapsedMicroseconds(start));
+			}
+
+			timings[HeadlessPhaseFrame].Add(ElapsedMicroseconds(framestart));
+			++numframes;
+
+			PROFILE_COLLECT();
+		}
+	}
+
+	if (UninitSceneCallback != nullptr)
+		UninitSceneCallback();
+
+	if (!timingsfile.empty()) {
+		if (!WriteTimings(timingsfile.c_str()))
+			printf("HeadlessApplication::Run(): Could not write '%s'\n", timingsfile.c_str());
+	}
+
+#ifdef ENABLE_PROFILER
+	const char* tracefile = getenv("PROFILER_TRACE");
+
+	if (tracefile != nullptr)
+		PROFILE_WRITE_TRACE(tracefile);
+#endif
+}
+
+void HeadlessApplication::SetTitle(const char* title)
+{
+	// NOTE: CI logs are easier to follow with this
+	printf("%s\n", title);
+}
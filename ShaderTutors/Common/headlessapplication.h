@@ -0,0 +1,136 @@
+
+#ifndef _HEADLESSAPPLICATION_H_
+#define _HEADLESSAPPLICATION_H_
+
+#include <vector>
+#include <string>
+
+#include "application.h"
+
+#define NUM_TIMING_BUCKETS	24	// powers of 2 in microseconds
+
+enum HeadlessEventType
+{
+	HeadlessEventTypeFrame = 0,		// advances the clock (value = delta, args[0] = count)
+	HeadlessEventTypeTimestep,		// value = fixed update step
+	HeadlessEventTypeKeyDown,
+	HeadlessEventTypeKeyUp,
+	HeadlessEventTypeMouseMove,
+	HeadlessEventTypeMouseScroll,
+	HeadlessEventTypeMouseDown,
+	HeadlessEventTypeMouseUp,
+	HeadlessEventTypeQuit
+};
+
+enum HeadlessPhase
+{
+	HeadlessPhaseUpdate = 0,
+	HeadlessPhaseRender,			// CPU side of RenderCallback
+	HeadlessPhaseCallbacks,			// input callbacks
+	HeadlessPhaseFrame,
+	HeadlessPhaseCount
+};
+
+struct HeadlessEvent
+{
+	HeadlessEventType	type;
+	double				value;
+	int32_t				args[2];
+};
+
+/**
+ * \brief Application without a window, driven by a script
+ *
+ * The script is a list of frames (with their delta time) and input events, so every
+ * run sees the same clock, the same updates and the same input. Like the Win32 loop,
+ * input is dispatched before each fixed update and RenderCallback is called once per
+ * frame with the interpolation factor. Script commands (one per line, # is a comment):
+ *
+ *   timestep 0.0333      fixed update step
+ *   frame 0.016 [count]  run a frame (or count frames) with the given delta
+ *   keydown W / keyup 0x57
+ *   mousemove 100 200
+ *   mousedown left / mouseup right
+ *   mousescroll -1
+ *   quit
+ *
+ * There is no device, so InitializeDriverInterface only accepts GraphicsAPINone.
+ *
+ * Environment: HEADLESS_SCRIPT is loaded on construction (otherwise 300 frames at
+ * 60 Hz are run), HEADLESS_TIMINGS is the JSON file written after Run. The Chrome
+ * trace goes to PROFILER_TRACE, as with the Win32 loop (see profiler.h).
+ */
+class HeadlessApplication : public Application
+{
+	class TimingHistogram
+	{
+	private:
+		std::vector<float>	samples;	// in microseconds
+		uint32_t			buckets[NUM_TIMING_BUCKETS];
+		double				total;
+
+	public:
+		TimingHistogram();
+
+		void Add(float microsecs);
+		void Clear();
+		void WriteJSON(FILE* outfile, const char* name) const;
+	};
+
+	struct InputState
+	{
+		uint8_t Button;
+		int32_t X, Y;
+	};
+
+	typedef std::vector<HeadlessEvent> EventList;
+
+private:
+	EventList			script;
+	EventList			pending;	// input waiting for the next update
+	TimingHistogram		timings[HeadlessPhaseCount];
+	InputState			inputstate;
+	std::string			timingsfile;
+	double				timestep;
+	double				simulatedtime;
+	uint32_t			clientwidth;
+	uint32_t			clientheight;
+	uint32_t			numframes;
+	uint32_t			numupdates;
+
+	bool DispatchEvent(const HeadlessEvent& ev);	// false if the app should quit
+
+public:
+	HeadlessApplication(uint32_t width, uint32_t height);
+	~HeadlessApplication();
+
+	bool LoadScript(const char* file);
+	bool WriteTimings(const char* file) const;
+
+	void AddFrames(uint32_t count, double delta);
+	void AddEvent(const HeadlessEvent& ev);
+	void ClearScript();
+
+	bool InitializeDriverInterface(GraphicsAPI api) override;
+	bool Present() override;
+
+	void Run() override;
+	void SetTitle(const char* title) override;
+
+	uint8_t GetMouseButtonState() const override	{ return inputstate.Button; }
+	uint32_t GetClientWidth() const override		{ return clientwidth; }
+	uint32_t GetClientHeight() const override		{ return clientheight; }
+
+	void* GetHandle() const override				{ return nullptr; }
+	void* GetDriverInterface() const override		{ return nullptr; }
+	void* GetLogicalDevice() const override			{ return nullptr; }
+	void* GetSwapChain() const override				{ return nullptr; }
+	void* GetDeviceContext() const override			{ return nullptr; }
+
+	inline void SetFixedTimestep(double step)		{ timestep = step; }
+	inline void SetTimingsFile(const char* file)	{ timingsfile = (file ? file : ""); }
+	inline uint32_t GetNumFrames() const			{ return numframes; }
+	inline uint32_t GetNumUpdates() const			{ return numupdates; }
+};
+
+#endif
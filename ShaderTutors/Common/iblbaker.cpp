@@ -0,0 +1,699 @@
+
+#include "iblbaker.h"
+#include "dds.h"
+#include "gl4ext.h"
+#include "threadpool.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#	include <emmintrin.h>
+#	define IBLBAKER_SSE2
+#endif
+
+// NOTE: the DDS formats are GLFMT_* (dds.cpp is compiled with OPENGL in the GL samples)
+
+struct IBLBaker::CubeLevel
+{
+	std::vector<float>	texels;		// RGBA, face by face
+	uint32_t			size;
+};
+
+struct IBLBaker::SpecularSample
+{
+	Math::Vector3	dir;		// in tangent space (n = v = r)
+	float			weight;		// dot(n, l)
+	float			lod;		// in the mip chain of the environment
+};
+
+// --- Texel helpers ----------------------------------------------------------
+
+#ifdef IBLBAKER_SSE2
+typedef __m128 Texel4;
+
+static inline Texel4 Load4(const float* p)						{ return _mm_loadu_ps(p); }
+static inline Texel4 Splat4(float f)							{ return _mm_set1_ps(f); }
+static inline Texel4 Set4(const Math::Vector3& v)				{ return _mm_setr_ps(v.x, v.y, v.z, 0.0f); }
+static inline Texel4 Add4(Texel4 a, Texel4 b)					{ return _mm_add_ps(a, b); }
+static inline Texel4 Mul4(Texel4 a, Texel4 b)					{ return _mm_mul_ps(a, b); }
+static inline Texel4 Mad4(Texel4 a, Texel4 b, Texel4 c)			{ return _mm_add_ps(_mm_mul_ps(a, b), c); }
+static inline Texel4 Lerp4(Texel4 a, Texel4 b, Texel4 s)		{ return _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), s)); }
+static inline void Store4(float* p, Texel4 a)					{ _mm_storeu_ps(p, a); }
+#else
+struct Texel4
+{
+	float v[4];
+};
+
+static inline Texel4 Load4(const float* p)						{ return { p[0], p[1], p[2], p[3] }; }
+static inline Texel4 Splat4(float f)							{ return { f, f, f, f }; }
+static inline Texel4 Set4(const Math::Vector3& v)				{ return { v.x, v.y, v.z, 0.0f }; }
+static inline Texel4 Add4(Texel4 a, Texel4 b)					{ return { a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2], a.v[3] + b.v[3] }; }
+static inline Texel4 Mul4(Texel4 a, Texel4 b)					{ return { a.v[0] * b.v[0], a.v[1] * b.v[1], a.v[2] * b.v[2], a.v[3] * b.v[3] }; }
+static inline Texel4 Mad4(Texel4 a, Texel4 b, Texel4 c)			{ return { a.v[0] * b.v[0] + c.v[0], a.v[1] * b.v[1] + c.v[1], a.v[2] * b.v[2] + c.v[2], a.v[3] * b.v[3] + c.v[3] }; }
+static inline Texel4 Lerp4(Texel4 a, Texel4 b, Texel4 s)		{ return { a.v[0] + (b.v[0] - a.v[0]) * s.v[0], a.v[1] + (b.v[1] - a.v[1]) * s.v[1], a.v[2] + (b.v[2] - a.v[2]) * s.v[2], a.v[3] + (b.v[3] - a.v[3]) * s.v[3] }; }
+static inline void Store4(float* p, Texel4 a)					{ p[0] = a.v[0]; p[1] = a.v[1]; p[2] = a.v[2]; p[3] = a.v[3]; }
+#endif
+
+// --- Cubemap helpers --------------------------------------------------------
+
+static void FaceToDirection(Math::Vector3& out, uint32_t face, float s, float t)
+{
+	// NOTE: D3D/GL cubemap layout, s and t are in [-1, 1] (t points down)
+	switch (face) {
+	case 0:		out = Math::Vector3(1, -t, -s);		break;
+	case 1:		out = Math::Vector3(-1, -t, s);		break;
+	case 2:		out = Math::Vector3(s, 1, t);		break;
+	case 3:		out = Math::Vector3(s, -1, -t);		break;
+	case 4:		out = Math::Vector3(s, -t, 1);		break;
+	default:	out = Math::Vector3(-s, -t, -1);	break;
+	}
+
+	Math::Vec3Normalize(out, out);
+}
+
+static uint32_t DirectionToFace(float& u, float& v, const Math::Vector3& dir)
+{
+	float ax = fabsf(dir.x);
+	float ay = fabsf(dir.y);
+	float az = fabsf(dir.z);
+	float ma, sc, tc;
+	uint32_t face;
+
+	if (ax >= ay && ax >= az) {
+		face = (dir.x > 0 ? 0 : 1);
+		ma = ax;
+		sc = (dir.x > 0 ? -dir.z : dir.z);
+		tc = -dir.y;
+	} else if (ay >= az) {
+		face = (dir.y > 0 ? 2 : 3);
+		ma = ay;
+		sc = dir.x;
+		tc = (dir.y > 0 ? dir.z : -dir.z);
+	} else {
+		face = (dir.z > 0 ? 4 : 5);
+		ma = az;
+		sc = (dir.z > 0 ? dir.x : -dir.x);
+		tc = -dir.y;
+	}
+
+	u = 0.5f * (sc / ma + 1.0f);
+	v = 0.5f * (tc / ma + 1.0f);
+
+	return face;
+}
+
+static float AreaElement(float x, float y)
+{
+	return atan2f(x * y, sqrtf(x * x + y * y + 1.0f));
+}
+
+static float TexelSolidAngle(float s, float t, float halftexel)
+{
+	float x0 = s - halftexel;
+	float x1 = s + halftexel;
+	float y0 = t - halftexel;
+	float y1 = t + halftexel;
+
+	return AreaElement(x0, y0) - AreaElement(x0, y1) - AreaElement(x1, y0) + AreaElement(x1, y1);
+}
+
+static Texel4 SampleBilinear(const float* face, uint32_t size, float u, float v)
+{
+	// NOTE: clamps to the edges of the face (no seamless filtering)
+	float fx = Math::Clamp(u * size - 0.5f, 0.0f, (float)(size - 1));
+	float fy = Math::Clamp(v * size - 0.5f, 0.0f, (float)(size - 1));
+
+	uint32_t x0 = (uint32_t)fx;
+	uint32_t y0 = (uint32_t)fy;
+	uint32_t x1 = Math::Min<uint32_t>(x0 + 1, size - 1);
+	uint32_t y1 = Math::Min<uint32_t>(y0 + 1, size - 1);
+
+	const float* row0 = face + y0 * size * 4;
+	const float* row1 = face + y1 * size * 4;
+
+	Texel4 sx = Splat4(fx - x0);
+	Texel4 top = Lerp4(Load4(row0 + x0 * 4), Load4(row0 + x1 * 4), sx);
+	Texel4 bottom = Lerp4(Load4(row1 + x0 * 4), Load4(row1 + x1 * 4), sx);
+
+	return Lerp4(top, bottom, Splat4(fy - y0));
+}
+
+static void SHBasis(float out[9], const Math::Vector3& n)
+{
+	out[0] = 0.282095f;
+	out[1] = 0.488603f * n.y;
+	out[2] = 0.488603f * n.z;
+	out[3] = 0.488603f * n.x;
+	out[4] = 1.092548f * n.x * n.y;
+	out[5] = 1.092548f * n.y * n.z;
+	out[6] = 0.315392f * (3.0f * n.z * n.z - 1.0f);
+	out[7] = 1.092548f * n.x * n.z;
+	out[8] = 0.546274f * (n.x * n.x - n.y * n.y);
+}
+
+static void Hammersley(Math::Vector2& out, uint32_t index, uint32_t numsamples)
+{
+	out.x = (float)index / (float)numsamples;
+	out.y = (float)Math::ReverseBits32(index) * 2.3283064365386963e-10f;
+}
+
+static float GGXCosTheta(float xi, float a2)
+{
+	return sqrtf((1.0f - xi) / (1.0f + (a2 - 1.0f) * xi));
+}
+
+static void ParallelRows(ThreadPool* pool, uint32_t count, uint32_t grain, const ThreadPool::RangeCallback& callback)
+{
+	if (pool)
+		pool->ParallelFor(count, grain, callback);
+	else
+		callback(0, count, 0);
+}
+
+static void ConvertToHalf(Math::Float16* out, const float* in, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+		out[i] = Math::Float16(in[i]);
+}
+
+// --- IBLBaker impl ----------------------------------------------------------
+
+IBLBaker::IBLBaker()
+{
+	threadpool		= nullptr;
+	numspecsamples	= 256;
+	numbrdfsamples	= 2048;
+}
+
+IBLBaker::~IBLBaker()
+{
+}
+
+bool IBLBaker::LoadEnvironment(const char* file)
+{
+	DDS_Image_Info info;
+	uint32_t bytes = 0;
+
+	if (!LoadFromDDS(file, &info)) {
+		std::cout << "Error: Could not load environment map!\n";
+		return false;
+	}
+
+	if (info.Format == GLFMT_A16B16G16R16F)
+		bytes = 8;
+	else if (info.Format == GLFMT_A8R8G8B8)
+		bytes = 4;
+
+	if (info.Type != DDSImageTypeCube || info.Width != info.Height || bytes == 0) {
+		std::cout << "Error: Environment map must be an RGBA16F or RGBA8 cubemap!\n";
+
+		free(info.Data);
+		return false;
+	}
+
+	uint32_t size = info.Width;
+	uint32_t facestride = GetImageSize(size, size, bytes, info.MipLevels);
+
+	envlevels.clear();
+	envlevels.resize(1);
+
+	envlevels[0].size = size;
+	envlevels[0].texels.resize(6 * size * size * 4);
+
+	// first level of each face
+	for (uint32_t face = 0; face < 6; ++face) {
+		const uint8_t* src = (const uint8_t*)info.Data + face * facestride;
+		float* dst = envlevels[0].texels.data() + face * size * size * 4;
+
+		if (bytes == 8) {
+			const Math::Float16* halfs = (const Math::Float16*)src;
+
+			for (uint32_t i = 0; i < size * size * 4; ++i)
+				dst[i] = halfs[i];
+		} else {
+			// BGRA
+			for (uint32_t i = 0; i < size * size; ++i) {
+				dst[i * 4 + 0] = src[i * 4 + 2] / 255.0f;
+				dst[i * 4 + 1] = src[i * 4 + 1] / 255.0f;
+				dst[i * 4 + 2] = src[i * 4 + 0] / 255.0f;
+				dst[i * 4 + 3] = src[i * 4 + 3] / 255.0f;
+			}
+		}
+	}
+
+	free(info.Data);
+
+	// NOTE: the mip chain is always regenerated (2x2 box filter), the file might not have one
+	while (size > 1) {
+		const CubeLevel& src = envlevels.back();
+		CubeLevel dst;
+
+		dst.size = size / 2;
+		dst.texels.resize(6 * dst.size * dst.size * 4);
+
+		for (uint32_t face = 0; face < 6; ++face) {
+			const float* srcface = src.texels.data() + face * src.size * src.size * 4;
+			float* dstface = dst.texels.data() + face * dst.size * dst.size * 4;
+
+			for (uint32_t y = 0; y < dst.size; ++y) {
+				const float* row0 = srcface + (y * 2) * src.size * 4;
+				const float* row1 = row0 + src.size * 4;
+
+				for (uint32_t x = 0; x < dst.size; ++x) {
+					Texel4 sum = Add4(Add4(Load4(row0 + x * 8), Load4(row0 + x * 8 + 4)), Add4(Load4(row1 + x * 8), Load4(row1 + x * 8 + 4)));
+					Store4(dstface + (y * dst.size + x) * 4, Mul4(sum, Splat4(0.25f)));
+				}
+			}
+		}
+
+		envlevels.push_back(std::move(dst));
+		size /= 2;
+	}
+
+	ProjectToSH();
+	return true;
+}
+
+void IBLBaker::ProjectToSH()
+{
+	const CubeLevel& level = envlevels[0];
+
+	uint32_t size = level.size;
+	uint32_t numthreads = (threadpool ? threadpool->GetNumThreads() : 1);
+	std::vector<double> partials(numthreads * 9 * 3, 0.0);
+
+	ParallelRows(threadpool, 6 * size, 4, [&](uint32_t begin, uint32_t end, uint32_t thread) {
+		double* sums = partials.data() + thread * 9 * 3;
+		Math::Vector3 dir;
+		float basis[9];
+		float coeffs[9][4];
+
+		for (uint32_t r = begin; r < end; ++r) {
+			uint32_t face = r / size;
+			uint32_t y = r % size;
+			float t = 2.0f * (y + 0.5f) / size - 1.0f;
+
+			const float* texels = level.texels.data() + (face * size + y) * size * 4;
+			Texel4 acc[9];
+
+			for (int k = 0; k < 9; ++k)
+				acc[k] = Splat4(0.0f);
+
+			for (uint32_t x = 0; x < size; ++x) {
+				float s = 2.0f * (x + 0.5f) / size - 1.0f;
+				float dw = TexelSolidAngle(s, t, 1.0f / size);
+
+				FaceToDirection(dir, face, s, t);
+				SHBasis(basis, dir);
+
+				Texel4 radiance = Load4(texels + x * 4);
+
+				for (int k = 0; k < 9; ++k)
+					acc[k] = Mad4(radiance, Splat4(basis[k] * dw), acc[k]);
+			}
+
+			// NOTE: float per row, double across rows
+			for (int k = 0; k < 9; ++k) {
+				Store4(coeffs[k], acc[k]);
+
+				sums[k * 3 + 0] += coeffs[k][0];
+				sums[k * 3 + 1] += coeffs[k][1];
+				sums[k * 3 + 2] += coeffs[k][2];
+			}
+		}
+	});
+
+	for (int k = 0; k < 9; ++k) {
+		double total[3] = { 0, 0, 0 };
+
+		for (uint32_t i = 0; i < numthreads; ++i) {
+			total[0] += partials[(i * 9 + k) * 3 + 0];
+			total[1] += partials[(i * 9 + k) * 3 + 1];
+			total[2] += partials[(i * 9 + k) * 3 + 2];
+		}
+
+		shcoeffs[k] = Math::Vector3((float)total[0], (float)total[1], (float)total[2]);
+	}
+}
+
+bool IBLBaker::BakeDiffuse(const char* file, uint32_t size)
+{
+	if (envlevels.empty())
+		return false;
+
+	// cosine lobe (Ramamoorthi & Hanrahan), divided by PI like the shader (average radiance)
+	const float bands[9] = { 1.0f, 2.0f / 3.0f, 2.0f / 3.0f, 2.0f / 3.0f, 0.25f, 0.25f, 0.25f, 0.25f, 0.25f };
+
+	DDS_Image_Info info;
+	Texel4 coeffs[9];
+
+	size = Math::Min<uint32_t>(size, envlevels[0].size);
+
+	for (int k = 0; k < 9; ++k) {
+		Math::Vector3 c;
+
+		Math::Vec3Scale(c, shcoeffs[k], bands[k]);
+		coeffs[k] = Set4(c);
+	}
+
+	std::vector<Math::Float16> halfs(6 * size * size * 4);
+
+	ParallelRows(threadpool, 6 * size, 8, [&](uint32_t begin, uint32_t end, uint32_t) {
+		Math::Vector3 dir;
+		float basis[9];
+		float texel[4];
+
+		for (uint32_t r = begin; r < end; ++r) {
+			uint32_t face = r / size;
+			uint32_t y = r % size;
+			float t = 2.0f * (y + 0.5f) / size - 1.0f;
+
+			Math::Float16* out = halfs.data() + (face * size + y) * size * 4;
+
+			for (uint32_t x = 0; x < size; ++x) {
+				float s = 2.0f * (x + 0.5f) / size - 1.0f;
+
+				FaceToDirection(dir, face, s, t);
+				SHBasis(basis, dir);
+
+				Texel4 irradiance = Splat4(0.0f);
+
+				for (int k = 0; k < 9; ++k)
+					irradiance = Mad4(coeffs[k], Splat4(basis[k]), irradiance);
+
+				Store4(texel, irradiance);
+
+				// NOTE: ringing can go below zero around bright sources
+				out[x * 4 + 0] = Math::Float16(Math::Max(texel[0], 0.0f));
+				out[x * 4 + 1] = Math::Float16(Math::Max(texel[1], 0.0f));
+				out[x * 4 + 2] = Math::Float16(Math::Max(texel[2], 0.0f));
+				out[x * 4 + 3] = Math::Float16(1.0f);
+			}
+		}
+	});
+
+	info.Width		= size;
+	info.Height		= size;
+	info.Depth		= 0;
+	info.Format		= GLFMT_A16B16G16R16F;
+	info.MipLevels	= 1;
+	info.DataSize	= (uint32_t)(halfs.size() * sizeof(Math::Float16));
+	info.Data		= halfs.data();
+	info.Type		= DDSImageTypeCube;
+
+	return SaveToDDS(file, &info);
+}
+
+bool IBLBaker::BakeSpecular(const char* file, uint32_t size, uint32_t miplevels)
+{
+	if (envlevels.empty())
+		return false;
+
+	DDS_Image_Info info;
+
+	size = Math::Min<uint32_t>(size, envlevels[0].size);
+	miplevels = Math::Min<uint32_t>(miplevels, Math::Log2OfPow2(size) + 1);
+
+	uint32_t facestride = GetImageSize(size, size, 4, miplevels);
+	uint32_t offset = 0;
+
+	// NOTE: solid angle of an environment texel (for the filtered importance sampling)
+	float texelangle = (4.0f * Math::PI) / (6.0f * envlevels[0].size * envlevels[0].size);
+	float maxlod = (float)(envlevels.size() - 1);
+
+	std::vector<Math::Float16> halfs(6 * facestride);
+	std::vector<SpecularSample> samples;
+	std::vector<float> texels;
+	Math::Vector2 xi;
+
+	for (uint32_t level = 0; level < miplevels; ++level) {
+		uint32_t levelsize = Math::Max<uint32_t>(1, size >> level);
+
+		float roughness = (level + 0.5f) / miplevels;
+		float a = roughness * roughness;
+		float a2 = a * a;
+
+		// the samples are the same for every texel (since n = v = r)
+		samples.clear();
+
+		for (uint32_t i = 0; i < numspecsamples; ++i) {
+			Hammersley(xi, i, numspecsamples);
+
+			float phi = Math::TWO_PI * xi.x;
+			float costheta = GGXCosTheta(xi.y, a2);
+			float sintheta = sqrtf(1.0f - costheta * costheta);
+
+			Math::Vector3 h(sintheta * cosf(phi), sintheta * sinf(phi), costheta);
+			SpecularSample sample;
+
+			sample.dir = Math::Vector3(2.0f * costheta * h.x, 2.0f * costheta * h.y, 2.0f * costheta * h.z - 1.0f);
+			sample.weight = sample.dir.z;
+
+			if (sample.weight <= 0.0f)
+				continue;
+
+			// PDF = D(h) * dot(n, h) / (4 * dot(v, h)) = D(h) / 4
+			float d = (costheta * a2 - costheta) * costheta + 1.0f;
+			float pdf = a2 / (Math::PI * d * d) * 0.25f;
+			float sampleangle = 1.0f / (numspecsamples * pdf);
+
+			sample.lod = Math::Clamp(0.5f * log2f(sampleangle / texelangle), 0.0f, maxlod);
+			samples.push_back(sample);
+		}
+
+		texels.resize(6 * levelsize * levelsize * 4);
+		PrefilterLevel(texels.data(), levelsize, samples);
+
+		for (uint32_t face = 0; face < 6; ++face) {
+			const float* src = texels.data() + face * levelsize * levelsize * 4;
+			Math::Float16* dst = halfs.data() + face * facestride + offset;
+
+			ConvertToHalf(dst, src, levelsize * levelsize * 4);
+		}
+
+		offset += levelsize * levelsize * 4;
+	}
+
+	info.Width		= size;
+	info.Height		= size;
+	info.Depth		= 0;
+	info.Format		= GLFMT_A16B16G16R16F;
+	info.MipLevels	= miplevels;
+	info.DataSize	= (uint32_t)(halfs.size() * sizeof(Math::Float16));
+	info.Data		= halfs.data();
+	info.Type		= DDSImageTypeCube;
+
+	return SaveToDDS(file, &info);
+}
+
+void IBLBaker::PrefilterLevel(float* out, uint32_t size, const std::vector<SpecularSample>& samples) const
+{
+	float totalweight = 0;
+
+	for (const SpecularSample& sample : samples)
+		totalweight += sample.weight;
+
+	Texel4 normalize = Splat4(1.0f / Math::Max(totalweight, 1e-3f));
+
+	ParallelRows(threadpool, 6 * size, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+		Math::Vector3 n, t, b, l;
+		Math::Vector3 up;
+		float u, v;
+
+		for (uint32_t r = begin; r < end; ++r) {
+			uint32_t face = r / size;
+			uint32_t y = r % size;
+			float tc = 2.0f * (y + 0.5f) / size - 1.0f;
+
+			for (uint32_t x = 0; x < size; ++x) {
+				float sc = 2.0f * (x + 0.5f) / size - 1.0f;
+
+				FaceToDirection(n, face, sc, tc);
+
+				// same frame as TangentToWorld
+				up = ((fabsf(n.z) < 0.999f) ? Math::Vector3(0, 0, 1) : Math::Vector3(1, 0, 0));
+
+				Math::Vec3Cross(t, up, n);
+				Math::Vec3Normalize(t, t);
+				Math::Vec3Cross(b, n, t);
+
+				Texel4 color = Splat4(0.0f);
+
+				for (const SpecularSample& sample : samples) {
+					l.x = t.x * sample.dir.x + b.x * sample.dir.y + n.x * sample.dir.z;
+					l.y = t.y * sample.dir.x + b.y * sample.dir.y + n.y * sample.dir.z;
+					l.z = t.z * sample.dir.x + b.z * sample.dir.y + n.z * sample.dir.z;
+
+					uint32_t envface = DirectionToFace(u, v, l);
+					uint32_t lod = (uint32_t)sample.lod;
+					float frac = sample.lod - lod;
+
+					const CubeLevel& level0 = envlevels[lod];
+					Texel4 radiance = SampleBilinear(level0.texels.data() + envface * level0.size * level0.size * 4, level0.size, u, v);
+
+					if (frac > 0.0f) {
+						const CubeLevel& level1 = envlevels[lod + 1];
+						Texel4 radiance1 = SampleBilinear(level1.texels.data() + envface * level1.size * level1.size * 4, level1.size, u, v);
+
+						radiance = Lerp4(radiance, radiance1, Splat4(frac));
+					}
+
+					color = Mad4(radiance, Splat4(sample.weight), color);
+				}
+
+				color = Mul4(color, normalize);
+				Store4(out + ((face * size + y) * size + x) * 4, color);
+
+				out[((face * size + y) * size + x) * 4 + 3] = 1.0f;
+			}
+		}
+	});
+}
+
+bool IBLBaker::BakeBRDF(const char* file, uint32_t size) const
+{
+	DDS_Image_Info info;
+
+	std::vector<Math::Float16> halfs(size * size * 2);
+
+	ParallelRows(threadpool, size, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+		std::vector<float> row(size * 2);
+
+		for (uint32_t y = begin; y < end; ++y) {
+			IntegrateBRDFRow(row.data(), size, y);
+			ConvertToHalf(halfs.data() + y * size * 2, row.data(), size * 2);
+		}
+	});
+
+	info.Width		= size;
+	info.Height		= size;
+	info.Depth		= 0;
+	info.Format		= GLFMT_G16R16F;
+	info.MipLevels	= 1;
+	info.DataSize	= (uint32_t)(halfs.size() * sizeof(Math::Float16));
+	info.Data		= halfs.data();
+	info.Type		= DDSImageType2D;
+
+	return SaveToDDS(file, &info);
+}
+
+void IBLBaker::IntegrateBRDFRow(float* out, uint32_t size, uint32_t row) const
+{
+	// NOTE: same as integratebrdf10.fx (x = dot(n, v), y = roughness)
+	float roughness = (row + 0.5f) / size;
+	float a = roughness * roughness;
+	float a2 = a * a;
+
+	// G_Smith_Lightprobe
+	float ga = roughness * 0.5f + 0.5f;
+	float ga2 = ga * ga * ga * ga;
+
+	uint32_t numpadded = (numbrdfsamples + 3) & ~3u;
+	std::vector<float> hx(numpadded, 0.0f);
+	std::vector<float> hz(numpadded, 0.0f);	// padding is rejected (dot(n, l) < 0)
+	Math::Vector2 xi;
+
+	// h only depends on the roughness (v is in the xz plane)
+	for (uint32_t i = 0; i < numbrdfsamples; ++i) {
+		Hammersley(xi, i, numbrdfsamples);
+
+		float phi = Math::TWO_PI * xi.x;
+		float costheta = GGXCosTheta(xi.y, a2);
+		float sintheta = sqrtf(1.0f - costheta * costheta);
+
+		hx[i] = sintheta * cosf(phi);
+		hz[i] = costheta;
+	}
+
+	for (uint32_t x = 0; x < size; ++x) {
+		float ndotv = (x + 0.5f) / size;
+		float vx = sqrtf(1.0f - ndotv * ndotv);
+		float vz = ndotv;
+		float lambdav = (-1.0f + sqrtf(ga2 * (1.0f - ndotv * ndotv) / (ndotv * ndotv) + 1.0f)) * 0.5f;
+		float scale = 0, bias = 0;
+
+#ifdef IBLBAKER_SSE2
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 one = _mm_set1_ps(1.0f);
+		const __m128 half = _mm_set1_ps(0.5f);
+
+		__m128 sumscale = zero;
+		__m128 sumbias = zero;
+
+		for (uint32_t i = 0; i < numpadded; i += 4) {
+			__m128 h_x = _mm_loadu_ps(hx.data() + i);
+			__m128 h_z = _mm_loadu_ps(hz.data() + i);
+
+			__m128 vdoth = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(vx), h_x), _mm_mul_ps(_mm_set1_ps(vz), h_z));
+			__m128 ndotl = _mm_sub_ps(_mm_mul_ps(_mm_add_ps(vdoth, vdoth), h_z), _mm_set1_ps(ndotv));
+			__m128 mask = _mm_cmpgt_ps(ndotl, zero);
+
+			ndotl = _mm_min_ps(_mm_max_ps(ndotl, _mm_set1_ps(1e-6f)), one);
+			vdoth = _mm_min_ps(_mm_max_ps(vdoth, zero), one);
+
+			__m128 ndotl2 = _mm_mul_ps(ndotl, ndotl);
+			__m128 lambdal = _mm_mul_ps(_mm_sub_ps(_mm_sqrt_ps(_mm_add_ps(_mm_div_ps(_mm_mul_ps(_mm_set1_ps(ga2), _mm_sub_ps(one, ndotl2)), ndotl2), one)), one), half);
+			__m128 G = _mm_div_ps(one, _mm_add_ps(_mm_add_ps(one, lambdal), _mm_set1_ps(lambdav)));
+			__m128 G_mul_pdf = _mm_div_ps(_mm_mul_ps(G, vdoth), _mm_mul_ps(_mm_set1_ps(ndotv), _mm_max_ps(h_z, _mm_set1_ps(1e-6f))));
+
+			G_mul_pdf = _mm_and_ps(mask, _mm_min_ps(G_mul_pdf, one));
+
+			__m128 omv = _mm_sub_ps(one, vdoth);
+			__m128 omv2 = _mm_mul_ps(omv, omv);
+			__m128 Fc = _mm_mul_ps(_mm_mul_ps(omv2, omv2), omv);
+
+			sumscale = _mm_add_ps(sumscale, _mm_mul_ps(_mm_sub_ps(one, Fc), G_mul_pdf));
+			sumbias = _mm_add_ps(sumbias, _mm_mul_ps(Fc, G_mul_pdf));
+		}
+
+		float lanes[4];
+
+		_mm_storeu_ps(lanes, sumscale);
+		scale = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+
+		_mm_storeu_ps(lanes, sumbias);
+		bias = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#else
+		for (uint32_t i = 0; i < numbrdfsamples; ++i) {
+			float vdoth = vx * hx[i] + vz * hz[i];
+			float ndotl = 2.0f * vdoth * hz[i] - ndotv;
+
+			if (ndotl <= 0.0f)
+				continue;
+
+			ndotl = Math::Min(ndotl, 1.0f);
+			vdoth = Math::Clamp(vdoth, 0.0f, 1.0f);
+
+			float lambdal = (-1.0f + sqrtf(ga2 * (1.0f - ndotl * ndotl) / (ndotl * ndotl) + 1.0f)) * 0.5f;
+			float G = 1.0f / (1.0f + lambdal + lambdav);
+			float G_mul_pdf = Math::Min((G * vdoth) / (ndotv * hz[i]), 1.0f);
+			float Fc = powf(1.0f - vdoth, 5.0f);
+
+			scale += (1.0f - Fc) * G_mul_pdf;
+			bias += Fc * G_mul_pdf;
+		}
+#endif
+
+		out[x * 2 + 0] = scale / numbrdfsamples;
+		out[x * 2 + 1] = bias / numbrdfsamples;
+	}
+}
+
+void IBLBaker::SetSampleCounts(uint32_t specsamples, uint32_t brdfsamples)
+{
+	numspecsamples = Math::Max<uint32_t>(specsamples, 1);
+	numbrdfsamples = Math::Max<uint32_t>(brdfsamples, 1);
+}
+
+void IBLBaker::SetThreadPool(ThreadPool* pool)
+{
+	threadpool = pool;
+}
+
+uint32_t IBLBaker::GetEnvironmentSize() const
+{
+	return (envlevels.empty() ? 0 : envlevels[0].size);
+}
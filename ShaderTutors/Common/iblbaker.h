@@ -0,0 +1,54 @@
+
+#ifndef _IBLBAKER_H_
+#define _IBLBAKER_H_
+
+#include <vector>
+#include "3Dmath.h"
+
+class ThreadPool;
+
+/**
+ * \brief Offline light probe baker (CPU counterpart of 53_PrefilterEnvmap)
+ *
+ * Reads an environment cubemap with LoadFromDDS and writes the textures of the light
+ * probe shaders with SaveToDDS: diffuse irradiance (evaluated from a 3rd order SH
+ * projection), GGX prefiltered specular irradiance (one roughness per mip) and the
+ * split-sum BRDF lookup table. The outputs follow the conventions of the D3D10 prefilter
+ * (see prefilterenvmap10.fx and integratebrdf10.fx), so they can be used as drop-in
+ * replacements.
+ */
+class IBLBaker
+{
+	struct CubeLevel;
+	struct SpecularSample;
+
+private:
+	std::vector<CubeLevel>	envlevels;		// RGBA32F mip chain of the environment
+	Math::Vector3			shcoeffs[9];	// radiance
+	ThreadPool*				threadpool;
+	uint32_t				numspecsamples;
+	uint32_t				numbrdfsamples;
+
+	void ProjectToSH();
+	void PrefilterLevel(float* out, uint32_t size, const std::vector<SpecularSample>& samples) const;
+	void IntegrateBRDFRow(float* out, uint32_t size, uint32_t row) const;
+
+public:
+	IBLBaker();
+	~IBLBaker();
+
+	bool LoadEnvironment(const char* file);		// RGBA16F or RGBA8 cubemap
+
+	bool BakeDiffuse(const char* file, uint32_t size = 128);
+	bool BakeSpecular(const char* file, uint32_t size = 512, uint32_t miplevels = 8);
+	bool BakeBRDF(const char* file, uint32_t size = 256) const;
+
+	void SetSampleCounts(uint32_t specsamples, uint32_t brdfsamples);
+	void SetThreadPool(ThreadPool* pool);
+
+	uint32_t GetEnvironmentSize() const;
+
+	inline const Math::Vector3* GetSHCoefficients() const	{ return shcoeffs; }
+};
+
+#endif
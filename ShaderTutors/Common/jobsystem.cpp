@@ -0,0 +1,433 @@
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+
+#include "jobsystem.h"
+
+#define JOB_SPIN_COUNT		64
+
+struct RangeData
+{
+	JobSystem*							system;
+	const JobSystem::RangeCallback*		callback;
+	uint32_t							begin;
+	uint32_t							end;
+	uint32_t							grain;
+};
+
+// NOTE: ids instead of pointers, a new system can get the address of a deleted one
+static std::atomic<uint64_t>	nextsystemid(1);
+static thread_local uint64_t	currentsystem	= 0;	// cache of the last lookup
+static thread_local uint32_t	currentindex	= UINT32_MAX;
+
+static void EmptyJob(Job*, const void*)
+{
+}
+
+static void RunRange(Job* job, const void* data)
+{
+	RangeData range = *(const RangeData*)data;
+
+	// give away the upper halves, keep the lowest part
+	while (range.end - range.begin > range.grain) {
+		uint32_t numgrains = (range.end - range.begin + range.grain - 1) / range.grain;
+		RangeData upper = range;
+
+		upper.begin = range.begin + (numgrains / 2) * range.grain;
+		range.end = upper.begin;
+
+		range.system->Run(range.system->CreateJob(&RunRange, &upper, sizeof(RangeData), job));
+	}
+
+	(*range.callback)(range.begin, range.end, range.system->GetThreadIndex());
+}
+
+// --- JobSystem impl ---------------------------------------------------------
+
+// NOTE: at most half of the ring can be queued, so that allocation finds a free slot quickly
+JobSystem::Worker::Worker()
+	: queue(JOBS_PER_THREAD / 2)
+{
+	jobs.reset(new Job[JOBS_PER_THREAD]);
+
+	for (uint32_t i = 0; i < JOBS_PER_THREAD; ++i)
+		jobs[i].unfinished.store(0, std::memory_order_relaxed);
+
+	nextjob	= 0;
+	seed	= 0;
+}
+
+JobSystem::JobSystem(uint32_t numthreads)
+{
+	if (numthreads == 0)
+		numthreads = std::max<uint32_t>(std::thread::hardware_concurrency(), 1);
+
+	id = nextsystemid.fetch_add(1, std::memory_order_relaxed);
+	owner = std::this_thread::get_id();
+
+	numqueued.store(0, std::memory_order_relaxed);
+	numsleepers.store(0, std::memory_order_relaxed);
+	exiting.store(false, std::memory_order_relaxed);
+
+	for (uint32_t i = 0; i < numthreads; ++i) {
+		workers.emplace_back(new Worker());
+		workers.back()->seed = 0x9e3779b9 * (i + 1);
+	}
+
+	// the caller is thread 0 (workers wait until every thread is created, see GetThreadIndex)
+	std::lock_guard<std::mutex> guard(lock);
+
+	for (uint32_t i = 1; i < numthreads; ++i)
+		threads.push_back(std::thread(&JobSystem::WorkerMain, this, i));
+}
+
+JobSystem::~JobSystem()
+{
+	exiting.store(true, std::memory_order_seq_cst);
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		available.notify_all();
+	}
+
+	for (size_t i = 0; i < threads.size(); ++i)
+		threads[i].join();
+}
+
+void JobSystem::WorkerMain(uint32_t index)
+{
+	uint32_t numfailed = 0;
+
+	currentsystem = id;
+	currentindex = index;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+	}
+
+	while (!exiting.load(std::memory_order_relaxed)) {
+		Job* job = FindJob(index);
+
+		if (job != nullptr) {
+			Execute(job);
+			numfailed = 0;
+
+			continue;
+		}
+
+		if (++numfailed < JOB_SPIN_COUNT) {
+			std::this_thread::yield();
+			continue;
+		}
+
+		// pairs with the fence in Run (either we see the job or it sees the sleeper)
+		numsleepers.fetch_add(1, std::memory_order_seq_cst);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		if (numqueued.load(std::memory_order_relaxed) <= 0) {
+			std::unique_lock<std::mutex> guard(lock);
+
+			available.wait(guard, [&]() -> bool {
+				return (exiting.load(std::memory_order_relaxed) || numqueued.load(std::memory_order_relaxed) > 0);
+			});
+		}
+
+		numsleepers.fetch_sub(1, std::memory_order_relaxed);
+		numfailed = 0;
+	}
+}
+
+uint32_t JobSystem::GetThreadIndex() const
+{
+	if (currentsystem == id)
+		return currentindex;
+
+	// the thread last used another system
+	std::thread::id self = std::this_thread::get_id();
+	uint32_t index = UINT32_MAX;
+
+	if (self == owner) {
+		index = 0;
+	} else {
+		for (size_t i = 0; i < threads.size(); ++i) {
+			if (threads[i].get_id() == self)
+				index = (uint32_t)i + 1;
+		}
+	}
+
+	currentsystem = id;
+	currentindex = index;
+
+	return index;
+}
+
+Job* JobSystem::AllocateJob(uint32_t index)
+{
+	Worker& worker = *workers[index];
+
+	for (;;) {
+		// skip jobs that are still running or waited for (their children aren't finished)
+		for (uint32_t i = 0; i < JOBS_PER_THREAD; ++i) {
+			Job* job = &worker.jobs[worker.nextjob++ & (JOBS_PER_THREAD - 1)];
+
+			if (job->unfinished.load(std::memory_order_acquire) == 0)
+				return job;
+		}
+
+		// every slot is busy, help until one becomes free
+		Job* other = FindJob(index);
+
+		if (other != nullptr)
+			Execute(other);
+		else
+			std::this_thread::yield();
+	}
+}
+
+Job* JobSystem::FindJob(uint32_t index)
+{
+	Job* job = nullptr;
+	uint32_t numworkers = (uint32_t)workers.size();
+	uint32_t first = 0;
+
+	if (index < numworkers) {
+		Worker& worker = *workers[index];
+
+		if (worker.queue.Pop(job)) {
+			numqueued.fetch_sub(1, std::memory_order_relaxed);
+			return job;
+		}
+
+		// xorshift
+		worker.seed ^= (worker.seed << 13);
+		worker.seed ^= (worker.seed >> 17);
+		worker.seed ^= (worker.seed << 5);
+
+		first = worker.seed % numworkers;
+	}
+
+	for (uint32_t i = 0; i < numworkers; ++i) {
+		uint32_t victim = (first + i) % numworkers;
+
+		if (victim != index && workers[victim]->queue.Steal(job)) {
+			numqueued.fetch_sub(1, std::memory_order_relaxed);
+			return job;
+		}
+	}
+
+	return nullptr;
+}
+
+void JobSystem::Execute(Job* job)
+{
+	job->function(job, job->data);
+	Finish(job);
+}
+
+void JobSystem::Finish(Job* job)
+{
+	// NOTE: read parent first, the slot can be reused as soon as the counter is zero
+	Job* parent = job->parent;
+
+	if (job->unfinished.fetch_sub(1, std::memory_order_acq_rel) == 1 && parent != nullptr)
+		Finish(parent);
+}
+
+Job* JobSystem::CreateJob(JobFunction function, const void* data, size_t size, Job* parent)
+{
+	uint32_t index = GetThreadIndex();
+
+	if (index == UINT32_MAX)
+		throw std::logic_error("JobSystem::CreateJob: not called on a thread of the system");
+
+	assert(size <= JOB_DATA_SIZE);
+
+	Job* job = AllocateJob(index);
+
+	if (parent != nullptr)
+		parent->unfinished.fetch_add(1, std::memory_order_relaxed);
+
+	job->function = function;
+	job->parent = parent;
+	job->unfinished.store(1, std::memory_order_relaxed);
+
+	if (size > 0)
+		memcpy(job->data, data, size);
+
+	return job;
+}
+
+void JobSystem::Run(Job* job)
+{
+	uint32_t index = GetThreadIndex();
+
+	if (index == UINT32_MAX)
+		throw std::logic_error("JobSystem::Run: not called on a thread of the system");
+
+	numqueued.fetch_add(1, std::memory_order_seq_cst);
+
+	if (!workers[index]->queue.Push(job)) {
+		// deque is full, run it here
+		numqueued.fetch_sub(1, std::memory_order_relaxed);
+		Execute(job);
+
+		return;
+	}
+
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if (numsleepers.load(std::memory_order_relaxed) > 0) {
+		std::lock_guard<std::mutex> guard(lock);
+		available.notify_one();
+	}
+}
+
+void JobSystem::Wait(const Job* job)
+{
+	uint32_t index = GetThreadIndex();
+
+	while (!IsFinished(job)) {
+		// other threads can't create jobs, so they don't help
+		Job* other = (index != UINT32_MAX ? FindJob(index) : nullptr);
+
+		if (other != nullptr)
+			Execute(other);
+		else
+			std::this_thread::yield();
+	}
+}
+
+void JobSystem::ParallelFor(uint32_t count, uint32_t grain, const RangeCallback& callback)
+{
+	if (count == 0)
+		return;
+
+	RangeData range;
+
+	range.system	= this;
+	range.callback	= &callback;
+	range.begin		= 0;
+	range.end		= count;
+	range.grain		= std::max<uint32_t>(grain, 1);
+
+	uint32_t index = GetThreadIndex();
+
+	// NOTE: other threads can't create jobs, they run the whole range (thread index UINT32_MAX)
+	if (workers.size() == 1 || count <= range.grain || index == UINT32_MAX) {
+		callback(0, count, index);
+		return;
+	}
+
+	// the caller takes the first part
+	Job* root = CreateJob(&RunRange, &range, sizeof(RangeData));
+
+	Execute(root);
+	Wait(root);
+}
+
+// --- JobGraph impl ----------------------------------------------------------
+
+JobGraph::JobGraph()
+{
+	numremaining = 0;
+}
+
+uint32_t JobGraph::AddTask(const TaskCallback& task)
+{
+	nodes.push_back({ task, std::vector<uint32_t>(), 0 });
+	return (uint32_t)nodes.size() - 1;
+}
+
+void JobGraph::AddDependency(uint32_t task, uint32_t dependency)
+{
+	nodes[dependency].successors.push_back(task);
+	++nodes[task].numdependencies;
+}
+
+void JobGraph::Clear()
+{
+	nodes.clear();
+}
+
+void JobGraph::RunNode(Job* job, const void* data)
+{
+	NodeData current = *(const NodeData*)data;
+	const Node& node = current.graph->nodes[current.node];
+
+	node.task();
+
+	// successors are children of the root, so that it finishes last
+	for (uint32_t successor : node.successors) {
+		if (current.graph->remaining[successor].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			NodeData next = { current.graph, current.system, successor };
+			current.system->Run(current.system->CreateJob(&RunNode, &next, sizeof(NodeData), job->parent));
+		}
+	}
+}
+
+bool JobGraph::Execute(JobSystem& system)
+{
+	uint32_t numnodes = (uint32_t)nodes.size();
+
+	if (numnodes > numremaining) {
+		remaining.reset(new std::atomic<uint32_t>[numnodes]);
+		numremaining = numnodes;
+	}
+
+	// check for cycles (Kahn's algorithm)
+	std::vector<uint32_t> ready;
+	uint32_t numvisited = 0;
+
+	for (uint32_t i = 0; i < numnodes; ++i) {
+		remaining[i].store(nodes[i].numdependencies, std::memory_order_relaxed);
+
+		if (nodes[i].numdependencies == 0)
+			ready.push_back(i);
+	}
+
+	std::vector<uint32_t> roots(ready);
+	std::vector<uint32_t> order;
+
+	order.reserve(numnodes);
+
+	while (!ready.empty()) {
+		uint32_t index = ready.back();
+
+		ready.pop_back();
+		order.push_back(index);
+		++numvisited;
+
+		for (uint32_t successor : nodes[index].successors) {
+			if (remaining[successor].fetch_sub(1, std::memory_order_relaxed) == 1)
+				ready.push_back(successor);
+		}
+	}
+
+	if (numvisited != numnodes)
+		return false;
+
+	if (system.GetThreadIndex() == UINT32_MAX) {
+		// other threads can't create jobs, run the tasks here
+		for (uint32_t index : order)
+			nodes[index].task();
+
+		return true;
+	}
+
+	for (uint32_t i = 0; i < numnodes; ++i)
+		remaining[i].store(nodes[i].numdependencies, std::memory_order_relaxed);
+
+	// NOTE: the root does nothing, it finishes after every task
+	Job* root = system.CreateJob(&EmptyJob, nullptr, 0);
+
+	for (uint32_t index : roots) {
+		NodeData data = { this, &system, index };
+		system.Run(system.CreateJob(&RunNode, &data, sizeof(NodeData), root));
+	}
+
+	system.Run(root);
+	system.Wait(root);
+
+	return true;
+}
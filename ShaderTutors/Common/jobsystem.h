@@ -0,0 +1,163 @@
+
+#ifndef _JOBSYSTEM_H_
+#define _JOBSYSTEM_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <type_traits>
+#include <condition_variable>
+
+#include "workstealingqueue.hpp"
+
+#define JOB_DATA_SIZE		40		// bytes of inline parameters (a Job is 64 bytes)
+#define JOBS_PER_THREAD		4096	// deques hold half as many
+
+class JobSystem;
+struct Job;
+
+typedef void (*JobFunction)(Job* job, const void* data);
+
+struct Job
+{
+	JobFunction					function;
+	Job*						parent;
+	std::atomic<int32_t>		unfinished;		// itself + children
+	alignas(8) uint8_t			data[JOB_DATA_SIZE];
+};
+
+/**
+ * \brief Work-stealing job scheduler
+ *
+ * Every thread has a Chase-Lev deque: it pushes and pops its own jobs in LIFO order,
+ * idle threads steal the oldest jobs of others. A job finishes when it and all of its
+ * children have finished, so waiting for a parent waits for the whole subtree.
+ *
+ * The creating thread is thread 0 and participates whenever it waits. Jobs can be
+ * created, run and waited for on that thread or inside jobs; CreateJob and Run throw
+ * std::logic_error on other threads, ParallelFor and JobGraph::Execute run serially there.
+ * Jobs are allocated from a ring per thread (busy slots are skipped), so a finished job
+ * can only be waited for until its thread allocates JOBS_PER_THREAD more jobs.
+ *
+ * Existing subsystems (physics, culling, lightning, light culler) take a ThreadPool, and
+ * new code should too; use the job system only for nested or dependent work (jobs that
+ * spawn jobs, task graphs), which ThreadPool can't do because it is not reentrant.
+ */
+class JobSystem
+{
+public:
+	typedef std::function<void (uint32_t, uint32_t, uint32_t)> RangeCallback;	// begin, end, thread index (UINT32_MAX on other threads)
+
+private:
+	struct Worker
+	{
+		WorkStealingQueue<Job*>	queue;
+		std::unique_ptr<Job[]>	jobs;
+		uint32_t				nextjob;
+		uint32_t				seed;		// for choosing victims
+
+		Worker();
+	};
+
+	std::vector<std::unique_ptr<Worker>>	workers;
+	std::vector<std::thread>				threads;
+	std::mutex								lock;
+	std::condition_variable					available;
+	std::atomic<int32_t>					numqueued;
+	std::atomic<uint32_t>					numsleepers;
+	std::atomic<bool>						exiting;
+	std::thread::id							owner;
+	uint64_t								id;
+
+	void WorkerMain(uint32_t index);
+	void Execute(Job* job);
+	void Finish(Job* job);
+
+	Job* AllocateJob(uint32_t index);
+	Job* FindJob(uint32_t index);
+
+	template <typename T>
+	static void CallFunctor(Job*, const void* data) {
+		(*(const T*)data)();
+	}
+
+public:
+	JobSystem(uint32_t numthreads = 0);	// 0 means one per core (including the caller)
+	~JobSystem();
+
+	JobSystem(const JobSystem&) = delete;
+	JobSystem& operator =(const JobSystem&) = delete;
+
+	// NOTE: data is copied into the job; the parent can't finish before the new job
+	Job* CreateJob(JobFunction function, const void* data, size_t size, Job* parent = nullptr);
+
+	template <typename T>
+	Job* CreateJob(const T& functor, Job* parent = nullptr) {
+		static_assert(sizeof(T) <= JOB_DATA_SIZE, "Functor does not fit into a job");
+		static_assert(std::is_trivially_copyable<T>::value, "Functor must be trivially copyable");
+
+		return CreateJob(&CallFunctor<T>, &functor, sizeof(T), parent);
+	}
+
+	void Run(Job* job);
+	void Wait(const Job* job);	// runs other jobs meanwhile
+
+	// splits the range in halves down to grain size (can be nested)
+	void ParallelFor(uint32_t count, uint32_t grain, const RangeCallback& callback);
+
+	uint32_t GetThreadIndex() const;	// UINT32_MAX on other threads
+
+	inline bool IsFinished(const Job* job) const	{ return (job->unfinished.load(std::memory_order_acquire) == 0); }
+	inline uint32_t GetNumThreads() const			{ return (uint32_t)workers.size(); }
+};
+
+/**
+ * \brief Tasks with dependencies, executed on a JobSystem
+ *
+ * A task becomes a job when all of its dependencies have finished. The graph can be
+ * executed any number of times.
+ */
+class JobGraph
+{
+public:
+	typedef std::function<void ()> TaskCallback;
+
+private:
+	struct Node
+	{
+		TaskCallback			task;
+		std::vector<uint32_t>	successors;
+		uint32_t				numdependencies;
+	};
+
+	struct NodeData
+	{
+		JobGraph*				graph;
+		JobSystem*				system;
+		uint32_t				node;
+	};
+
+	std::vector<Node>							nodes;
+	std::unique_ptr<std::atomic<uint32_t>[]>	remaining;	// unfinished dependencies
+	uint32_t									numremaining;
+
+	static void RunNode(Job* job, const void* data);
+
+public:
+	JobGraph();
+
+	uint32_t AddTask(const TaskCallback& task);
+	void AddDependency(uint32_t task, uint32_t dependency);	// task runs after dependency
+
+	bool Execute(JobSystem& system);	// false if the graph has a cycle
+	void Clear();
+
+	inline uint32_t GetNumTasks() const		{ return (uint32_t)nodes.size(); }
+};
+
+#endif
@@ -0,0 +1,358 @@
+
+#include <algorithm>
+#include <cstring>
+#include <cfloat>
+#include <xmmintrin.h>
+
+#include "lightculler.h"
+#include "threadpool.h"
+
+#define LIGHTS_PER_JOB	1024
+#define TILES_PER_GROUP	8
+#define ROWS_PER_BAND	4
+
+static __m128 PlaneDistance(const Math::Vector4& p, __m128 x, __m128 y, __m128 z, __m128 r)
+{
+	__m128 dist = _mm_add_ps(
+		_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(p.x)), _mm_mul_ps(y, _mm_set1_ps(p.y))),
+		_mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(p.z)), _mm_set1_ps(p.w)));
+
+	return _mm_add_ps(dist, r);
+}
+
+static uint32_t TailMask(uint32_t i, uint32_t count)
+{
+	uint32_t left = count - i;
+	return (left >= 4 ? 0xf : ((1 << left) - 1));
+}
+
+// --- LightCuller::SphereList impl -------------------------------------------
+
+LightCuller::SphereList::SphereList()
+{
+	count = 0;
+}
+
+void LightCuller::SphereList::Resize(uint32_t newcount)
+{
+	// NOTE: never shrinks (padding lanes are masked out)
+	size_t padded = (newcount + 3) & ~3;
+
+	if (x.size() < padded) {
+		x.resize(padded, 0);
+		y.resize(padded, 0);
+		z.resize(padded, 0);
+		r.resize(padded, 0);
+		lights.resize(padded, 0);
+	}
+
+	count = newcount;
+}
+
+// --- LightCuller impl -------------------------------------------------------
+
+LightCuller::LightCuller(uint32_t tilesize, uint32_t numslices)
+{
+	this->tilesize	= tilesize;
+	this->numslices	= std::min<uint32_t>(numslices, UINT16_MAX);
+
+	workers			= nullptr;
+	numtilesx		= 0;
+	numtilesy		= 0;
+	slicescale		= 0;
+	slicebias		= 0;
+}
+
+uint32_t LightCuller::GetSlice(float depth) const
+{
+	if (depth <= clipplanes.x)
+		return 0;
+
+	float slice = logf(depth) * slicescale + slicebias;
+	return std::min<uint32_t>((uint32_t)slice, numslices - 1);
+}
+
+void LightCuller::TransformLights(const Math::Vector4* lights, const Math::Matrix& view, uint32_t begin, uint32_t end)
+{
+	for (uint32_t i = begin; i < end; ++i) {
+		const Math::Vector4& light = lights[i];
+
+		float x = light.x * view._11 + light.y * view._21 + light.z * view._31 + view._41;
+		float y = light.x * view._12 + light.y * view._22 + light.z * view._32 + view._42;
+		float z = light.x * view._13 + light.y * view._23 + light.z * view._33 + view._43;
+
+		viewlights.x[i] = x;
+		viewlights.y[i] = y;
+		viewlights.z[i] = z;
+		viewlights.r[i] = light.w;
+		viewlights.lights[i] = i;
+
+		firstslice[i] = (uint16_t)GetSlice(-z - light.w);
+		lastslice[i] = (uint16_t)GetSlice(-z + light.w);
+	}
+}
+
+void LightCuller::CullSpheres(SphereList& out, const SphereList& in, float left, float right, float bottom, float top, const Math::Vector2& depths) const
+{
+	// same planes as in lightcull.comp (with NDC extents)
+	Math::Vector4 planes[4] = {
+		{ 1, 0, 0, -left },
+		{ -1, 0, 0, right },
+		{ 0, 1, 0, -bottom },
+		{ 0, -1, 0, top }
+	};
+
+	for (int i = 0; i < 4; ++i) {
+		Math::Vec4TransformTranspose(planes[i], proj, planes[i]);
+		Math::PlaneNormalize(planes[i], planes[i]);
+	}
+
+	__m128 zero = _mm_setzero_ps();
+	__m128 minz = _mm_set1_ps(depths.x);
+	__m128 maxz = _mm_set1_ps(depths.y);
+
+	uint32_t count = 0;
+
+	// at most the input survives
+	out.Resize(in.Size());
+
+	for (uint32_t i = 0; i < in.Size(); i += 4) {
+		__m128 x = _mm_loadu_ps(&in.x[i]);
+		__m128 y = _mm_loadu_ps(&in.y[i]);
+		__m128 z = _mm_loadu_ps(&in.z[i]);
+		__m128 r = _mm_loadu_ps(&in.r[i]);
+
+		// near and far are (0, 0, -1, -minz) and (0, 0, 1, maxz)
+		__m128 inside = _mm_cmpgt_ps(_mm_add_ps(_mm_sub_ps(_mm_sub_ps(zero, z), minz), r), zero);
+		inside = _mm_and_ps(inside, _mm_cmpgt_ps(_mm_add_ps(_mm_add_ps(z, maxz), r), zero));
+
+		for (int j = 0; j < 4; ++j)
+			inside = _mm_and_ps(inside, _mm_cmpgt_ps(PlaneDistance(planes[j], x, y, z, r), zero));
+
+		uint32_t mask = (uint32_t)_mm_movemask_ps(inside) & TailMask(i, in.Size());
+
+		if (mask == 0)
+			continue;
+
+		// write every lane, but only advance for survivors (no branches)
+		for (uint32_t lane = 0; lane < 4; ++lane) {
+			out.x[count] = in.x[i + lane];
+			out.y[count] = in.y[i + lane];
+			out.z[count] = in.z[i + lane];
+			out.r[count] = in.r[i + lane];
+			out.lights[count] = in.lights[i + lane];
+
+			count += ((mask >> lane) & 1);
+		}
+	}
+
+	out.Resize(count);
+}
+
+void LightCuller::AddToClusters(RowData& data, uint32_t tile, const Math::Vector2& depths)
+{
+	// NOTE: the side planes are the same for every slice, so only the depth range matters
+	const SphereList& survivors = data.tilelights;
+
+	uint32_t* tileoffsets = &data.offsets[tile * numslices];
+	uint32_t tilefirst = GetSlice(std::max(depths.x, clipplanes.x));
+	uint32_t tilelast = GetSlice(depths.y);
+	uint32_t start = (uint32_t)data.indices.size();
+
+	std::fill(data.counts.begin(), data.counts.end(), 0);
+
+	for (uint32_t i = 0; i < survivors.Size(); ++i) {
+		uint32_t light = survivors.lights[i];
+		uint32_t last = std::min<uint32_t>(lastslice[light], tilelast);
+
+		for (uint32_t j = std::max<uint32_t>(firstslice[light], tilefirst); j <= last; ++j)
+			++data.counts[j];
+	}
+
+	for (uint32_t j = 0; j < numslices; ++j) {
+		tileoffsets[j] = start;
+		start += data.counts[j];
+
+		// becomes write position
+		data.counts[j] = tileoffsets[j];
+	}
+
+	data.indices.resize(start);
+
+	for (uint32_t i = 0; i < survivors.Size(); ++i) {
+		uint32_t light = survivors.lights[i];
+		uint32_t last = std::min<uint32_t>(lastslice[light], tilelast);
+
+		for (uint32_t j = std::max<uint32_t>(firstslice[light], tilefirst); j <= last; ++j)
+			data.indices[data.counts[j]++] = light;
+	}
+}
+
+void LightCuller::CullBand(const Math::Vector2* tiledepths, uint32_t band)
+{
+	uint32_t		first		= band * ROWS_PER_BAND;
+	uint32_t		last		= std::min<uint32_t>(first + ROWS_PER_BAND, numtilesy);
+	Math::Vector2	banddepths(FLT_MAX, 0);
+
+	for (uint32_t i = first * numtilesx; i < last * numtilesx; ++i) {
+		const Math::Vector2& depths = (tiledepths ? tiledepths[i] : clipplanes);
+
+		banddepths.x = std::min(banddepths.x, depths.x);
+		banddepths.y = std::max(banddepths.y, depths.y);
+	}
+
+	if (banddepths.x > banddepths.y) {
+		bands[band].Resize(0);
+		return;
+	}
+
+	float bottom = (2.0f * first) / numtilesy - 1;
+	float top = (2.0f * last) / numtilesy - 1;
+
+	CullSpheres(bands[band], viewlights, -1, 1, bottom, top, banddepths);
+}
+
+void LightCuller::CullRow(const Math::Vector2* tiledepths, uint32_t row)
+{
+	RowData&		data	= rows[row];
+	Math::Vector2	rowdepths(FLT_MAX, 0);
+
+	data.indices.clear();
+	data.counts.resize(numslices);
+	data.offsets.assign(numtilesx * numslices, 0);
+
+	for (uint32_t i = 0; i < numtilesx; ++i) {
+		const Math::Vector2& depths = (tiledepths ? tiledepths[row * numtilesx + i] : clipplanes);
+
+		rowdepths.x = std::min(rowdepths.x, depths.x);
+		rowdepths.y = std::max(rowdepths.y, depths.y);
+	}
+
+	if (rowdepths.x > rowdepths.y)
+		return;
+
+	float bottom = (2.0f * row) / numtilesy - 1;
+	float top = (2.0f * (row + 1)) / numtilesy - 1;
+
+	CullSpheres(data.rowlights, bands[row / ROWS_PER_BAND], -1, 1, bottom, top, rowdepths);
+
+	for (uint32_t group = 0; group < numtilesx; group += TILES_PER_GROUP) {
+		uint32_t last = std::min<uint32_t>(group + TILES_PER_GROUP, numtilesx);
+		Math::Vector2 groupdepths(FLT_MAX, 0);
+
+		for (uint32_t tile = group; tile < last; ++tile) {
+			const Math::Vector2& depths = (tiledepths ? tiledepths[row * numtilesx + tile] : clipplanes);
+
+			groupdepths.x = std::min(groupdepths.x, depths.x);
+			groupdepths.y = std::max(groupdepths.y, depths.y);
+		}
+
+		if (groupdepths.x > groupdepths.y) {
+			data.grouplights.Resize(0);
+		} else {
+			float left = (2.0f * group) / numtilesx - 1;
+			float right = (2.0f * last) / numtilesx - 1;
+
+			CullSpheres(data.grouplights, data.rowlights, left, right, bottom, top, groupdepths);
+		}
+
+		for (uint32_t tile = group; tile < last; ++tile) {
+			const Math::Vector2& depths = (tiledepths ? tiledepths[row * numtilesx + tile] : clipplanes);
+
+			if (depths.x > depths.y || data.grouplights.Size() == 0) {
+				std::fill(&data.offsets[tile * numslices], &data.offsets[tile * numslices] + numslices, (uint32_t)data.indices.size());
+				continue;
+			}
+
+			float left = (2.0f * tile) / numtilesx - 1;
+			float right = (2.0f * (tile + 1)) / numtilesx - 1;
+
+			CullSpheres(data.tilelights, data.grouplights, left, right, bottom, top, depths);
+			AddToClusters(data, tile, depths);
+		}
+	}
+}
+
+void LightCuller::Cull(
+	const Math::Vector4* lights, uint32_t numlights,
+	const Math::Matrix& view, const Math::Matrix& proj, const Math::Vector2& clipplanes,
+	uint32_t screenwidth, uint32_t screenheight,
+	const Math::Vector2* tiledepths)
+{
+	this->proj			= proj;
+	this->clipplanes	= clipplanes;
+
+	numtilesx	= (screenwidth + tilesize - 1) / tilesize;
+	numtilesy	= (screenheight + tilesize - 1) / tilesize;
+	slicescale	= numslices / logf(clipplanes.y / clipplanes.x);
+	slicebias	= -logf(clipplanes.x) * slicescale;
+
+	uint32_t numclusters = numtilesx * numtilesy * numslices;
+
+	viewlights.Resize(numlights);
+
+	firstslice.resize(numlights);
+	lastslice.resize(numlights);
+
+	rows.resize(numtilesy);
+	bands.resize((numtilesy + ROWS_PER_BAND - 1) / ROWS_PER_BAND);
+	offsets.resize(numclusters + 1);
+
+	// transform to view space
+	uint32_t numjobs = (numlights + LIGHTS_PER_JOB - 1) / LIGHTS_PER_JOB;
+
+	auto transform = [&](uint32_t begin, uint32_t end, uint32_t) {
+		for (uint32_t i = begin; i < end; ++i)
+			TransformLights(lights, view, i * LIGHTS_PER_JOB, std::min((i + 1) * LIGHTS_PER_JOB, numlights));
+	};
+
+	auto cullbands = [&](uint32_t begin, uint32_t end, uint32_t) {
+		for (uint32_t i = begin; i < end; ++i)
+			CullBand(tiledepths, i);
+	};
+
+	auto cullrows = [&](uint32_t begin, uint32_t end, uint32_t) {
+		for (uint32_t i = begin; i < end; ++i)
+			CullRow(tiledepths, i);
+	};
+
+	if (workers != nullptr) {
+		workers->ParallelFor(numjobs, 1, transform);
+		workers->ParallelFor((uint32_t)bands.size(), 1, cullbands);
+		workers->ParallelFor(numtilesy, 1, cullrows);
+	} else {
+		transform(0, numjobs, 0);
+		cullbands(0, (uint32_t)bands.size(), 0);
+		cullrows(0, numtilesy, 0);
+	}
+
+	// rows are contiguous in the output
+	std::vector<uint32_t> rowstarts(numtilesy);
+	uint32_t total = 0;
+
+	for (uint32_t i = 0; i < numtilesy; ++i) {
+		rowstarts[i] = total;
+		total += (uint32_t)rows[i].indices.size();
+	}
+
+	indices.resize(total);
+	offsets[numclusters] = total;
+
+	auto gather = [&](uint32_t begin, uint32_t end, uint32_t) {
+		for (uint32_t i = begin; i < end; ++i) {
+			const RowData& data = rows[i];
+			uint32_t* rowoffsets = &offsets[i * numtilesx * numslices];
+
+			for (size_t j = 0; j < data.offsets.size(); ++j)
+				rowoffsets[j] = rowstarts[i] + data.offsets[j];
+
+			if (!data.indices.empty())
+				memcpy(&indices[rowstarts[i]], data.indices.data(), data.indices.size() * sizeof(uint32_t));
+		}
+	};
+
+	if (workers != nullptr)
+		workers->ParallelFor(numtilesy, 1, gather);
+	else
+		gather(0, numtilesy, 0);
+}
@@ -0,0 +1,95 @@
+
+#ifndef _LIGHTCULLER_H_
+#define _LIGHTCULLER_H_
+
+#include <vector>
+#include "3Dmath.h"
+
+class ThreadPool;
+
+/**
+ * \brief CPU version of lightcull.comp with depth slices (clusters)
+ *
+ * The screen is divided into tiles (tile y = 0 is the bottom row, as in the shader),
+ * and each tile into exponential depth slices between the clip planes. Lights are
+ * tested against the planes of a band of rows, a row, a group of tiles, then each
+ * tile (4 lights at once, same test as the shader).
+ *
+ * Lights of cluster (tile * numslices + slice) are indices[offsets[i]...offsets[i + 1]).
+ */
+class LightCuller
+{
+private:
+	struct SphereList
+	{
+		// view space, padded to 4 for SIMD
+		std::vector<float>		x, y, z, r;
+		std::vector<uint32_t>	lights;
+		uint32_t				count;
+
+		SphereList();
+
+		void Resize(uint32_t newcount);
+
+		inline uint32_t Size() const	{ return count; }
+	};
+
+	struct RowData
+	{
+		SphereList				rowlights;
+		SphereList				grouplights;
+		SphereList				tilelights;
+		std::vector<uint32_t>	counts;
+		std::vector<uint32_t>	offsets;	// local to the row
+		std::vector<uint32_t>	indices;
+	};
+
+	std::vector<SphereList>		bands;		// lights touching a few rows
+	std::vector<RowData>		rows;
+	SphereList					viewlights;
+	std::vector<uint16_t>		firstslice;	// depth range of light (not clamped to tile)
+	std::vector<uint16_t>		lastslice;
+	std::vector<uint32_t>		offsets;
+	std::vector<uint32_t>		indices;
+	ThreadPool*					workers;
+	Math::Matrix				proj;
+	Math::Vector2				clipplanes;
+	uint32_t					tilesize;
+	uint32_t					numslices;
+	uint32_t					numtilesx;
+	uint32_t					numtilesy;
+	float						slicescale;
+	float						slicebias;
+
+	void TransformLights(const Math::Vector4* lights, const Math::Matrix& view, uint32_t begin, uint32_t end);
+	void CullBand(const Math::Vector2* tiledepths, uint32_t band);
+	void CullRow(const Math::Vector2* tiledepths, uint32_t row);
+	void CullSpheres(SphereList& out, const SphereList& in, float left, float right, float bottom, float top, const Math::Vector2& depths) const;
+	void AddToClusters(RowData& data, uint32_t tile, const Math::Vector2& depths);
+
+	uint32_t GetSlice(float depth) const;
+
+public:
+	LightCuller(uint32_t tilesize = 16, uint32_t numslices = 16);
+
+	// lights are world space position + radius, tiledepths are linear depth (min, max) per tile (optional)
+	void Cull(
+		const Math::Vector4* lights, uint32_t numlights,
+		const Math::Matrix& view, const Math::Matrix& proj, const Math::Vector2& clipplanes,
+		uint32_t screenwidth, uint32_t screenheight,
+		const Math::Vector2* tiledepths = nullptr);
+
+	inline void SetThreadPool(ThreadPool* pool)					{ workers = pool; }
+
+	inline const std::vector<uint32_t>& GetOffsets() const		{ return offsets; }
+	inline const std::vector<uint32_t>& GetIndices() const		{ return indices; }
+	inline uint32_t GetNumTilesX() const						{ return numtilesx; }
+	inline uint32_t GetNumTilesY() const						{ return numtilesy; }
+	inline uint32_t GetNumSlices() const						{ return numslices; }
+
+	// for shaders: slice = clamp(log(depth) * scale + bias, 0, numslices - 1)
+	inline float GetSliceScale() const							{ return slicescale; }
+	inline float GetSliceBias() const							{ return slicebias; }
+};
+
+#endif
@@ -1,12 +1,21 @@
 
 #include "lightning.h"
 #include "geometryutils.h"
+#include "threadpool.h"
+#include "profiler.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#	include <emmintrin.h>
+#	define LIGHTNING_SSE2
+#endif
 
 #define METRIC_CORRECTION	8e-2f
+#define BLOCKS_PER_JOB		64		// 4 segments each
+#define MAX_FORK_LEVELS		32
 
 LightningParameters CoilLightning = {
 	Math::Vector2(0.45f, 0.55f),
-	METRIC_CORRECTION * Math::Vector2(-3.0f, 3.0f),	
+	METRIC_CORRECTION * Math::Vector2(-3.0f, 3.0f),
 	METRIC_CORRECTION * Math::Vector2(-3.0f, 3.0f),
 	0.5f,
 
@@ -20,58 +29,114 @@ LightningParameters CoilLightning = {
 	METRIC_CORRECTION * Math::Vector2(0.0f, 1.0f),
 	0.5f,
 	METRIC_CORRECTION * Math::Vector2(1.0f, 2.0f),
-	0.01f
+	0.01f,
+	0.5f
+};
+
+// billboard corners (left/right, start/end) and the 18 vertices that use them
+static const uint8_t CornerIndices[18] = {
+	0, 1, 2, 2, 1, 3,	// top cap
+	2, 3, 4, 4, 3, 5,	// inner quad
+	4, 5, 6, 6, 5, 7	// bottom cap
 };
 
-// --- Linear Congruential Generator ------------------------------------------
+static const float CornerU[8] = { -1, 1, -1, 1, -1, 1, -1, 1 };
+static const float CornerV[8] = { 1, 1, 0, 0, 0, 0, 1, 1 };
 
-static int random_x;
+// --- Counter-based generator ------------------------------------------------
 
-#define RANDOM_IA	16807
-#define RANDOM_IM	2147483647
-#define RANDOM_AM	(1.0f / RANDOM_IM)
-#define RANDOM_IQ	127773
-#define RANDOM_IR	2836
-#define RANDOM_MASK	123459876
+// NOTE: every number is a hash of (seed, level, segment, draw), so segments don't depend on each other
 
-static float Random()
+static uint32_t Hash(uint32_t x)
 {
-	// NOTE: http://www.library.cornell.edu/nr/bookcpdf/c7-1.pdf
-
-	int k;
-	float ans;
-	
-	random_x ^= RANDOM_MASK;
-	k = random_x / RANDOM_IQ;
-	random_x = RANDOM_IA * (random_x - k * RANDOM_IQ ) - RANDOM_IR * k;
-	
-	if (random_x < 0) 
-		random_x += RANDOM_IM;
-	
-	ans = RANDOM_AM * random_x;
-	random_x ^= RANDOM_MASK;
-	
-	return ans;
+	// NOTE: https://nullprogram.com/blog/2018/07/31/ (lowbias32)
+
+	x ^= x >> 16;
+	x *= 0x7feb352dU;
+	x ^= x >> 15;
+	x *= 0x846ca68bU;
+	x ^= x >> 16;
+
+	return x;
 }
 
-static void RandomSeed(int value)
+#ifndef LIGHTNING_SSE2
+static float Random(uint32_t key, uint32_t draw, const Math::Vector2& range)
 {
-	random_x = value;
-	Random();
+	float v = (Hash(key + draw) >> 8) * (1.0f / 16777216.0f);
+	return range.x * (1.0f - v) + range.y * v;
 }
+#endif
 
-static float Random(float low, float high)
+#ifdef LIGHTNING_SSE2
+static __m128i MultiplyLow(__m128i a, __m128i b)
 {
-	float v = Random();
-	return low * (1.0f - v) + high * v;
-};
+	// NOTE: SSE2 has no _mm_mullo_epi32
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static __m128i Hash(__m128i x)
+{
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+	x = MultiplyLow(x, _mm_set1_epi32(0x7feb352d));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+	x = MultiplyLow(x, _mm_set1_epi32((int32_t)0x846ca68bU));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+
+	return x;
+}
+
+static __m128 Random(__m128i keys, uint32_t draw, const Math::Vector2& range)
+{
+	__m128i h = Hash(_mm_add_epi32(keys, _mm_set1_epi32((int32_t)draw)));
+	__m128 v = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(h, 8)), _mm_set1_ps(1.0f / 16777216.0f));
+
+	return _mm_add_ps(_mm_mul_ps(_mm_set1_ps(range.x), _mm_sub_ps(_mm_set1_ps(1.0f), v)), _mm_mul_ps(_mm_set1_ps(range.y), v));
+}
+
+static void Normalize(__m128& x, __m128& y, __m128& z)
+{
+	__m128 lensq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+	__m128 il = _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(lensq));
+
+	x = _mm_mul_ps(x, il);
+	y = _mm_mul_ps(y, il);
+	z = _mm_mul_ps(z, il);
+}
+#endif
 
 // --- Lightning impl ---------------------------------------------------------
 
+void Lightning::SegmentStreams::Resize(size_t newsize)
+{
+	startsx.resize(newsize);
+	startsy.resize(newsize);
+	startsz.resize(newsize);
+	endsx.resize(newsize);
+	endsy.resize(newsize);
+	endsz.resize(newsize);
+	upsx.resize(newsize);
+	upsy.resize(newsize);
+	upsz.resize(newsize);
+	levels.resize(newsize);
+}
+
 Lightning::Lightning(const LightningParameters& params)
 {
-	parameters = params;
-	storageimpl = nullptr;
+	parameters		= params;
+	workers			= nullptr;
+	storageimpl		= nullptr;
+	numseeds		= 0;
+	numpadded		= 0;
+	numsubdivided	= 0;
+	numsegments		= 0;
+	randomseed		= 0;
+	framekey		= 0;
+	levels			= 0;
+	mask			= 0;
 
 	AnimationSpeed = 15;
 }
@@ -98,15 +163,22 @@ size_t Lightning::CalculateNumVertices(size_t segments, int levels, int mask)
 bool Lightning::Initialize(IParticleStorage* impl, const SeedList& seeds, int subdivisionlevels, int subdivisionmask)
 {
 	Math::Vector3 jitter;
-	size_t segments = seeds.size() / 2;
-	size_t maxnumvertices = CalculateNumVertices(segments, subdivisionlevels, subdivisionmask);
+	size_t numseedsegments = seeds.size() / 2;
+	size_t numpaddedsegments = (numseedsegments + 3) & ~(size_t)3;
+	size_t maxnumsegments = CalculateNumVertices(numseedsegments, subdivisionlevels, subdivisionmask) / 2;
 
-	if (!impl->Initialize(maxnumvertices * 18, sizeof(GeometryUtils::BillboardVertex)))
+	// NOTE: two caps and a quad per segment
+	if (!impl->Initialize(maxnumsegments * 18, sizeof(GeometryUtils::BillboardVertex)))
 		return false;
 
-	storageimpl	= impl;
-	levels		= subdivisionlevels;
-	mask		= subdivisionmask;
+	storageimpl		= impl;
+	levels			= subdivisionlevels;
+	mask			= subdivisionmask;
+	numseeds		= numseedsegments;
+	numpadded		= numpaddedsegments;
+	numsubdivided	= CalculateNumVertices(numpaddedsegments, subdivisionlevels, subdivisionmask) / 2;
+	numsegments		= maxnumsegments;
+	randomseed		= Hash((uint32_t)(Math::RandomFloat() * 16777216.0f));
 
 	seedpoints.reserve(seeds.size());
 
@@ -117,8 +189,17 @@ bool Lightning::Initialize(IParticleStorage* impl, const SeedList& seeds, int su
 		seedpoints.push_back(p + jitter);
 	}
 
-	subdivided0.reserve(maxnumvertices);
-	subdivided1.reserve(maxnumvertices);
+	// the two buffers hold every other level
+	size_t sizes[2] = { numpadded, 0 };
+	size_t count = numpadded;
+
+	for (int i = 0; i < levels; ++i) {
+		count *= ((mask & (1 << i)) ? 3 : 2);
+		sizes[(i + 1) % 2] = count;
+	}
+
+	segments[0].Resize(sizes[0]);
+	segments[1].Resize(sizes[1]);
 
 	return true;
 }
@@ -126,40 +207,183 @@ bool Lightning::Initialize(IParticleStorage* impl, const SeedList& seeds, int su
 void Lightning::Reset()
 {
 	seedpoints.clear();
+
+	numseeds		= 0;
+	numpadded		= 0;
+	numsubdivided	= 0;
+	numsegments		= 0;
 }
 
 void Lightning::Subdivide(float time)
 {
-	subdivided0.clear();
-	subdivided1.clear();
-
-	// fill first buffer
-	for (const Math::Vector3& p : seedpoints) {
-		subdivided0.push_back(p);
+	PROFILE_SCOPE("Lightning::Subdivide");
+
+	SegmentStreams& first = segments[0];
+
+	// fill first buffer (padding repeats the first seed)
+	for (size_t i = 0; i < numpadded; ++i) {
+		size_t j = ((i < numseeds) ? i : 0) * 2;
+
+		first.startsx[i]	= seedpoints[j].x;
+		first.startsy[i]	= seedpoints[j].y;
+		first.startsz[i]	= seedpoints[j].z;
+		first.endsx[i]		= seedpoints[j + 1].x;
+		first.endsy[i]		= seedpoints[j + 1].y;
+		first.endsz[i]		= seedpoints[j + 1].z;
+		first.upsx[i]		= 0;
+		first.upsy[i]		= 1;
+		first.upsz[i]		= 0;
+		first.levels[i]		= 0;
 	}
 
-	// subdivide
-	SeedList* buffers[] = { &subdivided0, &subdivided1 };
-
-	Math::Vector3 forward, right, center;
-	Math::Vector3 up(0, 1, 0);
-	Math::Vector3 splitpos;
-	float decay;
-	int current = 0;
+	// NOTE: the shape changes AnimationSpeed times per second
+	size_t count = numpadded;
+	framekey = Hash(randomseed + (uint32_t)(time * AnimationSpeed));
 
 	for (int i = 0; i < levels; ++i) {
-		const std::vector<Math::Vector3>& source = *buffers[current];
-		std::vector<Math::Vector3>& target = *buffers[1 - current];
+		// NOTE: captures fit into std::function without allocation
+		auto subdivide = [this, i](uint32_t begin, uint32_t end, uint32_t) {
+			SubdivideRange(i, begin, end);
+		};
 
-		target.clear();
+		uint32_t numblocks = (uint32_t)(count / 4);
 
-		for (size_t j = 0; j < source.size(); j += 2) {
-			const Math::Vector3& p1 = source[j];
-			const Math::Vector3& p2 = source[j + 1];
-			
-			RandomSeed((int)(j / 2 + 1.0f + time * AnimationSpeed));
+		if (workers != nullptr)
+			workers->ParallelFor(numblocks, BLOCKS_PER_JOB, subdivide);
+		else
+			subdivide(0, numblocks, 0);
 
-			Math::Vec3Normalize(forward, p2 - p1);
+		count *= ((mask & (1 << i)) ? 3 : 2);
+	}
+}
+
+void Lightning::SubdivideRange(int level, uint32_t begin, uint32_t end)
+{
+	const SegmentStreams& source = segments[level % 2];
+	SegmentStreams& target = segments[1 - level % 2];
+
+	bool fork = ((mask & (1 << level)) != 0);
+	uint32_t levelkey = Hash(framekey + (uint32_t)level);
+	size_t count = numpadded;
+
+	for (int i = 0; i < level; ++i)
+		count *= ((mask & (1 << i)) ? 3 : 2);
+
+	const Math::Vector2& fraction	= (fork ? parameters.ForkFraction : parameters.ZigZagFraction);
+	const Math::Vector2& deviationx	= (fork ? parameters.ForkZigZagDeviationRight : parameters.ZigZagDeviationRight);
+	const Math::Vector2& deviationy	= (fork ? parameters.ForkZigZagDeviationUp : parameters.ZigZagDeviationUp);
+
+	float zigzagdecay	= expf(-(fork ? parameters.ForkZigZagDeviationDecay : parameters.ZigZagDeviationDecay) * level);
+	float lengthdecay	= expf(-parameters.ForkLengthDecay * level);
+
+	// NOTE: children are stored child-major (index + k * count), so blocks of 4 stay contiguous
+	for (uint32_t b = begin; b < end; ++b) {
+		size_t j = b * 4;
+
+#ifdef LIGHTNING_SSE2
+		__m128 x1 = _mm_loadu_ps(source.startsx.data() + j);
+		__m128 y1 = _mm_loadu_ps(source.startsy.data() + j);
+		__m128 z1 = _mm_loadu_ps(source.startsz.data() + j);
+		__m128 x2 = _mm_loadu_ps(source.endsx.data() + j);
+		__m128 y2 = _mm_loadu_ps(source.endsy.data() + j);
+		__m128 z2 = _mm_loadu_ps(source.endsz.data() + j);
+		__m128 ux = _mm_loadu_ps(source.upsx.data() + j);
+		__m128 uy = _mm_loadu_ps(source.upsy.data() + j);
+		__m128 uz = _mm_loadu_ps(source.upsz.data() + j);
+		__m128 depth = _mm_loadu_ps(source.levels.data() + j);
+
+		__m128i keys = _mm_add_epi32(_mm_set1_epi32((int32_t)levelkey), _mm_slli_epi32(_mm_setr_epi32((int32_t)j, (int32_t)j + 1, (int32_t)j + 2, (int32_t)j + 3), 3));
+
+		// frame
+		__m128 fx = _mm_sub_ps(x2, x1);
+		__m128 fy = _mm_sub_ps(y2, y1);
+		__m128 fz = _mm_sub_ps(z2, z1);
+
+		Normalize(fx, fy, fz);
+
+		__m128 rx = _mm_sub_ps(_mm_mul_ps(fy, uz), _mm_mul_ps(fz, uy));
+		__m128 ry = _mm_sub_ps(_mm_mul_ps(fz, ux), _mm_mul_ps(fx, uz));
+		__m128 rz = _mm_sub_ps(_mm_mul_ps(fx, uy), _mm_mul_ps(fy, ux));
+
+		Normalize(rx, ry, rz);
+
+		ux = _mm_sub_ps(_mm_mul_ps(ry, fz), _mm_mul_ps(rz, fy));
+		uy = _mm_sub_ps(_mm_mul_ps(rz, fx), _mm_mul_ps(rx, fz));
+		uz = _mm_sub_ps(_mm_mul_ps(rx, fy), _mm_mul_ps(ry, fx));
+
+		Normalize(ux, uy, uz);
+
+		// zig-zag
+		__m128 t = Random(keys, 0, fraction);
+		__m128 s = _mm_sub_ps(_mm_set1_ps(1.0f), t);
+		__m128 dx = _mm_mul_ps(_mm_set1_ps(zigzagdecay), Random(keys, 1, deviationx));
+		__m128 dy = _mm_mul_ps(_mm_set1_ps(zigzagdecay), Random(keys, 2, deviationy));
+
+		__m128 sx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x1, s), _mm_mul_ps(x2, t)), _mm_add_ps(_mm_mul_ps(rx, dx), _mm_mul_ps(ux, dy)));
+		__m128 sy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(y1, s), _mm_mul_ps(y2, t)), _mm_add_ps(_mm_mul_ps(ry, dx), _mm_mul_ps(uy, dy)));
+		__m128 sz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(z1, s), _mm_mul_ps(z2, t)), _mm_add_ps(_mm_mul_ps(rz, dx), _mm_mul_ps(uz, dy)));
+
+		size_t k = j + count;
+
+		_mm_storeu_ps(target.startsx.data() + j, x1);
+		_mm_storeu_ps(target.startsy.data() + j, y1);
+		_mm_storeu_ps(target.startsz.data() + j, z1);
+		_mm_storeu_ps(target.endsx.data() + j, sx);
+		_mm_storeu_ps(target.endsy.data() + j, sy);
+		_mm_storeu_ps(target.endsz.data() + j, sz);
+		_mm_storeu_ps(target.upsx.data() + j, ux);
+		_mm_storeu_ps(target.upsy.data() + j, uy);
+		_mm_storeu_ps(target.upsz.data() + j, uz);
+		_mm_storeu_ps(target.levels.data() + j, depth);
+
+		_mm_storeu_ps(target.startsx.data() + k, sx);
+		_mm_storeu_ps(target.startsy.data() + k, sy);
+		_mm_storeu_ps(target.startsz.data() + k, sz);
+		_mm_storeu_ps(target.endsx.data() + k, x2);
+		_mm_storeu_ps(target.endsy.data() + k, y2);
+		_mm_storeu_ps(target.endsz.data() + k, z2);
+		_mm_storeu_ps(target.upsx.data() + k, ux);
+		_mm_storeu_ps(target.upsy.data() + k, uy);
+		_mm_storeu_ps(target.upsz.data() + k, uz);
+		_mm_storeu_ps(target.levels.data() + k, depth);
+
+		if (fork) {
+			__m128 ox = Random(keys, 3, parameters.ForkDeviationRight);
+			__m128 oy = Random(keys, 4, parameters.ForkDeviationUp);
+			__m128 oz = Random(keys, 5, parameters.ForkDeviationForward);
+
+			// NOTE: decay cancels out when normalized
+			__m128 dirx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, rx), _mm_mul_ps(oy, ux)), _mm_mul_ps(oz, fx));
+			__m128 diry = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, ry), _mm_mul_ps(oy, uy)), _mm_mul_ps(oz, fy));
+			__m128 dirz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, rz), _mm_mul_ps(oy, uz)), _mm_mul_ps(oz, fz));
+
+			Normalize(dirx, diry, dirz);
+
+			__m128 length = _mm_mul_ps(_mm_set1_ps(lengthdecay), Random(keys, 6, parameters.ForkLength));
+
+			k += count;
+
+			_mm_storeu_ps(target.startsx.data() + k, sx);
+			_mm_storeu_ps(target.startsy.data() + k, sy);
+			_mm_storeu_ps(target.startsz.data() + k, sz);
+			_mm_storeu_ps(target.endsx.data() + k, _mm_add_ps(sx, _mm_mul_ps(length, dirx)));
+			_mm_storeu_ps(target.endsy.data() + k, _mm_add_ps(sy, _mm_mul_ps(length, diry)));
+			_mm_storeu_ps(target.endsz.data() + k, _mm_add_ps(sz, _mm_mul_ps(length, dirz)));
+			_mm_storeu_ps(target.upsx.data() + k, ux);
+			_mm_storeu_ps(target.upsy.data() + k, uy);
+			_mm_storeu_ps(target.upsz.data() + k, uz);
+			_mm_storeu_ps(target.levels.data() + k, _mm_add_ps(depth, _mm_set1_ps(1.0f)));
+		}
+#else
+		for (size_t l = j; l < j + 4; ++l) {
+			Math::Vector3 p1(source.startsx[l], source.startsy[l], source.startsz[l]);
+			Math::Vector3 p2(source.endsx[l], source.endsy[l], source.endsz[l]);
+			Math::Vector3 up(source.upsx[l], source.upsy[l], source.upsz[l]);
+			Math::Vector3 forward, right, splitpos;
+			uint32_t key = levelkey + (uint32_t)l * 8;
+
+			Math::Vec3Subtract(forward, p2, p1);
+			Math::Vec3Normalize(forward, forward);
 
 			Math::Vec3Cross(right, forward, up);
 			Math::Vec3Normalize(right, right);
@@ -167,63 +391,52 @@ void Lightning::Subdivide(float time)
 			Math::Vec3Cross(up, right, forward);
 			Math::Vec3Normalize(up, up);
 
-			// TODO: up vector and level should be calculated and stored
-
-			if (mask & (1 << i)) {
-				// fork
-				Math::Vec3Lerp(splitpos, p1, p2, Random(parameters.ForkFraction.x, parameters.ForkFraction.y));
-
-				decay = expf(-parameters.ForkZigZagDeviationDecay * i);
+			// zig-zag
+			Math::Vec3Lerp(splitpos, p1, p2, Random(key, 0, fraction));
 
-				Math::Vector2 delta = decay * Math::Vector2(
-					Random(parameters.ForkZigZagDeviationRight.x, parameters.ForkZigZagDeviationRight.y),
-					Random(parameters.ForkZigZagDeviationUp.x, parameters.ForkZigZagDeviationUp.y));
+			splitpos += right * (zigzagdecay * Random(key, 1, deviationx));
+			splitpos += up * (zigzagdecay * Random(key, 2, deviationy));
 
-				splitpos += right * delta.x;
-				splitpos += up * delta.y;
+			size_t k = l + count;
 
-				target.push_back(p1);
-				target.push_back(splitpos);
-				target.push_back(splitpos);
-				target.push_back(p2);
+			target.startsx[l] = p1.x;			target.startsx[k] = splitpos.x;
+			target.startsy[l] = p1.y;			target.startsy[k] = splitpos.y;
+			target.startsz[l] = p1.z;			target.startsz[k] = splitpos.z;
+			target.endsx[l] = splitpos.x;		target.endsx[k] = p2.x;
+			target.endsy[l] = splitpos.y;		target.endsy[k] = p2.y;
+			target.endsz[l] = splitpos.z;		target.endsz[k] = p2.z;
+			target.upsx[l] = up.x;				target.upsx[k] = up.x;
+			target.upsy[l] = up.y;				target.upsy[k] = up.y;
+			target.upsz[l] = up.z;				target.upsz[k] = up.z;
+			target.levels[l] = source.levels[l];	target.levels[k] = source.levels[l];
 
-				decay = expf(-parameters.ForkDeviationDecay * i);
-
-				Math::Vector3 forkdelta = decay * Math::Vector3(
-					Random(parameters.ForkDeviationRight.x,parameters.ForkDeviationRight.y),
-					Random(parameters.ForkDeviationUp.x, parameters.ForkDeviationUp.y),
-					Random(parameters.ForkDeviationForward.x, parameters.ForkDeviationForward.y));
-
-				decay = expf(-parameters.ForkLengthDecay * i);
-				
+			if (fork) {
 				Math::Vector3 forkdir;
+				Math::Vector3 forkdelta(
+					Random(key, 3, parameters.ForkDeviationRight),
+					Random(key, 4, parameters.ForkDeviationUp),
+					Random(key, 5, parameters.ForkDeviationForward));
+
 				Math::Vec3Normalize(forkdir, forkdelta.x * right + forkdelta.y * up + forkdelta.z * forward);
-				
-				float forklength = decay * Random(parameters.ForkLength.x, parameters.ForkLength.y);
+
+				float forklength = lengthdecay * Random(key, 6, parameters.ForkLength);
 				Math::Vector3 forkpos = splitpos + forklength * forkdir;
-	
-				target.push_back(splitpos);
-				target.push_back(forkpos);
-			} else {
-				// zig-zag
-				Math::Vec3Lerp(splitpos, p1, p2, Random(parameters.ZigZagFraction.x, parameters.ZigZagFraction.y));
-
-				float decay = expf(-parameters.ZigZagDeviationDecay * i);
-				Math::Vector2 delta = decay * Math::Vector2(
-					Random(parameters.ZigZagDeviationRight.x, parameters.ZigZagDeviationRight.y),
-					Random(parameters.ZigZagDeviationUp.x, parameters.ZigZagDeviationUp.y));
-
-				splitpos += right * delta.x;
-				splitpos += up * delta.y;
-
-				target.push_back(p1);
-				target.push_back(splitpos);
-				target.push_back(splitpos);
-				target.push_back(p2);
+
+				k += count;
+
+				target.startsx[k]	= splitpos.x;
+				target.startsy[k]	= splitpos.y;
+				target.startsz[k]	= splitpos.z;
+				target.endsx[k]		= forkpos.x;
+				target.endsy[k]		= forkpos.y;
+				target.endsz[k]		= forkpos.z;
+				target.upsx[k]		= up.x;
+				target.upsy[k]		= up.y;
+				target.upsz[k]		= up.z;
+				target.levels[k]	= source.levels[l] + 1.0f;
 			}
 		}
-
-		current = 1 - current;
+#endif
 	}
 }
 
@@ -231,128 +444,183 @@ void Lightning::Generate(float thickness, const Math::Matrix& view)
 {
 	// NOTE: can't use triangle strip because there's no primitive restart
 
-	Math::Vector3	viewpos1, viewpos2;
-	Math::Vector3	forward, right;
-	float			halfthickness = thickness * 0.5f;
+	PROFILE_SCOPE("Lightning::Generate");
+
+	struct {
+		GeometryUtils::BillboardVertex*	vdata;
+		Math::Matrix					view;
+		float							halfthickness[MAX_FORK_LEVELS + 1];
+	} context;
 
-	// use texcoord for gradient
-	GeometryUtils::BillboardVertex*	vdata = (GeometryUtils::BillboardVertex*)storageimpl->LockVertexBuffer(0, 0);
-	const auto& vertices = GetSubdivision();
+	context.vdata = (GeometryUtils::BillboardVertex*)storageimpl->LockVertexBuffer(0, 0);
+	context.view = view;
 
-	if (vdata == nullptr)
+	if (context.vdata == nullptr)
 		return;
 
-	for (size_t i = 0; i < vertices.size(); i += 2) {
-		const Math::Vector3& start = vertices[i];
-		const Math::Vector3& end = vertices[i + 1];
-
-		GeometryUtils::BillboardVertex* t1 = (vdata + 0);
-		GeometryUtils::BillboardVertex* t2 = (vdata + 1);
-		GeometryUtils::BillboardVertex* t3 = (vdata + 2);
-		GeometryUtils::BillboardVertex* t4 = (vdata + 3);
-		GeometryUtils::BillboardVertex* t5 = (vdata + 4);
-		GeometryUtils::BillboardVertex* t6 = (vdata + 5);
-
-		GeometryUtils::BillboardVertex* v1 = (vdata + 6);
-		GeometryUtils::BillboardVertex* v2 = (vdata + 7);
-		GeometryUtils::BillboardVertex* v3 = (vdata + 8);
-		GeometryUtils::BillboardVertex* v4 = (vdata + 9);
-		GeometryUtils::BillboardVertex* v5 = (vdata + 10);
-		GeometryUtils::BillboardVertex* v6 = (vdata + 11);
-
-		GeometryUtils::BillboardVertex* b1 = (vdata + 12);
-		GeometryUtils::BillboardVertex* b2 = (vdata + 13);
-		GeometryUtils::BillboardVertex* b3 = (vdata + 14);
-		GeometryUtils::BillboardVertex* b4 = (vdata + 15);
-		GeometryUtils::BillboardVertex* b5 = (vdata + 16);
-		GeometryUtils::BillboardVertex* b6 = (vdata + 17);
-
-		Math::Vec3TransformCoord(viewpos1, start, view);
-		Math::Vec3TransformCoord(viewpos2, end, view);
-
-		Math::Vec3Subtract(forward, viewpos2, viewpos1);
-		Math::Vec3Cross(right, forward, Math::Vector3(0, 0, 1));
-
-		Math::Vec3Normalize(forward, forward);
-		Math::Vec3Normalize(right, right);
-
-		// top cap
-		t1->x = viewpos1.x - right.x * halfthickness - forward.x * halfthickness;
-		t1->y = viewpos1.y - right.y * halfthickness - forward.y * halfthickness;
-		t1->z = viewpos1.z - right.z * halfthickness - forward.z * halfthickness;
-		t1->u = -1;
-		t1->v = 1;
-
-		t2->x = t5->x = viewpos1.x + right.x * halfthickness - forward.x * halfthickness;
-		t2->y = t5->y = viewpos1.y + right.y * halfthickness - forward.y * halfthickness;
-		t2->z = t5->z = viewpos1.z + right.z * halfthickness - forward.z * halfthickness;
-		t2->u = t5->u = 1;
-		t2->v = t5->v = 1;
-
-		t3->x = t4->x = viewpos1.x - right.x * halfthickness;
-		t3->y = t4->y = viewpos1.y - right.y * halfthickness;
-		t3->z = t4->z = viewpos1.z - right.z * halfthickness;
-		t3->u = t4->u = -1;
-		t3->v = t4->v = 0;
-
-		t6->x = viewpos1.x + right.x * halfthickness;
-		t6->y = viewpos1.y + right.y * halfthickness;
-		t6->z = viewpos1.z + right.z * halfthickness;
-		t6->u = 1;
-		t6->v = 0;
-
-		// inner quad
-		v1->x = viewpos1.x - right.x * halfthickness;
-		v1->y = viewpos1.y - right.y * halfthickness;
-		v1->z = viewpos1.z - right.z * halfthickness;
-		v1->u = -1;
-		v1->v = 0;
-
-		v2->x = v5->x = viewpos1.x + right.x * halfthickness;
-		v2->y = v5->y = viewpos1.y + right.y * halfthickness;
-		v2->z = v5->z = viewpos1.z + right.z * halfthickness;
-		v2->u = v5->u = 1;
-		v2->v = v5->v = 0;
-
-		v3->x = v4->x = viewpos2.x - right.x * halfthickness;
-		v3->y = v4->y = viewpos2.y - right.y * halfthickness;
-		v3->z = v4->z = viewpos2.z - right.z * halfthickness;
-		v3->u = v4->u = -1;
-		v3->v = v4->v = 0;
-
-		v6->x = viewpos2.x + right.x * halfthickness;
-		v6->y = viewpos2.y + right.y * halfthickness;
-		v6->z = viewpos2.z + right.z * halfthickness;
-		v6->u = 1;
-		v6->v = 0;
-
-		// bottom cap
-		b1->x = viewpos2.x - right.x * halfthickness;
-		b1->y = viewpos2.y - right.y * halfthickness;
-		b1->z = viewpos2.z - right.z * halfthickness;
-		b1->u = -1;
-		b1->v = 0;
-
-		b2->x = b5->x = viewpos2.x + right.x * halfthickness;
-		b2->y = b5->y = viewpos2.y + right.y * halfthickness;
-		b2->z = b5->z = viewpos2.z + right.z * halfthickness;
-		b2->u = b5->u = 1;
-		b2->v = b5->v = 0;
-
-		b3->x = b4->x = viewpos2.x - right.x * halfthickness + forward.x * halfthickness;
-		b3->y = b4->y = viewpos2.y - right.y * halfthickness + forward.y * halfthickness;
-		b3->z = b4->z = viewpos2.z - right.z * halfthickness + forward.z * halfthickness;
-		b3->u = b4->u = -1;
-		b3->v = b4->v = 1;
-
-		b6->x = viewpos2.x + right.x * halfthickness + forward.x * halfthickness;
-		b6->y = viewpos2.y + right.y * halfthickness + forward.y * halfthickness;
-		b6->z = viewpos2.z + right.z * halfthickness + forward.z * halfthickness;
-		b6->u = 1;
-		b6->v = 1;
-
-		vdata += 18;
-	}
+	// forks get thinner
+	for (int i = 0; i <= MAX_FORK_LEVELS; ++i)
+		context.halfthickness[i] = thickness * 0.5f * expf(-parameters.ForkThicknessDecay * i);
+
+	// NOTE: segment j is a descendant of seed (j % numpadded), padding is skipped
+	auto generate = [this, &context](uint32_t begin, uint32_t end, uint32_t) {
+		const SegmentStreams& source = segments[levels % 2];
+		const Math::Matrix& view = context.view;
+		const float* halfthickness = context.halfthickness;
+
+		float cornersx[8][4];
+		float cornersy[8][4];
+		float cornersz[8][4];
+
+		for (uint32_t b = begin; b < end; ++b) {
+			size_t j = b * 4;
+			size_t root = j % numpadded;
+
+			if (root >= numseeds)
+				continue;
+
+			size_t first = (j / numpadded) * numseeds + root;
+			size_t count = Math::Min<size_t>(numseeds - root, 4);
+
+#ifdef LIGHTNING_SSE2
+			__m128 x1 = _mm_loadu_ps(source.startsx.data() + j);
+			__m128 y1 = _mm_loadu_ps(source.startsy.data() + j);
+			__m128 z1 = _mm_loadu_ps(source.startsz.data() + j);
+			__m128 x2 = _mm_loadu_ps(source.endsx.data() + j);
+			__m128 y2 = _mm_loadu_ps(source.endsy.data() + j);
+			__m128 z2 = _mm_loadu_ps(source.endsz.data() + j);
+
+			__m128 h = _mm_setr_ps(
+				halfthickness[Math::Min((int)source.levels[j + 0], MAX_FORK_LEVELS)],
+				halfthickness[Math::Min((int)source.levels[j + 1], MAX_FORK_LEVELS)],
+				halfthickness[Math::Min((int)source.levels[j + 2], MAX_FORK_LEVELS)],
+				halfthickness[Math::Min((int)source.levels[j + 3], MAX_FORK_LEVELS)]);
+
+			// transform to view space
+			__m128 w1 = _mm_div_ps(_mm_set1_ps(1.0f), _mm_add_ps(_mm_add_ps(_mm_mul_ps(x1, _mm_set1_ps(view._14)), _mm_mul_ps(y1, _mm_set1_ps(view._24))), _mm_add_ps(_mm_mul_ps(z1, _mm_set1_ps(view._34)), _mm_set1_ps(view._44))));
+			__m128 w2 = _mm_div_ps(_mm_set1_ps(1.0f), _mm_add_ps(_mm_add_ps(_mm_mul_ps(x2, _mm_set1_ps(view._14)), _mm_mul_ps(y2, _mm_set1_ps(view._24))), _mm_add_ps(_mm_mul_ps(z2, _mm_set1_ps(view._34)), _mm_set1_ps(view._44))));
+
+			__m128 vx1 = _mm_mul_ps(w1, _mm_add_ps(_mm_add_ps(_mm_mul_ps(x1, _mm_set1_ps(view._11)), _mm_mul_ps(y1, _mm_set1_ps(view._21))), _mm_add_ps(_mm_mul_ps(z1, _mm_set1_ps(view._31)), _mm_set1_ps(view._41))));
+			__m128 vy1 = _mm_mul_ps(w1, _mm_add_ps(_mm_add_ps(_mm_mul_ps(x1, _mm_set1_ps(view._12)), _mm_mul_ps(y1, _mm_set1_ps(view._22))), _mm_add_ps(_mm_mul_ps(z1, _mm_set1_ps(view._32)), _mm_set1_ps(view._42))));
+			__m128 vz1 = _mm_mul_ps(w1, _mm_add_ps(_mm_add_ps(_mm_mul_ps(x1, _mm_set1_ps(view._13)), _mm_mul_ps(y1, _mm_set1_ps(view._23))), _mm_add_ps(_mm_mul_ps(z1, _mm_set1_ps(view._33)), _mm_set1_ps(view._43))));
+
+			__m128 vx2 = _mm_mul_ps(w2, _mm_add_ps(_mm_add_ps(_mm_mul_ps(x2, _mm_set1_ps(view._11)), _mm_mul_ps(y2, _mm_set1_ps(view._21))), _mm_add_ps(_mm_mul_ps(z2, _mm_set1_ps(view._31)), _mm_set1_ps(view._41))));
+			__m128 vy2 = _mm_mul_ps(w2, _mm_add_ps(_mm_add_ps(_mm_mul_ps(x2, _mm_set1_ps(view._12)), _mm_mul_ps(y2, _mm_set1_ps(view._22))), _mm_add_ps(_mm_mul_ps(z2, _mm_set1_ps(view._32)), _mm_set1_ps(view._42))));
+			__m128 vz2 = _mm_mul_ps(w2, _mm_add_ps(_mm_add_ps(_mm_mul_ps(x2, _mm_set1_ps(view._13)), _mm_mul_ps(y2, _mm_set1_ps(view._23))), _mm_add_ps(_mm_mul_ps(z2, _mm_set1_ps(view._33)), _mm_set1_ps(view._43))));
+
+			// forward and right = cross(forward, (0, 0, 1))
+			__m128 fx = _mm_sub_ps(vx2, vx1);
+			__m128 fy = _mm_sub_ps(vy2, vy1);
+			__m128 fz = _mm_sub_ps(vz2, vz1);
+			__m128 rx = fy;
+			__m128 ry = _mm_sub_ps(_mm_setzero_ps(), fx);
+			__m128 rz = _mm_setzero_ps();
+
+			Normalize(fx, fy, fz);
+			Normalize(rx, ry, rz);
+
+			fx = _mm_mul_ps(fx, h);
+			fy = _mm_mul_ps(fy, h);
+			fz = _mm_mul_ps(fz, h);
+			rx = _mm_mul_ps(rx, h);
+			ry = _mm_mul_ps(ry, h);
+
+			// corners: start -/+ right, end -/+ right, each moved by -forward (top cap) or +forward (bottom cap)
+			_mm_storeu_ps(cornersx[0], _mm_sub_ps(_mm_sub_ps(vx1, rx), fx));
+			_mm_storeu_ps(cornersy[0], _mm_sub_ps(_mm_sub_ps(vy1, ry), fy));
+			_mm_storeu_ps(cornersz[0], _mm_sub_ps(vz1, fz));
+
+			_mm_storeu_ps(cornersx[1], _mm_sub_ps(_mm_add_ps(vx1, rx), fx));
+			_mm_storeu_ps(cornersy[1], _mm_sub_ps(_mm_add_ps(vy1, ry), fy));
+			_mm_storeu_ps(cornersz[1], _mm_sub_ps(vz1, fz));
+
+			_mm_storeu_ps(cornersx[2], _mm_sub_ps(vx1, rx));
+			_mm_storeu_ps(cornersy[2], _mm_sub_ps(vy1, ry));
+			_mm_storeu_ps(cornersz[2], vz1);
+
+			_mm_storeu_ps(cornersx[3], _mm_add_ps(vx1, rx));
+			_mm_storeu_ps(cornersy[3], _mm_add_ps(vy1, ry));
+			_mm_storeu_ps(cornersz[3], vz1);
+
+			_mm_storeu_ps(cornersx[4], _mm_sub_ps(vx2, rx));
+			_mm_storeu_ps(cornersy[4], _mm_sub_ps(vy2, ry));
+			_mm_storeu_ps(cornersz[4], vz2);
+
+			_mm_storeu_ps(cornersx[5], _mm_add_ps(vx2, rx));
+			_mm_storeu_ps(cornersy[5], _mm_add_ps(vy2, ry));
+			_mm_storeu_ps(cornersz[5], vz2);
+
+			_mm_storeu_ps(cornersx[6], _mm_add_ps(_mm_sub_ps(vx2, rx), fx));
+			_mm_storeu_ps(cornersy[6], _mm_add_ps(_mm_sub_ps(vy2, ry), fy));
+			_mm_storeu_ps(cornersz[6], _mm_add_ps(vz2, fz));
+
+			_mm_storeu_ps(cornersx[7], _mm_add_ps(_mm_add_ps(vx2, rx), fx));
+			_mm_storeu_ps(cornersy[7], _mm_add_ps(_mm_add_ps(vy2, ry), fy));
+			_mm_storeu_ps(cornersz[7], _mm_add_ps(vz2, fz));
+#else
+			for (size_t l = 0; l < count; ++l) {
+				Math::Vector3 start(source.startsx[j + l], source.startsy[j + l], source.startsz[j + l]);
+				Math::Vector3 end(source.endsx[j + l], source.endsy[j + l], source.endsz[j + l]);
+				Math::Vector3 viewpos1, viewpos2, forward, right;
+				float h = halfthickness[Math::Min((int)source.levels[j + l], MAX_FORK_LEVELS)];
+
+				Math::Vec3TransformCoord(viewpos1, start, view);
+				Math::Vec3TransformCoord(viewpos2, end, view);
+
+				Math::Vec3Subtract(forward, viewpos2, viewpos1);
+				Math::Vec3Cross(right, forward, Math::Vector3(0, 0, 1));
+
+				Math::Vec3Normalize(forward, forward);
+				Math::Vec3Normalize(right, right);
+
+				forward *= h;
+				right *= h;
+
+				const Math::Vector3 corners[8] = {
+					viewpos1 - right - forward,
+					viewpos1 + right - forward,
+					viewpos1 - right,
+					viewpos1 + right,
+					viewpos2 - right,
+					viewpos2 + right,
+					viewpos2 - right + forward,
+					viewpos2 + right + forward
+				};
+
+				for (int k = 0; k < 8; ++k) {
+					cornersx[k][l] = corners[k].x;
+					cornersy[k][l] = corners[k].y;
+					cornersz[k][l] = corners[k].z;
+				}
+			}
+#endif
+
+			// use texcoord for gradient (whole vertices are written, so the locked buffer is filled sequentially)
+			for (size_t l = 0; l < count; ++l) {
+				GeometryUtils::BillboardVertex* vertices = context.vdata + (first + l) * 18;
+				GeometryUtils::BillboardVertex corners[8];
+
+				for (int k = 0; k < 8; ++k) {
+					corners[k].x		= cornersx[k][l];
+					corners[k].y		= cornersy[k][l];
+					corners[k].z		= cornersz[k][l];
+					corners[k].color	= 0xffffffff;
+					corners[k].u		= CornerU[k];
+					corners[k].v		= CornerV[k];
+				}
+
+				for (int k = 0; k < 18; ++k)
+					vertices[k] = corners[CornerIndices[k]];
+			}
+		}
+	};
+
+	uint32_t numblocks = (uint32_t)(numsubdivided / 4);
+
+	if (workers != nullptr)
+		workers->ParallelFor(numblocks, BLOCKS_PER_JOB, generate);
+	else
+		generate(0, numblocks, 0);
 
 	storageimpl->UnlockVertexBuffer();
 }
@@ -25,26 +25,53 @@ struct LightningParameters
 	float			ForkDeviationDecay;
 	Math::Vector2	ForkLength;
 	float			ForkLengthDecay;
+	float			ForkThicknessDecay;
 };
 
 extern LightningParameters CoilLightning;
 
 // --- Classes ----------------------------------------------------------------
 
+class ThreadPool;
+
 class Lightning
 {
 	typedef std::vector<Math::Vector3> SeedList;
 
+	// SoA layout (subdivision and generation process 4 segments at once)
+	struct SegmentStreams
+	{
+		std::vector<float>	startsx;
+		std::vector<float>	startsy;
+		std::vector<float>	startsz;
+		std::vector<float>	endsx;
+		std::vector<float>	endsy;
+		std::vector<float>	endsz;
+		std::vector<float>	upsx;		// frame of the parent segment
+		std::vector<float>	upsy;
+		std::vector<float>	upsz;
+		std::vector<float>	levels;		// how many forks away from the seed
+
+		void Resize(size_t newsize);
+	};
+
 private:
 	LightningParameters	parameters;
 	SeedList			seedpoints;
-	SeedList			subdivided0;
-	SeedList			subdivided1;
+	SegmentStreams		segments[2];	// ping-pong buffers
+	ThreadPool*			workers;
 	IParticleStorage*	storageimpl;	// GPU-side storage
+	size_t				numseeds;		// seed segments
+	size_t				numpadded;		// seed segments rounded up to 4
+	size_t				numsubdivided;	// after the last level (with padding)
+	size_t				numsegments;	// after the last level (without padding)
+	uint32_t			randomseed;		// differs between bolts
+	uint32_t			framekey;		// changes with time
 	int					levels;			// how many times to subdivide
 	int					mask;			// to know when to fork
 
 	size_t CalculateNumVertices(size_t segments, int levels, int mask);
+	void SubdivideRange(int level, uint32_t begin, uint32_t end);
 
 public:
 	float AnimationSpeed;
@@ -58,9 +85,8 @@ public:
 	void Subdivide(float time);
 	void Generate(float thickness, const Math::Matrix& view);
 
-	inline const std::vector<Math::Vector3>& GetSubdivision() const {
-		return ((levels % 2) ? subdivided1 : subdivided0);
-	}
+	inline void SetThreadPool(ThreadPool* pool)	{ workers = pool; }
+	inline size_t GetNumSegments() const		{ return numsegments; }
 };
 
 #endif
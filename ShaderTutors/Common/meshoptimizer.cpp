@@ -0,0 +1,688 @@
+
+#include "meshoptimizer.h"
+#include "3Dmath.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#define VERTEX_CACHE_SIZE		32		// of the Forsyth scoring (not the simulated cache)
+#define MAX_VALENCE_SCORES		32
+
+namespace MeshOptimizer {
+
+// --- Helpers ----------------------------------------------------------------
+
+class CacheSimulator
+{
+private:
+	std::vector<uint32_t>	timestamps;
+	uint32_t				cachesize;
+	uint32_t				time;
+
+public:
+	CacheSimulator(uint32_t numvertices, uint32_t size) {
+		timestamps.resize(numvertices, 0);
+
+		cachesize = size;
+		time = size + 1;
+	}
+
+	// NOTE: FIFO, returns true on miss
+	inline bool Access(uint32_t vertex) {
+		if (time - timestamps[vertex] > cachesize) {
+			timestamps[vertex] = time++;
+			return true;
+		}
+
+		return false;
+	}
+
+	inline void Reset() {
+		time += cachesize + 1;
+	}
+};
+
+struct ForsythTables
+{
+	float cachescores[VERTEX_CACHE_SIZE];
+	float valencescores[MAX_VALENCE_SCORES];
+
+	ForsythTables() {
+		// see https://tomforsyth1000.github.io/papers/fast_vert_cache_opt.html
+		for (uint32_t i = 0; i < VERTEX_CACHE_SIZE; ++i) {
+			if (i < 3)
+				cachescores[i] = 0.75f;	// the last triangle (no matter which order)
+			else
+				cachescores[i] = powf(1.0f - (i - 3) * (1.0f / (VERTEX_CACHE_SIZE - 3)), 1.5f);
+		}
+
+		valencescores[0] = 0.0f;
+
+		for (uint32_t i = 1; i < MAX_VALENCE_SCORES; ++i)
+			valencescores[i] = 2.0f * powf((float)i, -0.5f);
+	}
+
+	inline float Score(int32_t cacheposition, uint32_t numliveuses) const {
+		if (numliveuses == 0)
+			return -1.0f;
+
+		float score = (cacheposition >= 0 ? cachescores[cacheposition] : 0.0f);
+
+		if (numliveuses < MAX_VALENCE_SCORES)
+			score += valencescores[numliveuses];
+		else
+			score += 2.0f * powf((float)numliveuses, -0.5f);
+
+		return score;
+	}
+};
+
+static bool ReadString(const std::vector<uint8_t>& data, size_t& offset, std::string& out)
+{
+	// NOTE: strings in .qm files end with a newline
+	out.clear();
+
+	while (offset < data.size() && data[offset] != '\n')
+		out.push_back((char)data[offset++]);
+
+	if (offset == data.size())
+		return false;
+
+	++offset;
+	return true;
+}
+
+// --- Functions impl ---------------------------------------------------------
+
+void OptimizeVertexCache(uint32_t* outindices, const uint32_t* indices, uint32_t numindices, uint32_t numvertices)
+{
+	static const ForsythTables tables;
+
+	uint32_t numtriangles = numindices / 3;
+
+	std::vector<uint32_t>	offsets(numvertices + 1, 0);
+	std::vector<uint32_t>	liveuses(numvertices, 0);
+	std::vector<uint32_t>	adjacency(numtriangles * 3);
+	std::vector<int32_t>	cachepositions(numvertices, -1);
+	std::vector<float>		vertexscores(numvertices);
+	std::vector<float>		trianglescores(numtriangles);
+	std::vector<uint8_t>	emitted(numtriangles, 0);
+
+	// vertex -> triangles
+	for (uint32_t i = 0; i < numtriangles * 3; ++i)
+		++liveuses[indices[i]];
+
+	for (uint32_t i = 0; i < numvertices; ++i)
+		offsets[i + 1] = offsets[i] + liveuses[i];
+
+	std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+
+	for (uint32_t i = 0; i < numtriangles * 3; ++i)
+		adjacency[fill[indices[i]]++] = i / 3;
+
+	for (uint32_t i = 0; i < numvertices; ++i)
+		vertexscores[i] = tables.Score(-1, liveuses[i]);
+
+	for (uint32_t i = 0; i < numtriangles; ++i)
+		trianglescores[i] = vertexscores[indices[i * 3 + 0]] + vertexscores[indices[i * 3 + 1]] + vertexscores[indices[i * 3 + 2]];
+
+	uint32_t	cache[VERTEX_CACHE_SIZE + 3];
+	uint32_t	newcache[VERTEX_CACHE_SIZE + 3];
+	uint32_t	cachesize = 0;
+	uint32_t	cursor = 0;
+	int64_t		best = -1;
+
+	for (uint32_t t = 0; t < numtriangles; ++t) {
+		if (best == -1) {
+			// nothing in the cache, continue with the next unused triangle
+			while (emitted[cursor])
+				++cursor;
+
+			best = cursor;
+		}
+
+		const uint32_t* tri = indices + best * 3;
+		uint32_t newcachesize = 0;
+
+		outindices[t * 3 + 0] = tri[0];
+		outindices[t * 3 + 1] = tri[1];
+		outindices[t * 3 + 2] = tri[2];
+
+		emitted[best] = 1;
+
+		for (int k = 0; k < 3; ++k) {
+			uint32_t v = tri[k];
+			uint32_t* triangles = adjacency.data() + offsets[v];
+			uint32_t count = liveuses[v];
+
+			for (uint32_t j = 0; j < count; ++j) {
+				if (triangles[j] == best) {
+					triangles[j] = triangles[count - 1];
+					break;
+				}
+			}
+
+			--liveuses[v];
+			newcache[newcachesize++] = v;
+		}
+
+		for (uint32_t i = 0; i < cachesize; ++i) {
+			uint32_t v = cache[i];
+
+			if (v != tri[0] && v != tri[1] && v != tri[2])
+				newcache[newcachesize++] = v;
+		}
+
+		// update scores (the vertices that dropped out too)
+		for (uint32_t i = 0; i < newcachesize; ++i) {
+			uint32_t v = newcache[i];
+			int32_t position = (i < VERTEX_CACHE_SIZE ? (int32_t)i : -1);
+
+			float score = tables.Score(position, liveuses[v]);
+			float delta = score - vertexscores[v];
+
+			cachepositions[v] = position;
+			vertexscores[v] = score;
+
+			for (uint32_t j = 0; j < liveuses[v]; ++j)
+				trianglescores[adjacency[offsets[v] + j]] += delta;
+		}
+
+		cachesize = std::min<uint32_t>(newcachesize, VERTEX_CACHE_SIZE);
+		memcpy(cache, newcache, cachesize * sizeof(uint32_t));
+
+		// best triangle adjacent to the cache
+		float bestscore = -1.0f;
+		best = -1;
+
+		for (uint32_t i = 0; i < cachesize; ++i) {
+			uint32_t v = cache[i];
+
+			for (uint32_t j = 0; j < liveuses[v]; ++j) {
+				uint32_t candidate = adjacency[offsets[v] + j];
+
+				if (trianglescores[candidate] > bestscore) {
+					bestscore = trianglescores[candidate];
+					best = candidate;
+				}
+			}
+		}
+	}
+}
+
+uint32_t OptimizeOverdraw(uint32_t* outindices, const uint32_t* indices, uint32_t numindices, const float* positions, uint32_t posstride, uint32_t numvertices, float threshold)
+{
+	// NOTE: Sander et al., "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw", the input should be cache optimized
+	struct Cluster
+	{
+		uint32_t	start;
+		uint32_t	count;
+		float		sortkey;
+	};
+
+	uint32_t numtriangles = numindices / 3;
+
+	if (numtriangles == 0)
+		return 0;
+
+	CacheSimulator cache(numvertices, 16);
+	std::vector<uint32_t> hardstarts;
+	std::vector<Cluster> clusters;
+
+	auto CountMisses = [&](uint32_t triangle) -> uint32_t {
+		const uint32_t* tri = indices + triangle * 3;
+		return (uint32_t)cache.Access(tri[0]) + (uint32_t)cache.Access(tri[1]) + (uint32_t)cache.Access(tri[2]);
+	};
+
+	auto GetPosition = [&](uint32_t vertex) -> const Math::Vector3& {
+		return *(const Math::Vector3*)((const uint8_t*)positions + (size_t)vertex * posstride);
+	};
+
+	// hard boundaries (where the cache was flushed)
+	for (uint32_t i = 0; i < numtriangles; ++i) {
+		if (CountMisses(i) == 3 || i == 0)
+			hardstarts.push_back(i);
+	}
+
+	hardstarts.push_back(numtriangles);
+
+	// soft boundaries (where the local cache efficiency is good enough)
+	for (size_t i = 0; i + 1 < hardstarts.size(); ++i) {
+		uint32_t first = hardstarts[i];
+		uint32_t last = hardstarts[i + 1];
+		uint32_t misses = 0;
+
+		cache.Reset();
+
+		for (uint32_t j = first; j < last; ++j)
+			misses += CountMisses(j);
+
+		float clusteracmr = (float)misses / (float)(last - first);
+		uint32_t start = first;
+
+		misses = 0;
+		cache.Reset();
+
+		for (uint32_t j = first; j < last; ++j) {
+			misses += CountMisses(j);
+
+			if (j + 1 < last && (float)misses <= threshold * clusteracmr * (j + 1 - start)) {
+				clusters.push_back({ start, j + 1 - start, 0.0f });
+
+				start = j + 1;
+				misses = 0;
+
+				cache.Reset();
+			}
+		}
+
+		clusters.push_back({ start, last - start, 0.0f });
+	}
+
+	// sort by (cluster center - mesh center) dot cluster normal, outer clusters first
+	std::vector<Math::Vector3> centers(clusters.size());
+	std::vector<Math::Vector3> normals(clusters.size());
+	Math::Vector3 meshcenter(0, 0, 0);
+	Math::Vector3 a, b, n;
+	float totalarea = 0;
+
+	for (size_t i = 0; i < clusters.size(); ++i) {
+		const Cluster& cluster = clusters[i];
+		Math::Vector3 center(0, 0, 0);
+		Math::Vector3 normal(0, 0, 0);
+		float clusterarea = 0;
+
+		for (uint32_t j = cluster.start; j < cluster.start + cluster.count; ++j) {
+			const Math::Vector3& p0 = GetPosition(indices[j * 3 + 0]);
+			const Math::Vector3& p1 = GetPosition(indices[j * 3 + 1]);
+			const Math::Vector3& p2 = GetPosition(indices[j * 3 + 2]);
+
+			Math::Vec3Subtract(a, p1, p0);
+			Math::Vec3Subtract(b, p2, p0);
+			Math::Vec3Cross(n, a, b);
+
+			float area = Math::Vec3Length(n);
+
+			center.x += (p0.x + p1.x + p2.x) * (area / 3.0f);
+			center.y += (p0.y + p1.y + p2.y) * (area / 3.0f);
+			center.z += (p0.z + p1.z + p2.z) * (area / 3.0f);
+
+			Math::Vec3Add(normal, normal, n);
+			clusterarea += area;
+		}
+
+		Math::Vec3Add(meshcenter, meshcenter, center);
+		totalarea += clusterarea;
+
+		if (clusterarea > 0.0f)
+			Math::Vec3Scale(center, center, 1.0f / clusterarea);
+
+		centers[i] = center;
+		normals[i] = normal;
+	}
+
+	if (totalarea > 0.0f)
+		Math::Vec3Scale(meshcenter, meshcenter, 1.0f / totalarea);
+
+	for (size_t i = 0; i < clusters.size(); ++i) {
+		float length = Math::Vec3Length(normals[i]);
+
+		Math::Vec3Subtract(a, centers[i], meshcenter);
+		clusters[i].sortkey = (length > 0.0f ? Math::Vec3Dot(a, normals[i]) / length : 0.0f);
+	}
+
+	std::stable_sort(clusters.begin(), clusters.end(), [](const Cluster& c1, const Cluster& c2) {
+		return (c1.sortkey > c2.sortkey);
+	});
+
+	uint32_t offset = 0;
+
+	for (const Cluster& cluster : clusters) {
+		memcpy(outindices + offset, indices + cluster.start * 3, cluster.count * 3 * sizeof(uint32_t));
+		offset += cluster.count * 3;
+	}
+
+	return (uint32_t)clusters.size();
+}
+
+uint32_t OptimizeVertexFetch(uint32_t* outremap, uint32_t* indices, uint32_t numindices, uint32_t firstvertex, uint32_t numvertices)
+{
+	// NOTE: vertices get the order of their first use, unused ones go to the end
+	uint32_t next = 0;
+
+	for (uint32_t i = 0; i < numvertices; ++i)
+		outremap[i] = UINT32_MAX;
+
+	for (uint32_t i = 0; i < numindices; ++i) {
+		uint32_t& index = outremap[indices[i] - firstvertex];
+
+		if (index == UINT32_MAX)
+			index = next++;
+
+		indices[i] = firstvertex + index;
+	}
+
+	uint32_t numused = next;
+
+	for (uint32_t i = 0; i < numvertices; ++i) {
+		if (outremap[i] == UINT32_MAX)
+			outremap[i] = next++;
+	}
+
+	return numused;
+}
+
+void RemapVertices(void* outvertices, const void* vertices, uint32_t numvertices, uint32_t stride, const uint32_t* remap)
+{
+	for (uint32_t i = 0; i < numvertices; ++i)
+		memcpy((uint8_t*)outvertices + (size_t)remap[i] * stride, (const uint8_t*)vertices + (size_t)i * stride, stride);
+}
+
+void AnalyzeVertexCache(CacheStatistics& out, const uint32_t* indices, uint32_t numindices, uint32_t numvertices, uint32_t cachesize)
+{
+	CacheSimulator cache(numvertices, cachesize);
+	std::vector<uint8_t> referenced(numvertices, 0);
+	uint32_t numreferenced = 0;
+
+	out.numtransformed = 0;
+
+	for (uint32_t i = 0; i < numindices; ++i) {
+		uint32_t v = indices[i];
+
+		if (cache.Access(v))
+			++out.numtransformed;
+
+		if (!referenced[v]) {
+			referenced[v] = 1;
+			++numreferenced;
+		}
+	}
+
+	out.acmr = (numindices > 0 ? (float)out.numtransformed / (float)(numindices / 3) : 0.0f);
+	out.atvr = (numreferenced > 0 ? (float)out.numtransformed / (float)numreferenced : 0.0f);
+}
+
+bool OptimizeQM(const char* file, QMStatistics* stats)
+{
+	std::vector<uint8_t>	data;
+	std::vector<uint32_t>	indices;
+	std::vector<uint32_t>	optimized;
+	std::vector<uint32_t>	original;
+	std::vector<uint32_t>	remap;
+	std::vector<uint8_t>	vertices;
+	QMLayout				layout;
+	QMStatistics			result;
+	bool					localsubsets = true;
+
+	memset(&result, 0, sizeof(QMStatistics));
+
+	// NOTE: the LOD ranges would reference the old triangle order (optimize before simplifying)
+	if (!ReadQM(data, layout, file) || layout.numlodentries > 0)
+		return false;
+
+	result.numsubsets	= layout.header[3];
+	result.numvertices	= layout.header[4];
+	result.numtriangles	= layout.header[1] / 3;
+
+	ReadIndices(indices, data, layout);
+	optimized.resize(indices.size());
+
+	// NOTE: vertices can only be reordered if every subset has its own range
+	for (const QMSubset& subset : layout.subsets) {
+		// every index is remapped, a partial triangle would reference the old vertex order
+		if (subset.IndexCount % 3 != 0)
+			return false;
+
+		for (uint32_t i = subset.IndexStart; i < subset.IndexStart + subset.IndexCount; ++i)
+			localsubsets = localsubsets && (indices[i] >= subset.VertexStart && indices[i] < subset.VertexStart + subset.VertexCount);
+
+		for (const QMSubset& other : layout.subsets) {
+			if (&other != &subset && other.VertexStart < subset.VertexStart + subset.VertexCount && subset.VertexStart < other.VertexStart + other.VertexCount)
+				localsubsets = false;
+		}
+	}
+
+	original = indices;
+	vertices.assign(data.begin() + layout.vertexoffset, data.begin() + layout.indexoffset);
+	remap.resize(result.numvertices);
+
+	for (const QMSubset& subset : layout.subsets) {
+		uint32_t* subsetindices = indices.data() + subset.IndexStart;
+		uint32_t* subsetoptimized = optimized.data() + subset.IndexStart;
+		uint32_t firstvertex = (localsubsets ? subset.VertexStart : 0);
+		uint32_t numvertices = (localsubsets ? subset.VertexCount : result.numvertices);
+		uint32_t numindices = subset.IndexCount;
+		CacheStatistics before, after;
+
+		if (numindices == 0)
+			continue;
+
+		// cache statistics are per draw call
+		AnalyzeVertexCache(before, subsetindices, numindices, result.numvertices);
+
+		for (uint32_t i = 0; i < numindices; ++i)
+			subsetindices[i] -= firstvertex;
+
+		const float* positions = (const float*)(data.data() + layout.vertexoffset + (size_t)firstvertex * layout.vstride + layout.posoffset);
+
+		OptimizeVertexCache(subsetoptimized, subsetindices, numindices, numvertices);
+		result.numclusters += OptimizeOverdraw(subsetindices, subsetoptimized, numindices, positions, layout.vstride, numvertices);
+
+		for (uint32_t i = 0; i < numindices; ++i)
+			subsetindices[i] += firstvertex;
+
+		AnalyzeVertexCache(after, subsetindices, numindices, result.numvertices);
+
+		if (after.numtransformed > before.numtransformed) {
+			// the original order was better (e.g. low-poly cylinders), keep it
+			memcpy(subsetindices, original.data() + subset.IndexStart, numindices * sizeof(uint32_t));
+			after = before;
+		}
+
+		if (localsubsets) {
+			const uint8_t* subsetvertices = data.data() + layout.vertexoffset + (size_t)firstvertex * layout.vstride;
+
+			OptimizeVertexFetch(remap.data(), subsetindices, numindices, firstvertex, numvertices);
+			RemapVertices(vertices.data() + (size_t)firstvertex * layout.vstride, subsetvertices, numvertices, layout.vstride, remap.data());
+		}
+
+		result.before.numtransformed += before.numtransformed;
+		result.after.numtransformed += after.numtransformed;
+	}
+
+	// write back (the rest of the file is unchanged)
+	memcpy(data.data() + layout.vertexoffset, vertices.data(), vertices.size());
+
+	for (uint32_t i = 0; i < layout.header[1]; ++i) {
+		if (layout.istride == 2)
+			*((uint16_t*)(data.data() + layout.indexoffset) + i) = (uint16_t)indices[i];
+		else
+			*((uint32_t*)(data.data() + layout.indexoffset) + i) = indices[i];
+	}
+
+	if (!OverwriteFile(file, data))
+		return false;
+
+	if (stats) {
+		uint32_t numreferenced = 0;
+		std::vector<uint8_t> referenced(result.numvertices, 0);
+
+		for (uint32_t index : indices) {
+			numreferenced += (referenced[index] == 0 ? 1 : 0);
+			referenced[index] = 1;
+		}
+
+		result.before.acmr = (float)result.before.numtransformed / (float)Math::Max<uint32_t>(result.numtriangles, 1);
+		result.before.atvr = (float)result.before.numtransformed / (float)Math::Max<uint32_t>(numreferenced, 1);
+		result.after.acmr = (float)result.after.numtransformed / (float)Math::Max<uint32_t>(result.numtriangles, 1);
+		result.after.atvr = (float)result.after.numtransformed / (float)Math::Max<uint32_t>(numreferenced, 1);
+		result.fetchreordered = localsubsets;
+
+		*stats = result;
+	}
+
+	return true;
+}
+
+bool ReadQM(std::vector<uint8_t>& outdata, QMLayout& outlayout, const char* file)
+{
+	static const uint16_t elemsizes[6] = { 1, 2, 3, 4, 4, 4 };
+	static const uint16_t elemstrides[6] = { 4, 4, 4, 4, 1, 1 };
+
+	std::string	buff;
+	FILE*		infile = nullptr;
+	uint32_t	numelems;
+	size_t		offset;
+	bool		success = false;
+
+#ifdef _MSC_VER
+	fopen_s(&infile, file, "rb");
+#else
+	infile = fopen(file, "rb");
+#endif
+
+	if (!infile)
+		return false;
+
+	fseek(infile, 0, SEEK_END);
+	outdata.resize((size_t)ftell(infile));
+	fseek(infile, 0, SEEK_SET);
+
+	if (fread(outdata.data(), 1, outdata.size(), infile) != outdata.size() || outdata.size() < 36)
+		goto _fail;
+
+	memcpy(outlayout.header, outdata.data(), 32);
+	memcpy(&numelems, outdata.data() + 32, 4);
+
+	outlayout.version		= outlayout.header[0] >> 16;
+	outlayout.istride		= outlayout.header[2];
+	outlayout.vstride		= 0;
+	outlayout.numlodentries	= 0;
+	outlayout.posoffset		= -1;
+
+	if (outlayout.istride != 2 && outlayout.istride != 4)
+		goto _fail;
+
+	// vertex declaration
+	offset = 36;
+
+	for (uint32_t i = 0; i < numelems; ++i) {
+		if (offset + 5 > outdata.size() || outdata[offset + 3] > 5)
+			goto _fail;
+
+		uint8_t usage = outdata[offset + 2];
+		uint8_t type = outdata[offset + 3];
+
+		if (usage == 0 && type == 2 && outlayout.posoffset == -1)
+			outlayout.posoffset = (int32_t)outlayout.vstride;
+
+		outlayout.vstride += elemsizes[type] * elemstrides[type];
+		offset += 5;
+	}
+
+	outlayout.vertexoffset = offset;
+	outlayout.indexoffset = outlayout.vertexoffset + (size_t)outlayout.vstride * outlayout.header[4];
+	outlayout.lodoffset = outlayout.indexoffset + (size_t)outlayout.istride * outlayout.header[1];
+
+	offset = outlayout.lodoffset;
+
+	if (outlayout.posoffset == -1 || offset > outdata.size())
+		goto _fail;
+
+	if (outlayout.version >= 1) {
+		if (offset + 4 > outdata.size())
+			goto _fail;
+
+		memcpy(&outlayout.numlodentries, outdata.data() + offset, 4);
+		offset += 4 + 8 * (size_t)outlayout.numlodentries;
+	}
+
+	// attribute table (see GLCreateMeshFromQM)
+	outlayout.subsetoffset = offset;
+	outlayout.subsets.resize(outlayout.header[3]);
+
+	for (QMSubset& subset : outlayout.subsets) {
+		if (offset + 40 > outdata.size())
+			goto _fail;
+
+		memcpy(&subset, outdata.data() + offset, 16);
+		offset += 40;	// + bounding box
+
+		ReadString(outdata, offset, buff);
+		ReadString(outdata, offset, buff);
+
+		if (!(buff.size() > 1 && buff[1] == ',')) {
+			offset += 16 * (outlayout.version >= 2 ? 5 : 4) + 12;
+
+			for (int j = 0; j < 8; ++j)
+				ReadString(outdata, offset, buff);
+		}
+
+		for (int j = 0; j < 8; ++j)
+			ReadString(outdata, offset, buff);
+
+		if (subset.IndexStart + subset.IndexCount > outlayout.header[1] || subset.VertexStart + subset.VertexCount > outlayout.header[4])
+			goto _fail;
+	}
+
+	// NOTE: indices are absolute
+	success = true;
+
+	if (outlayout.istride == 2) {
+		for (uint32_t i = 0; i < outlayout.header[1]; ++i)
+			success = success && (*((const uint16_t*)(outdata.data() + outlayout.indexoffset) + i) < outlayout.header[4]);
+	} else {
+		for (uint32_t i = 0; i < outlayout.header[1]; ++i)
+			success = success && (*((const uint32_t*)(outdata.data() + outlayout.indexoffset) + i) < outlayout.header[4]);
+	}
+
+_fail:
+	fclose(infile);
+	return success;
+}
+
+bool OverwriteFile(const char* file, const std::vector<uint8_t>& data)
+{
+	std::string	tmpfile = std::string(file) + ".tmp";
+	FILE*		outfile = nullptr;
+	bool		success;
+
+#ifdef _MSC_VER
+	fopen_s(&outfile, tmpfile.c_str(), "wb");
+#else
+	outfile = fopen(tmpfile.c_str(), "wb");
+#endif
+
+	if (!outfile)
+		return false;
+
+	success = (fwrite(data.data(), 1, data.size(), outfile) == data.size());
+	fclose(outfile);
+
+	if (success) {
+		remove(file);
+		success = (rename(tmpfile.c_str(), file) == 0);
+	} else {
+		remove(tmpfile.c_str());
+	}
+
+	return success;
+}
+
+void ReadIndices(std::vector<uint32_t>& out, const std::vector<uint8_t>& data, const QMLayout& layout)
+{
+	out.resize(layout.header[1]);
+
+	for (uint32_t i = 0; i < layout.header[1]; ++i) {
+		if (layout.istride == 2)
+			out[i] = *((const uint16_t*)(data.data() + layout.indexoffset) + i);
+		else
+			out[i] = *((const uint32_t*)(data.data() + layout.indexoffset) + i);
+	}
+}
+
+}
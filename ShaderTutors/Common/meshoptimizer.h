@@ -0,0 +1,71 @@
+
+#ifndef _MESHOPTIMIZER_H_
+#define _MESHOPTIMIZER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace MeshOptimizer {
+
+// --- Structures -------------------------------------------------------------
+
+struct CacheStatistics
+{
+	float		acmr;			// average cache miss ratio (transformed vertices per triangle)
+	float		atvr;			// average transformed vertex ratio (transformed / referenced vertices)
+	uint32_t	numtransformed;
+};
+
+struct QMStatistics
+{
+	CacheStatistics	before;
+	CacheStatistics	after;
+	uint32_t		numtriangles;
+	uint32_t		numvertices;
+	uint32_t		numsubsets;
+	uint32_t		numclusters;
+	bool			fetchreordered;	// false if the subsets share vertices
+};
+
+struct QMSubset
+{
+	uint32_t IndexStart;
+	uint32_t VertexStart;
+	uint32_t VertexCount;
+	uint32_t IndexCount;
+};
+
+struct QMLayout
+{
+	std::vector<QMSubset>	subsets;
+	uint32_t				header[8];		// see GLCreateMeshFromQM
+	uint32_t				version;
+	uint32_t				istride;
+	uint32_t				vstride;
+	uint32_t				numlodentries;	// 8 bytes each
+	int32_t					posoffset;		// float3 position in the vertex
+	size_t					vertexoffset;
+	size_t					indexoffset;
+	size_t					lodoffset;		// end of the indices
+	size_t					subsetoffset;	// attribute table
+};
+
+// --- Functions --------------------------------------------------------------
+
+void OptimizeVertexCache(uint32_t* outindices, const uint32_t* indices, uint32_t numindices, uint32_t numvertices);
+uint32_t OptimizeOverdraw(uint32_t* outindices, const uint32_t* indices, uint32_t numindices, const float* positions, uint32_t posstride, uint32_t numvertices, float threshold = 1.05f);
+uint32_t OptimizeVertexFetch(uint32_t* outremap, uint32_t* indices, uint32_t numindices, uint32_t firstvertex, uint32_t numvertices);
+
+void RemapVertices(void* outvertices, const void* vertices, uint32_t numvertices, uint32_t stride, const uint32_t* remap);
+void AnalyzeVertexCache(CacheStatistics& out, const uint32_t* indices, uint32_t numindices, uint32_t numvertices, uint32_t cachesize = 16);
+
+bool OptimizeQM(const char* file, QMStatistics* stats = nullptr);	// rewrites the file in place (fails if a subset has a partial triangle)
+
+bool ReadQM(std::vector<uint8_t>& outdata, QMLayout& outlayout, const char* file);
+bool OverwriteFile(const char* file, const std::vector<uint8_t>& data);	// through a temporary file
+void ReadIndices(std::vector<uint32_t>& out, const std::vector<uint8_t>& data, const QMLayout& layout);
+
+}
+
+#endif
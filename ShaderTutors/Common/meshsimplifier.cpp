@@ -0,0 +1,922 @@
+
+#include "meshsimplifier.h"
+#include "meshoptimizer.h"
+#include "3Dmath.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#define BORDER_WEIGHT		10.0f	// of the edge quadrics (relative to the triangles)
+#define SEAM_WEIGHT			1.0f
+#define COST_SLACK			1.5f	// cost limit of a pass relative to the cheapest collapses it needs
+
+#define EDGE_OPEN			1		// no opposite edge with the same vertices
+#define EDGE_SEAM			2		// ...but there is one with the same positions
+
+struct MeshSimplifier::Quadric
+{
+	double a00, a11, a22;
+	double a01, a02, a12;
+	double b0, b1, b2;
+	double c;
+	double area;	// of the triangle planes (to normalize the error)
+
+	void AddPlane(const Math::Vector3& n, float d, double weight) {
+		a00 += weight * n.x * n.x;
+		a11 += weight * n.y * n.y;
+		a22 += weight * n.z * n.z;
+		a01 += weight * n.x * n.y;
+		a02 += weight * n.x * n.z;
+		a12 += weight * n.y * n.z;
+
+		b0 += weight * n.x * d;
+		b1 += weight * n.y * d;
+		b2 += weight * n.z * d;
+		c += weight * d * d;
+	}
+
+	void Add(const Quadric& other) {
+		a00 += other.a00;	a11 += other.a11;	a22 += other.a22;
+		a01 += other.a01;	a02 += other.a02;	a12 += other.a12;
+		b0 += other.b0;		b1 += other.b1;		b2 += other.b2;
+
+		c += other.c;
+		area += other.area;
+	}
+
+	double Evaluate(const float* p) const {
+		double x = p[0], y = p[1], z = p[2];
+
+		double result =
+			a00 * x * x + a11 * y * y + a22 * z * z +
+			2.0 * (a01 * x * y + a02 * x * z + a12 * y * z) +
+			2.0 * (b0 * x + b1 * y + b2 * z) + c;
+
+		return result;
+	}
+};
+
+struct MeshSimplifier::Candidate
+{
+	uint32_t	from;
+	uint32_t	to;
+	float		cost;
+};
+
+// --- Helpers ----------------------------------------------------------------
+
+class EdgeSet
+{
+private:
+	std::vector<uint64_t>	keys;
+	uint64_t				mask;
+
+	static inline uint64_t Hash(uint64_t key) {
+		return (key * 0x9E3779B97F4A7C15ull) >> 17;
+	}
+
+public:
+	void Reset(size_t count) {
+		size_t size = 16;
+
+		while (size < count * 2)
+			size <<= 1;
+
+		keys.assign(size, UINT64_MAX);
+		mask = size - 1;
+	}
+
+	void Insert(uint32_t a, uint32_t b) {
+		uint64_t key = ((uint64_t)a << 32) | b;
+		uint64_t slot = Hash(key) & mask;
+
+		while (keys[slot] != UINT64_MAX && keys[slot] != key)
+			slot = (slot + 1) & mask;
+
+		keys[slot] = key;
+	}
+
+	bool Contains(uint32_t a, uint32_t b) const {
+		uint64_t key = ((uint64_t)a << 32) | b;
+		uint64_t slot = Hash(key) & mask;
+
+		while (keys[slot] != UINT64_MAX) {
+			if (keys[slot] == key)
+				return true;
+
+			slot = (slot + 1) & mask;
+		}
+
+		return false;
+	}
+};
+
+static inline uint32_t HashPosition(const float* p)
+{
+	uint32_t bits[3];
+	memcpy(bits, p, 12);
+
+	return (bits[0] * 73856093u) ^ (bits[1] * 19349663u) ^ (bits[2] * 83492791u);
+}
+
+static inline bool SamePosition(const float* p, const float* q)
+{
+	return (p[0] == q[0] && p[1] == q[1] && p[2] == q[2]);
+}
+
+static float PointTriangleDistance(const Math::Vector3& p, const Math::Vector3& a, const Math::Vector3& b, const Math::Vector3& c)
+{
+	// NOTE: Ericson, "Real-Time Collision Detection", 5.1.5
+	Math::Vector3 ab = b - a;
+	Math::Vector3 ac = c - a;
+	Math::Vector3 ap = p - a;
+	Math::Vector3 bp = p - b;
+	Math::Vector3 cp = p - c;
+	Math::Vector3 closest;
+
+	float d1 = Math::Vec3Dot(ab, ap);
+	float d2 = Math::Vec3Dot(ac, ap);
+	float d3 = Math::Vec3Dot(ab, bp);
+	float d4 = Math::Vec3Dot(ac, bp);
+	float d5 = Math::Vec3Dot(ab, cp);
+	float d6 = Math::Vec3Dot(ac, cp);
+
+	float va = d3 * d6 - d5 * d4;
+	float vb = d5 * d2 - d1 * d6;
+	float vc = d1 * d4 - d3 * d2;
+
+	if (d1 <= 0.0f && d2 <= 0.0f) {
+		closest = a;
+	} else if (d3 >= 0.0f && d4 <= d3) {
+		closest = b;
+	} else if (d6 >= 0.0f && d5 <= d6) {
+		closest = c;
+	} else if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+		closest = a + ab * (d1 / (d1 - d3));
+	} else if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+		closest = a + ac * (d2 / (d2 - d6));
+	} else if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f) {
+		closest = b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+	} else {
+		float denom = 1.0f / (va + vb + vc);
+		closest = a + ab * (vb * denom) + ac * (vc * denom);
+	}
+
+	return Math::Vec3Distance(p, closest);
+}
+
+static inline void TriangleNormal(Math::Vector3& out, const float* p0, const float* p1, const float* p2)
+{
+	Math::Vector3 e1(p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]);
+	Math::Vector3 e2(p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]);
+
+	Math::Vec3Cross(out, e1, e2);
+}
+
+// --- MeshSimplifier impl ----------------------------------------------------
+
+MeshSimplifier::MeshSimplifier()
+{
+	positions	= nullptr;
+	posstride	= 0;
+	numvertices	= 0;
+	error		= 0;
+}
+
+MeshSimplifier::~MeshSimplifier()
+{
+}
+
+void MeshSimplifier::Initialize(const uint32_t* indices, uint32_t numindices, const float* positions, uint32_t posstride, uint32_t numvertices, const uint8_t* vertexlocks)
+{
+	this->indices.assign(indices, indices + (numindices - numindices % 3));
+	this->positions = (const uint8_t*)positions;
+	this->posstride = posstride;
+	this->numvertices = numvertices;
+
+	error = 0;
+
+	remap.resize(numvertices);
+	parents.resize(numvertices);
+	quadrics.assign(numvertices, Quadric());
+
+	for (uint32_t i = 0; i < numvertices; ++i)
+		remap[i] = parents[i] = i;
+
+	if (vertexlocks != nullptr)
+		locks.assign(vertexlocks, vertexlocks + numvertices);
+	else
+		locks.assign(numvertices, 0);
+
+	RemoveDegenerates();
+	ClassifyVertices();
+
+	// triangle planes
+	for (size_t i = 0; i < this->indices.size(); i += 3) {
+		const uint32_t* tri = this->indices.data() + i;
+		const float* p0 = GetPosition(tri[0]);
+
+		Math::Vector3 n;
+		TriangleNormal(n, p0, GetPosition(tri[1]), GetPosition(tri[2]));
+
+		float length = Math::Vec3Length(n);
+
+		if (length == 0.0f)
+			continue;
+
+		Math::Vec3Scale(n, n, 1.0f / length);
+		float d = -(n.x * p0[0] + n.y * p0[1] + n.z * p0[2]);
+
+		for (int k = 0; k < 3; ++k) {
+			quadrics[tri[k]].AddPlane(n, d, 0.5 * length);
+			quadrics[tri[k]].area += 0.5 * length;
+		}
+
+		// NOTE: planes perpendicular to the open edges keep their shape
+		for (int k = 0; k < 3; ++k) {
+			if (!(edgeflags[i + k] & EDGE_OPEN))
+				continue;
+
+			const float* pa = GetPosition(tri[k]);
+			const float* pb = GetPosition(tri[(k + 1) % 3]);
+
+			Math::Vector3 edge(pb[0] - pa[0], pb[1] - pa[1], pb[2] - pa[2]);
+			Math::Vector3 m;
+
+			float weight = Math::Vec3Dot(edge, edge) * ((edgeflags[i + k] & EDGE_SEAM) ? SEAM_WEIGHT : BORDER_WEIGHT);
+
+			Math::Vec3Cross(m, edge, n);
+			Math::Vec3Normalize(m, m);
+
+			d = -(m.x * pa[0] + m.y * pa[1] + m.z * pa[2]);
+
+			quadrics[tri[k]].AddPlane(m, d, weight);
+			quadrics[tri[(k + 1) % 3]].AddPlane(m, d, weight);
+		}
+	}
+}
+
+uint32_t MeshSimplifier::Simplify(uint32_t targetindices, float maxerror)
+{
+	uint32_t targettriangles = targetindices / 3;
+	uint32_t numtriangles = (uint32_t)(indices.size() / 3);
+
+	// NOTE: each pass collapses independent edges (no shared triangles), then rebuilds the topology
+	while (numtriangles > targettriangles) {
+		ClassifyVertices();
+		BuildAdjacency();
+		CollectCandidates();
+
+		if (candidates.empty() || CollapseEdges(numtriangles, targettriangles, maxerror) == 0)
+			break;
+
+		RemoveDegenerates();
+		numtriangles = (uint32_t)(indices.size() / 3);
+	}
+
+	MeasureError();
+	return (uint32_t)indices.size();
+}
+
+void MeshSimplifier::ClassifyVertices()
+{
+	std::vector<uint32_t>	table;
+	std::vector<uint8_t>	numwedges(numvertices, 0);
+	std::vector<uint8_t>	numout(numvertices, 0);
+	std::vector<uint8_t>	numin(numvertices, 0);
+	std::vector<uint8_t>	vertexedges(numvertices, 0);
+	EdgeSet					indexedges;
+	EdgeSet					positionedges;
+	size_t					numindices = indices.size();
+	uint32_t				mask = 15;
+
+	while (mask + 1 < numvertices * 2)
+		mask = (mask << 1) | 1;
+
+	table.assign(mask + 1, UINT32_MAX);
+	canonical.assign(numvertices, UINT32_MAX);
+	twins.assign(numvertices, UINT32_MAX);
+	openout.assign(numvertices, UINT32_MAX);
+	openin.assign(numvertices, UINT32_MAX);
+	kinds.assign(numvertices, VertexKindLocked);
+	edgeflags.assign(numindices, 0);
+
+	// weld positions
+	for (size_t i = 0; i < numindices; ++i) {
+		uint32_t v = indices[i];
+
+		if (canonical[v] != UINT32_MAX)
+			continue;
+
+		const float* p = GetPosition(v);
+		uint32_t slot = HashPosition(p) & mask;
+
+		while (table[slot] != UINT32_MAX && !SamePosition(GetPosition(table[slot]), p))
+			slot = (slot + 1) & mask;
+
+		if (table[slot] == UINT32_MAX)
+			table[slot] = v;
+
+		uint32_t c = table[slot];
+
+		canonical[v] = c;
+
+		if (numwedges[c] < 255)
+			++numwedges[c];
+
+		if (numwedges[c] == 2) {
+			twins[c] = v;
+			twins[v] = c;
+		}
+	}
+
+	// open edges
+	indexedges.Reset(numindices);
+	positionedges.Reset(numindices);
+
+	for (size_t i = 0; i < numindices; ++i) {
+		uint32_t a = indices[i];
+		uint32_t b = indices[i - i % 3 + (i + 1) % 3];
+
+		indexedges.Insert(a, b);
+		positionedges.Insert(canonical[a], canonical[b]);
+	}
+
+	for (size_t i = 0; i < numindices; ++i) {
+		uint32_t a = indices[i];
+		uint32_t b = indices[i - i % 3 + (i + 1) % 3];
+
+		if (indexedges.Contains(b, a))
+			continue;
+
+		uint8_t flags = EDGE_OPEN | (positionedges.Contains(canonical[b], canonical[a]) ? EDGE_SEAM : 0);
+
+		edgeflags[i] = flags;
+		vertexedges[a] |= flags;
+		vertexedges[b] |= flags;
+
+		openout[a] = b;
+		openin[b] = a;
+
+		numout[a] = (uint8_t)Math::Min(numout[a] + 1, 255);
+		numin[b] = (uint8_t)Math::Min(numin[b] + 1, 255);
+	}
+
+	// classify
+	auto IsChain = [&](uint32_t v) -> bool {
+		return (numout[v] == 1 && numin[v] == 1);
+	};
+
+	for (size_t i = 0; i < numindices; ++i) {
+		uint32_t v = indices[i];
+		uint32_t c = canonical[v];
+		uint32_t w = twins[v];
+
+		if (kinds[v] != VertexKindLocked || locks[v] || (w != UINT32_MAX && locks[w]))
+			continue;
+
+		if (numwedges[c] == 1) {
+			if (vertexedges[v] == 0)
+				kinds[v] = VertexKindManifold;
+			else if (IsChain(v) && !(vertexedges[v] & EDGE_SEAM))
+				kinds[v] = VertexKindBorder;
+		} else if (numwedges[c] == 2) {
+			bool seam =
+				IsChain(v) && IsChain(w) &&
+				vertexedges[v] == (EDGE_OPEN|EDGE_SEAM) &&
+				vertexedges[w] == (EDGE_OPEN|EDGE_SEAM);
+
+			if (seam)
+				kinds[v] = VertexKindSeam;
+		}
+	}
+}
+
+void MeshSimplifier::BuildAdjacency()
+{
+	size_t numindices = indices.size();
+
+	adjacencyoffsets.assign(numvertices + 1, 0);
+	adjacency.resize(numindices);
+
+	for (size_t i = 0; i < numindices; ++i)
+		++adjacencyoffsets[canonical[indices[i]] + 1];
+
+	for (uint32_t i = 0; i < numvertices; ++i)
+		adjacencyoffsets[i + 1] += adjacencyoffsets[i];
+
+	std::vector<uint32_t> fill(adjacencyoffsets.begin(), adjacencyoffsets.end() - 1);
+
+	for (size_t i = 0; i < numindices; ++i)
+		adjacency[fill[canonical[indices[i]]]++] = (uint32_t)(i / 3);
+}
+
+void MeshSimplifier::CollectCandidates()
+{
+	size_t numindices = indices.size();
+	uint32_t twintarget;
+
+	candidates.clear();
+
+	for (size_t i = 0; i < numindices; ++i) {
+		uint32_t a = indices[i];
+		uint32_t b = indices[i - i % 3 + (i + 1) % 3];
+
+		// NOTE: inner edges are seen from both sides, only one of them is enough
+		if (!(edgeflags[i] & EDGE_OPEN) && a > b)
+			continue;
+
+		float cost1 = (CanCollapse(a, b, twintarget) ? CollapseCost(a, b) : FLT_MAX);
+		float cost2 = (CanCollapse(b, a, twintarget) ? CollapseCost(b, a) : FLT_MAX);
+
+		if (cost1 == FLT_MAX && cost2 == FLT_MAX)
+			continue;
+
+		if (cost1 <= cost2)
+			candidates.push_back({ a, b, cost1 });
+		else
+			candidates.push_back({ b, a, cost2 });
+	}
+
+}
+
+uint32_t MeshSimplifier::CollapseEdges(uint32_t numtriangles, uint32_t targettriangles, float maxerror)
+{
+	auto CompareCost = [](const Candidate& c1, const Candidate& c2) -> bool {
+		return (c1.cost < c2.cost);
+	};
+
+	// NOTE: an inner collapse removes two triangles, only the cheapest ones are needed
+	size_t goal = Math::Min<size_t>((numtriangles - targettriangles) / 2, candidates.size() - 1);
+
+	std::nth_element(candidates.begin(), candidates.begin() + goal, candidates.end(), CompareCost);
+
+	float costlimit = Math::Min(maxerror, candidates[goal].cost * COST_SLACK + FLT_EPSILON);
+	auto last = std::partition(candidates.begin(), candidates.end(), [=](const Candidate& c) { return (c.cost <= costlimit); });
+
+	std::sort(candidates.begin(), last, CompareCost);
+
+	std::vector<uint32_t> valences(numvertices);
+	uint32_t numcollapsed = 0;
+	uint32_t twintarget;
+
+	touched.assign(numvertices, 0);
+
+	for (uint32_t i = 0; i < numvertices; ++i)
+		valences[i] = adjacencyoffsets[i + 1] - adjacencyoffsets[i];
+
+	auto IsRemoved = [&](const uint32_t* tri, uint32_t cb) -> bool {
+		return (canonical[tri[0]] == cb || canonical[tri[1]] == cb || canonical[tri[2]] == cb);
+	};
+
+	for (auto it = candidates.begin(); it != last && numtriangles > targettriangles; ++it) {
+		uint32_t a = it->from;
+		uint32_t b = it->to;
+		uint32_t ca = canonical[a];
+		uint32_t cb = canonical[b];
+		bool independent = (touched[ca] == 0);
+
+		// NOTE: 'a' can't be next to a moved vertex, and can't move if it is next to one (the flip test would be wrong)
+		for (uint32_t j = adjacencyoffsets[ca]; j < adjacencyoffsets[ca + 1] && independent; ++j) {
+			const uint32_t* tri = indices.data() + adjacency[j] * 3;
+			independent = (touched[canonical[tri[0]]] != 2 && touched[canonical[tri[1]]] != 2 && touched[canonical[tri[2]]] != 2);
+		}
+
+		if (!independent || !CanCollapse(a, b, twintarget) || FlipsTriangle(a, b))
+			continue;
+
+		// the third vertex of a removed triangle must keep some triangles (or it would be lost without collapsing)
+		for (uint32_t j = adjacencyoffsets[ca]; j < adjacencyoffsets[ca + 1] && independent; ++j) {
+			const uint32_t* tri = indices.data() + adjacency[j] * 3;
+
+			if (!IsRemoved(tri, cb))
+				continue;
+
+			for (int k = 0; k < 3; ++k) {
+				uint32_t c = canonical[tri[k]];
+				uint32_t numremoved = 0;
+
+				if (c == ca || c == cb)
+					continue;
+
+				for (uint32_t l = adjacencyoffsets[ca]; l < adjacencyoffsets[ca + 1]; ++l) {
+					const uint32_t* other = indices.data() + adjacency[l] * 3;
+
+					if (IsRemoved(other, cb) && (canonical[other[0]] == c || canonical[other[1]] == c || canonical[other[2]] == c))
+						++numremoved;
+				}
+
+				independent = independent && (valences[c] > numremoved);
+			}
+		}
+
+		if (!independent)
+			continue;
+
+		for (uint32_t j = adjacencyoffsets[ca]; j < adjacencyoffsets[ca + 1]; ++j) {
+			const uint32_t* tri = indices.data() + adjacency[j] * 3;
+			uint32_t c0 = canonical[tri[0]];
+			uint32_t c1 = canonical[tri[1]];
+			uint32_t c2 = canonical[tri[2]];
+
+			touched[c0] = touched[c1] = touched[c2] = 1;
+
+			if (IsRemoved(tri, cb)) {
+				--valences[c0];
+				--valences[c1];
+				--valences[c2];
+				--numtriangles;
+			}
+		}
+
+		touched[ca] = 2;
+
+		remap[a] = parents[a] = b;
+		quadrics[b].Add(quadrics[a]);
+
+		if (kinds[a] == VertexKindSeam) {
+			remap[twins[a]] = parents[twins[a]] = twintarget;
+			quadrics[twintarget].Add(quadrics[twins[a]]);
+		}
+
+		++numcollapsed;
+	}
+
+	return numcollapsed;
+}
+
+void MeshSimplifier::RemoveDegenerates()
+{
+	size_t count = 0;
+
+	for (size_t i = 0; i < indices.size(); i += 3) {
+		uint32_t i0 = remap[indices[i + 0]];
+		uint32_t i1 = remap[indices[i + 1]];
+		uint32_t i2 = remap[indices[i + 2]];
+
+		const float* p0 = GetPosition(i0);
+		const float* p1 = GetPosition(i1);
+		const float* p2 = GetPosition(i2);
+
+		if (SamePosition(p0, p1) || SamePosition(p0, p2) || SamePosition(p1, p2))
+			continue;
+
+		indices[count++] = i0;
+		indices[count++] = i1;
+		indices[count++] = i2;
+	}
+
+	indices.resize(count);
+
+	for (uint32_t i = 0; i < numvertices; ++i)
+		remap[i] = i;
+}
+
+void MeshSimplifier::MeasureError()
+{
+	// NOTE: distance to the triangles around the vertex that a vertex collapsed into (an upper bound of the distance to the surface)
+	ClassifyVertices();
+	BuildAdjacency();
+
+	for (uint32_t i = 0; i < numvertices; ++i) {
+		uint32_t root = i;
+
+		if (parents[i] == i)
+			continue;
+
+		while (parents[root] != root)
+			root = parents[root];
+
+		parents[i] = root;
+
+		Math::Vector3 p(GetPosition(i));
+		uint32_t croot = canonical[root];
+		float distance = FLT_MAX;
+
+		if (croot == UINT32_MAX) {
+			// the whole component is gone
+			distance = Math::Vec3Distance(p, Math::Vector3(GetPosition(root)));
+		} else {
+			for (uint32_t j = adjacencyoffsets[croot]; j < adjacencyoffsets[croot + 1]; ++j) {
+				const uint32_t* tri = indices.data() + adjacency[j] * 3;
+
+				Math::Vector3 a(GetPosition(tri[0]));
+				Math::Vector3 b(GetPosition(tri[1]));
+				Math::Vector3 c(GetPosition(tri[2]));
+
+				distance = Math::Min(distance, PointTriangleDistance(p, a, b, c));
+			}
+		}
+
+		error = Math::Max(error, distance);
+	}
+}
+
+bool MeshSimplifier::CanCollapse(uint32_t from, uint32_t to, uint32_t& twintarget) const
+{
+	uint8_t kind1 = kinds[from];
+	uint8_t kind2 = kinds[to];
+
+	if (canonical[from] == canonical[to])
+		return false;
+
+	switch (kind1) {
+	case VertexKindManifold:
+		return true;
+
+	case VertexKindBorder:
+		return ((kind2 == VertexKindBorder || kind2 == VertexKindLocked) && (openout[from] == to || openin[from] == to));
+
+	case VertexKindSeam:
+		if ((kind2 != VertexKindSeam && kind2 != VertexKindLocked) || (openout[from] != to && openin[from] != to))
+			return false;
+
+		// the twin has to go to the same position on the other side of the seam
+		{
+			uint32_t twin = twins[from];
+
+			if (canonical[openout[twin]] == canonical[to])
+				twintarget = openout[twin];
+			else if (canonical[openin[twin]] == canonical[to])
+				twintarget = openin[twin];
+			else
+				return false;
+		}
+
+		return true;
+
+	default:
+		break;
+	}
+
+	return false;
+}
+
+bool MeshSimplifier::FlipsTriangle(uint32_t from, uint32_t to) const
+{
+	uint32_t ca = canonical[from];
+	uint32_t cb = canonical[to];
+	const float* target = GetPosition(to);
+
+	for (uint32_t j = adjacencyoffsets[ca]; j < adjacencyoffsets[ca + 1]; ++j) {
+		const uint32_t* tri = indices.data() + adjacency[j] * 3;
+		const float* oldpos[3];
+		const float* newpos[3];
+
+		for (int k = 0; k < 3; ++k) {
+			uint32_t c = canonical[tri[k]];
+
+			if (c == cb)
+				goto _next;
+
+			oldpos[k] = GetPosition(tri[k]);
+			newpos[k] = (c == ca ? target : oldpos[k]);
+		}
+
+		{
+			Math::Vector3 n1, n2;
+
+			TriangleNormal(n1, oldpos[0], oldpos[1], oldpos[2]);
+			TriangleNormal(n2, newpos[0], newpos[1], newpos[2]);
+
+			if (Math::Vec3Dot(n1, n2) <= 0.0f)
+				return true;
+		}
+
+	_next:
+		;
+	}
+
+	return false;
+}
+
+float MeshSimplifier::CollapseCost(uint32_t from, uint32_t to) const
+{
+	const float* target = GetPosition(to);
+	double cost = quadrics[from].Evaluate(target);
+	double area = quadrics[from].area;
+
+	if (kinds[from] == VertexKindSeam) {
+		cost += quadrics[twins[from]].Evaluate(target);
+		area += quadrics[twins[from]].area;
+	}
+
+	// NOTE: root mean square distance to the planes
+	return (float)sqrt(Math::Max(cost, 0.0) / Math::Max(area, 1e-12));
+}
+
+bool MeshSimplifier::GenerateQMLODs(const char* file, uint32_t numlods, float ratio, float maxerror, LODChainStatistics* stats)
+{
+	struct PositionKey
+	{
+		uint32_t bits[3];
+		uint32_t subset;
+		uint32_t vertex;
+
+		inline bool operator <(const PositionKey& other) const {
+			return (memcmp(this, &other, 16) < 0);
+		}
+	};
+
+	typedef std::vector<uint32_t> IndexList;
+
+	std::vector<uint8_t>	data;
+	std::vector<uint8_t>	output;
+	std::vector<uint8_t>	locks;
+	std::vector<uint32_t>	indices;
+	std::vector<uint32_t>	lodindices;
+	std::vector<uint32_t>	entries;
+	std::vector<IndexList>	levels;
+	std::vector<PositionKey> keys;
+	MeshOptimizer::QMLayout	layout;
+	LODChainStatistics		result;
+	Math::AABox				box;
+
+	memset(&result, 0, sizeof(LODChainStatistics));
+	numlods = Math::Min<uint32_t>(Math::Max<uint32_t>(numlods, 1), MAX_QM_LODS);
+
+	if (!MeshOptimizer::ReadQM(data, layout, file))
+		return false;
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	uint32_t numsubsets = layout.header[3];
+	uint32_t numvertices = layout.header[4];
+
+	// NOTE: existing LODs are in the LOD block, they are regenerated
+	MeshOptimizer::ReadIndices(indices, data, layout);
+
+	for (uint32_t i = 0; i < numvertices; ++i)
+		box.Add(Math::Vector3((const float*)(data.data() + layout.vertexoffset + (size_t)i * layout.vstride + layout.posoffset)));
+
+	maxerror *= Math::Vec3Distance(box.Min, box.Max);
+
+	// lock positions that appear in more than one subset (so that there are no cracks between them)
+	locks.assign(numvertices, 0);
+
+	for (uint32_t i = 0; i < numsubsets; ++i) {
+		const MeshOptimizer::QMSubset& subset = layout.subsets[i];
+
+		for (uint32_t j = subset.IndexStart; j < subset.IndexStart + subset.IndexCount; ++j) {
+			PositionKey key;
+			const uint8_t* p = data.data() + layout.vertexoffset + (size_t)indices[j] * layout.vstride + layout.posoffset;
+
+			memcpy(key.bits, p, 12);
+
+			key.subset = i;
+			key.vertex = indices[j];
+
+			keys.push_back(key);
+		}
+	}
+
+	std::sort(keys.begin(), keys.end());
+
+	for (size_t i = 0; i < keys.size();) {
+		size_t j = i + 1;
+		bool shared = false;
+
+		while (j < keys.size() && memcmp(keys[j].bits, keys[i].bits, 12) == 0) {
+			shared = shared || (keys[j].subset != keys[i].subset);
+			++j;
+		}
+
+		for (size_t k = i; k < j && shared; ++k)
+			locks[keys[k].vertex] = 1;
+
+		i = j;
+	}
+
+	// simplify subsets progressively
+	levels.resize(numlods * numsubsets);
+
+	for (uint32_t i = 0; i < numsubsets; ++i) {
+		const MeshOptimizer::QMSubset& subset = layout.subsets[i];
+		const uint32_t* subsetindices = indices.data() + subset.IndexStart;
+		IndexList localindices(subsetindices, subsetindices + subset.IndexCount);
+		MeshSimplifier simplifier;
+		uint32_t firstvertex = subset.VertexStart;
+		uint32_t numsubsetvertices = subset.VertexCount;
+
+		for (uint32_t index : localindices) {
+			if (index < subset.VertexStart || index >= subset.VertexStart + subset.VertexCount) {
+				firstvertex = 0;
+				numsubsetvertices = numvertices;
+
+				break;
+			}
+		}
+
+		for (uint32_t& index : localindices)
+			index -= firstvertex;
+
+		const uint8_t* vertices = data.data() + layout.vertexoffset + (size_t)firstvertex * layout.vstride;
+
+		simplifier.Initialize(localindices.data(), (uint32_t)localindices.size(), (const float*)(vertices + layout.posoffset), layout.vstride, numsubsetvertices, locks.data() + firstvertex);
+
+		for (uint32_t l = 1; l < numlods; ++l) {
+			IndexList& level = levels[l * numsubsets + i];
+			uint32_t target = (uint32_t)(subset.IndexCount * powf(ratio, (float)l));
+
+			simplifier.Simplify(target, maxerror);
+			level.resize(simplifier.GetNumIndices());
+
+			MeshOptimizer::OptimizeVertexCache(level.data(), simplifier.GetIndices(), simplifier.GetNumIndices(), numsubsetvertices);
+
+			for (uint32_t& index : level)
+				index += firstvertex;
+
+			result.errors[l] = Math::Max(result.errors[l], simplifier.GetError());
+		}
+	}
+
+	// NOTE: the chain ends where the simplifier got stuck (locked or faceted geometry)
+	result.numtriangles[0] = layout.header[1] / 3;
+
+	for (uint32_t l = 1; l < numlods; ++l) {
+		uint32_t numlevelindices = 0;
+
+		for (uint32_t i = 0; i < numsubsets; ++i)
+			numlevelindices += (uint32_t)levels[l * numsubsets + i].size();
+
+		if (numlevelindices / 3 > result.numtriangles[l - 1] * 9 / 10) {
+			numlods = l;
+			break;
+		}
+
+		result.numtriangles[l] = numlevelindices / 3;
+		result.errors[l] = Math::Max(result.errors[l], result.errors[l - 1]);
+	}
+
+	// LOD block: {number of levels, number of indices}, then for each level {error, number of indices}
+	// and an {IndexStart, IndexCount} per subset (relative to the first LOD index), then the indices
+	if (numlods > 1) {
+		entries.push_back(numlods - 1);
+		entries.push_back(0);
+	}
+
+	for (uint32_t l = 1; l < numlods; ++l) {
+		uint32_t levelstart = (uint32_t)entries.size();
+		uint32_t numlevelindices = 0;
+
+		entries.push_back(0);
+		entries.push_back(0);
+
+		for (uint32_t i = 0; i < numsubsets; ++i) {
+			const IndexList& level = levels[l * numsubsets + i];
+
+			entries.push_back((uint32_t)lodindices.size());
+			entries.push_back((uint32_t)level.size());
+
+			lodindices.insert(lodindices.end(), level.begin(), level.end());
+			numlevelindices += (uint32_t)level.size();
+		}
+
+		memcpy(&entries[levelstart], &result.errors[l], 4);
+		entries[levelstart + 1] = numlevelindices;
+	}
+
+	result.numlods = numlods;
+
+	// NOTE: header[1] stays the number of LOD0 indices, older loaders skip the indices as 8 byte entries
+	uint32_t version = Math::Max<uint32_t>(layout.version, 1);
+	uint32_t numlodindices = (uint32_t)lodindices.size();
+	uint32_t numentries = (uint32_t)(entries.size() / 2) + (numlodindices * layout.istride + 7) / 8;
+	size_t lodindexoffset = layout.lodoffset + 4 + entries.size() * 4;
+
+	if (numlods > 1)
+		entries[1] = numlodindices;
+
+	output.assign(data.begin(), data.begin() + layout.lodoffset);
+	output.resize(layout.lodoffset + 4 + (size_t)numentries * 8, 0);
+
+	layout.header[0] = (version << 16) | (layout.header[0] & 0xffff);
+	memcpy(output.data(), layout.header, 32);
+
+	memcpy(output.data() + layout.lodoffset, &numentries, 4);
+
+	if (!entries.empty())
+		memcpy(output.data() + layout.lodoffset + 4, entries.data(), entries.size() * 4);
+
+	for (uint32_t i = 0; i < numlodindices; ++i) {
+		if (layout.istride == 2)
+			*((uint16_t*)(output.data() + lodindexoffset) + i) = (uint16_t)lodindices[i];
+		else
+			*((uint32_t*)(output.data() + lodindexoffset) + i) = lodindices[i];
+	}
+
+	output.insert(output.end(), data.begin() + layout.subsetoffset, data.end());
+
+	auto end = std::chrono::high_resolution_clock::now();
+	result.buildtime = std::chrono::duration<float, std::milli>(end - start).count();
+
+	if (!MeshOptimizer::OverwriteFile(file, output))
+		return false;
+
+	if (stats)
+		*stats = result;
+
+	return true;
+}
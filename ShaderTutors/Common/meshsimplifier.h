@@ -0,0 +1,89 @@
+
+#ifndef _MESHSIMPLIFIER_H_
+#define _MESHSIMPLIFIER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cfloat>
+#include <vector>
+
+#define MAX_QM_LODS		8
+
+struct LODChainStatistics
+{
+	float		errors[MAX_QM_LODS];		// object space
+	uint32_t	numtriangles[MAX_QM_LODS];
+	uint32_t	numlods;
+	float		buildtime;					// ms
+};
+
+/**
+ * \brief Quadric error edge collapse simplifier (Garland & Heckbert)
+ *
+ * Only half-edge collapses, so the result indexes the original vertices. Vertices that share
+ * their position with another one (UV or normal seams) slide along the seam together with their
+ * twin, open borders collapse only along themselves, everything else that is not manifold stays.
+ */
+class MeshSimplifier
+{
+	struct Quadric;
+	struct Candidate;
+
+	enum VertexKind
+	{
+		VertexKindManifold = 0,
+		VertexKindBorder,
+		VertexKindSeam,
+		VertexKindLocked
+	};
+
+private:
+	std::vector<Quadric>	quadrics;		// per vertex
+	std::vector<uint32_t>	indices;
+	std::vector<uint32_t>	remap;
+	std::vector<uint32_t>	parents;		// collapse targets (from the original mesh)
+	std::vector<uint32_t>	canonical;		// first vertex with the same position
+	std::vector<uint32_t>	twins;			// other vertex with the same position (seams)
+	std::vector<uint32_t>	openout;		// border or seam edge leaving the vertex
+	std::vector<uint32_t>	openin;			// border or seam edge arriving to the vertex
+	std::vector<uint32_t>	adjacencyoffsets;
+	std::vector<uint32_t>	adjacency;		// canonical vertex -> triangles
+	std::vector<uint8_t>	edgeflags;		// per corner (edge to the next corner)
+	std::vector<uint8_t>	kinds;
+	std::vector<uint8_t>	locks;			// user locks
+	std::vector<uint8_t>	touched;
+	std::vector<Candidate>	candidates;
+
+	const uint8_t*			positions;
+	uint32_t				posstride;
+	uint32_t				numvertices;
+	float					error;
+
+	void ClassifyVertices();
+	void BuildAdjacency();
+	void CollectCandidates();
+	uint32_t CollapseEdges(uint32_t numtriangles, uint32_t targettriangles, float maxerror);
+	void RemoveDegenerates();
+	void MeasureError();
+
+	bool CanCollapse(uint32_t from, uint32_t to, uint32_t& twintarget) const;
+	bool FlipsTriangle(uint32_t from, uint32_t to) const;
+	float CollapseCost(uint32_t from, uint32_t to) const;
+
+	inline const float* GetPosition(uint32_t vertex) const	{ return (const float*)(positions + (size_t)vertex * posstride); }
+
+public:
+	MeshSimplifier();
+	~MeshSimplifier();
+
+	void Initialize(const uint32_t* indices, uint32_t numindices, const float* positions, uint32_t posstride, uint32_t numvertices, const uint8_t* vertexlocks = nullptr);
+	uint32_t Simplify(uint32_t targetindices, float maxerror = FLT_MAX);	// can be called repeatedly with smaller targets
+
+	static bool GenerateQMLODs(const char* file, uint32_t numlods = 4, float ratio = 0.5f, float maxerror = 0.02f, LODChainStatistics* stats = nullptr);	// error relative to the size of the mesh
+
+	inline const uint32_t* GetIndices() const	{ return indices.data(); }
+	inline uint32_t GetNumIndices() const		{ return (uint32_t)indices.size(); }
+	inline float GetError() const				{ return error; }	// bound of the distance from the original vertices
+};
+
+#endif
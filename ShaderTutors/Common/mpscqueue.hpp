@@ -0,0 +1,292 @@
+
+#ifndef _MPSCQUEUE_HPP_
+#define _MPSCQUEUE_HPP_
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstdint>
+
+#define MPSC_SPIN_COUNT		64
+
+/**
+ * \brief Bounded lock-free multi-producer single-consumer ring
+ *
+ * Every slot has a sequence number telling whether it's free or published (see
+ * Vyukov's bounded queue). Producers reserve consecutive slots with one CAS, the
+ * consumer takes as many published slots as it can without any atomic RMW.
+ *
+ * The mutex is only touched when somebody is parked: an idle consumer (empty ring)
+ * or a thread waiting for a ticket. Tickets count pushed/completed elements, so
+ * Push(...) returns a ticket that is done when the consumer called Complete() for
+ * everything up to (and including) that element.
+ */
+template <typename value_type>
+class MPSCQueue
+{
+private:
+	struct Slot
+	{
+		std::atomic<uint64_t>	sequence;
+		value_type				value;
+	};
+
+	Slot*						slots;
+	uint64_t					capacity;
+	uint64_t					mask;
+
+	// NOTE: padded to keep producers and the consumer on separate cache lines
+	uint8_t						padding0[64];
+	std::atomic<uint64_t>		tail;
+	uint8_t						padding1[64];
+	std::atomic<uint64_t>		head;
+	std::atomic<uint64_t>		completed;
+	uint8_t						padding2[64];
+	std::atomic<uint32_t>		numsleepers;
+	std::atomic<uint32_t>		numwaiters;
+
+	std::mutex					lock;
+	std::condition_variable		published;
+	std::condition_variable		finished;
+
+	bool Reserve(uint64_t& pos, uint32_t count);
+	void Publish(uint64_t pos, const value_type* values, uint32_t count);
+	bool HasPublished() const;
+
+public:
+	MPSCQueue(uint32_t size = 1024);	// rounded up to power of 2
+	~MPSCQueue();
+
+	MPSCQueue(const MPSCQueue&) = delete;
+	MPSCQueue& operator =(const MPSCQueue&) = delete;
+
+	// any thread (Push waits while the ring is full)
+	bool TryPush(const value_type& value, uint64_t* ticket = nullptr);
+	uint64_t Push(const value_type& value);
+	uint64_t PushBatch(const value_type* values, uint32_t count);
+
+	// consumer thread only
+	uint32_t TryPopBatch(value_type* out, uint32_t maxcount);
+	uint32_t PopBatch(value_type* out, uint32_t maxcount);	// parks while empty
+	void Complete(uint32_t count = 1);
+
+	// any thread except the consumer
+	void Wait(uint64_t ticket);
+
+	inline bool IsCompleted(uint64_t ticket) const	{ return (completed.load(std::memory_order_acquire) >= ticket); }
+	inline uint64_t GetLastTicket() const			{ return tail.load(std::memory_order_acquire); }
+	inline uint32_t GetCapacity() const				{ return (uint32_t)capacity; }
+};
+
+template <typename value_type>
+MPSCQueue<value_type>::MPSCQueue(uint32_t size)
+{
+	capacity = 2;
+
+	while (capacity < size)
+		capacity <<= 1;
+
+	mask = capacity - 1;
+	slots = new Slot[capacity];
+
+	for (uint64_t i = 0; i < capacity; ++i)
+		slots[i].sequence.store(i, std::memory_order_relaxed);
+
+	tail.store(0, std::memory_order_relaxed);
+	head.store(0, std::memory_order_relaxed);
+	completed.store(0, std::memory_order_relaxed);
+
+	numsleepers.store(0, std::memory_order_relaxed);
+	numwaiters.store(0, std::memory_order_relaxed);
+}
+
+template <typename value_type>
+MPSCQueue<value_type>::~MPSCQueue()
+{
+	delete[] slots;
+}
+
+template <typename value_type>
+bool MPSCQueue<value_type>::Reserve(uint64_t& pos, uint32_t count)
+{
+	// NOTE: the consumer frees slots in order, so if the last one is free then all of them are
+	pos = tail.load(std::memory_order_relaxed);
+
+	while (true) {
+		const Slot& last = slots[(pos + count - 1) & mask];
+		uint64_t seq = last.sequence.load(std::memory_order_acquire);
+		int64_t diff = (int64_t)seq - (int64_t)(pos + count - 1);
+
+		if (diff == 0) {
+			if (tail.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed))
+				return true;
+		} else if (diff < 0) {
+			// full
+			return false;
+		} else {
+			pos = tail.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+template <typename value_type>
+void MPSCQueue<value_type>::Publish(uint64_t pos, const value_type* values, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; ++i) {
+		Slot& slot = slots[(pos + i) & mask];
+
+		slot.value = values[i];
+		slot.sequence.store(pos + i + 1, std::memory_order_release);
+	}
+
+	// pairs with the fence in PopBatch (either we see the sleeper or it sees the data)
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if (numsleepers.load(std::memory_order_relaxed) > 0) {
+		std::lock_guard<std::mutex> guard(lock);
+		published.notify_one();
+	}
+}
+
+template <typename value_type>
+bool MPSCQueue<value_type>::HasPublished() const
+{
+	uint64_t pos = head.load(std::memory_order_relaxed);
+	return (slots[pos & mask].sequence.load(std::memory_order_acquire) == pos + 1);
+}
+
+template <typename value_type>
+bool MPSCQueue<value_type>::TryPush(const value_type& value, uint64_t* ticket)
+{
+	uint64_t pos;
+
+	if (!Reserve(pos, 1))
+		return false;
+
+	Publish(pos, &value, 1);
+
+	if (ticket != nullptr)
+		*ticket = pos + 1;
+
+	return true;
+}
+
+template <typename value_type>
+uint64_t MPSCQueue<value_type>::Push(const value_type& value)
+{
+	return PushBatch(&value, 1);
+}
+
+template <typename value_type>
+uint64_t MPSCQueue<value_type>::PushBatch(const value_type* values, uint32_t count)
+{
+	uint64_t pos = 0;
+
+	while (count > 0) {
+		// larger batches are split to fit
+		uint32_t batchsize = (uint32_t)(count < capacity ? count : capacity);
+
+		while (!Reserve(pos, batchsize))
+			std::this_thread::yield();
+
+		Publish(pos, values, batchsize);
+
+		pos += batchsize;
+		values += batchsize;
+		count -= batchsize;
+	}
+
+	return pos;
+}
+
+template <typename value_type>
+uint32_t MPSCQueue<value_type>::TryPopBatch(value_type* out, uint32_t maxcount)
+{
+	uint64_t pos = head.load(std::memory_order_relaxed);
+	uint32_t count = 0;
+
+	while (count < maxcount) {
+		Slot& slot = slots[(pos + count) & mask];
+
+		if (slot.sequence.load(std::memory_order_acquire) != pos + count + 1)
+			break;
+
+		out[count] = slot.value;
+		++count;
+	}
+
+	// give them back to producers
+	for (uint32_t i = 0; i < count; ++i)
+		slots[(pos + i) & mask].sequence.store(pos + i + capacity, std::memory_order_release);
+
+	head.store(pos + count, std::memory_order_relaxed);
+	return count;
+}
+
+template <typename value_type>
+uint32_t MPSCQueue<value_type>::PopBatch(value_type* out, uint32_t maxcount)
+{
+	uint32_t count;
+
+	for (int i = 0; i < MPSC_SPIN_COUNT; ++i) {
+		if ((count = TryPopBatch(out, maxcount)) > 0)
+			return count;
+
+		std::this_thread::yield();
+	}
+
+	while (true) {
+		numsleepers.fetch_add(1, std::memory_order_seq_cst);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		if ((count = TryPopBatch(out, maxcount)) == 0) {
+			std::unique_lock<std::mutex> guard(lock);
+
+			published.wait(guard, [&]() -> bool {
+				return HasPublished();
+			});
+		}
+
+		numsleepers.fetch_sub(1, std::memory_order_relaxed);
+
+		if (count > 0 || (count = TryPopBatch(out, maxcount)) > 0)
+			return count;
+	}
+}
+
+template <typename value_type>
+void MPSCQueue<value_type>::Complete(uint32_t count)
+{
+	completed.fetch_add(count, std::memory_order_seq_cst);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if (numwaiters.load(std::memory_order_relaxed) > 0) {
+		std::lock_guard<std::mutex> guard(lock);
+		finished.notify_all();
+	}
+}
+
+template <typename value_type>
+void MPSCQueue<value_type>::Wait(uint64_t ticket)
+{
+	for (int i = 0; i < MPSC_SPIN_COUNT; ++i) {
+		if (IsCompleted(ticket))
+			return;
+
+		std::this_thread::yield();
+	}
+
+	numwaiters.fetch_add(1, std::memory_order_seq_cst);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	{
+		std::unique_lock<std::mutex> guard(lock);
+
+		finished.wait(guard, [&]() -> bool {
+			return IsCompleted(ticket);
+		});
+	}
+	numwaiters.fetch_sub(1, std::memory_order_relaxed);
+}
+
+#endif
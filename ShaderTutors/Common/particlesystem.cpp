@@ -1,6 +1,14 @@
 
+#include <cstring>
+
 #include "particlesystem.h"
 #include "geometryutils.h"
+#include "profiler.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#	include <emmintrin.h>
+#	define PARTICLES_SSE2
+#endif
 
 IParticleStorage::~IParticleStorage()
 {
@@ -8,15 +16,54 @@ IParticleStorage::~IParticleStorage()
 
 // --- ParticleSystem impl ----------------------------------------------------
 
+void ParticleSystem::ParticleStreams::Resize(size_t newsize)
+{
+	positionsx.resize(newsize);
+	positionsy.resize(newsize);
+	positionsz.resize(newsize);
+	velocitiesx.resize(newsize);
+	velocitiesy.resize(newsize);
+	velocitiesz.resize(newsize);
+	alphas.resize(newsize);
+	lives.resize(newsize);
+}
+
+void ParticleSystem::ParticleStreams::Move(size_t to, size_t from)
+{
+	positionsx[to] = positionsx[from];
+	positionsy[to] = positionsy[from];
+	positionsz[to] = positionsz[from];
+	velocitiesx[to] = velocitiesx[from];
+	velocitiesy[to] = velocitiesy[from];
+	velocitiesz[to] = velocitiesz[from];
+	alphas[to] = alphas[from];
+	lives[to] = lives[from];
+}
+
 ParticleSystem::ParticleSystem()
 {
 	storageimpl		= nullptr;
+	count			= 0;
 	maxcount		= 0;
+	randomstate		= 0x9e3779b9;
 
 	Force			= Math::Vector3(0, -9.81f, 0);
 	EmitterRadius	= 0.5f;
 	ParticleSize	= 0.5f;
 	NeedsSorting	= true;
+
+	for (int i = 0; i < NumAngleSteps; ++i) {
+		float u = (float)i / (float)NumAngleSteps;
+		float v = u;
+
+		u = 2 * u * Math::PI;
+		v = (v - 0.5f) * Math::PI;
+
+		sinu[i] = sinf(u);
+		cosu[i] = cosf(u);
+		sinv[i] = sinf(v);
+		cosv[i] = cosf(v);
+	}
 }
 
 ParticleSystem::~ParticleSystem()
@@ -32,76 +79,203 @@ bool ParticleSystem::Initialize(IParticleStorage* impl, size_t maxnumparticles)
 	maxcount = maxnumparticles;
 	storageimpl = impl;
 
-	particles.reserve(maxnumparticles);
-	orderedparticles.Reserve(maxnumparticles);
+	// NOTE: padded, so that the update kernel doesn't need a scalar tail
+	particles.Resize((maxnumparticles + 3) & ~(size_t)3);
+
+	sortkeys.resize(maxnumparticles);
+	tempkeys.resize(maxnumparticles);
+	order.resize(maxnumparticles);
+	temporder.resize(maxnumparticles);
 
 	return true;
 }
 
+void ParticleSystem::Emit(size_t index)
+{
+	Math::Vector3 position, du, dv, n;
+
+	int u = (int)(NextRandom() % NumAngleSteps);
+	int v = (int)(NextRandom() % NumAngleSteps);
+
+	position.x = EmitterRadius * sinu[u] * cosv[v];
+	position.y = EmitterRadius * cosu[u] * cosv[v];
+	position.z = EmitterRadius * sinv[v];
+
+	du.x = position.y;
+	du.y = -position.x;
+	du.z = position.z;
+
+	dv.x = -EmitterRadius * sinu[u] * sinv[v];
+	dv.y = -EmitterRadius * cosu[u] * sinv[v];
+	dv.z = EmitterRadius * cosv[v];
+
+	Math::Vec3Cross(n, du, dv);
+	Math::Vec3Normalize(n, n);
+
+	particles.positionsx[index] = position.x;
+	particles.positionsy[index] = position.y;
+	particles.positionsz[index] = position.z;
+
+	particles.velocitiesx[index] = n.x * 0.02f;	// InitialVelocity
+	particles.velocitiesy[index] = n.y * 0.02f;
+	particles.velocitiesz[index] = n.z * 0.02f;
+
+	particles.alphas[index] = 1;
+	particles.lives[index] = (int32_t)(NextRandom() % 50) + 10;	// InitialLife
+}
+
 void ParticleSystem::Update(float dt)
 {
-	size_t i = 0;
+	PROFILE_SCOPE("ParticleSystem::Update");
 
-	while (i < particles.size()) {
-		Particle& p = particles[i];
-		
-		if (p.life < 30)
-			p.color.a = (float)p.life / 30.0f;
+	size_t i = 0;
 
-		if (p.life == 0) {
-			// died
-			std::swap(particles[i], particles[particles.size() - 1]);
-			particles.pop_back();
+	// remove dead particles
+	while (i < count) {
+		if (particles.lives[i] == 0) {
+			--count;
+			particles.Move(i, count);
 		} else {
-			p.position += p.velocity;
-			p.velocity += Force * dt;
-
-			--p.life;
 			++i;
 		}
 	}
 
-	while (particles.size() < maxcount) {
-		float u = (float)(rand() % 100) / 100.0f;
-		float v = (float)(rand() % 100) / 100.0f;
+	// update the rest
+	float*		px		= particles.positionsx.data();
+	float*		py		= particles.positionsy.data();
+	float*		pz		= particles.positionsz.data();
+	float*		vx		= particles.velocitiesx.data();
+	float*		vy		= particles.velocitiesy.data();
+	float*		vz		= particles.velocitiesz.data();
+	float*		alpha	= particles.alphas.data();
+	int32_t*	life	= particles.lives.data();
+
+#ifdef PARTICLES_SSE2
+	const __m128	fx		= _mm_set1_ps(Force.x * dt);
+	const __m128	fy		= _mm_set1_ps(Force.y * dt);
+	const __m128	fz		= _mm_set1_ps(Force.z * dt);
+	const __m128	fade	= _mm_set1_ps(1.0f / 30.0f);
+	const __m128	one		= _mm_set1_ps(1.0f);
+	const __m128i	ione	= _mm_set1_epi32(1);
+
+	for (i = 0; i < count; i += 4) {
+		__m128 x = _mm_loadu_ps(px + i);
+		__m128 y = _mm_loadu_ps(py + i);
+		__m128 z = _mm_loadu_ps(pz + i);
+		__m128 dx = _mm_loadu_ps(vx + i);
+		__m128 dy = _mm_loadu_ps(vy + i);
+		__m128 dz = _mm_loadu_ps(vz + i);
+		__m128i l = _mm_loadu_si128((const __m128i*)(life + i));
+
+		// fade out in the last 30 frames
+		_mm_storeu_ps(alpha + i, _mm_min_ps(_mm_mul_ps(_mm_cvtepi32_ps(l), fade), one));
+
+		_mm_storeu_ps(px + i, _mm_add_ps(x, dx));
+		_mm_storeu_ps(py + i, _mm_add_ps(y, dy));
+		_mm_storeu_ps(pz + i, _mm_add_ps(z, dz));
+
+		_mm_storeu_ps(vx + i, _mm_add_ps(dx, fx));
+		_mm_storeu_ps(vy + i, _mm_add_ps(dy, fy));
+		_mm_storeu_ps(vz + i, _mm_add_ps(dz, fz));
+
+		_mm_storeu_si128((__m128i*)(life + i), _mm_sub_epi32(l, ione));
+	}
+#else
+	for (i = 0; i < count; ++i) {
+		alpha[i] = Math::Min((float)life[i] / 30.0f, 1.0f);
 
-		u = 2 * u * Math::PI;
-		v = (v - 0.5f) * Math::PI;
+		px[i] += vx[i];
+		py[i] += vy[i];
+		pz[i] += vz[i];
+
+		vx[i] += Force.x * dt;
+		vy[i] += Force.y * dt;
+		vz[i] += Force.z * dt;
+
+		--life[i];
+	}
+#endif
+
+	// spawn new ones
+	while (count < maxcount) {
+		Emit(count);
+		++count;
+	}
+}
+
+void ParticleSystem::SortByDepth(const Math::Matrix& worldview)
+{
+	const float*	px = particles.positionsx.data();
+	const float*	py = particles.positionsy.data();
+	const float*	pz = particles.positionsz.data();
+	uint32_t		histogram[4][256];
+
+	memset(histogram, 0, sizeof(histogram));
+
+	// view depth once per particle
+	for (size_t i = 0; i < count; ++i) {
+		float z = px[i] * worldview._13 + py[i] * worldview._23 + pz[i] * worldview._33 + worldview._43;
+		uint32_t key;
 
-		Particle p;
-		Math::Vector3 du, dv, n;
+		memcpy(&key, &z, sizeof(uint32_t));
 
-		p.position.x = EmitterRadius * sinf(u) * cosf(v);
-		p.position.y = EmitterRadius * cosf(u) * cosf(v);
-		p.position.z = EmitterRadius * sinf(v);
+		// make float order match unsigned order, then flip it (larger z comes first)
+		key = ((key & 0x80000000) ? ~key : (key | 0x80000000));
+		key = ~key;
 
-		du.x = p.position.y;
-		du.y = -p.position.x;
-		du.z = p.position.z;
+		sortkeys[i] = key;
+		order[i] = (uint32_t)i;
 
-		dv.x = -EmitterRadius * sinf(u) * sinf(v);
-		dv.y = -EmitterRadius * cosf(u) * sinf(v);
-		dv.z = EmitterRadius * cosf(v);
+		++histogram[0][key & 0xff];
+		++histogram[1][(key >> 8) & 0xff];
+		++histogram[2][(key >> 16) & 0xff];
+		++histogram[3][key >> 24];
+	}
+
+	// LSD radix sort, 8 bits per pass
+	for (int pass = 0; pass < 4; ++pass) {
+		uint32_t* counts = histogram[pass];
+		uint32_t shift = pass * 8;
+		uint32_t offset = 0;
 
-		Math::Vec3Cross(n, du, dv);
-		Math::Vec3Normalize(n, n);
+		// every key falls into the same bucket
+		if (counts[(sortkeys[0] >> shift) & 0xff] == count)
+			continue;
 
-		p.velocity = n * 0.02f;			// InitialVelocity
-		p.life = (rand() % 50) + 10;	// InitialLife
-		p.color = Math::Color(1, 1, 1, 1);
+		for (int j = 0; j < 256; ++j) {
+			uint32_t tmp = counts[j];
+
+			counts[j] = offset;
+			offset += tmp;
+		}
+
+		for (size_t i = 0; i < count; ++i) {
+			uint32_t key = sortkeys[i];
+			uint32_t index = counts[(key >> shift) & 0xff]++;
+
+			tempkeys[index] = key;
+			temporder[index] = order[i];
+		}
 
-		particles.push_back(p);
+		sortkeys.swap(tempkeys);
+		order.swap(temporder);
 	}
 }
 
 void ParticleSystem::Draw(const Math::Matrix& world, const Math::Matrix& view, std::function<void (size_t)> callback)
 {
-	Math::Vector3	worldpos;
+	PROFILE_SCOPE("ParticleSystem::Draw");
+
+	Math::Matrix	worldview;
 	Math::Vector3	right, up;
 	Math::Vector3	tmp1, tmp2;
-	size_t			count		= particles.size();
 	float			halfsize	= ParticleSize * 0.5f;
 
+	const float*	px			= particles.positionsx.data();
+	const float*	py			= particles.positionsy.data();
+	const float*	pz			= particles.positionsz.data();
+	const float*	alpha		= particles.alphas.data();
+
 	// NOTE: matrix is right-handed
 	right.x = -view._11;
 	right.y = -view._21;
@@ -116,66 +290,61 @@ void ParticleSystem::Draw(const Math::Matrix& world, const Math::Matrix& view, s
 	if (vdata == nullptr)
 		return;
 
-	Math::MatrixMultiply(orderedparticles.comp.transform, world, view);
-
 	tmp1 = (right - up) * halfsize;
 	tmp2 = (right + up) * halfsize;
-	
-	if (NeedsSorting) {
-		orderedparticles.Clear();
-
-		for (size_t i = 0; i < particles.size(); ++i)
-			orderedparticles.Insert(particles[i]);
 
-		count = orderedparticles.Size();
+	if (NeedsSorting && count > 0) {
+		Math::MatrixMultiply(worldview, world, view);
+		SortByDepth(worldview);
 	}
 
 	for (size_t i = 0; i < count; ++i) {
-		GeometryUtils::BillboardVertex* v1 = (vdata + i * 6 + 0);
-		GeometryUtils::BillboardVertex* v2 = (vdata + i * 6 + 1);
-		GeometryUtils::BillboardVertex* v3 = (vdata + i * 6 + 2);
-		GeometryUtils::BillboardVertex* v4 = (vdata + i * 6 + 3);
-		GeometryUtils::BillboardVertex* v5 = (vdata + i * 6 + 4);
-		GeometryUtils::BillboardVertex* v6 = (vdata + i * 6 + 5);
-
-		const Particle& p = (NeedsSorting ? orderedparticles[i] : particles[i]);
-		Math::Vec3TransformCoord(worldpos, p.position, world);
-			
+		GeometryUtils::BillboardVertex* v = (vdata + i * 6);
+		size_t index = (NeedsSorting ? order[i] : i);
+
+		// NOTE: world is expected to be affine
+		float x = px[index] * world._11 + py[index] * world._21 + pz[index] * world._31 + world._41;
+		float y = px[index] * world._12 + py[index] * world._22 + pz[index] * world._32 + world._42;
+		float z = px[index] * world._13 + py[index] * world._23 + pz[index] * world._33 + world._43;
+
+		// white with fading alpha
+		uint32_t color = ((uint32_t)(alpha[index] * 255) << 24) | 0x00ffffff;
+
 		// top left
-		v1->x = worldpos.x - tmp1.x;
-		v1->y = worldpos.y - tmp1.y;
-		v1->z = worldpos.z - tmp1.z;
+		v[0].x = x - tmp1.x;
+		v[0].y = y - tmp1.y;
+		v[0].z = z - tmp1.z;
 
-		v1->u = 0;
-		v1->v = 0;
-		v1->color = p.color;
+		v[0].u = 0;
+		v[0].v = 0;
+		v[0].color = color;
 
 		// top right
-		v2->x = v5->x = worldpos.x + tmp2.x;
-		v2->y = v5->y = worldpos.y + tmp2.y;
-		v2->z = v5->z = worldpos.z + tmp2.z;
+		v[1].x = v[4].x = x + tmp2.x;
+		v[1].y = v[4].y = y + tmp2.y;
+		v[1].z = v[4].z = z + tmp2.z;
 
-		v2->u = v5->u = 1;
-		v2->v = v5->v = 0;
-		v2->color = v5->color = p.color;
+		v[1].u = v[4].u = 1;
+		v[1].v = v[4].v = 0;
+		v[1].color = v[4].color = color;
 
 		// bottom left
-		v3->x = v4->x = worldpos.x - tmp2.x;
-		v3->y = v4->y = worldpos.y - tmp2.y;
-		v3->z = v4->z = worldpos.z - tmp2.z;
-
-		v3->u = v4->u = 0;
-		v3->v = v4->v = 1;
-		v3->color = v4->color = p.color;
-
-		// bottomright
-		v6->x = worldpos.x + tmp1.x;
-		v6->y = worldpos.y + tmp1.y;
-		v6->z = worldpos.z + tmp1.z;
-
-		v6->u = 1;
-		v6->v = 1;
-		v6->color = p.color;
+		v[2].x = v[3].x = x - tmp2.x;
+		v[2].y = v[3].y = y - tmp2.y;
+		v[2].z = v[3].z = z - tmp2.z;
+
+		v[2].u = v[3].u = 0;
+		v[2].v = v[3].v = 1;
+		v[2].color = v[3].color = color;
+
+		// bottom right
+		v[5].x = x + tmp1.x;
+		v[5].y = y + tmp1.y;
+		v[5].z = z + tmp1.z;
+
+		v[5].u = 1;
+		v[5].v = 1;
+		v[5].color = color;
 	}
 
 	storageimpl->UnlockVertexBuffer();
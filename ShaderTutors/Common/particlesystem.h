@@ -3,9 +3,9 @@
 #define _PARTICLESYSTEM_H_
 
 #include <vector>
+#include <functional>
 
 #include "3Dmath.h"
-#include "orderedmultiarray.hpp"
 
 // --- Interfaces -------------------------------------------------------------
 
@@ -26,36 +26,53 @@ public:
 
 class ParticleSystem
 {
-	struct Particle
+	// SoA layout (the update kernel processes 4 particles at once)
+	struct ParticleStreams
 	{
-		Math::Vector3 position;
-		Math::Vector3 velocity;
-		Math::Color color;
-		uint32_t life;
+		std::vector<float>		positionsx;
+		std::vector<float>		positionsy;
+		std::vector<float>		positionsz;
+		std::vector<float>		velocitiesx;
+		std::vector<float>		velocitiesy;
+		std::vector<float>		velocitiesz;
+		std::vector<float>		alphas;
+		std::vector<int32_t>	lives;
+
+		void Resize(size_t newsize);
+		void Move(size_t to, size_t from);
 	};
 
-	struct ParticleCompare
-	{
-		Math::Matrix transform;
-
-		bool operator ()(const Particle& a, const Particle& b) const {
-			Math::Vector3 p1, p2;
-
-			Math::Vec3TransformCoord(p1, a.position, transform);
-			Math::Vec3TransformCoord(p2, b.position, transform);
-
-			return (p1.z > p2.z);
-		}
-	};
+	typedef std::vector<uint32_t> KeyList;
 
-	typedef std::vector<Particle> ParticleList;
-	typedef OrderedMultiArray<Particle, ParticleCompare> ParticleTable;
+	static const int NumAngleSteps = 100;
 
 private:
-	ParticleList		particles;
-	ParticleTable		orderedparticles;
+	ParticleStreams		particles;
+	KeyList				sortkeys;		// ping-pong buffers for radix sort
+	KeyList				tempkeys;
+	KeyList				order;
+	KeyList				temporder;
 	IParticleStorage*	storageimpl;	// GPU-side storage
+	size_t				count;
 	size_t				maxcount;
+	uint32_t			randomstate;	// xorshift32
+
+	// NOTE: the emitter only uses discrete angles
+	float				sinu[NumAngleSteps];
+	float				cosu[NumAngleSteps];
+	float				sinv[NumAngleSteps];
+	float				cosv[NumAngleSteps];
+
+	void Emit(size_t index);
+	void SortByDepth(const Math::Matrix& worldview);
+
+	inline uint32_t NextRandom() {
+		randomstate ^= (randomstate << 13);
+		randomstate ^= (randomstate >> 17);
+		randomstate ^= (randomstate << 5);
+
+		return randomstate;
+	}
 
 public:
 	Math::Vector3		EmitterPosition;
@@ -71,6 +88,8 @@ public:
 
 	void Update(float dt);
 	void Draw(const Math::Matrix& world, const Math::Matrix& view, std::function<void (size_t)> callback);
+
+	inline size_t GetNumParticles() const	{ return count; }
 };
 
 #endif
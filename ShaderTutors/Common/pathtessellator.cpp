@@ -0,0 +1,560 @@
+
+#include <algorithm>
+#include <cmath>
+
+#include "pathtessellator.h"
+
+#define MAX_CURVE_SEGMENTS	128
+#define MAX_FAN_SEGMENTS	64
+#define MIN_ARENA_SIZE		256
+
+static inline void SetVertex(Math::Vector4& out, float x, float y)
+{
+	out.x = x;
+	out.y = y;
+	out.z = 0;
+	out.w = 1;
+}
+
+static inline bool IsSamePoint(const Math::Vector2& p, float x, float y)
+{
+	float dx = p.x - x;
+	float dy = p.y - y;
+
+	return (dx * dx + dy * dy < 1e-10f);
+}
+
+// --- PathStrokeStyle impl ---------------------------------------------------
+
+PathStrokeStyle::PathStrokeStyle()
+{
+	width		= 1.0f;
+	miterlimit	= 4.0f;
+	join		= LineJoinTypeMiter;
+	cap			= LineCapTypeButt;
+}
+
+// --- PathArena impl ---------------------------------------------------------
+
+PathArena::PathArena()
+{
+	vertices		= nullptr;
+	indices			= nullptr;
+	numvertices		= 0;
+	numindices		= 0;
+	vertexcapacity	= 0;
+	indexcapacity	= 0;
+}
+
+PathArena::~PathArena()
+{
+	delete[] vertices;
+	delete[] indices;
+}
+
+void PathArena::Grow(uint32_t numverts, uint32_t numinds)
+{
+	if (numvertices + numverts > vertexcapacity) {
+		uint32_t newcapacity = Math::Max<uint32_t>(Math::Max<uint32_t>(vertexcapacity * 2, numvertices + numverts), MIN_ARENA_SIZE);
+		Math::Vector4* newvertices = new Math::Vector4[newcapacity];
+
+		std::copy(vertices, vertices + numvertices, newvertices);
+		delete[] vertices;
+
+		vertices = newvertices;
+		vertexcapacity = newcapacity;
+	}
+
+	if (numindices + numinds > indexcapacity) {
+		uint32_t newcapacity = Math::Max<uint32_t>(Math::Max<uint32_t>(indexcapacity * 2, numindices + numinds), MIN_ARENA_SIZE);
+		uint32_t* newindices = new uint32_t[newcapacity];
+
+		std::copy(indices, indices + numindices, newindices);
+		delete[] indices;
+
+		indices = newindices;
+		indexcapacity = newcapacity;
+	}
+}
+
+uint32_t PathArena::Allocate(uint32_t numverts, uint32_t numinds, Math::Vector4** verts, uint32_t** inds)
+{
+	uint32_t base = numvertices;
+
+	if (numvertices + numverts > vertexcapacity || numindices + numinds > indexcapacity)
+		Grow(numverts, numinds);
+
+	(*verts) = vertices + numvertices;
+	(*inds) = indices + numindices;
+
+	numvertices += numverts;
+	numindices += numinds;
+
+	return base;
+}
+
+void PathArena::Reset()
+{
+	numvertices = 0;
+	numindices = 0;
+}
+
+// --- PathTessellator impl ---------------------------------------------------
+
+PathTessellator::PathTessellator()
+{
+	tolerance = 0.25f;
+}
+
+void PathTessellator::BeginPath()
+{
+	points.clear();
+	contours.clear();
+}
+
+void PathTessellator::MoveTo(float x, float y)
+{
+	if (!contours.empty() && contours.back().count == 1) {
+		// 2 MoveTo()s in a row
+		points.back() = Math::Vector2(x, y);
+		return;
+	}
+
+	Contour contour;
+
+	contour.first	= (uint32_t)points.size();
+	contour.count	= 1;
+	contour.closed	= false;
+
+	contours.push_back(contour);
+	points.push_back(Math::Vector2(x, y));
+}
+
+Math::Vector2 PathTessellator::StartSegment()
+{
+	if (contours.empty()) {
+		MoveTo(0, 0);
+	} else if (contours.back().closed) {
+		// continue from the start of the closed contour
+		Math::Vector2 start = points[contours.back().first];
+		MoveTo(start.x, start.y);
+	}
+
+	return points.back();
+}
+
+void PathTessellator::AddPoint(float x, float y)
+{
+	if (IsSamePoint(StartSegment(), x, y))
+		return;
+
+	points.push_back(Math::Vector2(x, y));
+	++contours.back().count;
+}
+
+void PathTessellator::LineTo(float x, float y)
+{
+	AddPoint(x, y);
+}
+
+void PathTessellator::QuadTo(float cx, float cy, float x, float y)
+{
+	Math::Vector2 p0 = StartSegment();
+
+	// NOTE: uniform subdivision is within tolerance if |B''| / (8 * n^2) <= tolerance
+	float ax = p0.x - 2 * cx + x;
+	float ay = p0.y - 2 * cy + y;
+	float dd = sqrtf(ax * ax + ay * ay);
+
+	uint32_t segments = (uint32_t)ceilf(sqrtf(dd / (4 * tolerance)));
+	segments = Math::Min<uint32_t>(Math::Max<uint32_t>(segments, 1), MAX_CURVE_SEGMENTS);
+
+	float step = 1.0f / segments;
+
+	for (uint32_t i = 1; i < segments; ++i) {
+		float t = i * step;
+		float s = 1 - t;
+
+		AddPoint(
+			s * s * p0.x + 2 * s * t * cx + t * t * x,
+			s * s * p0.y + 2 * s * t * cy + t * t * y);
+	}
+
+	AddPoint(x, y);
+}
+
+void PathTessellator::CubicTo(float cx1, float cy1, float cx2, float cy2, float x, float y)
+{
+	Math::Vector2 p0 = StartSegment();
+
+	// NOTE: |B''| <= 6 * max(|p0 - 2c1 + c2|, |c1 - 2c2 + p1|)
+	float ax = p0.x - 2 * cx1 + cx2;
+	float ay = p0.y - 2 * cy1 + cy2;
+	float bx = cx1 - 2 * cx2 + x;
+	float by = cy1 - 2 * cy2 + y;
+	float dd = sqrtf(Math::Max(ax * ax + ay * ay, bx * bx + by * by));
+
+	uint32_t segments = (uint32_t)ceilf(sqrtf(0.75f * dd / tolerance));
+	segments = Math::Min<uint32_t>(Math::Max<uint32_t>(segments, 1), MAX_CURVE_SEGMENTS);
+
+	float step = 1.0f / segments;
+
+	for (uint32_t i = 1; i < segments; ++i) {
+		float t = i * step;
+		float s = 1 - t;
+		float w0 = s * s * s;
+		float w1 = 3 * s * s * t;
+		float w2 = 3 * s * t * t;
+		float w3 = t * t * t;
+
+		AddPoint(
+			w0 * p0.x + w1 * cx1 + w2 * cx2 + w3 * x,
+			w0 * p0.y + w1 * cy1 + w2 * cy2 + w3 * y);
+	}
+
+	AddPoint(x, y);
+}
+
+void PathTessellator::ClosePath()
+{
+	if (contours.empty())
+		return;
+
+	Contour& contour = contours.back();
+	const Math::Vector2& start = points[contour.first];
+
+	if (contour.count > 1 && IsSamePoint(points.back(), start.x, start.y)) {
+		points.pop_back();
+		--contour.count;
+	}
+
+	contour.closed = true;
+}
+
+void PathTessellator::AddRoundFan(PathArena& out, const Math::Vector2& p, float dx, float dy, float sweep) const
+{
+	Math::Vector4* verts;
+	uint32_t* inds;
+
+	// angle step that keeps the chords within tolerance
+	float radius = sqrtf(dx * dx + dy * dy);
+	float maxangle = Math::HALF_PI;
+
+	if (tolerance < radius)
+		maxangle = Math::Min(maxangle, 2.0f * acosf(1.0f - tolerance / radius));
+
+	uint32_t segments = (uint32_t)ceilf(fabsf(sweep) / maxangle);
+	segments = Math::Min<uint32_t>(Math::Max<uint32_t>(segments, 1), MAX_FAN_SEGMENTS);
+
+	uint32_t base = out.Allocate(segments + 2, segments * 3, &verts, &inds);
+
+	float step = sweep / segments;
+	float cosstep = cosf(step);
+	float sinstep = sinf(step);
+
+	SetVertex(verts[0], p.x, p.y);
+
+	for (uint32_t i = 0; i <= segments; ++i) {
+		SetVertex(verts[i + 1], p.x + dx, p.y + dy);
+
+		float tx = dx * cosstep - dy * sinstep;
+		dy = dx * sinstep + dy * cosstep;
+		dx = tx;
+	}
+
+	for (uint32_t i = 0; i < segments; ++i) {
+		inds[i * 3 + 0] = base;
+		inds[i * 3 + 1] = base + i + 1;
+		inds[i * 3 + 2] = base + i + 2;
+	}
+}
+
+void PathTessellator::AddJoin(PathArena& out, const Math::Vector2& p, float nx0, float ny0, float nx1, float ny1, float halfwidth, const PathStrokeStyle& style) const
+{
+	Math::Vector4* verts;
+	uint32_t* inds;
+
+	float cross = nx0 * ny1 - ny0 * nx1;
+	float dot = nx0 * nx1 + ny0 * ny1;
+
+	if (fabsf(cross) < 1e-6f && dot > 0)
+		return;
+
+	// the gap is on the right side when turning left
+	float side = (cross > 0 ? -halfwidth : halfwidth);
+	float ox0 = nx0 * side;
+	float oy0 = ny0 * side;
+	float ox1 = nx1 * side;
+	float oy1 = ny1 * side;
+
+	if (style.join == LineJoinTypeRound) {
+		float sweep = acosf(Math::Clamp(dot, -1.0f, 1.0f));
+		AddRoundFan(out, p, ox0, oy0, (cross > 0 ? sweep : -sweep));
+
+		return;
+	}
+
+	if (style.join == LineJoinTypeMiter) {
+		// NOTE: |n0 + n1| = 2 * cos(theta / 2), the miter is halfwidth / cos(theta / 2) long
+		float mx = nx0 + nx1;
+		float my = ny0 + ny1;
+		float mlen = sqrtf(mx * mx + my * my);
+
+		if (mlen > 1e-6f && 2.0f <= style.miterlimit * mlen) {
+			float scale = 2.0f / (mlen * mlen);
+			uint32_t base = out.Allocate(4, 6, &verts, &inds);
+
+			SetVertex(verts[0], p.x, p.y);
+			SetVertex(verts[1], p.x + ox0, p.y + oy0);
+			SetVertex(verts[2], p.x + mx * side * scale, p.y + my * side * scale);
+			SetVertex(verts[3], p.x + ox1, p.y + oy1);
+
+			inds[0] = base;
+			inds[1] = base + 1;
+			inds[2] = base + 2;
+			inds[3] = base;
+			inds[4] = base + 2;
+			inds[5] = base + 3;
+
+			return;
+		}
+	}
+
+	// bevel
+	uint32_t base = out.Allocate(3, 3, &verts, &inds);
+
+	SetVertex(verts[0], p.x, p.y);
+	SetVertex(verts[1], p.x + ox0, p.y + oy0);
+	SetVertex(verts[2], p.x + ox1, p.y + oy1);
+
+	inds[0] = base;
+	inds[1] = base + 1;
+	inds[2] = base + 2;
+}
+
+void PathTessellator::StrokeContour(PathArena& out, const Contour& contour, const PathStrokeStyle& style) const
+{
+	const Math::Vector2* pts = &points[contour.first];
+
+	Math::Vector4* verts;
+	uint32_t* inds;
+	float halfwidth = style.width * 0.5f;
+
+	if (contour.count == 1) {
+		// dot
+		if (style.cap == LineCapTypeRound) {
+			AddRoundFan(out, pts[0], halfwidth, 0, Math::TWO_PI);
+		} else if (style.cap == LineCapTypeSquare) {
+			uint32_t base = out.Allocate(4, 6, &verts, &inds);
+
+			SetVertex(verts[0], pts[0].x - halfwidth, pts[0].y - halfwidth);
+			SetVertex(verts[1], pts[0].x + halfwidth, pts[0].y - halfwidth);
+			SetVertex(verts[2], pts[0].x - halfwidth, pts[0].y + halfwidth);
+			SetVertex(verts[3], pts[0].x + halfwidth, pts[0].y + halfwidth);
+
+			inds[0] = base;
+			inds[1] = base + 1;
+			inds[2] = base + 2;
+			inds[3] = base + 2;
+			inds[4] = base + 1;
+			inds[5] = base + 3;
+		}
+
+		return;
+	}
+
+	bool closed = (contour.closed && contour.count > 2);
+	uint32_t numsegments = (closed ? contour.count : contour.count - 1);
+	float prevnx = 0, prevny = 0;
+	float firstdx = 0, firstdy = 0;
+	float lastdx = 0, lastdy = 0;
+
+	if (closed) {
+		// normal of the closing segment (for the join at the first point)
+		const Math::Vector2& a = pts[contour.count - 1];
+		float dx = pts[0].x - a.x;
+		float dy = pts[0].y - a.y;
+		float invlen = 1.0f / sqrtf(dx * dx + dy * dy);
+
+		prevnx = -dy * invlen;
+		prevny = dx * invlen;
+	}
+
+	for (uint32_t i = 0; i < numsegments; ++i) {
+		const Math::Vector2& a = pts[i];
+		const Math::Vector2& b = pts[(i + 1 == contour.count) ? 0 : i + 1];
+
+		float dx = b.x - a.x;
+		float dy = b.y - a.y;
+		float invlen = 1.0f / sqrtf(dx * dx + dy * dy);
+
+		dx *= invlen;
+		dy *= invlen;
+
+		float nx = -dy * halfwidth;
+		float ny = dx * halfwidth;
+
+		if (i > 0 || closed)
+			AddJoin(out, a, prevnx, prevny, -dy, dx, halfwidth, style);
+
+		float ax = a.x, ay = a.y;
+		float bx = b.x, by = b.y;
+
+		if (!closed && style.cap == LineCapTypeSquare) {
+			if (i == 0) {
+				ax -= dx * halfwidth;
+				ay -= dy * halfwidth;
+			}
+
+			if (i == numsegments - 1) {
+				bx += dx * halfwidth;
+				by += dy * halfwidth;
+			}
+		}
+
+		uint32_t base = out.Allocate(4, 6, &verts, &inds);
+
+		SetVertex(verts[0], ax + nx, ay + ny);
+		SetVertex(verts[1], ax - nx, ay - ny);
+		SetVertex(verts[2], bx + nx, by + ny);
+		SetVertex(verts[3], bx - nx, by - ny);
+
+		inds[0] = base;
+		inds[1] = base + 1;
+		inds[2] = base + 2;
+		inds[3] = base + 2;
+		inds[4] = base + 1;
+		inds[5] = base + 3;
+
+		if (i == 0) {
+			firstdx = dx;
+			firstdy = dy;
+		}
+
+		prevnx = -dy;
+		prevny = dx;
+		lastdx = dx;
+		lastdy = dy;
+	}
+
+	if (!closed && style.cap == LineCapTypeRound) {
+		// half circles from the left side to the right side (going around the end)
+		AddRoundFan(out, pts[0], -firstdy * halfwidth, firstdx * halfwidth, Math::PI);
+		AddRoundFan(out, pts[contour.count - 1], lastdy * halfwidth, -lastdx * halfwidth, Math::PI);
+	}
+}
+
+void PathTessellator::FillContour(PathArena& out, const Contour& contour)
+{
+	if (contour.count < 3)
+		return;
+
+	const Math::Vector2* pts = &points[contour.first];
+
+	Math::Vector4* verts;
+	uint32_t* inds;
+	uint32_t count = contour.count;
+	uint32_t base = out.Allocate(count, (count - 2) * 3, &verts, &inds);
+	float area = 0;
+	bool convex = true;
+
+	for (uint32_t i = 0; i < count; ++i) {
+		const Math::Vector2& a = pts[i];
+		const Math::Vector2& b = pts[(i + 1) % count];
+
+		SetVertex(verts[i], a.x, a.y);
+		area += a.x * b.y - b.x * a.y;
+	}
+
+	float orient = (area < 0 ? -1.0f : 1.0f);
+
+	for (uint32_t i = 0; i < count && convex; ++i) {
+		const Math::Vector2& a = pts[i];
+		const Math::Vector2& b = pts[(i + 1) % count];
+		const Math::Vector2& c = pts[(i + 2) % count];
+
+		convex = ((b.x - a.x) * (c.y - b.y) - (b.y - a.y) * (c.x - b.x)) * orient >= 0;
+	}
+
+	if (convex) {
+		for (uint32_t i = 1; i < count - 1; ++i) {
+			(*inds++) = base;
+			(*inds++) = base + i;
+			(*inds++) = base + i + 1;
+		}
+
+		return;
+	}
+
+	// ear clipping
+	uint32_t remaining = count;
+	uint32_t current = 0;
+	uint32_t misses = 0;
+
+	polygon.resize(count);
+
+	for (uint32_t i = 0; i < count; ++i)
+		polygon[i] = i;
+
+	auto signedarea = [&](const Math::Vector2& a, const Math::Vector2& b, const Math::Vector2& c) -> float {
+		return ((b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x)) * orient;
+	};
+
+	while (remaining > 3 && misses < remaining) {
+		uint32_t i0 = polygon[(current + remaining - 1) % remaining];
+		uint32_t i1 = polygon[current];
+		uint32_t i2 = polygon[(current + 1) % remaining];
+
+		const Math::Vector2& a = pts[i0];
+		const Math::Vector2& b = pts[i1];
+		const Math::Vector2& c = pts[i2];
+
+		bool isear = (signedarea(a, b, c) > 0);
+
+		for (uint32_t j = 0; j < remaining && isear; ++j) {
+			uint32_t k = polygon[j];
+
+			if (k == i0 || k == i1 || k == i2)
+				continue;
+
+			const Math::Vector2& p = pts[k];
+			isear = !(signedarea(a, b, p) >= 0 && signedarea(b, c, p) >= 0 && signedarea(c, a, p) >= 0);
+		}
+
+		if (isear) {
+			(*inds++) = base + i0;
+			(*inds++) = base + i1;
+			(*inds++) = base + i2;
+
+			polygon.erase(polygon.begin() + current);
+			--remaining;
+
+			misses = 0;
+
+			if (current >= remaining)
+				current = 0;
+		} else {
+			current = (current + 1) % remaining;
+			++misses;
+		}
+	}
+
+	// NOTE: degenerate or self-intersecting contours end up here with more than 3 vertices
+	for (uint32_t i = 1; i < remaining - 1; ++i) {
+		(*inds++) = base + polygon[0];
+		(*inds++) = base + polygon[i];
+		(*inds++) = base + polygon[i + 1];
+	}
+}
+
+void PathTessellator::Stroke(PathArena& out, const PathStrokeStyle& style) const
+{
+	for (const Contour& contour : contours)
+		StrokeContour(out, contour, style);
+}
+
+void PathTessellator::Fill(PathArena& out)
+{
+	for (const Contour& contour : contours)
+		FillContour(out, contour);
+}
@@ -0,0 +1,117 @@
+
+#ifndef _PATHTESSELLATOR_H_
+#define _PATHTESSELLATOR_H_
+
+#include <vector>
+#include "3Dmath.h"
+
+enum LineJoinType
+{
+	LineJoinTypeMiter = 0,
+	LineJoinTypeBevel,
+	LineJoinTypeRound
+};
+
+enum LineCapType
+{
+	LineCapTypeButt = 0,
+	LineCapTypeSquare,
+	LineCapTypeRound
+};
+
+struct PathStrokeStyle
+{
+	float			width;
+	float			miterlimit;		// miter length / width (as in SVG)
+	LineJoinType	join;
+	LineCapType		cap;
+
+	PathStrokeStyle();
+};
+
+/**
+ * \brief Growable vertex/index storage for tessellated paths
+ *
+ * Reset only rewinds the buffers, so after the first few frames nothing is
+ * allocated. Vertices are (x, y, 0, 1), indices are 32 bit triangle lists.
+ */
+class PathArena
+{
+private:
+	Math::Vector4*	vertices;
+	uint32_t*		indices;
+	uint32_t		numvertices;
+	uint32_t		numindices;
+	uint32_t		vertexcapacity;
+	uint32_t		indexcapacity;
+
+	void Grow(uint32_t numverts, uint32_t numinds);
+
+public:
+	PathArena();
+	~PathArena();
+
+	PathArena(const PathArena&) = delete;
+	PathArena& operator =(const PathArena&) = delete;
+
+	// returns index of the first vertex, (*verts) and (*inds) must be filled by the caller
+	uint32_t Allocate(uint32_t numverts, uint32_t numinds, Math::Vector4** verts, uint32_t** inds);
+	void Reset();
+
+	inline const Math::Vector4* GetVertices() const	{ return vertices; }
+	inline const uint32_t* GetIndices() const		{ return indices; }
+	inline uint32_t GetNumVertices() const			{ return numvertices; }
+	inline uint32_t GetNumIndices() const			{ return numindices; }
+};
+
+/**
+ * \brief Converts 2D vector paths to triangles
+ *
+ * Curves are flattened so that the polyline stays within 'tolerance' of the curve.
+ * Strokes are built from one quad per segment plus join and cap geometry (the inner
+ * side of joins overlaps, which is fine for opaque colors). Every contour of a fill
+ * is triangulated separately by ear clipping, so holes and self-intersecting
+ * contours are not supported.
+ */
+class PathTessellator
+{
+private:
+	struct Contour
+	{
+		uint32_t	first;
+		uint32_t	count;
+		bool		closed;
+	};
+
+	std::vector<Math::Vector2>	points;
+	std::vector<Contour>		contours;
+	std::vector<uint32_t>		polygon;	// scratch for ear clipping
+	float						tolerance;
+
+	Math::Vector2 StartSegment();
+	void AddPoint(float x, float y);
+	void AddJoin(PathArena& out, const Math::Vector2& p, float nx0, float ny0, float nx1, float ny1, float halfwidth, const PathStrokeStyle& style) const;
+	void AddRoundFan(PathArena& out, const Math::Vector2& p, float dx, float dy, float sweep) const;	// (dx, dy) is the first rim point relative to p
+
+	void StrokeContour(PathArena& out, const Contour& contour, const PathStrokeStyle& style) const;
+	void FillContour(PathArena& out, const Contour& contour);
+
+public:
+	PathTessellator();
+
+	void BeginPath();
+	void MoveTo(float x, float y);
+	void LineTo(float x, float y);
+	void QuadTo(float cx, float cy, float x, float y);
+	void CubicTo(float cx1, float cy1, float cx2, float cy2, float x, float y);
+	void ClosePath();
+
+	void Stroke(PathArena& out, const PathStrokeStyle& style) const;
+	void Fill(PathArena& out);
+
+	inline void SetTolerance(float value)	{ tolerance = value; }
+	inline bool IsEmpty() const				{ return contours.empty(); }
+	inline size_t GetNumPoints() const		{ return points.size(); }
+};
+
+#endif
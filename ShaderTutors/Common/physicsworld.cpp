@@ -1,6 +1,13 @@
 
+#include <algorithm>
+#include <cstring>
+
 #include "physicsworld.h"
-#include "gl4ext.h"
+#include "threadpool.h"
+#include "profiler.h"
+
+#define BAUMGARTE_FACTOR	0.2f	// fraction of penetration resolved per step
+#define PENETRATION_SLOP	0.005f	// 5 mm
 
 const float PhysicsWorld::Immovable = 3.402823466e+38f;
 
@@ -12,7 +19,9 @@ private:
 public:
 	RigidSphere(float radius);
 
+	void GetBounds(Math::AABox& out) const override;
 	void GetTransformWithSize(Math::Matrix& out) override;
+	float RayIntersect(Math::Vector3& normal, const Math::Vector3& start, const Math::Vector3& dir) override;
 
 	inline float GetRadius() const	{ return radius; }
 };
@@ -25,6 +34,7 @@ private:
 public:
 	RigidBox(float width, float height, float depth);
 
+	void GetBounds(Math::AABox& out) const override;
 	void GetTransformWithSize(Math::Matrix& out) override;
 	float RayIntersect(Math::Vector3& normal, const Math::Vector3& start, const Math::Vector3& dir) override;
 
@@ -39,6 +49,15 @@ RigidSphere::RigidSphere(float radius)
 	this->radius = radius;
 }
 
+void RigidSphere::GetBounds(Math::AABox& out) const
+{
+	// swept sphere (detectors work on previous -> current)
+	out = Math::AABox();
+
+	out.Add(Math::Vector3::Min(GetPreviousPosition(), GetPosition()) - Math::Vector3(radius, radius, radius));
+	out.Add(Math::Vector3::Max(GetPreviousPosition(), GetPosition()) + Math::Vector3(radius, radius, radius));
+}
+
 void RigidSphere::GetTransformWithSize(Math::Matrix& out)
 {
 	out = world;
@@ -60,6 +79,34 @@ void RigidSphere::GetTransformWithSize(Math::Matrix& out)
 	out._43 -= (pivot[0] * out._13 + pivot[1] * out._23 + pivot[2] * out._33);
 }
 
+float RigidSphere::RayIntersect(Math::Vector3& normal, const Math::Vector3& start, const Math::Vector3& dir)
+{
+	// NOTE: like AABox::RayIntersect, returns a negative value if the ray starts inside
+	Math::Vector3 m, p;
+
+	Math::Vec3Subtract(m, start, GetPosition());
+
+	float a = Math::Vec3Dot(dir, dir);
+	float b = Math::Vec3Dot(m, dir);
+	float c = Math::Vec3Dot(m, m) - radius * radius;
+	float d = b * b - a * c;
+
+	if (a == 0 || d < 0)
+		return FLT_MAX;
+
+	d = sqrtf(d);
+
+	if (-b + d < 0)
+		return FLT_MAX;
+
+	float t = (-b - d) / a;
+
+	Math::Vec3Mad(p, m, dir, t);
+	Math::Vec3Scale(normal, p, 1.0f / radius);
+
+	return t;
+}
+
 // --- RigidBox impl ----------------------------------------------------------
 
 RigidBox::RigidBox(float width, float height, float depth)
@@ -68,6 +115,31 @@ RigidBox::RigidBox(float width, float height, float depth)
 	size = Math::Vector3(width, height, depth);
 }
 
+void RigidBox::GetBounds(Math::AABox& out) const
+{
+	Math::AABox prevbox;
+	Math::Vector3 offset;
+
+	out = Math::AABox(size);
+
+	Math::Vec3Subtract(out.Min, out.Min, pivot);
+	Math::Vec3Subtract(out.Max, out.Max, pivot);
+
+	out.TransformAxisAligned(world);
+
+	// NOTE: world is only updated by setters, but current position might have changed since
+	Math::Vec3Subtract(offset, GetPosition(), Math::Vector3(world._41, world._42, world._43));
+	out.Offset(offset[0], offset[1], offset[2]);
+
+	Math::Vec3Subtract(offset, GetPreviousPosition(), GetPosition());
+
+	prevbox = out;
+	prevbox.Offset(offset[0], offset[1], offset[2]);
+
+	out.Add(prevbox.Min);
+	out.Add(prevbox.Max);
+}
+
 void RigidBox::GetTransformWithSize(Math::Matrix& out)
 {
 	out = world;
@@ -136,13 +208,15 @@ float RigidBox::RayIntersect(Math::Vector3& normal, const Math::Vector3& start,
 RigidBody::RigidBody(RigidBodyType bodytype)
 {
 	type = bodytype;
-	invmass = 0;
+	owner = nullptr;
 	userdata = 0;
+	index = -1;
+	dirty = false;
 
-	Math::QuaternionIdentity(previous.orientation);
-	Math::QuaternionIdentity(current.orientation);
+	Math::QuaternionIdentity(orientation);
 
-	UpdateMatrices();
+	Math::MatrixIdentity(world);
+	Math::MatrixIdentity(worldinv);
 }
 
 RigidBody::~RigidBody()
@@ -151,9 +225,18 @@ RigidBody::~RigidBody()
 
 void RigidBody::GetInterpolatedPosition(Math::Vector3& out, float t) const
 {
-	out[0] = (1.0f - t) * previous.position[0] + t * current.position[0];
-	out[1] = (1.0f - t) * previous.position[1] + t * current.position[1];
-	out[2] = (1.0f - t) * previous.position[2] + t * current.position[2];
+	const Math::Vector3& previous = GetPreviousPosition();
+	const Math::Vector3& current = GetPosition();
+
+	out[0] = (1.0f - t) * previous[0] + t * current[0];
+	out[1] = (1.0f - t) * previous[1] + t * current[1];
+	out[2] = (1.0f - t) * previous[2] + t * current[2];
+}
+
+void RigidBody::GetBounds(Math::AABox& out) const
+{
+	out = Math::AABox();
+	out.Add(GetPosition());
 }
 
 void RigidBody::GetTransformWithSize(Math::Matrix& out)
@@ -165,95 +248,112 @@ float RigidBody::RayIntersect(Math::Vector3& normal, const Math::Vector3& start,
 	return FLT_MAX;
 }
 
+void RigidBody::Invalidate()
+{
+	if (owner != nullptr && !dirty) {
+		dirty = true;
+		owner->dirtybodies.push_back(this);
+	}
+}
+
 void RigidBody::UpdateMatrices()
 {
-	Math::MatrixRotationQuaternion(prevworld, previous.orientation);
-	Math::MatrixRotationQuaternion(world, current.orientation);
+	const Math::Vector3& position = Position();
 
-	prevworld._41 = previous.position[0];
-	prevworld._42 = previous.position[1];
-	prevworld._43 = previous.position[2];
+	Math::MatrixRotationQuaternion(world, orientation);
 
-	world._41 = current.position[0];
-	world._42 = current.position[1];
-	world._43 = current.position[2];
+	world._41 = position[0];
+	world._42 = position[1];
+	world._43 = position[2];
 
 	Math::MatrixInverse(worldinv, world);
-	Math::MatrixInverse(prevworldinv, prevworld);
 }
 
 void RigidBody::Integrate(float dt)
 {
-	const Math::Vector3 gravity = { 0, -10, 0 };
+	const Math::Vector3& gravity = owner->gravity;
+	Math::Vector3& position = Position();
+	Math::Vector3& velocity = Velocity();
 
-	if (invmass == 0)
+	if (GetInverseMass() == 0)
 		return;
 
-	previous.position = current.position;
+	PreviousPosition() = position;
 
 	velocity[0] += gravity[0] * dt;
 	velocity[1] += gravity[1] * dt;
 	velocity[2] += gravity[2] * dt;
 
-	current.position[0] += velocity[0] * dt;
-	current.position[1] += velocity[1] * dt;
-	current.position[2] += velocity[2] * dt;
+	position[0] += velocity[0] * dt;
+	position[1] += velocity[1] * dt;
+	position[2] += velocity[2] * dt;
+
+	Invalidate();
 }
 
 void RigidBody::IntegratePosition(float dt)
 {
-	current.position[0] += velocity[0] * dt;
-	current.position[1] += velocity[1] * dt;
-	current.position[2] += velocity[2] * dt;
+	Math::Vector3& position = Position();
+	const Math::Vector3& velocity = Velocity();
+
+	position[0] += velocity[0] * dt;
+	position[1] += velocity[1] * dt;
+	position[2] += velocity[2] * dt;
+
+	Invalidate();
 }
 
 void RigidBody::ResolvePenetration(const Contact& contact)
 {
-	Math::Vec3Mad(current.position, current.position, contact.normal, contact.depth + 1e-3f);	// 1 mm
+	Math::Vec3Mad(Position(), Position(), contact.normal, contact.depth + 1e-3f);	// 1 mm
+	Invalidate();
 }
 
 void RigidBody::ResolvePenetration(float toi)
 {
-	Math::Vec3Mad(current.position, previous.position, velocity, toi);
+	Math::Vec3Mad(Position(), PreviousPosition(), Velocity(), toi);
+	Invalidate();
 }
 
 void RigidBody::SetMass(float mass)
 {
 	if (mass == PhysicsWorld::Immovable)
-		invmass = 0;
+		owner->states.invmasses[index] = 0;
 	else
-		invmass = 1.0f / mass;
+		owner->states.invmasses[index] = 1.0f / mass;
 }
 
 void RigidBody::SetPivot(const Math::Vector3& offset)
 {
 	pivot = offset;
+	Invalidate();
 }
 
 void RigidBody::SetPosition(float x, float y, float z)
 {
-	previous.position = Math::Vector3(x, y, z);
-	current.position = Math::Vector3(x, y, z);
+	PreviousPosition() = Math::Vector3(x, y, z);
+	Position() = Math::Vector3(x, y, z);
 
 	UpdateMatrices();
+	Invalidate();
 }
 
 void RigidBody::SetVelocity(float x, float y, float z)
 {
-	velocity = Math::Vector3(x, y, z);
+	Velocity() = Math::Vector3(x, y, z);
 }
 
 void RigidBody::SetVelocity(const Math::Vector3& v)
 {
-	velocity = v;
+	Velocity() = v;
 }
 
 void RigidBody::SetOrientation(const Math::Quaternion& q)
 {
-	previous.orientation = q;
-	current.orientation = q;
+	orientation = q;
 
 	UpdateMatrices();
+	Invalidate();
 }
 
 // --- PhysicsWorld impl ------------------------------------------------------
@@ -262,8 +362,16 @@ PhysicsWorld::PhysicsWorld()
 {
 	memset(detectors, 0, sizeof(detectors));
 
+	detectors[1][1] = &PhysicsWorld::SphereSweepSphere;
 	detectors[1][2] = &PhysicsWorld::SphereSweepBox;
 	detectors[2][1] = &PhysicsWorld::BoxSweepSphere;
+	detectors[2][2] = &PhysicsWorld::BoxSweepBox;
+
+	broadphase		= BroadPhase::Create(BroadPhaseTypeSweepAndPrune, 1.0f);
+	workers			= nullptr;
+	gravity			= { 0, -10, 0 };
+	friction		= 0.5f;
+	numiterations	= 10;
 }
 
 PhysicsWorld::~PhysicsWorld()
@@ -272,28 +380,111 @@ PhysicsWorld::~PhysicsWorld()
 		delete bodies[i];
 
 	bodies.clear();
+
+	delete broadphase;
+	delete workers;
+}
+
+RigidBody* PhysicsWorld::AddBody(RigidBody* body)
+{
+	body->owner = this;
+	body->index = (int)bodies.size();
+
+	bodies.push_back(body);
+
+	states.positions.push_back(Math::Vector3(0, 0, 0));
+	states.prevpositions.push_back(Math::Vector3(0, 0, 0));
+	states.velocities.push_back(Math::Vector3(0, 0, 0));
+	states.invmasses.push_back(0);
+
+	body->UpdateMatrices();
+
+	// NOTE: inserted on first query (bodies are usually positioned after creation)
+	body->Invalidate();
+
+	return body;
 }
 
 RigidBody* PhysicsWorld::AddStaticBox(float width, float height, float depth)
 {
-	RigidBody* body = new RigidBox(width, height, depth);
+	RigidBody* body = AddBody(new RigidBox(width, height, depth));
 
 	body->SetMass(Immovable);
-	bodies.push_back(body);
+	return body;
+}
+
+RigidBody* PhysicsWorld::AddDynamicBox(float width, float height, float depth, float mass)
+{
+	RigidBody* body = AddBody(new RigidBox(width, height, depth));
 
+	body->SetMass(mass);
 	return body;
 }
 
 RigidBody* PhysicsWorld::AddDynamicSphere(float radius, float mass)
 {
-	RigidBody* body = new RigidSphere(radius);
+	RigidBody* body = AddBody(new RigidSphere(radius));
 
 	body->SetMass(mass);
-	bodies.push_back(body);
-
 	return body;
 }
 
+void PhysicsWorld::SetBroadPhase(BroadPhaseType type, float cellsize)
+{
+	delete broadphase;
+	broadphase = BroadPhase::Create(type, cellsize);
+
+	for (size_t i = 0; i < dirtybodies.size(); ++i)
+		dirtybodies[i]->dirty = false;
+
+	dirtybodies.clear();
+
+	for (size_t i = 0; i < bodies.size(); ++i)
+		bodies[i]->Invalidate();
+}
+
+void PhysicsWorld::UpdateBroadPhase()
+{
+	Math::AABox box;
+
+	for (size_t i = 0; i < dirtybodies.size(); ++i) {
+		RigidBody* body = dirtybodies[i];
+
+		if (broadphase != nullptr) {
+			body->GetBounds(box);
+
+			// new bodies are invalidated in order of creation
+			if (body->index < broadphase->GetNumProxies())
+				broadphase->Update(body->index, box);
+			else
+				broadphase->Insert(body->index, box);
+		}
+
+		body->dirty = false;
+	}
+
+	dirtybodies.clear();
+}
+
+float PhysicsWorld::RayCastCallback(void* context, int proxy, float maxt)
+{
+	RayCastContext* raycast = (RayCastContext*)context;
+	RigidBody* body = raycast->world->bodies[proxy];
+	Math::Vector3 n;
+
+	float t = body->RayIntersect(n, raycast->start, raycast->dir);
+
+	if (t < maxt) {
+		raycast->bestbody = body;
+		raycast->bestt = t;
+		raycast->normal = n;
+
+		return t;
+	}
+
+	return maxt;
+}
+
 RigidBody* PhysicsWorld::RayIntersect(const Math::Vector3& start, const Math::Vector3& dir)
 {
 	Math::Vector4 params;
@@ -306,7 +497,29 @@ RigidBody* PhysicsWorld::RayIntersect(Math::Vector4& out, const Math::Vector3& s
 	float t, bestt = FLT_MAX;
 	Math::Vector3 n;
 
-	// TODO: kD-tree
+	UpdateBroadPhase();
+
+	if (broadphase != nullptr) {
+		RayCastContext raycast;
+
+		raycast.start		= start;
+		raycast.dir			= dir;
+		raycast.world		= this;
+		raycast.bestbody	= nullptr;
+		raycast.bestt		= FLT_MAX;
+
+		broadphase->RayCast(start, dir, &PhysicsWorld::RayCastCallback, &raycast);
+
+		if (raycast.bestbody != nullptr) {
+			out.x = raycast.normal.x;
+			out.y = raycast.normal.y;
+			out.z = raycast.normal.z;
+		}
+
+		out[3] = raycast.bestt;
+		return raycast.bestbody;
+	}
+
 	for (size_t i = 0; i < bodies.size(); ++i) {
 		t = bodies[i]->RayIntersect(n, start, dir);
 
@@ -324,6 +537,227 @@ RigidBody* PhysicsWorld::RayIntersect(Math::Vector4& out, const Math::Vector3& s
 	return bestbody;
 }
 
+bool PhysicsWorld::SphereSweepSphere(CollisionData& out, RigidBody* body1, RigidBody* body2)
+{
+	RigidSphere*	sphere1		= (RigidSphere*)body1;
+	RigidSphere*	sphere2		= (RigidSphere*)body2;
+
+	Contact			contact;
+	Math::Vector3	v1, v2;
+	Math::Vector3	rel_vel;
+	Math::Vector3	estpos;
+	Math::Vector3	tmp;
+
+	float			radii		= sphere1->GetRadius() + sphere2->GetRadius();
+	float			dist, prevdist;
+	float			maxdist;
+	float			dt, t = 0;
+	int				numiter = 0;
+
+	contact.body1 = body1;
+	contact.body2 = body2;
+
+	// calculate relative velocity (sphere2 stays at its previous position)
+	Math::Vec3Subtract(v1, sphere1->GetPosition(), sphere1->GetPreviousPosition());
+	Math::Vec3Subtract(v2, sphere2->GetPosition(), sphere2->GetPreviousPosition());
+	Math::Vec3Subtract(rel_vel, v1, v2);
+
+	estpos = sphere1->GetPreviousPosition();
+	maxdist = Math::Vec3Length(rel_vel);
+	dist = Math::Vec3Distance(estpos, sphere2->GetPreviousPosition()) - radii;
+
+	if (maxdist > 1e-3f) {
+		// conservative advancement
+		while (numiter < 15) {
+			prevdist = dist;
+			dt = dist / maxdist;
+
+			Math::Vec3Scale(tmp, rel_vel, dt);
+			Math::Vec3Add(estpos, estpos, tmp);
+
+			t += dt;
+			dist = Math::Vec3Distance(estpos, sphere2->GetPreviousPosition()) - radii;
+
+			if (dist >= prevdist || t > 1 || dist < 1e-3f)	// 1 mm
+				break;
+
+			++numiter;
+		}
+	}
+
+	if (dist >= 1e-3f || t > 1)
+		return false;
+
+	Math::Vec3Subtract(contact.normal, estpos, sphere2->GetPreviousPosition());
+
+	if (Math::Vec3Dot(contact.normal, contact.normal) > 1e-10f)
+		Math::Vec3Normalize(contact.normal, contact.normal);
+	else
+		contact.normal = Math::Vector3(0, 1, 0);
+
+	contact.toi = Math::Max(t, 0.0f);
+
+	// convert to current frame
+	Math::Vec3Subtract(tmp, sphere1->GetPosition(), sphere2->GetPosition());
+	contact.depth = radii - Math::Vec3Dot(tmp, contact.normal);
+
+	Math::Vec3Mad(contact.pos1, sphere1->GetPosition(), contact.normal, -sphere1->GetRadius());
+	Math::Vec3Mad(contact.pos2, sphere2->GetPosition(), contact.normal, sphere2->GetRadius());
+
+	out.contacts.push_back(contact);
+	return true;
+}
+
+bool PhysicsWorld::BoxSweepBox(CollisionData& out, RigidBody* body1, RigidBody* body2)
+{
+	RigidBox*		box1		= (RigidBox*)body1;
+	RigidBox*		box2		= (RigidBox*)body2;
+
+	if (box1->GetInverseMass() == 0 && box2->GetInverseMass() == 0)
+		return false;
+
+	Contact			contact;
+	Math::Vector3	axes1[3], axes2[3];
+	Math::Vector3	center1, center2;
+	Math::Vector3	half1, half2;
+	Math::Vector3	start, diff;
+	Math::Vector3	v1, v2;
+	Math::Vector3	rel_vel;
+	Math::Vector3	axis;
+	Math::Vector3	bestaxis;
+
+	// orientation doesn't change during a step
+	for (int i = 0; i < 3; ++i) {
+		axes1[i] = Math::Vector3(box1->world[i][0], box1->world[i][1], box1->world[i][2]);
+		axes2[i] = Math::Vector3(box2->world[i][0], box2->world[i][1], box2->world[i][2]);
+	}
+
+	Math::Vec3Scale(half1, box1->GetSize(), 0.5f);
+	Math::Vec3Scale(half2, box2->GetSize(), 0.5f);
+
+	Math::Vec3TransformNormal(center1, -box1->pivot, box1->world);
+	Math::Vec3TransformNormal(center2, -box2->pivot, box2->world);
+
+	// relative motion (box2 stays at its previous position)
+	Math::Vec3Subtract(v1, box1->GetPosition(), box1->GetPreviousPosition());
+	Math::Vec3Subtract(v2, box2->GetPosition(), box2->GetPreviousPosition());
+	Math::Vec3Subtract(rel_vel, v1, v2);
+
+	Math::Vec3Subtract(start, box1->GetPreviousPosition(), box2->GetPreviousPosition());
+	Math::Vec3Add(start, start, center1);
+	Math::Vec3Subtract(start, start, center2);
+
+	// swept SAT: find the last axis to start overlapping
+	float tfirst = -FLT_MAX;
+	float tlast = FLT_MAX;
+	float mindepth = FLT_MAX;
+	float bestradius = 0;
+	float radius;
+
+	for (int i = 0; i < 15; ++i) {
+		if (i < 3) {
+			axis = axes1[i];
+		} else if (i < 6) {
+			axis = axes2[i - 3];
+		} else {
+			Math::Vec3Cross(axis, axes1[(i - 6) / 3], axes2[(i - 6) % 3]);
+
+			// parallel edges, already covered by face axes
+			if (Math::Vec3Dot(axis, axis) < 1e-6f)
+				continue;
+
+			Math::Vec3Normalize(axis, axis);
+		}
+
+		radius = 0;
+
+		for (int j = 0; j < 3; ++j) {
+			radius += fabs(Math::Vec3Dot(axes1[j], axis)) * half1[j];
+			radius += fabs(Math::Vec3Dot(axes2[j], axis)) * half2[j];
+		}
+
+		float s = Math::Vec3Dot(start, axis);
+		float w = Math::Vec3Dot(rel_vel, axis);
+		float tenter, texit;
+
+		if (fabs(w) < 1e-8f) {
+			if (fabs(s) > radius)
+				return false;
+
+			tenter = -FLT_MAX;
+			texit = FLT_MAX;
+		} else {
+			tenter = (-radius - s) / w;
+			texit = (radius - s) / w;
+
+			if (tenter > texit)
+				Math::Swap(tenter, texit);
+		}
+
+		if (tenter > tfirst) {
+			tfirst = tenter;
+
+			if (tfirst >= 0) {
+				bestaxis = axis;
+				bestradius = radius;
+			}
+		}
+
+		tlast = Math::Min(tlast, texit);
+
+		if (tfirst > tlast || tfirst > 1 || tlast < 0)
+			return false;
+
+		if (tfirst < 0) {
+			// already overlapping, prefer least penetration at the end of the step
+			float depth = radius - fabs(s + w);
+
+			if (depth < mindepth) {
+				mindepth = depth;
+
+				bestaxis = axis;
+				bestradius = radius;
+			}
+		}
+	}
+
+	// overlapping at start on every axis (minimum depth axis was stored)
+	tfirst = Math::Max(tfirst, 0.0f);
+
+	// orient towards body1 (on the side where they touch, fast bodies might have passed through)
+	Math::Vec3Mad(diff, start, rel_vel, tfirst);
+
+	if (Math::Vec3Dot(diff, bestaxis) < 0)
+		Math::Vec3Scale(bestaxis, bestaxis, -1);
+
+	// convert to current frame
+	Math::Vec3Add(diff, start, rel_vel);
+
+	contact.body1	= body1;
+	contact.body2	= body2;
+	contact.normal	= bestaxis;
+	contact.toi		= tfirst;
+	contact.depth	= bestradius - Math::Vec3Dot(diff, bestaxis);
+
+	// contact points: center of the supporting feature of each box
+	Math::Vec3Add(contact.pos1, box1->GetPosition(), center1);
+	Math::Vec3Add(contact.pos2, box2->GetPosition(), center2);
+
+	for (int j = 0; j < 3; ++j) {
+		float d1 = Math::Vec3Dot(axes1[j], bestaxis);
+		float d2 = Math::Vec3Dot(axes2[j], bestaxis);
+
+		if (fabs(d1) > 1e-3f)
+			Math::Vec3Mad(contact.pos1, contact.pos1, axes1[j], (d1 > 0 ? -half1[j] : half1[j]));
+
+		if (fabs(d2) > 1e-3f)
+			Math::Vec3Mad(contact.pos2, contact.pos2, axes2[j], (d2 > 0 ? half2[j] : -half2[j]));
+	}
+
+	out.contacts.push_back(contact);
+	return true;
+}
+
 bool PhysicsWorld::SphereSweepBox(CollisionData& out, RigidBody* body1, RigidBody* body2)
 {
 	RigidSphere*	sphere		= (RigidSphere*)body1;
@@ -339,15 +773,13 @@ bool PhysicsWorld::SphereSweepBox(CollisionData& out, RigidBody* body1, RigidBod
 	contact.body2 = body2;
 
 	// calculate relative velocity
-	Math::Vec3Subtract(v1, box->current.position, box->previous.position);
-	Math::Vec3Subtract(v2, sphere->current.position, sphere->previous.position);
+	Math::Vec3Subtract(v1, box->GetPosition(), box->GetPreviousPosition());
+	Math::Vec3Subtract(v2, sphere->GetPosition(), sphere->GetPreviousPosition());
 	Math::Vec3Subtract(rel_vel, v2, v1);
 
-	if (Math::Vec3Dot(rel_vel, rel_vel) < 1e-5f)
-		return false;
-
+	// NOTE: slow bodies are not advanced, but still tested at their previous position (resting contact)
 	// transform to box space
-	Math::Vec3TransformCoord(start, sphere->previous.position, box->worldinv);
+	Math::Vec3TransformCoord(start, sphere->GetPreviousPosition(), box->worldinv);
 	Math::Vec3TransformNormal(rel_vel, rel_vel, box->worldinv);
 
 	Math::Vec3Subtract(inner.Min, inner.Min, box->pivot);
@@ -430,18 +862,18 @@ bool PhysicsWorld::SphereSweepBox(CollisionData& out, RigidBody* body1, RigidBod
 		contact.toi = t;
 
 		// convert to current frame
-		t = Math::PlaneDotCoord(worldplane, sphere->current.position);
+		t = Math::PlaneDotCoord(worldplane, sphere->GetPosition());
 		contact.depth = sphere->GetRadius() - t;
 
 		contact.normal = (const Math::Vector3&)worldplane;
 
 		// contact on sphere
 		Math::Vec3Scale(contact.pos1, contact.normal, sphere->GetRadius());
-		Math::Vec3Subtract(contact.pos1, sphere->current.position, contact.pos1);
+		Math::Vec3Subtract(contact.pos1, sphere->GetPosition(), contact.pos1);
 
 		// contact on box
 		Math::Vec3Scale(contact.pos2, contact.normal, t);
-		Math::Vec3Subtract(contact.pos2, sphere->current.position, contact.pos2);
+		Math::Vec3Subtract(contact.pos2, sphere->GetPosition(), contact.pos2);
 
 		out.contacts.push_back(contact);
 		return true;
@@ -454,8 +886,8 @@ bool PhysicsWorld::BoxSweepSphere(CollisionData& out, RigidBody* body1, RigidBod
 {
 	bool collided = SphereSweepBox(out, body2, body1);
 
-	if (out.contacts.size() > 0) {
-		Contact& contact = out.contacts[0];
+	if (collided) {
+		Contact& contact = out.contacts.back();
 
 		Math::Vec3Scale(contact.normal, contact.normal, -1);
 		Math::Swap(contact.pos1, contact.pos2);
@@ -475,11 +907,293 @@ bool PhysicsWorld::Detect(CollisionData& out, RigidBody* body1, RigidBody* body2
 	return false;
 }
 
+void PhysicsWorld::DetectCollisions(CollisionData& out)
+{
+	PROFILE_SCOPE("PhysicsWorld::DetectCollisions");
+
+	UpdateBroadPhase();
+
+	if (broadphase == nullptr) {
+		for (size_t i = 0; i < bodies.size(); ++i) {
+			for (size_t j = i + 1; j < bodies.size(); ++j)
+				Detect(out, bodies[i], bodies[j]);
+		}
+
+		return;
+	}
+
+	pairs.clear();
+	broadphase->QueryPairs(pairs);
+
+	PROFILE_COUNTER("PhysicsWorld pairs", pairs.size());
+
+	for (size_t i = 0; i < pairs.size(); ++i)
+		Detect(out, bodies[pairs[i].proxy1], bodies[pairs[i].proxy2]);
+}
+
 void PhysicsWorld::DetectCollisions(CollisionData& out, RigidBody* body)
 {
-	for (size_t i = 0; i < bodies.size(); ++i) {
-		if (bodies[i] != body)
-			Detect(out, body, bodies[i]);
+	PROFILE_SCOPE("PhysicsWorld::DetectCollisions");
+
+	UpdateBroadPhase();
+
+	if (broadphase == nullptr) {
+		for (size_t i = 0; i < bodies.size(); ++i) {
+			if (bodies[i] != body)
+				Detect(out, body, bodies[i]);
+		}
+
+		return;
+	}
+
+	candidates.clear();
+	broadphase->Query(candidates, broadphase->GetBounds(body->index));
+
+	// NOTE: keep body order deterministic
+	std::sort(candidates.begin(), candidates.end());
+
+	for (size_t i = 0; i < candidates.size(); ++i) {
+		if (bodies[candidates[i]] != body)
+			Detect(out, body, bodies[candidates[i]]);
+	}
+}
+
+void PhysicsWorld::SetNumThreads(uint32_t numthreads)
+{
+	delete workers;
+	workers = nullptr;
+
+	if (numthreads != 1)
+		workers = new ThreadPool(numthreads);
+}
+
+int PhysicsWorld::FindIslandRoot(int body)
+{
+	while (islandids[body] != body) {
+		islandids[body] = islandids[islandids[body]];	// path halving
+		body = islandids[body];
+	}
+
+	return body;
+}
+
+void PhysicsWorld::BuildIslands(float dt)
+{
+	PROFILE_SCOPE("PhysicsWorld::BuildIslands");
+
+	ContactConstraint constraint;
+	Math::Vector3 relvel;
+	int numbodies = (int)bodies.size();
+
+	constraints.clear();
+	islands.clear();
+	islandids.resize(numbodies);
+
+	for (int i = 0; i < numbodies; ++i)
+		islandids[i] = i;
+
+	for (size_t i = 0; i < stepdata.contacts.size(); ++i) {
+		const Contact& contact = stepdata.contacts[i];
+
+		constraint.body1	= contact.body1->index;
+		constraint.body2	= contact.body2->index;
+		constraint.invmass1	= states.invmasses[constraint.body1];
+		constraint.invmass2	= states.invmasses[constraint.body2];
+
+		if (constraint.invmass1 + constraint.invmass2 == 0)
+			continue;
+
+		constraint.normal = contact.normal;
+		Math::GetOrthogonalVectors(constraint.tangent1, constraint.tangent2, constraint.normal);
+
+		// depth was measured at the predicted positions, convert it back to the start of the step
+		Math::Vec3Subtract(relvel, states.velocities[constraint.body1], states.velocities[constraint.body2]);
+
+		float vn = Math::Vec3Dot(relvel, constraint.normal);
+		float depth = contact.depth + vn * dt;
+
+		if (depth > PENETRATION_SLOP)
+			constraint.bias = BAUMGARTE_FACTOR * (depth - PENETRATION_SLOP) / dt;
+		else if (depth < 0)
+			constraint.bias = depth / dt;	// speculative: may still approach by the gap
+		else
+			constraint.bias = 0;
+
+		constraint.impulse		= 0;
+		constraint.friction1	= 0;
+		constraint.friction2	= 0;
+
+		constraints.push_back(constraint);
+
+		// static bodies don't connect islands
+		if (constraint.invmass1 > 0 && constraint.invmass2 > 0) {
+			int root1 = FindIslandRoot(constraint.body1);
+			int root2 = FindIslandRoot(constraint.body2);
+
+			// smaller index wins, so that islands are ordered the same way every run
+			if (root1 < root2)
+				islandids[root2] = root1;
+			else if (root2 < root1)
+				islandids[root1] = root2;
+		}
+	}
+
+	// counting sort of constraints by island root
+	std::vector<int> offsets(numbodies + 1, 0);
+	Island island;
+
+	for (size_t i = 0; i < constraints.size(); ++i) {
+		const ContactConstraint& c = constraints[i];
+		int root = FindIslandRoot(c.invmass1 > 0 ? c.body1 : c.body2);
+
+		++offsets[root + 1];
+	}
+
+	for (int i = 0; i < numbodies; ++i) {
+		if (offsets[i + 1] > 0) {
+			island.firstconstraint = offsets[i];
+			island.numconstraints = offsets[i + 1];
+
+			islands.push_back(island);
+		}
+
+		offsets[i + 1] += offsets[i];
+	}
+
+	islandconstraints.resize(constraints.size());
+
+	for (size_t i = 0; i < constraints.size(); ++i) {
+		const ContactConstraint& c = constraints[i];
+		int root = FindIslandRoot(c.invmass1 > 0 ? c.body1 : c.body2);
+
+		islandconstraints[offsets[root]++] = c;
+	}
+}
+
+void PhysicsWorld::SolveIsland(const Island& island)
+{
+	// sequential impulses (only linear motion, bodies don't rotate)
+	std::vector<Math::Vector3>& velocities = states.velocities;
+	Math::Vector3 relvel;
+
+	for (int iter = 0; iter < numiterations; ++iter) {
+		for (int i = 0; i < island.numconstraints; ++i) {
+			ContactConstraint& c = islandconstraints[island.firstconstraint + i];
+
+			float invmass = c.invmass1 + c.invmass2;
+			float oldimpulse, newimpulse, lambda;
+
+			// normal
+			Math::Vec3Subtract(relvel, velocities[c.body1], velocities[c.body2]);
+
+			lambda		= (c.bias - Math::Vec3Dot(relvel, c.normal)) / invmass;
+			oldimpulse	= c.impulse;
+			newimpulse	= Math::Max(oldimpulse + lambda, 0.0f);
+			lambda		= newimpulse - oldimpulse;
+			c.impulse	= newimpulse;
+
+			// NOTE: never write static bodies, they are shared between islands
+			if (c.invmass1 > 0)
+				Math::Vec3Mad(velocities[c.body1], velocities[c.body1], c.normal, lambda * c.invmass1);
+
+			if (c.invmass2 > 0)
+				Math::Vec3Mad(velocities[c.body2], velocities[c.body2], c.normal, -lambda * c.invmass2);
+
+			// friction
+			float maxfriction = friction * c.impulse;
+
+			for (int j = 0; j < 2; ++j) {
+				const Math::Vector3& tangent = (j == 0 ? c.tangent1 : c.tangent2);
+				float& accumulated = (j == 0 ? c.friction1 : c.friction2);
+
+				Math::Vec3Subtract(relvel, velocities[c.body1], velocities[c.body2]);
+
+				lambda		= -Math::Vec3Dot(relvel, tangent) / invmass;
+				oldimpulse	= accumulated;
+				newimpulse	= Math::Clamp(oldimpulse + lambda, -maxfriction, maxfriction);
+				lambda		= newimpulse - oldimpulse;
+				accumulated	= newimpulse;
+
+				if (c.invmass1 > 0)
+					Math::Vec3Mad(velocities[c.body1], velocities[c.body1], tangent, lambda * c.invmass1);
+
+				if (c.invmass2 > 0)
+					Math::Vec3Mad(velocities[c.body2], velocities[c.body2], tangent, -lambda * c.invmass2);
+			}
+		}
+	}
+}
+
+void PhysicsWorld::Step(float dt)
+{
+	PROFILE_SCOPE("PhysicsWorld::Step");
+
+	uint32_t numbodies = (uint32_t)bodies.size();
+
+	auto integrate = [&](uint32_t begin, uint32_t end, uint32_t) {
+		for (uint32_t i = begin; i < end; ++i) {
+			if (states.invmasses[i] == 0)
+				continue;
+
+			Math::Vector3& position = states.positions[i];
+			Math::Vector3& velocity = states.velocities[i];
+
+			states.prevpositions[i] = position;
+			Math::Vec3Mad(velocity, velocity, gravity, dt);
+
+			// predicted position (sweep detectors need it)
+			Math::Vec3Mad(position, position, velocity, dt);
+		}
+	};
+
+	auto finalize = [&](uint32_t begin, uint32_t end, uint32_t) {
+		for (uint32_t i = begin; i < end; ++i) {
+			if (states.invmasses[i] > 0) {
+				Math::Vec3Mad(states.positions[i], states.prevpositions[i], states.velocities[i], dt);
+
+				// box detectors expect the matrices at the start of the step
+				bodies[i]->UpdateMatrices();
+			}
+		}
+	};
+
+	auto solve = [&](uint32_t begin, uint32_t end, uint32_t) {
+		for (uint32_t i = begin; i < end; ++i)
+			SolveIsland(islands[i]);
+	};
+
+	// predict
+	if (workers != nullptr)
+		workers->ParallelFor(numbodies, 1024, integrate);
+	else
+		integrate(0, numbodies, 0);
+
+	for (uint32_t i = 0; i < numbodies; ++i) {
+		if (states.invmasses[i] > 0)
+			bodies[i]->Invalidate();
+	}
+
+	// detect
+	stepdata.contacts.clear();
+	DetectCollisions(stepdata);
+
+	// solve (islands are independent, so the result doesn't depend on the number of threads)
+	BuildIslands(dt);
+
+	if (workers != nullptr)
+		workers->ParallelFor((uint32_t)islands.size(), 1, solve);
+	else
+		solve(0, (uint32_t)islands.size(), 0);
+
+	// integrate with solved velocities
+	if (workers != nullptr)
+		workers->ParallelFor(numbodies, 1024, finalize);
+	else
+		finalize(0, numbodies, 0);
+
+	for (uint32_t i = 0; i < numbodies; ++i) {
+		if (states.invmasses[i] > 0)
+			bodies[i]->Invalidate();
 	}
 }
 
@@ -3,9 +3,11 @@
 #define _PHYSICSWORLD_H_
 
 #include <vector>
-#include "3Dmath.h"
+#include "broadphase.h"
 
 class RigidBody;
+class PhysicsWorld;
+class ThreadPool;
 
 enum RigidBodyType
 {
@@ -22,7 +24,7 @@ struct Contact
 	RigidBody*		body1;
 	RigidBody*		body2;
 	float			depth;
-	float			toi;	// time of impact
+	float			toi;	// time of impact (fraction of the step, use toi * dt with ResolvePenetration)
 };
 
 struct CollisionData
@@ -34,35 +36,32 @@ class RigidBody
 {
 	friend class PhysicsWorld;
 
-	struct Internal_State
-	{
-		Math::Quaternion orientation;
-		Math::Vector3 position;
-	};
-
 protected:
-	Internal_State	previous;
-	Internal_State	current;
-
-	Math::Matrix	prevworld;
-	Math::Matrix	prevworldinv;
-	Math::Matrix	world;
-	Math::Matrix	worldinv;
-
-	Math::Vector3	velocity;
-	Math::Vector3	pivot;
-
-	void*			userdata;
-	float			invmass;
-	RigidBodyType	type;
+	// NOTE: position, velocity and mass live in the world's state arrays
+	Math::Matrix		world;
+	Math::Matrix		worldinv;
+	Math::Quaternion	orientation;
+	Math::Vector3		pivot;
+
+	PhysicsWorld*		owner;
+	void*				userdata;
+	int					index;		// into state arrays and broad phase
+	RigidBodyType		type;
+	bool				dirty;		// broad phase bounds are outdated
 
 	RigidBody(RigidBodyType bodytype);
 
+	void Invalidate();
 	void UpdateMatrices();
 
+	inline Math::Vector3& Position();
+	inline Math::Vector3& PreviousPosition();
+	inline Math::Vector3& Velocity();
+
 public:
 	virtual ~RigidBody();
 
+	virtual void GetBounds(Math::AABox& out) const;
 	virtual void GetTransformWithSize(Math::Matrix& out);
 	virtual float RayIntersect(Math::Vector3& normal, const Math::Vector3& start, const Math::Vector3& dir);
 
@@ -83,9 +82,11 @@ public:
 	inline void SetUserData(void* data)						{ userdata = data; }
 	inline void* GetUserData()								{ return userdata; }
 
-	inline const Math::Vector3& GetVelocity() const			{ return velocity; }
-	inline const Math::Vector3& GetPosition() const			{ return current.position; }
-	inline const Math::Vector3& GetPreviousPosition() const	{ return previous.position; }
+	inline const Math::Vector3& GetVelocity() const;
+	inline const Math::Vector3& GetPosition() const;
+	inline const Math::Vector3& GetPreviousPosition() const;
+	inline float GetInverseMass() const;
+
 	inline const Math::Matrix& GetTransform() const			{ return world; }
 	inline const Math::Matrix& GetInverseTransform() const	{ return worldinv; }
 	inline RigidBodyType GetType() const					{ return type; }
@@ -97,14 +98,85 @@ class PhysicsWorld
 
 	typedef bool (PhysicsWorld::*DetectorFunc)(CollisionData&, RigidBody*, RigidBody*);
 
-private:
-	DetectorFunc	detectors[3][3];
-	BodyList		bodies;
+	friend class RigidBody;
+
+	// SoA body state
+	struct BodyStates
+	{
+		std::vector<Math::Vector3>	positions;
+		std::vector<Math::Vector3>	prevpositions;
+		std::vector<Math::Vector3>	velocities;
+		std::vector<float>			invmasses;
+	};
+
+	struct ContactConstraint
+	{
+		Math::Vector3	normal;		// points towards body1
+		Math::Vector3	tangent1;
+		Math::Vector3	tangent2;
+		int				body1;
+		int				body2;
+		float			invmass1;
+		float			invmass2;
+		float			bias;		// target normal velocity
+		float			impulse;	// accumulated
+		float			friction1;	// accumulated
+		float			friction2;	// accumulated
+	};
+
+	struct Island
+	{
+		int	firstconstraint;
+		int	numconstraints;
+	};
 
+	typedef std::vector<ContactConstraint> ConstraintList;
+	typedef std::vector<Island> IslandList;
+
+	struct RayCastContext
+	{
+		Math::Vector3	start;
+		Math::Vector3	dir;
+		Math::Vector3	normal;
+		PhysicsWorld*	world;
+		RigidBody*		bestbody;
+		float			bestt;
+	};
+
+private:
+	DetectorFunc			detectors[3][3];
+	BodyList				bodies;
+	BodyList				dirtybodies;
+	BroadPhase*				broadphase;
+	BroadPhase::ProxyList	candidates;
+	BroadPhase::PairList	pairs;
+
+	BodyStates				states;
+	CollisionData			stepdata;
+	ConstraintList			constraints;
+	ConstraintList			islandconstraints;	// sorted by island
+	IslandList				islands;
+	std::vector<int>		islandids;
+	ThreadPool*				workers;
+	Math::Vector3			gravity;
+	float					friction;
+	int						numiterations;
+
+	bool SphereSweepSphere(CollisionData& out, RigidBody* body1, RigidBody* body2);
 	bool SphereSweepBox(CollisionData& out, RigidBody* body1, RigidBody* body2);
 	bool BoxSweepSphere(CollisionData& out, RigidBody* body1, RigidBody* body2);
+	bool BoxSweepBox(CollisionData& out, RigidBody* body1, RigidBody* body2);
 	bool Detect(CollisionData& out, RigidBody* body1, RigidBody* body2);
 
+	RigidBody* AddBody(RigidBody* body);
+	int FindIslandRoot(int body);
+
+	void BuildIslands(float dt);
+	void SolveIsland(const Island& island);
+	void UpdateBroadPhase();
+
+	static float RayCastCallback(void* context, int proxy, float maxt);
+
 public:
 	static const float Immovable;
 
@@ -112,13 +184,55 @@ public:
 	~PhysicsWorld();
 
 	RigidBody* AddStaticBox(float width, float height, float depth);
+	RigidBody* AddDynamicBox(float width, float height, float depth, float mass);
 	RigidBody* AddDynamicSphere(float radius, float mass);
 	RigidBody* RayIntersect(const Math::Vector3& start, const Math::Vector3& dir);
 	RigidBody* RayIntersect(Math::Vector4& out, const Math::Vector3& start, const Math::Vector3& dir);
 
+	void DetectCollisions(CollisionData& out);
 	void DetectCollisions(CollisionData& out, RigidBody* body);
+	void SetBroadPhase(BroadPhaseType type, float cellsize = 1.0f);
+	void SetNumThreads(uint32_t numthreads);
+	void Step(float dt);
+
+	inline void SetGravity(const Math::Vector3& value)	{ gravity = value; }
+	inline void SetFriction(float value)				{ friction = value; }
+	inline void SetNumIterations(int value)				{ numiterations = value; }
+
+	inline const Math::Vector3& GetGravity() const		{ return gravity; }
+	inline size_t GetNumBodies() const					{ return bodies.size(); }
 
 	void DEBUG_Visualize(void (*callback)(RigidBodyType, const Math::Matrix&));
 };
 
+// --- RigidBody inline functions ---------------------------------------------
+
+inline Math::Vector3& RigidBody::Position() {
+	return owner->states.positions[index];
+}
+
+inline Math::Vector3& RigidBody::PreviousPosition() {
+	return owner->states.prevpositions[index];
+}
+
+inline Math::Vector3& RigidBody::Velocity() {
+	return owner->states.velocities[index];
+}
+
+inline const Math::Vector3& RigidBody::GetVelocity() const {
+	return owner->states.velocities[index];
+}
+
+inline const Math::Vector3& RigidBody::GetPosition() const {
+	return owner->states.positions[index];
+}
+
+inline const Math::Vector3& RigidBody::GetPreviousPosition() const {
+	return owner->states.prevpositions[index];
+}
+
+inline float RigidBody::GetInverseMass() const {
+	return owner->states.invmasses[index];
+}
+
 #endif
@@ -0,0 +1,201 @@
+
+#include "profiler.h"
+
+#ifdef ENABLE_PROFILER
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+typedef std::chrono::steady_clock ProfilerClock;
+
+struct ProfilerThreadBuffer
+{
+	ProfilerEvent			events[PROFILER_RING_SIZE];
+	std::atomic<uint64_t>	head;		// written by the owner thread
+	std::atomic<uint64_t>	tail;		// written by Collect
+	std::atomic<uint64_t>	dropped;
+	std::string				name;		// guarded by registrylock
+	uint32_t				id;
+
+	void Push(const ProfilerEvent& ev)
+	{
+		uint64_t pos = head.load(std::memory_order_relaxed);
+
+		if (pos - tail.load(std::memory_order_acquire) >= PROFILER_RING_SIZE) {
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		events[pos & (PROFILER_RING_SIZE - 1)] = ev;
+		head.store(pos + 1, std::memory_order_release);
+	}
+};
+
+// NOTE: buffers are never freed, threads might still write into them at exit
+static std::mutex							registrylock;
+static std::vector<ProfilerThreadBuffer*>	threadbuffers;
+static std::vector<ProfilerEvent>			collected;
+static const ProfilerClock::time_point		epoch = ProfilerClock::now();
+static thread_local ProfilerThreadBuffer*	localbuffer = nullptr;
+
+static ProfilerThreadBuffer* GetThreadBuffer()
+{
+	if (localbuffer == nullptr) {
+		ProfilerThreadBuffer* buffer = new ProfilerThreadBuffer();
+
+		buffer->head.store(0, std::memory_order_relaxed);
+		buffer->tail.store(0, std::memory_order_relaxed);
+		buffer->dropped.store(0, std::memory_order_relaxed);
+
+		std::lock_guard<std::mutex> guard(registrylock);
+
+		buffer->id = (uint32_t)threadbuffers.size() + 1;
+		threadbuffers.push_back(buffer);
+
+		localbuffer = buffer;
+	}
+
+	return localbuffer;
+}
+
+static void WriteEscaped(FILE* outfile, const char* str)
+{
+	for (; *str != 0; ++str) {
+		if (*str == '"' || *str == '\\')
+			fputc('\\', outfile);
+
+		fputc(*str, outfile);
+	}
+}
+
+// --- Profiler impl ----------------------------------------------------------
+
+uint64_t Profiler::Now()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(ProfilerClock::now() - epoch).count();
+}
+
+void Profiler::AddZone(const char* name, uint64_t start, uint64_t end)
+{
+	ProfilerEvent ev;
+
+	ev.name		= name;
+	ev.start	= start;
+	ev.end		= end;
+	ev.type		= ProfilerEventTypeZone;
+	ev.thread	= 0;
+
+	GetThreadBuffer()->Push(ev);
+}
+
+void Profiler::Counter(const char* name, double value)
+{
+	ProfilerEvent ev;
+
+	ev.name		= name;
+	ev.start	= Now();
+	ev.value	= value;
+	ev.type		= ProfilerEventTypeCounter;
+	ev.thread	= 0;
+
+	GetThreadBuffer()->Push(ev);
+}
+
+void Profiler::SetThreadName(const char* name)
+{
+	ProfilerThreadBuffer* buffer = GetThreadBuffer();
+	std::lock_guard<std::mutex> guard(registrylock);
+
+	buffer->name = name;
+}
+
+void Profiler::Collect()
+{
+	std::lock_guard<std::mutex> guard(registrylock);
+
+	for (ProfilerThreadBuffer* buffer : threadbuffers) {
+		uint64_t first = buffer->tail.load(std::memory_order_relaxed);
+		uint64_t last = buffer->head.load(std::memory_order_acquire);
+
+		for (uint64_t i = first; i < last; ++i) {
+			collected.push_back(buffer->events[i & (PROFILER_RING_SIZE - 1)]);
+			collected.back().thread = buffer->id;
+		}
+
+		buffer->tail.store(last, std::memory_order_release);
+	}
+}
+
+void Profiler::Clear()
+{
+	Collect();
+
+	std::lock_guard<std::mutex> guard(registrylock);
+	collected.clear();
+}
+
+bool Profiler::WriteChromeTrace(const char* file)
+{
+	Collect();
+
+	std::lock_guard<std::mutex> guard(registrylock);
+	FILE* outfile = fopen(file, "wb");
+	uint64_t dropped = 0;
+	bool first = true;
+
+	if (outfile == nullptr)
+		return false;
+
+	fprintf(outfile, "{\"traceEvents\":[\n");
+
+	for (ProfilerThreadBuffer* buffer : threadbuffers) {
+		dropped += buffer->dropped.load(std::memory_order_relaxed);
+
+		if (buffer->name.empty())
+			continue;
+
+		fprintf(outfile, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"", (first ? "" : ",\n"), buffer->id);
+		WriteEscaped(outfile, buffer->name.c_str());
+		fprintf(outfile, "\"}}");
+
+		first = false;
+	}
+
+	for (const ProfilerEvent& ev : collected) {
+		fprintf(outfile, "%s{\"name\":\"", (first ? "" : ",\n"));
+		WriteEscaped(outfile, ev.name);
+
+		// NOTE: timestamps are in microseconds
+		if (ev.type == ProfilerEventTypeZone) {
+			fprintf(outfile, "\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+				ev.thread, ev.start * 1e-3, (ev.end - ev.start) * 1e-3);
+		} else {
+			fprintf(outfile, "\",\"ph\":\"C\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"args\":{\"value\":%g}}",
+				ev.thread, ev.start * 1e-3, ev.value);
+		}
+
+		first = false;
+	}
+
+	fprintf(outfile, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_events\":%llu}}\n", (unsigned long long)dropped);
+	fclose(outfile);
+
+	return true;
+}
+
+uint64_t Profiler::GetNumDroppedEvents()
+{
+	std::lock_guard<std::mutex> guard(registrylock);
+	uint64_t dropped = 0;
+
+	for (ProfilerThreadBuffer* buffer : threadbuffers)
+		dropped += buffer->dropped.load(std::memory_order_relaxed);
+
+	return dropped;
+}
+
+#endif
@@ -0,0 +1,101 @@
+
+#ifndef _PROFILER_H_
+#define _PROFILER_H_
+
+// NOTE: define ENABLE_PROFILER (project wide) to turn on instrumentation, otherwise the macros below compile to nothing
+// (OpenGL samples: msbuild /p:EnableProfiler=true, see Common_GL.props; Linux: CXXFLAGS=-DENABLE_PROFILER).
+// Both the Win32 and the headless loop write a Chrome trace to PROFILER_TRACE after Run (if set).
+
+#ifdef ENABLE_PROFILER
+
+#include <cstdint>
+
+#define PROFILER_RING_SIZE	16384	// events per thread (power of 2)
+
+#define PROFILE_CONCAT_(a, b)			a##b
+#define PROFILE_CONCAT(a, b)			PROFILE_CONCAT_(a, b)
+
+#define PROFILE_SCOPE(name)				ProfilerZone PROFILE_CONCAT(_profilerzone, __LINE__)(name)
+#define PROFILE_COUNTER(name, value)	Profiler::Counter(name, (double)(value))
+#define PROFILE_THREAD_NAME(name)		Profiler::SetThreadName(name)
+#define PROFILE_COLLECT()				Profiler::Collect()
+#define PROFILE_WRITE_TRACE(file)		Profiler::WriteChromeTrace(file)
+
+enum ProfilerEventType
+{
+	ProfilerEventTypeZone = 0,
+	ProfilerEventTypeCounter
+};
+
+struct ProfilerEvent
+{
+	const char*	name;		// must stay alive until exported (use literals)
+	uint64_t	start;		// in nanoseconds since the first event
+	union {
+		uint64_t	end;
+		double		value;
+	};
+	uint32_t	type;
+	uint32_t	thread;		// set when collected
+};
+
+/**
+ * \brief Collects timed zones and counters from any thread
+ *
+ * Every thread writes into its own ring buffer (no locks, no allocation after the
+ * first event), events that don't fit are dropped. Collect moves the rings into
+ * one list (call it regularly, e.g. once per frame), WriteChromeTrace exports that
+ * list in the Chrome trace format (chrome://tracing, ui.perfetto.dev).
+ */
+class Profiler
+{
+public:
+	static uint64_t Now();
+
+	static void AddZone(const char* name, uint64_t start, uint64_t end);
+	static void Counter(const char* name, double value);
+	static void SetThreadName(const char* name);
+
+	static void Collect();
+	static void Clear();
+	static bool WriteChromeTrace(const char* file);
+
+	static uint64_t GetNumDroppedEvents();
+};
+
+/**
+ * \brief RAII zone, records one event when it goes out of scope
+ */
+class ProfilerZone
+{
+private:
+	const char*	name;
+	uint64_t	start;
+
+public:
+	ProfilerZone(const char* zonename)
+	{
+		name = zonename;
+		start = Profiler::Now();
+	}
+
+	~ProfilerZone()
+	{
+		Profiler::AddZone(name, start, Profiler::Now());
+	}
+
+	ProfilerZone(const ProfilerZone&) = delete;
+	ProfilerZone& operator =(const ProfilerZone&) = delete;
+};
+
+#else
+
+#define PROFILE_SCOPE(name)
+#define PROFILE_COUNTER(name, value)
+#define PROFILE_THREAD_NAME(name)
+#define PROFILE_COLLECT()
+#define PROFILE_WRITE_TRACE(file)
+
+#endif
+
+#endif
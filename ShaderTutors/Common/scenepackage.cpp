@@ -0,0 +1,595 @@
+
+#include <algorithm>
+#include <cstring>
+
+#include "scenepackage.h"
+#include "profiler.h"
+
+#ifdef _WIN32
+#	include <Windows.h>
+#else
+#	include <fcntl.h>
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#	include <unistd.h>
+#endif
+
+static bool ReadString(FILE* infile, std::string& out)
+{
+	// NOTE: strings in .qm files end with a newline
+	int ch = fgetc(infile);
+
+	out.clear();
+
+	while (ch != '\n' && ch != EOF) {
+		out.push_back((char)ch);
+		ch = fgetc(infile);
+	}
+
+	return (ch != EOF);
+}
+
+static inline uint64_t AlignOffset(uint64_t offset)
+{
+	return (offset + SCENEPACKAGE_ALIGNMENT - 1) & ~((uint64_t)SCENEPACKAGE_ALIGNMENT - 1);
+}
+
+// --- SceneDescription impl --------------------------------------------------
+
+SceneDescription::SceneDescription()
+{
+	camera.eye = Math::Vector3(0, 0, 0);
+	camera.orient = Math::Vector3(0, 0, 0);
+	camera.fov = Math::HALF_PI;
+	camera.reserved = 0;
+}
+
+bool SceneDescription::LoadQM(const char* file)
+{
+	PROFILE_SCOPE("SceneDescription::LoadQM");
+
+	static const uint16_t elemsizes[6] = { 1, 2, 3, 4, 4, 4 };
+	static const uint16_t elemstrides[6] = { 4, 4, 4, 4, 1, 1 };
+
+	FILE* infile = nullptr;
+
+#ifdef _MSC_VER
+	fopen_s(&infile, file, "rb");
+#else
+	infile = fopen(file, "rb");
+#endif
+
+	if (!infile)
+		return false;
+
+	std::vector<uint8_t> vertexdata;
+	std::string buff;
+	uint32_t unused;
+	uint32_t version;
+	uint32_t numindices;
+	uint32_t istride;
+	uint32_t numsubsets;
+	uint32_t numvertices;
+	uint32_t numelems;
+	uint32_t vstride = 0;
+	int32_t posoffset = -1;
+	int32_t normoffset = -1;
+	int32_t texoffset = -1;
+	bool success = false;
+
+	vertices.clear();
+	indices.clear();
+	subsets.clear();
+
+	fread(&unused, 4, 1, infile);
+	fread(&numindices, 4, 1, infile);
+	fread(&istride, 4, 1, infile);
+	fread(&numsubsets, 4, 1, infile);
+	fread(&numvertices, 4, 1, infile);
+
+	version = unused >> 16;
+
+	fread(&unused, 4, 1, infile);
+	fread(&unused, 4, 1, infile);
+	fread(&unused, 4, 1, infile);
+
+	if (fread(&numelems, 4, 1, infile) != 1)
+		goto _fail;
+
+	// vertex declaration
+	for (uint32_t i = 0; i < numelems; ++i) {
+		uint16_t stream;
+		uint8_t usage, type, usageindex;
+
+		fread(&stream, 2, 1, infile);
+		fread(&usage, 1, 1, infile);
+		fread(&type, 1, 1, infile);
+
+		if (fread(&usageindex, 1, 1, infile) != 1 || type > 5)
+			goto _fail;
+
+		if (usage == 0 && posoffset == -1)
+			posoffset = (int32_t)vstride;
+		else if (usage == 5 && normoffset == -1)
+			normoffset = (int32_t)vstride;
+		else if (usage == 6 && usageindex == 0 && texoffset == -1)
+			texoffset = (int32_t)vstride;
+
+		vstride += elemsizes[type] * elemstrides[type];
+	}
+
+	if (posoffset == -1 || numvertices == 0 || numindices < 3 || (istride != 2 && istride != 4))
+		goto _fail;
+
+	vertexdata.resize((size_t)numvertices * vstride);
+
+	if (fread(vertexdata.data(), vstride, numvertices, infile) != numvertices)
+		goto _fail;
+
+	vertices.resize(numvertices);
+
+	for (uint32_t i = 0; i < numvertices; ++i) {
+		GeometryUtils::CommonVertex& vert = vertices[i];
+		const uint8_t* src = vertexdata.data() + (size_t)i * vstride;
+
+		memcpy(&vert.x, src + posoffset, 12);
+
+		if (normoffset != -1)
+			memcpy(&vert.nx, src + normoffset, 12);
+		else
+			vert.nx = vert.ny = vert.nz = 0;
+
+		if (texoffset != -1)
+			memcpy(&vert.u, src + texoffset, 8);
+		else
+			vert.u = vert.v = 0;
+	}
+
+	indices.resize(numindices);
+
+	if (istride == 2) {
+		std::vector<uint16_t> shortindices(numindices);
+
+		if (fread(shortindices.data(), 2, numindices, infile) != numindices)
+			goto _fail;
+
+		std::copy(shortindices.begin(), shortindices.end(), indices.begin());
+	} else if (fread(indices.data(), 4, numindices, infile) != numindices) {
+		goto _fail;
+	}
+
+	for (uint32_t i = 0; i < numindices; ++i) {
+		if (indices[i] >= numvertices)
+			goto _fail;
+	}
+
+	if (version >= 1) {
+		// NOTE: only the first LOD is traced (see MeshSimplifier::GenerateQMLODs)
+		fread(&unused, 4, 1, infile);
+
+		if (unused > 0)
+			fseek(infile, 8 * unused, SEEK_CUR);
+	}
+
+	// attribute table (same order as GLCreateMeshFromQM)
+	subsets.resize(numsubsets);
+
+	for (uint32_t i = 0; i < numsubsets; ++i) {
+		ScenePackageSubset& subset = subsets[i];
+		float bounds[6];
+
+		fread(&subset.IndexStart, 4, 1, infile);
+		fread(&subset.VertexStart, 4, 1, infile);
+		fread(&subset.VertexCount, 4, 1, infile);
+		fread(&subset.IndexCount, 4, 1, infile);
+		fread(bounds, 4, 6, infile);
+
+		ReadString(infile, buff);
+		ReadString(infile, buff);
+
+		bool hasmaterial = !(buff.size() > 1 && buff[1] == ',');
+
+		if (hasmaterial) {
+			uint8_t colors[5 * 16];
+
+			fread(colors, 16, (version >= 2 ? 5 : 4), infile);
+			fread(colors, 4, 3, infile);	// power, alpha, unused
+
+			for (int j = 0; j < 8; ++j)
+				ReadString(infile, buff);
+		}
+
+		for (int j = 0; j < 8; ++j)
+			ReadString(infile, buff);
+
+		if (subset.IndexStart + subset.IndexCount > numindices)
+			goto _fail;
+	}
+
+	success = true;
+
+_fail:
+	fclose(infile);
+	return success;
+}
+
+bool SceneDescription::LoadInfo(const char* file)
+{
+	PROFILE_SCOPE("SceneDescription::LoadInfo");
+
+	FILE* infile = nullptr;
+
+#ifdef _MSC_VER
+	fopen_s(&infile, file, "rb");
+#else
+	infile = fopen(file, "rb");
+#endif
+
+	if (!infile)
+		return false;
+
+	std::vector<char> buff;
+	uint32_t numenvmaps = 0;
+	uint32_t numlights = 0;
+	uint32_t numtextures = 0;
+	uint32_t nummaterials = 0;
+	uint32_t numoverrides = 0;
+	uint32_t length = 0;
+	bool success = false;
+
+	lights.clear();
+	materials.clear();
+	texturenames.clear();
+	overrides.clear();
+
+	fread(&numenvmaps, 4, 1, infile);
+	fread(&numlights, 4, 1, infile);
+	fread(&numtextures, 4, 1, infile);
+	fread(&nummaterials, 4, 1, infile);
+
+	if (fread(&numoverrides, 4, 1, infile) != 1)
+		goto _fail;
+
+	lights.resize(numlights);
+
+	if (fread(lights.data(), sizeof(AreaLight), numlights, infile) != numlights)
+		goto _fail;
+
+	for (uint32_t i = 0; i < numtextures; ++i) {
+		// NOTE: length includes the terminating zero
+		if (fread(&length, 4, 1, infile) != 1)
+			goto _fail;
+
+		buff.assign(length + 1, 0);
+
+		fread(buff.data(), 1, length, infile);
+		texturenames.push_back(buff.data());
+	}
+
+	materials.resize(nummaterials);
+
+	if (fread(materials.data(), sizeof(BSDFInfo), nummaterials, infile) != nummaterials)
+		goto _fail;
+
+	fread(&camera.fov, 4, 1, infile);
+	fread(&camera.eye, 4, 3, infile);
+	fread(&camera.orient, 4, 3, infile);
+
+	overrides.resize(numoverrides);
+
+	if (fread(overrides.data(), 4, numoverrides, infile) != numoverrides)
+		goto _fail;
+
+	success = true;
+
+_fail:
+	fclose(infile);
+	return success;
+}
+
+bool SceneDescription::LoadBVHCache(const char* file)
+{
+	PROFILE_SCOPE("SceneDescription::LoadBVHCache");
+
+	FILE* infile = nullptr;
+
+#ifdef _MSC_VER
+	fopen_s(&infile, file, "rb");
+#else
+	infile = fopen(file, "rb");
+#endif
+
+	bvhnodes.clear();
+	bvhtriangles.clear();
+
+	if (!infile)
+		return false;
+
+	// NOTE: see OpenGLBVH::Build
+	uint32_t totalnodes = 0;
+	uint32_t numtriangleIDs = 0;
+	int32_t unused[2];
+	bool success = false;
+
+	fread(&totalnodes, 4, 1, infile);
+	fread(&numtriangleIDs, 4, 1, infile);
+
+	if (fread(unused, 4, 2, infile) != 2)
+		goto _fail;
+
+	bvhnodes.resize(totalnodes);
+	bvhtriangles.resize((size_t)numtriangleIDs * 2);
+
+	if (fread(bvhnodes.data(), sizeof(ScenePackageBVHNode), totalnodes, infile) != totalnodes)
+		goto _fail;
+
+	if (fread(bvhtriangles.data(), 8, numtriangleIDs, infile) != numtriangleIDs)
+		goto _fail;
+
+	success = true;
+
+_fail:
+	if (!success) {
+		bvhnodes.clear();
+		bvhtriangles.clear();
+	}
+
+	fclose(infile);
+	return success;
+}
+
+// --- ScenePackageWriter impl ------------------------------------------------
+
+void ScenePackageWriter::AddSection(ScenePackageSectionType type, const void* data, uint32_t count, uint32_t stride)
+{
+	PendingSection section;
+
+	section.desc.type		= type;
+	section.desc.count		= count;
+	section.desc.stride		= stride;
+	section.desc.reserved	= 0;
+	section.desc.offset		= 0;
+	section.desc.size		= (uint64_t)count * stride;
+	section.data			= data;
+
+	sections.push_back(section);
+}
+
+void ScenePackageWriter::AddScene(const SceneDescription& scene)
+{
+	AddSection(ScenePackageSectionVertices, scene.vertices.data(), (uint32_t)scene.vertices.size(), sizeof(GeometryUtils::CommonVertex));
+	AddSection(ScenePackageSectionIndices, scene.indices.data(), (uint32_t)scene.indices.size(), sizeof(uint32_t));
+	AddSection(ScenePackageSectionSubsets, scene.subsets.data(), (uint32_t)scene.subsets.size(), sizeof(ScenePackageSubset));
+	AddSection(ScenePackageSectionMaterialOverrides, scene.overrides.data(), (uint32_t)scene.overrides.size(), sizeof(uint32_t));
+	AddSection(ScenePackageSectionMaterials, scene.materials.data(), (uint32_t)scene.materials.size(), sizeof(BSDFInfo));
+	AddSection(ScenePackageSectionLights, scene.lights.data(), (uint32_t)scene.lights.size(), sizeof(AreaLight));
+	AddSection(ScenePackageSectionCamera, &scene.camera, 1, sizeof(ScenePackageCamera));
+
+	if (!scene.bvhnodes.empty()) {
+		AddSection(ScenePackageSectionBVHNodes, scene.bvhnodes.data(), (uint32_t)scene.bvhnodes.size(), sizeof(ScenePackageBVHNode));
+		AddSection(ScenePackageSectionBVHTriangles, scene.bvhtriangles.data(), (uint32_t)(scene.bvhtriangles.size() / 2), 8);
+	}
+}
+
+void ScenePackageWriter::Clear()
+{
+	sections.clear();
+}
+
+bool ScenePackageWriter::Write(const char* file) const
+{
+	PROFILE_SCOPE("ScenePackageWriter::Write");
+
+	if (sections.empty() || sections.size() > SCENEPACKAGE_MAX_SECTIONS)
+		return false;
+
+	std::vector<ScenePackageSection> toc(sections.size());
+	ScenePackageHeader header;
+	uint64_t offset = sizeof(ScenePackageHeader) + sections.size() * sizeof(ScenePackageSection);
+
+	for (size_t i = 0; i < sections.size(); ++i) {
+		offset = AlignOffset(offset);
+
+		toc[i] = sections[i].desc;
+		toc[i].offset = offset;
+
+		offset += toc[i].size;
+	}
+
+	header.magic		= SCENEPACKAGE_MAGIC;
+	header.version		= SCENEPACKAGE_VERSION;
+	header.numsections	= (uint32_t)sections.size();
+	header.reserved		= 0;
+	header.filesize		= AlignOffset(offset);
+	header.reserved2	= 0;
+
+	FILE* outfile = nullptr;
+
+#ifdef _MSC_VER
+	fopen_s(&outfile, file, "wb");
+#else
+	outfile = fopen(file, "wb");
+#endif
+
+	if (!outfile)
+		return false;
+
+	const uint8_t zeros[SCENEPACKAGE_ALIGNMENT] = {};
+	uint64_t written = 0;
+	bool success = true;
+
+	auto writeBytes = [&](const void* data, uint64_t count) {
+		if (count > 0 && fwrite(data, 1, (size_t)count, outfile) != count)
+			success = false;
+
+		written += count;
+	};
+
+	writeBytes(&header, sizeof(ScenePackageHeader));
+	writeBytes(toc.data(), toc.size() * sizeof(ScenePackageSection));
+
+	for (size_t i = 0; i < sections.size(); ++i) {
+		writeBytes(zeros, toc[i].offset - written);
+		writeBytes(sections[i].data, toc[i].size);
+	}
+
+	writeBytes(zeros, header.filesize - written);
+
+	fclose(outfile);
+	return success;
+}
+
+// --- ScenePackage impl ------------------------------------------------------
+
+ScenePackage::ScenePackage()
+{
+	data			= nullptr;
+	sections		= nullptr;
+	size			= 0;
+	numsections		= 0;
+
+#ifdef _WIN32
+	filehandle		= INVALID_HANDLE_VALUE;
+	mappinghandle	= nullptr;
+#else
+	filehandle		= -1;
+#endif
+}
+
+ScenePackage::~ScenePackage()
+{
+	Close();
+}
+
+bool ScenePackage::Open(const char* file)
+{
+	PROFILE_SCOPE("ScenePackage::Open");
+
+	Close();
+
+#ifdef _WIN32
+	LARGE_INTEGER filesize;
+
+	filehandle = CreateFileA(file, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL|FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+	if (filehandle == INVALID_HANDLE_VALUE)
+		return false;
+
+	if (!GetFileSizeEx(filehandle, &filesize) || filesize.QuadPart < (LONGLONG)sizeof(ScenePackageHeader)) {
+		Close();
+		return false;
+	}
+
+	mappinghandle = CreateFileMappingA(filehandle, NULL, PAGE_READONLY, 0, 0, NULL);
+
+	if (mappinghandle == nullptr) {
+		Close();
+		return false;
+	}
+
+	data = (const uint8_t*)MapViewOfFile(mappinghandle, FILE_MAP_READ, 0, 0, 0);
+	size = (uint64_t)filesize.QuadPart;
+#else
+	struct stat filestat;
+
+	filehandle = open(file, O_RDONLY);
+
+	if (filehandle == -1)
+		return false;
+
+	if (fstat(filehandle, &filestat) != 0 || filestat.st_size < (off_t)sizeof(ScenePackageHeader)) {
+		Close();
+		return false;
+	}
+
+	void* mapping = mmap(nullptr, (size_t)filestat.st_size, PROT_READ, MAP_PRIVATE, filehandle, 0);
+
+	data = ((mapping == MAP_FAILED) ? nullptr : (const uint8_t*)mapping);
+	size = (uint64_t)filestat.st_size;
+#endif
+
+	if (data == nullptr) {
+		Close();
+		return false;
+	}
+
+	// validate
+	const ScenePackageHeader* header = (const ScenePackageHeader*)data;
+	bool valid = (header->magic == SCENEPACKAGE_MAGIC && header->version == SCENEPACKAGE_VERSION);
+
+	valid = valid && (header->filesize == size && header->numsections <= SCENEPACKAGE_MAX_SECTIONS);
+	valid = valid && (sizeof(ScenePackageHeader) + header->numsections * sizeof(ScenePackageSection) <= size);
+
+	if (valid) {
+		sections = (const ScenePackageSection*)(data + sizeof(ScenePackageHeader));
+		numsections = header->numsections;
+
+		for (uint32_t i = 0; i < numsections && valid; ++i) {
+			const ScenePackageSection& section = sections[i];
+
+			valid = (section.offset % SCENEPACKAGE_ALIGNMENT == 0);
+			valid = valid && (section.size == (uint64_t)section.count * section.stride);
+			valid = valid && (section.offset <= size && section.size <= size - section.offset);
+		}
+	}
+
+	if (!valid) {
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+void ScenePackage::Close()
+{
+#ifdef _WIN32
+	if (data != nullptr)
+		UnmapViewOfFile(data);
+
+	if (mappinghandle != nullptr)
+		CloseHandle(mappinghandle);
+
+	if (filehandle != INVALID_HANDLE_VALUE)
+		CloseHandle(filehandle);
+
+	filehandle = INVALID_HANDLE_VALUE;
+	mappinghandle = nullptr;
+#else
+	if (data != nullptr)
+		munmap((void*)data, (size_t)size);
+
+	if (filehandle != -1)
+		close(filehandle);
+
+	filehandle = -1;
+#endif
+
+	data = nullptr;
+	sections = nullptr;
+	size = 0;
+	numsections = 0;
+}
+
+const void* ScenePackage::GetSection(ScenePackageSectionType type, uint32_t* count, uint32_t stride) const
+{
+	if (count != nullptr)
+		*count = 0;
+
+	for (uint32_t i = 0; i < numsections; ++i) {
+		const ScenePackageSection& section = sections[i];
+
+		if (section.type != (uint32_t)type)
+			continue;
+
+		if (stride != 0 && section.stride != stride)
+			return nullptr;
+
+		if (count != nullptr)
+			*count = section.count;
+
+		return (data + section.offset);
+	}
+
+	return nullptr;
+}
@@ -0,0 +1,214 @@
+
+#ifndef _SCENEPACKAGE_H_
+#define _SCENEPACKAGE_H_
+
+#include <string>
+#include <vector>
+
+#include "3Dmath.h"
+#include "geometryutils.h"
+
+#define SCENEPACKAGE_MAGIC			0x4e435351	// "QSCN"
+#define SCENEPACKAGE_VERSION		1
+#define SCENEPACKAGE_ALIGNMENT		64			// of every section (from the start of the file)
+#define SCENEPACKAGE_MAX_SECTIONS	64
+
+// NOTE: the scene structures below are shared with the GLSL path tracers of sample 57 (and the .info files)
+
+enum BSDFType
+{
+	BSDFTypeDiffuse = 0,
+	BSDFTypeSpecular = 1,		// Dirac delta (when roughness < 0.1)
+	BSDFTypeInsulator = 2,
+	BSDFTypeConductor = 4,		// metals
+	BSDFTypeDielectric = 8,		// glass, diamond, etc.
+	BSDFTypeTransparent = 16	// alpha-blended diffuse
+};
+
+enum ShapeType
+{
+	ShapeTypePlate = 2,
+	ShapeTypeSphere = 4
+};
+
+struct BSDFInfo
+{
+	Math::Color	color;
+	uint32_t	textureID;
+	uint32_t	bsdftype;
+	uint32_t	roughness;	// float bits
+	uint32_t	eta;		// float bits
+};
+
+struct AreaLight
+{
+	Math::Matrix	tounit;
+	Math::Matrix	toworld;
+	Math::Vector3	luminance;
+	uint32_t		shapetype;
+};
+
+static_assert(sizeof(BSDFInfo) == 32, "sizeof(BSDFInfo) must be 32 B");
+static_assert(sizeof(AreaLight) == 144, "sizeof(AreaLight) must be 144 B");
+
+enum ScenePackageSectionType
+{
+	ScenePackageSectionVertices = 0,		// GeometryUtils::CommonVertex
+	ScenePackageSectionIndices,				// uint32_t
+	ScenePackageSectionSubsets,				// ScenePackageSubset (attribute table)
+	ScenePackageSectionMaterialOverrides,	// uint32_t, subset -> material
+	ScenePackageSectionMaterials,			// BSDFInfo
+	ScenePackageSectionLights,				// AreaLight
+	ScenePackageSectionCamera,				// ScenePackageCamera
+	ScenePackageSectionTextureInfo,			// ScenePackageTextureArray
+	ScenePackageSectionTexels,				// RGBA8 layers of the texture array (rows from v = 0)
+	ScenePackageSectionBVHNodes,			// ScenePackageBVHNode
+	ScenePackageSectionBVHTriangles,		// (first index, material) pairs
+	ScenePackageSectionCount
+};
+
+struct ScenePackageHeader
+{
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	numsections;	// the table of contents follows the header
+	uint32_t	reserved;
+	uint64_t	filesize;
+	uint64_t	reserved2;
+};
+
+struct ScenePackageSection
+{
+	uint32_t	type;
+	uint32_t	count;			// number of elements
+	uint32_t	stride;			// size of one element
+	uint32_t	reserved;
+	uint64_t	offset;			// from the start of the file
+	uint64_t	size;			// count * stride
+};
+
+struct ScenePackageSubset
+{
+	uint32_t	IndexStart;
+	uint32_t	IndexCount;
+	uint32_t	VertexStart;
+	uint32_t	VertexCount;
+};
+
+struct ScenePackageCamera
+{
+	Math::Vector3	eye;
+	Math::Vector3	orient;		// yaw, pitch, roll
+	float			fov;
+	uint32_t		reserved;
+};
+
+struct ScenePackageTextureArray
+{
+	uint32_t	width;
+	uint32_t	height;
+	uint32_t	numlayers;
+	uint32_t	srgb;
+};
+
+struct ScenePackageBVHNode
+{
+	Math::Vector3	min;
+	uint32_t		leftorcount;
+	Math::Vector3	max;
+	uint32_t		rightorstart;
+};
+
+static_assert(sizeof(ScenePackageHeader) == 32, "sizeof(ScenePackageHeader) must be 32 B");
+static_assert(sizeof(ScenePackageSection) == 32, "sizeof(ScenePackageSection) must be 32 B");
+static_assert(sizeof(ScenePackageCamera) == 32, "sizeof(ScenePackageCamera) must be 32 B");
+static_assert(sizeof(ScenePackageBVHNode) == 32, "sizeof(ScenePackageBVHNode) must be 32 B");
+
+/**
+ * \brief The source files of a sample 57 scene (.qm + .info + BVH cache), parsed on the CPU
+ */
+struct SceneDescription
+{
+	std::vector<GeometryUtils::CommonVertex>	vertices;
+	std::vector<uint32_t>						indices;
+	std::vector<ScenePackageSubset>				subsets;
+	std::vector<uint32_t>						overrides;
+	std::vector<BSDFInfo>						materials;
+	std::vector<AreaLight>						lights;
+	std::vector<std::string>					texturenames;	// relative to the .info file
+	std::vector<ScenePackageBVHNode>			bvhnodes;
+	std::vector<uint32_t>						bvhtriangles;	// pairs
+	ScenePackageCamera							camera;
+
+	SceneDescription();
+
+	bool LoadQM(const char* file);
+	bool LoadInfo(const char* file);
+	bool LoadBVHCache(const char* file);
+};
+
+/**
+ * \brief Writes a scene package
+ *
+ * The sections are only referenced until Write, which lays them out after the table
+ * of contents, each on a SCENEPACKAGE_ALIGNMENT boundary.
+ */
+class ScenePackageWriter
+{
+	struct PendingSection
+	{
+		ScenePackageSection	desc;
+		const void*			data;
+	};
+
+private:
+	std::vector<PendingSection> sections;
+
+public:
+	void AddSection(ScenePackageSectionType type, const void* data, uint32_t count, uint32_t stride);
+	void AddScene(const SceneDescription& scene);	// everything but the textures
+	void Clear();
+
+	bool Write(const char* file) const;
+};
+
+/**
+ * \brief Memory-mapped scene package (read-only)
+ *
+ * Open validates the header and the table of contents, after that the sections can
+ * be used in place (e.g. uploaded to the GPU or read by the CPU path tracer) until Close.
+ */
+class ScenePackage
+{
+private:
+	const uint8_t*				data;
+	const ScenePackageSection*	sections;
+	uint64_t					size;
+	uint32_t					numsections;
+
+#ifdef _WIN32
+	void*						filehandle;
+	void*						mappinghandle;
+#else
+	int							filehandle;
+#endif
+
+public:
+	ScenePackage();
+	~ScenePackage();
+
+	bool Open(const char* file);
+	void Close();
+
+	const void* GetSection(ScenePackageSectionType type, uint32_t* count = nullptr, uint32_t stride = 0) const;	// nullptr if missing (or the stride is different)
+
+	template <typename T>
+	inline const T* GetSection(ScenePackageSectionType type, uint32_t* count = nullptr) const {
+		return (const T*)GetSection(type, count, sizeof(T));
+	}
+
+	inline bool IsOpen() const			{ return (data != nullptr); }
+	inline uint64_t GetSize() const		{ return size; }
+};
+
+#endif
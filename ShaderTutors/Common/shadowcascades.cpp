@@ -0,0 +1,459 @@
+
+#include <cmath>
+#include <cfloat>
+#include <xmmintrin.h>
+
+#include "shadowcascades.h"
+
+#define LISPSM_MIN_SINGAMMA		1e-2f	// below this the warp degenerates
+
+static __m128 PlaneDistance(const Math::Vector4& p, __m128 x, __m128 y, __m128 z)
+{
+	return _mm_add_ps(
+		_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(p.x)), _mm_mul_ps(y, _mm_set1_ps(p.y))),
+		_mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(p.z)), _mm_set1_ps(p.w)));
+}
+
+static __m128 Select(__m128 mask, __m128 a, __m128 b)
+{
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static void BoxCorners(Math::Vector3 (&out)[8], const Math::AABox& box)
+{
+	for (int i = 0; i < 8; ++i) {
+		out[i].x = ((i & 1) ? box.Max.x : box.Min.x);
+		out[i].y = ((i & 2) ? box.Max.y : box.Min.y);
+		out[i].z = ((i & 4) ? box.Max.z : box.Min.z);
+	}
+}
+
+static void BoxEdges(Math::Vector3 (&out)[12][2], const Math::Vector3 (&corners)[8])
+{
+	// corners of an edge differ in one bit (works for frustums too)
+	int count = 0;
+
+	for (int i = 0; i < 8; ++i) {
+		for (int bit = 1; bit < 8; bit <<= 1) {
+			if (!(i & bit)) {
+				out[count][0] = corners[i];
+				out[count][1] = corners[i|bit];
+
+				++count;
+			}
+		}
+	}
+}
+
+ShadowCascades::ShadowCascades(uint32_t numcascades, float lambda)
+{
+	SetSplitScheme(numcascades, lambda);
+
+	for (uint32_t i = 0; i < MAX_SHADOW_CASCADES; ++i) {
+		bodies[i].count = 0;
+		splits[i] = Math::Vector2(0, 0);
+	}
+
+	scenebody.count = 0;
+}
+
+void ShadowCascades::SetSplitScheme(uint32_t numcascades, float lambda)
+{
+	this->numcascades	= Math::Min<uint32_t>(Math::Max<uint32_t>(numcascades, 1), MAX_SHADOW_CASCADES);
+	this->lambda		= lambda;
+}
+
+void ShadowCascades::ClipSegments(CascadeBody& body, const Math::Vector3 (&segments)[12][2], const Math::Vector4 (&planes)[6]) const
+{
+	// NOTE: parametric clipping (Cyrus-Beck), 4 segments at once
+	__m128 zero = _mm_setzero_ps();
+	float tmins[4], tmaxs[4];
+
+	for (int i = 0; i < 12; i += 4) {
+		const Math::Vector3 (*batch)[2] = segments + i;
+
+		__m128 sx = _mm_setr_ps(batch[0][0].x, batch[1][0].x, batch[2][0].x, batch[3][0].x);
+		__m128 sy = _mm_setr_ps(batch[0][0].y, batch[1][0].y, batch[2][0].y, batch[3][0].y);
+		__m128 sz = _mm_setr_ps(batch[0][0].z, batch[1][0].z, batch[2][0].z, batch[3][0].z);
+		__m128 ex = _mm_setr_ps(batch[0][1].x, batch[1][1].x, batch[2][1].x, batch[3][1].x);
+		__m128 ey = _mm_setr_ps(batch[0][1].y, batch[1][1].y, batch[2][1].y, batch[3][1].y);
+		__m128 ez = _mm_setr_ps(batch[0][1].z, batch[1][1].z, batch[2][1].z, batch[3][1].z);
+
+		__m128 tmin = zero;
+		__m128 tmax = _mm_set1_ps(1.0f);
+		__m128 rejected = zero;
+
+		for (int j = 0; j < 6; ++j) {
+			__m128 d0 = PlaneDistance(planes[j], sx, sy, sz);
+			__m128 d1 = PlaneDistance(planes[j], ex, ey, ez);
+			__m128 outside0 = _mm_cmplt_ps(d0, zero);
+			__m128 outside1 = _mm_cmplt_ps(d1, zero);
+
+			// NOTE: t is garbage where the segment doesn't cross the plane, but those lanes are masked out
+			__m128 t = _mm_div_ps(d0, _mm_sub_ps(d0, d1));
+
+			rejected = _mm_or_ps(rejected, _mm_and_ps(outside0, outside1));
+
+			tmin = Select(_mm_andnot_ps(outside1, outside0), _mm_max_ps(tmin, t), tmin);
+			tmax = Select(_mm_andnot_ps(outside0, outside1), _mm_min_ps(tmax, t), tmax);
+		}
+
+		int mask = _mm_movemask_ps(_mm_andnot_ps(rejected, _mm_cmple_ps(tmin, tmax)));
+
+		if (mask == 0)
+			continue;
+
+		_mm_storeu_ps(tmins, tmin);
+		_mm_storeu_ps(tmaxs, tmax);
+
+		for (int k = 0; k < 4; ++k) {
+			if (!(mask & (1 << k)))
+				continue;
+
+			const Math::Vector3& start = batch[k][0];
+			Math::Vector3 dir = batch[k][1] - start;
+
+			body.x[body.count] = start.x + tmins[k] * dir.x;
+			body.y[body.count] = start.y + tmins[k] * dir.y;
+			body.z[body.count] = start.z + tmins[k] * dir.z;
+
+			body.x[body.count + 1] = start.x + tmaxs[k] * dir.x;
+			body.y[body.count + 1] = start.y + tmaxs[k] * dir.y;
+			body.z[body.count + 1] = start.z + tmaxs[k] * dir.z;
+
+			body.count += 2;
+		}
+	}
+}
+
+static void PadBody(float* x, float* y, float* z, uint32_t count)
+{
+	// replicate the first point, so that SIMD loops don't need masking
+	for (uint32_t i = count; i < ((count + 3) & ~3); ++i) {
+		x[i] = x[0];
+		y[i] = y[0];
+		z[i] = z[0];
+	}
+}
+
+void ShadowCascades::ExtrudeBody(CascadeBody& body, const Math::Vector3& lightdir) const
+{
+	// add points where the rays towards the light leave the scene
+	Math::Vector3 dir = -lightdir;
+	uint32_t count = body.count;
+	float params[4];
+
+	for (uint32_t i = 0; i < count; i += 4) {
+		__m128 px = _mm_loadu_ps(body.x + i);
+		__m128 py = _mm_loadu_ps(body.y + i);
+		__m128 pz = _mm_loadu_ps(body.z + i);
+		__m128 pos[3] = { px, py, pz };
+		__m128 v = _mm_set1_ps(FLT_MAX);
+
+		for (int j = 0; j < 3; ++j) {
+			if (fabs(dir[j]) < 1e-6f)
+				continue;
+
+			__m128 invdir = _mm_set1_ps(1.0f / dir[j]);
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(scenebox.Min[j]), pos[j]), invdir);
+			__m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(scenebox.Max[j]), pos[j]), invdir);
+
+			v = _mm_min_ps(v, _mm_max_ps(t1, t2));
+		}
+
+		int mask = _mm_movemask_ps(_mm_cmpgt_ps(v, _mm_set1_ps(1e-3f)));
+
+		if (mask == 0)
+			continue;
+
+		_mm_storeu_ps(params, v);
+
+		for (uint32_t k = 0; k < 4 && i + k < count; ++k) {
+			if (!(mask & (1 << k)))
+				continue;
+
+			body.x[body.count] = body.x[i + k] + params[k] * dir.x;
+			body.y[body.count] = body.y[i + k] + params[k] * dir.y;
+			body.z[body.count] = body.z[i + k] + params[k] * dir.z;
+
+			++body.count;
+		}
+	}
+
+	PadBody(body.x, body.y, body.z, body.count);
+}
+
+void ShadowCascades::CalculateBounds(Math::AABox& out, const CascadeBody& body, const Math::Matrix& transform, bool project) const
+{
+	const Math::Matrix& m = transform;
+
+	__m128 minx = _mm_set1_ps(FLT_MAX);
+	__m128 miny = minx;
+	__m128 minz = minx;
+	__m128 maxx = _mm_set1_ps(-FLT_MAX);
+	__m128 maxy = maxx;
+	__m128 maxz = maxx;
+
+	for (uint32_t i = 0; i < body.count; i += 4) {
+		__m128 px = _mm_loadu_ps(body.x + i);
+		__m128 py = _mm_loadu_ps(body.y + i);
+		__m128 pz = _mm_loadu_ps(body.z + i);
+
+		__m128 x = PlaneDistance(Math::Vector4(m._11, m._21, m._31, m._41), px, py, pz);
+		__m128 y = PlaneDistance(Math::Vector4(m._12, m._22, m._32, m._42), px, py, pz);
+		__m128 z = PlaneDistance(Math::Vector4(m._13, m._23, m._33, m._43), px, py, pz);
+
+		if (project) {
+			__m128 w = PlaneDistance(Math::Vector4(m._14, m._24, m._34, m._44), px, py, pz);
+			__m128 invw = _mm_div_ps(_mm_set1_ps(1.0f), w);
+
+			x = _mm_mul_ps(x, invw);
+			y = _mm_mul_ps(y, invw);
+			z = _mm_mul_ps(z, invw);
+		}
+
+		minx = _mm_min_ps(minx, x);
+		miny = _mm_min_ps(miny, y);
+		minz = _mm_min_ps(minz, z);
+		maxx = _mm_max_ps(maxx, x);
+		maxy = _mm_max_ps(maxy, y);
+		maxz = _mm_max_ps(maxz, z);
+	}
+
+	float values[6][4];
+
+	_mm_storeu_ps(values[0], minx);
+	_mm_storeu_ps(values[1], miny);
+	_mm_storeu_ps(values[2], minz);
+	_mm_storeu_ps(values[3], maxx);
+	_mm_storeu_ps(values[4], maxy);
+	_mm_storeu_ps(values[5], maxz);
+
+	for (int i = 0; i < 3; ++i) {
+		out.Min[i] = Math::Min(Math::Min(values[i][0], values[i][1]), Math::Min(values[i][2], values[i][3]));
+		out.Max[i] = Math::Max(Math::Max(values[i + 3][0], values[i + 3][1]), Math::Max(values[i + 3][2], values[i + 3][3]));
+	}
+}
+
+void ShadowCascades::CalculateBasis(Math::Matrix& out, const Math::Vector3& lightdir, const Math::Vector3& origin) const
+{
+	// same light space as in 43_LightSpacePerspectiveSM (y is the view direction projected onto the shadow map)
+	Math::Vector3 lsleft, lsup;
+
+	Math::Vec3Cross(lsleft, lightdir, viewdir);
+
+	if (Math::Vec3Length(lsleft) < 1e-3f) {
+		// looking into (or away from) the light
+		Math::Vec3Cross(lsleft, lightdir, (fabs(lightdir.y) < 0.99f ? Math::Vector3(0, 1, 0) : Math::Vector3(1, 0, 0)));
+	}
+
+	Math::Vec3Normalize(lsleft, lsleft);
+
+	Math::Vec3Cross(lsup, lsleft, lightdir);
+	Math::Vec3Normalize(lsup, lsup);
+
+	Math::MatrixIdentity(out);
+
+	out._11 = lsleft.x;	out._12 = lsup.x;	out._13 = lightdir.x;
+	out._21 = lsleft.y;	out._22 = lsup.y;	out._23 = lightdir.y;
+	out._31 = lsleft.z;	out._32 = lsup.z;	out._33 = lightdir.z;
+
+	out._41 = -Math::Vec3Dot(lsleft, origin);
+	out._42 = -Math::Vec3Dot(lsup, origin);
+	out._43 = -Math::Vec3Dot(lightdir, origin);
+}
+
+void ShadowCascades::Update(const Math::Matrix& view, const Math::Matrix& proj, const Math::AABox& scenebox)
+{
+	Math::Matrix		viewinv, viewproj, viewprojinv;
+	Math::Vector4		planes[6];
+	Math::Vector4		boxplanes[6];
+	Math::Vector4		ndc;
+	Math::Vector3		corners[8];
+	Math::Vector3		cascadecorners[8];
+	Math::Vector3		boxcorners[8];
+	Math::Vector3		frustumedges[12][2];
+	Math::Vector3		boxedges[12][2];
+
+	this->scenebox = scenebox;
+
+	Math::MatrixInverse(viewinv, view);
+	Math::MatrixMultiply(viewproj, view, proj);
+	Math::MatrixInverse(viewprojinv, viewproj);
+
+	eyepos = Math::Vector3(viewinv._41, viewinv._42, viewinv._43);
+	viewdir = Math::Vector3(-view._13, -view._23, -view._33);
+
+	// corners of the whole frustum (bit 2 selects the far plane)
+#ifdef OPENGL
+	float ndcnear = -1.0f;
+#else
+	float ndcnear = 0.0f;
+#endif
+
+	for (int i = 0; i < 8; ++i) {
+		Math::Vec4Transform(ndc, Math::Vector4((i & 1) ? 1.0f : -1.0f, (i & 2) ? 1.0f : -1.0f, (i & 4) ? 1.0f : ndcnear, 1), viewprojinv);
+		corners[i] = Math::Vector3(ndc.x, ndc.y, ndc.z) / ndc.w;
+	}
+
+	float znear = Math::Vec3Dot(corners[0] - eyepos, viewdir);
+	float zfar = Math::Vec3Dot(corners[4] - eyepos, viewdir);
+
+	// side planes are shared, normals point inward
+	Math::FrustumPlanes(planes, viewproj);
+
+	boxplanes[0] = Math::Vector4(1, 0, 0, -scenebox.Min.x);
+	boxplanes[1] = Math::Vector4(-1, 0, 0, scenebox.Max.x);
+	boxplanes[2] = Math::Vector4(0, 1, 0, -scenebox.Min.y);
+	boxplanes[3] = Math::Vector4(0, -1, 0, scenebox.Max.y);
+	boxplanes[4] = Math::Vector4(0, 0, 1, -scenebox.Min.z);
+	boxplanes[5] = Math::Vector4(0, 0, -1, scenebox.Max.z);
+
+	BoxCorners(boxcorners, scenebox);
+	BoxEdges(boxedges, boxcorners);
+
+	scenebody.count = 8;
+
+	for (int i = 0; i < 8; ++i) {
+		scenebody.x[i] = boxcorners[i].x;
+		scenebody.y[i] = boxcorners[i].y;
+		scenebody.z[i] = boxcorners[i].z;
+	}
+
+	for (uint32_t i = 0; i < numcascades; ++i) {
+		CascadeBody& body = bodies[i];
+
+		// practical split scheme
+		for (uint32_t j = 0; j < 2; ++j) {
+			float s = (float)(i + j) / (float)numcascades;
+
+			float logsplit = znear * powf(zfar / znear, s);
+			float uniformsplit = znear + (zfar - znear) * s;
+
+			splits[i][j] = lambda * logsplit + (1.0f - lambda) * uniformsplit;
+		}
+
+		// NOTE: corners move linearly along the frustum edges
+		float t0 = (splits[i].x - znear) / (zfar - znear);
+		float t1 = (splits[i].y - znear) / (zfar - znear);
+
+		for (int j = 0; j < 8; ++j) {
+			const Math::Vector3& a = corners[j & 3];
+			const Math::Vector3& b = corners[(j & 3)|4];
+
+			cascadecorners[j] = a + ((j & 4) ? t1 : t0) * (b - a);
+		}
+
+		BoxEdges(frustumedges, cascadecorners);
+
+		planes[4] = Math::Vector4(viewdir.x, viewdir.y, viewdir.z, -Math::Vec3Dot(viewdir, eyepos) - splits[i].x);
+		planes[5] = Math::Vector4(-viewdir.x, -viewdir.y, -viewdir.z, Math::Vec3Dot(viewdir, eyepos) + splits[i].y);
+
+		body.count = 0;
+
+		ClipSegments(body, boxedges, planes);
+		ClipSegments(body, frustumedges, boxplanes);
+
+		PadBody(body.x, body.y, body.z, body.count);
+	}
+}
+
+void ShadowCascades::FitCascadeOrtho(ShadowCascade& out, const CascadeBody& body, const Math::Vector3& lightdir) const
+{
+	Math::Matrix lightproj;
+	Math::AABox lightbox = scenebox;
+
+	CalculateBasis(out.lightview, lightdir, eyepos);
+	CalculateBounds(out.lightbody, body, out.lightview, false);
+
+	// anything between the light and the body can cast shadows
+	lightbox.TransformAxisAligned(out.lightview);
+	out.lightbody.Min.z = Math::Min(out.lightbody.Min.z, lightbox.Min.z);
+
+	Math::MatrixOrthoOffCenterRH(
+		lightproj,
+		out.lightbody.Min.x, out.lightbody.Max.x,
+		out.lightbody.Min.y, out.lightbody.Max.y,
+		-out.lightbody.Min.z, -out.lightbody.Max.z);
+
+	Math::MatrixMultiply(out.lightviewproj, out.lightview, lightproj);
+	out.projcenter = eyepos;
+}
+
+void ShadowCascades::FitCascadeLiSPSM(ShadowCascade& out, const CascadeBody& body, const Math::Vector3& lightdir) const
+{
+	float cosgamma = Math::Vec3Dot(viewdir, lightdir);
+	float singamma = sqrtf(Math::Max(0.0f, 1.0f - cosgamma * cosgamma));
+
+	if (singamma < LISPSM_MIN_SINGAMMA) {
+		FitCascadeOrtho(out, body, lightdir);
+		return;
+	}
+
+	// calculate body B (with the casters) in light space
+	CascadeBody extruded = body;
+	Math::Matrix lispsmproj(1, 1, 1, 1);
+	Math::Matrix fittounitcube;
+	Math::Vector3 lsup;
+
+	ExtrudeBody(extruded, lightdir);
+
+	CalculateBasis(out.lightview, lightdir, eyepos);
+	CalculateBounds(out.lightbody, extruded, out.lightview, false);
+
+	lsup = Math::Vector3(out.lightview._12, out.lightview._22, out.lightview._32);
+
+	// calculate LSPSM matrix (optimal n for this cascade)
+	float znear	= out.splits.x / singamma;
+	float d		= Math::Max(out.lightbody.Max.y - out.lightbody.Min.y, 1e-3f);
+	float zfar	= znear + d * singamma;
+	float n		= (znear + sqrtf(zfar * znear)) / singamma;
+	float f		= n + d;
+
+	// move projection center so that the near plane touches the body
+	out.projcenter = eyepos + lsup * (out.lightbody.Min.y - n);
+	CalculateBasis(out.lightview, lightdir, out.projcenter);
+
+	lispsmproj._22 = (f + n) / (f - n);
+	lispsmproj._42 = -2 * f * n / (f - n);
+	lispsmproj._24 = 1;
+	lispsmproj._44 = 0;
+
+	// project everything into unit cube
+	Math::MatrixMultiply(out.lightviewproj, out.lightview, lispsmproj);
+	CalculateBounds(out.lightbody, extruded, out.lightviewproj, true);
+
+	Math::MatrixOrthoOffCenterRH(
+		fittounitcube,
+		out.lightbody.Min.x, out.lightbody.Max.x,
+		out.lightbody.Min.y, out.lightbody.Max.y,
+		-out.lightbody.Min.z, -out.lightbody.Max.z);
+
+	Math::MatrixMultiply(out.lightviewproj, out.lightviewproj, fittounitcube);
+}
+
+void ShadowCascades::FitOrtho(ShadowCascade* out, const Math::Vector3& lightdir) const
+{
+	for (uint32_t i = 0; i < numcascades; ++i) {
+		out[i].splits = splits[i];
+		FitCascadeOrtho(out[i], (bodies[i].count > 0 ? bodies[i] : scenebody), lightdir);
+	}
+}
+
+void ShadowCascades::FitLiSPSM(ShadowCascade* out, const Math::Vector3& lightdir) const
+{
+	for (uint32_t i = 0; i < numcascades; ++i) {
+		out[i].splits = splits[i];
+		FitCascadeLiSPSM(out[i], (bodies[i].count > 0 ? bodies[i] : scenebody), lightdir);
+	}
+}
+
+uint32_t ShadowCascades::GetBodyPoints(Math::Vector3* out, uint32_t cascade) const
+{
+	const CascadeBody& body = bodies[cascade];
+
+	for (uint32_t i = 0; i < body.count; ++i)
+		out[i] = Math::Vector3(body.x[i], body.y[i], body.z[i]);
+
+	return body.count;
+}
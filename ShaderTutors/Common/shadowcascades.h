@@ -0,0 +1,72 @@
+
+#ifndef _SHADOWCASCADES_H_
+#define _SHADOWCASCADES_H_
+
+#include "3Dmath.h"
+
+#define MAX_SHADOW_CASCADES		8
+#define MAX_BODY_POINTS			48	// 24 edges, at most 2 points each
+
+struct ShadowCascade
+{
+	Math::Matrix	lightviewproj;	// world -> unit cube
+	Math::Matrix	lightview;		// basis of the light space (z is the light direction)
+	Math::AABox		lightbody;		// body in (warped) light space before fitting
+	Math::Vector3	projcenter;		// center of the (LiSPSM) projection
+	Math::Vector2	splits;			// view space distances
+};
+
+/**
+ * \brief Fits directional light shadow maps to the view frustum split into cascades
+ *
+ * Update intersects each split frustum with the scene box (both convex, so clipping
+ * their edges against each other gives the corners of the body), FitOrtho and
+ * FitLiSPSM then calculate the light matrices for a given light direction. Works
+ * with fixed size buffers, nothing is allocated.
+ */
+class ShadowCascades
+{
+private:
+	struct CascadeBody
+	{
+		// SoA for SIMD, second half is for the extrusion towards the light
+		float		x[MAX_BODY_POINTS * 2];
+		float		y[MAX_BODY_POINTS * 2];
+		float		z[MAX_BODY_POINTS * 2];
+		uint32_t	count;
+	};
+
+	CascadeBody		bodies[MAX_SHADOW_CASCADES];
+	CascadeBody		scenebody;		// used when a cascade doesn't intersect the scene
+	Math::Vector2	splits[MAX_SHADOW_CASCADES];
+	Math::AABox		scenebox;
+	Math::Vector3	eyepos;
+	Math::Vector3	viewdir;
+	uint32_t		numcascades;
+	float			lambda;
+
+	void ClipSegments(CascadeBody& body, const Math::Vector3 (&segments)[12][2], const Math::Vector4 (&planes)[6]) const;
+	void ExtrudeBody(CascadeBody& body, const Math::Vector3& lightdir) const;
+	void CalculateBounds(Math::AABox& out, const CascadeBody& body, const Math::Matrix& transform, bool project) const;
+	void CalculateBasis(Math::Matrix& out, const Math::Vector3& lightdir, const Math::Vector3& origin) const;
+	void FitCascadeOrtho(ShadowCascade& out, const CascadeBody& body, const Math::Vector3& lightdir) const;
+	void FitCascadeLiSPSM(ShadowCascade& out, const CascadeBody& body, const Math::Vector3& lightdir) const;
+
+public:
+	ShadowCascades(uint32_t numcascades = 4, float lambda = 0.75f);
+
+	// lambda blends between uniform (0) and logarithmic (1) split distances
+	void SetSplitScheme(uint32_t numcascades, float lambda);
+	void Update(const Math::Matrix& view, const Math::Matrix& proj, const Math::AABox& scenebox);
+
+	// out[i] for every cascade, lightdir is the direction the light travels in
+	void FitOrtho(ShadowCascade* out, const Math::Vector3& lightdir) const;
+	void FitLiSPSM(ShadowCascade* out, const Math::Vector3& lightdir) const;
+
+	uint32_t GetBodyPoints(Math::Vector3* out, uint32_t cascade) const;	// for debugging (at most MAX_BODY_POINTS)
+
+	inline uint32_t GetNumCascades() const						{ return numcascades; }
+	inline const Math::Vector2& GetSplit(uint32_t cascade) const	{ return splits[cascade]; }
+};
+
+#endif
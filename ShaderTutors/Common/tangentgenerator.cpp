@@ -0,0 +1,428 @@
+
+#include "tangentgenerator.h"
+#include "geometryutils.h"
+#include "meshoptimizer.h"
+#include "threadpool.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#	include <emmintrin.h>
+#	define TANGENTGENERATOR_SSE2
+#endif
+
+#define TRIANGLES_PER_JOB	4096
+#define VERTICES_PER_JOB	2048	// multiple of 4
+
+static void ParallelRange(ThreadPool* pool, uint32_t count, uint32_t grain, const ThreadPool::RangeCallback& callback)
+{
+	if (pool != nullptr)
+		pool->ParallelFor(count, grain, callback);
+	else if (count > 0)
+		callback(0, count, 0);
+}
+
+static inline uint32_t ReadIndex(const void* indices, uint32_t index, bool is32bit)
+{
+	return (is32bit ? ((const uint32_t*)indices)[index] : ((const uint16_t*)indices)[index]);
+}
+
+static inline const float* GetAttribute(const TangentInputDesc& desc, uint32_t vertex, uint32_t offset)
+{
+	return (const float*)((const uint8_t*)desc.vertices + (size_t)vertex * desc.stride + offset);
+}
+
+static void WriteFrame(uint8_t* outdata, uint32_t outstride, TangentFormat format, uint32_t vertex, const float normal[3], const float tangent[3], const float bitangent[3])
+{
+	uint8_t* dest = outdata + (size_t)vertex * outstride;
+
+	if (format == TangentFormatQuaternion) {
+		TangentGenerator::EncodeQuaternion((int16_t*)dest, normal, tangent, bitangent);
+	} else {
+		memcpy(dest, tangent, 12);
+		memcpy(dest + 12, bitangent, 12);
+	}
+}
+
+// --- TangentGenerator impl --------------------------------------------------
+
+TangentGenerator::TangentGenerator()
+{
+	workers = nullptr;
+}
+
+TangentGenerator::~TangentGenerator()
+{
+}
+
+void TangentGenerator::AccumulateTriangles(const TangentInputDesc& desc, uint32_t begin, uint32_t end)
+{
+	// NOTE: same arithmetic as GeometryUtils::AccumulateTangentFrame
+	for (uint32_t i = begin; i < end; ++i) {
+		uint32_t i1 = ReadIndex(desc.indices, i * 3 + 0, desc.is32bit);
+		uint32_t i2 = ReadIndex(desc.indices, i * 3 + 1, desc.is32bit);
+		uint32_t i3 = ReadIndex(desc.indices, i * 3 + 2, desc.is32bit);
+
+		const float* p1 = GetAttribute(desc, i1, desc.positionoffset);
+		const float* p2 = GetAttribute(desc, i2, desc.positionoffset);
+		const float* p3 = GetAttribute(desc, i3, desc.positionoffset);
+
+		const float* uv1 = GetAttribute(desc, i1, desc.texcoordoffset);
+		const float* uv2 = GetAttribute(desc, i2, desc.texcoordoffset);
+		const float* uv3 = GetAttribute(desc, i3, desc.texcoordoffset);
+
+		float* frame = &triangleframes[(size_t)i * 6];
+		float a[3], c[3];
+
+		a[0] = p2[0] - p1[0];
+		a[1] = p2[1] - p1[1];
+		a[2] = p2[2] - p1[2];
+
+		c[0] = p3[0] - p1[0];
+		c[1] = p3[1] - p1[1];
+		c[2] = p3[2] - p1[2];
+
+		float s1 = uv2[0] - uv1[0];
+		float s2 = uv3[0] - uv1[0];
+		float t1 = uv2[1] - uv1[1];
+		float t2 = uv3[1] - uv1[1];
+
+		float invdet = 1.0f / ((s1 * t2 - s2 * t1) + 0.0001f);
+
+		frame[0] = (t2 * a[0] - t1 * c[0]) * invdet;
+		frame[1] = (t2 * a[1] - t1 * c[1]) * invdet;
+		frame[2] = (t2 * a[2] - t1 * c[2]) * invdet;
+
+		frame[3] = (s1 * c[0] - s2 * a[0]) * invdet;
+		frame[4] = (s1 * c[1] - s2 * a[1]) * invdet;
+		frame[5] = (s1 * c[2] - s2 * a[2]) * invdet;
+	}
+}
+
+void TangentGenerator::BuildAdjacency(const TangentInputDesc& desc)
+{
+	// NOTE: counting sort, triangles stay in index buffer order for every vertex
+	uint32_t numtriangles = desc.numindices / 3;
+
+	adjacencyoffsets.assign(desc.numvertices + 1, 0);
+	adjacency.resize(numtriangles * 3);
+
+	for (uint32_t i = 0; i < numtriangles * 3; ++i)
+		++adjacencyoffsets[ReadIndex(desc.indices, i, desc.is32bit) + 1];
+
+	for (uint32_t i = 0; i < desc.numvertices; ++i)
+		adjacencyoffsets[i + 1] += adjacencyoffsets[i];
+
+	for (uint32_t i = 0; i < numtriangles * 3; ++i) {
+		uint32_t vertex = ReadIndex(desc.indices, i, desc.is32bit);
+		adjacency[adjacencyoffsets[vertex]++] = i / 3;
+	}
+
+	for (uint32_t i = desc.numvertices; i > 0; --i)
+		adjacencyoffsets[i] = adjacencyoffsets[i - 1];
+
+	adjacencyoffsets[0] = 0;
+}
+
+void TangentGenerator::ResolveVertices(const TangentInputDesc& desc, uint8_t* outdata, uint32_t outstride, TangentFormat format, uint32_t begin, uint32_t end) const
+{
+	GeometryUtils::TBNVertex vert;
+	uint32_t i = begin;
+
+	auto gather = [&](float outframe[6], uint32_t vertex) {
+		// NOTE: summed in the same order as the serial version
+		for (int k = 0; k < 6; ++k)
+			outframe[k] = 0;
+
+		for (uint32_t j = adjacencyoffsets[vertex]; j < adjacencyoffsets[vertex + 1]; ++j) {
+			const float* frame = &triangleframes[(size_t)adjacency[j] * 6];
+
+			for (int k = 0; k < 6; ++k)
+				outframe[k] += frame[k];
+		}
+	};
+
+	auto resolve = [&](uint32_t vertex, const float frame[6]) {
+		memcpy(&vert.nx, GetAttribute(desc, vertex, desc.normaloffset), 12);
+		memcpy(&vert.tx, frame, 24);
+
+		GeometryUtils::OrthogonalizeTangentFrame(vert);
+		WriteFrame(outdata, outstride, format, vertex, &vert.nx, &vert.tx, &vert.bx);
+	};
+
+#ifdef TANGENTGENERATOR_SSE2
+	const __m128 epsilon = _mm_set1_ps(1e-6f);
+	const __m128 one = _mm_set1_ps(1.0f);
+
+	alignas(16) float frames[6][4];
+	alignas(16) float normals[3][4];
+	alignas(16) float results[6][4];
+	float frame[6];
+
+	// NOTE: OrthogonalizeTangentFrame for 4 vertices at once (same order of operations)
+	for (; i + 4 <= end; i += 4) {
+		for (uint32_t lane = 0; lane < 4; ++lane) {
+			const float* normal = GetAttribute(desc, i + lane, desc.normaloffset);
+
+			gather(frame, i + lane);
+
+			for (int k = 0; k < 6; ++k)
+				frames[k][lane] = frame[k];
+
+			normals[0][lane] = normal[0];
+			normals[1][lane] = normal[1];
+			normals[2][lane] = normal[2];
+		}
+
+		__m128 tx = _mm_load_ps(frames[0]), ty = _mm_load_ps(frames[1]), tz = _mm_load_ps(frames[2]);
+		__m128 bx = _mm_load_ps(frames[3]), by = _mm_load_ps(frames[4]), bz = _mm_load_ps(frames[5]);
+		__m128 nx = _mm_load_ps(normals[0]), ny = _mm_load_ps(normals[1]), nz = _mm_load_ps(normals[2]);
+
+		__m128 tt = _mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, tx), _mm_mul_ps(ty, ty)), _mm_mul_ps(tz, tz));
+		__m128 bb = _mm_add_ps(_mm_add_ps(_mm_mul_ps(bx, bx), _mm_mul_ps(by, by)), _mm_mul_ps(bz, bz));
+
+		if (_mm_movemask_ps(_mm_or_ps(_mm_cmplt_ps(tt, epsilon), _mm_cmplt_ps(bb, epsilon))) != 0) {
+			// degenerate UVs somewhere, let the scalar version handle it
+			for (uint32_t lane = 0; lane < 4; ++lane) {
+				for (int k = 0; k < 6; ++k)
+					frame[k] = frames[k][lane];
+
+				resolve(i + lane, frame);
+			}
+
+			continue;
+		}
+
+		__m128 nt = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, tx), _mm_mul_ps(ny, ty)), _mm_mul_ps(nz, tz));
+		__m128 nb = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, bx), _mm_mul_ps(ny, by)), _mm_mul_ps(nz, bz));
+
+		__m128 ox = _mm_sub_ps(tx, _mm_mul_ps(nx, nt));
+		__m128 oy = _mm_sub_ps(ty, _mm_mul_ps(ny, nt));
+		__m128 oz = _mm_sub_ps(tz, _mm_mul_ps(nz, nt));
+
+		__m128 ob = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, bx), _mm_mul_ps(oy, by)), _mm_mul_ps(oz, bz));
+		__m128 ratio = _mm_div_ps(ob, tt);
+
+		__m128 px = _mm_sub_ps(_mm_sub_ps(bx, _mm_mul_ps(nx, nb)), _mm_mul_ps(ox, ratio));
+		__m128 py = _mm_sub_ps(_mm_sub_ps(by, _mm_mul_ps(ny, nb)), _mm_mul_ps(oy, ratio));
+		__m128 pz = _mm_sub_ps(_mm_sub_ps(bz, _mm_mul_ps(nz, nb)), _mm_mul_ps(oz, ratio));
+
+		__m128 oo = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, ox), _mm_mul_ps(oy, oy)), _mm_mul_ps(oz, oz));
+		__m128 pp = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, px), _mm_mul_ps(py, py)), _mm_mul_ps(pz, pz));
+
+		__m128 tvalid = _mm_cmpge_ps(oo, epsilon);
+		__m128 bvalid = _mm_cmpge_ps(pp, epsilon);
+		__m128 til = _mm_div_ps(one, _mm_sqrt_ps(oo));
+		__m128 bil = _mm_div_ps(one, _mm_sqrt_ps(pp));
+
+		// keep the unnormalized vectors where the projection vanished
+		_mm_store_ps(results[0], _mm_or_ps(_mm_and_ps(tvalid, _mm_mul_ps(ox, til)), _mm_andnot_ps(tvalid, tx)));
+		_mm_store_ps(results[1], _mm_or_ps(_mm_and_ps(tvalid, _mm_mul_ps(oy, til)), _mm_andnot_ps(tvalid, ty)));
+		_mm_store_ps(results[2], _mm_or_ps(_mm_and_ps(tvalid, _mm_mul_ps(oz, til)), _mm_andnot_ps(tvalid, tz)));
+		_mm_store_ps(results[3], _mm_or_ps(_mm_and_ps(bvalid, _mm_mul_ps(px, bil)), _mm_andnot_ps(bvalid, bx)));
+		_mm_store_ps(results[4], _mm_or_ps(_mm_and_ps(bvalid, _mm_mul_ps(py, bil)), _mm_andnot_ps(bvalid, by)));
+		_mm_store_ps(results[5], _mm_or_ps(_mm_and_ps(bvalid, _mm_mul_ps(pz, bil)), _mm_andnot_ps(bvalid, bz)));
+
+		for (uint32_t lane = 0; lane < 4; ++lane) {
+			float tangent[3] = { results[0][lane], results[1][lane], results[2][lane] };
+			float bitangent[3] = { results[3][lane], results[4][lane], results[5][lane] };
+			float normal[3] = { normals[0][lane], normals[1][lane], normals[2][lane] };
+
+			WriteFrame(outdata, outstride, format, i + lane, normal, tangent, bitangent);
+		}
+	}
+#endif
+
+	for (; i < end; ++i) {
+		float frame[6];
+
+		gather(frame, i);
+		resolve(i, frame);
+	}
+}
+
+void TangentGenerator::Generate(const TangentInputDesc& desc, void* outdata, uint32_t outstride, TangentFormat format)
+{
+	uint32_t numtriangles = desc.numindices / 3;
+
+	triangleframes.resize((size_t)numtriangles * 6);
+
+	ParallelRange(workers, numtriangles, TRIANGLES_PER_JOB, [&](uint32_t begin, uint32_t end, uint32_t) {
+		AccumulateTriangles(desc, begin, end);
+	});
+
+	BuildAdjacency(desc);
+
+	ParallelRange(workers, desc.numvertices, VERTICES_PER_JOB, [&](uint32_t begin, uint32_t end, uint32_t) {
+		ResolveVertices(desc, (uint8_t*)outdata, outstride, format, begin, end);
+	});
+}
+
+bool TangentGenerator::GenerateQMTangents(const char* file, TangentStatistics* stats)
+{
+	static const uint16_t elemsizes[6] = { 1, 2, 3, 4, 4, 4 };
+	static const uint16_t elemstrides[6] = { 4, 4, 4, 4, 1, 1 };
+
+	std::vector<uint8_t>	data;
+	std::vector<uint8_t>	output;
+	MeshOptimizer::QMLayout	layout;
+	TangentInputDesc		desc;
+	int32_t					offsets[9];
+	uint32_t				numelems;
+	uint32_t				vstride = 0;
+
+	if (!MeshOptimizer::ReadQM(data, layout, file))
+		return false;
+
+	for (int i = 0; i < 9; ++i)
+		offsets[i] = -1;
+
+	memcpy(&numelems, data.data() + 32, 4);
+
+	for (uint32_t i = 0; i < numelems; ++i) {
+		const uint8_t* elem = data.data() + 36 + i * 5;
+
+		// first float3/float2 element of the usage (see the usages table in GLCreateMeshFromQM)
+		if (elem[2] < 9 && offsets[elem[2]] == -1 && elem[3] == (elem[2] == 6 ? 1 : 2))
+			offsets[elem[2]] = (int32_t)vstride;
+
+		vstride += elemsizes[elem[3]] * elemstrides[elem[3]];
+	}
+
+	if (offsets[5] == -1 || offsets[6] == -1)
+		return false;
+
+	// NOTE: existing LODs use the vertices of the first level
+	desc.vertices		= data.data() + layout.vertexoffset;
+	desc.indices		= data.data() + layout.indexoffset;
+	desc.numvertices	= layout.header[4];
+	desc.numindices		= layout.header[1] - layout.header[1] % 3;
+	desc.stride			= layout.vstride;
+	desc.positionoffset	= (uint32_t)layout.posoffset;
+	desc.normaloffset	= (uint32_t)offsets[5];
+	desc.texcoordoffset	= (uint32_t)offsets[6];
+	desc.is32bit		= (layout.istride == 4);
+
+	// NOTE: adding the elements would change the vertex stride, but OpenGLBVH, VulkanMesh and the
+	// samples that bind the vertex buffer as CommonVertex (51_Instancing, 51_MultiDrawIndirect, 57) expect 32 bytes
+	if (offsets[7] == -1 || offsets[8] != offsets[7] + 12)
+		return false;
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	// regenerate in place
+	output = data;
+	Generate(desc, output.data() + layout.vertexoffset + offsets[7], layout.vstride);
+
+	auto end = std::chrono::high_resolution_clock::now();
+
+	if (stats != nullptr) {
+		stats->numtriangles	= desc.numindices / 3;
+		stats->numvertices	= desc.numvertices;
+		stats->buildtime	= std::chrono::duration<float, std::milli>(end - start).count();
+	}
+
+	return MeshOptimizer::OverwriteFile(file, output);
+}
+
+void TangentGenerator::EncodeQuaternion(int16_t out[4], const float normal[3], const float tangent[3], const float bitangent[3])
+{
+	Math::Vector3 n(normal), t, b;
+	Math::Quaternion q;
+
+	// orthonormal basis (tangent, normal x tangent, normal)
+	if (Math::Vec3Dot(n, n) < 1e-12f)
+		n = Math::Vector3(0, 0, 1);
+
+	Math::Vec3Normalize(n, n);
+	Math::Vec3Scale(t, n, Math::Vec3Dot(n, Math::Vector3(tangent)));
+	Math::Vec3Subtract(t, Math::Vector3(tangent), t);
+
+	if (Math::Vec3Dot(t, t) < 1e-12f)
+		Math::Vec3Cross(t, n, (fabs(n.x) < 0.9f ? Math::Vector3(1, 0, 0) : Math::Vector3(0, 1, 0)));
+
+	Math::Vec3Normalize(t, t);
+	Math::Vec3Cross(b, n, t);
+
+	float handedness = (Math::Vec3Dot(b, Math::Vector3(bitangent)) < 0 ? -1.0f : 1.0f);
+	float trace = t.x + b.y + n.z;
+
+	if (trace > 0) {
+		float s = 0.5f / sqrtf(trace + 1.0f);
+
+		q.w = 0.25f / s;
+		q.x = (b.z - n.y) * s;
+		q.y = (n.x - t.z) * s;
+		q.z = (t.y - b.x) * s;
+	} else if (t.x > b.y && t.x > n.z) {
+		float s = 2.0f * sqrtf(1.0f + t.x - b.y - n.z);
+
+		q.w = (b.z - n.y) / s;
+		q.x = 0.25f * s;
+		q.y = (b.x + t.y) / s;
+		q.z = (n.x + t.z) / s;
+	} else if (b.y > n.z) {
+		float s = 2.0f * sqrtf(1.0f + b.y - t.x - n.z);
+
+		q.w = (n.x - t.z) / s;
+		q.x = (b.x + t.y) / s;
+		q.y = 0.25f * s;
+		q.z = (n.y + b.z) / s;
+	} else {
+		float s = 2.0f * sqrtf(1.0f + n.z - t.x - b.y);
+
+		q.w = (t.y - b.x) / s;
+		q.x = (n.x + t.z) / s;
+		q.y = (n.y + b.z) / s;
+		q.z = 0.25f * s;
+	}
+
+	Math::QuaternionNormalize(q, q);
+
+	if (q.w < 0) {
+		q.x = -q.x;
+		q.y = -q.y;
+		q.z = -q.z;
+		q.w = -q.w;
+	}
+
+	// NOTE: w must not quantize to zero, otherwise the handedness is lost
+	const float bias = 1.0f / 32767.0f;
+
+	if (q.w < bias) {
+		float scale = sqrtf(1.0f - bias * bias);
+
+		q.x *= scale;
+		q.y *= scale;
+		q.z *= scale;
+		q.w = bias;
+	}
+
+	out[0] = (int16_t)lrintf(Math::Clamp(q.x * handedness, -1.0f, 1.0f) * 32767.0f);
+	out[1] = (int16_t)lrintf(Math::Clamp(q.y * handedness, -1.0f, 1.0f) * 32767.0f);
+	out[2] = (int16_t)lrintf(Math::Clamp(q.z * handedness, -1.0f, 1.0f) * 32767.0f);
+	out[3] = (int16_t)lrintf(Math::Clamp(q.w * handedness, -1.0f, 1.0f) * 32767.0f);
+}
+
+void TangentGenerator::DecodeQuaternion(float outnormal[3], float outtangent[3], float outbitangent[3], const int16_t quat[4])
+{
+	Math::Quaternion q(quat[0] / 32767.0f, quat[1] / 32767.0f, quat[2] / 32767.0f, quat[3] / 32767.0f);
+	float handedness = (quat[3] < 0 ? -1.0f : 1.0f);
+
+	Math::QuaternionNormalize(q, q);
+
+	// columns of the rotation matrix (the sign of q doesn't matter here)
+	outtangent[0] = 1.0f - 2.0f * (q.y * q.y + q.z * q.z);
+	outtangent[1] = 2.0f * (q.x * q.y + q.w * q.z);
+	outtangent[2] = 2.0f * (q.x * q.z - q.w * q.y);
+
+	outbitangent[0] = handedness * 2.0f * (q.x * q.y - q.w * q.z);
+	outbitangent[1] = handedness * (1.0f - 2.0f * (q.x * q.x + q.z * q.z));
+	outbitangent[2] = handedness * 2.0f * (q.y * q.z + q.w * q.x);
+
+	outnormal[0] = 2.0f * (q.x * q.z + q.w * q.y);
+	outnormal[1] = 2.0f * (q.y * q.z - q.w * q.x);
+	outnormal[2] = 1.0f - 2.0f * (q.x * q.x + q.y * q.y);
+}
@@ -0,0 +1,70 @@
+
+#ifndef _TANGENTGENERATOR_H_
+#define _TANGENTGENERATOR_H_
+
+#include <cstdint>
+#include <vector>
+
+class ThreadPool;
+
+enum TangentFormat
+{
+	TangentFormatVectors = 0,	// float3 tangent + float3 bitangent (like TBNVertex)
+	TangentFormatQuaternion		// 4 x snorm16, the whole frame (sign of w is the handedness)
+};
+
+struct TangentInputDesc
+{
+	const void*		vertices;
+	const void*		indices;		// triangle list
+	uint32_t		numvertices;
+	uint32_t		numindices;
+	uint32_t		stride;
+	uint32_t		positionoffset;	// float3
+	uint32_t		normaloffset;	// float3
+	uint32_t		texcoordoffset;	// float2
+	bool			is32bit;
+};
+
+struct TangentStatistics
+{
+	uint32_t		numtriangles;
+	uint32_t		numvertices;
+	float			buildtime;		// ms
+};
+
+/**
+ * \brief Parallel version of GeometryUtils::GenerateTangentFrame
+ *
+ * Triangles are split across threads, then every vertex sums its triangles in index buffer
+ * order, so the result doesn't depend on the number of threads and is the same as the serial
+ * version's. Works on any vertex layout through offsets, the output is written into a separate
+ * (or the same) strided buffer.
+ */
+class TangentGenerator
+{
+private:
+	std::vector<float>		triangleframes;		// unnormalized tangent and bitangent per triangle
+	std::vector<uint32_t>	adjacencyoffsets;
+	std::vector<uint32_t>	adjacency;			// vertex -> triangles, in index buffer order
+	ThreadPool*				workers;
+
+	void AccumulateTriangles(const TangentInputDesc& desc, uint32_t begin, uint32_t end);
+	void BuildAdjacency(const TangentInputDesc& desc);
+	void ResolveVertices(const TangentInputDesc& desc, uint8_t* outdata, uint32_t outstride, TangentFormat format, uint32_t begin, uint32_t end) const;
+
+public:
+	TangentGenerator();
+	~TangentGenerator();
+
+	void Generate(const TangentInputDesc& desc, void* outdata, uint32_t outstride, TangentFormat format = TangentFormatVectors);	// outdata points to the first vertex's tangent
+
+	bool GenerateQMTangents(const char* file, TangentStatistics* stats = nullptr);	// updates the tangent and binormal elements (fails if the file has none)
+
+	static void EncodeQuaternion(int16_t out[4], const float normal[3], const float tangent[3], const float bitangent[3]);
+	static void DecodeQuaternion(float outnormal[3], float outtangent[3], float outbitangent[3], const int16_t quat[4]);
+
+	inline void SetThreadPool(ThreadPool* pool)	{ workers = pool; }
+};
+
+#endif
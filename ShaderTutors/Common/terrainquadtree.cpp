@@ -1,7 +1,12 @@
 
+#include <algorithm>
 #include "terrainquadtree.h"
+#include "gridlodpatterns.h"
+#include "profiler.h"
 
 #define CHOOPY_SCALE_CORRECTION	1.35f	// because frustum culling gives false negatives
+#define COVERAGE_HYSTERESIS		0.15f	// relative band around maxcoverage where the previous decision is kept
+#define COVERAGE_REFRESH		0.05f	// re-evaluate coverage if the eye moved more than this * distance
 
 TerrainQuadTree::Node::Node()
 {
@@ -14,6 +19,16 @@ TerrainQuadTree::Node::Node()
 	length = 0;
 }
 
+TerrainQuadTree::CachedNode::CachedNode()
+{
+	coverage	= 0;
+	mindist		= 0;
+	children	= -1;
+	evaluated	= false;
+	decided		= false;
+	split		= false;
+}
+
 TerrainQuadTree::TerrainQuadTree()
 {
 	numlods		= 0;
@@ -21,6 +36,8 @@ TerrainQuadTree::TerrainQuadTree()
 	patchlength	= 0;
 	maxcoverage	= 0;
 	screenarea	= 0;
+	projscale	= 0;
+	numevaluated = 0;
 }
 
 void TerrainQuadTree::Initialize(const Math::Vector2& start, float size, int lodcount, int meshsize, float patchsize, float maxgridcoverage, float screensize)
@@ -33,21 +50,219 @@ void TerrainQuadTree::Initialize(const Math::Vector2& start, float size, int lod
 	patchlength	= patchsize;
 	maxcoverage	= maxgridcoverage;
 	screenarea	= screensize;
+
+	cache.clear();
+	freeblocks.clear();
+
+	cache.push_back(CachedNode());
+	cache[0].node = root;
 }
 
 void TerrainQuadTree::Rebuild(const Math::Matrix& viewproj, const Math::Matrix& proj, const Math::Vector3& eye)
 {
+	PROFILE_SCOPE("TerrainQuadTree::Rebuild");
+
 	nodes.clear();
+	patches.clear();
+	Math::FrustumPlanes(planes, viewproj);
+
+	// NOTE: BuildTree writes subnode indices, build from a copy so they don't leak into the next frame
+	Node node = root;
+
+	numevaluated = 0;
+	BuildTree(node, proj, eye);
+
+	PROFILE_COUNTER("TerrainQuadTree nodes evaluated", numevaluated);
+
+	BuildPatches();
+}
+
+void TerrainQuadTree::RebuildIncremental(const Math::Matrix& viewproj, const Math::Matrix& proj, const Math::Vector3& eye)
+{
+	PROFILE_SCOPE("TerrainQuadTree::RebuildIncremental");
+
+	// NOTE: keeps the previous frame's tree; only nodes whose coverage might have crossed a threshold are re-evaluated
+	nodes.clear();
+	patches.clear();
+
+	if (cache.empty())
+		return;
+
+	Math::FrustumPlanes(planes, viewproj);
+
+	if (projscale != proj._11 * proj._22) {
+		// field of view changed, everything is stale
+		for (CachedNode& cached : cache) {
+			cached.evaluated = false;
+			cached.decided = false;
+		}
+
+		projscale = proj._11 * proj._22;
+	}
+
+	numevaluated = 0;
+	UpdateTree(0, proj, eye, false);
+
+	PROFILE_COUNTER("TerrainQuadTree nodes evaluated", numevaluated);
+
+	BuildPatches();
+}
+
+void TerrainQuadTree::BuildPatches()
+{
+	// emit patch list grouped by stitching pattern
+	Patch patch;
+
+	for (const Node& node : nodes) {
+		if (!node.IsLeaf())
+			continue;
+
+		FindSubsetPattern(patch.pattern, node);
+
+		patch.start		= node.start;
+		patch.length	= node.length;
+		patch.lod		= node.lod;
+		patch.subset	= GridLODPatterns::GetPatternIndex(node.lod, patch.pattern);
+
+		patches.push_back(patch);
+	}
 
-	BuildTree(root, viewproj, proj, eye);
+	std::stable_sort(patches.begin(), patches.end(), [](const Patch& a, const Patch& b) -> bool {
+		return (a.subset < b.subset);
+	});
 }
 
-int TerrainQuadTree::BuildTree(Node& node, const Math::Matrix& viewproj, const Math::Matrix& proj, const Math::Vector3& eye)
+int TerrainQuadTree::UpdateTree(int index, const Math::Matrix& proj, const Math::Vector3& eye, bool inside)
 {
-	if (!IsVisible(node, viewproj))
+	if (!inside) {
+		int result = IsVisible(cache[index].node);
+
+		if (result == 0)
+			return -1;
+
+		// children of a fully contained node need no test
+		inside = (result == 2);
+	}
+
+	CachedNode& cached = cache[index];
+
+	// coverage is (c / mindist^2), so moving d changes it at most by (mindist / (mindist - d))^2
+	if (!cached.evaluated || Math::Vec3Distance(eye, cached.evaleye) > COVERAGE_REFRESH * cached.mindist) {
+		cached.coverage		= CalculateCoverage(cached.node, proj, eye, &cached.mindist);
+		cached.evaleye		= eye;
+		cached.evaluated	= true;
+
+		++numevaluated;
+	}
+
+	// NOTE: the hysteresis only applies to decisions that were made (a new node decides like Rebuild)
+	float coverage = cached.coverage;
+	float threshold = maxcoverage;
+	bool decided = cached.decided;
+	bool visible = true;
+
+	if (decided)
+		threshold *= (cached.split ? (1.0f - COVERAGE_HYSTERESIS) : (1.0f + COVERAGE_HYSTERESIS));
+
+	cached.decided = true;
+
+	cached.split = (coverage > threshold && cached.node.length > patchlength);
+
+	if (cached.split) {
+		if (cached.children == -1) {
+			int children = AllocateChildren(cached.node);
+			cache[index].children = children;	// might have been reallocated
+		}
+
+		int children = cache[index].children;
+		int subnodes[4];
+
+		subnodes[0] = UpdateTree(children + 0, proj, eye, inside);
+		subnodes[1] = UpdateTree(children + 1, proj, eye, inside);
+		subnodes[2] = UpdateTree(children + 2, proj, eye, inside);
+		subnodes[3] = UpdateTree(children + 3, proj, eye, inside);
+
+		Node& node = cache[index].node;
+
+		node.subnodes[0] = subnodes[0];
+		node.subnodes[1] = subnodes[1];
+		node.subnodes[2] = subnodes[2];
+		node.subnodes[3] = subnodes[3];
+
+		visible = !node.IsLeaf();
+	} else {
+		if (cached.children != -1) {
+			ReleaseChildren(cached.children);
+			cached.children = -1;
+		}
+
+		cached.node.subnodes[0] = cached.node.subnodes[1] = cached.node.subnodes[2] = cached.node.subnodes[3] = -1;
+	}
+
+	Node& node = cache[index].node;
+
+	// keep previous LOD while the coverage stays inside the hysteresis band
+	int minlod = CalculateLOD(coverage, maxcoverage * (1.0f - COVERAGE_HYSTERESIS));
+	int maxlod = CalculateLOD(coverage, maxcoverage * (1.0f + COVERAGE_HYSTERESIS));
+
+	if (!decided || node.lod < minlod || node.lod > maxlod)
+		node.lod = CalculateLOD(coverage, maxcoverage);
+
+	if (!visible)
+		return -1;
+
+	int position = (int)nodes.size();
+	nodes.push_back(node);
+
+	return position;
+}
+
+int TerrainQuadTree::AllocateChildren(const Node& parent)
+{
+	// NOTE: parent might live in the cache, copy before resizing
+	Math::Vector2 start = parent.start;
+	float halflength = 0.5f * parent.length;
+	int children = 0;
+
+	if (freeblocks.size() > 0) {
+		children = freeblocks.back();
+		freeblocks.pop_back();
+
+		for (int i = 0; i < 4; ++i)
+			cache[children + i] = CachedNode();
+	} else {
+		children = (int)cache.size();
+		cache.resize(cache.size() + 4);
+	}
+
+	cache[children + 0].node.start = start;
+	cache[children + 1].node.start = { start.x + halflength, start.y };
+	cache[children + 2].node.start = { start.x + halflength, start.y + halflength };
+	cache[children + 3].node.start = { start.x, start.y + halflength };
+
+	for (int i = 0; i < 4; ++i)
+		cache[children + i].node.length = halflength;
+
+	return children;
+}
+
+void TerrainQuadTree::ReleaseChildren(int index)
+{
+	for (int i = 0; i < 4; ++i) {
+		if (cache[index + i].children != -1)
+			ReleaseChildren(cache[index + i].children);
+	}
+
+	freeblocks.push_back(index);
+}
+
+int TerrainQuadTree::BuildTree(Node& node, const Math::Matrix& proj, const Math::Vector3& eye)
+{
+	if (IsVisible(node) == 0)
 		return -1;
 
 	float coverage = CalculateCoverage(node, proj, eye);
+	++numevaluated;
 	bool visible = true;
 
 	if (coverage > maxcoverage && node.length > patchlength) {
@@ -60,28 +275,18 @@ int TerrainQuadTree::BuildTree(Node& node, const Math::Matrix& viewproj, const M
 
 		subnodes[0].length = subnodes[1].length = subnodes[2].length = subnodes[3].length = 0.5f * node.length;
 
-		node.subnodes[0] = BuildTree(subnodes[0], viewproj, proj, eye);
-		node.subnodes[1] = BuildTree(subnodes[1], viewproj, proj, eye);
-		node.subnodes[2] = BuildTree(subnodes[2], viewproj, proj, eye);
-		node.subnodes[3] = BuildTree(subnodes[3], viewproj, proj, eye);
+		node.subnodes[0] = BuildTree(subnodes[0], proj, eye);
+		node.subnodes[1] = BuildTree(subnodes[1], proj, eye);
+		node.subnodes[2] = BuildTree(subnodes[2], proj, eye);
+		node.subnodes[3] = BuildTree(subnodes[3], proj, eye);
 
 		visible = !node.IsLeaf();
 	}
 
-	if (visible) {
-		int lod = 0;
-
-		for (lod = 0; lod < numlods - 1; ++lod) {
-			if (coverage > maxcoverage)
-				break;
-
-			coverage *= 4.0f;
-		}
-
-		node.lod = Math::Min(lod, numlods - 2);
-	} else {
+	if (visible)
+		node.lod = CalculateLOD(coverage, maxcoverage);
+	else
 		return -1;
-	}
 
 	int position = (int)nodes.size();
 	nodes.push_back(node);
@@ -89,20 +294,30 @@ int TerrainQuadTree::BuildTree(Node& node, const Math::Matrix& viewproj, const M
 	return position;
 }
 
-bool TerrainQuadTree::IsVisible(const Node& node, const Math::Matrix& viewproj) const
+int TerrainQuadTree::CalculateLOD(float coverage, float threshold) const
+{
+	int lod = 0;
+
+	for (lod = 0; lod < numlods - 1; ++lod) {
+		if (coverage > threshold)
+			break;
+
+		coverage *= 4.0f;
+	}
+
+	return Math::Min(lod, numlods - 2);
+}
+
+int TerrainQuadTree::IsVisible(const Node& node) const
 {
 	Math::AABox box;
-	Math::Vector4 planes[6];
 	float length = node.length;
 
 	// NOTE: depends on choopy scale
 	box.Add(node.start.x - CHOOPY_SCALE_CORRECTION, -0.01f, node.start.y - CHOOPY_SCALE_CORRECTION);
 	box.Add(node.start.x + length + CHOOPY_SCALE_CORRECTION, 0.01f, node.start.y + length + CHOOPY_SCALE_CORRECTION);
 
-	Math::FrustumPlanes(planes, viewproj);
-	int result = FrustumIntersect(planes, box);
-
-	return (result > 0);
+	return FrustumIntersect(planes, box);
 }
 
 int TerrainQuadTree::FindLeaf(const Math::Vector2& point) const
@@ -182,7 +397,7 @@ void TerrainQuadTree::Traverse(NodeCallback callback) const
 	InternalTraverse(nodes.back(), callback);
 }
 
-float TerrainQuadTree::CalculateCoverage(const Node& node, const Math::Matrix& proj, const Math::Vector3& eye) const
+float TerrainQuadTree::CalculateCoverage(const Node& node, const Math::Matrix& proj, const Math::Vector3& eye, float* outmindist) const
 {
 	const static Math::Vector2 samples[16] = {
 		{ 0, 0 },
@@ -209,6 +424,7 @@ float TerrainQuadTree::CalculateCoverage(const Node& node, const Math::Matrix& p
 	float gridlength	= length / meshdim;
 	float worldarea		= gridlength * gridlength;
 	float maxprojarea	= 0;
+	float mindist		= FLT_MAX;
 
 	// NOTE: from nVidia (sample patch at given points and estimate coverage)
 	for (int i = 0; i < 16; ++i) {
@@ -223,8 +439,13 @@ float TerrainQuadTree::CalculateCoverage(const Node& node, const Math::Matrix& p
 
 		if (maxprojarea < projarea)
 			maxprojarea = projarea;
+
+		mindist = Math::Min(mindist, dist);
 	}
 
+	if (outmindist != nullptr)
+		*outmindist = mindist;
+
 	return maxprojarea * screenarea * 0.25f;
 }
 
@@ -24,11 +24,44 @@ public:
 		}
 	};
 
+	struct Patch
+	{
+		Math::Vector2	start;
+		float			length;
+		int				lod;
+		int				pattern[4];		// left, right, bottom, top (see FindSubsetPattern)
+		uint32_t		subset;			// lod * 3^4 + pattern as base 3 number (see GridLODPatterns)
+	};
+
+	typedef std::vector<Patch> PatchList;
+
 private:
+	struct CachedNode
+	{
+		Node			node;
+		Math::Vector3	evaleye;		// eye position at last coverage evaluation
+		float			coverage;
+		float			mindist;		// distance of the closest sample point
+		int				children;		// first of 4 consecutive cache entries (or -1)
+		bool			evaluated;
+		bool			decided;		// split and node.lod hold the previous frame's decision
+		bool			split;
+
+		CachedNode();
+	};
+
 	typedef std::vector<Node> NodeList;
+	typedef std::vector<CachedNode> CachedNodeList;
+	typedef std::vector<int> BlockList;
 	typedef std::function<void (const TerrainQuadTree::Node&)> NodeCallback;
 
-	NodeList	nodes;
+	NodeList		nodes;
+	CachedNodeList	cache;			// persistent tree for incremental mode (cache[0] is the root)
+	PatchList		patches;
+	BlockList		freeblocks;		// released children blocks
+	Math::Vector4	planes[6];
+	float			projscale;		// proj._11 * proj._22 of the last incremental rebuild
+	int				numevaluated;	// coverage evaluations in the last rebuild
 	Node		root;
 	int			numlods;		// number of LOD levels
 	int			meshdim;		// patch mesh resolution
@@ -36,12 +69,17 @@ private:
 	float		maxcoverage;	// any node larger than this will be subdivided
 	float		screenarea;
 
-	float CalculateCoverage(const Node& node, const Math::Matrix& proj, const Math::Vector3& eye) const;
-	bool IsVisible(const Node& node, const Math::Matrix& viewproj) const;
+	float CalculateCoverage(const Node& node, const Math::Matrix& proj, const Math::Vector3& eye, float* outmindist = nullptr) const;
+	int IsVisible(const Node& node) const;
+	int CalculateLOD(float coverage, float threshold) const;
 	void InternalTraverse(const Node& node, NodeCallback callback) const;
 
 	int FindLeaf(const Math::Vector2& point) const;
-	int BuildTree(Node& node, const Math::Matrix& viewproj, const Math::Matrix& proj, const Math::Vector3& eye);
+	int BuildTree(Node& node, const Math::Matrix& proj, const Math::Vector3& eye);
+	int UpdateTree(int index, const Math::Matrix& proj, const Math::Vector3& eye, bool inside);
+	int AllocateChildren(const Node& parent);
+	void BuildPatches();
+	void ReleaseChildren(int index);
 
 public:
 	TerrainQuadTree();
@@ -49,7 +87,11 @@ public:
 	void FindSubsetPattern(int outindices[4], const Node& node);
 	void Initialize(const Math::Vector2& start, float size, int lodcount, int meshsize, float patchsize, float maxgridcoverage, float screensize);
 	void Rebuild(const Math::Matrix& viewproj, const Math::Matrix& proj, const Math::Vector3& eye);
+	void RebuildIncremental(const Math::Matrix& viewproj, const Math::Matrix& proj, const Math::Vector3& eye);
 	void Traverse(NodeCallback callback) const;
+
+	inline const PatchList& GetPatches() const	{ return patches; }
+	inline int GetNumEvaluatedNodes() const		{ return numevaluated; }
 };
 
 #endif
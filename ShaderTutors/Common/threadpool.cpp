@@ -0,0 +1,107 @@
+
+#include <algorithm>
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(uint32_t numthreads)
+{
+	callback	= nullptr;
+	count		= 0;
+	grain		= 1;
+	generation	= 0;
+	numbusy		= 0;
+	exiting		= false;
+
+	if (numthreads == 0)
+		numthreads = std::max<uint32_t>(std::thread::hardware_concurrency(), 1);
+
+	// the caller is thread 0
+	for (uint32_t i = 1; i < numthreads; ++i)
+		workers.push_back(std::thread(&ThreadPool::Run, this, i));
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::unique_lock<std::mutex> guard(lock);
+
+		exiting = true;
+		started.notify_all();
+	}
+
+	for (size_t i = 0; i < workers.size(); ++i)
+		workers[i].join();
+}
+
+void ThreadPool::Run(uint32_t index)
+{
+	uint32_t seen = 0;
+
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> guard(lock);
+
+			started.wait(guard, [&] {
+				return (exiting || generation != seen);
+			});
+
+			if (exiting)
+				break;
+
+			seen = generation;
+		}
+
+		Execute(index);
+
+		{
+			std::unique_lock<std::mutex> guard(lock);
+
+			if (--numbusy == 0)
+				finished.notify_one();
+		}
+	}
+}
+
+void ThreadPool::Execute(uint32_t index)
+{
+	uint32_t begin;
+
+	while ((begin = next.fetch_add(grain)) < count)
+		(*callback)(begin, std::min(begin + grain, count), index);
+}
+
+void ThreadPool::ParallelFor(uint32_t count, uint32_t grain, const RangeCallback& callback)
+{
+	if (count == 0)
+		return;
+
+	grain = std::max<uint32_t>(grain, 1);
+
+	if (workers.size() == 0 || count <= grain) {
+		callback(0, count, 0);
+		return;
+	}
+
+	{
+		std::unique_lock<std::mutex> guard(lock);
+
+		this->callback	= &callback;
+		this->count		= count;
+		this->grain		= grain;
+
+		next = 0;
+		numbusy = (uint32_t)workers.size();
+
+		++generation;
+		started.notify_all();
+	}
+
+	Execute(0);
+
+	std::unique_lock<std::mutex> guard(lock);
+
+	finished.wait(guard, [&] {
+		return (numbusy == 0);
+	});
+
+	this->callback = nullptr;
+}
@@ -0,0 +1,48 @@
+
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+/**
+ * \brief Fixed set of worker threads for data parallel loops
+ *
+ * The calling thread participates in the work. Not reentrant.
+ */
+class ThreadPool
+{
+public:
+	typedef std::function<void (uint32_t, uint32_t, uint32_t)> RangeCallback;	// begin, end, thread index
+
+private:
+	std::vector<std::thread>	workers;
+	std::mutex					lock;
+	std::condition_variable		started;
+	std::condition_variable		finished;
+	std::atomic<uint32_t>		next;
+
+	const RangeCallback*		callback;
+	uint32_t					count;
+	uint32_t					grain;
+	uint32_t					generation;
+	uint32_t					numbusy;
+	bool						exiting;
+
+	void Run(uint32_t index);
+	void Execute(uint32_t index);
+
+public:
+	ThreadPool(uint32_t numthreads = 0);	// 0 means one per core
+	~ThreadPool();
+
+	void ParallelFor(uint32_t count, uint32_t grain, const RangeCallback& callback);
+
+	inline uint32_t GetNumThreads() const	{ return (uint32_t)workers.size() + 1; }
+};
+
+#endif
@@ -0,0 +1,435 @@
+
+#include <cstring>
+
+#include "visibilityservice.h"
+#include "threadpool.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#	include <emmintrin.h>
+#	define VISIBILITYSERVICE_SSE2
+#endif
+
+#define BLOCK_SIZE			8
+#define BLOCK_SHIFT			3
+#define BLOCKS_PER_JOB		1024	// 8192 objects
+#define SLOT_BITS			24
+#define SLOT_MASK			((1 << SLOT_BITS) - 1)
+
+static void ParallelRange(ThreadPool* pool, uint32_t count, uint32_t grain, const ThreadPool::RangeCallback& callback)
+{
+	if (pool != nullptr)
+		pool->ParallelFor(count, grain, callback);
+	else if (count > 0)
+		callback(0, count, 0);
+}
+
+static inline uint32_t CountBits(uint32_t mask)
+{
+	// 8 bits
+	mask = mask - ((mask >> 1) & 0x55);
+	mask = (mask & 0x33) + ((mask >> 2) & 0x33);
+
+	return ((mask + (mask >> 4)) & 0x0f);
+}
+
+#ifdef VISIBILITYSERVICE_SSE2
+static inline __m128 PlaneDistance(const float* p, __m128 x, __m128 y, __m128 z)
+{
+	return _mm_add_ps(
+		_mm_add_ps(_mm_mul_ps(x, _mm_loadu_ps(p)), _mm_mul_ps(y, _mm_loadu_ps(p + 4))),
+		_mm_add_ps(_mm_mul_ps(z, _mm_loadu_ps(p + 8)), _mm_loadu_ps(p + 12)));
+}
+
+static inline __m128 ProjectedRadius(const float* n, __m128 x, __m128 y, __m128 z)
+{
+	return _mm_add_ps(
+		_mm_add_ps(_mm_mul_ps(x, _mm_loadu_ps(n)), _mm_mul_ps(y, _mm_loadu_ps(n + 4))),
+		_mm_mul_ps(z, _mm_loadu_ps(n + 8)));
+}
+#endif
+
+// --- VisibilityService impl -------------------------------------------------
+
+VisibilityService::VisibilityService()
+{
+	workers		= nullptr;
+	numobjects	= 0;
+	numqueries	= 0;
+}
+
+VisibilityService::~VisibilityService()
+{
+}
+
+uint32_t VisibilityService::GetIndex(VisibilityHandle handle) const
+{
+	uint32_t slot = (handle & SLOT_MASK);
+
+	if (handle == VISIBILITY_INVALID_HANDLE || slot >= slots.size() || slots[slot].generation != (handle >> SLOT_BITS))
+		return UINT32_MAX;
+
+	return slots[slot].index;
+}
+
+void VisibilityService::WriteBounds(uint32_t index, const Math::AABox& box, uint32_t mask)
+{
+	BoundsBlock& block = blocks[index >> BLOCK_SHIFT];
+	uint32_t lane = (index & (BLOCK_SIZE - 1));
+
+	Math::Vector3 center, halfsize;
+
+	// empty boxes are never visible (negative size marks them for SetLayers)
+	if (box.Min.x > box.Max.x) {
+		center = Math::Vector3(0, 0, 0);
+		halfsize = Math::Vector3(-1, -1, -1);
+		mask = 0;
+	} else {
+		box.GetCenter(center);
+		box.GetHalfSize(halfsize);
+	}
+
+	for (int i = 0; i < 3; ++i) {
+		block.centers[i][lane] = center[i];
+		block.halfsizes[i][lane] = halfsize[i];
+	}
+
+	block.masks[lane] = mask;
+}
+
+void VisibilityService::CopyBounds(uint32_t dstindex, uint32_t srcindex)
+{
+	BoundsBlock& dst = blocks[dstindex >> BLOCK_SHIFT];
+	const BoundsBlock& src = blocks[srcindex >> BLOCK_SHIFT];
+
+	uint32_t dstlane = (dstindex & (BLOCK_SIZE - 1));
+	uint32_t srclane = (srcindex & (BLOCK_SIZE - 1));
+
+	for (int i = 0; i < 3; ++i) {
+		dst.centers[i][dstlane] = src.centers[i][srclane];
+		dst.halfsizes[i][dstlane] = src.halfsizes[i][srclane];
+	}
+
+	dst.masks[dstlane] = src.masks[srclane];
+}
+
+VisibilityHandle VisibilityService::Register(const Math::AABox& box, uint32_t userindex, uint32_t mask)
+{
+	uint32_t slot;
+
+	if (freeslots.empty()) {
+		if (slots.size() >= SLOT_MASK)
+			return VISIBILITY_INVALID_HANDLE;
+
+		slot = (uint32_t)slots.size();
+		slots.push_back({ 0, 0 });
+	} else {
+		slot = freeslots.back();
+		freeslots.pop_back();
+	}
+
+	uint32_t index = numobjects++;
+	VisibilityHandle handle = (slots[slot].generation << SLOT_BITS) | slot;
+
+	if ((index >> BLOCK_SHIFT) >= blocks.size()) {
+		blocks.emplace_back();
+		memset(&blocks.back(), 0, sizeof(BoundsBlock));
+	}
+
+	slots[slot].index = index;
+
+	userindices.push_back(userindex);
+	layers.push_back(mask);
+	handles.push_back(handle);
+
+	WriteBounds(index, box, mask);
+
+	return handle;
+}
+
+void VisibilityService::Update(VisibilityHandle handle, const Math::AABox& box)
+{
+	uint32_t index = GetIndex(handle);
+
+	if (index != UINT32_MAX)
+		WriteBounds(index, box, layers[index]);
+}
+
+void VisibilityService::SetLayers(VisibilityHandle handle, uint32_t mask)
+{
+	uint32_t index = GetIndex(handle);
+
+	if (index == UINT32_MAX)
+		return;
+
+	BoundsBlock& block = blocks[index >> BLOCK_SHIFT];
+	uint32_t lane = (index & (BLOCK_SIZE - 1));
+
+	if (block.halfsizes[0][lane] >= 0)
+		block.masks[lane] = mask;
+
+	layers[index] = mask;
+}
+
+void VisibilityService::Unregister(VisibilityHandle handle)
+{
+	uint32_t index = GetIndex(handle);
+
+	if (index == UINT32_MAX)
+		return;
+
+	uint32_t slot = (handle & SLOT_MASK);
+	uint32_t last = numobjects - 1;
+
+	// move the last object into the hole
+	if (index != last) {
+		CopyBounds(index, last);
+
+		userindices[index] = userindices[last];
+		layers[index] = layers[last];
+		handles[index] = handles[last];
+
+		slots[handles[index] & SLOT_MASK].index = index;
+	}
+
+	blocks[last >> BLOCK_SHIFT].masks[last & (BLOCK_SIZE - 1)] = 0;
+
+	userindices.pop_back();
+	layers.pop_back();
+	handles.pop_back();
+
+	if ((last & (BLOCK_SIZE - 1)) == 0)
+		blocks.pop_back();
+
+	--numobjects;
+
+	slots[slot].generation = (slots[slot].generation + 1) & (UINT32_MAX >> SLOT_BITS);
+	freeslots.push_back(slot);
+}
+
+void VisibilityService::Clear()
+{
+	for (uint32_t i = 0; i < numobjects; ++i) {
+		uint32_t slot = (handles[i] & SLOT_MASK);
+
+		slots[slot].generation = (slots[slot].generation + 1) & (UINT32_MAX >> SLOT_BITS);
+		freeslots.push_back(slot);
+	}
+
+	blocks.clear();
+	userindices.clear();
+	layers.clear();
+	handles.clear();
+
+	numobjects = 0;
+}
+
+bool VisibilityService::IsValid(VisibilityHandle handle) const
+{
+	return (GetIndex(handle) != UINT32_MAX);
+}
+
+void VisibilityService::BeginQueries()
+{
+	numqueries = 0;
+}
+
+uint32_t VisibilityService::AddQuery(const Math::Vector4 planes[6], uint32_t mask)
+{
+	if (numqueries >= queries.size()) {
+		queries.emplace_back();
+		results.emplace_back();
+	}
+
+	QueryPlanes& query = queries[numqueries];
+
+	for (int i = 0; i < 6; ++i) {
+		for (int j = 0; j < 4; ++j) {
+			for (int k = 0; k < 4; ++k)
+				query.planes[i][j][k] = planes[i][j];
+		}
+
+		for (int j = 0; j < 3; ++j) {
+			for (int k = 0; k < 4; ++k)
+				query.negabsnormals[i][j][k] = -fabs(planes[i][j]);
+		}
+	}
+
+	for (int k = 0; k < 4; ++k)
+		query.masks[k] = mask;
+	return numqueries++;
+}
+
+uint32_t VisibilityService::AddFrustumQuery(const Math::Matrix& viewproj, uint32_t mask)
+{
+	Math::Vector4 planes[6];
+
+	Math::FrustumPlanes(planes, viewproj);
+	return AddQuery(planes, mask);
+}
+
+uint32_t VisibilityService::AddFrustumQuery(const Math::Vector4 frustum[6], uint32_t mask)
+{
+	return AddQuery(frustum, mask);
+}
+
+uint32_t VisibilityService::AddBoxQuery(const Math::AABox& box, uint32_t mask)
+{
+	// NOTE: exact box-box overlap with the frustum test
+	Math::Vector4 planes[6] = {
+		{ 1, 0, 0, -box.Min.x },
+		{ -1, 0, 0, box.Max.x },
+		{ 0, 1, 0, -box.Min.y },
+		{ 0, -1, 0, box.Max.y },
+		{ 0, 0, 1, -box.Min.z },
+		{ 0, 0, -1, box.Max.z }
+	};
+
+	return AddQuery(planes, mask);
+}
+
+void VisibilityService::TestBlocks(uint32_t job, uint32_t begin, uint32_t end)
+{
+	uint32_t numblocks = (uint32_t)blocks.size();
+	uint32_t numjobs = (numblocks + BLOCKS_PER_JOB - 1) / BLOCKS_PER_JOB;
+
+	for (uint32_t q = 0; q < numqueries; ++q)
+		jobcounts[q * numjobs + job] = 0;
+
+	for (uint32_t b = begin; b < end; ++b) {
+		const BoundsBlock& block = blocks[b];
+
+#ifdef VISIBILITYSERVICE_SSE2
+		// load the block once for all queries (two halves of 4)
+		__m128 cx1 = _mm_loadu_ps(block.centers[0]);
+		__m128 cy1 = _mm_loadu_ps(block.centers[1]);
+		__m128 cz1 = _mm_loadu_ps(block.centers[2]);
+		__m128 cx2 = _mm_loadu_ps(block.centers[0] + 4);
+		__m128 cy2 = _mm_loadu_ps(block.centers[1] + 4);
+		__m128 cz2 = _mm_loadu_ps(block.centers[2] + 4);
+
+		__m128 hx1 = _mm_loadu_ps(block.halfsizes[0]);
+		__m128 hy1 = _mm_loadu_ps(block.halfsizes[1]);
+		__m128 hz1 = _mm_loadu_ps(block.halfsizes[2]);
+		__m128 hx2 = _mm_loadu_ps(block.halfsizes[0] + 4);
+		__m128 hy2 = _mm_loadu_ps(block.halfsizes[1] + 4);
+		__m128 hz2 = _mm_loadu_ps(block.halfsizes[2] + 4);
+
+		__m128i masks1 = _mm_loadu_si128((const __m128i*)block.masks);
+		__m128i masks2 = _mm_loadu_si128((const __m128i*)(block.masks + 4));
+#endif
+
+		for (uint32_t q = 0; q < numqueries; ++q) {
+			const QueryPlanes& query = queries[q];
+			uint32_t visiblemask = 0;
+
+#ifdef VISIBILITYSERVICE_SSE2
+			// same test as Math::FrustumIntersect
+			__m128i querymask = _mm_loadu_si128((const __m128i*)query.masks);
+
+			__m128 outside1 = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(masks1, querymask), _mm_setzero_si128()));
+			__m128 outside2 = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(masks2, querymask), _mm_setzero_si128()));
+
+			for (int i = 0; i < 6; ++i) {
+				const float* p = query.planes[i][0];
+				const float* n = query.negabsnormals[i][0];
+
+				outside1 = _mm_or_ps(outside1, _mm_cmplt_ps(PlaneDistance(p, cx1, cy1, cz1), ProjectedRadius(n, hx1, hy1, hz1)));
+				outside2 = _mm_or_ps(outside2, _mm_cmplt_ps(PlaneDistance(p, cx2, cy2, cz2), ProjectedRadius(n, hx2, hy2, hz2)));
+
+				// NOTE: most boxes are rejected by the first few planes
+				if (_mm_movemask_ps(_mm_and_ps(outside1, outside2)) == 0xf)
+					break;
+			}
+
+			visiblemask = (~(_mm_movemask_ps(outside1) | (_mm_movemask_ps(outside2) << 4)) & 0xff);
+#else
+			for (uint32_t lane = 0; lane < BLOCK_SIZE; ++lane) {
+				bool visible = ((block.masks[lane] & query.masks[0]) != 0);
+
+				for (int i = 0; visible && i < 6; ++i) {
+					const float (*p)[4] = query.planes[i];
+					const float (*n)[4] = query.negabsnormals[i];
+
+					float dist = block.centers[0][lane] * p[0][0] + block.centers[1][lane] * p[1][0] + block.centers[2][lane] * p[2][0] + p[3][0];
+					float negmaxdist = block.halfsizes[0][lane] * n[0][0] + block.halfsizes[1][lane] * n[1][0] + block.halfsizes[2][lane] * n[2][0];
+
+					visible = !(dist < negmaxdist);
+				}
+
+				visiblemask |= ((visible ? 1 : 0) << lane);
+			}
+#endif
+
+			blockmasks[(size_t)q * numblocks + b] = (uint8_t)visiblemask;
+			jobcounts[q * numjobs + job] += CountBits(visiblemask);
+		}
+	}
+}
+
+void VisibilityService::CompactBlocks(uint32_t job, uint32_t begin, uint32_t end, const uint32_t* offsets)
+{
+	uint32_t numblocks = (uint32_t)blocks.size();
+	uint32_t numjobs = (numblocks + BLOCKS_PER_JOB - 1) / BLOCKS_PER_JOB;
+
+	for (uint32_t q = 0; q < numqueries; ++q) {
+		const uint8_t* masks = blockmasks.data() + (size_t)q * numblocks;
+		uint32_t* out = results[q].data() + offsets[q * numjobs + job];
+
+		for (uint32_t b = begin; b < end; ++b) {
+			uint32_t mask = masks[b];
+
+			if (mask == 0)
+				continue;
+
+			const uint32_t* indices = userindices.data() + b * BLOCK_SIZE;
+
+			for (uint32_t lane = 0; lane < BLOCK_SIZE; ++lane) {
+				if (mask & (1 << lane))
+					*out++ = indices[lane];
+			}
+		}
+	}
+}
+
+void VisibilityService::Cull()
+{
+	uint32_t numblocks = (uint32_t)blocks.size();
+	uint32_t numjobs = (numblocks + BLOCKS_PER_JOB - 1) / BLOCKS_PER_JOB;
+
+	for (uint32_t q = 0; q < numqueries; ++q)
+		results[q].clear();
+
+	if (numblocks == 0 || numqueries == 0)
+		return;
+
+	blockmasks.resize((size_t)numqueries * numblocks);
+	jobcounts.resize(numqueries * numjobs);
+
+	// pass 1: test every block against every query while it is in cache
+	ParallelRange(workers, numjobs, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+		for (uint32_t job = begin; job < end; ++job)
+			TestBlocks(job, job * BLOCKS_PER_JOB, Math::Min<uint32_t>((job + 1) * BLOCKS_PER_JOB, numblocks));
+	});
+
+	// pass 2: prefix sum of counts, so that jobs can write the results in order
+	uint32_t* offsets = jobcounts.data();
+
+	for (uint32_t q = 0; q < numqueries; ++q) {
+		uint32_t total = 0;
+
+		for (uint32_t job = 0; job < numjobs; ++job) {
+			uint32_t count = offsets[q * numjobs + job];
+
+			offsets[q * numjobs + job] = total;
+			total += count;
+		}
+
+		results[q].resize(total);
+	}
+
+	// pass 3: write indices
+	ParallelRange(workers, numjobs, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+		for (uint32_t job = begin; job < end; ++job)
+			CompactBlocks(job, job * BLOCKS_PER_JOB, Math::Min<uint32_t>((job + 1) * BLOCKS_PER_JOB, numblocks), offsets);
+	});
+}
@@ -0,0 +1,108 @@
+
+#ifndef _VISIBILITYSERVICE_H_
+#define _VISIBILITYSERVICE_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "3Dmath.h"
+
+#define VISIBILITY_INVALID_HANDLE	UINT32_MAX
+#define VISIBILITY_ALL_LAYERS		UINT32_MAX
+
+class ThreadPool;
+
+typedef uint32_t VisibilityHandle;
+
+/**
+ * \brief Culls registered boxes against a batch of convex volumes in one pass
+ *
+ * Objects register their world space bounds once and get a handle. The bounds are
+ * stored in blocks of 8 (SoA), and each block is loaded once per Cull and tested
+ * against every query (camera, shadow cascades, light volumes). Objects and queries
+ * have layer masks, and a query only sees objects that share a layer with it.
+ *
+ * Results are compact lists of the user indices given to Register, in storage order
+ * (which is deterministic, but changes when objects are unregistered). Unlike
+ * FrustumCuller, there is no hierarchy, so bounds can change every frame.
+ */
+class VisibilityService
+{
+public:
+	typedef std::vector<uint32_t> IndexList;
+
+private:
+	struct BoundsBlock
+	{
+		float		centers[3][8];
+		float		halfsizes[3][8];
+		uint32_t	masks[8];		// 0 for empty boxes and unused lanes
+	};
+
+	struct QueryPlanes
+	{
+		// every value is repeated 4 times for SIMD
+		float		planes[6][4][4];
+		float		negabsnormals[6][3][4];
+		uint32_t	masks[4];
+	};
+
+	struct Slot
+	{
+		uint32_t	index;			// position in storage
+		uint32_t	generation;
+	};
+
+private:
+	std::vector<BoundsBlock>	blocks;
+	std::vector<uint32_t>		userindices;	// per object in storage
+	std::vector<uint32_t>		layers;			// as given to Register (masks are 0 for empty boxes)
+	std::vector<uint32_t>		handles;		// storage -> handle
+	std::vector<Slot>			slots;
+	std::vector<uint32_t>		freeslots;
+	std::vector<QueryPlanes>	queries;
+	std::vector<IndexList>		results;
+	std::vector<uint8_t>		blockmasks;		// per query and block
+	std::vector<uint32_t>		jobcounts;		// per query and job
+	ThreadPool*					workers;
+	uint32_t					numobjects;
+	uint32_t					numqueries;
+
+	void WriteBounds(uint32_t index, const Math::AABox& box, uint32_t mask);
+	void CopyBounds(uint32_t dstindex, uint32_t srcindex);
+	void TestBlocks(uint32_t job, uint32_t begin, uint32_t end);
+	void CompactBlocks(uint32_t job, uint32_t begin, uint32_t end, const uint32_t* offsets);
+
+	uint32_t AddQuery(const Math::Vector4 planes[6], uint32_t mask);
+	uint32_t GetIndex(VisibilityHandle handle) const;
+
+public:
+	VisibilityService();
+	~VisibilityService();
+
+	VisibilityHandle Register(const Math::AABox& box, uint32_t userindex, uint32_t mask = VISIBILITY_ALL_LAYERS);
+
+	void Update(VisibilityHandle handle, const Math::AABox& box);
+	void SetLayers(VisibilityHandle handle, uint32_t mask);
+	void Unregister(VisibilityHandle handle);
+	void Clear();
+
+	// NOTE: queries are valid until the next BeginQueries, results until the next Cull
+	void BeginQueries();
+
+	uint32_t AddFrustumQuery(const Math::Matrix& viewproj, uint32_t mask = VISIBILITY_ALL_LAYERS);
+	uint32_t AddFrustumQuery(const Math::Vector4 frustum[6], uint32_t mask = VISIBILITY_ALL_LAYERS);
+	uint32_t AddBoxQuery(const Math::AABox& box, uint32_t mask = VISIBILITY_ALL_LAYERS);
+
+	void Cull();
+
+	bool IsValid(VisibilityHandle handle) const;
+
+	inline void SetThreadPool(ThreadPool* pool)					{ workers = pool; }
+
+	inline const IndexList& GetVisible(uint32_t query) const	{ return results[query]; }
+	inline uint32_t GetNumObjects() const						{ return numobjects; }
+	inline uint32_t GetNumQueries() const						{ return numqueries; }
+};
+
+#endif
@@ -3,6 +3,7 @@
 #include "3Dmath.h"
 #include "geometryutils.h"
 #include "dds.h"
+#include "profiler.h"
 
 #include <GlslangToSpv.h>
 
@@ -1099,6 +1100,8 @@ VulkanImage* VulkanImage::CreateFromFile(const char* file, bool srgb)
 
 VulkanImage* VulkanImage::CreateFromDDS(const char* file, bool srgb)
 {
+	PROFILE_SCOPE("VulkanImage::CreateFromDDS");
+
 	VulkanImage* ret = VulkanContentManager().PointerImage(file);
 
 	if (ret != nullptr) {
@@ -1731,6 +1734,8 @@ void* VulkanMesh::GetUniformBufferPointer()
 
 VulkanMesh* VulkanMesh::LoadFromQM(const char* file, VulkanBuffer* buffer, VkDeviceSize offset)
 {
+	PROFILE_SCOPE("VulkanMesh::LoadFromQM");
+
 	static const uint16_t elemsizes[] = {
 		1,	// float
 		2,	// float2
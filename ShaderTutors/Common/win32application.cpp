@@ -1,5 +1,6 @@
 
 #include "win32application.h"
+#include "profiler.h"
 
 #ifdef OPENGL
 #	include "glextensions.h"
@@ -1371,12 +1372,21 @@ void Win32Application::Run()
 
 		if (msg.message != WM_QUIT && RenderCallback != nullptr)
 			RenderCallback((float)accum / 0.0333f, (float)delta);
+
+		PROFILE_COLLECT();
 	}
 
 	if (UninitSceneCallback != nullptr)
 		UninitSceneCallback();
 
 	DestroyDriverInterface();
+
+#ifdef ENABLE_PROFILER
+	const char* tracefile = getenv("PROFILER_TRACE");
+
+	if (tracefile != nullptr)
+		PROFILE_WRITE_TRACE(tracefile);
+#endif
 }
 
 void Win32Application::SetTitle(const char* title)
@@ -0,0 +1,142 @@
+
+#ifndef _WORKSTEALINGQUEUE_HPP_
+#define _WORKSTEALINGQUEUE_HPP_
+
+#include <atomic>
+#include <cstdint>
+
+/**
+ * \brief Bounded Chase-Lev deque
+ *
+ * The owner thread pushes and pops at the bottom (LIFO), other threads steal from the
+ * top (FIFO). Only the last element and steals need a CAS. The memory orders follow
+ * Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models" (2013).
+ *
+ * The ring doesn't grow; Push fails when it's full, so the caller can run the element
+ * itself. Elements must be trivially copyable (they are read before the CAS).
+ */
+template <typename value_type>
+class WorkStealingQueue
+{
+private:
+	std::atomic<value_type>*	elements;
+	int64_t						capacity;
+	int64_t						mask;
+
+	// NOTE: padded to keep the owner and thieves on separate cache lines
+	uint8_t						padding0[64];
+	std::atomic<int64_t>		top;		// thieves
+	uint8_t						padding1[64];
+	std::atomic<int64_t>		bottom;		// owner
+	uint8_t						padding2[64];
+
+public:
+	WorkStealingQueue(uint32_t size = 4096);	// rounded up to power of 2
+	~WorkStealingQueue();
+
+	WorkStealingQueue(const WorkStealingQueue&) = delete;
+	WorkStealingQueue& operator =(const WorkStealingQueue&) = delete;
+
+	// owner thread only
+	bool Push(const value_type& value);
+	bool Pop(value_type& out);
+
+	// any thread
+	bool Steal(value_type& out);
+
+	inline bool IsEmpty() const			{ return (bottom.load(std::memory_order_relaxed) <= top.load(std::memory_order_relaxed)); }
+	inline uint32_t GetCapacity() const	{ return (uint32_t)capacity; }
+};
+
+template <typename value_type>
+WorkStealingQueue<value_type>::WorkStealingQueue(uint32_t size)
+{
+	capacity = 2;
+
+	while (capacity < size)
+		capacity <<= 1;
+
+	mask = capacity - 1;
+	elements = new std::atomic<value_type>[capacity];
+
+	top.store(0, std::memory_order_relaxed);
+	bottom.store(0, std::memory_order_relaxed);
+}
+
+template <typename value_type>
+WorkStealingQueue<value_type>::~WorkStealingQueue()
+{
+	delete[] elements;
+}
+
+template <typename value_type>
+bool WorkStealingQueue<value_type>::Push(const value_type& value)
+{
+	int64_t b = bottom.load(std::memory_order_relaxed);
+	int64_t t = top.load(std::memory_order_acquire);
+
+	if (b - t >= capacity)
+		return false;
+
+	elements[b & mask].store(value, std::memory_order_relaxed);
+
+	// publish the element before the new bottom
+	std::atomic_thread_fence(std::memory_order_release);
+	bottom.store(b + 1, std::memory_order_relaxed);
+
+	return true;
+}
+
+template <typename value_type>
+bool WorkStealingQueue<value_type>::Pop(value_type& out)
+{
+	int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+
+	bottom.store(b, std::memory_order_relaxed);
+
+	// pairs with the fence in Steal (either the thief sees the new bottom or we see its top)
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	int64_t t = top.load(std::memory_order_relaxed);
+	bool success = true;
+
+	if (t <= b) {
+		out = elements[b & mask].load(std::memory_order_relaxed);
+
+		if (t == b) {
+			// last element, race against thieves
+			success = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+			bottom.store(b + 1, std::memory_order_relaxed);
+		}
+	} else {
+		// empty
+		success = false;
+		bottom.store(b + 1, std::memory_order_relaxed);
+	}
+
+	return success;
+}
+
+template <typename value_type>
+bool WorkStealingQueue<value_type>::Steal(value_type& out)
+{
+	int64_t t = top.load(std::memory_order_acquire);
+
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	int64_t b = bottom.load(std::memory_order_acquire);
+
+	if (t >= b)
+		return false;
+
+	// NOTE: can be overwritten by the owner after the CAS failed, then it's not used
+	value_type value = elements[t & mask].load(std::memory_order_relaxed);
+
+	if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+		return false;
+
+	out = value;
+	return true;
+}
+
+#endif
@@ -2,33 +2,41 @@
 #include "drawingitem.h"
 #include "renderingcore.h"
 
+#define PENDING_TICKET	UINT64_MAX
+
 // --- NativeContext impl -----------------------------------------------------
 
 class NativeContext::FlushPrimitivesTask : public IRenderingTask
 {
-public:
-	typedef std::vector<Math::Vector4> VertexList;
-	typedef std::vector<uint16_t> IndexList;
+	struct PrimitiveBatch
+	{
+		Math::Color	color;
+		uint32_t	firstindex;
+		uint32_t	numindices;
+	};
+
+	typedef std::vector<PrimitiveBatch> BatchList;
+	typedef std::vector<OpenGLAttributeRange> AttributeTable;
 
 private:
+	PathArena			arena;
+	BatchList			batches;
+	AttributeTable		table;
 	Math::Matrix		world;
 	Math::Color			clearcolor;
-	Math::Color			linecolor;
-	VertexList			vertices;
-	IndexList			indices;
 	OpenGLFramebuffer*	rendertarget;	// external
 	OpenGLMesh*			mesh;
-	OpenGLEffect*		lineeffect;
+	OpenGLEffect*		coloreffect;
 	bool				needsclear;
 
 	void Dispose() override
 	{
 		// NOTE: runs on renderer thread
-		SAFE_DELETE(lineeffect);
+		SAFE_DELETE(coloreffect);
 		SAFE_DELETE(mesh);
 	}
 
-	void Execute(IRenderingContext* context) override
+	void UploadPrimitives(IRenderingContext* context)
 	{
 		// NOTE: runs on renderer thread
 		OpenGLVertexElement decl[] = {
@@ -36,58 +44,100 @@ private:
 			{ 0xff, 0, 0, 0, 0 }
 		};
 
-		OpenGLAttributeRange table[] = {
-			{ GLPT_LINELIST, 0, 0, (GLuint)indices.size(), 0, (GLuint)vertices.size(), true }
-		};
+		GLuint	numvertices	= arena.GetNumVertices();
+		GLuint	numindices	= arena.GetNumIndices();
+		void*	vdata		= nullptr;
+		void*	idata		= nullptr;
 
-		float			width		= (float)rendertarget->GetWidth();
-		float			height		= (float)rendertarget->GetHeight();
-		Math::Matrix	proj;
-		Math::Vector2	thickness	= { 3.0f / width, 3.0f / height };
-		void*			vdata		= nullptr;
-		void*			idata		= nullptr;
+		if (mesh == nullptr || mesh->GetNumVertices() < numvertices || mesh->GetNumIndices() < numindices) {
+			GLuint vertexcapacity = 1024;
+			GLuint indexcapacity = 2048;
 
-		if (lineeffect == nullptr) {
-			lineeffect = context->CreateEffect(
-				"../../Media/ShadersGL/simplecolor.vert",
-				"../../Media/ShadersGL/drawlines.geom",		// NOTE: causes driver crash on Intel
-				"../../Media/ShadersGL/simplecolor.frag");
-		}
+			if (mesh != nullptr) {
+				vertexcapacity = mesh->GetNumVertices();
+				indexcapacity = mesh->GetNumIndices();
+			}
+
+			while (vertexcapacity < numvertices)
+				vertexcapacity *= 2;
+
+			while (indexcapacity < numindices)
+				indexcapacity *= 2;
 
-		if (mesh == nullptr)
-			mesh = context->CreateMesh(128, 256, GLMESH_DYNAMIC, decl);
+			SAFE_DELETE(mesh);
+			mesh = context->CreateMesh(vertexcapacity, indexcapacity, GLMESH_DYNAMIC|GLMESH_32BIT, decl);
+		}
 
-		mesh->LockVertexBuffer(0, 0, GLLOCK_DISCARD, (void**)&vdata);
-		mesh->LockIndexBuffer(0, 0, GLLOCK_DISCARD, &idata);
+		mesh->LockVertexBuffer(0, numvertices * sizeof(Math::Vector4), GLLOCK_DISCARD, (void**)&vdata);
+		mesh->LockIndexBuffer(0, numindices * sizeof(GLuint), GLLOCK_DISCARD, &idata);
 
-		memcpy(vdata, vertices.data(), vertices.size() * sizeof(Math::Vector4));
-		memcpy(idata, indices.data(), indices.size() * sizeof(GLushort));
+		memcpy(vdata, arena.GetVertices(), numvertices * sizeof(Math::Vector4));
+		memcpy(idata, arena.GetIndices(), numindices * sizeof(GLuint));
 
 		mesh->UnlockIndexBuffer();
 		mesh->UnlockVertexBuffer();
-		mesh->SetAttributeTable(table, 1);
+
+		// one subset per color
+		table.resize(batches.size());
+
+		for (size_t i = 0; i < batches.size(); ++i) {
+			OpenGLAttributeRange& subset = table[i];
+
+			subset.PrimitiveType	= GLPT_TRIANGLELIST;
+			subset.AttribId			= 0;
+			subset.IndexStart		= batches[i].firstindex;
+			subset.IndexCount		= batches[i].numindices;
+			subset.VertexStart		= 0;
+			subset.VertexCount		= numvertices;
+			subset.Enabled			= GL_TRUE;
+		}
+
+		// NOTE: SetAttributeTable allocates, so only call it when the table grows
+		if (mesh->GetNumSubsets() < (GLuint)table.size())
+			mesh->SetAttributeTable(table.data(), (GLuint)table.size());
+		else
+			memcpy(mesh->GetAttributeTable(), table.data(), table.size() * sizeof(OpenGLAttributeRange));
+	}
+
+	void Execute(IRenderingContext* context) override
+	{
+		// NOTE: runs on renderer thread
+		float			width	= (float)rendertarget->GetWidth();
+		float			height	= (float)rendertarget->GetHeight();
+		Math::Matrix	proj;
+
+		if (coloreffect == nullptr) {
+			coloreffect = context->CreateEffect(
+				"../../Media/ShadersGL/simplecolor.vert",
+				0,
+				"../../Media/ShadersGL/simplecolor.frag");
+		}
+
+		if (!batches.empty())
+			UploadPrimitives(context);
 
 		Math::MatrixOrthoOffCenterRH(proj, width * -0.5f, width * 0.5f, height * -0.5f, height * 0.5f, -1, 1);
 
-		lineeffect->SetMatrix("matWorld", world);
-		lineeffect->SetMatrix("matViewProj", proj);
-		lineeffect->SetVector("matColor", &linecolor.r);
-		lineeffect->SetVector("lineThickness", thickness);
+		coloreffect->SetMatrix("matWorld", world);
+		coloreffect->SetMatrix("matViewProj", proj);
 
 		rendertarget->Set();
 		{
 			if (needsclear)
 				context->Clear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT, clearcolor);
 
-			lineeffect->Begin();
+			coloreffect->Begin();
 			{
-				mesh->DrawSubset(0);
+				for (size_t i = 0; i < batches.size(); ++i) {
+					coloreffect->SetVector("matColor", &batches[i].color.r);
+					coloreffect->CommitChanges();
+
+					mesh->DrawSubset((GLuint)i);
+				}
 			}
-			lineeffect->End();
+			coloreffect->End();
 		}
 		rendertarget->Unset();
-
-		needsclear = false;
 	}
 
 public:
@@ -96,34 +146,55 @@ public:
 	{
 		// NOTE: runs on any other thread
 		rendertarget	= framebuffer;
-		lineeffect		= nullptr;
+		coloreffect		= nullptr;
 		mesh			= nullptr;
 
-		clearcolor		= Math::Color(1, 1, 1, 1);
-		linecolor		= Math::Color(1, 1, 1, 1);
-		needsclear		= false;
-
-		Math::MatrixIdentity(world);
+		Reset();
 	}
 
-	void SetNeedsClear(const Math::Color& color)
+	void Reset()
 	{
-		// NOTE: runs on any other thread
-		needsclear = true;
-		clearcolor = color;
+		// NOTE: runs on any other thread (when not in the queue)
+		arena.Reset();
+		batches.clear();
+
+		clearcolor = Math::Color(1, 1, 1, 1);
+		needsclear = false;
+
+		Math::MatrixIdentity(world);
 	}
 
-	void SetData(const VertexList& verts, const IndexList& inds)
+	void AddPrimitives(const Math::Color& color, uint32_t firstindex)
 	{
 		// NOTE: runs on any other thread
-		vertices = verts;
-		indices = inds;
+		uint32_t lastindex = arena.GetNumIndices();
+
+		if (lastindex == firstindex)
+			return;
+
+		if (!batches.empty()) {
+			PrimitiveBatch& last = batches.back();
+
+			if (last.firstindex + last.numindices == firstindex && memcmp(&last.color, &color, sizeof(Math::Color)) == 0) {
+				last.numindices += (lastindex - firstindex);
+				return;
+			}
+		}
+
+		PrimitiveBatch batch;
+
+		batch.color			= color;
+		batch.firstindex	= firstindex;
+		batch.numindices	= lastindex - firstindex;
+
+		batches.push_back(batch);
 	}
 
-	void SetLineColor(const Math::Color& color)
+	void SetNeedsClear(const Math::Color& color)
 	{
 		// NOTE: runs on any other thread
-		linecolor = color;
+		needsclear = true;
+		clearcolor = color;
 	}
 
 	void SetWorldMatrix(const Math::Matrix& matrix)
@@ -131,6 +202,8 @@ public:
 		// NOTE: runs on any other thread
 		world = matrix;
 	}
+
+	inline PathArena& GetArena()	{ return arena; }
 };
 
 NativeContext::NativeContext()
@@ -154,10 +227,13 @@ NativeContext::NativeContext(DrawingItem* item, DrawingLayer* layer)
 	owneritem = item;
 	ownerlayer = layer;
 
-	flushtask = new FlushPrimitivesTask(item->GetOpenGLUniverseID(), layer->GetRenderTarget());
+	flushtask = layer->AcquireFlushTask();
+	color = Math::Color(1, 1, 1, 1);
 
-	vertices.reserve(128);
-	indices.reserve(256);
+	// NOTE: matches the previous geometry shader lines
+	strokestyle.width = 3.0f;
+
+	layer->tessellator.BeginPath();
 }
 
 NativeContext::~NativeContext()
@@ -171,15 +247,12 @@ NativeContext::~NativeContext()
 void NativeContext::FlushPrimitives()
 {
 	if (flushtask != nullptr) {
-		flushtask->SetData(vertices, indices);
-		flushtask->MarkForDispose();
+		// unpainted path
+		Stroke();
 
-		GetRenderingCore()->AddTask(flushtask);
+		ownerlayer->ReleaseFlushTask(flushtask);
 		flushtask = nullptr;
 	}
-
-	vertices.clear();
-	indices.clear();
 }
 
 void NativeContext::Clear(const Math::Color& color)
@@ -190,31 +263,80 @@ void NativeContext::Clear(const Math::Color& color)
 
 void NativeContext::SetColor(const Math::Color& color)
 {
-	if (flushtask != nullptr)
-		flushtask->SetLineColor(color);
+	this->color = color;
 }
 
-void NativeContext::MoveTo(float x, float y)
+void NativeContext::SetLineWidth(float width)
 {
-	if ((indices.size() > 0 && vertices.size() + 1 > indices.size()) ||
-		(indices.size() == 0 && vertices.size() == 1))
-	{
-		// detected 2 MoveTo()s in a row
-		vertices.pop_back();
-	}
+	strokestyle.width = width;
+}
+
+void NativeContext::SetLineJoin(LineJoinType join)
+{
+	strokestyle.join = join;
+}
 
-	vertices.push_back(Math::Vector4(x, y, 0, 1));
+void NativeContext::SetLineCap(LineCapType cap)
+{
+	strokestyle.cap = cap;
+}
+
+void NativeContext::MoveTo(float x, float y)
+{
+	if (ownerlayer != nullptr)
+		ownerlayer->tessellator.MoveTo(x, y);
 }
 
 void NativeContext::LineTo(float x, float y)
 {
-	if (vertices.size() == 0)
-		vertices.push_back(Math::Vector4(0, 0, 0, 1));
+	if (ownerlayer != nullptr)
+		ownerlayer->tessellator.LineTo(x, y);
+}
 
-	indices.push_back((uint16_t)vertices.size() - 1);
-	indices.push_back((uint16_t)vertices.size());
+void NativeContext::QuadTo(float cx, float cy, float x, float y)
+{
+	if (ownerlayer != nullptr)
+		ownerlayer->tessellator.QuadTo(cx, cy, x, y);
+}
+
+void NativeContext::CubicTo(float cx1, float cy1, float cx2, float cy2, float x, float y)
+{
+	if (ownerlayer != nullptr)
+		ownerlayer->tessellator.CubicTo(cx1, cy1, cx2, cy2, x, y);
+}
 
-	vertices.push_back(Math::Vector4(x, y, 0, 1));
+void NativeContext::ClosePath()
+{
+	if (ownerlayer != nullptr)
+		ownerlayer->tessellator.ClosePath();
+}
+
+void NativeContext::Stroke()
+{
+	if (flushtask == nullptr || ownerlayer->tessellator.IsEmpty())
+		return;
+
+	PathArena& arena = flushtask->GetArena();
+	uint32_t firstindex = arena.GetNumIndices();
+
+	ownerlayer->tessellator.Stroke(arena, strokestyle);
+	ownerlayer->tessellator.BeginPath();
+
+	flushtask->AddPrimitives(color, firstindex);
+}
+
+void NativeContext::Fill()
+{
+	if (flushtask == nullptr || ownerlayer->tessellator.IsEmpty())
+		return;
+
+	PathArena& arena = flushtask->GetArena();
+	uint32_t firstindex = arena.GetNumIndices();
+
+	ownerlayer->tessellator.Fill(arena);
+	ownerlayer->tessellator.BeginPath();
+
+	flushtask->AddPrimitives(color, firstindex);
 }
 
 void NativeContext::SetWorldTransform(const Math::Matrix& transform)
@@ -234,6 +356,8 @@ NativeContext& NativeContext::operator =(const NativeContext& other)
 	flushtask = other.flushtask;
 	owneritem = other.owneritem;
 	ownerlayer = other.ownerlayer;
+	strokestyle = other.strokestyle;
+	color = other.color;
 
 	other.flushtask = nullptr;
 	other.owneritem = nullptr;
@@ -285,18 +409,72 @@ DrawingLayer::DrawingLayer(int universe, uint32_t width, uint32_t height)
 	owner = nullptr;
 	setuptask = new DrawingLayerSetupTask(universe, width, height);
 	
-	GetRenderingCore()->AddTask(setuptask);
-	GetRenderingCore()->Barrier();
+	GetRenderingCore()->Wait(GetRenderingCore()->AddTask(setuptask));
+
+	for (int i = 0; i < 2; ++i) {
+		flushtasks[i] = new NativeContext::FlushPrimitivesTask(universe, setuptask->GetRenderTarget());
+		flushtickets[i] = 0;
+	}
+
+	currentflush = 0;
 }
 
 DrawingLayer::~DrawingLayer()
 {
+	// NOTE: the owner already submitted everything
+	for (int i = 0; i < 2; ++i) {
+		GetRenderingCore()->Wait(flushtickets[i]);
+
+		flushtasks[i]->MarkForDispose();
+		GetRenderingCore()->AddTask(flushtasks[i]);
+
+		flushtasks[i] = nullptr;
+	}
+
 	setuptask->MarkForDispose();
 	GetRenderingCore()->AddTask(setuptask);
 
 	setuptask = nullptr;
 }
 
+NativeContext::FlushPrimitivesTask* DrawingLayer::AcquireFlushTask()
+{
+	// NOTE: called with contextguard locked
+	NativeContext::FlushPrimitivesTask* task = flushtasks[currentflush];
+	uint64_t ticket;
+
+	{
+		std::lock_guard<std::mutex> guard(owner->pendingguard);
+		ticket = flushtickets[currentflush];
+	}
+
+	if (ticket == PENDING_TICKET) {
+		// still in the owner's list
+		owner->SubmitTasks();
+
+		std::lock_guard<std::mutex> guard(owner->pendingguard);
+		ticket = flushtickets[currentflush];
+	}
+
+	GetRenderingCore()->Wait(ticket);
+	task->Reset();
+
+	return task;
+}
+
+void DrawingLayer::ReleaseFlushTask(NativeContext::FlushPrimitivesTask* task)
+{
+	// NOTE: called with contextguard locked
+	{
+		std::lock_guard<std::mutex> guard(owner->pendingguard);
+
+		flushtickets[currentflush] = PENDING_TICKET;
+		owner->pendingtasks.push_back(task);
+	}
+
+	currentflush = 1 - currentflush;
+}
+
 OpenGLFramebuffer* DrawingLayer::GetRenderTarget() const
 {
 	return setuptask->GetRenderTarget();
@@ -381,13 +559,40 @@ DrawingItem::DrawingItem(int universe, uint32_t width, uint32_t height)
 DrawingItem::~DrawingItem()
 {
 	recomposetask->MarkForDispose();
-	GetRenderingCore()->AddTask(recomposetask);
+	SubmitTasks(recomposetask);
 
 	recomposetask = nullptr;
 }
 
+uint64_t DrawingItem::SubmitTasks(IRenderingTask* last)
+{
+	std::lock_guard<std::mutex> guard(pendingguard);
+	uint64_t ticket;
+
+	if (last != nullptr)
+		pendingtasks.push_back(last);
+
+	if (pendingtasks.empty())
+		return 0;
+
+	// NOTE: tasks complete in order, so the last ticket is good for all of them
+	ticket = GetRenderingCore()->AddTasks(pendingtasks.data(), (uint32_t)pendingtasks.size());
+	pendingtasks.clear();
+
+	DrawingLayer* layers[] = { &bottomlayer, &feedbacklayer };
+
+	for (DrawingLayer* layer : layers) {
+		for (int i = 0; i < 2; ++i) {
+			if (layer->flushtickets[i] == PENDING_TICKET)
+				layer->flushtickets[i] = ticket;
+		}
+	}
+
+	return ticket;
+}
+
 void DrawingItem::RecomposeLayers()
 {
-	GetRenderingCore()->AddTask(recomposetask);
-	GetRenderingCore()->Barrier();
+	// flushes of all layers go in the same batch
+	GetRenderingCore()->Wait(SubmitTasks(recomposetask));
 }
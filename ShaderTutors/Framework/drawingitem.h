@@ -6,15 +6,21 @@
 #include <mutex>
 
 #include "../Common/3DMath.h"
+#include "../Common/pathtessellator.h"
 
 class DrawingItem;
 class DrawingLayer;
 class OpenGLFramebuffer;
 class OpenGLScreenQuad;
+class IRenderingTask;
 
 /**
  * \brief Interface for 2D rendering
  *
+ * Paths are tessellated on the calling thread into the arena of the layer, the
+ * rendering thread only uploads and draws them. A path that wasn't stroked or
+ * filled explicitly is stroked when the context goes away.
+ *
  * Copy constructor and operator = assumes move semantic.
  */
 class NativeContext
@@ -22,16 +28,13 @@ class NativeContext
 	friend class DrawingLayer;
 	class FlushPrimitivesTask;
 
-	typedef std::vector<Math::Vector4> VertexList;
-	typedef std::vector<uint16_t> IndexList;
-
 private:
 	mutable DrawingItem*			owneritem;
 	mutable DrawingLayer*			ownerlayer;
 	mutable FlushPrimitivesTask*	flushtask;
 
-	VertexList	vertices;
-	IndexList	indices;
+	PathStrokeStyle		strokestyle;
+	Math::Color			color;
 
 	NativeContext();
 	NativeContext(DrawingItem* item, DrawingLayer* layer);
@@ -45,14 +48,26 @@ public:
 	void Clear(const Math::Color& color);
 	void MoveTo(float x, float y);
 	void LineTo(float x, float y);
+	void QuadTo(float cx, float cy, float x, float y);
+	void CubicTo(float cx1, float cy1, float cx2, float cy2, float x, float y);
+	void ClosePath();
+	void Stroke();
+	void Fill();
+
 	void SetWorldTransform(const Math::Matrix& transform);
 	void SetColor(const Math::Color& color);
+	void SetLineWidth(float width);
+	void SetLineJoin(LineJoinType join);
+	void SetLineCap(LineCapType cap);
 
 	NativeContext& operator =(const NativeContext& other);
 };
 
 /**
  * \brief One layer with attached rendertarget
+ *
+ * Has two flush tasks (with their own arenas), so a context can be filled while
+ * the rendering thread draws the previous one.
  */
 class DrawingLayer
 {
@@ -62,13 +77,20 @@ class DrawingLayer
 	class DrawingLayerSetupTask;
 
 private:
-	DrawingItem*			owner;
-	DrawingLayerSetupTask*	setuptask;
-	std::mutex				contextguard;
+	DrawingItem*						owner;
+	DrawingLayerSetupTask*				setuptask;
+	NativeContext::FlushPrimitivesTask*	flushtasks[2];
+	uint64_t							flushtickets[2];	// guarded by the owner
+	uint32_t							currentflush;
+	PathTessellator						tessellator;
+	std::mutex							contextguard;
 
 	DrawingLayer(int universe, uint32_t width, uint32_t height);
 	~DrawingLayer();
 
+	NativeContext::FlushPrimitivesTask* AcquireFlushTask();
+	void ReleaseFlushTask(NativeContext::FlushPrimitivesTask* task);
+
 public:
 	NativeContext GetContext();
 	OpenGLFramebuffer* GetRenderTarget() const;
@@ -76,17 +98,27 @@ public:
 
 /**
  * \brief Multilayered drawing sheet
+ *
+ * Flushes of all layers are collected and submitted in one batch with the next
+ * recomposition (or when a layer needs its flush task back).
  */
 class DrawingItem
 {
+	friend class DrawingLayer;
 	class RecomposeLayersTask;
 
+	typedef std::vector<IRenderingTask*> TaskList;
+
 private:
 	DrawingLayer			bottomlayer;
 	DrawingLayer			feedbacklayer;
 	RecomposeLayersTask*	recomposetask;
+	TaskList				pendingtasks;
+	std::mutex				pendingguard;
 	int						universeID;
 
+	uint64_t SubmitTasks(IRenderingTask* last = nullptr);
+
 public:
 	DrawingItem(int universe, uint32_t width, uint32_t height);
 	~DrawingItem();
@@ -1,8 +1,8 @@
 
 #include <iostream>
-#include <future>
 
 #include "renderingcore.h"
+#include "../Common/profiler.h"
 
 #define MYERROR(x)			{ std::cout << "* Error: " << x << "!\n"; }
 #define V_RETURN(r, e, x)	{ if( !(x) ) { MYERROR(e); return r; }}
@@ -450,31 +450,6 @@ OpenGLMesh* RenderingCore::PrivateInterface::CreateMesh(GLuint numvertices, GLui
 
 // --- Core internal tasks ----------------------------------------------------
 
-class BarrierTask : public IRenderingTask
-{
-private:
-	std::promise<void> promise;
-
-public:
-	BarrierTask()
-		: IRenderingTask(-3)
-	{
-	}
-
-	void Execute(IRenderingContext* context) override
-	{
-		promise.set_value();
-	}
-
-	void Dispose() override
-	{
-	}
-
-	inline std::future<void> GetFuture() {
-		return promise.get_future();
-	}
-};
-
 class UniverseCreatorTask : public IRenderingTask
 {
 	enum ContextAction
@@ -537,12 +512,19 @@ IRenderingTask::~IRenderingTask()
 
 // --- RenderingCore impl -----------------------------------------------------
 
-RenderingCore::RenderingCore()
+RenderingCore::RenderingCore(IRenderingContext* context)
+	: tasks(MAX_QUEUED_TASKS)
 {
-	if (GLExtensions::GLVersion == 0)
-		InitializeCoreProfile();
+	privinterf = nullptr;
+	headlesscontext = context;
+
+	if (headlesscontext == nullptr) {
+		if (GLExtensions::GLVersion == 0)
+			InitializeCoreProfile();
+
+		privinterf = new PrivateInterface();
+	}
 
-	privinterf = new PrivateInterface();
 	thread = std::thread(&RenderingCore::THREAD_Run, this);
 }
 
@@ -551,12 +533,22 @@ RenderingCore::~RenderingCore()
 	delete privinterf;
 }
 
+RenderingCore* RenderingCore::CreateHeadless(IRenderingContext* context)
+{
+	if (context == nullptr)
+		return nullptr;
+
+	return new RenderingCore(context);
+}
+
 int RenderingCore::CreateUniverse(HDC hdc)
 {
+	if (privinterf == nullptr)
+		return -1;
+
 	UniverseCreatorTask* creator = new UniverseCreatorTask(privinterf, hdc);
 
-	AddTask(creator);
-	Barrier();
+	Wait(AddTask(creator));
 
 	int id = creator->GetContextID();
 	delete creator;
@@ -566,26 +558,35 @@ int RenderingCore::CreateUniverse(HDC hdc)
 
 void RenderingCore::DeleteUniverse(int id)
 {
+	if (privinterf == nullptr)
+		return;
+
 	UniverseCreatorTask* deleter = new UniverseCreatorTask(privinterf, id);
 
-	AddTask(deleter);
-	Barrier();
+	Wait(AddTask(deleter));
 
 	delete deleter;
 }
 
 void RenderingCore::Barrier()
 {
-	BarrierTask* barrier = new BarrierTask();
-	std::future<void>& future = barrier->GetFuture();
+	// wait for everything that was added so far
+	tasks.Wait(tasks.GetLastTicket());
+}
 
-	AddTask(barrier);
-	future.wait();
+void RenderingCore::Wait(uint64_t ticket)
+{
+	tasks.Wait(ticket);
+}
+
+uint64_t RenderingCore::AddTask(IRenderingTask* task)
+{
+	return tasks.Push(task);
 }
 
-void RenderingCore::AddTask(IRenderingTask* task)
+uint64_t RenderingCore::AddTasks(IRenderingTask** tasklist, uint32_t count)
 {
-	tasks.Push(task);
+	return tasks.PushBatch(tasklist, count);
 }
 
 void RenderingCore::Shutdown()
@@ -593,8 +594,10 @@ void RenderingCore::Shutdown()
 	tasks.Push(nullptr);
 	thread.join();
 
-	delete _inst;
-	_inst = nullptr;
+	if (this == _inst)
+		_inst = nullptr;
+
+	delete this;
 }
 
 bool RenderingCore::InitializeCoreProfile()
@@ -657,28 +660,45 @@ bool RenderingCore::InitializeCoreProfile()
 
 void RenderingCore::THREAD_Run()
 {
-	while (true) {
-		IRenderingTask* action = tasks.Pop();
-
-		if (action == 0) {
-			// exit call
-			break;
-		} else if (action->GetUniverseID() == -3) {
-			// barrier task
-			action->Execute(nullptr);
-		} else if (action->GetUniverseID() == -2) {
-			// context creator task
-			action->Execute(privinterf);
-		} else if (privinterf->ActivateContext(action->GetUniverseID())) {
-			// rendering task
-			action->Execute(privinterf);
-		}
+	IRenderingTask* batch[MAX_TASKS_PER_POP];
+	bool running = true;
+
+	PROFILE_THREAD_NAME("RenderingCore");
+
+	while (running) {
+		uint32_t count = tasks.PopBatch(batch, MAX_TASKS_PER_POP);
+
+		PROFILE_COUNTER("RenderingCore batch size", count);
+
+		for (uint32_t i = 0; i < count; ++i) {
+			IRenderingTask* action = batch[i];
 
-		if (action->IsMarkedForDispose()) {
-			action->Dispose();
+			PROFILE_SCOPE("RenderingCore::Execute");
+
+			if (action == 0) {
+				// exit call
+				running = false;
+				break;
+			} else if (headlesscontext != nullptr) {
+				// test mode
+				action->Execute(headlesscontext);
+			} else if (action->GetUniverseID() == -2) {
+				// context creator task
+				action->Execute(privinterf);
+			} else if (privinterf->ActivateContext(action->GetUniverseID())) {
+				// rendering task
+				action->Execute(privinterf);
+			}
+
+			if (action->IsMarkedForDispose()) {
+				action->Dispose();
+
+				delete action;
+				action = nullptr;
+			}
 
-			delete action;
-			action = nullptr;
+			// NOTE: wakes up waiters of this ticket
+			tasks.Complete();
 		}
 	}
 }
@@ -5,11 +5,14 @@
 #include <thread>
 #include <atomic>
 
-#include "../Common/blockingqueue.hpp"
+#include "../Common/mpscqueue.hpp"
 #include "../Common/gl4ext.h"
 
 #define SAFE_DELETE(x)	{ if ((x)) { delete (x); (x) = 0; } }
 
+#define MAX_QUEUED_TASKS	1024
+#define MAX_TASKS_PER_POP	32
+
 class IRenderingContext;
 
 /**
@@ -77,23 +80,32 @@ class RenderingCore
 public:
 	class PrivateInterface;
 
-	void AddTask(IRenderingTask* task);
+	// returns a ticket (fence) for the task(s)
+	uint64_t AddTask(IRenderingTask* task);
+	uint64_t AddTasks(IRenderingTask** tasks, uint32_t count);
 	void Shutdown();
 
 	// these methods always block
 	int CreateUniverse(HDC hdc);
 	void DeleteUniverse(int id);
 	void Barrier();
+	void Wait(uint64_t ticket);
+
+	inline bool IsCompleted(uint64_t ticket) const	{ return tasks.IsCompleted(ticket); }
+
+	// no OpenGL: every task executes on the given context (for tests, delete with Shutdown())
+	static RenderingCore* CreateHeadless(IRenderingContext* context);
 
 private:
 	static RenderingCore* _inst;
 	static std::mutex singletonguard;
 
 	std::thread						thread;
-	BlockingQueue<IRenderingTask*>	tasks;
+	MPSCQueue<IRenderingTask*>		tasks;
 	PrivateInterface*				privinterf;
+	IRenderingContext*				headlesscontext;
 
-	RenderingCore();
+	RenderingCore(IRenderingContext* context = nullptr);
 	~RenderingCore();
 
 	bool InitializeCoreProfile();